@@ -0,0 +1,451 @@
+/*++
+
+Module Name:
+
+    BenchAsyncLog.cpp
+
+Abstract:
+
+    Checks AsyncLog and compares it against the old WriteToLogFile path on a
+    local file.
+
+    Checks (exit non-zero on failure)
+        - records from several threads all reach the file, each thread's in
+          the order it logged them, even with buffers small enough to stall
+        - a WRITTEN barrier returns only once the file holds everything
+          logged before it, SYNCED also syncs
+        - a record longer than a buffer is truncated, not dropped or split
+
+    Benchmarks, a case is the 3 records ViFuR3 logs per hypercall with a
+    barrier every VIFU_BATCH_SIZE cases, file opened write-through
+        log/write-through           - vsnprintf + write per record
+        log/async/<durability>      - AsyncLog
+    reported as records/s and p99 enqueue latency
+
+    Usage: BenchAsyncLog [directory for the scratch files, default .]
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <string>
+#include <thread>
+#include <vector>
+#include "ViFuBench.h"
+#include "../ViFuCore/AsyncLog.h"
+
+#if !defined(_WIN32)
+#include <sys/stat.h>
+#endif
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define BENCH_BATCH_CASES   64
+
+static std::string g_dir = ".";
+
+//
+// Scratch file, truncated on open, removed on close
+//
+class BenchFile
+{
+public:
+    BenchFile (
+        IN const CHAR   *name,
+        IN BOOL         writeThrough
+    )
+        : m_path(g_dir + "/" + name)
+    {
+#if defined(_WIN32)
+        m_hFile = CreateFileA(m_path.c_str(),
+                              GENERIC_WRITE,
+                              FILE_SHARE_READ,
+                              NULL,
+                              CREATE_ALWAYS,
+                              writeThrough ? FILE_FLAG_WRITE_THROUGH : 0,
+                              NULL);
+        m_sink.reset(new AsyncLogFileSink(m_hFile));
+#else
+        m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | (writeThrough ? O_DSYNC : 0), 0644);
+        m_sink.reset(new AsyncLogFileSink(m_fd));
+#endif
+    }
+
+    ~BenchFile ()
+    {
+#if defined(_WIN32)
+        CloseHandle(m_hFile);
+        DeleteFileA(m_path.c_str());
+#else
+        close(m_fd);
+        unlink(m_path.c_str());
+#endif
+    }
+
+    BOOL
+    IsOpen () const
+    {
+#if defined(_WIN32)
+        return m_hFile != INVALID_HANDLE_VALUE;
+#else
+        return m_fd >= 0;
+#endif
+    }
+
+    //
+    // What the old WriteToLogFile did
+    //
+    VOID
+    Printf (
+        IN const CHAR   *fmt,
+        IN ...
+    )
+    {
+        CHAR        buffer[4096];
+        va_list     args;
+
+        va_start(args, fmt);
+        vsnprintf(buffer, sizeof(buffer), fmt, args);
+        va_end(args);
+
+        m_sink->Write(buffer, strlen(buffer));
+    }
+
+    UINT64
+    Size () const
+    {
+#if defined(_WIN32)
+        WIN32_FILE_ATTRIBUTE_DATA attr;
+
+        if (!GetFileAttributesExA(m_path.c_str(), GetFileExInfoStandard, &attr))
+        {
+            return 0;
+        }
+        return ((UINT64)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+#else
+        struct stat st;
+
+        return stat(m_path.c_str(), &st) == 0 ? (UINT64)st.st_size : 0;
+#endif
+    }
+
+    std::string
+    Contents () const
+    {
+        std::string contents;
+        CHAR        chunk[65536];
+        FILE        *pFile = fopen(m_path.c_str(), "rb");
+        SIZE_T      n = 0;
+
+        if (pFile == NULL)
+        {
+            return contents;
+        }
+        while ((n = fread(chunk, 1, sizeof(chunk), pFile)) != 0)
+        {
+            contents.append(chunk, n);
+        }
+        fclose(pFile);
+        return contents;
+    }
+
+    AsyncLogSink *Sink () { return m_sink.get(); }
+
+private:
+    std::string                     m_path;
+    std::unique_ptr<AsyncLogSink>   m_sink;
+#if defined(_WIN32)
+    HANDLE                          m_hFile;
+#else
+    INT                             m_fd;
+#endif
+};
+
+//
+// Threads log "<thread> <seq>" lines, each thread's seq must come back in
+// order and complete
+//
+static BOOL
+CheckOrdering (
+    IN UINT32   threadCnt,
+    IN UINT32   recordsPerThread,
+    IN UINT32   bufferSize,
+    IN UINT32   bufferCount
+)
+{
+    BenchFile                   file("asynclog_order.txt", FALSE);
+    AsyncLog                    log;
+    ASYNC_LOG_CONFIG            config = ASYNC_LOG_DEFAULT_CONFIG;
+    ASYNC_LOG_STATS             stats = {};
+    std::vector<std::thread>    threads;
+    std::vector<UINT32>         next(threadCnt, 0);
+
+    CHECK(file.IsOpen());
+    config.bufferSize = bufferSize;
+    config.bufferCount = bufferCount;
+    config.flushIntervalMs = 1;
+    CHECK(log.Open(file.Sink(), config));
+
+    for (UINT32 t = 0; t < threadCnt; t++)
+    {
+        threads.emplace_back([&, t]() {
+            for (UINT32 r = 0; r < recordsPerThread; r++)
+            {
+                log.Printf("%u %u\n", t, r);
+                if ((r % 1000) == 999)
+                {
+                    log.Barrier();
+                }
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    log.Close();
+    log.GetStats(&stats);
+    CHECK(stats.recordsEnqueued == (UINT64)threadCnt * recordsPerThread);
+    CHECK(stats.bytesWritten == stats.bytesEnqueued);
+    CHECK(stats.queueDepth == 0 && stats.writeErrors == 0);
+
+    std::string contents = file.Contents();
+    CHECK(contents.size() == stats.bytesWritten);
+
+    SIZE_T pos = 0;
+    while (pos < contents.size())
+    {
+        UINT32  t = 0;
+        UINT32  r = 0;
+        SIZE_T  eol = contents.find('\n', pos);
+
+        CHECK(eol != std::string::npos);
+        CHECK(sscanf(contents.c_str() + pos, "%u %u", &t, &r) == 2);
+        CHECK(t < threadCnt && r == next[t]);
+        next[t]++;
+        pos = eol + 1;
+    }
+    for (UINT32 t = 0; t < threadCnt; t++)
+    {
+        CHECK(next[t] == recordsPerThread);
+    }
+
+    printf("[+] ordering %u threads x %u records, buffers %u x %u: %llu writes, %llu stalls\n",
+           threadCnt,
+           recordsPerThread,
+           bufferCount,
+           bufferSize,
+           (unsigned long long)stats.writes,
+           (unsigned long long)stats.stalls);
+    return TRUE;
+}
+
+static BOOL
+CheckDurability ()
+{
+    BenchFile           file("asynclog_durability.txt", FALSE);
+    AsyncLog            log;
+    ASYNC_LOG_CONFIG    config = ASYNC_LOG_DEFAULT_CONFIG;
+    ASYNC_LOG_STATS     stats = {};
+    UINT64              expected = 0;
+
+    CHECK(file.IsOpen());
+
+    //
+    // Long interval so only the barrier can have flushed
+    //
+    config.flushIntervalMs = 60000;
+    config.durability = ASYNC_LOG_DURABILITY_WRITTEN;
+    CHECK(log.Open(file.Sink(), config));
+
+    for (UINT32 round = 0; round < 50; round++)
+    {
+        for (UINT32 r = 0; r <= round; r++)
+        {
+            log.Printf("round %u record %u\n", round, r);
+        }
+        log.GetStats(&stats);
+        expected = stats.bytesEnqueued;
+
+        log.Barrier();
+        CHECK(file.Size() == expected);
+    }
+    log.GetStats(&stats);
+    CHECK(stats.syncs == 0);
+    log.Close();
+
+    //
+    // Overlong record keeps the first bufferSize - 1 bytes
+    //
+    BenchFile           longFile("asynclog_long.txt", FALSE);
+    std::string         longRecord(3000, 'x');
+
+    CHECK(longFile.IsOpen());
+    config.bufferSize = 1024;
+    config.durability = ASYNC_LOG_DURABILITY_SYNCED;
+    CHECK(log.Open(longFile.Sink(), config));
+    log.Printf("short\n");
+    log.Printf("%s", longRecord.c_str());
+    log.Printf("\nend\n");
+    log.Barrier();
+    log.GetStats(&stats);
+    CHECK(stats.syncs >= 1);
+    log.Close();
+
+    CHECK(longFile.Contents() == "short\n" + std::string(1023, 'x') + "\nend\n");
+
+    printf("[+] durability checks passed\n");
+    return TRUE;
+}
+
+//
+// One ViFuR3 case worth of records
+//
+template <typename LOG>
+static inline VOID
+LogCase (
+    IN LOG      &log,
+    IN UINT32   c
+)
+{
+    UINT64 regs = 0x0001000000000000ULL | c;
+
+    log.Printf("%x %x %x %x\r\n", c & 0xff, 0, 1, c & 0x7f);
+    log.Printf("[ ] %s [0x%llx]\r\n", "HvCallFlushVirtualAddressSpace", (unsigned long long)regs);
+    log.Printf("    rax 0x%016llx rbx 0x%016llx rcx 0x%016llx rdx 0x%016llx rsi 0x%016llx\n"
+               "    rdi 0x%016llx r8  0x%016llx r9  0x%016llx r10 0x%016llx r11 0x%016llx\n",
+               (unsigned long long)regs, 0ULL, (unsigned long long)regs, 0x1000ULL, 0ULL,
+               0ULL, 0x2000ULL, 0ULL, 0ULL, 0ULL);
+}
+
+static VOID
+BenchWriteThrough (
+    IN UINT32   cases
+)
+{
+    BenchFile           file("asynclog_bench_wt.txt", TRUE);
+    LatencyHistogram    latency;
+    BenchTimer          timer;
+
+    if (!file.IsOpen())
+    {
+        return;
+    }
+
+    //
+    // Per record timing, a case is three records
+    //
+    struct TimedFile
+    {
+        BenchFile           &file;
+        LatencyHistogram    &latency;
+
+        VOID
+        Printf (
+            IN const CHAR   *fmt,
+            IN ...
+        )
+        {
+            CHAR        buffer[4096];
+            va_list     args;
+            auto        start = std::chrono::steady_clock::now();
+
+            va_start(args, fmt);
+            vsnprintf(buffer, sizeof(buffer), fmt, args);
+            va_end(args);
+            file.Sink()->Write(buffer, strlen(buffer));
+
+            latency.Record((UINT64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start).count());
+        }
+    } timed = { file, latency };
+
+    timer.Reset();
+    for (UINT32 c = 0; c < cases; c++)
+    {
+        LogCase(timed, c);
+    }
+    double secs = timer.Seconds();
+
+    BenchReport("log/write-through", cases * 3 / secs, "records/s");
+    BenchReport("log/write-through p99", (double)latency.Percentile(99), "ns");
+}
+
+static VOID
+BenchAsync (
+    IN UINT32                   cases,
+    IN ASYNC_LOG_DURABILITY     durability
+)
+{
+    static const CHAR *s_names[] = { "none", "written", "synced" };
+    BenchFile           file("asynclog_bench_async.txt", TRUE);
+    AsyncLog            log;
+    ASYNC_LOG_CONFIG    config = ASYNC_LOG_DEFAULT_CONFIG;
+    ASYNC_LOG_STATS     stats = {};
+    BenchTimer          timer;
+    CHAR                name[64];
+
+    config.durability = durability;
+    if (!file.IsOpen() || !log.Open(file.Sink(), config))
+    {
+        return;
+    }
+
+    timer.Reset();
+    for (UINT32 c = 0; c < cases; c++)
+    {
+        LogCase(log, c);
+        if ((c % BENCH_BATCH_CASES) == BENCH_BATCH_CASES - 1)
+        {
+            log.Barrier();
+        }
+    }
+    log.Flush();
+    double secs = timer.Seconds();
+
+    log.Close();
+    log.GetStats(&stats);
+
+    snprintf(name, sizeof(name), "log/async/%s", s_names[durability]);
+    BenchReport(name, cases * 3 / secs, "records/s");
+    snprintf(name, sizeof(name), "log/async/%s p99", s_names[durability]);
+    BenchReport(name, (double)stats.enqueueP99, "ns");
+    snprintf(name, sizeof(name), "log/async/%s barrier p99", s_names[durability]);
+    BenchReport(name, (double)stats.barrierP99, "ns");
+    snprintf(name, sizeof(name), "log/async/%s records/write", s_names[durability]);
+    BenchReport(name, stats.writes != 0 ? (double)stats.recordsEnqueued / stats.writes : 0, "records");
+}
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    if (argc > 1)
+    {
+        g_dir = argv[1];
+    }
+
+    if (!CheckOrdering(4, 20000, 64 * 1024, 16) ||
+        !CheckOrdering(4, 20000, 256, 2) ||
+        !CheckDurability())
+    {
+        return 1;
+    }
+    printf("[+] AsyncLog checks passed\n");
+
+    BenchWriteThrough(10000);
+    BenchAsync(200000, ASYNC_LOG_DURABILITY_NONE);
+    BenchAsync(200000, ASYNC_LOG_DURABILITY_WRITTEN);
+    BenchAsync(10000, ASYNC_LOG_DURABILITY_SYNCED);
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*++
+
+Module Name:
+
+    BenchBatch.cpp
+
+Abstract:
+
+    Cases/sec through the IOCTL_HYPERCALL_BATCH encoder, loopback backend and
+    result decode for batch sizes 1..4096. With the loopback backend the
+    numbers are the per-case cost of the wire format alone, i.e. the ceiling
+    the batching path puts on the fuzzer. The "syscall" series adds one real
+    user/kernel round trip per batch to stand in for DeviceIoControl.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include "ViFuBench.h"
+#include "../ViFuCore/HcBackend.h"
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <unistd.h>
+#endif
+
+//
+// Loopback plus one cheap system call per submission
+//
+class SyscallLoopbackBackend : public HcLoopbackBackend
+{
+public:
+    using HcBackend::ExecBatch;
+
+    virtual UINT32
+    ExecBatch (
+        IN  const VOID  *pInBuf,
+        IN  UINT32      inBufLen,
+        OUT VOID        *pOutBuf,
+        IN  UINT32      outBufLen,
+        OUT PUINT32     pBytesRet
+    )
+    {
+#ifdef _WIN32
+        BenchDoNotOptimize(GetFileAttributesW(L"."));
+#else
+        BenchDoNotOptimize(getppid());
+#endif
+        return HcLoopbackBackend::ExecBatch(pInBuf, inBufLen, pOutBuf, outBufLen, pBytesRet);
+    }
+};
+
+static VOID
+BenchBackend (
+    IN HcBackend    &backend,
+    IN const CHAR   *backendName
+)
+{
+    for (UINT32 batchSize = 1; batchSize <= HYPERCALL_BATCH_MAX_CASES; batchSize *= 2)
+    {
+        HcBatchEncoder  batch(batchSize);
+        HcBatchResults  results(batchSize);
+        UINT64          successCnt = 0;
+        CHAR            name[64];
+
+        double casesPerSec = BenchRun([&](UINT64 iters) {
+            UINT64 c = 0;
+
+            while (c < iters)
+            {
+                batch.Reset();
+                while (!batch.IsFull() && c < iters)
+                {
+                    PCPU_REG_64 pRegs = batch.Next();
+
+                    memset(pRegs, 0, sizeof(CPU_REG_64));
+                    pRegs->rcx = c & 0xFFFF;
+                    pRegs->rdx = USE_GPA_MEM_FILL;
+                    c++;
+                }
+
+                if (backend.ExecBatch(batch, results) != 0)
+                {
+                    printf("[-] ExecBatch failed\n");
+                    return;
+                }
+
+                for (UINT32 r = 0; r < results.Count(); r++)
+                {
+                    successCnt += (results[r].hvStatus == HV_STATUS_SUCCESS);
+                }
+            }
+        });
+
+        BenchDoNotOptimize(successCnt);
+        snprintf(name, sizeof(name), "batch/%s/size:%u", backendName, batchSize);
+        BenchReport(name, casesPerSec, "cases/s");
+    }
+}
+
+int
+main ()
+{
+    HcLoopbackBackend       loopback;
+    SyscallLoopbackBackend  syscallLoopback;
+
+    BenchBackend(loopback, "loopback");
+    BenchBackend(syscallLoopback, "syscall");
+
+    return 0;
+}
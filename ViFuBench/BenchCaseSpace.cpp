@@ -0,0 +1,397 @@
+/*++
+
+Module Name:
+
+    BenchCaseSpace.cpp
+
+Abstract:
+
+    Checks the flat case space against the nested loops and switch it
+    replaced, and measures index -> case materialization.
+
+    Checks (exit non-zero on failure)
+        - in order, the space gives the old loops' cases (caseIdx 0 - 136)
+          register for register, then the structured and havoc cases
+        - IndexOf inverts Materialize, resume skips to the next rep/fast
+          combo or the next allowed call code
+        - shards are disjoint and cover the space, a keyed cursor visits
+          every index of its range exactly once
+
+    Benchmarks
+        casespace/nested loops (old)    - the old loops and switch
+        casespace/materialize           - in index order
+        casespace/materialize shuffled  - keyed cursor order
+        casespace/resume (old)          - walking the loops to the last case
+        casespace/resume                - ResumeIndex + Seek
+
+    Usage: BenchCaseSpace
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include "ViFuBench.h"
+#include "../ViFuCore/CaseSpace.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+//
+// The switch (i) of the old ViFuR3 loop
+//
+static VOID
+OldSwitch (
+    IN     USHORT       i,
+    IN     USHORT       isFast,
+    IN OUT PCPU_REG_64  pRegs
+)
+{
+    switch (i)
+    {
+    case 120:
+        pRegs->xmm0.lower = 0x0DCDCDCDCDCDCDCD;
+        pRegs->xmm0.upper = 0x0FEFEFEFEFEFEFEF;
+        break;
+    case 121:
+        if (isFast == 1)
+        {
+            pRegs->xmm0.lower = 0; pRegs->xmm0.upper = 0;
+            pRegs->xmm1.lower = 0; pRegs->xmm1.upper = 0;
+            pRegs->xmm2.lower = 0; pRegs->xmm2.upper = 0;
+        }
+        break;
+    case 122:
+        if (isFast == 1)
+        {
+            pRegs->xmm0.lower = 1; pRegs->xmm0.upper = 0;
+            pRegs->xmm1.lower = 1; pRegs->xmm1.upper = 0;
+            pRegs->xmm2.lower = 0; pRegs->xmm2.upper = 0;
+        }
+        break;
+    case 123:
+        if (isFast == 1)
+        {
+            pRegs->xmm0.lower = 1; pRegs->xmm0.upper = 0;
+            pRegs->xmm1.lower = 1; pRegs->xmm1.upper = 0;
+            pRegs->xmm2.lower = 1; pRegs->xmm2.upper = 0;
+        }
+        break;
+    case 7:
+        pRegs->rdx = USE_GPA_MEM_NOFILL_1;
+        break;
+    case 6:
+        pRegs->rdx = USE_GPA_MEM_NOFILL_0;
+        break;
+    case 5:
+        pRegs->r8 = 0;
+        pRegs->rdx = 0;
+        break;
+    case 4:
+        pRegs->r11 = USE_GPA_MEM_FILL;
+        // fall through
+    case 3:
+        pRegs->r10 = USE_GPA_MEM_FILL;
+        // fall through
+    case 2:
+        pRegs->r9 = USE_GPA_MEM_FILL;
+        // fall through
+    case 1:
+        pRegs->r8 = USE_GPA_MEM_FILL;
+        // fall through
+    case 0:
+        pRegs->rdx = USE_GPA_MEM_FILL;
+        break;
+    default:
+        if (i >= 72 && i <= 135)
+        {
+            pRegs->rdx = USE_GPA_MEM_BIT_RANGE_LOOP;
+            pRegs->r8 = USE_GPA_MEM_BIT_RANGE_LOOP;
+            pRegs->rax = 0ULL | (1ULL << (i - 72));
+        }
+        else if (i >= 8 && i <= 71)
+        {
+            pRegs->rdx = USE_GPA_MEM_BIT_RANGE_LOOP;
+            pRegs->r8 = 0;
+            pRegs->rax = 0ULL | (1ULL << (i - 8));
+        }
+        break;
+    }
+}
+
+//
+// The old nested loops, calling fn(callcode, isRepCnt, isFast, i, regs) per case
+//
+template <typename FN>
+static VOID
+OldLoops (
+    IN const HcFilter   &filter,
+    IN FN               fn
+)
+{
+    CPU_REG_64 inRegs;
+
+    for (USHORT callcode = 0; callcode < HC_DESC_COUNT; callcode++)
+    {
+        if (!filter.IsAllowed(callcode))
+        {
+            continue;
+        }
+        for (USHORT isRepCnt = 0; isRepCnt <= 2; isRepCnt++)
+        {
+            for (USHORT isFast = 0; isFast <= 1; isFast++)
+            {
+                for (USHORT i = 0; i <= 8+64+64; i++)
+                {
+                    memset(&inRegs, 0, sizeof(inRegs));
+                    inRegs.rcx = callcode | ((UINT64)isFast << 16) | ((UINT64)isRepCnt << 32);
+                    OldSwitch(i, isFast, &inRegs);
+                    if (!fn(callcode, isRepCnt, isFast, i, inRegs))
+                    {
+                        return;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static BOOL
+CheckOldOrder ()
+{
+    HcFilter    filter;
+    CaseSpace   space(filter, 1);
+    FUZZ_CASE   fuzzCase;
+    UINT64      combo = 0;
+    UINT64      cases = 0;
+    BOOL        same = TRUE;
+
+    CHECK(space.CasesPerCombo() == CASE_SPACE_CASES);
+    OldLoops(filter, [&](USHORT callcode, USHORT isRepCnt, USHORT isFast, USHORT i, const CPU_REG_64 &regs) {
+        UINT64 index = combo * space.CasesPerCombo() + i;
+
+        same = same &&
+               space.Materialize(index, &fuzzCase) &&
+               fuzzCase.callcode == callcode &&
+               fuzzCase.repCnt == isRepCnt &&
+               fuzzCase.fast == isFast &&
+               fuzzCase.caseIdx == i &&
+               fuzzCase.rngState == 0 &&
+               memcmp(&fuzzCase.regs, &regs, sizeof(regs)) == 0;
+        combo += i == 8+64+64;
+        cases++;
+        return same;
+    });
+    CHECK(same);
+    CHECK(combo * space.CasesPerCombo() == space.Count());
+
+    //
+    // The rest of each combo: structured, then havoc with a journaled iteration
+    //
+    CHECK(space.Materialize(INPUT_GEN_FIRST_CASE, &fuzzCase));
+    CHECK(fuzzCase.rngState == 0 && fuzzCase.regs.rdx != 0);
+    CHECK(space.Materialize(INPUT_GEN_LAST_CASE + 1, &fuzzCase));
+    CHECK(strcmp(space.Generator(fuzzCase.generator).name, "havoc") == 0);
+    CHECK(fuzzCase.rngState == ((fuzzCase.callcode * 3ULL + 0) * 2 + 0) * CASE_SPACE_HAVOC_CASES);
+    CHECK(!space.Materialize(space.Count(), &fuzzCase));
+
+    printf("[+] case space matches the old loops (%llu cases, %llu total)\n",
+           (unsigned long long)cases,
+           (unsigned long long)space.Count());
+    return TRUE;
+}
+
+static BOOL
+CheckIndex ()
+{
+    HcFilter    filter;
+    FUZZ_CASE   fuzzCase;
+    UINT64      index = 0;
+
+    filter.Allow(0x40, 0x4f, FALSE);
+    CaseSpace space(filter, 2);
+
+    for (UINT64 i = 0; i < space.Count(); i += 7)
+    {
+        CHECK(space.Materialize(i, &fuzzCase));
+        CHECK(space.IndexOf(fuzzCase.callcode, fuzzCase.repCnt, fuzzCase.fast, fuzzCase.caseIdx, &index));
+        CHECK(index == i);
+    }
+    CHECK(!space.IndexOf(0x45, 0, 0, 0, &index));
+    CHECK(!space.IndexOf(0x3f, 3, 0, 0, &index));
+
+    //
+    // Next combo of the same call code, next call code, past a denied range
+    //
+    CHECK(space.IndexOf(0x3f, 0, 1, 0, &index) && space.ResumeIndex(0x3f, 0, 0) == index);
+    CHECK(space.IndexOf(0x50, 0, 0, 0, &index) && space.ResumeIndex(0x3f, 2, 1) == index);
+    CHECK(space.ResumeIndex(0x45, 1, 1) == index);
+    CHECK(space.ResumeIndex(HC_DESC_COUNT - 1, 2, 1) == space.Count());
+
+    printf("[+] case space index checks passed\n");
+    return TRUE;
+}
+
+static BOOL
+CheckShards ()
+{
+    HcFilter            filter;
+    CaseSpace           space(filter, 3);
+    std::vector<UINT8>  seen((SIZE_T)space.Count());
+
+    for (UINT32 n : { 1u, 3u, 7u, 64u, 1000u })
+    {
+        UINT64 next = 0;
+
+        for (UINT32 s = 0; s < n; s++)
+        {
+            UINT64 begin = 0;
+            UINT64 end = 0;
+
+            space.Shard(s, n, &begin, &end);
+            CHECK(begin == next && begin <= end);
+            CHECK(begin % space.CasesPerCombo() == 0);
+            next = end;
+        }
+        CHECK(next == space.Count());
+    }
+
+    //
+    // Shuffled shards of one space still see every case exactly once
+    //
+    for (UINT32 s = 0; s < 5; s++)
+    {
+        UINT64 begin = 0;
+        UINT64 end = 0;
+        UINT64 index = 0;
+
+        space.Shard(s, 5, &begin, &end);
+        CaseCursor cursor(begin, end, 0x5eed + s);
+
+        while (cursor.Next(&index))
+        {
+            CHECK(index >= begin && index < end);
+            CHECK(seen[(SIZE_T)index]++ == 0);
+        }
+        CHECK(cursor.Position() == end - begin);
+    }
+    for (UINT8 count : seen)
+    {
+        CHECK(count == 1);
+    }
+
+    for (UINT64 length : { 0ULL, 1ULL, 2ULL, 3ULL, 1000ULL, 65537ULL })
+    {
+        std::vector<UINT8> hits((SIZE_T)length);
+        CaseCursor cursor(100, 100 + length, 9);
+        UINT64 index = 0;
+
+        while (cursor.Next(&index))
+        {
+            CHECK(hits[(SIZE_T)(index - 100)]++ == 0);
+        }
+        CHECK(cursor.Position() == length);
+
+        //
+        // Skipping ahead lands where walking would have
+        //
+        if (length > 2)
+        {
+            CaseCursor skip(100, 100 + length, 9);
+            skip.Seek(length / 2);
+            CHECK(skip.Next(&index) && index == cursor.IndexAt(length / 2));
+        }
+    }
+
+    printf("[+] case space shard checks passed\n");
+    return TRUE;
+}
+
+int
+main ()
+{
+    HcFilter filter;
+    CaseSpace space(filter, 4);
+
+    if (!CheckOldOrder() || !CheckIndex() || !CheckShards())
+    {
+        return 1;
+    }
+
+    BenchReport("casespace/nested loops (old)", BenchRun([&](UINT64 iters) {
+        UINT64 cases = 0;
+
+        while (cases < iters)
+        {
+            OldLoops(filter, [&](USHORT, USHORT, USHORT, USHORT, const CPU_REG_64 &regs) {
+                BenchDoNotOptimize(regs);
+                return ++cases < iters;
+            });
+        }
+    }), "cases/s");
+
+    BenchReport("casespace/materialize", BenchRun([&](UINT64 iters) {
+        FUZZ_CASE fuzzCase;
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            space.Materialize(i % space.Count(), &fuzzCase);
+            BenchDoNotOptimize(fuzzCase);
+        }
+    }), "cases/s");
+
+    BenchReport("casespace/materialize shuffled", BenchRun([&](UINT64 iters) {
+        CaseCursor cursor(0, space.Count(), 0xabcdef);
+        FUZZ_CASE fuzzCase;
+        UINT64 index = 0;
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            if (!cursor.Next(&index))
+            {
+                cursor.Seek(0);
+                cursor.Next(&index);
+            }
+            space.Materialize(index, &fuzzCase);
+            BenchDoNotOptimize(fuzzCase);
+        }
+    }), "cases/s");
+
+    //
+    // Resuming at the last combo. The old loops skipped ahead with goto, but
+    // any order other than nested loops has to be walked to find the case
+    //
+    BenchReport("casespace/resume (old)", BenchRun([&](UINT64 iters) {
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            UINT64 walked = 0;
+
+            OldLoops(filter, [&](USHORT callcode, USHORT isRepCnt, USHORT isFast, USHORT, const CPU_REG_64 &regs) {
+                BenchDoNotOptimize(regs);
+                walked++;
+                return !(callcode == HC_DESC_COUNT - 1 && isRepCnt == 2 && isFast == 1);
+            });
+            BenchDoNotOptimize(walked);
+        }
+    }, 0.2), "resumes/s");
+
+    BenchReport("casespace/resume", BenchRun([&](UINT64 iters) {
+        CaseCursor cursor(0, space.Count());
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            UINT16 callcode = (UINT16)(HC_DESC_COUNT - 1 - (i & 7));
+
+            BenchDoNotOptimize(callcode);
+            cursor.Seek(space.ResumeIndex(callcode, 2, 0));
+            BenchDoNotOptimize(cursor);
+        }
+    }), "resumes/s");
+
+    return 0;
+}
@@ -0,0 +1,339 @@
+/*++
+
+Module Name:
+
+    BenchCollector.cpp
+
+Abstract:
+
+    Loopback load test of the log collector. The collector runs on a thread,
+    simulated guests connect over 127.0.0.1 and log the way ViFuR3 does: a
+    journal record and two VIFU_LOG lines per case through AsyncLog with
+    CollectorSinks, a watermark per batch and a SYNCED barrier on both every
+    VIFU_BATCH_SIZE cases.
+
+    Checks (exit non-zero on failure)
+        - a second connection for a connected guest id is refused
+        - a journal record that doesn't continue the journal is refused
+        - after the load, every guest reconnecting is told its full journal
+          count, its last case and watermark and log size, and the files on
+          disk agree
+
+    Benchmarks
+        collector/<n> guests            - sustained journal records/s
+        collector/<n> guests/all        - all records (journal + log lines)/s
+        collector/barrier p99           - guest barrier wait, includes fdatasync
+
+    Usage: BenchCollector [scratch directory, default .] [guests, default 32]
+                          [seconds, default 3] [data|none, default data]
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <signal.h>
+#include "ViFuBench.h"
+#include "../ViFuCore/CollectorClient.h"
+#include "../ViFuCollector/CollectorServer.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define BENCH_BATCH_CASES   64
+#define BENCH_TIMEOUT_MS    30000
+
+typedef struct _GUEST_RESULT
+{
+    BOOL                ok;
+    UINT64              cases;
+    UINT64              journalRecords;
+    UINT64              records;
+    UINT64              logBytes;
+    FUZZ_JOURNAL_RECORD lastCase;
+    UINT64              low;            // Of the last watermark
+    LatencyHistogram    barrier;
+} GUEST_RESULT, *PGUEST_RESULT;
+
+static std::string  g_dir = ".";
+static UINT16       g_port = 0;
+
+static BOOL
+CheckRejects ()
+{
+    CollectorClient     first;
+    CollectorClient     second;
+    COLLECTOR_HELLO_ACK ack = {};
+    FUZZ_JOURNAL_RECORD record;
+    CPU_REG_64          regs = {};
+
+    CHECK(first.Connect("127.0.0.1", g_port, "reject-test", 1, BENCH_TIMEOUT_MS, &ack));
+    CHECK(ack.journalCount == 0 && ack.resume.flags == 0);
+
+    CHECK(!second.Connect("127.0.0.1", g_port, "reject-test", 1, BENCH_TIMEOUT_MS, &ack));
+    CHECK(second.Status() == COLLECTOR_STATUS_GUEST_BUSY);
+
+    //
+    // Sequence 5 when the collector expects 0
+    //
+    FuzzJournalFile journal;
+
+    journal.Resume(ack.campaignId, 5);
+    FuzzJournalInitCase(&record, 1, 0, 0, 0, 0, &regs);
+    journal.Seal(&record);
+    UINT64 seq = first.Send(COLLECTOR_STREAM_JOURNAL, &record, sizeof(record));
+    CHECK(seq == 1);
+    CHECK(!first.WaitAcked(seq));
+    CHECK(first.Status() == COLLECTOR_STATUS_BAD_JOURNAL);
+
+    printf("[+] collector reject checks passed\n");
+    return TRUE;
+}
+
+//
+// One simulated ViFuR3
+//
+static VOID
+Guest (
+    IN  UINT32          guest,
+    IN  double          seconds,
+    OUT PGUEST_RESULT   pResult
+)
+{
+    CollectorClient     client;
+    COLLECTOR_HELLO_ACK ack = {};
+    FuzzJournalFile     journal;
+    FUZZ_JOURNAL_RECORD record;
+    FUZZ_JOURNAL_RECORD watermark;
+    CPU_REG_64          regs = {};
+    AsyncLog            log;
+    AsyncLog            journalLog;
+    ASYNC_LOG_CONFIG    config = ASYNC_LOG_DEFAULT_CONFIG;
+    ASYNC_LOG_STATS     stats = {};
+    CHAR                guestId[COLLECTOR_GUEST_ID_LEN];
+    BenchTimer          timer;
+
+    pResult->ok = FALSE;
+    snprintf(guestId, sizeof(guestId), "guest%02u", guest);
+    if (!client.Connect("127.0.0.1", g_port, guestId, 0x1000 + guest, BENCH_TIMEOUT_MS, &ack))
+    {
+        printf("[-] %s can't connect\n", guestId);
+        return;
+    }
+
+    CollectorSink logSink(&client, COLLECTOR_STREAM_LOG);
+    CollectorSink journalSink(&client, COLLECTOR_STREAM_JOURNAL);
+
+    config.durability = ASYNC_LOG_DURABILITY_SYNCED;
+    log.Open(&logSink, config);
+    journalLog.Open(&journalSink, config);
+    journal.Resume(ack.campaignId, ack.journalCount);
+
+    FuzzJournalInitSession(&record, (UINT64)time(NULL));
+    journal.Seal(&record);
+    journalLog.Write(&record, sizeof(record));
+
+    UINT64 cases = 0;
+    UINT64 watermarks = 0;
+    timer.Reset();
+    while (timer.Seconds() < seconds)
+    {
+        //
+        // Every batch before this one is done
+        //
+        FuzzJournalInitWatermark(&watermark, cases, 0);
+        journal.Seal(&watermark);
+        journalLog.Write(&watermark, sizeof(watermark));
+        pResult->low = cases;
+        watermarks++;
+
+        for (UINT32 c = 0; c < BENCH_BATCH_CASES; c++, cases++)
+        {
+            regs.rcx = cases % 0xbd;
+            regs.rdx = USE_GPA_MEM_FILL;
+            regs.rax = 1ULL << (cases % 64);
+            FuzzJournalInitCase(&record, (USHORT)(cases % 0xbd), 0, 1, (USHORT)(cases % 137), cases, &regs);
+            journal.Seal(&record);
+            journalLog.Write(&record, sizeof(record));
+
+            log.Printf("[ ] %s [0x%llx]\r\n", "HvCallFlushVirtualAddressSpace", (unsigned long long)regs.rcx);
+            log.Printf("    rax 0x%016llx rbx 0x%016llx rcx 0x%016llx rdx 0x%016llx rsi 0x%016llx\n"
+                       "    rdi 0x%016llx r8  0x%016llx r9  0x%016llx r10 0x%016llx r11 0x%016llx\n",
+                       (unsigned long long)regs.rax, 0ULL, (unsigned long long)regs.rcx,
+                       (unsigned long long)regs.rdx, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL);
+        }
+
+        BenchTimer wait;
+
+        journalLog.Barrier();
+        log.Barrier();
+        pResult->barrier.Record((UINT64)(wait.Seconds() * 1e9));
+        if (!client.IsConnected())
+        {
+            printf("[-] %s dropped, status %u\n", guestId, client.Status());
+            return;
+        }
+    }
+
+    pResult->lastCase = record;
+    journalLog.Close();
+    log.Close();
+
+    journalLog.GetStats(&stats);
+    pResult->records = stats.recordsEnqueued;
+    log.GetStats(&stats);
+    pResult->records += stats.recordsEnqueued;
+    pResult->logBytes = stats.bytesWritten;
+    pResult->cases = cases;
+    pResult->journalRecords = cases + watermarks + 1;
+    pResult->ok = client.IsConnected() && client.Acked() == client.Sent();
+}
+
+static BOOL
+CheckGuest (
+    IN UINT32           guest,
+    IN const GUEST_RESULT &result
+)
+{
+    CollectorClient     client;
+    COLLECTOR_HELLO_ACK ack = {};
+    FuzzJournalReader   reader;
+    CHAR                guestId[COLLECTOR_GUEST_ID_LEN];
+    struct stat         st;
+
+    snprintf(guestId, sizeof(guestId), "guest%02u", guest);
+    CHECK(result.ok);
+    CHECK(client.Connect("127.0.0.1", g_port, guestId, 0, BENCH_TIMEOUT_MS, &ack));
+    CHECK(ack.campaignId == 0x1000 + guest);
+    CHECK(ack.journalCount == result.journalRecords);
+    CHECK(ack.logBytes == result.logBytes);
+    CHECK(ack.resume.flags == (FUZZ_JOURNAL_RESUME_HAS_CASE | FUZZ_JOURNAL_RESUME_HAS_LOW));
+    CHECK(memcmp(&ack.resume.lastCase, &result.lastCase, sizeof(ack.resume.lastCase)) == 0);
+    CHECK(ack.resume.low == result.low);
+    client.Close();
+
+    std::string dir = g_dir + "/" + guestId;
+    CHECK(reader.Open((dir + "/fuzz_journal.bin").c_str()));
+    CHECK(reader.Count() == result.journalRecords);
+    CHECK(reader.Record(0)->kind == FUZZ_JOURNAL_KIND_SESSION);
+    CHECK(stat((dir + "/VIFU_LOG.txt").c_str(), &st) == 0 && (UINT64)st.st_size == result.logBytes);
+    return TRUE;
+}
+
+static VOID
+RemoveGuestDir (
+    IN const CHAR   *guestId
+)
+{
+    std::string dir = g_dir + "/" + guestId;
+
+    unlink((dir + "/fuzz_journal.bin").c_str());
+    unlink((dir + "/VIFU_LOG.txt").c_str());
+    rmdir(dir.c_str());
+}
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    CollectorServer     server;
+    COLLECTOR_CONFIG    config = {};
+    COLLECTOR_STATS     stats = {};
+    UINT32              guests = 32;
+    double              seconds = 3.0;
+    CHAR                name[64];
+    BOOL                bOk = TRUE;
+
+    if (argc > 1)
+    {
+        g_dir = argv[1];
+    }
+    if (argc > 2)
+    {
+        guests = (UINT32)atoi(argv[2]);
+    }
+    if (argc > 3)
+    {
+        seconds = atof(argv[3]);
+    }
+
+    g_dir += "/collector";
+    config.pDir = g_dir.c_str();
+    config.pBindAddr = "127.0.0.1";
+    config.sync = argc > 4 && strcmp(argv[4], "none") == 0 ? COLLECTOR_SYNC_NONE : COLLECTOR_SYNC_DATA;
+
+    signal(SIGPIPE, SIG_IGN);
+    if (!server.Start(config))
+    {
+        printf("[-] ERR starting collector\n");
+        return 1;
+    }
+    g_port = server.Port();
+    std::thread serverThread([&]() { server.Run(); });
+
+    RemoveGuestDir("reject-test");
+    for (UINT32 g = 0; g < guests; g++)
+    {
+        snprintf(name, sizeof(name), "guest%02u", g);
+        RemoveGuestDir(name);
+    }
+
+    bOk = CheckRejects();
+
+    std::vector<GUEST_RESULT>   results(guests);
+    std::vector<std::thread>    threads;
+    BenchTimer                  timer;
+
+    for (UINT32 g = 0; bOk && g < guests; g++)
+    {
+        threads.emplace_back(Guest, g, seconds, &results[g]);
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    double secs = timer.Seconds();
+
+    UINT64 cases = 0;
+    UINT64 records = 0;
+    LatencyHistogram barrier;
+
+    for (UINT32 g = 0; bOk && g < guests; g++)
+    {
+        bOk = CheckGuest(g, results[g]);
+        cases += results[g].journalRecords;
+        records += results[g].records;
+        barrier.Merge(results[g].barrier);
+    }
+
+    server.GetStats(&stats);
+    server.Stop();
+    serverThread.join();
+
+    if (!bOk)
+    {
+        return 1;
+    }
+    printf("[+] collector load checks passed, %llu group commits, %llu syncs, %llu acks\n",
+           (unsigned long long)stats.groupCommits,
+           (unsigned long long)stats.syncs,
+           (unsigned long long)stats.acks);
+
+    snprintf(name, sizeof(name), "collector/%u guests", guests);
+    BenchReport(name, cases / secs, "records/s");
+    snprintf(name, sizeof(name), "collector/%u guests/all", guests);
+    BenchReport(name, records / secs, "records/s");
+    BenchReport("collector/barrier p99", barrier.Percentile(99.0) / 1000.0, "us");
+    return 0;
+}
@@ -0,0 +1,659 @@
+/*++
+
+Module Name:
+
+    BenchCoordinator.cpp
+
+Abstract:
+
+    Loopback test of the campaign coordinator. The coordinator runs on a
+    thread, simulated guests connect over 127.0.0.1 and fuzz the way ViFuR3
+    does with a coordinator: a WorkerPool per guest running its leases
+    through CoordinatorRunLease on a simulated backend, reporting status
+    counts and the novelty entries new to the guest.
+
+    Checks (exit non-zero on failure)
+        - a campaign split between the guests runs every case once, and the
+          merged status counts and novelty match one run over the whole space
+        - a guest crashing mid lease has a crash window recorded that holds
+          the crashing case, no case outside a window runs twice or is missed
+        - a lease not heartbeated is taken back, its window recorded and its
+          rest leased first, the late heartbeat gets LEASE_LOST
+        - a guest saying hello again takes its old lease back
+        - a guest whose case space differs is refused
+
+    Benchmarks
+        coordinator/lease round trip    - lease requests/s, one guest
+        coordinator/heartbeat           - heartbeats/s, one guest
+        coordinator/<n> guests          - cases/s with <n> guests of 2 workers
+        coordinator/<n> guests leases   - lease requests/s meanwhile
+
+    Usage: BenchCoordinator [scratch directory, default .] [guests, default 32]
+                            [per-call latency in ns, default 1000]
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <signal.h>
+#include "ViFuBench.h"
+#include "../ViFuCore/CoordinatorClient.h"
+#include "../ViFuCore/CaseSpace.h"
+#include "../ViFuCore/HcSimBackend.h"
+#include "../ViFuCoordinator/CoordinatorServer.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define BENCH_BATCH_CASES       64
+#define BENCH_TIMEOUT_MS        30000
+#define BENCH_GUEST_WORKERS     2
+#define BENCH_CAMPAIGN_ID       0x5eed
+#define NO_CRASH                (~0ULL)
+
+//
+// What each worker of a simulated guest holds
+//
+typedef struct _SIM_WORKER
+{
+    HcSimBackend            backend;
+    HcBatchEncoder          batch;
+    HcBatchResults          results;
+    std::vector<CPU_REG_64> inRegs;
+
+    _SIM_WORKER ()
+        : batch(BENCH_BATCH_CASES),
+          results(BENCH_BATCH_CASES)
+    {
+    }
+} SIM_WORKER;
+
+typedef struct _GUEST_RESULT
+{
+    BOOL                        ok;
+    BOOL                        crashed;
+    UINT64                      crashIndex;         // Case it crashed on
+    UINT64                      leases;
+    std::vector<NOVELTY_ENTRY>  novel;
+} GUEST_RESULT, *PGUEST_RESULT;
+
+//
+// A coordinator on its own thread
+//
+class TestCoordinator
+{
+public:
+    TestCoordinator (
+        IN const CHAR   *name,
+        IN UINT32       leaseCombos,
+        IN UINT32       heartbeatMs,
+        IN UINT32       leaseTimeoutMs
+    )
+    {
+        COORD_CONFIG config = {};
+
+        m_dir = s_root + "/" + name;
+        unlink((m_dir + "/crash_windows.txt").c_str());
+        config.pDir = m_dir.c_str();
+        config.pBindAddr = "127.0.0.1";
+        config.campaignId = BENCH_CAMPAIGN_ID;
+        config.leaseCombos = leaseCombos;
+        config.heartbeatMs = heartbeatMs;
+        config.leaseTimeoutMs = leaseTimeoutMs;
+        m_started = server.Start(config);
+        if (m_started)
+        {
+            m_thread = std::thread([this]() { server.Run(); });
+        }
+    }
+
+    ~TestCoordinator ()
+    {
+        if (m_started)
+        {
+            server.Stop();
+            m_thread.join();
+        }
+    }
+
+    BOOL Started () const { return m_started; }
+
+    CoordinatorServer   server;
+    static std::string  s_root;
+
+private:
+    std::string         m_dir;
+    BOOL                m_started;
+    std::thread         m_thread;
+};
+
+std::string TestCoordinator::s_root = ".";
+
+static VOID
+FlushSimBatch (
+    IN OUT SIM_WORKER           *pWorker,
+    IN OUT CoordinatorClient    &client,
+    IN OUT NoveltyTracker       &novelty,
+    IN OUT std::mutex           &noveltyLock,
+    IN OUT WorkerCounters       &counters
+)
+{
+    if (pWorker->batch.IsEmpty())
+    {
+        return;
+    }
+
+    if (pWorker->backend.ExecBatch(pWorker->batch, pWorker->results) != 0)
+    {
+        counters.Add(WORKER_COUNTER_ERRORS);
+        client.RecordError();
+    }
+
+    std::lock_guard<std::mutex> lock(noveltyLock);
+
+    for (UINT32 c = 0; c < pWorker->results.Count(); c++)
+    {
+        const HYPERCALL_BATCH_RESULT &result = pWorker->results[c];
+
+        client.Record(result.hvStatus);
+        if (novelty.Observe(pWorker->inRegs[c], result, 0))
+        {
+            client.RecordNovel(novelty.Entry(novelty.Count() - 1));
+        }
+    }
+    pWorker->batch.Reset();
+    pWorker->inRegs.clear();
+}
+
+//
+// One simulated ViFuR3. Dies (disconnects mid lease, its results since the
+// last report lost) on the case after crashAfter
+//
+static VOID
+Guest (
+    IN  const CHAR                      *guestId,
+    IN  UINT16                          port,
+    IN  UINT64                          crashAfter,
+    IN  UINT32                          latencyNs,
+    IN  std::vector<std::atomic<UINT8>> *pHits,
+    OUT PGUEST_RESULT                   pResult
+)
+{
+    CoordinatorClient   client;
+    COORD_HELLO_ACK     ack = {};
+    COORD_LEASE         lease = {};
+    HcFilter            filter;
+    NoveltyTracker      novelty;
+    std::mutex          noveltyLock;
+    WorkerPool          pool(BENCH_GUEST_WORKERS, FALSE);
+    std::atomic<bool>   crashed(false);
+    std::atomic<UINT64> ran(0);
+
+    pResult->ok = FALSE;
+    pResult->crashed = FALSE;
+    pResult->crashIndex = 0;
+    pResult->leases = 0;
+
+    if (!client.Connect("127.0.0.1", port, guestId, pool.Workers(), BENCH_TIMEOUT_MS, &ack))
+    {
+        printf("[-] %s can't connect\n", guestId);
+        return;
+    }
+
+    CaseSpace space(filter, ack.campaignId);
+    std::vector<std::unique_ptr<SIM_WORKER>> workers;
+
+    for (UINT32 w = 0; w < pool.Workers(); w++)
+    {
+        workers.emplace_back(new SIM_WORKER);
+        workers.back()->backend.SetLatency(latencyNs);
+    }
+    client.SetSpace(space.Count(), space.CasesPerCombo());
+
+    while (client.RequestLease(&lease) && !(lease.flags & COORD_LEASE_FLAG_DONE))
+    {
+        if (lease.begin == lease.end)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(ack.heartbeatMs));
+            continue;
+        }
+        pResult->leases++;
+
+        COORD_STATUS status = CoordinatorRunLease(client, pool, lease, space.CasesPerCombo(), ack.heartbeatMs,
+            [&](UINT32 w, UINT64 begin, UINT64 end, WorkerCounters &counters) {
+                SIM_WORKER *pWorker = workers[w].get();
+                FUZZ_CASE fuzzCase;
+
+                for (UINT64 i = begin; i < end && !crashed; i++)
+                {
+                    if (ran++ == crashAfter)
+                    {
+                        pResult->crashIndex = i;
+                        crashed = true;
+                        pool.Stop();
+                        client.Close();
+                        return;
+                    }
+                    if (pHits != NULL)
+                    {
+                        (*pHits)[(SIZE_T)i]++;
+                    }
+                    space.Materialize(i, &fuzzCase);
+                    pWorker->batch.Add(fuzzCase.regs);
+                    pWorker->inRegs.push_back(fuzzCase.regs);
+                    counters.Add(WORKER_COUNTER_CASES);
+                    if (pWorker->batch.IsFull())
+                    {
+                        FlushSimBatch(pWorker, client, novelty, noveltyLock, counters);
+                    }
+                }
+                FlushSimBatch(pWorker, client, novelty, noveltyLock, counters);
+            });
+
+        if (crashed)
+        {
+            pResult->crashed = TRUE;
+            return;
+        }
+        if (status != COORD_STATUS_OK)
+        {
+            printf("[-] %s lost lease %llu: %u\n", guestId, (unsigned long long)lease.leaseId, status);
+            return;
+        }
+    }
+
+    for (SIZE_T e = 0; e < novelty.Count(); e++)
+    {
+        pResult->novel.push_back(novelty.Entry(e));
+    }
+    pResult->ok = (lease.flags & COORD_LEASE_FLAG_DONE) != 0;
+}
+
+//
+// Run a campaign with `guests` simulated guests until the coordinator says
+// DONE. Returns the wall time
+//
+static double
+RunCampaign (
+    IN  TestCoordinator                 &coordinator,
+    IN  UINT32                          guests,
+    IN  UINT32                          crashGuest,
+    IN  UINT64                          crashAfter,
+    IN  UINT32                          latencyNs,
+    IN  std::vector<std::atomic<UINT8>> *pHits,
+    OUT std::vector<GUEST_RESULT>       &results
+)
+{
+    std::vector<std::string>    ids(guests);
+    std::vector<std::thread>    threads;
+    BenchTimer                  timer;
+
+    results.clear();
+    results.resize(guests);
+    for (UINT32 g = 0; g < guests; g++)
+    {
+        ids[g] = "guest" + std::to_string(g);
+        threads.emplace_back(Guest,
+                             ids[g].c_str(),
+                             coordinator.server.Port(),
+                             g == crashGuest ? crashAfter : NO_CRASH,
+                             latencyNs,
+                             pHits,
+                             &results[g]);
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    return timer.Seconds();
+}
+
+static BOOL
+CheckCampaign (
+    IN UINT32   guests
+)
+{
+    HcFilter                        filter;
+    CaseSpace                       space(filter, BENCH_CAMPAIGN_ID);
+    HcSimBackend                    backend;
+    HcBatchEncoder                  batch(BENCH_BATCH_CASES);
+    HcBatchResults                  results(BENCH_BATCH_CASES);
+    std::vector<CPU_REG_64>         inRegs;
+    NoveltyTracker                  reference;
+    UINT64                          refCounts[COORD_STATUS_SLOTS] = {};
+    std::vector<std::atomic<UINT8>> hits((SIZE_T)space.Count());
+    std::vector<GUEST_RESULT>       guestResults;
+    UINT64                          statusCounts[COORD_STATUS_SLOTS];
+    UINT64                          errors = 0;
+    NoveltyTracker                  merged;
+    COORD_GUEST_STATS               guestStats;
+
+    //
+    // The whole space in one go
+    //
+    for (UINT64 i = 0; i < space.Count(); i++)
+    {
+        FUZZ_CASE fuzzCase;
+
+        space.Materialize(i, &fuzzCase);
+        batch.Add(fuzzCase.regs);
+        inRegs.push_back(fuzzCase.regs);
+        if (batch.IsFull() || i + 1 == space.Count())
+        {
+            backend.ExecBatch(batch, results);
+            for (UINT32 c = 0; c < results.Count(); c++)
+            {
+                refCounts[CoordStatusSlot(results[c].hvStatus)]++;
+                reference.Observe(inRegs[c], results[c], 0);
+            }
+            batch.Reset();
+            inRegs.clear();
+        }
+    }
+
+    for (auto &hit : hits)
+    {
+        hit = 0;
+    }
+
+    TestCoordinator coordinator("clean", 4, 50, 5000);
+
+    CHECK(coordinator.Started());
+    RunCampaign(coordinator, guests, guests, NO_CRASH, 0, &hits, guestResults);
+
+    for (auto &hit : hits)
+    {
+        CHECK(hit == 1);
+    }
+    for (UINT32 g = 0; g < guests; g++)
+    {
+        std::string guestId = "guest" + std::to_string(g);
+
+        CHECK(guestResults[g].ok);
+        CHECK(coordinator.server.GetGuestStats(guestId.c_str(), &guestStats));
+        CHECK(guestStats.leases == guestResults[g].leases);
+        for (const NOVELTY_ENTRY &entry : guestResults[g].novel)
+        {
+            merged.Insert(entry);
+        }
+    }
+    CHECK(coordinator.server.IsDone());
+    CHECK(coordinator.server.CrashWindows().empty());
+
+    coordinator.server.GetStatusCounts(statusCounts, &errors);
+    CHECK(memcmp(statusCounts, refCounts, sizeof(refCounts)) == 0);
+    CHECK(errors == 0);
+    CHECK(coordinator.server.NoveltyCount() == reference.Count());
+    CHECK(merged.Count() == reference.Count());
+
+    COORD_STATS stats;
+
+    coordinator.server.GetStats(&stats);
+    printf("[+] campaign checks passed (%u guests, %llu cases, %llu leases, %llu heartbeats, %zu novel)\n",
+           guests,
+           (unsigned long long)space.Count(),
+           (unsigned long long)stats.leases,
+           (unsigned long long)stats.heartbeats,
+           reference.Count());
+    return TRUE;
+}
+
+static BOOL
+CheckCrash (
+    IN UINT32   guests
+)
+{
+    HcFilter                        filter;
+    CaseSpace                       space(filter, BENCH_CAMPAIGN_ID);
+    std::vector<std::atomic<UINT8>> hits((SIZE_T)space.Count());
+    std::vector<GUEST_RESULT>       guestResults;
+    UINT32                          crashGuest = 1;
+    UINT32                          leaseCombos = 8;
+    COORD_STATS                     stats;
+
+    for (auto &hit : hits)
+    {
+        hit = 0;
+    }
+
+    TestCoordinator coordinator("crash", leaseCombos, 50, 5000);
+
+    CHECK(coordinator.Started());
+
+    //
+    // Into its second lease
+    //
+    RunCampaign(coordinator, guests, crashGuest, (leaseCombos + 3) * space.CasesPerCombo() + 17, 0, &hits, guestResults);
+
+    std::vector<COORD_CRASH_WINDOW> windows = coordinator.server.CrashWindows();
+    UINT64 crashIndex = guestResults[crashGuest].crashIndex;
+
+    coordinator.server.GetStats(&stats);
+    CHECK(coordinator.server.IsDone());
+    CHECK(guestResults[crashGuest].crashed);
+    CHECK(windows.size() == 1);
+    CHECK(windows[0].guestId == "guest" + std::to_string(crashGuest));
+    CHECK(windows[0].reason == COORD_TAKEBACK_DISCONNECT);
+    CHECK(windows[0].low <= crashIndex && crashIndex < windows[0].high);
+    CHECK(windows[0].low % space.CasesPerCombo() == 0 && windows[0].high % space.CasesPerCombo() == 0);
+    CHECK(windows[0].high - windows[0].low <= (UINT64)leaseCombos * space.CasesPerCombo());
+    CHECK(stats.disconnects == 1 && stats.crashWindows == 1);
+
+    for (UINT64 i = 0; i < space.Count(); i++)
+    {
+        if (i >= windows[0].low && i < windows[0].high)
+        {
+            CHECK(hits[(SIZE_T)i] <= 1);
+        }
+        else
+        {
+            CHECK(hits[(SIZE_T)i] == 1);
+        }
+    }
+    CHECK(hits[(SIZE_T)crashIndex] == 0);
+
+    for (UINT32 g = 0; g < guests; g++)
+    {
+        CHECK(g == crashGuest || guestResults[g].ok);
+    }
+
+    printf("[+] crash checks passed (case %llu in window [%llu, %llu), %llu combos)\n",
+           (unsigned long long)crashIndex,
+           (unsigned long long)windows[0].low,
+           (unsigned long long)windows[0].high,
+           (unsigned long long)((windows[0].high - windows[0].low) / space.CasesPerCombo()));
+    return TRUE;
+}
+
+static BOOL
+CheckTakeBack ()
+{
+    HcFilter            filter;
+    CaseSpace           space(filter, BENCH_CAMPAIGN_ID);
+    UINT64              cpc = space.CasesPerCombo();
+    COORD_HELLO_ACK     ack = {};
+    COORD_LEASE         lease = {};
+    COORD_LEASE         next = {};
+    COORD_STATS         stats;
+
+    //
+    // Stall past the timeout
+    //
+    {
+        TestCoordinator     coordinator("takeback", 8, 20, 100);
+        CoordinatorClient   client;
+
+        CHECK(coordinator.Started());
+        CHECK(client.Connect("127.0.0.1", coordinator.server.Port(), "stall-test", 1, BENCH_TIMEOUT_MS, &ack));
+        CHECK(ack.campaignId == BENCH_CAMPAIGN_ID && ack.heartbeatMs == 20 && ack.leaseTimeoutMs == 100);
+        client.SetSpace(space.Count(), (UINT32)cpc);
+        CHECK(client.RequestLease(&lease));
+        CHECK(lease.begin == 0 && lease.end == 8 * cpc && lease.flags == 0);
+        CHECK(client.Heartbeat(cpc, 3 * cpc) == COORD_STATUS_OK);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(400));
+        CHECK(client.Heartbeat(2 * cpc, 4 * cpc) == COORD_STATUS_LEASE_LOST);
+        CHECK(client.IsConnected());
+
+        coordinator.server.GetStats(&stats);
+        std::vector<COORD_CRASH_WINDOW> windows = coordinator.server.CrashWindows();
+        CHECK(stats.timeouts == 1);
+        CHECK(windows.size() == 1 && windows[0].reason == COORD_TAKEBACK_TIMEOUT);
+        CHECK(windows[0].low == cpc && windows[0].high == 3 * cpc);
+
+        //
+        // The rest of the lease goes out first
+        //
+        CHECK(client.RequestLease(&next));
+        CHECK(next.begin == 3 * cpc && next.end == 8 * cpc);
+    }
+
+    //
+    // Rebooted guest says hello again
+    //
+    {
+        TestCoordinator     coordinator("restart", 8, 1000, 10000);
+        CoordinatorClient   before;
+        CoordinatorClient   after;
+
+        CHECK(coordinator.Started());
+        CHECK(before.Connect("127.0.0.1", coordinator.server.Port(), "restart-test", 1, BENCH_TIMEOUT_MS, &ack));
+        before.SetSpace(space.Count(), (UINT32)cpc);
+        CHECK(before.RequestLease(&lease));
+        CHECK(before.Heartbeat(2 * cpc, 5 * cpc) == COORD_STATUS_OK);
+
+        CHECK(after.Connect("127.0.0.1", coordinator.server.Port(), "restart-test", 1, BENCH_TIMEOUT_MS, &ack));
+        after.SetSpace(space.Count(), (UINT32)cpc);
+        CHECK(after.RequestLease(&next));
+        CHECK(next.begin == 5 * cpc && next.end == 8 * cpc);
+        CHECK(before.Heartbeat(3 * cpc, 5 * cpc) != COORD_STATUS_OK);
+
+        coordinator.server.GetStats(&stats);
+        std::vector<COORD_CRASH_WINDOW> windows = coordinator.server.CrashWindows();
+        CHECK(stats.restarts == 1 && stats.activeGuests == 1);
+        CHECK(windows.size() == 1 && windows[0].reason == COORD_TAKEBACK_RESTART);
+        CHECK(windows[0].low == 2 * cpc && windows[0].high == 5 * cpc);
+    }
+
+    //
+    // Different case space
+    //
+    {
+        TestCoordinator     coordinator("mismatch", 8, 1000, 10000);
+        CoordinatorClient   first;
+        CoordinatorClient   second;
+
+        CHECK(coordinator.Started());
+        CHECK(first.Connect("127.0.0.1", coordinator.server.Port(), "space-a", 1, BENCH_TIMEOUT_MS, &ack));
+        first.SetSpace(space.Count(), (UINT32)cpc);
+        CHECK(first.RequestLease(&lease));
+
+        CHECK(second.Connect("127.0.0.1", coordinator.server.Port(), "space-b", 1, BENCH_TIMEOUT_MS, &ack));
+        second.SetSpace(space.Count() - cpc, (UINT32)cpc);
+        CHECK(!second.RequestLease(&next));
+        CHECK(second.Status() == COORD_STATUS_SPACE_MISMATCH);
+        CHECK(!second.IsConnected());
+    }
+
+    printf("[+] take back checks passed\n");
+    return TRUE;
+}
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    UINT32 guests = 32;
+    UINT32 latencyNs = 1000;
+    CHAR name[64];
+
+    if (argc > 1)
+    {
+        TestCoordinator::s_root = argv[1];
+    }
+    if (argc > 2)
+    {
+        guests = (UINT32)atoi(argv[2]);
+    }
+    if (argc > 3)
+    {
+        latencyNs = (UINT32)atoi(argv[3]);
+    }
+
+    TestCoordinator::s_root += "/coordinator";
+    mkdir(TestCoordinator::s_root.c_str(), 0755);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!CheckCampaign(guests) || !CheckCrash(guests / 4 != 0 ? guests / 4 : 1) || !CheckTakeBack())
+    {
+        return 1;
+    }
+
+    //
+    // Lease and heartbeat round trips over a space too big to run out
+    //
+    {
+        TestCoordinator     coordinator("roundtrip", 1, 1000, 10000);
+        CoordinatorClient   client;
+        COORD_HELLO_ACK     ack = {};
+        COORD_LEASE         lease = {};
+
+        if (!coordinator.Started() ||
+            !client.Connect("127.0.0.1", coordinator.server.Port(), "bench", 1, BENCH_TIMEOUT_MS, &ack))
+        {
+            printf("[-] ERR starting coordinator\n");
+            return 1;
+        }
+        client.SetSpace(1ULL << 40, 1);
+
+        BenchReport("coordinator/lease round trip", BenchRun([&](UINT64 iters) {
+            for (UINT64 i = 0; i < iters; i++)
+            {
+                client.RequestLease(&lease);
+            }
+        }, 0.3), "leases/s");
+        BenchReport("coordinator/heartbeat", BenchRun([&](UINT64 iters) {
+            for (UINT64 i = 0; i < iters; i++)
+            {
+                client.Heartbeat(lease.begin, lease.end);
+            }
+        }, 0.3), "heartbeats/s");
+    }
+
+    for (UINT32 n = 1; n <= guests; n *= 2)
+    {
+        HcFilter                    filter;
+        CaseSpace                   space(filter, BENCH_CAMPAIGN_ID);
+        std::vector<GUEST_RESULT>   results;
+        COORD_STATS                 stats;
+        TestCoordinator             coordinator("scaling", 4, 50, 10000);
+
+        if (!coordinator.Started())
+        {
+            printf("[-] ERR starting coordinator\n");
+            return 1;
+        }
+
+        double secs = RunCampaign(coordinator, n, n, NO_CRASH, latencyNs, NULL, results);
+
+        coordinator.server.GetStats(&stats);
+        snprintf(name, sizeof(name), "coordinator/%u guests", n);
+        BenchReport(name, space.Count() / secs, "cases/s");
+        snprintf(name, sizeof(name), "coordinator/%u guests leases", n);
+        BenchReport(name, (stats.leases + stats.heartbeats) / secs, "requests/s");
+    }
+
+    return 0;
+}
@@ -0,0 +1,546 @@
+/*++
+
+Module Name:
+
+    BenchCorpus.cpp
+
+Abstract:
+
+    Checks the content addressed corpus store and measures insert, lookup
+    and open cost on a corpus of millions of entries.
+
+    Checks (exit non-zero on failure)
+        - SHA-256 matches the FIPS 180-4 examples
+        - a case is stored once, reads back exactly, page included, and
+          keeps the tags it was first stored with
+        - a clean reopen maps the index without reading a segment
+        - a dirty index is rebuilt from the segments, a torn record at the
+          tail of the last one is cut off and the next insert lands there
+        - segments roll over at the configured size
+        - workers inserting overlapping cases at once store each one once
+
+    Benchmarks
+        corpus/insert <n> threads   - new cases stored per second
+        corpus/insert duplicate     - cases already stored, per second
+        corpus/lookup hit, miss     - lookups by hash per second
+        corpus/open clean           - Open of the whole corpus, index mapped
+        corpus/open rebuild         - Open with the index left dirty
+
+    Usage: BenchCorpus [scratch directory, default .] [entries, default 1000000] [threads, default 4]
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <stdlib.h>
+#include "ViFuBench.h"
+#include "../ViFuCore/CorpusStore.h"
+#include "../ViFuCore/PageFill.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+static std::string g_dir = ".";
+
+static std::string
+ScratchPath (
+    IN const CHAR   *name
+)
+{
+    return g_dir + "/" + name;
+}
+
+//
+// Delete a store the bench made, segments until the first missing one
+//
+static VOID
+RemoveStore (
+    IN const std::string    &dir
+)
+{
+    for (UINT32 segment = 0;; segment++)
+    {
+        CHAR name[32];
+
+        snprintf(name, sizeof(name), CORPUS_SEGMENT_FORMAT, segment);
+        if (remove((dir + "/" + name).c_str()) != 0)
+        {
+            break;
+        }
+    }
+    remove((dir + "/" + CORPUS_INDEX_NAME).c_str());
+    rmdir(dir.c_str());
+}
+
+//
+// Case n, every 64th has a page
+//
+static VOID
+MakeCase (
+    OUT PCORPUS_CASE    pCase,
+    IN  UINT64          n
+)
+{
+    PUINT64 pQwords = (PUINT64)&pCase->regs;
+
+    memset(&pCase->regs, 0, sizeof(CPU_REG_64));
+    for (UINT32 q = 0; q < 10; q++)
+    {
+        pQwords[q] = PageFillSplitMix(n * 16 + q);
+    }
+    pCase->bPage = (n % 64) == 0;
+    pCase->rsvd = 0;
+    if (pCase->bPage)
+    {
+        for (UINT32 q = 0; q < CORPUS_PAGE_SIZE / 8; q++)
+        {
+            ((PUINT64)pCase->page)[q] = PageFillSplitMix(n ^ (q * 0x9E3779B97F4A7C15ULL));
+        }
+    }
+}
+
+static VOID
+MakeTags (
+    OUT PCORPUS_TAGS    pTags,
+    IN  UINT64          n
+)
+{
+    memset(pTags, 0, sizeof(CORPUS_TAGS));
+    pTags->novelty = PageFillSplitMix(~n);
+    pTags->discoveredAt = n;
+    pTags->hvStatus = (UINT16)(n % 0x20);
+}
+
+static BOOL
+SameCase (
+    IN const CORPUS_CASE    &a,
+    IN const CORPUS_CASE    &b
+)
+{
+    return memcmp(&a.regs, &b.regs, sizeof(CPU_REG_64)) == 0 &&
+           a.bPage == b.bPage &&
+           (!a.bPage || memcmp(a.page, b.page, CORPUS_PAGE_SIZE) == 0);
+}
+
+static BOOL
+CheckSha256 ()
+{
+    static const UINT8 s_abc[CORPUS_HASH_SIZE] =
+    {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+    };
+    static const UINT8 s_twoBlocks[CORPUS_HASH_SIZE] =
+    {
+        0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+        0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1
+    };
+    const CHAR  *pTwoBlocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    CORPUS_HASH hash;
+
+    {
+        CorpusSha256 sha;
+
+        sha.Update("abc", 3);
+        sha.Final(&hash);
+        CHECK(memcmp(hash.bytes, s_abc, CORPUS_HASH_SIZE) == 0);
+    }
+
+    //
+    // Fed a byte at a time, across the block boundary
+    //
+    {
+        CorpusSha256 sha;
+
+        for (SIZE_T b = 0; b < strlen(pTwoBlocks); b++)
+        {
+            sha.Update(&pTwoBlocks[b], 1);
+        }
+        sha.Final(&hash);
+        CHECK(memcmp(hash.bytes, s_twoBlocks, CORPUS_HASH_SIZE) == 0);
+    }
+    return TRUE;
+}
+
+static BOOL
+CheckStore ()
+{
+    std::string     dir = ScratchPath("corpus_check");
+    CorpusStore     store;
+    CORPUS_CASE     corpusCase;
+    CORPUS_CASE     readBack;
+    CORPUS_TAGS     tags;
+    CORPUS_HASH     hash;
+    CORPUS_SLOT     slot;
+    CORPUS_STATS    stats;
+
+    RemoveStore(dir);
+    CHECK(store.Open(dir.c_str()));
+
+    for (UINT64 n = 0; n < 5000; n++)
+    {
+        MakeCase(&corpusCase, n);
+        MakeTags(&tags, n);
+        CHECK(store.Insert(corpusCase, tags) == CORPUS_INSERT_NEW);
+    }
+
+    //
+    // Stored once, with the first tags
+    //
+    MakeCase(&corpusCase, 64);
+    MakeTags(&tags, 9999);
+    CHECK(store.Insert(corpusCase, tags, &hash) == CORPUS_INSERT_DUPLICATE);
+    CHECK(store.Count() == 5000);
+    CHECK(store.Lookup(hash, &slot) && slot.discoveredAt == 64 && (slot.flags & CORPUS_FLAG_PAGE));
+    CHECK(store.Read(slot, &readBack) && SameCase(readBack, corpusCase));
+
+    MakeCase(&corpusCase, 65);
+    CorpusHashCase(corpusCase, &hash);
+    CHECK(store.Lookup(hash, &slot) && !(slot.flags & CORPUS_FLAG_PAGE) && slot.hvStatus == 65 % 0x20);
+    CHECK(store.Read(slot, &readBack) && SameCase(readBack, corpusCase));
+
+    MakeCase(&corpusCase, 5000);
+    CHECK(!store.Contains(corpusCase));
+
+    store.GetStats(&stats);
+    CHECK(stats.inserted == 5000 && stats.duplicates == 1 && stats.grows != 0);
+
+    //
+    // Clean reopen, nothing read from the segments
+    //
+    store.Close();
+    CHECK(store.Open(dir.c_str()));
+    store.GetStats(&stats);
+    CHECK(store.Count() == 5000 && stats.rebuilt == 0);
+    MakeCase(&corpusCase, 4999);
+    CHECK(store.Contains(corpusCase));
+    store.Close();
+
+    //
+    // Dirty index and a torn record: rebuilt, the tail cut off
+    //
+    {
+        FUZZ_JOURNAL_FD     fd = CorpusOpenFile(dir + "/" + CORPUS_INDEX_NAME, FALSE);
+        CORPUS_INDEX_HEADER header;
+        CORPUS_RECORD       torn;
+        UINT64              size = 0;
+
+        CHECK(fd != FUZZ_JOURNAL_INVALID_FD);
+        CHECK(FuzzJournalFdRead(fd, 0, &header, sizeof(header)));
+        header.state = CORPUS_INDEX_DIRTY;
+        CHECK(FuzzJournalFdWrite(fd, 0, &header, sizeof(header)));
+        CorpusCloseFile(fd);
+
+        fd = CorpusOpenFile(dir + "/segment.000000.vfc", FALSE);
+        CHECK(fd != FUZZ_JOURNAL_INVALID_FD && FuzzJournalFdSize(fd, &size));
+        memset(&torn, 0, sizeof(torn));
+        torn.magic = CORPUS_RECORD_MAGIC;
+        torn.size = CorpusRecordSize(FALSE);
+        CHECK(FuzzJournalFdWrite(fd, size, &torn, sizeof(torn)));
+        CorpusCloseFile(fd);
+    }
+    CHECK(store.Open(dir.c_str()));
+    store.GetStats(&stats);
+    CHECK(store.Count() == 5000 && stats.rebuilt == 5000 && stats.tornBytes == sizeof(CORPUS_RECORD));
+    MakeCase(&corpusCase, 5000);
+    MakeTags(&tags, 5000);
+    CHECK(store.Insert(corpusCase, tags, &hash) == CORPUS_INSERT_NEW);
+    CHECK(store.Lookup(hash, &slot) && store.Read(slot, &readBack) && SameCase(readBack, corpusCase));
+    store.Close();
+
+    CHECK(store.Open(dir.c_str()));
+    store.GetStats(&stats);
+    CHECK(store.Count() == 5001 && stats.rebuilt == 0);
+    store.Close();
+
+    RemoveStore(dir);
+    return TRUE;
+}
+
+static BOOL
+CheckSegments ()
+{
+    std::string     dir = ScratchPath("corpus_segments");
+    CORPUS_CONFIG   config = { 64 * 1024, 0 };
+    CorpusStore     store;
+    CORPUS_CASE     corpusCase;
+    CORPUS_CASE     readBack;
+    CORPUS_TAGS     tags;
+    CORPUS_HASH     hash;
+    CORPUS_SLOT     slot;
+    CORPUS_STATS    stats;
+
+    RemoveStore(dir);
+    CHECK(store.Open(dir.c_str(), &config));
+    for (UINT64 n = 0; n < 2000; n++)
+    {
+        MakeCase(&corpusCase, n);
+        MakeTags(&tags, n);
+        CHECK(store.Insert(corpusCase, tags) == CORPUS_INSERT_NEW);
+    }
+    CHECK(store.Segments() > 1);
+    store.Close();
+
+    //
+    // Rebuilt across all of them
+    //
+    {
+        FUZZ_JOURNAL_FD fd = CorpusOpenFile(dir + "/" + CORPUS_INDEX_NAME, FALSE);
+
+        CHECK(fd != FUZZ_JOURNAL_INVALID_FD && FuzzJournalFdTruncate(fd, 0));
+        CorpusCloseFile(fd);
+    }
+    CHECK(store.Open(dir.c_str(), &config));
+    store.GetStats(&stats);
+    CHECK(store.Count() == 2000 && stats.rebuilt == 2000);
+    for (UINT64 n = 0; n < 2000; n += 7)
+    {
+        MakeCase(&corpusCase, n);
+        CorpusHashCase(corpusCase, &hash);
+        CHECK(store.Lookup(hash, &slot) && store.Read(slot, &readBack) && SameCase(readBack, corpusCase));
+    }
+    store.Close();
+
+    RemoveStore(dir);
+    return TRUE;
+}
+
+static BOOL
+CheckConcurrent ()
+{
+    std::string                 dir = ScratchPath("corpus_concurrent");
+    CorpusStore                 store;
+    CORPUS_STATS                stats;
+    std::vector<std::thread>    threads;
+    const UINT32                workers = 8;
+    const UINT64                perWorker = 4000;
+
+    RemoveStore(dir);
+    CHECK(store.Open(dir.c_str()));
+
+    //
+    // Worker w inserts cases [w * perWorker / 2, ...), half shared with the next
+    //
+    for (UINT32 w = 0; w < workers; w++)
+    {
+        threads.emplace_back([&store, w, perWorker]() {
+            CORPUS_CASE corpusCase;
+            CORPUS_TAGS tags;
+
+            for (UINT64 n = w * perWorker / 2; n < w * perWorker / 2 + perWorker; n++)
+            {
+                MakeCase(&corpusCase, n);
+                MakeTags(&tags, n);
+                store.Insert(corpusCase, tags);
+            }
+        });
+    }
+    for (SIZE_T t = 0; t < threads.size(); t++)
+    {
+        threads[t].join();
+    }
+
+    store.GetStats(&stats);
+    CHECK(store.Count() == (workers + 1) * perWorker / 2);
+    CHECK(stats.inserted == store.Count() && stats.duplicates == workers * perWorker - store.Count());
+    store.Close();
+
+    RemoveStore(dir);
+    return TRUE;
+}
+
+static VOID
+Bench (
+    IN UINT64   entries,
+    IN UINT32   threads
+)
+{
+    std::string     dir = ScratchPath("corpus_bench");
+    CORPUS_CONFIG   config = { 0, 0 };
+    CorpusStore     store;
+    CORPUS_STATS    stats;
+    BenchTimer      timer;
+    double          secs = 0;
+    CHAR            name[64];
+
+    RemoveStore(dir);
+    if (!store.Open(dir.c_str(), &config))
+    {
+        printf("[-] could not open %s\n", dir.c_str());
+        return;
+    }
+
+    //
+    // One thread, then the rest by `threads` workers at once
+    //
+    {
+        UINT64      single = entries / 4;
+        CORPUS_CASE corpusCase;
+        CORPUS_TAGS tags;
+
+        timer.Reset();
+        for (UINT64 n = 0; n < single; n++)
+        {
+            MakeCase(&corpusCase, n);
+            MakeTags(&tags, n);
+            store.Insert(corpusCase, tags);
+        }
+        secs = timer.Seconds();
+        BenchReport("corpus/insert 1 threads", single / secs, "cases/s");
+
+        std::vector<std::thread> workers;
+
+        timer.Reset();
+        for (UINT32 w = 0; w < threads; w++)
+        {
+            workers.emplace_back([&store, w, threads, single, entries]() {
+                CORPUS_CASE workerCase;
+                CORPUS_TAGS workerTags;
+
+                for (UINT64 n = single + w; n < entries; n += threads)
+                {
+                    MakeCase(&workerCase, n);
+                    MakeTags(&workerTags, n);
+                    store.Insert(workerCase, workerTags);
+                }
+            });
+        }
+        for (SIZE_T w = 0; w < workers.size(); w++)
+        {
+            workers[w].join();
+        }
+        secs = timer.Seconds();
+        snprintf(name, sizeof(name), "corpus/insert %u threads", threads);
+        BenchReport(name, (entries - single) / secs, "cases/s");
+
+        timer.Reset();
+        for (UINT64 n = 0; n < single; n++)
+        {
+            MakeCase(&corpusCase, n * 3 % entries);
+            MakeTags(&tags, n);
+            store.Insert(corpusCase, tags);
+        }
+        secs = timer.Seconds();
+        BenchReport("corpus/insert duplicate", single / secs, "cases/s");
+    }
+
+    //
+    // Hashes made up front, this is the index alone
+    //
+    {
+        std::vector<CORPUS_HASH>    hashes(1 << 16);
+        CORPUS_CASE                 corpusCase;
+        CORPUS_SLOT                 slot;
+        UINT64                      found = 0;
+
+        for (SIZE_T h = 0; h < hashes.size(); h++)
+        {
+            MakeCase(&corpusCase, PageFillSplitMix(h) % entries);
+            CorpusHashCase(corpusCase, &hashes[h]);
+        }
+        BenchReport("corpus/lookup hit", BenchRun([&](UINT64 iters) {
+            for (UINT64 i = 0; i < iters; i++)
+            {
+                found += store.Lookup(hashes[i & (hashes.size() - 1)], &slot);
+            }
+        }), "lookups/s");
+
+        for (SIZE_T h = 0; h < hashes.size(); h++)
+        {
+            hashes[h].bytes[31] ^= 0xff;
+        }
+        BenchReport("corpus/lookup miss", BenchRun([&](UINT64 iters) {
+            for (UINT64 i = 0; i < iters; i++)
+            {
+                found += store.Lookup(hashes[i & (hashes.size() - 1)], &slot);
+            }
+        }), "lookups/s");
+        BenchDoNotOptimize(found);
+    }
+
+    store.GetStats(&stats);
+    printf("[ ] %llu entries in %u segments, %llu index grows\n",
+           (unsigned long long)store.Count(),
+           store.Segments(),
+           (unsigned long long)stats.grows);
+    store.Close();
+
+    timer.Reset();
+    store.Open(dir.c_str());
+    secs = timer.Seconds();
+    BenchReport("corpus/open clean", secs * 1000, "ms");
+    store.Close();
+
+    {
+        FUZZ_JOURNAL_FD fd = CorpusOpenFile(dir + "/" + CORPUS_INDEX_NAME, FALSE);
+
+        if (fd != FUZZ_JOURNAL_INVALID_FD)
+        {
+            FuzzJournalFdTruncate(fd, 0);
+            CorpusCloseFile(fd);
+        }
+    }
+    timer.Reset();
+    store.Open(dir.c_str());
+    secs = timer.Seconds();
+    store.GetStats(&stats);
+    BenchReport("corpus/open rebuild", secs * 1000, "ms");
+    if (stats.rebuilt != entries)
+    {
+        printf("[-] rebuild found %llu of %llu entries\n",
+               (unsigned long long)stats.rebuilt,
+               (unsigned long long)entries);
+    }
+    store.Close();
+
+    RemoveStore(dir);
+}
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    UINT64 entries = 1000000;
+    UINT32 threads = 4;
+
+    if (argc > 1)
+    {
+        g_dir = argv[1];
+    }
+    if (argc > 2)
+    {
+        entries = strtoull(argv[2], NULL, 0);
+    }
+    if (argc > 3)
+    {
+        threads = (UINT32)atoi(argv[3]);
+    }
+    if (entries < 1000)
+    {
+        entries = 1000;
+    }
+    if (threads == 0)
+    {
+        threads = 1;
+    }
+
+    if (!CheckSha256() || !CheckStore() || !CheckSegments() || !CheckConcurrent())
+    {
+        return 1;
+    }
+    printf("[+] CorpusStore checks passed\n");
+
+    Bench(entries, threads);
+    return 0;
+}
@@ -0,0 +1,357 @@
+/*++
+
+Module Name:
+
+    BenchFastCall.cpp
+
+Abstract:
+
+    Extended fast call register layout (FastCall.h) and the register only
+    cases built on it, against the GPA backed cases they replace.
+
+    Checks (exit non-zero on failure)
+        - input marshals into RDX, R8, then the low and high qwords of
+          XMM0 - XMM5, zeroing the rest, and output comes out of the first
+          16 byte register pair past the input
+        - register only cases are extended fast calls with the call's fields
+          in the registers and no GPA marker anywhere, havoc on them with
+          MUTATOR_OP_MASK_REGISTER_ONLY keeps it that way
+        - the simulated backend reads fields from the upper XMM halves and
+          returns output in the registers past the input
+
+    Benchmarks
+        fastcall/marshal        - marshal and unmarshal of a full block/s
+        fastcall/gpa            - default case table on the simulated
+                                  backend, cases/s and effective
+        fastcall/register       - register only case table, cases/s and
+                                  effective
+
+    Effective cases are the ones InputGenIsEffectiveStatus accepts.
+
+    Usage: BenchFastCall
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <string>
+#include "ViFuBench.h"
+#include "../ViFuCore/HcSimBackend.h"
+#include "../ViFuCore/CaseSpace.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define BENCH_BATCH_SIZE    64
+
+static BOOL
+IsGpaMarker (
+    IN UINT64   value
+)
+{
+    return value == USE_GPA_MEM_FILL ||
+           value == USE_GPA_MEM_NOFILL_0 ||
+           value == USE_GPA_MEM_NOFILL_1 ||
+           value == USE_GPA_MEM_BIT_RANGE_LOOP ||
+           value == USE_GPA_MEM_LAYOUT ||
+           (value & ~(UINT64)USE_GPA_MEM_OFFSET_MASK) == USE_GPA_MEM_OFFSET;
+}
+
+static BOOL
+HasGpaMarker (
+    IN const CPU_REG_64 &regs
+)
+{
+    const UINT64 *pQwords = (const UINT64 *)&regs;
+
+    for (UINT32 q = 0; q < sizeof(CPU_REG_64) / sizeof(UINT64); q++)
+    {
+        if (q != offsetof(CPU_REG_64, rcx) / 8 && IsGpaMarker(pQwords[q]))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static BOOL
+CheckMarshal ()
+{
+    UINT8       input[FAST_CALL_MAX_INPUT + 8];
+    UINT8       output[FAST_CALL_MAX_INPUT];
+    CPU_REG_64  regs;
+
+    for (UINT32 b = 0; b < sizeof(input); b++)
+    {
+        input[b] = (UINT8)(b + 1);
+    }
+
+    memset(&regs, 0xcc, sizeof(regs));
+    CHECK(FastCallMarshalInput(&regs, input, FAST_CALL_MAX_INPUT));
+    CHECK(regs.rdx == 0x0807060504030201ULL);
+    CHECK(regs.r8 == 0x100f0e0d0c0b0a09ULL);
+    CHECK(regs.xmm0.lower == 0x1817161514131211ULL && regs.xmm0.upper == 0x201f1e1d1c1b1a19ULL);
+    CHECK(regs.xmm5.upper == 0x706f6e6d6c6b6a69ULL);
+    CHECK(regs.rax == 0xccccccccccccccccULL && regs.r9 == 0xccccccccccccccccULL);
+    CHECK(!FastCallMarshalInput(&regs, input, FAST_CALL_MAX_INPUT + 1));
+
+    //
+    // A partial qword is zero padded, the registers past it are zeroed
+    //
+    memset(&regs, 0xcc, sizeof(regs));
+    CHECK(FastCallMarshalInput(&regs, input, 19));
+    CHECK(regs.rdx == 0x0807060504030201ULL && regs.r8 == 0x100f0e0d0c0b0a09ULL);
+    CHECK(regs.xmm0.lower == 0x131211 && regs.xmm0.upper == 0);
+    CHECK(regs.xmm5.lower == 0 && regs.xmm5.upper == 0);
+
+    CHECK(FastCallOutputSlot(0) == 0);
+    CHECK(FastCallOutputSlot(8) == 2 && FastCallOutputSlot(16) == 2);
+    CHECK(FastCallOutputSlot(17) == 4 && FastCallOutputSlot(FAST_CALL_MAX_INPUT) == FAST_CALL_SLOTS);
+
+    regs.xmm0.lower = 0x1111111111111111ULL;
+    regs.xmm0.upper = 0x2222222222222222ULL;
+    regs.xmm1.lower = 0x3333333333333333ULL;
+    memset(output, 0, sizeof(output));
+    CHECK(FastCallUnmarshalOutput(&regs, 16, output, 20) == 20);
+    CHECK(output[0] == 0x11 && output[8] == 0x22 && output[16] == 0x33 && output[19] == 0x33 && output[20] == 0);
+    CHECK(FastCallUnmarshalOutput(&regs, 96, output, 64) == 16);
+    CHECK(FastCallUnmarshalOutput(&regs, FAST_CALL_MAX_INPUT, output, 8) == 0);
+    return TRUE;
+}
+
+static BOOL
+CheckCases ()
+{
+    HcFilter    filter;
+    FUZZ_CASE   fuzzCase;
+    UINT64      mutated = 0;
+
+    CaseSpace space(filter, 7, s_registerGenerators, _ARRAYSIZE(s_registerGenerators), MUTATOR_OP_MASK_REGISTER_ONLY);
+
+    CHECK(space.Count() != 0);
+    for (UINT64 i = 0; i < space.Count(); i++)
+    {
+        CHECK(space.Materialize(i, &fuzzCase));
+        CHECK((fuzzCase.regs.rcx >> 16) & 1);
+        CHECK((fuzzCase.regs.rcx & 0xffff) == fuzzCase.callcode);
+        CHECK(!HasGpaMarker(fuzzCase.regs));
+        CHECK(fuzzCase.regs.rax == 0 && fuzzCase.regs.rbx == 0 && fuzzCase.regs.r9 == 0);
+
+        if (space.Generator(fuzzCase.generator).pfnGenerate == CaseGenRegisterHavoc)
+        {
+            FUZZ_CASE base;
+
+            //
+            // Havoc case k starts from register case k % INPUT_GEN_CASES,
+            // only the slots and the control word may differ from it
+            //
+            CHECK(space.Materialize(i - fuzzCase.caseIdx + (fuzzCase.caseIdx - INPUT_GEN_CASES) % INPUT_GEN_CASES, &base));
+            base.regs.rcx = fuzzCase.regs.rcx;
+            for (UINT32 slot = 0; slot < FAST_CALL_SLOTS; slot++)
+            {
+                mutated += *FastCallSlot(&base.regs, slot) != *FastCallSlot(&fuzzCase.regs, slot);
+                *FastCallSlot(&base.regs, slot) = *FastCallSlot(&fuzzCase.regs, slot);
+            }
+            CHECK(memcmp(&base.regs, &fuzzCase.regs, sizeof(CPU_REG_64)) == 0);
+            continue;
+        }
+
+        //
+        // Field k % fields holds the value, in its register
+        //
+        UINT32 k = fuzzCase.caseIdx;
+        UINT32 fields = InputGenRegisterFieldCount(HcDescriptors[fuzzCase.callcode], fuzzCase.repCnt);
+        UINT64 value = s_inputGenValues[(k / fields) % _ARRAYSIZE(s_inputGenValues)];
+
+        CHECK(*FastCallSlot(&fuzzCase.regs, k % fields) == value);
+        if (fuzzCase.fast && fields < FAST_CALL_SLOTS)
+        {
+            CHECK(fuzzCase.regs.xmm5.upper == value);
+        }
+    }
+    CHECK(mutated != 0);
+    return TRUE;
+}
+
+static BOOL
+CheckSim ()
+{
+    HcSimBackend    sim;
+    CPU_REG_64      regs;
+    CPU_REG_64      out;
+    UINT16          repComplete = 0;
+    const HC_DESC   *pDesc = NULL;
+
+    //
+    // A simple call with 4 - 13 input qwords, one of its reserved fields
+    // in an upper XMM half and output that fits past the input
+    //
+    UINT32 reservedSlot = 0;
+    for (UINT32 callcode = 0; callcode < HC_DESC_COUNT && pDesc == NULL; callcode++)
+    {
+        const HC_DESC &desc = HcDescriptors[callcode];
+
+        if (InputGenIsRepCall(desc) || (desc.flags & HC_DESC_STUB) ||
+            desc.inputSize < 32 || desc.inputSize > FAST_CALL_MAX_INPUT - 16 || (desc.inputSize & 7) ||
+            desc.outputSize == 0 ||
+            FastCallOutputSlot(desc.inputSize) * 8 + desc.outputSize > FAST_CALL_MAX_INPUT)
+        {
+            continue;
+        }
+        for (UINT32 f = 3; f < desc.inputSize / 8; f += 2)
+        {
+            if (HcSimBackend::FieldKind(callcode, f) == HC_SIM_FIELD_RESERVED)
+            {
+                pDesc = &desc;
+                reservedSlot = f;
+                break;
+            }
+        }
+    }
+    CHECK(pDesc != NULL);
+
+    //
+    // Zero is in range for every field
+    //
+    memset(&regs, 0, sizeof(regs));
+    regs.rcx = pDesc->callcode | (1ULL << 16);
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_SUCCESS);
+
+    UINT32 outSlot = FastCallOutputSlot(pDesc->inputSize);
+    CHECK(*FastCallSlot(&out, outSlot) == 0xa5a5a5a5a5a5a5a5ULL);
+    CHECK(*FastCallSlot(&out, outSlot - 1) == *FastCallSlot(&regs, outSlot - 1));
+
+    *FastCallSlot(&regs, reservedSlot) = 1;
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_INVALID_PARAMETER);
+
+    //
+    // More input than the registers hold
+    //
+    for (UINT32 callcode = 0; callcode < HC_DESC_COUNT; callcode++)
+    {
+        const HC_DESC &desc = HcDescriptors[callcode];
+
+        if (!InputGenIsRepCall(desc) && !(desc.flags & HC_DESC_STUB) && desc.inputSize > FAST_CALL_MAX_INPUT)
+        {
+            memset(&regs, 0, sizeof(regs));
+            regs.rcx = callcode | (1ULL << 16);
+            CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_INVALID_HYPERCALL_INPUT);
+            break;
+        }
+    }
+    return TRUE;
+}
+
+typedef struct _CASE_COUNTS
+{
+    UINT64  cases;
+    UINT64  effective;
+} CASE_COUNTS;
+
+static VOID
+RunCases (
+    IN     const CaseSpace  &space,
+    IN     HcSimBackend     &sim,
+    IN     UINT16           flags,
+    IN     UINT64           iters,
+    IN OUT CASE_COUNTS      *pCounts
+)
+{
+    HcBatchEncoder  batch(BENCH_BATCH_SIZE);
+    HcBatchResults  results(BENCH_BATCH_SIZE);
+    FUZZ_CASE       fuzzCase;
+    UINT64          index = 0;
+
+    while (iters != 0)
+    {
+        batch.Reset();
+        batch.SetFlags(flags);
+        for (; iters != 0 && !batch.IsFull(); iters--)
+        {
+            space.Materialize(index, &fuzzCase);
+            batch.Add(fuzzCase.regs);
+            index = index + 1 == space.Count() ? 0 : index + 1;
+        }
+
+        sim.ExecBatch(batch, results);
+        for (UINT32 c = 0; c < results.Count(); c++)
+        {
+            pCounts->effective += InputGenIsEffectiveStatus(results[c].hvStatus);
+        }
+        pCounts->cases += results.Count();
+    }
+}
+
+static VOID
+Report (
+    IN const CHAR           *name,
+    IN const CASE_COUNTS    &counts,
+    IN double               rate
+)
+{
+    double effective = counts.cases ? 100.0 * counts.effective / counts.cases : 0.0;
+    std::string percent = std::string(name) + " effective";
+
+    printf("%-48s %16.2f cases/s, %5.1f%% effective\n", name, rate, effective);
+    BenchRecord(name, rate, "cases/s");
+    BenchRecord(percent.c_str(), effective, "%");
+}
+
+int
+main ()
+{
+    HcSimBackend    sim;
+    HcFilter        filter;
+    CASE_COUNTS     gpa = {};
+    CASE_COUNTS     reg = {};
+
+    if (!CheckMarshal() || !CheckCases() || !CheckSim())
+    {
+        return 1;
+    }
+    printf("[+] fast call checks passed\n");
+
+    double marshalRate = BenchRun([&](UINT64 iters) {
+        UINT64      input[FAST_CALL_SLOTS] = { 1, 2, 3 };
+        UINT64      output[FAST_CALL_SLOTS];
+        CPU_REG_64  regs;
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            input[0] = i;
+            FastCallMarshalInput(&regs, input, sizeof(input));
+            FastCallUnmarshalOutput(&regs, 0, output, sizeof(output));
+            BenchDoNotOptimize(output);
+        }
+    });
+    BenchReport("fastcall/marshal", marshalRate, "blocks/s");
+
+    CaseSpace gpaSpace(filter, 7);
+    CaseSpace regSpace(filter, 7, s_registerGenerators, _ARRAYSIZE(s_registerGenerators), MUTATOR_OP_MASK_REGISTER_ONLY);
+
+    RunCases(gpaSpace, sim, 0, gpaSpace.Count(), &gpa);
+    RunCases(regSpace, sim, HYPERCALL_BATCH_FLAG_REGISTER_ONLY, regSpace.Count(), &reg);
+
+    double gpaRate = BenchRun([&](UINT64 iters) {
+        CASE_COUNTS counts = {};
+        RunCases(gpaSpace, sim, 0, iters, &counts);
+        BenchDoNotOptimize(counts);
+    });
+    double regRate = BenchRun([&](UINT64 iters) {
+        CASE_COUNTS counts = {};
+        RunCases(regSpace, sim, HYPERCALL_BATCH_FLAG_REGISTER_ONLY, iters, &counts);
+        BenchDoNotOptimize(counts);
+    });
+
+    Report("fastcall/gpa", gpa, gpaRate);
+    Report("fastcall/register", reg, regRate);
+    printf("%-48s %16.2fx\n", "fastcall/register vs gpa", regRate / gpaRate);
+    BenchRecord("fastcall/register vs gpa", regRate / gpaRate, "x");
+    return 0;
+}
@@ -0,0 +1,266 @@
+/*++
+
+Module Name:
+
+    BenchGpaPool.cpp
+
+Abstract:
+
+    Checks and benchmarks GpaPool on heap pages with fake PAs.
+
+    Checks (exit non-zero on failure)
+        - every page is page aligned, has a unique PA and its cached PA
+          matches the platform translation
+        - a taken slot is never handed out twice, the pool reports exhaustion
+          once every slot is claimed and pages go back on release
+        - threads claiming the same processor's slot never share pages
+
+    Benchmarks, cases/s of page setup only (no fill, no hypercall)
+        gpa/alloc+zero      - what IOCTL_HYPERCALL used to do per case
+        gpa/pool/per-case   - claim and release a pair per case
+        gpa/pool/batch:64   - claim once per 64 cases, as a batch or doorbell
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <set>
+#include "ViFuBench.h"
+#include "../ViFuCore/GpaPool.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+static BOOL
+CheckLayout ()
+{
+    GPA_POOL            pool;
+    std::set<UINT64>    pas;
+
+    CHECK(GpaPoolInit(&pool, 8, 4));
+
+    for (UINT32 p = 0; p < 8 * 4; p++)
+    {
+        PGPA_PAGE pPage = &pool.pPages[p];
+
+        CHECK(((UINT64)(SIZE_T)pPage->pVa & (GPA_PAGE_SIZE - 1)) == 0);
+        CHECK(pPage->pa == GpaPlatformGetPhysical(pPage->pVa));
+        CHECK((pPage->pa & (GPA_PAGE_SIZE - 1)) == 0);
+        CHECK(pas.insert(pPage->pa).second);
+    }
+
+    for (UINT32 c = 0; c < 8; c++)
+    {
+        CHECK(pool.pCpus[c].freeCnt == 4);
+    }
+
+    GpaPoolDestroy(&pool);
+    CHECK(pool.pPages == NULL && pool.pCpus == NULL);
+    return TRUE;
+}
+
+static BOOL
+CheckClaims ()
+{
+    GPA_POOL        pool;
+    GPA_PAGE_PAIR   pairs[4];
+    GPA_PAGE_PAIR   extra;
+
+    CHECK(GpaPoolInit(&pool, 4, GPA_POOL_PAGES_PER_CPU));
+
+    //
+    // Everyone asks for processor 2, each must land on a different slot
+    //
+    for (UINT32 i = 0; i < 4; i++)
+    {
+        CHECK(GpaPoolAcquirePair(&pool, 2, &pairs[i]));
+        CHECK(pairs[i].pIn != pairs[i].pOut);
+        CHECK(pairs[i].pCpu->freeCnt == 0);
+
+        for (UINT32 j = 0; j < i; j++)
+        {
+            CHECK(pairs[i].pCpu != pairs[j].pCpu);
+        }
+    }
+    CHECK(pairs[0].pCpu == &pool.pCpus[2]);
+    CHECK(pairs[1].pCpu == &pool.pCpus[3]);
+    CHECK(pairs[2].pCpu == &pool.pCpus[0]);
+
+    //
+    // Exhausted
+    //
+    CHECK(!GpaPoolAcquirePair(&pool, 0, &extra));
+    CHECK(!GpaPoolAcquirePair(&pool, 7, &extra));
+
+    GpaPoolReleasePair(&pairs[0]);
+    CHECK(pool.pCpus[2].freeCnt == GPA_POOL_PAGES_PER_CPU);
+    CHECK(GpaPoolAcquirePair(&pool, 1, &extra));
+    CHECK(extra.pCpu == &pool.pCpus[2]);
+
+    //
+    // A slot left with too few pages is unlocked again, not half claimed
+    //
+    GpaPoolReleasePair(&pairs[1]);
+    PGPA_PAGE pPage0 = GpaPoolPop(&pool.pCpus[3]);
+    PGPA_PAGE pPage1 = GpaPoolPop(&pool.pCpus[3]);
+    CHECK(pPage0 != NULL && pPage1 != NULL);
+    CHECK(!GpaPoolAcquirePair(&pool, 3, &extra));
+    CHECK(pool.pCpus[3].lock == 0 && pool.pCpus[3].freeCnt == 0);
+    GpaPoolPush(&pool.pCpus[3], pPage1);
+    CHECK(!GpaPoolAcquirePair(&pool, 3, &extra));
+    CHECK(pool.pCpus[3].lock == 0 && pool.pCpus[3].freeCnt == 1);
+    GpaPoolPush(&pool.pCpus[3], pPage0);
+    CHECK(GpaPoolAcquirePair(&pool, 3, &extra));
+
+    GpaPoolDestroy(&pool);
+    return TRUE;
+}
+
+//
+// Threads all claim the same processor and stamp their pages, any page seen
+// with another thread's stamp while claimed means a slot was shared
+//
+static BOOL
+CheckThreads (
+    IN UINT32   threadCnt,
+    IN UINT32   iters
+)
+{
+    GPA_POOL                    pool;
+    std::atomic<UINT64>         clashes(0);
+    std::atomic<UINT64>         starved(0);
+    std::vector<std::thread>    threads;
+
+    CHECK(GpaPoolInit(&pool, threadCnt, GPA_POOL_PAGES_PER_CPU));
+
+    for (UINT32 t = 0; t < threadCnt; t++)
+    {
+        threads.emplace_back([&, t]() {
+            for (UINT32 i = 0; i < iters; i++)
+            {
+                GPA_PAGE_PAIR pair;
+                UINT64        stamp = ((UINT64)(t + 1) << 32) | i;
+
+                if (!GpaPoolAcquirePair(&pool, 0, &pair))
+                {
+                    starved++;
+                    continue;
+                }
+
+                *(volatile UINT64 *)pair.pIn->pVa = stamp;
+                *(volatile UINT64 *)pair.pOut->pVa = ~stamp;
+                if ((i & 0xF) == 0)
+                {
+                    std::this_thread::yield();
+                }
+                if (*(volatile UINT64 *)pair.pIn->pVa != stamp ||
+                    *(volatile UINT64 *)pair.pOut->pVa != ~stamp)
+                {
+                    clashes++;
+                }
+
+                GpaPoolReleasePair(&pair);
+            }
+        });
+    }
+
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    for (UINT32 c = 0; c < threadCnt; c++)
+    {
+        CHECK(pool.pCpus[c].freeCnt == GPA_POOL_PAGES_PER_CPU && pool.pCpus[c].lock == 0);
+    }
+
+    GpaPoolDestroy(&pool);
+
+    //
+    // As many slots as threads, so nobody should ever be turned away
+    //
+    CHECK(clashes == 0);
+    CHECK(starved == 0);
+    return TRUE;
+}
+
+static VOID
+Bench ()
+{
+    GPA_POOL    pool;
+    UINT64      sink = 0;
+
+    double legacy = BenchRun([&](UINT64 iters) {
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            PCHAR pPage = (PCHAR)GpaPlatformAlloc(GPA_PAGE_SIZE);
+
+            memset(pPage, 0, GPA_PAGE_SIZE);
+            sink += GpaPlatformGetPhysical(pPage);
+            BenchDoNotOptimize(pPage);
+            GpaPlatformFree(pPage);
+        }
+    });
+    BenchReport("gpa/alloc+zero", legacy, "cases/s");
+
+    if (!GpaPoolInit(&pool, 1, GPA_POOL_PAGES_PER_CPU))
+    {
+        return;
+    }
+
+    double perCase = BenchRun([&](UINT64 iters) {
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            GPA_PAGE_PAIR pair;
+
+            GpaPoolAcquirePair(&pool, 0, &pair);
+            sink += pair.pIn->pa ^ pair.pOut->pa;
+            GpaPoolReleasePair(&pair);
+        }
+    });
+    BenchReport("gpa/pool/per-case", perCase, "cases/s");
+
+    double perBatch = BenchRun([&](UINT64 iters) {
+        GPA_PAGE_PAIR pair = { 0 };
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            if ((i & 0x3F) == 0)
+            {
+                GpaPoolAcquirePair(&pool, 0, &pair);
+            }
+            sink += pair.pIn->pa ^ pair.pOut->pa;
+            BenchDoNotOptimize(sink);
+            if ((i & 0x3F) == 0x3F || i + 1 == iters)
+            {
+                GpaPoolReleasePair(&pair);
+            }
+        }
+    });
+    BenchReport("gpa/pool/batch:64", perBatch, "cases/s");
+
+    BenchDoNotOptimize(sink);
+    GpaPoolDestroy(&pool);
+}
+
+int
+main ()
+{
+    if (!CheckLayout() || !CheckClaims() || !CheckThreads(4, 200000))
+    {
+        return 1;
+    }
+    printf("[+] GpaPool checks passed\n");
+
+    Bench();
+    return 0;
+}
@@ -0,0 +1,342 @@
+/*++
+
+Module Name:
+
+    BenchHcLatency.cpp
+
+Abstract:
+
+    Per call code and status latency histograms and the outlier detector
+    (HcLatency.h).
+
+    Checks (exit non-zero on failure)
+        - ConcurrentLatencyHistogram gives the same count, sum, max and
+          percentiles as LatencyHistogram on the same samples, and loses
+          no sample recorded from several threads at once
+        - cases land in their status's histogram and in the call code's,
+          statuses past HC_LATENCY_STATUSES share the last one
+        - nothing is an outlier before warmup, after it only cases the
+          set powers of 10 away from the median are, either way
+        - on the simulated backend, a rep call filling its input page with
+          reps is a slow outlier among the same call code running one
+        - Ranked puts the slowest 99th percentile first
+
+    Benchmarks
+        latency/histogram           - LatencyHistogram records/s, one thread
+        latency/record              - HcLatency records/s, one thread
+        latency/record N shared     - N threads recording one call code
+        latency/record N spread     - N threads recording a call code each
+
+    Usage: BenchHcLatency
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <thread>
+#include <vector>
+#include "ViFuBench.h"
+#include "../ViFuCore/HcLatency.h"
+#include "../ViFuCore/HcSimBackend.h"
+#include "../ViFuCore/InputGenerator.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define BENCH_MAX_THREADS   8
+
+//
+// xorshift, samples spread over several orders of magnitude
+//
+static UINT64
+NextSample (
+    IN OUT UINT64   *pState
+)
+{
+    *pState ^= *pState << 13;
+    *pState ^= *pState >> 7;
+    *pState ^= *pState << 17;
+    return (*pState >> 40) >> (*pState & 15);
+}
+
+static BOOL
+CheckConcurrent ()
+{
+    ConcurrentLatencyHistogram  concurrent;
+    LatencyHistogram            reference;
+    LatencyHistogram            snapshot;
+    UINT64                      state = 0x9E3779B97F4A7C15ULL;
+
+    for (UINT32 i = 0; i < 100000; i++)
+    {
+        UINT64 sample = NextSample(&state);
+
+        CHECK(concurrent.Record(sample) == i);
+        reference.Record(sample);
+    }
+
+    concurrent.Snapshot(&snapshot);
+    CHECK(snapshot.Count() == reference.Count() && concurrent.Count() == reference.Count());
+    CHECK(snapshot.Max() == reference.Max() && snapshot.Mean() == reference.Mean());
+    for (double pct = 0; pct <= 100; pct += 12.5)
+    {
+        CHECK(snapshot.Percentile(pct) == reference.Percentile(pct));
+    }
+    CHECK(snapshot.Percentile(99.9) == reference.Percentile(99.9));
+
+    //
+    // Threads recording disjoint ranges, thread t's max is t's last sample
+    //
+    ConcurrentLatencyHistogram  shared;
+    std::vector<std::thread>    threads;
+
+    for (UINT32 t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&shared, t]() {
+            for (UINT64 i = 0; i < 200000; i++)
+            {
+                shared.Record(t * 1000000 + i);
+            }
+        });
+    }
+    for (SIZE_T t = 0; t < threads.size(); t++)
+    {
+        threads[t].join();
+    }
+
+    shared.Snapshot(&snapshot);
+    CHECK(snapshot.Count() == 800000 && shared.Count() == 800000);
+    CHECK(snapshot.Max() == 3000000 + 199999);
+    CHECK(snapshot.Mean() == (0 + 1000000 + 2000000 + 3000000) / 4.0 + 199999 / 2.0);
+    return TRUE;
+}
+
+static BOOL
+CheckStatuses ()
+{
+    HcLatency           latency;
+    LatencyHistogram    hist;
+
+    for (UINT32 i = 0; i < 10; i++)
+    {
+        latency.Record(0x13, HV_STATUS_SUCCESS, 100);
+    }
+    for (UINT32 i = 0; i < 20; i++)
+    {
+        latency.Record(0x13, HV_STATUS_INVALID_PARAMETER, 200);
+    }
+    latency.Record(0x13, 0x90, 300);
+    latency.Record(0x13, 0xffff, 400);
+    latency.Record(HC_DESC_COUNT, HV_STATUS_SUCCESS, 100);
+
+    CHECK(latency.Get(0x13, HV_STATUS_SUCCESS, &hist) && hist.Count() == 10 && hist.Max() == 100);
+    CHECK(latency.Get(0x13, HV_STATUS_INVALID_PARAMETER, &hist) && hist.Count() == 20 && hist.Max() == 200);
+    CHECK(latency.Get(0x13, 0x90, &hist) && hist.Count() == 2 && hist.Max() == 400);
+    CHECK(latency.Get(0x13, HC_LATENCY_STATUSES - 1, &hist) && hist.Count() == 2);
+    CHECK(!latency.Get(0x13, HV_STATUS_ACCESS_DENIED, &hist) && hist.Count() == 0);
+    CHECK(latency.Get(0x13, HC_LATENCY_ANY_STATUS, &hist) && hist.Count() == 32 && hist.Max() == 400);
+    CHECK(!latency.Get(0x14, HC_LATENCY_ANY_STATUS, &hist));
+    CHECK(!latency.Get(HC_DESC_COUNT, HC_LATENCY_ANY_STATUS, &hist));
+    return TRUE;
+}
+
+static BOOL
+CheckOutliers ()
+{
+    HcLatency   latency(3, 1024);
+    UINT64      state = 1;
+
+    //
+    // 900 - 1100 cycles, nothing is judged before the 1024th
+    //
+    CHECK(latency.Record(0x13, HV_STATUS_SUCCESS, 100000000) == HC_LATENCY_NORMAL);
+    for (UINT32 i = 1; i < 1024; i++)
+    {
+        CHECK(latency.Record(0x13, HV_STATUS_SUCCESS, 900 + NextSample(&state) % 201) == HC_LATENCY_NORMAL);
+    }
+
+    UINT64 median = latency.Median(0x13);
+    CHECK(median >= 900 && median <= 1100 + 1100 / LATENCY_HIST_SUB_BUCKETS);
+    CHECK(latency.Median(0x14) == 0);
+
+    CHECK(latency.Record(0x13, HV_STATUS_SUCCESS, median * 1000) == HC_LATENCY_NORMAL);
+    CHECK(latency.Record(0x13, HV_STATUS_SUCCESS, median * 1001 + 1000) == HC_LATENCY_SLOW);
+    CHECK(latency.Record(0x13, HV_STATUS_INVALID_PARAMETER, 100000000) == HC_LATENCY_SLOW);
+    CHECK(latency.Record(0x13, HV_STATUS_SUCCESS, 1000) == HC_LATENCY_NORMAL);
+    CHECK(latency.Record(0x13, HV_STATUS_SUCCESS, 2) == HC_LATENCY_NORMAL);
+    CHECK(latency.Record(0x13, HV_STATUS_SUCCESS, 0) == HC_LATENCY_FAST);
+
+    //
+    // Another call code has its own median
+    //
+    for (UINT32 i = 0; i < 1024; i++)
+    {
+        CHECK(latency.Record(0x14, HV_STATUS_SUCCESS, 10) == HC_LATENCY_NORMAL);
+    }
+    CHECK(latency.Record(0x14, HV_STATUS_SUCCESS, 100000) == HC_LATENCY_SLOW);
+    CHECK(latency.Record(0x13, HV_STATUS_SUCCESS, 100000) == HC_LATENCY_NORMAL);
+
+    CHECK(latency.Outliers(0x13, HC_LATENCY_SLOW) == 2 && latency.Outliers(0x13, HC_LATENCY_FAST) == 1);
+    CHECK(latency.Outliers(0x14, HC_LATENCY_SLOW) == 1 && latency.Outliers(0x14, HC_LATENCY_FAST) == 0);
+
+    std::vector<HC_LATENCY_SUMMARY> ranked = latency.Ranked();
+    CHECK(ranked.size() == 2);
+    CHECK(ranked[0].callcode == 0x13 && ranked[0].p99 >= ranked[1].p99);
+    CHECK(ranked[0].cases == 1031 && ranked[0].slow == 2 && ranked[0].max == 100000000);
+    CHECK(ranked[1].callcode == 0x14 && ranked[1].p50 == 10);
+    return TRUE;
+}
+
+//
+// A rep call the simulator accepts with every field 0
+//
+static const HC_DESC *
+FindRepCall ()
+{
+    for (UINT32 callcode = 0; callcode < HC_DESC_COUNT; callcode++)
+    {
+        const HC_DESC &desc = HcDescriptors[callcode];
+
+        if (InputGenIsRepCall(desc) && !(desc.flags & HC_DESC_STUB) &&
+            desc.inputSize <= 64 && desc.outputSize <= 64)
+        {
+            return &desc;
+        }
+    }
+    return NULL;
+}
+
+static BOOL
+CheckSim ()
+{
+    HcSimBackend    sim;
+    HcBatchEncoder  batch(64);
+    HcBatchResults  results(64);
+    HcLatency       latency(2, 256);
+    CPU_REG_64      regs;
+    const HC_DESC   *pDesc = FindRepCall();
+    UINT32          slow = 0;
+    UINT32          pageFill = 0;
+
+    CHECK(pDesc != NULL);
+    pageFill = (INPUT_LAYOUT_PAGE_SIZE - ((pDesc->inputSize + 7u) & ~7u)) / 8;
+
+    //
+    // Each rep costs 100ns, so a page full of reps is hundreds of times one
+    // rep. Only the long ones are checked, a preempted short one can be
+    // slow too
+    //
+    sim.SetLatency(0, 100);
+    memset(&regs, 0, sizeof(regs));
+    regs.rdx = USE_GPA_MEM_NOFILL_0;
+    regs.r8 = pDesc->outputSize != 0 ? USE_GPA_MEM_NOFILL_0 : 0;
+
+    for (UINT32 b = 0; b < 8; b++)
+    {
+        batch.Reset();
+        for (UINT32 c = 0; c < 64; c++)
+        {
+            BOOL bLong = b == 7 && c % 16 == 0;
+
+            regs.rcx = pDesc->callcode | ((UINT64)(bLong ? pageFill : 1) << HV_CONTROL_REP_COUNT_SHIFT);
+            batch.Add(regs);
+        }
+
+        CHECK(sim.ExecBatch(batch, results) == 0 && results.Count() == 64);
+        for (UINT32 c = 0; c < results.Count(); c++)
+        {
+            HC_LATENCY_OUTLIER outlier = latency.Record(pDesc->callcode, results[c].hvStatus, results[c].cycles);
+
+            CHECK(results[c].hvStatus == HV_STATUS_SUCCESS);
+            CHECK(outlier != HC_LATENCY_FAST);
+            slow += b == 7 && c % 16 == 0 && outlier == HC_LATENCY_SLOW;
+        }
+    }
+    CHECK(slow == 4);
+    return TRUE;
+}
+
+static double
+RunThreads (
+    IN HcLatency    &latency,
+    IN UINT32       threadCnt,
+    IN BOOL         bSpread
+)
+{
+    return BenchRun([&](UINT64 iters) {
+        std::vector<std::thread> threads;
+
+        for (UINT32 t = 0; t < threadCnt; t++)
+        {
+            threads.emplace_back([&latency, t, iters, threadCnt, bSpread]() {
+                UINT64 state = t + 1;
+                UINT32 callcode = bSpread ? t + 1 : 1;
+
+                for (UINT64 i = t; i < iters; i += threadCnt)
+                {
+                    latency.Record(callcode, HV_STATUS_SUCCESS, NextSample(&state));
+                }
+            });
+        }
+        for (SIZE_T t = 0; t < threads.size(); t++)
+        {
+            threads[t].join();
+        }
+    });
+}
+
+int
+main ()
+{
+    UINT32 threadCnt = std::thread::hardware_concurrency();
+
+    if (!CheckConcurrent() || !CheckStatuses() || !CheckOutliers() || !CheckSim())
+    {
+        return 1;
+    }
+    printf("[+] latency checks passed\n");
+
+    double rate = BenchRun([](UINT64 iters) {
+        LatencyHistogram hist;
+        UINT64 state = 1;
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            hist.Record(NextSample(&state));
+        }
+        BenchDoNotOptimize(hist);
+    });
+    BenchReport("latency/histogram", rate, "records/s");
+
+    HcLatency latency;
+
+    rate = BenchRun([&](UINT64 iters) {
+        UINT64 state = 1;
+        UINT32 outliers = 0;
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            outliers += latency.Record(1, HV_STATUS_SUCCESS, NextSample(&state)) != HC_LATENCY_NORMAL;
+        }
+        BenchDoNotOptimize(outliers);
+    });
+    BenchReport("latency/record", rate, "records/s");
+
+    threadCnt = threadCnt < 2 ? 2 : (threadCnt > BENCH_MAX_THREADS ? BENCH_MAX_THREADS : threadCnt);
+    for (UINT32 t = 2; t <= threadCnt; t *= 2)
+    {
+        CHAR name[64];
+
+        snprintf(name, sizeof(name), "latency/record %u shared", t);
+        BenchReport(name, RunThreads(latency, t, FALSE), "records/s");
+        snprintf(name, sizeof(name), "latency/record %u spread", t);
+        BenchReport(name, RunThreads(latency, t, TRUE), "records/s");
+    }
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*++
+
+Module Name:
+
+    BenchHypercallTable.cpp
+
+Abstract:
+
+    Checks the hypercall descriptor table and config overrides, and measures
+    the per-case call code filtering of the fuzzer loop before and after.
+
+    Checks (exit non-zero on failure)
+        - the default bitmaps deny exactly the call codes the old loop skipped
+        - config lines allow, deny and ranges apply in order, a bad line is
+          reported with its number
+
+    Benchmarks
+        filter/strstr + scan (old)  - name strstr and BSOD list scan per case
+        filter/bitmap per case      - HcFilter::IsAllowed per case
+        filter/bitmap per callcode  - one test per call code, what ViFuR3 does
+
+    Usage: BenchHypercallTable [scratch directory, default .]
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <string>
+#include "ViFuBench.h"
+#include "../ViFuCore/CaseSpace.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+//
+// Cases per call code of the fuzzer loop: rep 0-2, fast 0-1, i 0-INPUT_GEN_LAST_CASE
+// and 64 havoc cases (VIFU_HAVOC_CASES)
+//
+#define CASES_PER_CALLCODE  (3 * 2 * CASE_SPACE_CASES)
+
+static const UINT16 s_oldBsodCallcodes[] = { 0x01, 0x0a, 0x11, 0x12 };
+
+static std::string g_dir = ".";
+
+static BOOL
+OldIsAvoided (
+    IN UINT32   callcode
+)
+{
+    if (strstr(HcDescriptors[callcode].name, "Reserved") != 0)
+    {
+        return TRUE;
+    }
+
+    for (UINT32 b = 0; b < _ARRAYSIZE(s_oldBsodCallcodes); b++)
+    {
+        if (s_oldBsodCallcodes[b] == callcode)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static BOOL
+CheckDefaults ()
+{
+    HcFilter filter;
+
+    for (UINT32 callcode = 0; callcode < HC_DESC_COUNT; callcode++)
+    {
+        CHECK(filter.IsAllowed(callcode) == !OldIsAvoided(callcode));
+        CHECK(filter.IsDenied(callcode) == OldIsAvoided(callcode));
+        CHECK(HcLookup(callcode)->callcode == callcode);
+    }
+    CHECK(HcLookup(HC_DESC_COUNT) == NULL);
+    CHECK(!filter.IsAllowed(0xffff));
+
+    printf("[+] hypercall table default checks passed\n");
+    return TRUE;
+}
+
+static BOOL
+CheckConfig ()
+{
+    std::string path = g_dir + "/hypercalls.cfg";
+    HcFilter    filter;
+    UINT32      badLine = 0;
+    FILE        *pFile = fopen(path.c_str(), "w");
+
+    CHECK(pFile != NULL);
+    fprintf(pFile,
+            "# child partition\n"
+            "\n"
+            "allow 0x7f\n"
+            "deny  0x40-0x4f   # partition management\n"
+            "allow 0x46\n"
+            "deny 18\n");
+    fclose(pFile);
+
+    CHECK(filter.LoadConfig(path.c_str(), &badLine));
+    CHECK(filter.IsAllowed(0x7f));
+    CHECK(!filter.IsAllowed(0x40) && !filter.IsAllowed(0x4f) && filter.IsDenied(0x45));
+    CHECK(filter.IsAllowed(0x46) && !filter.IsDenied(0x46));
+    CHECK(!filter.IsAllowed(0x12) && filter.IsAllowed(0x50));
+
+    pFile = fopen(path.c_str(), "w");
+    CHECK(pFile != NULL);
+    fprintf(pFile, "allow 0x7f\nallow 0x10-0x8\n");
+    fclose(pFile);
+
+    HcFilter bad;
+    CHECK(!bad.LoadConfig(path.c_str(), &badLine));
+    CHECK(badLine == 2 && bad.IsAllowed(0x7f));
+
+    for (const CHAR *pLine : { "permit 1\n", "deny\n", "deny 0x10000\n", "deny 1 2\n", "allow 0x1-\n" })
+    {
+        pFile = fopen(path.c_str(), "w");
+        CHECK(pFile != NULL);
+        fputs(pLine, pFile);
+        fclose(pFile);
+        CHECK(!bad.LoadConfig(path.c_str(), &badLine) && badLine == 1);
+    }
+
+    CHECK(!bad.LoadConfig((path + ".missing").c_str(), &badLine) && badLine == 0);
+
+    remove(path.c_str());
+    printf("[+] hypercall config checks passed\n");
+    return TRUE;
+}
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    HcFilter filter;
+
+    if (argc > 1)
+    {
+        g_dir = argv[1];
+    }
+
+    if (!CheckDefaults() || !CheckConfig())
+    {
+        return 1;
+    }
+
+    //
+    // Each unit is one case of the loop
+    //
+    BenchReport("filter/strstr + scan (old)", BenchRun([](UINT64 iters) {
+        UINT64 allowed = 0;
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            UINT32 callcode = (UINT32)((i / CASES_PER_CALLCODE) % HC_DESC_COUNT);
+
+            BenchDoNotOptimize(callcode);
+            allowed += !OldIsAvoided(callcode);
+        }
+        BenchDoNotOptimize(allowed);
+    }), "cases/s");
+
+    BenchReport("filter/bitmap per case", BenchRun([&](UINT64 iters) {
+        UINT64 allowed = 0;
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            UINT32 callcode = (UINT32)((i / CASES_PER_CALLCODE) % HC_DESC_COUNT);
+
+            BenchDoNotOptimize(callcode);
+            allowed += filter.IsAllowed(callcode);
+        }
+        BenchDoNotOptimize(allowed);
+    }), "cases/s");
+
+    BenchReport("filter/bitmap per callcode", BenchRun([&](UINT64 iters) {
+        UINT64 allowed = 0;
+        UINT32 callcode = 0;
+        BOOL isAllowed = filter.IsAllowed(0);
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            if (i % CASES_PER_CALLCODE == 0)
+            {
+                callcode = (UINT32)((i / CASES_PER_CALLCODE) % HC_DESC_COUNT);
+                BenchDoNotOptimize(callcode);
+                isAllowed = filter.IsAllowed(callcode);
+            }
+            allowed += isAllowed;
+        }
+        BenchDoNotOptimize(allowed);
+    }), "cases/s");
+
+    return 0;
+}
@@ -0,0 +1,379 @@
+/*++
+
+Module Name:
+
+    BenchInputGen.cpp
+
+Abstract:
+
+    Compares the blind page fills of the fuzzer loop with the structure-aware
+    cases of InputGenerator.h on the simulated backend, by how many cases get
+    past the basic input checks.
+
+    Checks (exit non-zero on failure)
+        - layouts pack and unpack, the header, rep elements and one field are
+          written, the output GPA leaves exactly outputSize bytes in its page
+        - the simulated backend fails misaligned, foreign and page crossing
+          GPAs, and passes a valid structured case
+        - structured cases get past validation more often than blind ones
+
+    Benchmarks
+        inputgen/blind      - cases 0 - 136 of the loop, cases/s and effective
+        inputgen/structured - generated cases, cases/s and effective
+
+    Effective cases are the ones InputGenIsEffectiveStatus accepts.
+
+    Usage: BenchInputGen
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include "ViFuBench.h"
+#include "../ViFuCore/HcSimBackend.h"
+#include "../ViFuCore/InputGenerator.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define BENCH_BATCH_SIZE    64
+
+typedef VOID (*CASE_FN)(IN const HC_DESC &desc, IN UINT32 i, IN OUT PCPU_REG_64 pRegs);
+
+//
+// Blind cases as set by the switch in ViFuR3 (XMM-only cases look like case 5
+// to the simulated backend)
+//
+static VOID
+BlindCase (
+    IN     const HC_DESC    &desc,
+    IN     UINT32           i,
+    IN OUT PCPU_REG_64      pRegs
+)
+{
+    (VOID)desc;
+
+    if (i >= 120 && i <= 123)
+    {
+        return;
+    }
+    if (i >= 72)
+    {
+        pRegs->rdx = USE_GPA_MEM_BIT_RANGE_LOOP;
+        pRegs->r8 = USE_GPA_MEM_BIT_RANGE_LOOP;
+        pRegs->rax = 1ULL << (i - 72);
+    }
+    else if (i >= 8)
+    {
+        pRegs->rdx = USE_GPA_MEM_BIT_RANGE_LOOP;
+        pRegs->rax = 1ULL << (i - 8);
+    }
+    else if (i == 7)
+    {
+        pRegs->rdx = USE_GPA_MEM_NOFILL_1;
+    }
+    else if (i == 6)
+    {
+        pRegs->rdx = USE_GPA_MEM_NOFILL_0;
+    }
+    else if (i <= 4)
+    {
+        pRegs->rdx = USE_GPA_MEM_FILL;
+        pRegs->r8 = i >= 1 ? USE_GPA_MEM_FILL : 0;
+        pRegs->r9 = i >= 2 ? USE_GPA_MEM_FILL : 0;
+        pRegs->r10 = i >= 3 ? USE_GPA_MEM_FILL : 0;
+        pRegs->r11 = i >= 4 ? USE_GPA_MEM_FILL : 0;
+    }
+}
+
+static VOID
+StructuredCase (
+    IN     const HC_DESC    &desc,
+    IN     UINT32           i,
+    IN OUT PCPU_REG_64      pRegs
+)
+{
+    InputGenCase(desc, i, pRegs);
+}
+
+//
+// Walks callcode x rep 0-2 x fast 0-1 x case like the fuzzer loop, over the
+// call codes the default filter allows
+//
+class CaseWalker
+{
+public:
+    CaseWalker (
+        IN CASE_FN  pCaseFn,
+        IN UINT32   cases
+    )
+        : m_pCaseFn(pCaseFn),
+          m_cases(cases),
+          m_callcode(0),
+          m_repCnt(0),
+          m_isFast(0),
+          m_i(0)
+    {
+        SkipDenied();
+    }
+
+    UINT64
+    SpaceSize () const
+    {
+        UINT64 callcodes = 0;
+
+        for (UINT32 c = 0; c < HC_DESC_COUNT; c++)
+        {
+            callcodes += m_filter.IsAllowed(c);
+        }
+        return callcodes * 3 * 2 * m_cases;
+    }
+
+    VOID
+    Next (
+        OUT PCPU_REG_64 pRegs
+    )
+    {
+        memset(pRegs, 0, sizeof(CPU_REG_64));
+        pRegs->rcx = m_callcode | ((UINT64)m_isFast << 16) | ((UINT64)m_repCnt << 32);
+        m_pCaseFn(HcDescriptors[m_callcode], m_i, pRegs);
+
+        if (++m_i < m_cases)
+        {
+            return;
+        }
+        m_i = 0;
+        if (++m_isFast <= 1)
+        {
+            return;
+        }
+        m_isFast = 0;
+        if (++m_repCnt <= 2)
+        {
+            return;
+        }
+        m_repCnt = 0;
+        m_callcode = (m_callcode + 1) % HC_DESC_COUNT;
+        SkipDenied();
+    }
+
+private:
+    VOID
+    SkipDenied ()
+    {
+        while (!m_filter.IsAllowed(m_callcode))
+        {
+            m_callcode = (m_callcode + 1) % HC_DESC_COUNT;
+        }
+    }
+
+    HcFilter    m_filter;
+    CASE_FN     m_pCaseFn;
+    UINT32      m_cases;
+    UINT32      m_callcode;
+    UINT32      m_repCnt;
+    UINT32      m_isFast;
+    UINT32      m_i;
+};
+
+typedef struct _CASE_COUNTS
+{
+    UINT64  cases;
+    UINT64  effective;
+    UINT64  byStatus[HV_STATUS_INVALID_PARAMETER + 2];
+} CASE_COUNTS;
+
+static VOID
+RunCases (
+    IN OUT CaseWalker       &walker,
+    IN     HcBackend        &backend,
+    IN     UINT64           count,
+    IN OUT CASE_COUNTS      *pCounts
+)
+{
+    HcBatchEncoder  batch(BENCH_BATCH_SIZE);
+    HcBatchResults  results(BENCH_BATCH_SIZE);
+    CPU_REG_64      regs;
+
+    for (UINT64 c = 0; c < count; c++)
+    {
+        walker.Next(&regs);
+        batch.Add(regs);
+        if (!batch.IsFull() && c + 1 < count)
+        {
+            continue;
+        }
+
+        backend.ExecBatch(batch, results);
+        for (UINT32 r = 0; r < results.Count(); r++)
+        {
+            HV_STATUS status = results[r].hvStatus;
+
+            pCounts->cases++;
+            pCounts->effective += InputGenIsEffectiveStatus(status);
+            pCounts->byStatus[status <= HV_STATUS_INVALID_PARAMETER ? status : HV_STATUS_INVALID_PARAMETER + 1]++;
+        }
+        batch.Reset();
+    }
+}
+
+static BOOL
+CheckLayout ()
+{
+    INPUT_LAYOUT    layout = {};
+    INPUT_LAYOUT    unpacked = {};
+    UINT64          page[0x1000 / 8] = {};
+
+    layout.headerSize = 0x18;
+    layout.outputSize = 0x14;
+    layout.repElementQwords = 2;
+    layout.field = 4;
+    layout.flags = INPUT_LAYOUT_FLAG_PARTITION_SELF;
+
+    InputLayoutUnpack(INPUT_LAYOUT_PACK(&layout), &unpacked);
+    CHECK(memcmp(&layout, &unpacked, sizeof(layout)) == 0);
+    CHECK(InputLayoutInputBytes(&layout, 3) == 0x18 + 3 * 16);
+    CHECK(InputLayoutInputBytes(&layout, 0xfff) == 0x1000);
+    CHECK(InputLayoutOutputOffset(&layout) == 0x1000 - 0x18);
+
+    InputLayoutBuild(page, &layout, 3, 0x1234);
+    CHECK(page[0] == HV_PARTITION_ID_SELF && page[4] == 0x1234);
+    CHECK(page[1] == 0 && page[2] == 0 && page[3] == 0 && page[5] == 0);
+
+    //
+    // A field past the rep elements is left alone
+    //
+    layout.field = 0x18 / 8 + 3 * 2;
+    page[layout.field] = 0;
+    InputLayoutBuild(page, &layout, 3, 0x1234);
+    CHECK(page[layout.field] == 0);
+
+    layout.outputSize = 0;
+    CHECK(InputLayoutOutputOffset(&layout) == 0);
+
+    printf("[+] input layout checks passed\n");
+    return TRUE;
+}
+
+static BOOL
+CheckSim ()
+{
+    HcSimBackend    sim;
+    CPU_REG_64      regs = {};
+    CPU_REG_64      out = {};
+    UINT16          repComplete = 0;
+    const HC_DESC   &desc = HcDescriptors[0x4];     // HvGetLogicalProcessorRunTime, 8 in 0x20 out
+
+    CHECK(desc.inputSize == 8 && desc.outputSize == 0x20 && desc.isRep == 0);
+
+    regs.rcx = 0x4;
+    InputGenCase(desc, 0, &regs);
+    CHECK(regs.rdx == USE_GPA_MEM_LAYOUT && regs.r8 == USE_GPA_MEM_LAYOUT);
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_SUCCESS);
+
+    regs.rcx = 0x4 | (1ULL << 27);
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_INVALID_HYPERCALL_INPUT);
+
+    regs.rcx = 0x4;
+    regs.rdx = HC_SIM_INPUT_GPA + 4;
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_INVALID_ALIGNMENT);
+    regs.rdx = 0x20000000;
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_INVALID_PARAMETER);
+    regs.rdx = HC_SIM_INPUT_GPA;
+    regs.r8 = HC_SIM_OUTPUT_GPA + 0x1000 - 0x18;
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_INVALID_HYPERCALL_INPUT);
+    regs.r8 = HC_SIM_OUTPUT_GPA + 0x1000 - 0x20;
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_SUCCESS);
+
+    //
+    // Rep call (HvFlushVirtualAddressList) needs a rep count
+    //
+    memset(&regs, 0, sizeof(regs));
+    regs.rcx = 0x3;
+    InputGenCase(HcDescriptors[0x3], 0, &regs);
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_INVALID_HYPERCALL_INPUT);
+    regs.rcx = 0x3 | (2ULL << 32);
+    HV_STATUS status = sim.Exec(&regs, &out, &repComplete);
+    CHECK(status == HV_STATUS_SUCCESS || status == HV_STATUS_INVALID_PARAMETER);
+    CHECK(status != HV_STATUS_SUCCESS || repComplete == 2);
+
+    regs.rcx = 0x5;
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_INVALID_HYPERCALL_CODE);
+
+    printf("[+] simulated backend checks passed\n");
+    return TRUE;
+}
+
+static VOID
+Report (
+    IN const CHAR           *name,
+    IN const CASE_COUNTS    &counts,
+    IN double               casesPerSec
+)
+{
+    CHAR line[64];
+    double ratio = (double)counts.effective / (double)counts.cases;
+
+    snprintf(line, sizeof(line), "%s cases", name);
+    BenchReport(line, casesPerSec, "cases/s");
+    snprintf(line, sizeof(line), "%s effective", name);
+    BenchReport(line, casesPerSec * ratio, "cases/s");
+    printf("    %llu of %llu effective (%.2f%%), code %llu input %llu alignment %llu parameter %llu\n",
+           (unsigned long long)counts.effective,
+           (unsigned long long)counts.cases,
+           ratio * 100,
+           (unsigned long long)counts.byStatus[HV_STATUS_INVALID_HYPERCALL_CODE],
+           (unsigned long long)counts.byStatus[HV_STATUS_INVALID_HYPERCALL_INPUT],
+           (unsigned long long)counts.byStatus[HV_STATUS_INVALID_ALIGNMENT],
+           (unsigned long long)counts.byStatus[HV_STATUS_INVALID_PARAMETER]);
+}
+
+int
+main ()
+{
+    HcSimBackend    sim;
+    CASE_COUNTS     blind = {};
+    CASE_COUNTS     structured = {};
+
+    if (!CheckLayout() || !CheckSim())
+    {
+        return 1;
+    }
+
+    //
+    // One full pass of each for the counts, then time them
+    //
+    CaseWalker blindWalker(BlindCase, INPUT_GEN_FIRST_CASE);
+    CaseWalker structuredWalker(StructuredCase, INPUT_GEN_CASES);
+
+    RunCases(blindWalker, sim, blindWalker.SpaceSize(), &blind);
+    RunCases(structuredWalker, sim, structuredWalker.SpaceSize(), &structured);
+
+    double blindRate = BenchRun([&](UINT64 iters) {
+        CASE_COUNTS counts = {};
+        RunCases(blindWalker, sim, iters, &counts);
+        BenchDoNotOptimize(counts);
+    });
+    double structuredRate = BenchRun([&](UINT64 iters) {
+        CASE_COUNTS counts = {};
+        RunCases(structuredWalker, sim, iters, &counts);
+        BenchDoNotOptimize(counts);
+    });
+
+    Report("inputgen/blind", blind, blindRate);
+    Report("inputgen/structured", structured, structuredRate);
+
+    if (structured.effective * blind.cases <= blind.effective * structured.cases)
+    {
+        printf("[-] structured cases are not more effective than blind ones\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,496 @@
+/*++
+
+Module Name:
+
+    BenchJournal.cpp
+
+Abstract:
+
+    Checks the binary fuzz journal and measures append and resume cost on a
+    multi-GB journal.
+
+    Checks (exit non-zero on failure)
+        - CRC32C matches the reference check value
+        - registers survive pack/unpack, too many non-zero qwords are flagged
+        - reattaching finds the last case and session records, and the last
+          case of the main pass past the probe records after it
+        - FindResume gives each pass's last case and low watermark
+        - a partial record, corrupted records and records of another campaign
+          at the tail are cut off, and the next append lands after the last
+          good record
+        - a file that isn't a journal is refused and left alone
+        - records appended through AsyncLog land in their slots
+        - the memory mapped reader and text conversion agree with the writer
+
+    Benchmarks
+        journal/append              - 64 record appends until the journal
+                                      reaches the requested size
+        journal/resume              - Attach + FindLast on the full journal
+        journal/resume/torn         - the same with a torn tail to cut off
+        journal/scan                - validate every record through the
+                                      mapped reader, what a converter does
+
+    Usage: BenchJournal [scratch directory, default .] [journal GB, default 2]
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include "ViFuBench.h"
+#include "../ViFuCore/FuzzJournal.h"
+#include "../ViFuCore/AsyncLog.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+static std::string g_dir = ".";
+
+static std::string
+ScratchPath (
+    IN const CHAR   *name
+)
+{
+    return g_dir + "/" + name;
+}
+
+static FUZZ_JOURNAL_FD
+OpenJournalFd (
+    IN const std::string    &path,
+    IN BOOL                 truncate
+)
+{
+#if defined(_WIN32)
+    return CreateFileA(path.c_str(),
+                       GENERIC_READ | GENERIC_WRITE,
+                       FILE_SHARE_READ,
+                       NULL,
+                       truncate ? CREATE_ALWAYS : OPEN_ALWAYS,
+                       0,
+                       NULL);
+#else
+    return open(path.c_str(), O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+#endif
+}
+
+static VOID
+CloseJournalFd (
+    IN FUZZ_JOURNAL_FD  fd
+)
+{
+#if defined(_WIN32)
+    CloseHandle(fd);
+#else
+    close(fd);
+#endif
+}
+
+static VOID
+RemoveJournal (
+    IN const std::string    &path
+)
+{
+    remove(path.c_str());
+}
+
+//
+// Case n of a synthetic run
+//
+static VOID
+MakeCase (
+    OUT PFUZZ_JOURNAL_RECORD    pRecord,
+    IN  UINT64                  n
+)
+{
+    CPU_REG_64 regs = {};
+
+    regs.rcx = (n % 0xbd) | ((n & 1) << 16);
+    regs.rdx = USE_GPA_MEM_FILL;
+    regs.r8 = (n & 2) ? USE_GPA_MEM_FILL : 0;
+    regs.rax = 1ULL << (n % 64);
+    FuzzJournalInitCase(pRecord,
+                        (USHORT)(n % 0xbd),
+                        (USHORT)(n % 3),
+                        (USHORT)(n & 1),
+                        (USHORT)(n % 137),
+                        n * 0x9E3779B97F4A7C15ULL,
+                        &regs);
+}
+
+static BOOL
+CheckFormat ()
+{
+    CPU_REG_64          regs = {};
+    CPU_REG_64          out = {};
+    FUZZ_JOURNAL_RECORD record;
+    CHAR                text[128];
+
+    CHECK(FuzzJournalCrc32c("123456789", 9) == 0xE3069283);
+
+    regs.rax = 1;
+    regs.rcx = 0x10049;
+    regs.r11 = USE_GPA_MEM_FILL;
+    regs.xmm0.upper = 0x0FEFEFEFEFEFEFEFULL;
+    regs.xmm5.lower = 5;
+    FuzzJournalInitCase(&record, 0x49, 1, 0, 121, 7, &regs);
+    CHECK(record.flags == 0);
+    FuzzJournalUnpackRegs(&record, &out);
+    CHECK(memcmp(&regs, &out, sizeof(regs)) == 0);
+
+    FuzzJournalFormatText(&record, text, sizeof(text));
+    CHECK(strcmp(text, "49 1 0 79\r\n") == 0);
+
+    memset(&regs, 0xA5, sizeof(regs));
+    FuzzJournalInitCase(&record, 1, 0, 1, 0, 0, &regs);
+    CHECK(record.flags & FUZZ_JOURNAL_FLAG_REGS_TRUNCATED);
+    FuzzJournalUnpackRegs(&record, &out);
+    CHECK(memcmp(&regs, &out, FUZZ_JOURNAL_MAX_REGS * sizeof(UINT64)) == 0);
+    CHECK(out.xmm5.upper == 0);
+    return TRUE;
+}
+
+static BOOL
+CheckRecovery ()
+{
+    std::string         path = ScratchPath("journal_check.bin");
+    FuzzJournalFile     journal;
+    FUZZ_JOURNAL_RECORD records[100];
+    FUZZ_JOURNAL_RECORD record;
+    FUZZ_JOURNAL_FD     fd = OpenJournalFd(path, TRUE);
+    UINT64              size = 0;
+
+    CHECK(fd != FUZZ_JOURNAL_INVALID_FD);
+    CHECK(journal.Attach(fd, 0x1234));
+    CHECK(journal.Count() == 0 && !journal.FindLast(FUZZ_JOURNAL_KIND_CASE, &record));
+
+    FuzzJournalInitSession(&record, 1000);
+    CHECK(journal.Append(&record, 1));
+    for (UINT32 batch = 0; batch < 10; batch++)
+    {
+        for (UINT32 r = 0; r < 100; r++)
+        {
+            MakeCase(&records[r], batch * 100 + r);
+        }
+        CHECK(journal.Append(records, 100));
+    }
+    FuzzJournalInitSession(&record, 2000);
+    CHECK(journal.Append(&record, 1));
+
+    //
+    // Clean reattach, new campaign id is ignored
+    //
+    CHECK(journal.Attach(fd, 0x5678));
+    CHECK(journal.CampaignId() == 0x1234);
+    CHECK(journal.Count() == 1002 && journal.TornRecords() == 0);
+    CHECK(journal.FindLast(FUZZ_JOURNAL_KIND_SESSION, &record) && record.regs[0] == 2000);
+    CHECK(journal.FindLast(FUZZ_JOURNAL_KIND_CASE, &record) && record.sequence == 1000);
+    MakeCase(&records[0], 999);
+    CHECK(record.callcode == records[0].callcode && record.caseIdx == records[0].caseIdx);
+
+    //
+    // Half a record
+    //
+    CHECK(FuzzJournalFdWrite(fd, FUZZ_JOURNAL_RECORD_OFFSET(1002), &record, 50));
+    CHECK(journal.Attach(fd, 0));
+    CHECK(journal.Count() == 1002);
+    CHECK(FuzzJournalFdSize(fd, &size) && size == FUZZ_JOURNAL_RECORD_OFFSET(1002));
+
+    //
+    // Last 3 records damaged, as by a group write cut short
+    //
+    for (UINT64 seq = 999; seq < 1002; seq++)
+    {
+        UINT8 junk = 0xEE;
+        CHECK(FuzzJournalFdWrite(fd, FUZZ_JOURNAL_RECORD_OFFSET(seq) + 40 + seq % 80, &junk, 1));
+    }
+    CHECK(journal.Attach(fd, 0));
+    CHECK(journal.Count() == 999 && journal.TornRecords() == 3);
+    CHECK(journal.FindLast(FUZZ_JOURNAL_KIND_CASE, &record) && record.sequence == 998);
+
+    //
+    // Well formed records of another campaign after the end
+    //
+    FuzzJournalFile other;
+    FUZZ_JOURNAL_FD otherFd = OpenJournalFd(ScratchPath("journal_other.bin"), TRUE);
+
+    CHECK(otherFd != FUZZ_JOURNAL_INVALID_FD && other.Attach(otherFd, 0x9999));
+    for (UINT32 r = 0; r < 999; r++)
+    {
+        MakeCase(&record, r);
+        other.Seal(&record);
+    }
+    MakeCase(&records[0], 0);
+    MakeCase(&records[1], 1);
+    other.Seal(&records[0]);
+    other.Seal(&records[1]);
+    CHECK(records[0].sequence == 999);
+    CHECK(FuzzJournalFdWrite(fd, FUZZ_JOURNAL_RECORD_OFFSET(999), records, 2 * FUZZ_JOURNAL_RECORD_SIZE));
+    CloseJournalFd(otherFd);
+    RemoveJournal(ScratchPath("journal_other.bin"));
+
+    CHECK(journal.Attach(fd, 0));
+    CHECK(journal.Count() == 999);
+
+    //
+    // Appends go on after the last good record
+    //
+    MakeCase(&record, 5);
+    CHECK(journal.Append(&record, 1) && record.sequence == 999);
+    CHECK(journal.Attach(fd, 0) && journal.Count() == 1000);
+
+    //
+    // Mapped reader and text conversion
+    //
+    FuzzJournalReader   reader;
+    CHAR                text[128];
+
+    CHECK(reader.Open(path.c_str()));
+    CHECK(reader.Count() == 1000 && reader.Header()->campaignId == 0x1234);
+    for (UINT64 seq = 0; seq < reader.Count(); seq++)
+    {
+        CHECK(reader.IsValid(seq));
+    }
+    CHECK(reader.Record(0)->kind == FUZZ_JOURNAL_KIND_SESSION);
+    FuzzJournalFormatText(reader.Record(0), text, sizeof(text));
+    CHECK(text[0] == '\r' && text[2] == '[' && strlen(text) == 27);
+    FuzzJournalFormatText(reader.Record(999), text, sizeof(text));
+    CHECK(strcmp(text, "5 2 1 5\r\n") == 0);
+    reader.Close();
+
+    //
+    // A probe pass cut short after the main pass's last case
+    //
+    for (UINT32 r = 0; r < 10; r++)
+    {
+        MakeCase(&records[r], r);
+        records[r].flags |= FUZZ_JOURNAL_FLAG_PROBE;
+    }
+    CHECK(journal.Append(records, 10));
+    CHECK(journal.Attach(fd, 0));
+    CHECK(journal.FindLast(FUZZ_JOURNAL_KIND_CASE, &record) && record.sequence == 1009);
+    CHECK(record.flags & FUZZ_JOURNAL_FLAG_PROBE);
+    CHECK(journal.FindLast(FUZZ_JOURNAL_KIND_CASE, &record, FUZZ_JOURNAL_FLAG_PROBE, 0) && record.sequence == 999);
+    CHECK(journal.FindLast(FUZZ_JOURNAL_KIND_CASE, &record, FUZZ_JOURNAL_FLAG_PROBE, FUZZ_JOURNAL_FLAG_PROBE) &&
+          record.sequence == 1009);
+
+    FUZZ_JOURNAL_RESUME resume;
+
+    journal.FindResume(&resume);
+    CHECK(resume.flags == (FUZZ_JOURNAL_RESUME_HAS_CASE | FUZZ_JOURNAL_RESUME_HAS_PROBE));
+    CHECK(resume.lastCase.sequence == 999 && resume.lastProbe.sequence == 1009);
+
+    //
+    // Then a main pass and a probe pass, each after its watermark
+    //
+    FuzzJournalInitWatermark(&records[0], 40, 0);
+    for (UINT32 r = 1; r < 6; r++)
+    {
+        MakeCase(&records[r], r);
+    }
+    FuzzJournalInitWatermark(&records[6], 80, FUZZ_JOURNAL_FLAG_PROBE);
+    for (UINT32 r = 7; r < 10; r++)
+    {
+        MakeCase(&records[r], r);
+        records[r].flags |= FUZZ_JOURNAL_FLAG_PROBE;
+    }
+    CHECK(journal.Append(records, 10));
+    CHECK(FuzzJournalFormatText(&records[0], text, sizeof(text)) == 0 && text[0] == '\0');
+
+    journal.FindResume(&resume);
+    CHECK(resume.flags == (FUZZ_JOURNAL_RESUME_HAS_CASE |
+                           FUZZ_JOURNAL_RESUME_HAS_LOW |
+                           FUZZ_JOURNAL_RESUME_HAS_PROBE |
+                           FUZZ_JOURNAL_RESUME_HAS_PROBE_LOW));
+    CHECK(resume.low == 40 && resume.probeLow == 80);
+    CHECK(resume.lastCase.sequence == 1015 && resume.lastProbe.sequence == 1019);
+
+    CloseJournalFd(fd);
+    RemoveJournal(path);
+
+    //
+    // Not a journal
+    //
+    FILE *pFile = fopen(path.c_str(), "wb");
+    CHECK(pFile != NULL);
+    fputs("0 0 0 0\r\n1 0 0 0\r\n", pFile);
+    fclose(pFile);
+
+    fd = OpenJournalFd(path, FALSE);
+    CHECK(!journal.Attach(fd, 0));
+    CHECK(FuzzJournalFdSize(fd, &size) && size == 18);
+    CloseJournalFd(fd);
+    CHECK(!reader.Open(path.c_str()));
+    RemoveJournal(path);
+    return TRUE;
+}
+
+//
+// The ViFuR3 path, records sealed up front and written by the flusher
+//
+static BOOL
+CheckAsyncAppend ()
+{
+    std::string         path = ScratchPath("journal_async.bin");
+    FuzzJournalFile     journal;
+    FUZZ_JOURNAL_RECORD record;
+    FUZZ_JOURNAL_FD     fd = OpenJournalFd(path, TRUE);
+    AsyncLog            log;
+    ASYNC_LOG_CONFIG    config = ASYNC_LOG_DEFAULT_CONFIG;
+
+    CHECK(fd != FUZZ_JOURNAL_INVALID_FD);
+    CHECK(journal.Attach(fd, 42));
+    FuzzJournalInitSession(&record, 1);
+    CHECK(journal.Append(&record, 1));
+
+    AsyncLogFileSink sink(fd);
+    config.bufferSize = 1000;
+    CHECK(log.Open(&sink, config));
+    for (UINT32 r = 0; r < 5000; r++)
+    {
+        MakeCase(&record, r);
+        journal.Seal(&record);
+        log.Write(&record, sizeof(record));
+        if ((r % 64) == 63)
+        {
+            log.Barrier();
+        }
+    }
+    log.Close();
+
+    CHECK(journal.Attach(fd, 0));
+    CHECK(journal.Count() == 5001 && journal.TornRecords() == 0);
+    CHECK(journal.FindLast(FUZZ_JOURNAL_KIND_CASE, &record) && record.sequence == 5000);
+    CloseJournalFd(fd);
+    RemoveJournal(path);
+    return TRUE;
+}
+
+static VOID
+Bench (
+    IN double   gigabytes
+)
+{
+    std::string                         path = ScratchPath("journal_bench.bin");
+    FuzzJournalFile                     journal;
+    std::vector<FUZZ_JOURNAL_RECORD>    batch(64);
+    FUZZ_JOURNAL_RECORD                 record;
+    FUZZ_JOURNAL_FD                     fd = OpenJournalFd(path, TRUE);
+    UINT64                              target = (UINT64)(gigabytes * (1ULL << 30)) / FUZZ_JOURNAL_RECORD_SIZE;
+    UINT64                              found = 0;
+    BenchTimer                          timer;
+    CHAR                                name[64];
+
+    if (fd == FUZZ_JOURNAL_INVALID_FD || !journal.Attach(fd, 0xBE4C))
+    {
+        printf("[-] ERR creating %s\n", path.c_str());
+        return;
+    }
+
+    //
+    // Build the records outside the timed loop, only sealing is per record
+    //
+    for (UINT32 r = 0; r < batch.size(); r++)
+    {
+        MakeCase(&batch[r], r);
+    }
+
+    timer.Reset();
+    while (journal.Count() < target)
+    {
+        if (!journal.Append(batch.data(), (UINT32)batch.size()))
+        {
+            printf("[-] ERR appending at %llu\n", (unsigned long long)journal.Count());
+            break;
+        }
+    }
+    double secs = timer.Seconds();
+
+    snprintf(name, sizeof(name), "journal/append %.1fGB", gigabytes);
+    BenchReport(name, journal.Count() / secs, "records/s");
+    BenchReport("journal/append", journal.Count() * (double)FUZZ_JOURNAL_RECORD_SIZE / secs / 1e9, "GB/s");
+
+    double resumes = BenchRun([&](UINT64 iters) {
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            FuzzJournalFile resume;
+
+            resume.Attach(fd, 0);
+            resume.FindLast(FUZZ_JOURNAL_KIND_CASE, &record);
+            found += record.sequence;
+        }
+    }, 0.25);
+    BenchReport("journal/resume", 1e6 / resumes, "us");
+
+    double tornResumes = BenchRun([&](UINT64 iters) {
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            FuzzJournalFile resume;
+
+            FuzzJournalFdWrite(fd, FUZZ_JOURNAL_RECORD_OFFSET(journal.Count()), &record, 64);
+            resume.Attach(fd, 0);
+            resume.FindLast(FUZZ_JOURNAL_KIND_CASE, &record);
+            found += record.sequence;
+        }
+    }, 0.25);
+    BenchReport("journal/resume/torn", 1e6 / tornResumes, "us");
+    BenchDoNotOptimize(found);
+
+    FuzzJournalReader reader;
+    UINT64 valid = 0;
+
+    if (reader.Open(path.c_str()))
+    {
+        timer.Reset();
+        for (UINT64 seq = 0; seq < reader.Count(); seq++)
+        {
+            valid += reader.IsValid(seq) ? 1 : 0;
+        }
+        secs = timer.Seconds();
+        BenchReport("journal/scan", reader.Count() * (double)FUZZ_JOURNAL_RECORD_SIZE / secs / 1e9, "GB/s");
+        if (valid != journal.Count())
+        {
+            printf("[-] scan found %llu of %llu records valid\n",
+                   (unsigned long long)valid,
+                   (unsigned long long)journal.Count());
+        }
+    }
+    reader.Close();
+
+    CloseJournalFd(fd);
+    RemoveJournal(path);
+}
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    double gigabytes = 2.0;
+
+    if (argc > 1)
+    {
+        g_dir = argv[1];
+    }
+    if (argc > 2)
+    {
+        gigabytes = atof(argv[2]);
+    }
+
+    if (!CheckFormat() || !CheckRecovery() || !CheckAsyncAppend())
+    {
+        return 1;
+    }
+    printf("[+] FuzzJournal checks passed\n");
+
+    Bench(gigabytes);
+    return 0;
+}
@@ -0,0 +1,591 @@
+/*++
+
+Module Name:
+
+    BenchMetrics.cpp
+
+Abstract:
+
+    Checks the metrics publisher (Metrics.h) and measures what it costs a
+    fuzzing run: pipelined workers on the simulated backend, counting
+    statuses as ViFuR3's triage does, with and without a publisher, a
+    scraper and a TUI-like reader of the stats file.
+
+    Checks (exit non-zero on failure)
+        - the Prometheus text has every counter, only the statuses seen
+          and the stage and per-worker series
+        - GET /metrics answers 200 with the text, any other path 404
+        - a reader polling the stats file never sees a torn snapshot
+          while the publisher rewrites it every millisecond
+        - after Stop() the stats file holds the run's final totals, and
+          its status counts add up to the cases
+
+    Benchmarks
+        metrics/status add          - ns per case of counting its status
+        metrics/publish             - us per snapshot, collect to text
+        metrics/off                 - cases/s without metrics
+        metrics/on                  - cases/s publishing every 100 ms,
+                                      scraped every 100 ms and read every 10 ms,
+                                      ten times ViFuR3's METRICS_PERIOD_MS
+        metrics/overhead            - of on against off, best of interleaved runs
+
+    Usage: BenchMetrics [scratch directory, default .]
+                        [per-call latency in ns, default 2000]
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <string>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <stdlib.h>
+#include "ViFuBench.h"
+#include "../ViFuCore/Metrics.h"
+#include "../ViFuCore/CaseSpace.h"
+#include "../ViFuCore/HcSimBackend.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define BENCH_BATCH_CASES   64
+#define BENCH_DEPTH         4
+#define BENCH_WORKERS       2
+#define BENCH_CASES         200000
+#define BENCH_ROUNDS        5
+#define BENCH_MAX_OVERHEAD  5.0     // Percent
+#define BENCH_PERIOD_MS     100
+#define BENCH_READ_MS       10
+#define SEQLOCK_READS       20000
+
+typedef struct _SIM_BATCH
+{
+    HcBatchEncoder  batch;
+    HcBatchResults  results;
+    WORKER_CHUNK    chunk;
+    BOOL            bChunkEnd;
+    UINT32          status;
+
+    _SIM_BATCH ()
+        : batch(BENCH_BATCH_CASES),
+          results(BENCH_BATCH_CASES)
+    {
+    }
+} SIM_BATCH;
+
+//
+// A worker as FUZZ_WORKER in ViFuR3, with its status counters
+//
+typedef struct _SIM_WORKER
+{
+    HcSimBackend            backend;
+    Pipeline<SIM_BATCH>     pipeline;
+    MetricsStatusCounters   statuses;
+    WORKER_CHUNK            chunk;
+    UINT64                  nextCase;
+
+    _SIM_WORKER ()
+        : pipeline(BENCH_DEPTH),
+          nextCase(0)
+    {
+        memset(&chunk, 0, sizeof(chunk));
+    }
+} SIM_WORKER;
+
+typedef struct _SIM_FUZZ
+{
+    const CaseSpace                             *pSpace;
+    WorkerPool                                  *pPool;
+    std::vector<std::unique_ptr<SIM_WORKER>>    workers;
+} SIM_FUZZ;
+
+static VOID
+MakeFuzz (
+    IN  const CaseSpace &space,
+    IN  WorkerPool      &pool,
+    IN  UINT32          latencyNs,
+    OUT SIM_FUZZ        *pFuzz
+)
+{
+    pFuzz->pSpace = &space;
+    pFuzz->pPool = &pool;
+    pFuzz->workers.clear();
+    for (UINT32 w = 0; w < pool.Workers(); w++)
+    {
+        pFuzz->workers.emplace_back(new SIM_WORKER());
+        pFuzz->workers.back()->backend.SetLatency(latencyNs);
+    }
+}
+
+static VOID
+FuzzCases (
+    IN OUT SIM_FUZZ &fuzz,
+    IN     UINT64   cases
+)
+{
+    WorkerPool &pool = *fuzz.pPool;
+
+    pool.Seed(0, cases, fuzz.pSpace->CasesPerCombo());
+    pool.RunWorkers([&](UINT32 w, WorkerCounters &counters) {
+        SIM_WORKER *pWorker = fuzz.workers[w].get();
+
+        pWorker->pipeline.Run(
+            [&](SIM_BATCH &item) {
+                FUZZ_CASE fuzzCase;
+
+                if (pWorker->nextCase == pWorker->chunk.end)
+                {
+                    if (!pool.Claim(w, counters, &pWorker->chunk))
+                    {
+                        return FALSE;
+                    }
+                    pWorker->nextCase = pWorker->chunk.begin;
+                }
+
+                item.batch.Reset();
+                item.chunk = pWorker->chunk;
+                for (; pWorker->nextCase < pWorker->chunk.end && !item.batch.IsFull(); pWorker->nextCase++)
+                {
+                    fuzz.pSpace->Materialize(pWorker->nextCase % fuzz.pSpace->Count(), &fuzzCase);
+                    item.batch.Add(fuzzCase.regs);
+                    counters.Add(WORKER_COUNTER_CASES);
+                }
+                item.bChunkEnd = pWorker->nextCase == pWorker->chunk.end;
+                return TRUE;
+            },
+            [&](SIM_BATCH &item) {
+                item.status = pWorker->backend.ExecBatch(item.batch, item.results);
+                if (item.bChunkEnd)
+                {
+                    pool.Complete(item.chunk);
+                }
+            },
+            [&](SIM_BATCH &item) {
+                if (item.status != 0)
+                {
+                    counters.Add(WORKER_COUNTER_ERRORS);
+                }
+                for (UINT32 c = 0; c < item.results.Count(); c++)
+                {
+                    HV_STATUS status = item.results[c].hvStatus;
+
+                    pWorker->statuses.Add(status);
+                    counters.Add(WORKER_COUNTER_SUCCESS, status == HV_STATUS_SUCCESS);
+                    counters.Add(WORKER_COUNTER_EFFECTIVE, InputGenIsEffectiveStatus(status));
+                }
+            });
+    });
+}
+
+//
+// What ViFuR3's collect function does, less novelty and the loggers
+//
+static VOID
+Collect (
+    IN  SIM_FUZZ            &fuzz,
+    OUT PMETRICS_SNAPSHOT   pSnapshot
+)
+{
+    WorkerPool &pool = *fuzz.pPool;
+
+    pSnapshot->workers = pool.Workers();
+    for (UINT32 w = 0; w < pool.Workers() && w < METRICS_MAX_WORKERS; w++)
+    {
+        WorkerCounters  &counters = pool.Counters(w);
+        PIPELINE_STATS  stats;
+
+        for (UINT32 c = 0; c < WORKER_COUNTER_COUNT; c++)
+        {
+            pSnapshot->counters[c] += counters.Get((WORKER_COUNTER)c);
+        }
+        fuzz.workers[w]->statuses.Sum(pSnapshot->statuses);
+        fuzz.workers[w]->pipeline.GetStats(&stats);
+        PipelineStatsMerge(&pSnapshot->pipeline, stats);
+
+        pSnapshot->perWorker[w].cases = counters.Get(WORKER_COUNTER_CASES);
+        pSnapshot->perWorker[w].effective = counters.Get(WORKER_COUNTER_EFFECTIVE);
+        pSnapshot->perWorker[w].errors = counters.Get(WORKER_COUNTER_ERRORS);
+        pSnapshot->perWorker[w].executeBusyNs = stats.stages[PIPELINE_STAGE_EXECUTE].busyNs;
+    }
+}
+
+//
+// One GET, the whole response. Empty if the connection failed
+//
+static std::string
+HttpGet (
+    IN UINT16       port,
+    IN const CHAR   *path
+)
+{
+    struct sockaddr_in  addr = {};
+    std::string         response;
+    CHAR                buffer[4096];
+    INT                 s = socket(AF_INET, SOCK_STREAM, 0);
+    INT                 got = 0;
+
+    if (s < 0)
+    {
+        return response;
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        std::string request = std::string("GET ") + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+        send(s, request.data(), request.size(), 0);
+        while ((got = (INT)recv(s, buffer, sizeof(buffer), 0)) > 0)
+        {
+            response.append(buffer, (SIZE_T)got);
+        }
+    }
+    close(s);
+    return response;
+}
+
+static BOOL
+Contains (
+    IN const std::string    &text,
+    IN const CHAR           *pattern
+)
+{
+    return text.find(pattern) != std::string::npos;
+}
+
+static BOOL
+CheckFormat ()
+{
+    std::unique_ptr<METRICS_SNAPSHOT> pSnapshot(new METRICS_SNAPSHOT());
+    std::string text;
+
+    memset(pSnapshot.get(), 0, sizeof(METRICS_SNAPSHOT));
+    pSnapshot->workers = 2;
+    pSnapshot->counters[WORKER_COUNTER_CASES] = 1234;
+    pSnapshot->counters[WORKER_COUNTER_EFFECTIVE] = 99;
+    pSnapshot->statuses[HV_STATUS_SUCCESS] = 1000;
+    pSnapshot->statuses[HV_STATUS_INVALID_PARAMETER] = 234;
+    pSnapshot->novel = 17;
+    pSnapshot->logBacklog = 4096;
+    pSnapshot->pipeline.stages[PIPELINE_STAGE_EXECUTE].busyNs = 1500000000;
+    pSnapshot->perWorker[1].cases = 600;
+
+    MetricsFormatPrometheus(*pSnapshot, &text);
+    CHECK(Contains(text, "\nvifu_cases_total 1234\n"));
+    CHECK(Contains(text, "\nvifu_effective_total 99\n"));
+    CHECK(Contains(text, "\nvifu_chunks_total 0\n"));
+    CHECK(Contains(text, "\nvifu_hv_status_total{status=\"0x0000\"} 1000\n"));
+    CHECK(Contains(text, "vifu_hv_status_total{status=\"0x0005\"} 234\n"));
+    CHECK(!Contains(text, "status=\"0x0002\""));
+    CHECK(Contains(text, "\nvifu_novel_results_total 17\n"));
+    CHECK(Contains(text, "\nvifu_log_backlog_bytes 4096\n"));
+    CHECK(Contains(text, "\nvifu_stage_busy_seconds_total{stage=\"execute\"} 1.500000\n"));
+    CHECK(Contains(text, "\nvifu_worker_cases_total{worker=\"1\"} 600\n"));
+    CHECK(!Contains(text, "worker=\"2\""));
+    CHECK(text.back() == '\n');
+
+    printf("[+] format checks passed\n");
+    return TRUE;
+}
+
+static BOOL
+CheckHttp (
+    IN const std::string    &dir
+)
+{
+    std::string     path = dir + "/bench_metrics.bin";
+    METRICS_CONFIG  config = { path.c_str(), "127.0.0.1", 0, 10 };
+    MetricsPublisher publisher;
+    std::atomic<UINT64> cases(0);
+
+    CHECK(publisher.Start(config, [&](PMETRICS_SNAPSHOT pSnapshot) {
+        pSnapshot->workers = 1;
+        pSnapshot->counters[WORKER_COUNTER_CASES] = cases.load();
+    }));
+    CHECK(publisher.Port() != 0);
+
+    cases = 4242;
+    while (publisher.Published() < 3)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::string ok = HttpGet(publisher.Port(), "/metrics");
+    std::string missing = HttpGet(publisher.Port(), "/");
+
+    CHECK(ok.compare(0, 15, "HTTP/1.1 200 OK") == 0);
+    CHECK(Contains(ok, "Content-Type: text/plain; version=0.0.4\r\n"));
+    CHECK(Contains(ok, "\nvifu_cases_total 4242\n"));
+    CHECK(missing.compare(0, 22, "HTTP/1.1 404 Not Found") == 0);
+
+    publisher.Stop();
+    CHECK(HttpGet(publisher.Port(), "/metrics").empty());
+
+    printf("[+] http checks passed\n");
+    return TRUE;
+}
+
+//
+// Every collect fills each counter and status with the same value, so a
+// snapshot with two different ones was torn
+//
+static BOOL
+CheckSeqlock (
+    IN const std::string    &dir
+)
+{
+    std::string     path = dir + "/bench_metrics.bin";
+    METRICS_CONFIG  config = { path.c_str(), NULL, 0, 1 };
+    MetricsPublisher publisher;
+    MetricsView     view;
+    std::unique_ptr<METRICS_SNAPSHOT> pSnapshot(new METRICS_SNAPSHOT());
+    UINT64          value = 0;
+    UINT64          sequence = 0;
+    UINT64          lastSequence = 0;
+    UINT32          changes = 0;
+
+    CHECK(publisher.Start(config, [&](PMETRICS_SNAPSHOT pFill) {
+        value++;
+        pFill->workers = METRICS_MAX_WORKERS;
+        for (UINT32 c = 0; c < WORKER_COUNTER_COUNT; c++)
+        {
+            pFill->counters[c] = value;
+        }
+        for (UINT32 s = 0; s < METRICS_STATUSES; s++)
+        {
+            pFill->statuses[s] = value;
+        }
+        for (UINT32 w = 0; w < METRICS_MAX_WORKERS; w++)
+        {
+            pFill->perWorker[w].cases = value;
+        }
+    }));
+    CHECK(view.Open(path.c_str()));
+
+    for (UINT32 r = 0; r < SEQLOCK_READS; r++)
+    {
+        UINT64 first = 0;
+
+        if (!view.Read(pSnapshot.get(), &sequence))
+        {
+            continue;
+        }
+        first = pSnapshot->counters[0];
+        CHECK(first != 0);
+        for (UINT32 c = 0; c < WORKER_COUNTER_COUNT; c++)
+        {
+            CHECK(pSnapshot->counters[c] == first);
+        }
+        for (UINT32 s = 0; s < METRICS_STATUSES; s++)
+        {
+            CHECK(pSnapshot->statuses[s] == first);
+        }
+        for (UINT32 w = 0; w < METRICS_MAX_WORKERS; w++)
+        {
+            CHECK(pSnapshot->perWorker[w].cases == first);
+        }
+        CHECK(pSnapshot->published + 1 == first);
+        changes += sequence != lastSequence;
+        lastSequence = sequence;
+        if (r % 64 == 0)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+    publisher.Stop();
+    CHECK(changes > 1);
+
+    printf("[+] seqlock checks passed (%u reads, %u snapshots seen)\n", SEQLOCK_READS, changes);
+    return TRUE;
+}
+
+static BOOL
+CheckFinal (
+    IN const std::string    &dir,
+    IN const CaseSpace      &space
+)
+{
+    std::string     path = dir + "/bench_metrics.bin";
+    METRICS_CONFIG  config = { path.c_str(), "127.0.0.1", 0, 5 };
+    WorkerPool      pool(BENCH_WORKERS);
+    SIM_FUZZ        fuzz;
+    MetricsPublisher publisher;
+    MetricsView     view;
+    std::unique_ptr<METRICS_SNAPSHOT> pSnapshot(new METRICS_SNAPSHOT());
+    UINT64          statuses = 0;
+
+    MakeFuzz(space, pool, 0, &fuzz);
+    CHECK(publisher.Start(config, [&](PMETRICS_SNAPSHOT pFill) { Collect(fuzz, pFill); }));
+    FuzzCases(fuzz, 50000);
+    publisher.Stop();
+
+    CHECK(view.Open(path.c_str()) && view.Read(pSnapshot.get()));
+    CHECK(pSnapshot->workers == BENCH_WORKERS);
+    for (UINT32 c = 0; c < WORKER_COUNTER_COUNT; c++)
+    {
+        CHECK(pSnapshot->counters[c] == pool.Total((WORKER_COUNTER)c));
+    }
+    CHECK(pSnapshot->counters[WORKER_COUNTER_CASES] == 50000);
+    for (UINT32 s = 0; s < METRICS_STATUSES; s++)
+    {
+        statuses += pSnapshot->statuses[s];
+    }
+    CHECK(statuses == 50000);
+    CHECK(pSnapshot->statuses[HV_STATUS_SUCCESS] == pool.Total(WORKER_COUNTER_SUCCESS));
+    CHECK(pSnapshot->perWorker[0].cases + pSnapshot->perWorker[1].cases == 50000);
+    CHECK(pSnapshot->pipeline.stages[PIPELINE_STAGE_TRIAGE].items ==
+          pSnapshot->pipeline.stages[PIPELINE_STAGE_GENERATE].items);
+    CHECK(pSnapshot->pipeline.wallNs != 0);
+
+    printf("[+] final totals checks passed\n");
+    return TRUE;
+}
+
+//
+// cases/s of one run of BENCH_CASES, with the publisher, a scraper and a
+// stats file reader running alongside if bMetrics
+//
+static double
+RunFuzz (
+    IN const std::string    &dir,
+    IN const CaseSpace      &space,
+    IN UINT32               latencyNs,
+    IN BOOL                 bMetrics
+)
+{
+    std::string         path = dir + "/bench_metrics.bin";
+    METRICS_CONFIG      config = { path.c_str(), "127.0.0.1", 0, BENCH_PERIOD_MS };
+    WorkerPool          pool(BENCH_WORKERS);
+    SIM_FUZZ            fuzz;
+    MetricsPublisher    publisher;
+    std::atomic<bool>   bDone(false);
+    std::thread         scraper;
+    std::thread         reader;
+
+    MakeFuzz(space, pool, latencyNs, &fuzz);
+    if (bMetrics)
+    {
+        publisher.Start(config, [&](PMETRICS_SNAPSHOT pFill) { Collect(fuzz, pFill); });
+        scraper = std::thread([&]() {
+            while (!bDone)
+            {
+                BenchDoNotOptimize(HttpGet(publisher.Port(), "/metrics").size());
+                std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_PERIOD_MS));
+            }
+        });
+        reader = std::thread([&]() {
+            std::unique_ptr<METRICS_SNAPSHOT> pSnapshot(new METRICS_SNAPSHOT());
+            MetricsView view;
+
+            view.Open(path.c_str());
+            while (!bDone)
+            {
+                view.Read(pSnapshot.get());
+                BenchDoNotOptimize(pSnapshot->counters[WORKER_COUNTER_CASES]);
+                std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_READ_MS));
+            }
+        });
+    }
+
+    BenchTimer timer;
+    FuzzCases(fuzz, BENCH_CASES);
+    double secs = timer.Seconds();
+
+    bDone = true;
+    if (bMetrics)
+    {
+        scraper.join();
+        reader.join();
+        publisher.Stop();
+    }
+    return BENCH_CASES / secs;
+}
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    std::string dir = argc > 1 ? argv[1] : ".";
+    UINT32      latencyNs = argc > 2 ? (UINT32)atoi(argv[2]) : 2000;
+    HcFilter    filter;
+    CaseSpace   space(filter, 6);
+
+    if (!CheckFormat() || !CheckHttp(dir) || !CheckSeqlock(dir) || !CheckFinal(dir, space))
+    {
+        return 1;
+    }
+
+    printf("[ ] %u processors, %u workers, %u ns per call\n",
+           WorkerPoolProcessorCount(),
+           BENCH_WORKERS,
+           latencyNs);
+
+    //
+    // The only per-case work metrics add to triage
+    //
+    MetricsStatusCounters statuses;
+    double rate = BenchRun([&](UINT64 iters) {
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            statuses.Add((UINT16)(i & 7));
+        }
+    });
+    BenchReport("metrics/status add", 1e9 / rate, "ns/case");
+
+    {
+        WorkerPool  pool(BENCH_WORKERS);
+        SIM_FUZZ    fuzz;
+        std::unique_ptr<METRICS_SNAPSHOT> pSnapshot(new METRICS_SNAPSHOT());
+        std::string text;
+
+        MakeFuzz(space, pool, 0, &fuzz);
+        rate = BenchRun([&](UINT64 iters) {
+            for (UINT64 i = 0; i < iters; i++)
+            {
+                memset(pSnapshot.get(), 0, sizeof(METRICS_SNAPSHOT));
+                Collect(fuzz, pSnapshot.get());
+                MetricsFormatPrometheus(*pSnapshot, &text);
+            }
+        }, 0.2);
+        BenchReport("metrics/publish", 1e6 / rate, "us");
+    }
+
+    //
+    // Interleaved, so drift in the machine's speed hits both the same
+    //
+    double off = 0;
+    double on = 0;
+    for (UINT32 round = 0; round < BENCH_ROUNDS; round++)
+    {
+        double r = RunFuzz(dir, space, latencyNs, FALSE);
+
+        off = r > off ? r : off;
+        r = RunFuzz(dir, space, latencyNs, TRUE);
+        on = r > on ? r : on;
+    }
+    BenchReport("metrics/off", off, "cases/s");
+    BenchReport("metrics/on", on, "cases/s");
+
+    double overhead = (off - on) * 100 / off;
+    BenchReport("metrics/overhead", overhead, "%");
+    if (overhead > BENCH_MAX_OVERHEAD)
+    {
+        printf("[-] metrics cost %.2f%% of cases/s, more than %.0f%%\n", overhead, BENCH_MAX_OVERHEAD);
+        return 1;
+    }
+
+    remove((dir + "/bench_metrics.bin").c_str());
+    return 0;
+}
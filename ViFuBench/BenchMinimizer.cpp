@@ -0,0 +1,393 @@
+/*++
+
+Module Name:
+
+    BenchMinimizer.cpp
+
+Abstract:
+
+    Checks the crash minimizer against the simulated hypervisor with
+    injected crash predicates, and measures how many reboots and batches it
+    needs.
+
+    Checks (exit non-zero on failure)
+        - a register crash is reduced to exactly the bits the predicate
+          needs, from a case with every register and the page full of noise
+        - a page crash keeps only the needed page bytes and one bit of the
+          rep count, the call code is never cleared
+        - the same minimal case when the target cannot tell which case of a
+          batch failed, by bisecting
+        - a case that hangs is minimized as a hang, and candidates that hang
+          while minimizing a crash are run at most once
+        - a case that does not crash is reported as not reproduced
+        - every batch size finds the same minimal case
+
+    Benchmarks
+        minimizer/<scenario> reboots    - crashes and hangs of the target
+        minimizer/<scenario> batches    - batches run
+        minimizer/<scenario> executed   - candidates run
+
+    Usage: BenchMinimizer [max batch, default 16]
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <string>
+#include <set>
+#include <stdlib.h>
+#include "ViFuBench.h"
+#include "../ViFuCore/CrashMinimizer.h"
+#include "../ViFuCore/HcSimBackend.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define CRASH_CALLCODE      0x0044
+
+//
+// What the injected predicates look at, and what they saw
+//
+typedef struct _PREDICATE_CONTEXT
+{
+    UINT64              runs;
+    std::set<UINT64>    hung;           // Hashes of the cases that hung
+    UINT64              rehung;         // Hangs of a case that had hung before
+
+    _PREDICATE_CONTEXT ()
+        : runs(0),
+          rehung(0)
+    {
+    }
+} PREDICATE_CONTEXT;
+
+//
+// Crash when RDX bit 5 is set and R9 byte 1 is 0x41
+//
+static MIN_OUTCOME
+RegCrash (
+    IN const MIN_CASE                   *pCase,
+    IN const HYPERCALL_BATCH_RESULT     *pResult,
+    IN VOID                             *pContext
+)
+{
+    (VOID)pResult;
+    ((PREDICATE_CONTEXT *)pContext)->runs++;
+    if ((pCase->regs.rcx & 0xffff) == CRASH_CALLCODE &&
+        (pCase->regs.rdx & 0x20) != 0 &&
+        (pCase->regs.r9 & 0xff00) == 0x4100)
+    {
+        return MIN_OUTCOME_CRASH;
+    }
+    return MIN_OUTCOME_PASS;
+}
+
+//
+// Crash when page qword 17 has 0x41 in byte 2, for a rep call
+//
+static MIN_OUTCOME
+PageCrash (
+    IN const MIN_CASE                   *pCase,
+    IN const HYPERCALL_BATCH_RESULT     *pResult,
+    IN VOID                             *pContext
+)
+{
+    (VOID)pResult;
+    ((PREDICATE_CONTEXT *)pContext)->runs++;
+    if ((pCase->regs.rcx & 0xffff) == CRASH_CALLCODE &&
+        ((pCase->regs.rcx >> 32) & 0xfff) != 0 &&
+        (pCase->page[17] & 0xff0000) == 0x410000)
+    {
+        return MIN_OUTCOME_CRASH;
+    }
+    return MIN_OUTCOME_PASS;
+}
+
+//
+// RegCrash, but the guest hangs instead whenever RBX is cleared
+//
+static MIN_OUTCOME
+HangingCrash (
+    IN const MIN_CASE                   *pCase,
+    IN const HYPERCALL_BATCH_RESULT     *pResult,
+    IN VOID                             *pContext
+)
+{
+    PREDICATE_CONTEXT *pPredicate = (PREDICATE_CONTEXT *)pContext;
+
+    if (pCase->regs.rbx == 0)
+    {
+        UINT64 hash = MinCaseHash(*pCase);
+
+        pPredicate->runs++;
+        pPredicate->rehung += pPredicate->hung.count(hash);
+        pPredicate->hung.insert(hash);
+        return MIN_OUTCOME_HANG;
+    }
+    return RegCrash(pCase, pResult, pContext);
+}
+
+//
+// Hang when R10 bit 63 is set
+//
+static MIN_OUTCOME
+Hang (
+    IN const MIN_CASE                   *pCase,
+    IN const HYPERCALL_BATCH_RESULT     *pResult,
+    IN VOID                             *pContext
+)
+{
+    (VOID)pResult;
+    ((PREDICATE_CONTEXT *)pContext)->runs++;
+    return (pCase->regs.r10 >> 63) != 0 ? MIN_OUTCOME_HANG : MIN_OUTCOME_PASS;
+}
+
+//
+// Every register and, with bPage, the page full of noise, around what the
+// predicates need
+//
+static VOID
+NoisyCase (
+    IN  UINT64      seed,
+    IN  BOOL        bPage,
+    OUT PMIN_CASE   pCase
+)
+{
+    memset(pCase, 0, sizeof(MIN_CASE));
+    for (UINT32 q = 0; q < (bPage ? MIN_QWORDS : MIN_REG_QWORDS); q++)
+    {
+        *MinQword(pCase, q) = PageFillSplitMix(seed + q);
+    }
+    pCase->bPage = bPage;
+    pCase->regs.rcx = (pCase->regs.rcx & ~MIN_CALLCODE_MASK & ~(0xfffULL << 32)) | (5ULL << 32) | CRASH_CALLCODE;
+    pCase->regs.rdx |= 0x20;
+    pCase->regs.r9 = (pCase->regs.r9 & ~0xff00ULL) | 0x4100;
+    pCase->regs.r10 |= 1ULL << 63;
+    pCase->regs.rbx |= 1;
+    pCase->page[17] = (pCase->page[17] & ~0xff0000ULL) | 0x410000;
+}
+
+//
+// Everything but the call code and want is zero
+//
+static BOOL
+IsOnly (
+    IN const MIN_CASE   &minCase,
+    IN const MIN_CASE   &want
+)
+{
+    return memcmp(&minCase.regs, &want.regs, sizeof(CPU_REG_64)) == 0 &&
+           (!minCase.bPage || memcmp(minCase.page, want.page, sizeof(want.page)) == 0);
+}
+
+static MIN_STATUS
+RunMinimizer (
+    IN  MIN_CRASH_PREDICATE pPredicate,
+    IN  const MIN_CASE      &crashing,
+    IN  UINT32              maxBatch,
+    IN  BOOL                bAttribute,
+    OUT PMIN_CASE           pMinimal,
+    OUT PMIN_STATS          pStats,
+    OUT PREDICATE_CONTEXT   *pContext
+)
+{
+    HcSimBackend        backend;
+    MIN_CONFIG          config = { maxBatch, 0 };
+    CrashMinimizer      minimizer(&config);
+    MinBackendTarget    target(backend, pPredicate, pContext, bAttribute);
+    MIN_STATUS          status = minimizer.Minimize(target, crashing, pMinimal);
+
+    minimizer.GetStats(pStats);
+    return status;
+}
+
+static BOOL
+CheckRegs ()
+{
+    MIN_CASE            crashing;
+    MIN_CASE            minimal;
+    MIN_CASE            want = {};
+    MIN_STATS           stats;
+    PREDICATE_CONTEXT   context;
+
+    want.regs.rcx = CRASH_CALLCODE;
+    want.regs.rdx = 0x20;
+    want.regs.r9 = 0x4100;
+
+    for (UINT32 seed = 1; seed <= 8; seed++)
+    {
+        for (BOOL bAttribute : { TRUE, FALSE })
+        {
+            NoisyCase(seed * 1000, seed & 1, &crashing);
+            context.runs = 0;
+            CHECK(RunMinimizer(RegCrash, crashing, 16, bAttribute, &minimal, &stats, &context) == MIN_STATUS_MINIMIZED);
+            want.bPage = crashing.bPage;
+            CHECK(IsOnly(minimal, want));
+            CHECK(stats.target == MIN_OUTCOME_CRASH);
+            CHECK(stats.bitsAfter == 3 && stats.bitsBefore > 100);
+            CHECK(stats.hangs == 0);
+            CHECK(bAttribute ? stats.bisections == 0 : stats.bisections != 0);
+        }
+    }
+
+    printf("[+] register crash checks passed (%u bits down to %u)\n", stats.bitsBefore, stats.bitsAfter);
+    return TRUE;
+}
+
+static BOOL
+CheckPage ()
+{
+    MIN_CASE            crashing;
+    MIN_CASE            minimal;
+    MIN_STATS           stats;
+    PREDICATE_CONTEXT   context;
+
+    NoisyCase(77, TRUE, &crashing);
+    CHECK(RunMinimizer(PageCrash, crashing, 16, TRUE, &minimal, &stats, &context) == MIN_STATUS_MINIMIZED);
+
+    CHECK((minimal.regs.rcx & MIN_CALLCODE_MASK) == CRASH_CALLCODE);
+    CHECK(MinPopCount(minimal.regs.rcx & ~MIN_CALLCODE_MASK) == 1);
+    CHECK(((minimal.regs.rcx >> 32) & 0xfff) != 0);
+    CHECK(minimal.page[17] == 0x410000);
+    CHECK(stats.bitsAfter == 1 + 2);
+
+    minimal.regs.rcx = 0;
+    minimal.page[17] = 0;
+    for (UINT32 q = 0; q < MIN_QWORDS; q++)
+    {
+        CHECK(*MinQword(&minimal, q) == 0);
+    }
+
+    printf("[+] page crash checks passed (%llu reboots, %llu batches)\n",
+           (unsigned long long)stats.reboots,
+           (unsigned long long)stats.batches);
+    return TRUE;
+}
+
+static BOOL
+CheckHangs ()
+{
+    MIN_CASE            crashing;
+    MIN_CASE            minimal;
+    MIN_STATS           stats;
+    PREDICATE_CONTEXT   context;
+
+    //
+    // Clearing RBX hangs, so one bit of it stays
+    //
+    NoisyCase(5, FALSE, &crashing);
+    CHECK(RunMinimizer(HangingCrash, crashing, 16, TRUE, &minimal, &stats, &context) == MIN_STATUS_MINIMIZED);
+    CHECK(stats.target == MIN_OUTCOME_CRASH);
+    CHECK(stats.hangs != 0 && stats.hangs == context.hung.size());
+    CHECK(context.rehung == 0);
+    CHECK(MinPopCount(minimal.regs.rbx) == 1);
+    CHECK(minimal.regs.rdx == 0x20 && minimal.regs.r9 == 0x4100);
+    CHECK(stats.bitsAfter == 4);
+
+    //
+    // A hang is what the original does, so it is what is kept
+    //
+    PREDICATE_CONTEXT hangContext;
+
+    NoisyCase(6, TRUE, &crashing);
+    CHECK(RunMinimizer(Hang, crashing, 16, TRUE, &minimal, &stats, &hangContext) == MIN_STATUS_MINIMIZED);
+    CHECK(stats.target == MIN_OUTCOME_HANG);
+    CHECK(minimal.regs.r10 == 1ULL << 63 && stats.bitsAfter == 1);
+
+    //
+    // Nothing to minimize
+    //
+    PREDICATE_CONTEXT passContext;
+
+    crashing.regs.r10 = 0;
+    CHECK(RunMinimizer(Hang, crashing, 16, TRUE, &minimal, &stats, &passContext) == MIN_STATUS_NOT_REPRODUCED);
+    CHECK(memcmp(&minimal, &crashing, sizeof(MIN_CASE)) == 0);
+
+    printf("[+] hang checks passed (%zu distinct hangs, none run twice)\n", context.hung.size());
+    return TRUE;
+}
+
+static BOOL
+CheckBatchSizes ()
+{
+    MIN_CASE    crashing;
+    MIN_CASE    reference;
+
+    NoisyCase(11, TRUE, &crashing);
+    for (UINT32 maxBatch : { 1u, 2u, 7u, 64u, 4096u })
+    {
+        MIN_CASE            minimal;
+        MIN_STATS           stats;
+        PREDICATE_CONTEXT   context;
+
+        CHECK(RunMinimizer(RegCrash, crashing, maxBatch, TRUE, &minimal, &stats, &context) == MIN_STATUS_MINIMIZED);
+        if (maxBatch == 1)
+        {
+            reference = minimal;
+        }
+        CHECK(memcmp(&minimal, &reference, sizeof(MIN_CASE)) == 0);
+        CHECK(stats.reboots == 1 + stats.accepted[0] + stats.accepted[1] + stats.accepted[2]);
+    }
+
+    printf("[+] batch size checks passed\n");
+    return TRUE;
+}
+
+static VOID
+Report (
+    IN const CHAR           *scenario,
+    IN MIN_CRASH_PREDICATE  pPredicate,
+    IN BOOL                 bPage,
+    IN UINT32               maxBatch,
+    IN BOOL                 bAttribute
+)
+{
+    MIN_CASE            crashing;
+    MIN_CASE            minimal;
+    MIN_STATS           stats;
+    PREDICATE_CONTEXT   context;
+    std::string         name = std::string("minimizer/") + scenario;
+
+    NoisyCase(42, bPage, &crashing);
+    RunMinimizer(pPredicate, crashing, maxBatch, bAttribute, &minimal, &stats, &context);
+
+    BenchReport((name + " reboots").c_str(), (double)stats.reboots, "reboots");
+    BenchReport((name + " batches").c_str(), (double)stats.batches, "batches");
+    BenchReport((name + " executed").c_str(), (double)stats.executed, "cases");
+}
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    UINT32 maxBatch = MIN_DEFAULT_MAX_BATCH;
+
+    if (argc > 1)
+    {
+        maxBatch = (UINT32)atoi(argv[1]);
+    }
+
+    if (!CheckRegs() || !CheckPage() || !CheckHangs() || !CheckBatchSizes())
+    {
+        return 1;
+    }
+
+    printf("[ ] max batch %u\n", maxBatch);
+    Report("regs batch 1", RegCrash, FALSE, 1, TRUE);
+    Report("regs", RegCrash, FALSE, maxBatch, TRUE);
+    Report("regs unattributed", RegCrash, FALSE, maxBatch, FALSE);
+    Report("regs+page", RegCrash, TRUE, maxBatch, TRUE);
+    Report("page", PageCrash, TRUE, maxBatch, TRUE);
+    Report("page unattributed", PageCrash, TRUE, maxBatch, FALSE);
+    Report("hanging", HangingCrash, FALSE, maxBatch, TRUE);
+
+    return 0;
+}
@@ -0,0 +1,267 @@
+/*++
+
+Module Name:
+
+    BenchMutator.cpp
+
+Abstract:
+
+    Checks the havoc mutator and measures mutations/sec.
+
+    Checks (exit non-zero on failure)
+        - an iteration regenerates identically from (seed, iteration), in any
+          order and from a restored state, and another seed gives other cases
+        - the call code in RCX is never changed, every operation gets used,
+          register-only masks leave the page alone
+        - no allocations while mutating
+
+    Benchmarks
+        havoc/regs          - register and control word operations
+        havoc/regs + page   - all operations, on a 4K input page
+        havoc/regs + log    - register operations, recording a MUTATOR_LOG
+
+    Usage: BenchMutator
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <new>
+#include <stdlib.h>
+#include "ViFuBench.h"
+#include "../ViFuCore/HavocMutator.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define REPLAY_CASES    512
+
+static UINT64 g_allocations = 0;
+
+VOID *
+operator new (
+    IN SIZE_T   size
+)
+{
+    VOID *p = malloc(size == 0 ? 1 : size);
+
+    g_allocations++;
+    if (p == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+VOID
+operator delete (
+    IN VOID     *p
+) noexcept
+{
+    free(p);
+}
+
+VOID
+operator delete (
+    IN VOID     *p,
+    IN SIZE_T   size
+) noexcept
+{
+    (VOID)size;
+    free(p);
+}
+
+static UINT64 s_page[MUTATOR_PAGE_QWORDS];
+static UINT64 s_pageReplay[MUTATOR_PAGE_QWORDS];
+
+static VOID
+BaseCase (
+    OUT PCPU_REG_64 pRegs,
+    OUT PUINT64     pPage
+)
+{
+    memset(pRegs, 0, sizeof(CPU_REG_64));
+    pRegs->rcx = 0x20000004cULL;        // Call code 0x4c, 2 reps
+    pRegs->rdx = USE_GPA_MEM_NOFILL_0;
+    pRegs->r8 = USE_GPA_MEM_NOFILL_0;
+    memset(pPage, 0, sizeof(s_page));
+}
+
+static UINT64
+PageHash (
+    IN const UINT64 *pPage
+)
+{
+    UINT64 hash = 0;
+
+    for (UINT32 q = 0; q < MUTATOR_PAGE_QWORDS; q++)
+    {
+        hash = PageFillSplitMix(hash ^ pPage[q]);
+    }
+    return hash;
+}
+
+static BOOL
+CheckReplay ()
+{
+    HavocMutator    mutator(0x1234);
+    CPU_REG_64      cases[REPLAY_CASES];
+    UINT64          pageHashes[REPLAY_CASES];
+    CPU_REG_64      regs;
+    MUTATOR_LOG     log;
+    UINT32          opsSeen = 0;
+
+    for (UINT32 i = 0; i < REPLAY_CASES; i++)
+    {
+        BaseCase(&cases[i], s_page);
+        CHECK(mutator.Mutate(&cases[i], s_page, &log) == log.count);
+        CHECK(log.iteration == i && log.count >= 1 && log.count <= 8);
+        CHECK((cases[i].rcx & 0xffff) == 0x4c);
+
+        pageHashes[i] = PageHash(s_page);
+        for (UINT32 s = 0; s < log.count; s++)
+        {
+            opsSeen |= 1u << log.steps[s].op;
+        }
+    }
+    CHECK(opsSeen == MUTATOR_OP_MASK_ALL);
+    CHECK(mutator.Iteration() == REPLAY_CASES);
+
+    //
+    // Backwards, from another mutator restored from the saved state
+    //
+    MUTATOR_STATE state = mutator.State();
+    HavocMutator replay(0);
+
+    CHECK(replay.Restore(state));
+    for (UINT32 i = REPLAY_CASES; i-- > 0; )
+    {
+        replay.Seek(i);
+        BaseCase(&regs, s_pageReplay);
+        replay.Mutate(&regs, s_pageReplay);
+        CHECK(memcmp(&regs, &cases[i], sizeof(regs)) == 0);
+        CHECK(PageHash(s_pageReplay) == pageHashes[i]);
+    }
+
+    //
+    // Another seed, mostly other cases
+    //
+    HavocMutator other(0x1235);
+    UINT32 same = 0;
+
+    for (UINT32 i = 0; i < REPLAY_CASES; i++)
+    {
+        BaseCase(&regs, s_pageReplay);
+        other.Mutate(&regs, s_pageReplay);
+        same += memcmp(&regs, &cases[i], sizeof(regs)) == 0 && PageHash(s_pageReplay) == pageHashes[i];
+    }
+    CHECK(same < REPLAY_CASES / 16);
+
+    state.magic = 0;
+    CHECK(!replay.Restore(state));
+    state = mutator.State();
+    state.maxStack = MUTATOR_MAX_STACK + 1;
+    CHECK(!replay.Restore(state));
+
+    printf("[+] havoc replay checks passed\n");
+    return TRUE;
+}
+
+static BOOL
+CheckMasks ()
+{
+    HavocMutator    regsOnly(7, MUTATOR_OP_MASK_REGS, 16);
+    HavocMutator    controlOnly(7, 1u << MUTATOR_OP_CONTROL, 4);
+    CPU_REG_64      regs;
+    UINT64          before = 0;
+
+    for (UINT32 i = 0; i < 10000; i++)
+    {
+        BaseCase(&regs, s_page);
+        before = PageHash(s_page);
+        regsOnly.Mutate(&regs, s_page);
+        CHECK(PageHash(s_page) == before);
+        CHECK((regs.rcx & 0xffff) == 0x4c);
+
+        BaseCase(&regs, s_page);
+        controlOnly.Mutate(&regs);
+        CHECK((regs.rcx & 0xffff) == 0x4c);
+        CHECK(regs.rdx == USE_GPA_MEM_NOFILL_0 && regs.r8 == USE_GPA_MEM_NOFILL_0);
+    }
+
+    printf("[+] havoc mask checks passed\n");
+    return TRUE;
+}
+
+static BOOL
+CheckAllocations ()
+{
+    HavocMutator    mutator(99);
+    CPU_REG_64      regs;
+    MUTATOR_LOG     log;
+    UINT64          allocations = g_allocations;
+
+    for (UINT32 i = 0; i < 100000; i++)
+    {
+        BaseCase(&regs, s_page);
+        mutator.Mutate(&regs, s_page, &log);
+    }
+    CHECK(g_allocations == allocations);
+
+    printf("[+] havoc allocation checks passed\n");
+    return TRUE;
+}
+
+int
+main ()
+{
+    if (!CheckReplay() || !CheckMasks() || !CheckAllocations())
+    {
+        return 1;
+    }
+
+    //
+    // Each unit is one Mutate() call, 1 - 8 stacked operations
+    //
+    BenchReport("havoc/regs", BenchRun([](UINT64 iters) {
+        HavocMutator mutator(1, MUTATOR_OP_MASK_REGS);
+        CPU_REG_64 regs = {};
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            mutator.Mutate(&regs);
+            BenchDoNotOptimize(regs);
+        }
+    }), "mutations/s");
+
+    BenchReport("havoc/regs + page", BenchRun([](UINT64 iters) {
+        HavocMutator mutator(1);
+        CPU_REG_64 regs = {};
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            mutator.Mutate(&regs, s_page);
+            BenchDoNotOptimize(regs);
+        }
+    }), "mutations/s");
+
+    BenchReport("havoc/regs + log", BenchRun([](UINT64 iters) {
+        HavocMutator mutator(1, MUTATOR_OP_MASK_REGS);
+        CPU_REG_64 regs = {};
+        MUTATOR_LOG log;
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            mutator.Mutate(&regs, NULL, &log);
+            BenchDoNotOptimize(log);
+        }
+    }), "mutations/s");
+
+    return 0;
+}
@@ -0,0 +1,295 @@
+/*++
+
+Module Name:
+
+    BenchNovelty.cpp
+
+Abstract:
+
+    Checks the novelty tracker against std::unordered_map and measures
+    inserts/sec, next to the linear uniqueCalls scan it replaced.
+
+    Checks (exit non-zero on failure)
+        - counts, hits and first seen match a reference map through growth
+        - key masks pick the fields that make a signature
+        - a snapshot loads back identical, as does a copy saved after the
+          set grew, a damaged or differently keyed one is refused
+
+    Benchmarks
+        novelty/insert new          - distinct signatures, table growing
+        novelty/insert seen         - hits on a 64K signature set
+        novelty/observe             - signature + insert from case results,
+                                      1/16 of them new
+        linear scan/4095 (old)      - uniqueCalls lookup at its full size
+
+    Usage: BenchNovelty [scratch directory, default .]
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "ViFuBench.h"
+#include "../ViFuCore/NoveltyTracker.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+static std::string g_dir = ".";
+
+static UINT64
+NextRandom (
+    IN OUT UINT64   *pState
+)
+{
+    *pState ^= *pState << 13;
+    *pState ^= *pState >> 7;
+    *pState ^= *pState << 17;
+    return *pState;
+}
+
+static NOVELTY_ENTRY
+MakeEntry (
+    IN UINT64   signature,
+    IN UINT64   now
+)
+{
+    NOVELTY_ENTRY entry = {};
+
+    entry.signature = signature;
+    entry.callcode = signature & 0xfff;
+    entry.firstSeen = now;
+    entry.hits = 1;
+    return entry;
+}
+
+static BOOL
+CheckReference ()
+{
+    NoveltyTracker                      tracker;
+    std::unordered_map<UINT64, UINT64>  reference;
+    UINT64                              state = 0x1234567;
+
+    //
+    // Small key space so there are plenty of repeats, through many rehashes
+    //
+    for (UINT64 i = 0; i < 2000000; i++)
+    {
+        UINT64 signature = (NextRandom(&state) % 300000) + 1;
+        BOOL isNew = reference.find(signature) == reference.end();
+
+        CHECK(tracker.Insert(MakeEntry(signature, i)) == isNew);
+        reference[signature]++;
+    }
+
+    CHECK(tracker.Count() == reference.size());
+    CHECK(tracker.Observations() == 2000000);
+    for (SIZE_T e = 0; e < tracker.Count(); e++)
+    {
+        const NOVELTY_ENTRY &entry = tracker.Entry(e);
+
+        CHECK(reference[entry.signature] == entry.hits);
+        CHECK(tracker.Lookup(entry.signature) == &entry);
+        CHECK(e == 0 || tracker.Entry(e - 1).firstSeen < entry.firstSeen);
+    }
+    CHECK(tracker.Lookup(300001) == NULL);
+
+    printf("[+] novelty reference checks passed\n");
+    return TRUE;
+}
+
+static BOOL
+CheckKeys ()
+{
+    CPU_REG_64              inRegs = {};
+    HYPERCALL_BATCH_RESULT  result = {};
+    HYPERCALL_BATCH_RESULT  other = {};
+
+    inRegs.rcx = 0x8003;
+    result.hvStatus = 0;
+    result.repComplete = 3;
+    result.regsOut.rax = 0x30000;
+    other = result;
+    other.regsOut.rdx = 1;
+
+    NoveltyTracker byInput(NOVELTY_KEY_INPUT);
+    NoveltyTracker byOutput(NOVELTY_KEY_INPUT | NOVELTY_KEY_OUTPUT);
+
+    CHECK(byInput.Observe(inRegs, result, 1));
+    CHECK(!byInput.Observe(inRegs, other, 2));
+    CHECK(byOutput.Observe(inRegs, result, 1));
+    CHECK(byOutput.Observe(inRegs, other, 2));
+
+    //
+    // Status and rep count are separate fields of the signature
+    //
+    NoveltyTracker byStatus(NOVELTY_KEY_STATUS | NOVELTY_KEY_REP_COMPLETE);
+
+    other = result;
+    other.hvStatus = 3;
+    other.repComplete = 0;
+    CHECK(byStatus.Observe(inRegs, result, 1));
+    CHECK(byStatus.Observe(inRegs, other, 2));
+    CHECK(!byStatus.Observe(inRegs, result, 3));
+    CHECK(byStatus.Entry(0).hits == 2 && byStatus.Entry(0).repComplete == 3);
+    CHECK(byStatus.Entry(1).hvStatus == 3);
+
+    printf("[+] novelty key checks passed\n");
+    return TRUE;
+}
+
+static BOOL
+CheckSnapshot ()
+{
+    std::string     path = g_dir + "/novelty.bin";
+    NoveltyTracker  tracker;
+    NoveltyTracker  loaded;
+    NoveltyTracker  otherKey(NOVELTY_KEY_ALL);
+    UINT64          state = 99;
+
+    for (UINT64 i = 0; i < 100000; i++)
+    {
+        tracker.Insert(MakeEntry((NextRandom(&state) % 50000) + 1, i));
+    }
+
+    CHECK(tracker.Save(path.c_str()));
+    CHECK(loaded.Load(path.c_str()));
+    CHECK(loaded.Count() == tracker.Count());
+    CHECK(loaded.Observations() == tracker.Observations());
+    for (SIZE_T e = 0; e < tracker.Count(); e++)
+    {
+        CHECK(memcmp(&loaded.Entry(e), &tracker.Entry(e), sizeof(NOVELTY_ENTRY)) == 0);
+    }
+    CHECK(!loaded.Insert(tracker.Entry(tracker.Count() / 2)));
+    CHECK(!otherKey.Load(path.c_str()));
+
+    //
+    // A copy saved after the set moved on loads back as the copy
+    //
+    std::vector<NOVELTY_ENTRY>  copy;
+    UINT64                      observations = 0;
+
+    tracker.CopySnapshot(copy, &observations);
+    tracker.Insert(MakeEntry(50001, 0));
+    CHECK(NoveltySaveSnapshot(path.c_str(), tracker.KeyMask(), observations, copy));
+    CHECK(loaded.Load(path.c_str()));
+    CHECK(loaded.Count() == copy.size() && loaded.Count() + 1 == tracker.Count());
+    CHECK(loaded.Observations() == observations);
+
+    //
+    // Flip one byte of an entry
+    //
+    FILE *pFile = fopen(path.c_str(), "r+b");
+    CHECK(pFile != NULL);
+    fseek(pFile, sizeof(NOVELTY_SNAPSHOT_HEADER) + 7 * sizeof(NOVELTY_ENTRY) + 3, SEEK_SET);
+    fputc(0x5a, pFile);
+    fclose(pFile);
+
+    SIZE_T count = loaded.Count();
+    CHECK(!loaded.Load(path.c_str()));
+    CHECK(loaded.Count() == count);
+
+    remove(path.c_str());
+    printf("[+] novelty snapshot checks passed (%llu entries, %llu bytes)\n",
+           (unsigned long long)tracker.Count(),
+           (unsigned long long)(sizeof(NOVELTY_SNAPSHOT_HEADER) + tracker.Count() * sizeof(NOVELTY_ENTRY)));
+    return TRUE;
+}
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    if (argc > 1)
+    {
+        g_dir = argv[1];
+    }
+
+    if (!CheckReference() || !CheckKeys() || !CheckSnapshot())
+    {
+        return 1;
+    }
+
+    BenchReport("novelty/insert new", BenchRun([](UINT64 iters) {
+        NoveltyTracker tracker;
+        UINT64 state = 0x9E3779B97F4A7C15ULL;
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            BenchDoNotOptimize(tracker.Insert(MakeEntry(NextRandom(&state), i)));
+        }
+    }), "inserts/s");
+
+    {
+        NoveltyTracker tracker;
+        std::vector<UINT64> keys(65536);
+        UINT64 state = 42;
+
+        for (UINT64 &key : keys)
+        {
+            key = NextRandom(&state);
+            tracker.Insert(MakeEntry(key, 0));
+        }
+
+        BenchReport("novelty/insert seen", BenchRun([&](UINT64 iters) {
+            for (UINT64 i = 0; i < iters; i++)
+            {
+                BenchDoNotOptimize(tracker.Insert(MakeEntry(keys[(i * 40503) & 0xffff], i)));
+            }
+        }), "inserts/s");
+    }
+
+    {
+        NoveltyTracker tracker(NOVELTY_KEY_ALL);
+        CPU_REG_64 inRegs = {};
+        HYPERCALL_BATCH_RESULT result = {};
+        UINT64 state = 7;
+
+        BenchReport("novelty/observe", BenchRun([&](UINT64 iters) {
+            for (UINT64 i = 0; i < iters; i++)
+            {
+                inRegs.rcx = 0x10000 | (i & 0xbf);
+                result.hvStatus = (UINT16)(i & 0x1f);
+                result.regsOut.rax = (i & 0xf) == 0 ? NextRandom(&state) : 0;
+                BenchDoNotOptimize(tracker.Observe(inRegs, result, i));
+            }
+        }), "cases/s");
+    }
+
+    {
+        std::vector<UINT64> uniqueCalls(0xfff);
+        UINT64 state = 5;
+
+        for (UINT64 &call : uniqueCalls)
+        {
+            call = NextRandom(&state);
+        }
+
+        BenchReport("linear scan/4095 (old)", BenchRun([&](UINT64 iters) {
+            for (UINT64 i = 0; i < iters; i++)
+            {
+                UINT64 rcx = uniqueCalls[(i * 40503) % 0xfff];
+                DWORD u = 0;
+
+                BenchDoNotOptimize(rcx);
+                while (u < 0xfff && uniqueCalls[u] != rcx)
+                {
+                    u++;
+                }
+                BenchDoNotOptimize(u);
+            }
+        }), "lookups/s");
+    }
+
+    return 0;
+}
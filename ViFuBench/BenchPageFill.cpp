@@ -0,0 +1,191 @@
+/*++
+
+Module Name:
+
+    BenchPageFill.cpp
+
+Abstract:
+
+    Checks the PageFill SSE2/AVX2 kernels against the scalar reference and
+    reports GB/s for each pattern and ISA, whole page.
+
+    Checks (exit non-zero on failure)
+        - every ISA writes the same bytes as the scalar kernel for a spread of
+          patterns, values, steps and sub-ranges
+        - nothing outside [offset, offset + length) is touched
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include "ViFuBench.h"
+#include "../ViFuCore/PageFill.h"
+
+static const CHAR *g_patternNames[PAGE_FILL_PATTERN_MAX] =
+{
+    "constant",
+    "self-ptr",
+    "walking-bit",
+    "increment",
+    "prng"
+};
+
+static const CHAR *g_isaNames[PAGE_FILL_ISA_MAX] =
+{
+    "scalar",
+    "sse2",
+    "avx2"
+};
+
+#define CANARY  0xCC
+
+alignas(PAGE_FILL_PAGE_SIZE) static UINT8 g_ref[PAGE_FILL_PAGE_SIZE];
+alignas(PAGE_FILL_PAGE_SIZE) static UINT8 g_out[PAGE_FILL_PAGE_SIZE];
+
+static BOOL
+CheckIsa (
+    IN PAGE_FILL_ISA    isa
+)
+{
+    static const UINT32 ranges[][2] =
+    {
+        { 0, PAGE_FILL_PAGE_SIZE },
+        { 0, 8 },
+        { 8, 24 },
+        { 24, 40 },
+        { 56, 64 },
+        { 128, 2048 },
+        { 4000, 96 },
+        { 8, PAGE_FILL_PAGE_SIZE - 8 },
+        { 4088, 8 },
+        { 100, 0 },
+    };
+    static const UINT64 values[] = { 0, 1, 63, 64, 0x123456789ABCDEF0ULL, ~0ULL };
+    static const UINT64 steps[] = { 0, 1, 7, 16, 63, 64, 0x8000000000000001ULL };
+    UINT32 failures = 0;
+
+    for (UINT32 pat = 0; pat < PAGE_FILL_PATTERN_MAX; pat++)
+    {
+        for (UINT32 r = 0; r < _ARRAYSIZE(ranges); r++)
+        {
+            for (UINT32 v = 0; v < _ARRAYSIZE(values); v++)
+            {
+                for (UINT32 s = 0; s < _ARRAYSIZE(steps); s++)
+                {
+                    PAGE_FILL_PARAMS params = {};
+
+                    params.pattern = pat;
+                    params.offset = ranges[r][0];
+                    params.length = ranges[r][1];
+                    params.value = values[v];
+                    params.step = steps[s];
+
+                    memset(g_ref, CANARY, sizeof(g_ref));
+                    memset(g_out, CANARY, sizeof(g_out));
+                    PageFill(PAGE_FILL_ISA_SCALAR, g_ref, &params);
+                    PageFill(isa, g_out, &params);
+
+                    BOOL bOk = memcmp(g_ref, g_out, sizeof(g_ref)) == 0;
+
+                    for (UINT32 b = 0; b < PAGE_FILL_PAGE_SIZE && bOk; b++)
+                    {
+                        BOOL inRange = b >= params.offset && b < params.offset + params.length;
+
+                        bOk = inRange || g_out[b] == CANARY;
+                    }
+
+                    if (!bOk && failures++ < 8)
+                    {
+                        printf("[-] %s %s offset:%u length:%u value:0x%llx step:0x%llx mismatch\n",
+                               g_isaNames[isa],
+                               g_patternNames[pat],
+                               params.offset,
+                               params.length,
+                               (unsigned long long)params.value,
+                               (unsigned long long)params.step);
+                    }
+                }
+            }
+        }
+    }
+
+    return failures == 0;
+}
+
+//
+// Spot checks of the scalar reference itself
+//
+static BOOL
+CheckReference ()
+{
+    PAGE_FILL_PARAMS    params = {};
+    PUINT64             pSlots = (PUINT64)g_ref;
+
+    PAGE_FILL_INIT(&params, PAGE_FILL_SELF_PTR, 0x7000, 0);
+    PageFill(PAGE_FILL_ISA_SCALAR, g_ref, &params);
+    if (pSlots[0] != 0x7000 || pSlots[511] != 0x7FF8)
+    {
+        return FALSE;
+    }
+
+    PAGE_FILL_INIT(&params, PAGE_FILL_WALKING_BIT, 62, 1);
+    PageFill(PAGE_FILL_ISA_SCALAR, g_ref, &params);
+    if (pSlots[0] != (1ULL << 62) || pSlots[1] != (1ULL << 63) || pSlots[2] != 1)
+    {
+        return FALSE;
+    }
+
+    PAGE_FILL_INIT(&params, PAGE_FILL_INCREMENT, 10, 3);
+    PageFill(PAGE_FILL_ISA_SCALAR, g_ref, &params);
+    return pSlots[0] == 10 && pSlots[100] == 310;
+}
+
+int
+main ()
+{
+    PAGE_FILL_ISA   best = PageFillBestIsa();
+    BOOL            bOk = CheckReference();
+
+    if (!bOk)
+    {
+        printf("[-] scalar reference check failed\n");
+    }
+
+    for (UINT32 isa = PAGE_FILL_ISA_SSE2; isa <= (UINT32)best; isa++)
+    {
+        bOk &= CheckIsa((PAGE_FILL_ISA)isa);
+    }
+
+    if (!bOk)
+    {
+        return 1;
+    }
+    printf("[+] PageFill kernels match the scalar reference (best ISA %s)\n", g_isaNames[best]);
+
+    for (UINT32 pat = 0; pat < PAGE_FILL_PATTERN_MAX; pat++)
+    {
+        for (UINT32 isa = PAGE_FILL_ISA_SCALAR; isa <= (UINT32)best; isa++)
+        {
+            PAGE_FILL_PARAMS    params = {};
+            CHAR                name[64];
+
+            PAGE_FILL_INIT(&params, pat, 0x1000, 1);
+
+            double pagesPerSec = BenchRun([&](UINT64 iters) {
+                for (UINT64 i = 0; i < iters; i++)
+                {
+                    params.value = 0x1000 + i;
+                    PageFill((PAGE_FILL_ISA)isa, g_out, &params);
+                    BenchDoNotOptimize(g_out[i & 0xFFF]);
+                }
+            }, 0.25);
+
+            snprintf(name, sizeof(name), "pagefill/%s/%s", g_patternNames[pat], g_isaNames[isa]);
+            BenchReport(name, pagesPerSec * PAGE_FILL_PAGE_SIZE / 1e9, "GB/s");
+        }
+    }
+
+    return 0;
+}
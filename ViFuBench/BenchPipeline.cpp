@@ -0,0 +1,484 @@
+/*++
+
+Module Name:
+
+    BenchPipeline.cpp
+
+Abstract:
+
+    Checks the generate -> execute -> triage pipeline and measures it
+    against the sequential worker loop it replaces in ViFuR3, with a
+    simulated backend for execute and a sleep per batch for the journal
+    group commit of generate.
+
+    Checks (exit non-zero on failure)
+        - the SPSC queue passes every item once and in order between two
+          threads, and refuses to push when full and to pop when empty
+        - every item is generated, executed and triaged once and in order,
+          for several depths and over several runs of the same pipeline
+        - fuzzing the case space on pipelined workers gets the same cases,
+          success, effective and novelty counts as the sequential loop, and
+          every chunk is completed
+
+    Benchmarks
+        pipeline/sequential             - cases/s, generate, execute and
+                                          triage one after another
+        pipeline/depth <n>              - cases/s pipelined, <n> batches
+        pipeline/depth <n> speedup      - against sequential
+    followed by the per-stage utilisation and queue occupancy of the deepest
+
+    Usage: BenchPipeline [per-call latency in ns, default 2000]
+                         [commit latency per batch in us, default 100]
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <string>
+#include <mutex>
+#include <stdlib.h>
+#include "ViFuBench.h"
+#include "../ViFuCore/Pipeline.h"
+#include "../ViFuCore/WorkerPool.h"
+#include "../ViFuCore/CaseSpace.h"
+#include "../ViFuCore/HcSimBackend.h"
+#include "../ViFuCore/NoveltyTracker.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define BENCH_BATCH_CASES   64
+#define QUEUE_ITEMS         1000000
+#define ORDER_ITEMS         20000
+
+typedef struct _ORDER_ITEM
+{
+    UINT64  seq;
+    UINT64  value;
+} ORDER_ITEM;
+
+//
+// A batch going round a simulated worker's pipeline, as FUZZ_BATCH in ViFuR3
+//
+typedef struct _SIM_BATCH
+{
+    HcBatchEncoder  batch;
+    HcBatchResults  results;
+    WORKER_CHUNK    chunk;
+    BOOL            bChunkEnd;
+    UINT32          status;
+
+    _SIM_BATCH ()
+        : batch(BENCH_BATCH_CASES),
+          results(BENCH_BATCH_CASES)
+    {
+    }
+} SIM_BATCH;
+
+typedef struct _SIM_WORKER
+{
+    HcSimBackend        backend;
+    Pipeline<SIM_BATCH> pipeline;
+    SIM_BATCH           sequential;     // The one batch of the sequential loop
+    WORKER_CHUNK        chunk;
+    UINT64              nextCase;
+
+    _SIM_WORKER (
+        IN UINT32   depth
+    )
+        : pipeline(depth),
+          nextCase(0)
+    {
+        memset(&chunk, 0, sizeof(chunk));
+    }
+} SIM_WORKER;
+
+//
+// Everything a fuzzing run shares between its workers
+//
+typedef struct _SIM_FUZZ
+{
+    const CaseSpace *pSpace;
+    UINT32          commitUs;           // Sleep per batch, the journal commit
+    std::mutex      noveltyLock;
+    NoveltyTracker  novelty;
+} SIM_FUZZ;
+
+static VOID
+Commit (
+    IN SIM_FUZZ &fuzz
+)
+{
+    if (fuzz.commitUs != 0)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(fuzz.commitUs));
+    }
+}
+
+//
+// Fill the batch from the worker's chunk, claiming the next one once it is
+// used up. FALSE once the pool has none left
+//
+static BOOL
+Generate (
+    IN OUT SIM_FUZZ         &fuzz,
+    IN OUT WorkerPool       &pool,
+    IN OUT SIM_WORKER       *pWorker,
+    IN     UINT32           w,
+    IN OUT WorkerCounters   &counters,
+    IN OUT SIM_BATCH        &item
+)
+{
+    const CaseSpace &space = *fuzz.pSpace;
+    FUZZ_CASE       fuzzCase;
+
+    if (pWorker->nextCase == pWorker->chunk.end)
+    {
+        if (!pool.Claim(w, counters, &pWorker->chunk))
+        {
+            return FALSE;
+        }
+        pWorker->nextCase = pWorker->chunk.begin;
+    }
+
+    item.batch.Reset();
+    item.chunk = pWorker->chunk;
+    for (; pWorker->nextCase < pWorker->chunk.end && !item.batch.IsFull(); pWorker->nextCase++)
+    {
+        space.Materialize(pWorker->nextCase % space.Count(), &fuzzCase);
+        item.batch.Add(fuzzCase.regs);
+        counters.Add(WORKER_COUNTER_CASES);
+    }
+    item.bChunkEnd = pWorker->nextCase == pWorker->chunk.end;
+    Commit(fuzz);
+    return TRUE;
+}
+
+static VOID
+Execute (
+    IN OUT WorkerPool   &pool,
+    IN OUT SIM_WORKER   *pWorker,
+    IN OUT SIM_BATCH    &item
+)
+{
+    item.status = pWorker->backend.ExecBatch(item.batch, item.results);
+    if (item.bChunkEnd)
+    {
+        pool.Complete(item.chunk);
+    }
+}
+
+static VOID
+Triage (
+    IN OUT SIM_FUZZ         &fuzz,
+    IN OUT WorkerCounters   &counters,
+    IN     SIM_BATCH        &item
+)
+{
+    if (item.status != 0)
+    {
+        counters.Add(WORKER_COUNTER_ERRORS);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(fuzz.noveltyLock);
+
+        for (UINT32 c = 0; c < item.results.Count(); c++)
+        {
+            fuzz.novelty.Observe(item.batch.Case(c), item.results[c], 0);
+        }
+    }
+
+    for (UINT32 c = 0; c < item.results.Count(); c++)
+    {
+        HV_STATUS status = item.results[c].hvStatus;
+
+        counters.Add(WORKER_COUNTER_SUCCESS, status == HV_STATUS_SUCCESS);
+        counters.Add(WORKER_COUNTER_EFFECTIVE, InputGenIsEffectiveStatus(status));
+    }
+}
+
+//
+// Fuzz the cases of the space in [begin, end) on the pool, indices wrap past
+// the end of the space. depth 0 runs the three steps one after another on
+// the worker's thread, as ViFuR3 did before the pipeline
+//
+static VOID
+FuzzSpace (
+    IN OUT SIM_FUZZ                                 &fuzz,
+    IN OUT WorkerPool                               &pool,
+    IN OUT std::vector<std::unique_ptr<SIM_WORKER>> &simWorkers,
+    IN     UINT64                                   begin,
+    IN     UINT64                                   end,
+    IN     UINT32                                   depth
+)
+{
+    pool.Seed(begin, end, fuzz.pSpace->CasesPerCombo());
+    pool.RunWorkers([&](UINT32 w, WorkerCounters &counters) {
+        SIM_WORKER *pWorker = simWorkers[w].get();
+
+        if (depth == 0)
+        {
+            while (Generate(fuzz, pool, pWorker, w, counters, pWorker->sequential))
+            {
+                Execute(pool, pWorker, pWorker->sequential);
+                Triage(fuzz, counters, pWorker->sequential);
+            }
+            return;
+        }
+
+        pWorker->pipeline.Run(
+            [&](SIM_BATCH &item) {
+                return Generate(fuzz, pool, pWorker, w, counters, item);
+            },
+            [&](SIM_BATCH &item) {
+                Execute(pool, pWorker, item);
+            },
+            [&](SIM_BATCH &item) {
+                Triage(fuzz, counters, item);
+            });
+    });
+}
+
+static VOID
+MakeWorkers (
+    IN  UINT32                                      workers,
+    IN  UINT32                                      depth,
+    IN  UINT32                                      latencyNs,
+    OUT std::vector<std::unique_ptr<SIM_WORKER>>    *pSimWorkers
+)
+{
+    pSimWorkers->clear();
+    for (UINT32 w = 0; w < workers; w++)
+    {
+        pSimWorkers->emplace_back(new SIM_WORKER(depth));
+        pSimWorkers->back()->backend.SetLatency(latencyNs);
+    }
+}
+
+static BOOL
+CheckQueue ()
+{
+    SpscQueue<UINT64>   queue(1000);
+    UINT64              value = 0;
+    UINT64              expect = 0;
+
+    CHECK(queue.Capacity() == 1024);
+    CHECK(!queue.TryPop(&value));
+    for (UINT64 i = 0; i < queue.Capacity(); i++)
+    {
+        CHECK(queue.TryPush(i));
+    }
+    CHECK(!queue.TryPush(0));
+    CHECK(queue.Size() == queue.Capacity());
+    while (queue.TryPop(&value))
+    {
+        CHECK(value == expect++);
+    }
+    CHECK(expect == queue.Capacity() && queue.Size() == 0);
+
+    std::thread producer([&]() {
+        for (UINT64 i = 0; i < QUEUE_ITEMS; i++)
+        {
+            while (!queue.TryPush(i))
+            {
+                PipelineRelax();
+            }
+        }
+    });
+
+    expect = 0;
+    while (expect < QUEUE_ITEMS)
+    {
+        if (queue.TryPop(&value))
+        {
+            CHECK(value == expect++);
+        }
+    }
+    producer.join();
+    CHECK(queue.Size() == 0);
+
+    printf("[+] queue checks passed (%u items across threads)\n", QUEUE_ITEMS);
+    return TRUE;
+}
+
+static BOOL
+CheckOrder ()
+{
+    for (UINT32 depth : { 2u, 3u, 8u })
+    {
+        Pipeline<ORDER_ITEM> pipeline(depth);
+        PIPELINE_STATS stats;
+
+        for (UINT32 run = 0; run < 3; run++)
+        {
+            UINT64  generated = 0;
+            UINT64  executed = 0;
+            UINT64  triaged = 0;
+            BOOL    bInOrder = TRUE;
+
+            pipeline.Run(
+                [&](ORDER_ITEM &item) {
+                    if (generated == ORDER_ITEMS)
+                    {
+                        return FALSE;
+                    }
+                    item.seq = generated++;
+                    item.value = 0;
+                    return TRUE;
+                },
+                [&](ORDER_ITEM &item) {
+                    bInOrder &= item.seq == executed++;
+                    item.value = item.seq * 3;
+                },
+                [&](ORDER_ITEM &item) {
+                    bInOrder &= item.seq == triaged++ && item.value == item.seq * 3;
+                });
+
+            CHECK(bInOrder);
+            CHECK(generated == ORDER_ITEMS && executed == ORDER_ITEMS && triaged == ORDER_ITEMS);
+        }
+
+        pipeline.GetStats(&stats);
+        CHECK(stats.depth == depth);
+        for (UINT32 s = 0; s < PIPELINE_STAGE_COUNT; s++)
+        {
+            CHECK(stats.stages[s].items == 3 * ORDER_ITEMS);
+            CHECK(stats.stages[s].busyNs <= stats.wallNs);
+        }
+        for (UINT32 q = 0; q < PIPELINE_QUEUE_COUNT; q++)
+        {
+            CHECK(stats.queues[q].max <= depth);
+            CHECK(PipelineAverageOccupancy(stats, (PIPELINE_QUEUE)q) <= depth);
+        }
+    }
+
+    printf("[+] pipeline order checks passed (depths 2, 3, 8, 3 runs each)\n");
+    return TRUE;
+}
+
+static BOOL
+CheckFuzz ()
+{
+    HcFilter                                    filter;
+    CaseSpace                                   space(filter, 5);
+    std::vector<std::unique_ptr<SIM_WORKER>>    simWorkers;
+    SIM_FUZZ                                    sequential;
+    WorkerPool                                  single(1);
+
+    sequential.pSpace = &space;
+    sequential.commitUs = 0;
+    MakeWorkers(1, 2, 0, &simWorkers);
+    FuzzSpace(sequential, single, simWorkers, 0, space.Count(), 0);
+    CHECK(single.Total(WORKER_COUNTER_CASES) == space.Count());
+    CHECK(single.Total(WORKER_COUNTER_SUCCESS) != 0);
+
+    for (UINT32 workers : { 1u, 4u })
+    {
+        for (UINT32 depth : { 2u, 4u, 16u })
+        {
+            SIM_FUZZ    pipelined;
+            WorkerPool  pool(workers);
+
+            pipelined.pSpace = &space;
+            pipelined.commitUs = 0;
+            MakeWorkers(workers, depth, 0, &simWorkers);
+            FuzzSpace(pipelined, pool, simWorkers, 0, space.Count(), depth);
+
+            CHECK(pool.Total(WORKER_COUNTER_CASES) == space.Count());
+            CHECK(pool.Total(WORKER_COUNTER_SUCCESS) == single.Total(WORKER_COUNTER_SUCCESS));
+            CHECK(pool.Total(WORKER_COUNTER_EFFECTIVE) == single.Total(WORKER_COUNTER_EFFECTIVE));
+            CHECK(pool.Total(WORKER_COUNTER_ERRORS) == 0);
+            CHECK(pipelined.novelty.Count() == sequential.novelty.Count());
+            CHECK(pipelined.novelty.Observations() == space.Count());
+            CHECK(pool.LowWatermark() == space.Count());
+        }
+    }
+
+    printf("[+] pipeline fuzz checks passed (%llu cases, %zu novel)\n",
+           (unsigned long long)space.Count(),
+           (size_t)sequential.novelty.Count());
+    return TRUE;
+}
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    UINT32 latencyNs = 2000;
+    UINT32 commitUs = 100;
+
+    if (argc > 1)
+    {
+        latencyNs = (UINT32)atoi(argv[1]);
+    }
+    if (argc > 2)
+    {
+        commitUs = (UINT32)atoi(argv[2]);
+    }
+
+    if (!CheckQueue() || !CheckOrder() || !CheckFuzz())
+    {
+        return 1;
+    }
+
+    HcFilter                                    filter;
+    CaseSpace                                   space(filter, 6);
+    std::vector<std::unique_ptr<SIM_WORKER>>    simWorkers;
+    PIPELINE_STATS                              stats = {};
+    double                                      base = 0;
+
+    printf("[ ] %u processors, %u ns per call, %u us per commit of %u cases\n",
+           WorkerPoolProcessorCount(),
+           latencyNs,
+           commitUs,
+           BENCH_BATCH_CASES);
+
+    for (UINT32 depth : { 0u, 2u, 4u, 8u })
+    {
+        std::string name = depth == 0 ? "pipeline/sequential" : "pipeline/depth " + std::to_string(depth);
+        WorkerPool pool(1);
+        SIM_FUZZ fuzz;
+
+        fuzz.pSpace = &space;
+        fuzz.commitUs = commitUs;
+        MakeWorkers(1, depth < 2 ? 2 : depth, latencyNs, &simWorkers);
+
+        double rate = BenchRun([&](UINT64 iters) {
+            FuzzSpace(fuzz, pool, simWorkers, 0, iters, depth);
+        }, 0.3);
+
+        BenchReport(name.c_str(), rate, "cases/s");
+        if (depth == 0)
+        {
+            base = rate;
+            continue;
+        }
+        BenchReport((name + " speedup").c_str(), rate / base, "x");
+        simWorkers[0]->pipeline.GetStats(&stats);
+    }
+
+    printf("[ ] depth %u, bottleneck %s\n", stats.depth, PipelineStageName(PipelineBottleneck(stats)));
+    for (UINT32 s = 0; s < PIPELINE_STAGE_COUNT; s++)
+    {
+        std::string name = std::string("pipeline/") + PipelineStageName((PIPELINE_STAGE)s) + " busy";
+
+        BenchReport(name.c_str(), PipelineUtilisation(stats, (PIPELINE_STAGE)s), "%");
+    }
+    for (UINT32 q = 0; q < PIPELINE_QUEUE_COUNT; q++)
+    {
+        std::string name = std::string("pipeline/") + PipelineQueueName((PIPELINE_QUEUE)q) + " occupancy";
+
+        BenchReport(name.c_str(), PipelineAverageOccupancy(stats, (PIPELINE_QUEUE)q), "batches");
+    }
+
+    return 0;
+}
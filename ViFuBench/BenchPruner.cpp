@@ -0,0 +1,365 @@
+/*++
+
+Module Name:
+
+    BenchPruner.cpp
+
+Abstract:
+
+    Evaluates adaptive per call code pruning (CasePruner.h) on the simulated
+    hypervisor as a child partition with its state tracked: how many
+    distinct outcomes a run finds per million calls, with and without it.
+
+    An outcome is a call code, HV status and repComplete. The pruned run is
+    the probe pass, Decide, then the rest of the space; the plain run goes
+    through the whole space once.
+
+    Checks (exit non-zero on failure)
+        - stub call codes, and only they, are found unimplemented
+        - privileged call codes, and only they, are found privilege gated
+          when the caller is a child, and none are when it is the root
+        - NextCase runs exactly what IsPruned says it doesn't prune, and the
+          pruned run makes the calls the decisions leave
+        - a combo missing probe results is run whole, its probes included,
+          and its call code is judged on its fully probed combos only
+        - every outcome of an unimplemented call code the plain run finds,
+          the pruned run finds too, and of a privileged one all but its
+          control word, alignment and GPA rejections
+        - pruning finds more outcomes per million calls, and more at the
+          pruned run's budget than the plain run does with the same calls
+        - every decision formats to an audit line naming its verdict
+
+    Benchmarks
+        prune/plain             - outcomes per 1M calls without pruning
+        prune/pruned            - outcomes per 1M calls with it
+        prune/plain same budget - outcomes of the plain run after as many
+                                  calls as the pruned run made
+        prune/calls             - calls of the pruned run, % of plain
+        prune/recall            - plain run's outcomes the pruned run found
+        prune/<verdict>         - call codes with each verdict
+
+    Usage: BenchPruner
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <string>
+#include "ViFuBench.h"
+#include "../ViFuCore/CasePruner.h"
+#include "../ViFuCore/HcSimBackend.h"
+#include "../ViFuCore/NoveltyTracker.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define BENCH_BATCH_SIZE    64
+#define BENCH_SEED          7
+
+//
+// Calls made, up to budget, and outcomes found running what the pruner's
+// mode runs. Probe results go to the pruner
+//
+static UINT64
+RunPass (
+    IN     const CaseSpace  &space,
+    IN OUT CasePruner       &pruner,
+    IN OUT HcSimBackend     &sim,
+    IN OUT NoveltyTracker   &outcomes,
+    IN     UINT64           budget = ~0ULL
+)
+{
+    HcBatchEncoder  batch(BENCH_BATCH_SIZE);
+    HcBatchResults  results(BENCH_BATCH_SIZE);
+    FUZZ_CASE       cases[BENCH_BATCH_SIZE];
+    UINT64          calls = 0;
+    UINT64          index = pruner.NextCase(0, space.Count());
+
+    while (index < space.Count() && calls < budget)
+    {
+        batch.Reset();
+        for (; index < space.Count() && calls < budget && !batch.IsFull();
+             index = pruner.NextCase(index + 1, space.Count()), calls++)
+        {
+            space.Materialize(index, &cases[batch.Count()]);
+            batch.Add(cases[batch.Count()].regs);
+        }
+
+        sim.ExecBatch(batch, results);
+        for (UINT32 c = 0; c < results.Count(); c++)
+        {
+            CPU_REG_64 key = cases[c].regs;
+
+            if (pruner.Mode() == CASE_PRUNE_MODE_PROBE)
+            {
+                pruner.Observe(cases[c].callcode, cases[c].repCnt, cases[c].fast, results[c]);
+            }
+
+            //
+            // The call code alone stands for the input
+            //
+            key.rcx &= 0xffff;
+            outcomes.Observe(key, results[c], 0);
+        }
+    }
+    return calls;
+}
+
+//
+// Probe pass and Decide, as a child with state unless bRoot
+//
+static UINT64
+Probe (
+    IN     const CaseSpace  &space,
+    IN OUT CasePruner       &pruner,
+    IN OUT NoveltyTracker   &outcomes,
+    IN     BOOL             bRoot
+)
+{
+    HcSimBackend    sim;
+    UINT64          calls = 0;
+
+    if (!bRoot)
+    {
+        sim.SetCaller(HC_SIM_CALLER_CHILD);
+        sim.SetState(HC_SIM_STATE_ALL);
+    }
+    pruner.StartProbing();
+    calls = RunPass(space, pruner, sim, outcomes);
+    pruner.Decide();
+    return calls;
+}
+
+static BOOL
+CheckVerdicts (
+    IN const CaseSpace  &space,
+    IN const CasePruner &pruner,
+    IN BOOL             bRoot
+)
+{
+    UINT32  decided = 0;
+    CHAR    line[512];
+
+    for (SIZE_T d = 0; d < pruner.DecisionCount(); d++)
+    {
+        const CASE_PRUNE_DECISION   &decision = pruner.Decision(d);
+        const HC_DESC               *pDesc = HcLookup(decision.callcode);
+        BOOL                        isStub = (pDesc->flags & HC_DESC_STUB) != 0;
+        BOOL                        isPrivileged = !isStub && (pDesc->flags & HC_DESC_PRIVILEGED) != 0;
+
+        CHECK((decision.verdict == CASE_PRUNE_UNIMPLEMENTED) == isStub);
+        CHECK((decision.verdict == CASE_PRUNE_PRIVILEGED) == (isPrivileged && !bRoot));
+        CHECK(decision.probes == CASE_PRUNE_COMBOS * CASE_PRUNE_PROBES);
+        CHECK(decision.verdict == CASE_PRUNE_SENSITIVE ? decision.combosKept != 0 : decision.combosKept == 0);
+
+        CasePruneFormat(decision, line, sizeof(line));
+        CHECK(strstr(line, CasePruneVerdictName(decision.verdict)) != NULL);
+        CHECK(strstr(line, pDesc->name) != NULL);
+        decided++;
+    }
+    CHECK(decided == space.CallcodeCount());
+    return TRUE;
+}
+
+static BOOL
+CheckNextCase (
+    IN const CaseSpace  &space,
+    IN const CasePruner &pruner
+)
+{
+    UINT64 kept = 0;
+    UINT64 visited = 0;
+    UINT64 pruned = 0;
+
+    for (UINT64 i = 0; i < space.Count(); i++)
+    {
+        CHECK((pruner.NextCase(i, i + 1) == i) == !pruner.IsPruned(i));
+        kept += !pruner.IsPruned(i);
+    }
+    for (UINT64 i = pruner.NextCase(0, space.Count()); i < space.Count(); i = pruner.NextCase(i + 1, space.Count()))
+    {
+        visited++;
+    }
+    CHECK(visited == kept);
+
+    for (SIZE_T d = 0; d < pruner.DecisionCount(); d++)
+    {
+        pruned += pruner.Decision(d).casesPruned;
+    }
+    CHECK(kept + pruned + (UINT64)space.CallcodeCount() * CASE_PRUNE_COMBOS * CASE_PRUNE_PROBES == space.Count());
+    return TRUE;
+}
+
+//
+// The first call code unimplemented on every combo but the first, which
+// only one probe came back for, as when the guest went down in it
+//
+static BOOL
+CheckPartialProbes (
+    IN const CaseSpace  &space
+)
+{
+    CasePruner              pruner(space);
+    CasePruner              none(space);
+    HYPERCALL_BATCH_RESULT  result = { 0 };
+    FUZZ_CASE               fuzzCase;
+    UINT64                  index = 0;
+
+    result.hvStatus = HV_STATUS_INVALID_HYPERCALL_CODE;
+    space.Materialize(0, &fuzzCase);
+    pruner.StartProbing();
+    none.StartProbing();
+    for (UINT32 c = 0; c < CASE_PRUNE_COMBOS; c++)
+    {
+        for (UINT32 p = 0; p < (c == 0 ? 1 : pruner.ProbesPerCombo()); p++)
+        {
+            pruner.Observe(fuzzCase.callcode, c / CASE_SPACE_FAST, c % CASE_SPACE_FAST, result);
+        }
+        none.Observe(fuzzCase.callcode, c / CASE_SPACE_FAST, c % CASE_SPACE_FAST, result);
+    }
+
+    CHECK(pruner.Decide() == (CASE_PRUNE_COMBOS - 1) * (UINT64)(space.CasesPerCombo() - pruner.ProbesPerCombo()));
+    CHECK(pruner.DecisionCount() == 1);
+    CHECK(pruner.Decision(0).verdict == CASE_PRUNE_UNIMPLEMENTED);
+    CHECK(pruner.Decision(0).combosProbed == 0x3e && pruner.Decision(0).combosKept == 0x01);
+    CHECK(pruner.Decision(0).probes == (CASE_PRUNE_COMBOS - 1) * pruner.ProbesPerCombo());
+
+    //
+    // The first combo runs whole, the second is pruned
+    //
+    for (index = 0; index < space.CasesPerCombo(); index++)
+    {
+        CHECK(pruner.NextCase(index, space.CasesPerCombo()) == index);
+    }
+    CHECK(pruner.NextCase(space.CasesPerCombo(), 2 * space.CasesPerCombo()) == 2 * space.CasesPerCombo());
+
+    //
+    // No combo fully probed, no decision and nothing pruned
+    //
+    CHECK(none.Decide() == 0 && none.DecisionCount() == 0);
+    CHECK(none.NextCase(0, space.Count()) == 0 && none.NextCase(1, space.Count()) == 1);
+    return TRUE;
+}
+
+//
+// Outcomes of call codes a verdict prunes whole. The pruned run may miss
+// only the control word, alignment and GPA rejections of a privileged one,
+// which say nothing about its handler
+//
+static BOOL
+CheckNothingLost (
+    IN const CasePruner         &pruner,
+    IN const NoveltyTracker     &plain,
+    IN const NoveltyTracker     &pruned
+)
+{
+    for (SIZE_T e = 0; e < plain.Count(); e++)
+    {
+        const NOVELTY_ENTRY &entry = plain.Entry(e);
+
+        for (SIZE_T d = 0; d < pruner.DecisionCount(); d++)
+        {
+            const CASE_PRUNE_DECISION &decision = pruner.Decision(d);
+
+            if (decision.callcode != (entry.callcode & 0xffff) || pruned.Lookup(entry.signature) != NULL)
+            {
+                continue;
+            }
+            CHECK(decision.verdict != CASE_PRUNE_UNIMPLEMENTED);
+            CHECK(decision.verdict != CASE_PRUNE_PRIVILEGED ||
+                  entry.hvStatus == HV_STATUS_INVALID_HYPERCALL_INPUT ||
+                  entry.hvStatus == HV_STATUS_INVALID_ALIGNMENT ||
+                  entry.hvStatus == HV_STATUS_INVALID_PARAMETER);
+        }
+    }
+    return TRUE;
+}
+
+int
+main ()
+{
+    HcFilter        filter;
+    CaseSpace       space(filter, BENCH_SEED);
+    CasePruner      pruner(space);
+    CasePruner      rootPruner(space);
+    CasePruner      off(space);
+    HcSimBackend    sim;
+    NoveltyTracker  plain;
+    NoveltyTracker  pruned;
+    NoveltyTracker  sameBudget;
+    NoveltyTracker  rootOutcomes;
+    UINT64          plainCalls = 0;
+    UINT64          prunedCalls = 0;
+    UINT64          casesPruned = 0;
+    UINT64          found = 0;
+    UINT32          verdicts[CASE_PRUNE_SENSITIVE + 1] = { 0 };
+    BOOL            bOk = TRUE;
+
+    sim.SetCaller(HC_SIM_CALLER_CHILD);
+    sim.SetState(HC_SIM_STATE_ALL);
+    plainCalls = RunPass(space, off, sim, plain);
+
+    prunedCalls = Probe(space, pruner, pruned, FALSE);
+    sim.SetState(HC_SIM_STATE_ALL);
+    prunedCalls += RunPass(space, pruner, sim, pruned);
+
+    sim.SetState(HC_SIM_STATE_ALL);
+    RunPass(space, off, sim, sameBudget, prunedCalls);
+
+    Probe(space, rootPruner, rootOutcomes, TRUE);
+
+    for (SIZE_T d = 0; d < pruner.DecisionCount(); d++)
+    {
+        casesPruned += pruner.Decision(d).casesPruned;
+        verdicts[pruner.Decision(d).verdict]++;
+    }
+    for (SIZE_T e = 0; e < plain.Count(); e++)
+    {
+        found += pruned.Lookup(plain.Entry(e).signature) != NULL;
+    }
+
+    bOk = CheckVerdicts(space, pruner, FALSE) &&
+          CheckVerdicts(space, rootPruner, TRUE) &&
+          CheckNextCase(space, pruner) &&
+          CheckPartialProbes(space) &&
+          CheckNothingLost(pruner, plain, pruned);
+    if (bOk && prunedCalls + casesPruned != plainCalls)
+    {
+        printf("[-] pruned run made %llu calls, %llu pruned of %llu\n",
+               (unsigned long long)prunedCalls,
+               (unsigned long long)casesPruned,
+               (unsigned long long)plainCalls);
+        bOk = FALSE;
+    }
+    if (bOk && (pruned.Count() * plainCalls <= plain.Count() * prunedCalls ||
+                pruned.Count() <= sameBudget.Count()))
+    {
+        printf("[-] pruning found no more outcomes per call\n");
+        bOk = FALSE;
+    }
+    if (!bOk)
+    {
+        return 1;
+    }
+    printf("[+] pruner checks passed\n");
+
+    BenchReport("prune/plain", 1e6 * plain.Count() / plainCalls, "outcomes/1M calls");
+    BenchReport("prune/pruned", 1e6 * pruned.Count() / prunedCalls, "outcomes/1M calls");
+    BenchReport("prune/plain same budget", (double)sameBudget.Count(), "outcomes");
+    BenchReport("prune/pruned outcomes", (double)pruned.Count(), "outcomes");
+    BenchReport("prune/calls", 100.0 * prunedCalls / plainCalls, "% of plain");
+    BenchReport("prune/recall", 100.0 * found / plain.Count(), "% of plain outcomes");
+    for (UINT32 v = CASE_PRUNE_UNIMPLEMENTED; v <= CASE_PRUNE_SENSITIVE; v++)
+    {
+        std::string name = std::string("prune/") + CasePruneVerdictName(v);
+
+        BenchReport(name.c_str(), verdicts[v], "call codes");
+    }
+    return 0;
+}
@@ -0,0 +1,421 @@
+/*++
+
+Module Name:
+
+    BenchRepSweep.cpp
+
+Abstract:
+
+    Runs the rep count sweep (s_repSweepGenerators) on the simulated backend
+    with the hypervisor returning rep calls partially complete every so many
+    reps, and measures what continuing them in the backend saves over
+    sending the rest of each call back through user mode.
+
+    Checks (exit non-zero on failure)
+        - RepContinuationNext moves the start index to repComplete on a
+          partial success only, never on errors, complete or stalled calls
+        - rep sequence layouts count up from the value, the page fill count
+          fills the input page exactly
+        - the backend finishes a sliced rep call from its start index with
+          the expected continuations, a bad rep element stops it at that rep
+        - the sweep covers 1 - 4095 reps on rep calls only, with start
+          indexes 0, 1 and the last rep
+        - RepStats counts and ranks the sweep's cases
+
+    Benchmarks
+        repsweep/slice N        - sweep cases/s with N reps per issue (0 for
+                                  all), continuations per case and the IOCTL
+                                  round trips continuing in user mode would
+                                  have taken instead of one per batch
+        repsweep/top            - call codes RepStats ranks most expensive,
+                                  with a per rep cost in the simulator
+
+    Usage: BenchRepSweep
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include "ViFuBench.h"
+#include "../ViFuCore/HcSimBackend.h"
+#include "../ViFuCore/CaseSpace.h"
+#include "../ViFuCore/RepStats.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define BENCH_BATCH_SIZE    64
+
+//
+// Rep calls only, as ViFuR3 filters them with VIFU_REP_SWEEP
+//
+static VOID
+RepCallFilter (
+    OUT HcFilter    *pFilter
+)
+{
+    for (UINT32 callcode = 0; callcode < HC_DESC_COUNT; callcode++)
+    {
+        if (!InputGenIsRepCall(HcDescriptors[callcode]))
+        {
+            pFilter->Allow(callcode, callcode, FALSE);
+        }
+    }
+}
+
+//
+// A rep call the simulator accepts, whose rep elements must be below 0x100
+// so a counting sequence fails at rep 256
+//
+static const HC_DESC *
+FindSmallRepCall ()
+{
+    for (UINT32 callcode = 0; callcode < HC_DESC_COUNT; callcode++)
+    {
+        const HC_DESC &desc = HcDescriptors[callcode];
+
+        if (InputGenIsRepCall(desc) && !(desc.flags & HC_DESC_STUB) &&
+            desc.inputSize <= 64 && desc.outputSize <= 64 &&
+            HcSimBackend::FieldKind(callcode, 0x100) == HC_SIM_FIELD_SMALL)
+        {
+            return &desc;
+        }
+    }
+    return NULL;
+}
+
+static VOID
+RepCase (
+    IN  const HC_DESC   &desc,
+    IN  UINT32          repCnt,
+    IN  UINT32          repStart,
+    OUT PCPU_REG_64     pRegs
+)
+{
+    INPUT_LAYOUT layout;
+
+    memset(pRegs, 0, sizeof(CPU_REG_64));
+    InputGenLayout(desc, &layout);
+    layout.flags = INPUT_LAYOUT_FLAG_PARTITION_SELF | INPUT_LAYOUT_FLAG_REP_SEQUENCE;
+
+    pRegs->rcx = desc.callcode |
+                 ((UINT64)repCnt << HV_CONTROL_REP_COUNT_SHIFT) |
+                 ((UINT64)repStart << HV_CONTROL_REP_START_SHIFT);
+    pRegs->rdx = USE_GPA_MEM_LAYOUT;
+    pRegs->r8 = desc.outputSize != 0 ? USE_GPA_MEM_LAYOUT : 0;
+    pRegs->rbx = INPUT_LAYOUT_PACK(&layout);
+}
+
+static BOOL
+ExecOne (
+    IN  HcSimBackend            &sim,
+    IN  const CPU_REG_64        &regs,
+    OUT PHYPERCALL_BATCH_RESULT pResult
+)
+{
+    HcBatchEncoder batch(1);
+    HcBatchResults results(1);
+
+    batch.Add(regs);
+    if (sim.ExecBatch(batch, results) != 0 || results.Count() != 1)
+    {
+        return FALSE;
+    }
+    *pResult = results[0];
+    return TRUE;
+}
+
+static BOOL
+CheckContinuation ()
+{
+    UINT64 control = 0x13 | (100ULL << HV_CONTROL_REP_COUNT_SHIFT);
+
+    CHECK(RepContinuationNext(&control, HV_STATUS_SUCCESS | (16ULL << 32)));
+    CHECK(HV_CONTROL_REP_START(control) == 16 && HV_CONTROL_REP_COUNT(control) == 100);
+    CHECK((control & 0xffff) == 0x13);
+
+    CHECK(RepContinuationNext(&control, HV_STATUS_SUCCESS | (99ULL << 32)));
+    CHECK(HV_CONTROL_REP_START(control) == 99);
+
+    CHECK(!RepContinuationNext(&control, HV_STATUS_SUCCESS | (100ULL << 32)));
+    CHECK(!RepContinuationNext(&control, HV_STATUS_SUCCESS | (99ULL << 32)));
+    CHECK(!RepContinuationNext(&control, HV_STATUS_INVALID_PARAMETER | (99ULL << 32)));
+    CHECK(HV_CONTROL_REP_START(control) == 99);
+
+    control = 0x13;
+    CHECK(!RepContinuationNext(&control, HV_STATUS_SUCCESS));
+    return TRUE;
+}
+
+static BOOL
+CheckSequence ()
+{
+    static UINT64   s_page[INPUT_LAYOUT_PAGE_SIZE / 8];
+    INPUT_LAYOUT    layout = { 24, 0, 1, INPUT_LAYOUT_FLAG_PARTITION_SELF | INPUT_LAYOUT_FLAG_REP_SEQUENCE, 1 };
+    HC_DESC         desc = { 0 };
+
+    memset(s_page, 0, sizeof(s_page));
+    InputLayoutBuild(s_page, &layout, 8, 0x40);
+    CHECK(s_page[0] == HV_PARTITION_ID_SELF && s_page[1] == 0x40 && s_page[2] == 0);
+    for (UINT32 r = 0; r < 8; r++)
+    {
+        CHECK(s_page[3 + r] == 0x40 + r);
+    }
+    CHECK(s_page[11] == 0);
+
+    //
+    // Two qword elements, only the first of each is counted
+    //
+    layout.repElementQwords = 2;
+    layout.field = INPUT_LAYOUT_NO_FIELD;
+    memset(s_page, 0, sizeof(s_page));
+    InputLayoutBuild(s_page, &layout, 3, 5);
+    CHECK(s_page[3] == 5 && s_page[4] == 0 && s_page[5] == 6 && s_page[7] == 7 && s_page[9] == 0);
+
+    desc.isRep = 1;
+    desc.inputSize = 20;
+    layout.headerSize = 20;
+    layout.repElementQwords = INPUT_GEN_REP_ELEMENT_QWORDS;
+    UINT32 pageFill = InputGenRepSweepCount(desc, _ARRAYSIZE(s_inputGenRepCounts));
+    CHECK(InputLayoutInputBytes(&layout, pageFill) == INPUT_LAYOUT_PAGE_SIZE);
+    CHECK(InputGenRepSweepCount(desc, _ARRAYSIZE(s_inputGenRepCounts) + 1) == pageFill + 1);
+    CHECK(24 + pageFill * 8 == INPUT_LAYOUT_PAGE_SIZE);
+    return TRUE;
+}
+
+static BOOL
+CheckSim ()
+{
+    HcSimBackend            sim;
+    HYPERCALL_BATCH_RESULT  result;
+    CPU_REG_64              regs;
+    const HC_DESC           *pDesc = FindSmallRepCall();
+
+    CHECK(pDesc != NULL);
+
+    RepCase(*pDesc, 100, 0, &regs);
+    CHECK(ExecOne(sim, regs, &result));
+    CHECK(result.hvStatus == HV_STATUS_SUCCESS && result.repComplete == 100 && result.continuations == 0);
+
+    //
+    // 16 reps per issue: 0-15 then 6 continuations, 7 from a start of 10
+    //
+    sim.SetRepSlice(16);
+    CHECK(ExecOne(sim, regs, &result));
+    CHECK(result.hvStatus == HV_STATUS_SUCCESS && result.repComplete == 100 && result.continuations == 6);
+    CHECK(HV_RESULT_REP_COMPLETE(result.regsOut.rax) == 100);
+
+    RepCase(*pDesc, 100, 10, &regs);
+    CHECK(ExecOne(sim, regs, &result));
+    CHECK(result.hvStatus == HV_STATUS_SUCCESS && result.repComplete == 100 && result.continuations == 5);
+
+    RepCase(*pDesc, 100, 100, &regs);
+    CHECK(ExecOne(sim, regs, &result));
+    CHECK(result.hvStatus == HV_STATUS_INVALID_HYPERCALL_INPUT && result.continuations == 0);
+
+    //
+    // Elements count up from 0, rep 256 is the first out of range
+    //
+    RepCase(*pDesc, 300, 0, &regs);
+    CHECK(ExecOne(sim, regs, &result));
+    CHECK(result.hvStatus == HV_STATUS_INVALID_PARAMETER && result.repComplete == 256);
+    CHECK(result.continuations == 16);
+
+    sim.SetRepSlice(0);
+    CHECK(ExecOne(sim, regs, &result));
+    CHECK(result.hvStatus == HV_STATUS_INVALID_PARAMETER && result.repComplete == 256);
+    CHECK(result.continuations == 0);
+    return TRUE;
+}
+
+static BOOL
+CheckSweep ()
+{
+    HcFilter    filter;
+    FUZZ_CASE   fuzzCase;
+    BOOL        bMax = FALSE;
+    BOOL        bPageFill = FALSE;
+
+    RepCallFilter(&filter);
+
+    CaseSpace space(filter, 1, s_repSweepGenerators, _ARRAYSIZE(s_repSweepGenerators));
+
+    CHECK(space.Count() != 0);
+    CHECK(space.CasesPerCombo() == INPUT_GEN_REP_SWEEP_CASES);
+    for (UINT64 i = 0; i < space.Count(); i++)
+    {
+        const HC_DESC   *pDesc = NULL;
+        UINT32          repCnt = 0;
+        UINT32          repStart = 0;
+        INPUT_LAYOUT    layout;
+
+        CHECK(space.Materialize(i, &fuzzCase));
+        pDesc = &HcDescriptors[fuzzCase.callcode];
+        repCnt = HV_CONTROL_REP_COUNT(fuzzCase.regs.rcx);
+        repStart = HV_CONTROL_REP_START(fuzzCase.regs.rcx);
+
+        CHECK(InputGenIsRepCall(*pDesc));
+        CHECK(repCnt >= 1 && repCnt <= 0xfff);
+        CHECK(repStart == (fuzzCase.repCnt == 0 ? 0 : (fuzzCase.repCnt == 1 ? 1 : repCnt - 1)));
+        bMax |= repCnt == 0xfff;
+
+        if (fuzzCase.fast)
+        {
+            continue;
+        }
+
+        InputLayoutUnpack(fuzzCase.regs.rbx, &layout);
+        CHECK(fuzzCase.regs.rdx == USE_GPA_MEM_LAYOUT);
+        CHECK(layout.flags & INPUT_LAYOUT_FLAG_REP_SEQUENCE);
+        bPageFill |= InputLayoutInputBytes(&layout, repCnt) == INPUT_LAYOUT_PAGE_SIZE &&
+                     InputLayoutInputBytes(&layout, repCnt - 1) < INPUT_LAYOUT_PAGE_SIZE;
+    }
+    CHECK(bMax && bPageFill);
+    return TRUE;
+}
+
+typedef struct _SWEEP_COUNTS
+{
+    UINT64  cases;
+    UINT64  continuations;
+    UINT64  roundTrips;             // IOCTLs continuing in user mode would take
+    UINT64  batches;
+} SWEEP_COUNTS;
+
+//
+// Run iters cases of the sweep, wrapping around it
+//
+static VOID
+RunSweep (
+    IN     const CaseSpace  &space,
+    IN     HcSimBackend     &sim,
+    IN     UINT64           iters,
+    IN OUT SWEEP_COUNTS     *pCounts,
+    IN     RepStats         *pStats
+)
+{
+    HcBatchEncoder  batch(BENCH_BATCH_SIZE);
+    HcBatchResults  results(BENCH_BATCH_SIZE);
+    FUZZ_CASE       fuzzCase;
+    UINT64          index = 0;
+
+    while (iters != 0)
+    {
+        UINT32 maxContinuations = 0;
+
+        batch.Reset();
+        for (; iters != 0 && !batch.IsFull(); iters--)
+        {
+            space.Materialize(index, &fuzzCase);
+            batch.Add(fuzzCase.regs);
+            index = index + 1 == space.Count() ? 0 : index + 1;
+        }
+
+        sim.ExecBatch(batch, results);
+        for (UINT32 c = 0; c < results.Count(); c++)
+        {
+            pCounts->continuations += results[c].continuations;
+            if (results[c].continuations > maxContinuations)
+            {
+                maxContinuations = results[c].continuations;
+            }
+            if (pStats != NULL)
+            {
+                pStats->Record(batch.Case(c), results[c]);
+            }
+        }
+        pCounts->cases += results.Count();
+        pCounts->roundTrips += 1 + maxContinuations;
+        pCounts->batches++;
+    }
+}
+
+int
+main ()
+{
+    static const UINT32 s_slices[] = { 0, 256, 64, 16 };
+    HcFilter            filter;
+
+    if (!CheckContinuation() || !CheckSequence() || !CheckSim() || !CheckSweep())
+    {
+        return 1;
+    }
+
+    RepCallFilter(&filter);
+
+    CaseSpace space(filter, 1, s_repSweepGenerators, _ARRAYSIZE(s_repSweepGenerators));
+
+    for (UINT32 s = 0; s < _ARRAYSIZE(s_slices); s++)
+    {
+        HcSimBackend    sim;
+        SWEEP_COUNTS    counts = {};
+        CHAR            name[64];
+
+        sim.SetRepSlice(s_slices[s]);
+        RunSweep(space, sim, space.Count(), &counts, NULL);
+
+        double rate = BenchRun([&](UINT64 iters) {
+            SWEEP_COUNTS timed = {};
+            RunSweep(space, sim, iters, &timed, NULL);
+            BenchDoNotOptimize(timed);
+        });
+
+        snprintf(name, sizeof(name), "repsweep/slice %u", s_slices[s]);
+        printf("%-48s %16.2f cases/s, %.2f continuations/case, %.2f round trips/batch in UM\n",
+               name,
+               rate,
+               (double)counts.continuations / counts.cases,
+               (double)counts.roundTrips / counts.batches);
+        BenchRecord(name, rate, "cases/s");
+    }
+
+    //
+    // Every rep costs the same here, so the ranking follows the reps a call
+    // gets through before an element fails it
+    //
+    {
+        HcSimBackend    sim;
+        SWEEP_COUNTS    counts = {};
+        RepStats        stats;
+
+        sim.SetLatency(0, 20);
+        sim.SetRepSlice(64);
+        RunSweep(space, sim, space.Count(), &counts, &stats);
+
+        std::vector<REP_CALL_STATS> ranked = stats.Ranked();
+        if (ranked.empty() || ranked[0].cases == 0 ||
+            RepStatsCyclesPerCase(ranked[0]) < RepStatsCyclesPerCase(ranked.back()))
+        {
+            printf("[-] RepStats ranking is empty or out of order\n");
+            return 1;
+        }
+
+        UINT64 cases = 0;
+        for (SIZE_T r = 0; r < ranked.size(); r++)
+        {
+            cases += ranked[r].cases;
+        }
+        if (cases != counts.cases)
+        {
+            printf("[-] RepStats counted %llu of %llu cases\n", (unsigned long long)cases, (unsigned long long)counts.cases);
+            return 1;
+        }
+
+        for (SIZE_T r = 0; r < ranked.size() && r < 3; r++)
+        {
+            printf("repsweep/top %-35s %16.0f ns/case, %.1f reps, %llu continued\n",
+                   HcDescriptors[ranked[r].callcode].name,
+                   RepStatsCyclesPerCase(ranked[r]),
+                   (double)ranked[r].reps / ranked[r].cases,
+                   (unsigned long long)ranked[r].continued);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,597 @@
+/*++
+
+Module Name:
+
+    BenchReplay.cpp
+
+Abstract:
+
+    Checks the journal replay engine against a stateful simulation of the
+    hypervisor, and measures the replay rate and what bisection costs.
+
+    The simulation is HcSimBackend plus some state: ARM_CALLCODE calls arm
+    it, a FREE_CALLCODE call disarms it, STATE_CALLCODE crashes it once it
+    has been armed SIM_THRESHOLD times and CRASH_CALLCODE always does.
+    Reset is the reboot, it forgets everything.
+
+    Checks (exit non-zero on failure)
+        - every case streams out with the registers it was journaled with,
+          truncated records rebuilt through the CaseSpace, for any batch
+          size, and is refused without one
+        - the last k cases replay to the crash
+        - a crash that reproduces alone needs only its own case
+        - a crash that needs state needs exactly the cases from the first
+          arming call that counts, both sides of the answer replay as they
+          should
+        - the search does not cross a session (reboot)
+
+    Benchmarks
+        replay/batch <n>            - cases replayed per second, n per batch
+        replay/bisect probes        - replays to find a window of <window>
+                                      cases in a <cases> case session
+        replay/bisect cases         - cases those replays ran, against the
+                                      session size
+
+    Usage: BenchReplay [scratch directory, default .] [cases, default 100000]
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include "ViFuBench.h"
+#include "../ViFuCore/JournalReplay.h"
+#include "../ViFuCore/HcSimBackend.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define ARM_CALLCODE        0x0081
+#define FREE_CALLCODE       0x0082
+#define STATE_CALLCODE      0x0083
+#define CRASH_CALLCODE      0x0084
+#define SIM_THRESHOLD       3
+#define SIM_SEED            0xBE4C
+
+//
+// The bugcheck, as a status the model never gives
+//
+#define SIM_CRASH_STATUS    0xDEAD
+
+static std::string g_dir = ".";
+
+typedef struct _STATEFUL_SIM
+{
+    HcSimBackend    sim;
+    UINT32          armed;
+    BOOL            bDown;
+    UINT64          resets;
+
+    _STATEFUL_SIM ()
+        : armed(0),
+          bDown(FALSE),
+          resets(0)
+    {
+    }
+} STATEFUL_SIM;
+
+static UINT64
+StatefulHandler (
+    IN  const CPU_REG_64    *pInRegs,
+    OUT PCPU_REG_64         pOutRegs,
+    IN  VOID                *pContext
+)
+{
+    STATEFUL_SIM    *pSim = (STATEFUL_SIM *)pContext;
+    UINT16          repComplete = 0;
+    HV_STATUS       status = pSim->sim.Exec(pInRegs, pOutRegs, &repComplete);
+
+    if (pSim->bDown)
+    {
+        return SIM_CRASH_STATUS;
+    }
+
+    switch (pInRegs->rcx & 0xffff)
+    {
+    case ARM_CALLCODE:
+        pSim->armed++;
+        break;
+    case FREE_CALLCODE:
+        pSim->armed = 0;
+        break;
+    case STATE_CALLCODE:
+        pSim->bDown = pSim->armed >= SIM_THRESHOLD;
+        break;
+    case CRASH_CALLCODE:
+        pSim->bDown = TRUE;
+        break;
+    }
+    return pSim->bDown ? SIM_CRASH_STATUS : (UINT64)status | ((UINT64)repComplete << 32);
+}
+
+static REPLAY_OUTCOME
+SimCrashed (
+    IN const CPU_REG_64                 *pCase,
+    IN const HYPERCALL_BATCH_RESULT     *pResult,
+    IN VOID                             *pContext
+)
+{
+    (VOID)pCase;
+    (VOID)pContext;
+    return pResult->hvStatus == SIM_CRASH_STATUS ? REPLAY_OUTCOME_CRASH : REPLAY_OUTCOME_PASS;
+}
+
+static BOOL
+SimReset (
+    IN VOID     *pContext
+)
+{
+    STATEFUL_SIM *pSim = (STATEFUL_SIM *)pContext;
+
+    pSim->armed = 0;
+    pSim->bDown = FALSE;
+    pSim->resets++;
+    return TRUE;
+}
+
+//
+// Background cases. Odd ones fill every register, more than a record
+// keeps, so they are journaled truncated
+//
+static UINT64
+NoiseGenerate (
+    IN     const CASE_GEN_CONTEXT   *pContext,
+    IN     UINT32                   k,
+    IN OUT PCPU_REG_64              pRegs
+)
+{
+    PUINT64 pQwords = (PUINT64)pRegs;
+    UINT32  qwords = (k & 1) ? FUZZ_JOURNAL_REG_QWORDS : 4;
+
+    (VOID)pContext;
+    for (UINT32 q = 0; q < qwords; q++)
+    {
+        if (q != offsetof(CPU_REG_64, rcx) / sizeof(UINT64))
+        {
+            pQwords[q] = PageFillSplitMix(k * 64 + q) | 1;
+        }
+    }
+    return k;
+}
+
+static const CASE_GENERATOR s_noiseGenerators[] =
+{
+    { "noise", 64, 0, NoiseGenerate },
+};
+
+//
+// Call codes 0x02 - 0x3f, none of the simulation's
+//
+static HcFilter
+NoiseFilter ()
+{
+    HcFilter filter;
+
+    filter.Allow(0, HC_CALLCODE_SPACE - 1, FALSE);
+    filter.Allow(0x02, 0x3f, TRUE);
+    return filter;
+}
+
+static FUZZ_JOURNAL_FD
+OpenJournalFd (
+    IN const std::string    &path
+)
+{
+#if defined(_WIN32)
+    return CreateFileA(path.c_str(),
+                       GENERIC_READ | GENERIC_WRITE,
+                       FILE_SHARE_READ,
+                       NULL,
+                       CREATE_ALWAYS,
+                       0,
+                       NULL);
+#else
+    return open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+}
+
+static VOID
+CloseJournalFd (
+    IN FUZZ_JOURNAL_FD  fd
+)
+{
+#if defined(_WIN32)
+    CloseHandle(fd);
+#else
+    close(fd);
+#endif
+}
+
+//
+// A journal being made, and the registers of every case put in it. The
+// records are written by Write()
+//
+class JournalBuilder
+{
+public:
+    JournalBuilder (
+        IN const CHAR   *name
+    )
+        : m_path(g_dir + "/" + name),
+          m_filter(NoiseFilter()),
+          m_space(m_filter, SIM_SEED, s_noiseGenerators, _ARRAYSIZE(s_noiseGenerators)),
+          m_next(0)
+    {
+    }
+
+    ~JournalBuilder ()
+    {
+        remove(m_path.c_str());
+    }
+
+    const std::string &Path () const { return m_path; }
+    const CaseSpace &Space () const { return m_space; }
+    const std::vector<CPU_REG_64> &Cases () const { return m_cases; }
+    UINT64 Count () const { return m_cases.size(); }
+
+    VOID
+    Session ()
+    {
+        FUZZ_JOURNAL_RECORD record;
+
+        FuzzJournalInitSession(&record, 0);
+        m_records.push_back(record);
+    }
+
+    VOID
+    Noise (
+        IN UINT64   count
+    )
+    {
+        FUZZ_CASE fuzzCase;
+
+        for (UINT64 n = 0; n < count; n++)
+        {
+            FUZZ_JOURNAL_RECORD record;
+
+            m_space.Materialize(m_next++ % m_space.Count(), &fuzzCase);
+            FuzzJournalInitCase(&record,
+                                fuzzCase.callcode,
+                                fuzzCase.repCnt,
+                                fuzzCase.fast,
+                                fuzzCase.caseIdx,
+                                fuzzCase.rngState,
+                                &fuzzCase.regs);
+            m_records.push_back(record);
+            m_cases.push_back(fuzzCase.regs);
+        }
+    }
+
+    //
+    // A call to one of the simulation's call codes, returns its position
+    //
+    UINT64
+    Call (
+        IN UINT16   callcode
+    )
+    {
+        FUZZ_JOURNAL_RECORD record;
+        CPU_REG_64          regs;
+
+        memset(&regs, 0, sizeof(regs));
+        regs.rcx = callcode;
+        regs.rdx = m_cases.size();
+        FuzzJournalInitCase(&record, callcode, 0, 0, 0, 0, &regs);
+        m_records.push_back(record);
+        m_cases.push_back(regs);
+        return m_cases.size() - 1;
+    }
+
+    BOOL
+    Write ()
+    {
+        FUZZ_JOURNAL_FD fd = OpenJournalFd(m_path);
+        FuzzJournalFile journal;
+        BOOL            bWritten = FALSE;
+
+        if (fd == FUZZ_JOURNAL_INVALID_FD)
+        {
+            return FALSE;
+        }
+        bWritten = journal.Attach(fd, SIM_SEED) &&
+                   journal.Append(m_records.data(), (UINT32)m_records.size());
+        CloseJournalFd(fd);
+        return bWritten;
+    }
+
+private:
+    std::string                         m_path;
+    HcFilter                            m_filter;
+    CaseSpace                           m_space;
+    UINT64                              m_next;
+    std::vector<FUZZ_JOURNAL_RECORD>    m_records;
+    std::vector<CPU_REG_64>             m_cases;
+};
+
+//
+// Keeps every case it is given, never crashes
+//
+class RecordingTarget : public ReplayTarget
+{
+public:
+    virtual BOOL Reset () { return TRUE; }
+
+    virtual BOOL
+    Run (
+        IN  const CPU_REG_64    *pCases,
+        IN  UINT32              count,
+        OUT PREPLAY_BATCH_RESULT pResult
+    )
+    {
+        m_cases.insert(m_cases.end(), pCases, pCases + count);
+        pResult->outcome = REPLAY_OUTCOME_PASS;
+        pResult->ran = count;
+        return TRUE;
+    }
+
+    std::vector<CPU_REG_64> m_cases;
+};
+
+static BOOL
+CheckStream ()
+{
+    static const UINT32 batches[] = { 1, 7, 64, 0 };
+    JournalBuilder      builder("replay_stream.vfj");
+    FuzzJournalReader   reader;
+    REPLAY_RUN          run;
+    REPLAY_STATS        stats;
+
+    builder.Session();
+    builder.Noise(1000);
+    CHECK(builder.Write() && reader.Open(builder.Path().c_str()));
+
+    for (UINT32 b = 0; b < _ARRAYSIZE(batches); b++)
+    {
+        REPLAY_CONFIG   config = { batches[b], 0 };
+        JournalReplay   replay(reader, &builder.Space(), &config);
+        RecordingTarget target;
+
+        CHECK(replay.Count() == 1000 && replay.Sequence(0) == 1);
+        CHECK(replay.Replay(target, 0, replay.Count(), &run) == REPLAY_STATUS_OK);
+        CHECK(run.ran == 1000 && run.crash == REPLAY_NO_CRASH);
+        CHECK(target.m_cases.size() == builder.Count());
+        CHECK(memcmp(target.m_cases.data(), builder.Cases().data(), builder.Count() * sizeof(CPU_REG_64)) == 0);
+
+        replay.GetStats(&stats);
+        CHECK(stats.rebuilt == 500);
+    }
+
+    //
+    // Without the space the first truncated record stops it
+    //
+    {
+        JournalReplay   replay(reader);
+        RecordingTarget target;
+
+        CHECK(replay.Replay(target, 0, replay.Count(), &run) == REPLAY_STATUS_BAD_RECORD);
+        CHECK(replay.Replay(target, 0, 1, &run) == REPLAY_STATUS_OK && run.ran == 1);
+        CHECK(replay.Replay(target, 2, 1, &run) == REPLAY_STATUS_BAD_RANGE);
+    }
+    return TRUE;
+}
+
+static BOOL
+CheckWindow ()
+{
+    JournalBuilder      builder("replay_window.vfj");
+    FuzzJournalReader   reader;
+    STATEFUL_SIM        sim;
+    HcLoopbackBackend   backend(StatefulHandler, &sim);
+    ReplayBackendTarget target(backend, SimCrashed, SimReset, &sim);
+    REPLAY_RUN          run;
+    REPLAY_BISECT       bisect;
+    UINT64              crash = 0;
+
+    builder.Session();
+    builder.Noise(300);
+    crash = builder.Call(CRASH_CALLCODE);
+    CHECK(builder.Write() && reader.Open(builder.Path().c_str()));
+
+    JournalReplay replay(reader, &builder.Space());
+
+    CHECK(replay.ReplayLast(target, 50, &run) == REPLAY_STATUS_OK);
+    CHECK(run.begin == crash - 49 && run.crash == crash && run.ran == 50);
+    CHECK(replay.Replay(target, 0, crash, &run) == REPLAY_STATUS_OK && run.crash == REPLAY_NO_CRASH);
+
+    CHECK(replay.Bisect(target, crash, &bisect) == REPLAY_STATUS_OK);
+    CHECK(bisect.start == crash && bisect.required == 1 && bisect.probes == 1);
+    CHECK(bisect.crashSequence == crash + 1);
+    return TRUE;
+}
+
+static BOOL
+CheckBisectState ()
+{
+    JournalBuilder      builder("replay_state.vfj");
+    FuzzJournalReader   reader;
+    STATEFUL_SIM        sim;
+    HcLoopbackBackend   backend(StatefulHandler, &sim);
+    ReplayBackendTarget target(backend, SimCrashed, SimReset, &sim);
+    REPLAY_RUN          run;
+    REPLAY_BISECT       bisect;
+    UINT64              first = 0;
+    UINT64              crash = 0;
+
+    //
+    // Armed twice, freed, then armed three times: the crash needs the cases
+    // from the first arming after the free
+    //
+    builder.Session();
+    builder.Noise(100);
+    builder.Call(ARM_CALLCODE);
+    builder.Noise(300);
+    builder.Call(ARM_CALLCODE);
+    builder.Noise(100);
+    builder.Call(FREE_CALLCODE);
+    builder.Noise(400);
+    first = builder.Call(ARM_CALLCODE);
+    builder.Noise(600);
+    builder.Call(ARM_CALLCODE);
+    builder.Noise(1100);
+    builder.Call(ARM_CALLCODE);
+    builder.Noise(400);
+    crash = builder.Call(STATE_CALLCODE);
+    builder.Noise(50);
+    CHECK(builder.Write() && reader.Open(builder.Path().c_str()));
+
+    JournalReplay replay(reader, &builder.Space());
+
+    CHECK(replay.Replay(target, 0, replay.Count(), &run) == REPLAY_STATUS_OK && run.crash == crash);
+    CHECK(replay.Replay(target, crash, crash + 1, &run) == REPLAY_STATUS_OK && run.crash == REPLAY_NO_CRASH);
+
+    CHECK(replay.Bisect(target, crash, &bisect) == REPLAY_STATUS_OK);
+    CHECK(bisect.start == first && bisect.required == crash - first + 1);
+    CHECK(bisect.startSequence == first + 1 && bisect.crashSequence == crash + 1);
+    CHECK(replay.Replay(target, first, crash + 1, &run) == REPLAY_STATUS_OK && run.crash == crash);
+    CHECK(replay.Replay(target, first + 1, crash + 1, &run) == REPLAY_STATUS_OK && run.crash == REPLAY_NO_CRASH);
+    return TRUE;
+}
+
+static BOOL
+CheckSession ()
+{
+    JournalBuilder      builder("replay_session.vfj");
+    FuzzJournalReader   reader;
+    STATEFUL_SIM        sim;
+    HcLoopbackBackend   backend(StatefulHandler, &sim);
+    ReplayBackendTarget target(backend, SimCrashed, SimReset, &sim);
+    REPLAY_RUN          run;
+    REPLAY_BISECT       bisect;
+    UINT64              session = 0;
+    UINT64              crash = 0;
+
+    //
+    // The first arming was before the guest rebooted, so this journal can't
+    // have crashed. Replaying across the reboot would say it does
+    //
+    builder.Session();
+    builder.Call(ARM_CALLCODE);
+    builder.Noise(200);
+    builder.Session();
+    session = builder.Count();
+    builder.Call(ARM_CALLCODE);
+    builder.Call(ARM_CALLCODE);
+    builder.Noise(200);
+    crash = builder.Call(STATE_CALLCODE);
+    CHECK(builder.Write() && reader.Open(builder.Path().c_str()));
+
+    JournalReplay replay(reader, &builder.Space());
+
+    CHECK(replay.SessionStart(crash) == session && replay.SessionStart(session - 1) == 0);
+    CHECK(replay.Replay(target, 0, replay.Count(), &run) == REPLAY_STATUS_OK && run.crash == crash);
+    CHECK(replay.Bisect(target, crash, &bisect) == REPLAY_STATUS_NOT_REPRODUCED);
+    CHECK(bisect.sessionStart == session);
+    return TRUE;
+}
+
+static VOID
+Bench (
+    IN UINT64   cases
+)
+{
+    static const UINT32 batches[] = { 1, 16, 256, HYPERCALL_BATCH_MAX_CASES };
+    JournalBuilder      builder("replay_bench.vfj");
+    FuzzJournalReader   reader;
+    STATEFUL_SIM        sim;
+    HcLoopbackBackend   backend(StatefulHandler, &sim);
+    ReplayBackendTarget target(backend, SimCrashed, SimReset, &sim);
+    UINT64              window = cases / 100 + SIM_THRESHOLD;
+    UINT64              crash = 0;
+    CHAR                name[64];
+
+    //
+    // A long session, the arming calls spread over the last window cases
+    //
+    builder.Session();
+    builder.Noise(cases - window);
+    for (UINT32 a = 0; a < SIM_THRESHOLD; a++)
+    {
+        builder.Call(ARM_CALLCODE);
+        builder.Noise(window / SIM_THRESHOLD - 1);
+    }
+    builder.Noise(cases - 1 - builder.Count());
+    crash = builder.Call(STATE_CALLCODE);
+    if (!builder.Write() || !reader.Open(builder.Path().c_str()))
+    {
+        printf("[-] could not write %s\n", builder.Path().c_str());
+        return;
+    }
+
+    for (UINT32 b = 0; b < _ARRAYSIZE(batches); b++)
+    {
+        REPLAY_CONFIG   config = { batches[b], 0 };
+        JournalReplay   replay(reader, &builder.Space(), &config);
+        REPLAY_RUN      run;
+        REPLAY_STATS    stats;
+
+        replay.Replay(target, 0, replay.Count(), &run);
+        replay.GetStats(&stats);
+        snprintf(name, sizeof(name), "replay/batch %u", batches[b]);
+        BenchReport(name, stats.cases * 1e9 / (double)(stats.execNs != 0 ? stats.execNs : 1), "cases/s");
+    }
+
+    {
+        JournalReplay   replay(reader, &builder.Space());
+        REPLAY_BISECT   bisect;
+
+        if (replay.Bisect(target, crash, &bisect) != REPLAY_STATUS_OK)
+        {
+            printf("[-] bisection did not reproduce\n");
+            return;
+        }
+        printf("[ ] %llu cases, %llu required\n",
+               (unsigned long long)replay.Count(),
+               (unsigned long long)bisect.required);
+        BenchReport("replay/bisect probes", (double)bisect.probes, "replays");
+        BenchReport("replay/bisect cases", (double)bisect.cases / (double)replay.Count(), "x session");
+    }
+}
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    UINT64 cases = 100000;
+
+    if (argc > 1)
+    {
+        g_dir = argv[1];
+    }
+    if (argc > 2)
+    {
+        cases = strtoull(argv[2], NULL, 0);
+    }
+    if (cases < 1000)
+    {
+        cases = 1000;
+    }
+
+    if (!CheckStream() || !CheckWindow() || !CheckBisectState() || !CheckSession())
+    {
+        return 1;
+    }
+    printf("[+] JournalReplay checks passed\n");
+
+    Bench(cases);
+    return 0;
+}
@@ -0,0 +1,292 @@
+/*++
+
+Module Name:
+
+    BenchRing.cpp
+
+Abstract:
+
+    Two-thread stress and throughput benchmark for the HcRing SPSC ring.
+
+    ring/spsc    - producer and consumer threads stream sequence numbers
+                   through a bare ring, the consumer checks every entry
+                   arrives once, in order and intact
+    ring/pair    - HcRingClient batches against a consumer thread running
+                   HcRingDrain, the same drain loop the driver's doorbell uses,
+                   with every result checked against its case and every
+                   doorbell against its batch's flags
+
+    Exits non-zero on any ordering or content mismatch.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include "ViFuBench.h"
+#include "../ViFuCore/HcRingClient.h"
+
+typedef struct _SPSC_ENTRY
+{
+    UINT64 seq;
+    UINT64 check;
+} SPSC_ENTRY;
+
+#define SPSC_CHECK(seq)     ((seq) * 0x9E3779B97F4A7C15ULL ^ 0xA5A5A5A5A5A5A5A5ULL)
+
+//
+// Cache line aligned ring memory, kept for the life of the benchmark
+//
+static PVOID
+AllocRegion (
+    IN SIZE_T   size
+)
+{
+    std::vector<UINT64> *pMem = new std::vector<UINT64>((size + HC_RING_CACHE_LINE) / sizeof(UINT64) + 1);
+    UINT64 addr = (UINT64)pMem->data();
+
+    return (PVOID)((addr + HC_RING_CACHE_LINE - 1) & ~(UINT64)(HC_RING_CACHE_LINE - 1));
+}
+
+static BOOL
+BenchSpsc (
+    IN UINT32   entryCnt,
+    IN UINT64   msgCnt
+)
+{
+    PHC_RING_HEADER     pHeader = (PHC_RING_HEADER)AllocRegion(HC_RING_SIZE(entryCnt, sizeof(SPSC_ENTRY)));
+    std::atomic<UINT64> errors(0);
+    CHAR                name[64];
+
+    HcRingInitShared(pHeader, entryCnt, sizeof(SPSC_ENTRY));
+
+    BenchTimer timer;
+
+    std::thread consumer([&]() {
+        HC_RING ring = { 0 };
+        UINT64  expected = 0;
+
+        HcRingAttach(&ring, pHeader, entryCnt, sizeof(SPSC_ENTRY), FALSE);
+        while (expected < msgCnt)
+        {
+            SPSC_ENTRY *pEntry = (SPSC_ENTRY *)HcRingConsumerNext(&ring);
+            UINT32      batch = 0;
+
+            if (pEntry == NULL)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            while (pEntry != NULL && batch < 64)
+            {
+                if (pEntry->seq != expected || pEntry->check != SPSC_CHECK(expected))
+                {
+                    errors++;
+                }
+                expected++;
+                batch++;
+                HcRingConsumerAdvance(&ring);
+                pEntry = (SPSC_ENTRY *)HcRingConsumerNext(&ring);
+            }
+            HcRingConsumerRelease(&ring);
+        }
+    });
+
+    HC_RING ring = { 0 };
+    UINT64  seq = 0;
+
+    HcRingAttach(&ring, pHeader, entryCnt, sizeof(SPSC_ENTRY), TRUE);
+    while (seq < msgCnt)
+    {
+        SPSC_ENTRY *pEntry = (SPSC_ENTRY *)HcRingProducerNext(&ring);
+        UINT32      batch = 0;
+
+        if (pEntry == NULL)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        while (pEntry != NULL && batch < 64 && seq < msgCnt)
+        {
+            pEntry->seq = seq;
+            pEntry->check = SPSC_CHECK(seq);
+            seq++;
+            batch++;
+            HcRingProducerAdvance(&ring);
+            pEntry = (SPSC_ENTRY *)HcRingProducerNext(&ring);
+        }
+        HcRingProducerPublish(&ring);
+    }
+
+    consumer.join();
+
+    snprintf(name, sizeof(name), "ring/spsc/entries:%u", entryCnt);
+    BenchReport(name, (double)msgCnt / timer.Seconds(), "msgs/s");
+
+    if (errors != 0)
+    {
+        printf("[-] %s: %llu corrupt or out of order entries\n", name, (unsigned long long)errors.load());
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//
+// Echo exec - result carries the input back so every completion can be checked
+//
+static VOID
+EchoExecCase (
+    IN OUT PCPU_REG_64              pInRegs,
+    OUT    PHYPERCALL_BATCH_RESULT  pResult,
+    IN     PVOID                    pContext
+)
+{
+    (VOID)pContext;
+    memcpy(&pResult->regsOut, pInRegs, sizeof(CPU_REG_64));
+    pResult->hvStatus = HV_STATUS_SUCCESS;
+}
+
+//
+// Ring client whose consumer is a polling thread standing in for the driver
+//
+class ThreadRingBackend : public HcRingClient
+{
+public:
+    ThreadRingBackend (
+        IN UINT32   entryCnt
+    )
+        : HcRingClient(TRUE),
+          m_stop(false),
+          m_flags(0)
+    {
+        PVOID pBase = AllocRegion(HC_RING_PAIR_SIZE(entryCnt, entryCnt));
+
+        InitRings(pBase, entryCnt, entryCnt);
+        m_consumer = std::thread([this, pBase, entryCnt]() {
+            HC_RING sq = { 0 };
+            HC_RING cq = { 0 };
+
+            HcRingAttach(&sq, HcRingPairSq(pBase), entryCnt, sizeof(HC_SQ_ENTRY), FALSE);
+            HcRingAttach(&cq, HcRingPairCq(pBase, entryCnt), entryCnt, sizeof(HC_CQ_ENTRY), TRUE);
+            while (!m_stop.load(std::memory_order_relaxed))
+            {
+                if (HcRingDrain(&sq, &cq, 0xFFFFFFFF, EchoExecCase, NULL) == 0)
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    ~ThreadRingBackend ()
+    {
+        m_stop = true;
+        m_consumer.join();
+    }
+
+    UINT32 DoorbellFlags () const { return m_flags; }
+
+protected:
+    virtual UINT32
+    Doorbell (
+        IN UINT32   flags
+    )
+    {
+        m_flags = flags;
+        std::this_thread::yield();
+        return 0;
+    }
+
+private:
+    std::atomic<bool>   m_stop;
+    std::thread         m_consumer;
+    UINT32              m_flags;        // Of the last doorbell
+};
+
+static BOOL
+BenchPair (
+    IN UINT32   entryCnt,
+    IN UINT32   batchSize
+)
+{
+    ThreadRingBackend   backend(entryCnt);
+    HcBatchEncoder      batch(batchSize);
+    HcBatchResults      results(batchSize);
+    UINT64              errors = 0;
+    CHAR                name[64];
+
+    double casesPerSec = BenchRun([&](UINT64 iters) {
+        UINT64 c = 0;
+
+        while (c < iters)
+        {
+            //
+            // Every other batch register only
+            //
+            batch.Reset();
+            if (c / batchSize % 2)
+            {
+                batch.SetFlags(HYPERCALL_BATCH_FLAG_REGISTER_ONLY);
+            }
+            while (!batch.IsFull() && c < iters)
+            {
+                PCPU_REG_64 pRegs = batch.Next();
+
+                memset(pRegs, 0, sizeof(CPU_REG_64));
+                pRegs->rcx = c;
+                pRegs->rdx = batch.Flags() ? 0 : USE_GPA_MEM_FILL;
+                c++;
+            }
+
+            if (backend.ExecBatch(batch, results) != 0 ||
+                results.Count() != batch.Count() ||
+                backend.DoorbellFlags() != batch.Flags())
+            {
+                errors++;
+                return;
+            }
+
+            for (UINT32 r = 0; r < results.Count(); r++)
+            {
+                if (results[r].regsOut.rcx != batch.Case(r).rcx)
+                {
+                    errors++;
+                }
+            }
+        }
+    }, 0.3);
+
+    snprintf(name, sizeof(name), "ring/pair/entries:%u/batch:%u", entryCnt, batchSize);
+    BenchReport(name, casesPerSec, "cases/s");
+
+    if (errors != 0)
+    {
+        printf("[-] %s: %llu mismatched completions\n", name, (unsigned long long)errors);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int
+main ()
+{
+    BOOL bOk = TRUE;
+
+    for (UINT32 entryCnt = 16; entryCnt <= HC_RING_MAX_ENTRIES; entryCnt *= 4)
+    {
+        bOk &= BenchSpsc(entryCnt, 20000000);
+    }
+
+    for (UINT32 batchSize = 1; batchSize <= 1024; batchSize *= 4)
+    {
+        bOk &= BenchPair(256, batchSize);
+    }
+
+    return bOk ? 0 : 1;
+}
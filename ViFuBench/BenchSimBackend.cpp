@@ -0,0 +1,529 @@
+/*++
+
+Module Name:
+
+    BenchSimBackend.cpp
+
+Abstract:
+
+    Checks the simulated hypervisor (HcSimBackend.h) against the statuses
+    the TLFS gives, and measures how many calls a second it answers: the
+    ceiling every other component is measured under.
+
+    Checks (exit non-zero on failure)
+        - the control word: unknown call code, reserved bits, rep count on
+          a simple call or none on a rep call, rep start past the count,
+          fast input past the registers, and repComplete on success and on
+          a rep slice
+        - privilege: a child is denied every privileged call code, a parent
+          only the root ones, the root none
+        - state: partitions go created, initialized, finalized and deleted,
+          ports and connections are checked by id and in use, VTLs enable
+          per partition then per VP and are entered and left by VTL call
+          and return, tables run out, and Reset forgets all of it
+        - faults: a crash takes every later call down until Reset, a status
+          fault fires on about 1 in n calls, a stall holds the call, and a
+          predicate narrows any of them
+
+    Benchmarks
+        sim/exec                - default case table straight into Exec,
+                                  calls/s
+        sim/batch               - the same through ExecBatch, 64 per batch
+        sim/batch state         - with all state tracked, as a child
+        sim/batch faults        - with a status fault on 1 in 1000 calls
+
+    sim/batch below SIM_MIN_RATE calls/s fails the run.
+
+    Usage: BenchSimBackend
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <vector>
+#include "ViFuBench.h"
+#include "../ViFuCore/HcSimBackend.h"
+#include "../ViFuCore/CaseSpace.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define BENCH_BATCH_SIZE    64
+#define BENCH_CASES         4096
+#define SIM_MIN_RATE        1000000.0
+
+#define PRIV_PARENT_ROOT_CALLCODE   0x0044  // HvGetPartitionProperty
+#define PRIV_ROOT_CALLCODE          0x0060  // HvInitializeEventLogBufferGroup
+#define UNPRIVILEGED_CALLCODE       0x0046  // HvGetPartitionId
+
+//
+// Simple call with its input at HC_SIM_INPUT_GPA, returns the status and
+// the first output qword
+//
+static HV_STATUS
+Call (
+    IN  HcSimBackend                    &sim,
+    IN  UINT64                          callcode,
+    IN  std::initializer_list<UINT64>   input,
+    OUT PUINT64                         pOutput = NULL
+)
+{
+    CPU_REG_64  regs = {};
+    CPU_REG_64  out;
+    UINT16      repComplete = 0;
+    UINT32      f = 0;
+    HV_STATUS   status = HV_STATUS_SUCCESS;
+
+    memset(sim.InputPage(), 0, 0x1000);
+    for (UINT64 value : input)
+    {
+        sim.InputPage()[f++] = value;
+    }
+    sim.OutputPage()[0] = 0;
+
+    regs.rcx = callcode;
+    regs.rdx = HC_SIM_INPUT_GPA;
+    regs.r8 = HC_SIM_OUTPUT_GPA;
+    status = sim.Exec(&regs, &out, &repComplete);
+    if (pOutput != NULL)
+    {
+        *pOutput = sim.OutputPage()[0];
+    }
+    return status;
+}
+
+//
+// First simple and first rep call code with an input. Zero is in range for
+// every field, so an all-zero input passes
+//
+static BOOL
+FindCallcodes (
+    OUT PUINT32     pSimple,
+    OUT PUINT32     pRep
+)
+{
+    *pSimple = 0;
+    *pRep = 0;
+    for (UINT32 callcode = 1; callcode < HC_DESC_COUNT; callcode++)
+    {
+        const HC_DESC   *pDesc = HcLookup(callcode);
+        BOOL            isRep = pDesc->isRep == 1 || pDesc->isRep == 3;
+
+        if ((pDesc->flags & HC_DESC_STUB) || pDesc->inputSize == 0 || pDesc->inputSize > 0x100)
+        {
+            continue;
+        }
+        if (isRep && *pRep == 0)
+        {
+            *pRep = callcode;
+        }
+        else if (!isRep && *pSimple == 0)
+        {
+            *pSimple = callcode;
+        }
+    }
+    return *pSimple != 0 && *pRep != 0;
+}
+
+static BOOL
+CheckControl ()
+{
+    HcSimBackend    sim;
+    UINT32          simple = 0;
+    UINT32          rep = 0;
+    UINT16          repComplete = 0;
+    CPU_REG_64      regs = {};
+    CPU_REG_64      out;
+
+    CHECK(FindCallcodes(&simple, &rep));
+    CHECK(Call(sim, simple, {}) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, 0xffff, {}) == HV_STATUS_INVALID_HYPERCALL_CODE);
+    CHECK(Call(sim, simple | 1ULL << 27, {}) == HV_STATUS_INVALID_HYPERCALL_INPUT);
+    CHECK(Call(sim, simple | 1ULL << 63, {}) == HV_STATUS_INVALID_HYPERCALL_INPUT);
+    CHECK(Call(sim, simple | 1ULL << HV_CONTROL_REP_COUNT_SHIFT, {}) == HV_STATUS_INVALID_HYPERCALL_INPUT);
+    CHECK(Call(sim, rep, {}) == HV_STATUS_INVALID_HYPERCALL_INPUT);
+
+    regs.rdx = HC_SIM_INPUT_GPA;
+    regs.r8 = HC_SIM_OUTPUT_GPA;
+    memset(sim.InputPage(), 0, 0x1000);
+
+    regs.rcx = rep | 16ULL << HV_CONTROL_REP_COUNT_SHIFT | 16ULL << HV_CONTROL_REP_START_SHIFT;
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_INVALID_HYPERCALL_INPUT);
+    regs.rcx = rep | 16ULL << HV_CONTROL_REP_COUNT_SHIFT | 4ULL << HV_CONTROL_REP_START_SHIFT;
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_SUCCESS && repComplete == 16);
+
+    sim.SetRepSlice(5);
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_SUCCESS && repComplete == 9);
+    sim.SetRepSlice(0);
+
+    //
+    // Fast: more input than the registers hold is refused before anything
+    // is read
+    //
+    regs.rcx = rep | 1ULL << 16 | (UINT64)FAST_CALL_SLOTS << HV_CONTROL_REP_COUNT_SHIFT;
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_INVALID_HYPERCALL_INPUT && repComplete == 0);
+
+    //
+    // GPAs: misaligned, off the pool, crossing the page
+    //
+    regs.rcx = simple;
+    regs.rdx = HC_SIM_INPUT_GPA + 4;
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_INVALID_ALIGNMENT);
+    regs.rdx = HC_SIM_OUTPUT_GPA + 0x2000;
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_INVALID_PARAMETER);
+    regs.rdx = HC_SIM_INPUT_GPA + 0x1000 - 8;
+    CHECK(HcLookup(simple)->inputSize <= 8 ||
+          sim.Exec(&regs, &out, &repComplete) == HV_STATUS_INVALID_HYPERCALL_INPUT);
+    return TRUE;
+}
+
+static BOOL
+CheckPrivilege ()
+{
+    HcSimBackend sim;
+
+    CHECK(HcLookup(PRIV_PARENT_ROOT_CALLCODE)->privilege == HC_PRIV_PARENT_ROOT);
+    CHECK(HcLookup(PRIV_ROOT_CALLCODE)->privilege == HC_PRIV_ROOT);
+    CHECK(!(HcLookup(UNPRIVILEGED_CALLCODE)->flags & HC_DESC_PRIVILEGED));
+
+    CHECK(Call(sim, PRIV_PARENT_ROOT_CALLCODE, { HV_PARTITION_ID_SELF }) != HV_STATUS_ACCESS_DENIED);
+    CHECK(Call(sim, PRIV_ROOT_CALLCODE, {}) != HV_STATUS_ACCESS_DENIED);
+
+    sim.SetCaller(HC_SIM_CALLER_PARENT);
+    CHECK(Call(sim, PRIV_PARENT_ROOT_CALLCODE, { HV_PARTITION_ID_SELF }) != HV_STATUS_ACCESS_DENIED);
+    CHECK(Call(sim, PRIV_ROOT_CALLCODE, {}) == HV_STATUS_ACCESS_DENIED);
+
+    sim.SetCaller(HC_SIM_CALLER_CHILD);
+    CHECK(Call(sim, PRIV_PARENT_ROOT_CALLCODE, { HV_PARTITION_ID_SELF }) == HV_STATUS_ACCESS_DENIED);
+    CHECK(Call(sim, PRIV_ROOT_CALLCODE, {}) == HV_STATUS_ACCESS_DENIED);
+    CHECK(Call(sim, UNPRIVILEGED_CALLCODE, {}) != HV_STATUS_ACCESS_DENIED);
+
+    //
+    // The control word is checked first
+    //
+    CHECK(Call(sim, PRIV_ROOT_CALLCODE | 1ULL << 27, {}) == HV_STATUS_INVALID_HYPERCALL_INPUT);
+
+    for (UINT32 callcode = 0; callcode < HC_DESC_COUNT; callcode++)
+    {
+        const HC_DESC *pDesc = HcLookup(callcode);
+        BOOL isRep = pDesc->isRep == 1 || pDesc->isRep == 3;
+
+        if (isRep || (pDesc->flags & HC_DESC_STUB) || pDesc->inputSize > 0x1000 || pDesc->outputSize > 0x1000)
+        {
+            continue;
+        }
+        CHECK((Call(sim, callcode, {}) == HV_STATUS_ACCESS_DENIED) == ((pDesc->flags & HC_DESC_PRIVILEGED) != 0));
+    }
+    return TRUE;
+}
+
+static BOOL
+CheckPartitions ()
+{
+    HcSimBackend    sim;
+    UINT64          id = 0;
+    UINT64          out = 0;
+
+    sim.SetState(HC_SIM_STATE_ALL);
+
+    CHECK(Call(sim, HC_SIM_CALL_GET_PARTITION_ID, {}, &out) == HV_STATUS_SUCCESS && out == HC_SIM_SELF_ID);
+    CHECK(Call(sim, HC_SIM_CALL_INITIALIZE_PARTITION, { HC_SIM_FIRST_CHILD_ID }) == HV_STATUS_INVALID_PARTITION_ID);
+    CHECK(Call(sim, HC_SIM_CALL_INITIALIZE_PARTITION, { HV_PARTITION_ID_SELF }) == HV_STATUS_INVALID_PARTITION_ID);
+
+    CHECK(Call(sim, HC_SIM_CALL_CREATE_PARTITION, {}, &id) == HV_STATUS_SUCCESS && id == HC_SIM_FIRST_CHILD_ID);
+    CHECK(Call(sim, HC_SIM_CALL_GET_PARTITION_PROPERTY, { id, 0x1234 }) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, HC_SIM_CALL_SET_PARTITION_PROPERTY, { id + 1 }) == HV_STATUS_INVALID_PARTITION_ID);
+    CHECK(Call(sim, HC_SIM_CALL_FINALIZE_PARTITION, { id }) == HV_STATUS_INVALID_PARTITION_STATE);
+    CHECK(Call(sim, HC_SIM_CALL_INITIALIZE_PARTITION, { id }) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, HC_SIM_CALL_INITIALIZE_PARTITION, { id }) == HV_STATUS_INVALID_PARTITION_STATE);
+    CHECK(Call(sim, HC_SIM_CALL_DELETE_PARTITION, { id }) == HV_STATUS_INVALID_PARTITION_STATE);
+    CHECK(Call(sim, HC_SIM_CALL_FINALIZE_PARTITION, { id }) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, HC_SIM_CALL_DELETE_PARTITION, { id }) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, HC_SIM_CALL_DELETE_PARTITION, { id }) == HV_STATUS_INVALID_PARTITION_ID);
+    CHECK(sim.Partitions() == 0);
+
+    for (UINT32 p = 0; p < HC_SIM_MAX_OBJECTS; p++)
+    {
+        CHECK(Call(sim, HC_SIM_CALL_CREATE_PARTITION, {}, &out) == HV_STATUS_SUCCESS && out == ++id);
+    }
+    CHECK(Call(sim, HC_SIM_CALL_CREATE_PARTITION, {}) == HV_STATUS_INSUFFICIENT_MEMORY);
+
+    sim.Reset();
+    CHECK(sim.Partitions() == 0);
+    CHECK(Call(sim, HC_SIM_CALL_CREATE_PARTITION, {}, &out) == HV_STATUS_SUCCESS && out == HC_SIM_FIRST_CHILD_ID);
+    return TRUE;
+}
+
+static BOOL
+CheckPorts ()
+{
+    HcSimBackend    sim;
+    UINT64          child = 0;
+
+    sim.SetState(HC_SIM_STATE_ALL);
+    CHECK(Call(sim, HC_SIM_CALL_CREATE_PARTITION, {}, &child) == HV_STATUS_SUCCESS);
+
+    CHECK(Call(sim, HC_SIM_CALL_POST_MESSAGE, { 5 }) == HV_STATUS_INVALID_CONNECTION_ID);
+    CHECK(Call(sim, HC_SIM_CALL_CONNECT_PORT, { child, 5, HV_PARTITION_ID_SELF, 7 }) == HV_STATUS_INVALID_PORT_ID);
+    CHECK(Call(sim, HC_SIM_CALL_CREATE_PORT, { child + 1, 7 }) == HV_STATUS_INVALID_PARTITION_ID);
+    CHECK(Call(sim, HC_SIM_CALL_CREATE_PORT, { HV_PARTITION_ID_SELF, 7 }) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, HC_SIM_CALL_CREATE_PORT_EX, { HC_SIM_SELF_ID, 7 }) == HV_STATUS_INVALID_PORT_ID);
+    CHECK(Call(sim, HC_SIM_CALL_CONNECT_PORT, { child, 5, child + 1, 7 }) == HV_STATUS_INVALID_PARTITION_ID);
+    CHECK(Call(sim, HC_SIM_CALL_CONNECT_PORT, { child, 5, HV_PARTITION_ID_SELF, 7 }) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, HC_SIM_CALL_CONNECT_PORT_EX, { child, 5, HV_PARTITION_ID_SELF, 7 }) == HV_STATUS_INVALID_CONNECTION_ID);
+    CHECK(Call(sim, HC_SIM_CALL_POST_MESSAGE, { 5 }) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, HC_SIM_CALL_SIGNAL_EVENT, { 5 }) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, HC_SIM_CALL_SIGNAL_EVENT, { 6 }) == HV_STATUS_INVALID_CONNECTION_ID);
+    CHECK(Call(sim, HC_SIM_CALL_DELETE_PORT, { HV_PARTITION_ID_SELF, 7 }) == HV_STATUS_OBJECT_IN_USE);
+    CHECK(Call(sim, HC_SIM_CALL_DISCONNECT_PORT, { child, 5 }) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, HC_SIM_CALL_DISCONNECT_PORT, { child, 5 }) == HV_STATUS_INVALID_CONNECTION_ID);
+    CHECK(Call(sim, HC_SIM_CALL_DELETE_PORT, { HV_PARTITION_ID_SELF, 7 }) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, HC_SIM_CALL_DELETE_PORT, { HV_PARTITION_ID_SELF, 7 }) == HV_STATUS_INVALID_PORT_ID);
+    CHECK(sim.Ports() == 0 && sim.Connections() == 0);
+
+    for (UINT64 port = 0; port < HC_SIM_MAX_OBJECTS; port++)
+    {
+        CHECK(Call(sim, HC_SIM_CALL_CREATE_PORT, { HV_PARTITION_ID_SELF, port }) == HV_STATUS_SUCCESS);
+    }
+    CHECK(Call(sim, HC_SIM_CALL_CREATE_PORT, { HV_PARTITION_ID_SELF, 1000 }) == HV_STATUS_INSUFFICIENT_MEMORY);
+
+    //
+    // Without partitions tracked any partition id will do
+    //
+    sim.SetState(HC_SIM_STATE_PORTS);
+    CHECK(sim.Ports() == 0);
+    CHECK(Call(sim, HC_SIM_CALL_CREATE_PORT, { 0x1234, 7 }) == HV_STATUS_SUCCESS);
+    return TRUE;
+}
+
+static BOOL
+CheckVtls ()
+{
+    HcSimBackend    sim;
+    const UINT64    vp0 = 1ULL << 32;
+    const UINT64    vpSelf = 1ULL << 32 | HV_VP_INDEX_SELF;
+
+    sim.SetState(HC_SIM_STATE_ALL);
+
+    CHECK(Call(sim, HC_SIM_CALL_VTL_CALL, {}) == HV_STATUS_INVALID_VP_STATE);
+    CHECK(Call(sim, HC_SIM_CALL_VTL_RETURN, {}) == HV_STATUS_INVALID_VP_STATE);
+    CHECK(Call(sim, HC_SIM_CALL_ENABLE_VP_VTL, { HV_PARTITION_ID_SELF, vp0 }) == HV_STATUS_INVALID_PARTITION_STATE);
+    CHECK(Call(sim, HC_SIM_CALL_ENABLE_PARTITION_VTL, { HC_SIM_FIRST_CHILD_ID, 1 }) == HV_STATUS_INVALID_PARTITION_ID);
+    CHECK(Call(sim, HC_SIM_CALL_ENABLE_PARTITION_VTL, { HV_PARTITION_ID_SELF, 2 }) == HV_STATUS_INVALID_PARAMETER);
+    CHECK(Call(sim, HC_SIM_CALL_ENABLE_PARTITION_VTL, { HV_PARTITION_ID_SELF, 1 }) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, HC_SIM_CALL_ENABLE_PARTITION_VTL, { HC_SIM_SELF_ID, 1 }) == HV_STATUS_INVALID_PARTITION_STATE);
+    CHECK(Call(sim, HC_SIM_CALL_ENABLE_VP_VTL, { HV_PARTITION_ID_SELF, 1ULL << 32 | HC_SIM_VP_COUNT }) == HV_STATUS_INVALID_VP_INDEX);
+    CHECK(Call(sim, HC_SIM_CALL_ENABLE_VP_VTL, { HV_PARTITION_ID_SELF, vpSelf }) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, HC_SIM_CALL_ENABLE_VP_VTL, { HV_PARTITION_ID_SELF, vp0 }) == HV_STATUS_INVALID_VP_STATE);
+
+    CHECK(Call(sim, HC_SIM_CALL_VTL_CALL, {}) == HV_STATUS_SUCCESS && sim.Vtl() == 1);
+    CHECK(Call(sim, HC_SIM_CALL_VTL_CALL, {}) == HV_STATUS_INVALID_VP_STATE);
+    CHECK(Call(sim, HC_SIM_CALL_DISABLE_VP_VTL, { HV_PARTITION_ID_SELF, vp0 }) == HV_STATUS_INVALID_VP_STATE);
+    CHECK(Call(sim, HC_SIM_CALL_VTL_RETURN, {}) == HV_STATUS_SUCCESS && sim.Vtl() == 0);
+
+    CHECK(Call(sim, HC_SIM_CALL_DISABLE_PARTITION_VTL, { HV_PARTITION_ID_SELF, 1 }) == HV_STATUS_OBJECT_IN_USE);
+    CHECK(Call(sim, HC_SIM_CALL_DISABLE_VP_VTL, { HV_PARTITION_ID_SELF, vp0 }) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, HC_SIM_CALL_DISABLE_PARTITION_VTL, { HV_PARTITION_ID_SELF, 1 }) == HV_STATUS_SUCCESS);
+    CHECK(Call(sim, HC_SIM_CALL_DISABLE_PARTITION_VTL, { HV_PARTITION_ID_SELF, 1 }) == HV_STATUS_INVALID_PARTITION_STATE);
+
+    CHECK(Call(sim, HC_SIM_CALL_ENABLE_PARTITION_VTL, { HV_PARTITION_ID_SELF, 1 }) == HV_STATUS_SUCCESS);
+    sim.Reset();
+    CHECK(Call(sim, HC_SIM_CALL_ENABLE_VP_VTL, { HV_PARTITION_ID_SELF, vp0 }) == HV_STATUS_INVALID_PARTITION_STATE);
+    return TRUE;
+}
+
+static BOOL
+RaxIsOdd (
+    IN const CPU_REG_64     *pRegs,
+    IN VOID                 *pContext
+)
+{
+    (VOID)pContext;
+    return pRegs->rax & 1;
+}
+
+static BOOL
+CheckFaults ()
+{
+    HcSimBackend    sim;
+    HC_SIM_FAULT    fault = {};
+    UINT32          simple = 0;
+    UINT32          rep = 0;
+    UINT32          failed = 0;
+    CPU_REG_64      regs = {};
+    CPU_REG_64      out;
+    UINT16          repComplete = 0;
+
+    CHECK(FindCallcodes(&simple, &rep));
+
+    fault.kind = HC_SIM_FAULT_CRASH;
+    fault.callcode = rep;
+    sim.SetFault(&fault);
+    CHECK(Call(sim, simple, {}) == HV_STATUS_SUCCESS && !sim.IsDown());
+    CHECK(Call(sim, rep, {}) == HV_STATUS_INVALID_HYPERCALL_INPUT && !sim.IsDown());
+    CHECK(Call(sim, rep | 1ULL << HV_CONTROL_REP_COUNT_SHIFT, {}) == HC_SIM_CRASH_STATUS && sim.IsDown());
+    CHECK(Call(sim, simple, {}) == HC_SIM_CRASH_STATUS && sim.Faults() == 1);
+    sim.Reset();
+    CHECK(Call(sim, simple, {}) == HV_STATUS_SUCCESS);
+
+    //
+    // Through the batch path the crash is the case's status
+    //
+    {
+        HcBatchEncoder  batch(4);
+        HcBatchResults  results(4);
+
+        regs.rcx = simple;
+        regs.rdx = HC_SIM_INPUT_GPA;
+        regs.r8 = HC_SIM_OUTPUT_GPA;
+        batch.Add(regs);
+        regs.rcx = rep | 1ULL << HV_CONTROL_REP_COUNT_SHIFT;
+        batch.Add(regs);
+        batch.Add(regs);
+        CHECK(sim.ExecBatch(batch, results) == 0 && results.Count() == 3);
+        CHECK(results[0].hvStatus == HV_STATUS_SUCCESS);
+        CHECK(results[1].hvStatus == HC_SIM_CRASH_STATUS && results[2].hvStatus == HC_SIM_CRASH_STATUS);
+    }
+    sim.Reset();
+
+    fault.kind = HC_SIM_FAULT_STATUS;
+    fault.callcode = HC_SIM_FAULT_ANY_CALLCODE;
+    fault.oneIn = 8;
+    fault.status = HV_STATUS_INSUFFICIENT_MEMORY;
+    fault.seed = 0x51F;
+    sim.SetFault(&fault);
+    for (UINT32 i = 0; i < 80000; i++)
+    {
+        failed += Call(sim, simple, {}) == HV_STATUS_INSUFFICIENT_MEMORY;
+    }
+    CHECK(failed > 9000 && failed < 11000 && sim.Faults() == failed);
+
+    fault.oneIn = 0;
+    fault.pPredicate = RaxIsOdd;
+    sim.SetFault(&fault);
+    regs.rcx = simple;
+    regs.rdx = HC_SIM_INPUT_GPA;
+    regs.r8 = HC_SIM_OUTPUT_GPA;
+    regs.rax = 2;
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_SUCCESS);
+    regs.rax = 3;
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_INSUFFICIENT_MEMORY);
+
+    //
+    // A stall holds the VP but the call still succeeds
+    //
+    fault.kind = HC_SIM_FAULT_STALL;
+    fault.stallNs = 2000000;
+    fault.pPredicate = NULL;
+    sim.SetFault(&fault);
+    {
+        HcBatchEncoder  batch(1);
+        HcBatchResults  results(1);
+
+        batch.Add(regs);
+        CHECK(sim.ExecBatch(batch, results) == 0 && results.Count() == 1);
+        CHECK(results[0].hvStatus == HV_STATUS_SUCCESS && results[0].cycles >= fault.stallNs);
+    }
+
+    sim.SetFault(NULL);
+    CHECK(sim.Exec(&regs, &out, &repComplete) == HV_STATUS_SUCCESS);
+    return TRUE;
+}
+
+static double
+RunBatches (
+    IN HcSimBackend                     &sim,
+    IN const std::vector<CPU_REG_64>    &cases
+)
+{
+    return BenchRun([&](UINT64 iters) {
+        HcBatchEncoder  batch(BENCH_BATCH_SIZE);
+        HcBatchResults  results(BENCH_BATCH_SIZE);
+        size_t          next = 0;
+
+        while (iters != 0)
+        {
+            batch.Reset();
+            for (; iters != 0 && !batch.IsFull(); iters--)
+            {
+                batch.Add(cases[next]);
+                next = next + 1 == cases.size() ? 0 : next + 1;
+            }
+            sim.ExecBatch(batch, results);
+            BenchDoNotOptimize(results[0].hvStatus);
+        }
+    });
+}
+
+int
+main ()
+{
+    HcFilter                filter;
+    CaseSpace               space(filter, 7);
+    std::vector<CPU_REG_64> cases;
+    FUZZ_CASE               fuzzCase;
+    HC_SIM_FAULT            fault = {};
+
+    if (!CheckControl() || !CheckPrivilege() || !CheckPartitions() || !CheckPorts() ||
+        !CheckVtls() || !CheckFaults())
+    {
+        return 1;
+    }
+    printf("[+] simulated hypervisor checks passed\n");
+
+    //
+    // Evenly spread over the case table, so every call code and generator
+    // is in the mix
+    //
+    for (UINT64 i = 0; i < BENCH_CASES; i++)
+    {
+        space.Materialize(i * (space.Count() / BENCH_CASES), &fuzzCase);
+        cases.push_back(fuzzCase.regs);
+    }
+
+    HcSimBackend direct;
+    double execRate = BenchRun([&](UINT64 iters) {
+        CPU_REG_64  out;
+        UINT16      repComplete = 0;
+        size_t      next = 0;
+
+        for (UINT64 i = 0; i < iters; i++)
+        {
+            HV_STATUS status = direct.Exec(&cases[next], &out, &repComplete);
+
+            BenchDoNotOptimize(status);
+            next = next + 1 == cases.size() ? 0 : next + 1;
+        }
+    });
+    BenchReport("sim/exec", execRate, "calls/s");
+
+    HcSimBackend plain;
+    double batchRate = RunBatches(plain, cases);
+    BenchReport("sim/batch", batchRate, "calls/s");
+
+    HcSimBackend stateful;
+    stateful.SetState(HC_SIM_STATE_ALL);
+    stateful.SetCaller(HC_SIM_CALLER_CHILD);
+    BenchReport("sim/batch state", RunBatches(stateful, cases), "calls/s");
+
+    HcSimBackend faulty;
+    fault.kind = HC_SIM_FAULT_STATUS;
+    fault.callcode = HC_SIM_FAULT_ANY_CALLCODE;
+    fault.oneIn = 1000;
+    fault.status = HV_STATUS_INSUFFICIENT_MEMORY;
+    faulty.SetFault(&fault);
+    BenchReport("sim/batch faults", RunBatches(faulty, cases), "calls/s");
+
+    if (batchRate < SIM_MIN_RATE)
+    {
+        printf("[-] sim/batch below %.0f calls/s\n", SIM_MIN_RATE);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,335 @@
+/*++
+
+Module Name:
+
+    BenchWorkerPool.cpp
+
+Abstract:
+
+    Checks the work-stealing worker pool and measures how fuzzing the case
+    space scales with the worker count, each worker with its own simulated
+    backend and batch buffers the way ViFuR3 gives each its own device handle.
+
+    Checks (exit non-zero on failure)
+        - owner pops and concurrent steals claim every deque item once
+        - every index of a seeded range runs exactly once, for 1 - 64 workers
+          and uneven chunks, and the merged counters agree
+        - idle workers steal from a slow one
+        - the case space fuzzed by 8 workers gets the same success and
+          effective counts as by 1
+
+    Benchmarks
+        workerpool/<n> threads          - cases/s with <n> workers
+        workerpool/<n> threads speedup  - against 1 worker
+
+    Usage: BenchWorkerPool [per-call latency in ns, default 1000]
+                           [max threads, default 64]
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include <string>
+#include <stdlib.h>
+#include "ViFuBench.h"
+#include "../ViFuCore/WorkerPool.h"
+#include "../ViFuCore/CaseSpace.h"
+#include "../ViFuCore/HcSimBackend.h"
+
+#define CHECK(cond)                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("[-] %s:%d check failed: %s\n", __FILE__, __LINE__, #cond);  \
+        return FALSE;                                                       \
+    }
+
+#define BENCH_BATCH_CASES   64
+#define DEQUE_ITEMS         200000
+#define DEQUE_THIEVES       3
+
+//
+// What each ViFuR3 worker holds besides its device handle
+//
+typedef struct _SIM_WORKER
+{
+    HcSimBackend    backend;
+    HcBatchEncoder  batch;
+    HcBatchResults  results;
+
+    _SIM_WORKER ()
+        : batch(BENCH_BATCH_CASES),
+          results(BENCH_BATCH_CASES)
+    {
+    }
+} SIM_WORKER;
+
+static VOID
+FlushSimBatch (
+    IN OUT SIM_WORKER       *pWorker,
+    IN OUT WorkerCounters   &counters
+)
+{
+    if (pWorker->batch.IsEmpty())
+    {
+        return;
+    }
+
+    if (pWorker->backend.ExecBatch(pWorker->batch, pWorker->results) != 0)
+    {
+        counters.Add(WORKER_COUNTER_ERRORS);
+    }
+
+    for (UINT32 c = 0; c < pWorker->results.Count(); c++)
+    {
+        HV_STATUS status = pWorker->results[c].hvStatus;
+
+        counters.Add(WORKER_COUNTER_SUCCESS, status == HV_STATUS_SUCCESS);
+        counters.Add(WORKER_COUNTER_EFFECTIVE, InputGenIsEffectiveStatus(status));
+    }
+    pWorker->batch.Reset();
+}
+
+//
+// Fuzz the cases of the space in [begin, end) on the pool, indices wrap past
+// the end of the space
+//
+static VOID
+FuzzSpace (
+    IN     const CaseSpace  &space,
+    IN OUT WorkerPool       &pool,
+    IN     UINT64           begin,
+    IN     UINT64           end,
+    IN     UINT32           latencyNs
+)
+{
+    std::vector<std::unique_ptr<SIM_WORKER>> simWorkers;
+
+    for (UINT32 w = 0; w < pool.Workers(); w++)
+    {
+        simWorkers.emplace_back(new SIM_WORKER);
+        simWorkers.back()->backend.SetLatency(latencyNs);
+    }
+
+    pool.Seed(begin, end, space.CasesPerCombo());
+    pool.Run([&](UINT32 w, UINT64 chunkBegin, UINT64 chunkEnd, WorkerCounters &counters) {
+        SIM_WORKER *pWorker = simWorkers[w].get();
+        FUZZ_CASE fuzzCase;
+
+        for (UINT64 i = chunkBegin; i < chunkEnd; i++)
+        {
+            space.Materialize(i % space.Count(), &fuzzCase);
+            pWorker->batch.Add(fuzzCase.regs);
+            counters.Add(WORKER_COUNTER_CASES);
+            if (pWorker->batch.IsFull())
+            {
+                FlushSimBatch(pWorker, counters);
+            }
+        }
+        FlushSimBatch(pWorker, counters);
+    });
+}
+
+static BOOL
+CheckDeque ()
+{
+    WorkStealDeque              deque;
+    std::vector<UINT64>         claimed[DEQUE_THIEVES + 1];
+    std::vector<UINT8>          seen(DEQUE_ITEMS);
+    std::vector<std::thread>    thieves;
+    std::atomic<bool>           go(false);
+
+    for (UINT64 i = 0; i < DEQUE_ITEMS; i++)
+    {
+        deque.Push(i);
+    }
+    CHECK(deque.Size() == DEQUE_ITEMS);
+
+    for (UINT32 t = 1; t <= DEQUE_THIEVES; t++)
+    {
+        thieves.emplace_back([&, t]() {
+            UINT64 item = 0;
+
+            while (!go)
+            {
+            }
+            while (deque.Steal(&item))
+            {
+                claimed[t].push_back(item);
+            }
+        });
+    }
+
+    UINT64 item = 0;
+
+    go = true;
+    while (deque.Pop(&item))
+    {
+        claimed[0].push_back(item);
+    }
+    for (auto &thief : thieves)
+    {
+        thief.join();
+    }
+
+    for (auto &items : claimed)
+    {
+        for (UINT64 i : items)
+        {
+            CHECK(seen[(SIZE_T)i]++ == 0);
+        }
+    }
+    for (UINT8 count : seen)
+    {
+        CHECK(count == 1);
+    }
+
+    //
+    // Owner order is front to back
+    //
+    for (SIZE_T i = 1; i < claimed[0].size(); i++)
+    {
+        CHECK(claimed[0][i] > claimed[0][i - 1]);
+    }
+
+    printf("[+] deque checks passed (owner %zu, thieves %zu %zu %zu)\n",
+           claimed[0].size(),
+           claimed[1].size(),
+           claimed[2].size(),
+           claimed[3].size());
+    return TRUE;
+}
+
+static BOOL
+CheckCoverage ()
+{
+    for (UINT32 workers : { 1u, 2u, 3u, 8u, 64u })
+    {
+        for (UINT64 chunk : { 1ULL, 7ULL, 265ULL })
+        {
+            WorkerPool pool(workers);
+            UINT64 begin = 1000;
+            UINT64 end = begin + 5000 + workers;
+            std::vector<std::atomic<UINT32>> hits((SIZE_T)(end - begin));
+
+            for (auto &hit : hits)
+            {
+                hit = 0;
+            }
+
+            pool.Seed(begin, end, chunk);
+            pool.Run([&](UINT32, UINT64 chunkBegin, UINT64 chunkEnd, WorkerCounters &counters) {
+                for (UINT64 i = chunkBegin; i < chunkEnd; i++)
+                {
+                    hits[(SIZE_T)(i - begin)]++;
+                }
+                counters.Add(WORKER_COUNTER_CASES, chunkEnd - chunkBegin);
+            });
+
+            for (auto &hit : hits)
+            {
+                CHECK(hit == 1);
+            }
+            CHECK(pool.Total(WORKER_COUNTER_CASES) == end - begin);
+            CHECK(pool.Total(WORKER_COUNTER_CHUNKS) == (end - begin + chunk - 1) / chunk);
+        }
+    }
+
+    //
+    // Worker 0's chunks are slow, the rest should take them over
+    //
+    WorkerPool pool(4);
+    std::atomic<UINT64> ran(0);
+
+    pool.Seed(0, 64, 1);
+    pool.Run([&](UINT32 w, UINT64, UINT64, WorkerCounters &) {
+        if (w == 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        ran++;
+    });
+    CHECK(ran == 64);
+    CHECK(pool.Total(WORKER_COUNTER_STEALS) > 0);
+    CHECK(pool.Counters(0).Get(WORKER_COUNTER_CHUNKS) < 16);
+
+    printf("[+] pool coverage checks passed (%llu chunks stolen from the slow worker)\n",
+           (unsigned long long)pool.Total(WORKER_COUNTER_STEALS));
+    return TRUE;
+}
+
+static BOOL
+CheckFuzz ()
+{
+    HcFilter    filter;
+    CaseSpace   space(filter, 5);
+    WorkerPool  single(1);
+    WorkerPool  pool(8);
+    UINT64      success = 0;
+    UINT64      effective = 0;
+
+    FuzzSpace(space, single, 0, space.Count(), 0);
+    success = single.Total(WORKER_COUNTER_SUCCESS);
+    effective = single.Total(WORKER_COUNTER_EFFECTIVE);
+    CHECK(single.Total(WORKER_COUNTER_CASES) == space.Count());
+    CHECK(success != 0 && effective >= success);
+
+    FuzzSpace(space, pool, 0, space.Count(), 0);
+    CHECK(pool.Total(WORKER_COUNTER_CASES) == space.Count());
+    CHECK(pool.Total(WORKER_COUNTER_SUCCESS) == success);
+    CHECK(pool.Total(WORKER_COUNTER_EFFECTIVE) == effective);
+    CHECK(pool.Total(WORKER_COUNTER_ERRORS) == 0);
+
+    printf("[+] pool fuzz checks passed (%llu cases, %llu effective)\n",
+           (unsigned long long)space.Count(),
+           (unsigned long long)effective);
+    return TRUE;
+}
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    UINT32 latencyNs = 1000;
+    UINT32 maxThreads = 64;
+
+    if (argc > 1)
+    {
+        latencyNs = (UINT32)atoi(argv[1]);
+    }
+    if (argc > 2)
+    {
+        maxThreads = (UINT32)atoi(argv[2]);
+    }
+
+    if (!CheckDeque() || !CheckCoverage() || !CheckFuzz())
+    {
+        return 1;
+    }
+
+    HcFilter filter;
+    CaseSpace space(filter, 6);
+    double base = 0;
+
+    printf("[ ] %u processors, %u ns per call\n", WorkerPoolProcessorCount(), latencyNs);
+    for (UINT32 threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        std::string name = "workerpool/" + std::to_string(threads) + " threads";
+        WorkerPool pool(threads);
+        double rate = BenchRun([&](UINT64 iters) {
+            FuzzSpace(space, pool, 0, iters, latencyNs);
+        }, 0.3);
+
+        if (threads == 1)
+        {
+            base = rate;
+        }
+        BenchReport(name.c_str(), rate, "cases/s");
+        BenchReport((name + " speedup").c_str(), rate / base, "x");
+    }
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+#
+# Runs the ViFuBench suite and gathers every measurement into one JSON
+# document, laid out like Google Benchmark's --benchmark_format=json: a
+# context object and a benchmarks array, one entry per measurement.
+#
+#   cmake -DBENCH_DIR=<executables> -DBENCHES=<a,b,...> -DSCRATCH=<dir>
+#         -DOUTPUT=<json> [-DFILTER=<regex>] [-DBUILD_TYPE=<config>]
+#         -P RunBenchSuite.cmake
+#
+# Benchmarks that take sizes get ones that finish in seconds, so the suite
+# is cheap enough to run on every change. A benchmark whose checks fail is
+# listed under "failed" and fails the run, after the document is written.
+#
+
+cmake_minimum_required(VERSION 3.13)
+
+foreach(var BENCH_DIR BENCHES SCRATCH OUTPUT)
+    if(NOT DEFINED ${var})
+        message(FATAL_ERROR "RunBenchSuite: ${var} not set")
+    endif()
+endforeach()
+
+string(REPLACE "," ";" BENCHES "${BENCHES}")
+
+set(ARGS_BenchAsyncLog       "${SCRATCH}")
+set(ARGS_BenchCollector      "${SCRATCH}" 8 1)
+set(ARGS_BenchCoordinator    "${SCRATCH}" 8)
+set(ARGS_BenchCorpus         "${SCRATCH}" 100000 4)
+set(ARGS_BenchHypercallTable "${SCRATCH}")
+set(ARGS_BenchJournal        "${SCRATCH}" 0.25)
+set(ARGS_BenchMetrics        "${SCRATCH}")
+set(ARGS_BenchNovelty        "${SCRATCH}")
+set(ARGS_BenchReplay         "${SCRATCH}" 20000)
+set(ARGS_BenchWorkerPool     1000 8)
+
+file(MAKE_DIRECTORY "${SCRATCH}")
+
+set(entries "")
+set(failed "")
+
+foreach(bench ${BENCHES})
+    if(FILTER AND NOT bench MATCHES "${FILTER}")
+        continue()
+    endif()
+
+    set(records "${SCRATCH}/${bench}.jsonl")
+    file(REMOVE "${records}")
+    set(ENV{VIFU_BENCH_JSON} "${records}")
+
+    message(STATUS "${bench} ${ARGS_${bench}}")
+    execute_process(
+        COMMAND "${BENCH_DIR}/${bench}${CMAKE_EXECUTABLE_SUFFIX}" ${ARGS_${bench}}
+        WORKING_DIRECTORY "${SCRATCH}"
+        RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(WARNING "${bench} failed: ${result}")
+        list(APPEND failed "\"${bench}\"")
+    endif()
+
+    if(EXISTS "${records}")
+        file(STRINGS "${records}" lines)
+        foreach(line ${lines})
+            string(REGEX REPLACE "^{" "{\"bench\":\"${bench}\"," entry "${line}")
+            list(APPEND entries "    ${entry}")
+        endforeach()
+    endif()
+endforeach()
+
+string(TIMESTAMP date "%Y-%m-%dT%H:%M:%SZ" UTC)
+cmake_host_system_information(RESULT host QUERY HOSTNAME)
+cmake_host_system_information(RESULT cpus QUERY NUMBER_OF_LOGICAL_CORES)
+cmake_host_system_information(RESULT os QUERY OS_NAME)
+cmake_host_system_information(RESULT release QUERY OS_RELEASE)
+
+#
+# Entries may hold semicolons only inside their names, which have none
+#
+string(REPLACE ";" ",\n" benchmarks "${entries}")
+string(REPLACE ";" ", " failures "${failed}")
+
+file(WRITE "${OUTPUT}"
+"{
+  \"context\": {
+    \"date\": \"${date}\",
+    \"host_name\": \"${host}\",
+    \"num_cpus\": ${cpus},
+    \"system\": \"${os} ${release}\",
+    \"build_type\": \"${BUILD_TYPE}\"
+  },
+  \"failed\": [${failures}],
+  \"benchmarks\": [
+${benchmarks}
+  ]
+}
+")
+
+list(LENGTH entries count)
+message(STATUS "${count} measurements in ${OUTPUT}")
+if(failed)
+    message(FATAL_ERROR "Failed: ${failures}")
+endif()
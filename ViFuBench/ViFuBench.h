@@ -0,0 +1,138 @@
+/*++
+
+Module Name:
+
+    ViFuBench.h
+
+Abstract:
+
+    Tiny timing harness shared by the ViFuBench microbenchmarks. Each
+    benchmark is a plain executable that prints one line per measurement.
+
+    With VIFU_BENCH_JSON set to a file name, each measurement is also
+    appended to it as a JSON object on a line of its own, which the suite
+    runner (RunBenchSuite.cmake) gathers into one result document for
+    regression tracking.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "../ViFuCore/ViFuPlatform.h"
+
+//
+// Keep the compiler from discarding a value computed only for timing
+//
+template <typename T>
+inline VOID
+BenchDoNotOptimize (
+    IN const T  &value
+)
+{
+#if defined(__GNUC__)
+    __asm__ __volatile__("" : : "r,m"(value) : "memory");
+#else
+    static volatile const VOID *s_sink;
+    s_sink = &value;
+#endif
+}
+
+class BenchTimer
+{
+public:
+    BenchTimer () { Reset(); }
+
+    VOID Reset () { m_start = std::chrono::steady_clock::now(); }
+
+    double
+    Seconds () const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+//
+// Calls fn(iters) with a growing iteration count until a run takes at least
+// minSeconds. fn must perform `iters` units of work. Returns units/sec
+//
+template <typename FN>
+inline double
+BenchRun (
+    IN FN       fn,
+    IN double   minSeconds = 0.5
+)
+{
+    UINT64 iters = 1;
+
+    for (;;)
+    {
+        BenchTimer timer;
+        fn(iters);
+        double secs = timer.Seconds();
+
+        if (secs >= minSeconds || iters >= (1ULL << 40))
+        {
+            return (double)iters / secs;
+        }
+
+        //
+        // Aim a little past minSeconds based on the last run
+        //
+        UINT64 next = secs > 0 ? (UINT64)((double)iters * minSeconds * 1.4 / secs) : iters * 100;
+        iters = next > iters * 100 ? iters * 100 : (next > iters ? next : iters * 2);
+    }
+}
+
+//
+// Append the measurement to $VIFU_BENCH_JSON, if set. Names and units are
+// plain text, only quotes and backslashes need escaping
+//
+inline VOID
+BenchRecord (
+    IN const CHAR   *name,
+    IN double       value,
+    IN const CHAR   *unit
+)
+{
+    const CHAR  *path = getenv("VIFU_BENCH_JSON");
+    FILE        *pFile = NULL;
+
+    if (path == NULL || *path == '\0' || (pFile = fopen(path, "a")) == NULL)
+    {
+        return;
+    }
+
+    fputs("{\"name\":\"", pFile);
+    for (const CHAR *p = name; *p != '\0'; p++)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            fputc('\\', pFile);
+        }
+        fputc(*p, pFile);
+    }
+    fprintf(pFile, "\",\"value\":%.9g,\"unit\":\"%s\"}\n", value, unit);
+    fclose(pFile);
+}
+
+inline VOID
+BenchReport (
+    IN const CHAR   *name,
+    IN double       value,
+    IN const CHAR   *unit
+)
+{
+    printf("%-48s %16.2f %s\n", name, value, unit);
+    fflush(stdout);
+    BenchRecord(name, value, unit);
+}
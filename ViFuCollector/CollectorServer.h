@@ -0,0 +1,809 @@
+/*++
+
+Module Name:
+
+    CollectorServer.h
+
+Abstract:
+
+    Host side log collector, the replacement for the SMB share. Guests connect
+    over TCP (or AF_VSOCK where the host has it) and stream framed records,
+    see ViFuCore/CollectorProtocol.h.
+
+    One thread runs an epoll loop over every guest connection. Each
+    connection has its own receive buffer, parsed frames are appended to
+    <dir>/<guest id>/VIFU_LOG.txt and fuzz_journal.bin as they arrive. At the
+    end of every loop iteration the files written to in that iteration are
+    fdatasync'd once (group commit across frames and guests) and each of those
+    guests is sent one ACK for the last frame now durable. ACKs are cumulative,
+    so a guest that isn't reading gets only the latest one when its socket
+    drains.
+
+    The journal is opened with FuzzJournalFile, which cuts off a torn tail
+    left by a collector crash, and every incoming journal record has to
+    continue it (sequence, campaign, checksum).
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(__linux__)
+#include <linux/vm_sockets.h>
+#endif
+#include "../ViFuCore/CollectorProtocol.h"
+
+typedef enum _COLLECTOR_SYNC
+{
+    COLLECTOR_SYNC_NONE = 0,            // Ack once written to the page cache
+    COLLECTOR_SYNC_DATA                 // Ack once fdatasync'd
+} COLLECTOR_SYNC;
+
+typedef struct _COLLECTOR_CONFIG
+{
+    const CHAR      *pDir;              // Root of the per guest directories
+    const CHAR      *pBindAddr;         // IPv4 address to listen on
+    UINT16          port;               // 0 picks a free port, see Port()
+    UINT32          vsockPort;          // 0 for no AF_VSOCK listener
+    COLLECTOR_SYNC  sync;
+} COLLECTOR_CONFIG, *PCOLLECTOR_CONFIG;
+
+typedef struct _COLLECTOR_STATS
+{
+    UINT64  connections;
+    UINT64  activeGuests;
+    UINT64  frames;
+    UINT64  bytes;
+    UINT64  journalRecords;
+    UINT64  syncs;              // fdatasync calls
+    UINT64  groupCommits;       // Loop iterations that made something durable
+    UINT64  acks;
+    UINT64  rejected;           // Connections dropped with an ERROR frame
+} COLLECTOR_STATS, *PCOLLECTOR_STATS;
+
+#define COLLECTOR_READ_CHUNK    (256 * 1024)
+
+class CollectorServer
+{
+public:
+    CollectorServer ()
+        : m_epoll(-1),
+          m_listen(-1),
+          m_vsock(-1),
+          m_wake(-1),
+          m_port(0),
+          m_stop(false)
+    {
+        memset(&m_config, 0, sizeof(m_config));
+        ResetStats();
+    }
+
+    ~CollectorServer ()
+    {
+        for (auto &conn : m_conns)
+        {
+            CloseConnection(conn.second.get());
+        }
+        m_conns.clear();
+        CloseFd(m_listen);
+        CloseFd(m_vsock);
+        CloseFd(m_wake);
+        CloseFd(m_epoll);
+    }
+
+    BOOL
+    Start (
+        IN const COLLECTOR_CONFIG   &config
+    )
+    {
+        struct sockaddr_in  addr = {};
+        socklen_t           addrLen = sizeof(addr);
+        INT                 one = 1;
+
+        m_config = config;
+        m_dir = config.pDir != NULL ? config.pDir : ".";
+        mkdir(m_dir.c_str(), 0755);
+
+        m_epoll = epoll_create1(EPOLL_CLOEXEC);
+        m_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        m_listen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_epoll < 0 || m_wake < 0 || m_listen < 0)
+        {
+            return FALSE;
+        }
+
+        setsockopt(m_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(config.port);
+        if (inet_pton(AF_INET, config.pBindAddr != NULL ? config.pBindAddr : "0.0.0.0", &addr.sin_addr) != 1 ||
+            bind(m_listen, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(m_listen, 128) != 0 ||
+            getsockname(m_listen, (struct sockaddr *)&addr, &addrLen) != 0)
+        {
+            return FALSE;
+        }
+        m_port = ntohs(addr.sin_port);
+
+        if (config.vsockPort != 0 && !ListenVsock(config.vsockPort))
+        {
+            return FALSE;
+        }
+
+        return Watch(m_listen, EPOLLIN) && Watch(m_wake, EPOLLIN) &&
+               (m_vsock < 0 || Watch(m_vsock, EPOLLIN));
+    }
+
+    UINT16 Port () const { return m_port; }
+
+    //
+    // Serve until Stop(). Safe to call Stop() from another thread or a
+    // signal handler
+    //
+    VOID
+    Run ()
+    {
+        struct epoll_event events[64];
+
+        while (!m_stop)
+        {
+            INT n = epoll_wait(m_epoll, events, _ARRAYSIZE(events), -1);
+
+            if (n < 0 && errno != EINTR)
+            {
+                break;
+            }
+
+            for (INT e = 0; e < n; e++)
+            {
+                INT fd = events[e].data.fd;
+
+                if (fd == m_listen || fd == m_vsock)
+                {
+                    Accept(fd);
+                    continue;
+                }
+                if (fd == m_wake)
+                {
+                    continue;
+                }
+
+                auto it = m_conns.find(fd);
+                if (it == m_conns.end())
+                {
+                    continue;
+                }
+
+                Connection *pConn = it->second.get();
+
+                if (events[e].events & EPOLLIN)
+                {
+                    Receive(pConn);
+                }
+                if (!pConn->closing && (events[e].events & EPOLLOUT))
+                {
+                    Flush(pConn);
+                }
+                if (!pConn->closing && (events[e].events & (EPOLLHUP | EPOLLERR)))
+                {
+                    pConn->closing = true;
+                }
+            }
+
+            Commit();
+            Reap();
+        }
+    }
+
+    VOID
+    Stop ()
+    {
+        UINT64 one = 1;
+
+        m_stop = true;
+        if (write(m_wake, &one, sizeof(one)) < 0)
+        {
+            // Already signalled
+        }
+    }
+
+    VOID
+    GetStats (
+        OUT PCOLLECTOR_STATS    pStats
+    ) const
+    {
+        pStats->connections = m_connections;
+        pStats->activeGuests = m_activeGuests;
+        pStats->frames = m_frames;
+        pStats->bytes = m_bytes;
+        pStats->journalRecords = m_journalRecords;
+        pStats->syncs = m_syncs;
+        pStats->groupCommits = m_groupCommits;
+        pStats->acks = m_acks;
+        pStats->rejected = m_rejected;
+    }
+
+private:
+    struct Connection
+    {
+        Connection ()
+            : fd(-1), inUsed(0), outSent(0), hello(false), closing(false),
+              logFd(-1), journalFd(-1), journalNext(0), recvSeq(0), durableSeq(0),
+              ackedSeq(0), logDirty(false), journalDirty(false), wantWrite(false)
+        {
+        }
+
+        INT                 fd;
+        std::vector<CHAR>   in;
+        SIZE_T              inUsed;
+        std::vector<CHAR>   out;
+        SIZE_T              outSent;
+        bool                hello;
+        bool                closing;
+        std::string         guestId;
+        INT                 logFd;
+        INT                 journalFd;
+        FuzzJournalFile     journal;
+        UINT64              journalNext;
+        UINT64              recvSeq;
+        UINT64              durableSeq;
+        UINT64              ackedSeq;
+        bool                logDirty;
+        bool                journalDirty;
+        bool                wantWrite;
+    };
+
+    static VOID
+    CloseFd (
+        IN OUT INT  &fd
+    )
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    static BOOL
+    WriteAll (
+        IN INT          fd,
+        IN const CHAR   *p,
+        IN SIZE_T       len
+    )
+    {
+        while (len != 0)
+        {
+            ssize_t n = write(fd, p, len);
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return FALSE;
+            }
+            p += n;
+            len -= (SIZE_T)n;
+        }
+        return TRUE;
+    }
+
+    VOID
+    ResetStats ()
+    {
+        m_connections = 0;
+        m_activeGuests = 0;
+        m_frames = 0;
+        m_bytes = 0;
+        m_journalRecords = 0;
+        m_syncs = 0;
+        m_groupCommits = 0;
+        m_acks = 0;
+        m_rejected = 0;
+    }
+
+    BOOL
+    Watch (
+        IN INT      fd,
+        IN UINT32   events
+    )
+    {
+        struct epoll_event ev = {};
+
+        ev.events = events;
+        ev.data.fd = fd;
+        return epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+
+    BOOL
+    ListenVsock (
+        IN UINT32   port
+    )
+    {
+#if defined(AF_VSOCK)
+        struct sockaddr_vm addr = {};
+
+        m_vsock = socket(AF_VSOCK, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_vsock < 0)
+        {
+            return FALSE;
+        }
+        addr.svm_family = AF_VSOCK;
+        addr.svm_cid = VMADDR_CID_ANY;
+        addr.svm_port = port;
+        return bind(m_vsock, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(m_vsock, 128) == 0;
+#else
+        (VOID)port;
+        return FALSE;
+#endif
+    }
+
+    VOID
+    Accept (
+        IN INT  listenFd
+    )
+    {
+        for (;;)
+        {
+            INT fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            INT one = 1;
+
+            if (fd < 0)
+            {
+                return;
+            }
+
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (!Watch(fd, EPOLLIN | EPOLLRDHUP))
+            {
+                close(fd);
+                continue;
+            }
+
+            std::unique_ptr<Connection> pConn(new Connection());
+            pConn->fd = fd;
+            pConn->in.resize(sizeof(COLLECTOR_FRAME_HEADER) + COLLECTOR_READ_CHUNK);
+            m_conns[fd] = std::move(pConn);
+            m_connections++;
+        }
+    }
+
+    //
+    // Drain the socket into the connection's buffer and handle every whole
+    // frame in it
+    //
+    VOID
+    Receive (
+        IN Connection   *pConn
+    )
+    {
+        for (;;)
+        {
+            if (pConn->in.size() - pConn->inUsed < COLLECTOR_READ_CHUNK / 4)
+            {
+                pConn->in.resize(pConn->in.size() * 2);
+            }
+
+            ssize_t n = read(pConn->fd, pConn->in.data() + pConn->inUsed, pConn->in.size() - pConn->inUsed);
+
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            {
+                pConn->closing = true;
+                break;
+            }
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+
+            pConn->inUsed += (SIZE_T)n;
+            m_bytes += (UINT64)n;
+            if (!ParseFrames(pConn))
+            {
+                break;
+            }
+        }
+    }
+
+    BOOL
+    ParseFrames (
+        IN Connection   *pConn
+    )
+    {
+        SIZE_T offset = 0;
+
+        while (pConn->inUsed - offset >= sizeof(COLLECTOR_FRAME_HEADER))
+        {
+            COLLECTOR_FRAME_HEADER header;
+
+            memcpy(&header, pConn->in.data() + offset, sizeof(header));
+            if (header.magic != COLLECTOR_FRAME_MAGIC || header.length > COLLECTOR_MAX_PAYLOAD)
+            {
+                Reject(pConn, COLLECTOR_STATUS_BAD_FRAME);
+                return FALSE;
+            }
+
+            if (pConn->inUsed - offset < sizeof(header) + header.length)
+            {
+                //
+                // Make room for the rest of a big frame
+                //
+                if (pConn->in.size() < sizeof(header) + header.length)
+                {
+                    pConn->in.resize(sizeof(header) + header.length + COLLECTOR_READ_CHUNK);
+                }
+                break;
+            }
+
+            COLLECTOR_STATUS status = HandleFrame(pConn, header, pConn->in.data() + offset + sizeof(header));
+            if (status != COLLECTOR_STATUS_OK)
+            {
+                Reject(pConn, status);
+                return FALSE;
+            }
+            offset += sizeof(header) + header.length;
+            m_frames++;
+        }
+
+        if (offset != 0)
+        {
+            memmove(pConn->in.data(), pConn->in.data() + offset, pConn->inUsed - offset);
+            pConn->inUsed -= offset;
+        }
+        return TRUE;
+    }
+
+    COLLECTOR_STATUS
+    HandleFrame (
+        IN Connection                   *pConn,
+        IN const COLLECTOR_FRAME_HEADER &header,
+        IN const CHAR                   *pPayload
+    )
+    {
+        if (!pConn->hello)
+        {
+            if (header.type != COLLECTOR_FRAME_HELLO || header.length != sizeof(COLLECTOR_HELLO))
+            {
+                return COLLECTOR_STATUS_BAD_FRAME;
+            }
+            return HandleHello(pConn, (const COLLECTOR_HELLO *)pPayload);
+        }
+
+        if (header.type != COLLECTOR_FRAME_RECORDS ||
+            header.sequence != pConn->recvSeq + 1 ||
+            header.stream >= COLLECTOR_STREAM_MAX)
+        {
+            return COLLECTOR_STATUS_BAD_FRAME;
+        }
+
+        if (header.stream == COLLECTOR_STREAM_LOG)
+        {
+            if (!WriteAll(pConn->logFd, pPayload, header.length))
+            {
+                return COLLECTOR_STATUS_IO_ERROR;
+            }
+            pConn->logDirty = true;
+        }
+        else
+        {
+            UINT32 cnt = header.length / FUZZ_JOURNAL_RECORD_SIZE;
+
+            if (header.length % FUZZ_JOURNAL_RECORD_SIZE != 0)
+            {
+                return COLLECTOR_STATUS_BAD_JOURNAL;
+            }
+
+            for (UINT32 r = 0; r < cnt; r++)
+            {
+                FUZZ_JOURNAL_RECORD record;
+
+                memcpy(&record, pPayload + r * FUZZ_JOURNAL_RECORD_SIZE, sizeof(record));
+                if (!FuzzJournalCheckRecord(&record, pConn->journalNext + r, pConn->journal.CampaignId()))
+                {
+                    return COLLECTOR_STATUS_BAD_JOURNAL;
+                }
+            }
+
+            if (!WriteAll(pConn->journalFd, pPayload, header.length))
+            {
+                return COLLECTOR_STATUS_IO_ERROR;
+            }
+            pConn->journalNext += cnt;
+            pConn->journalDirty = true;
+            m_journalRecords += cnt;
+        }
+
+        pConn->recvSeq = header.sequence;
+        return COLLECTOR_STATUS_OK;
+    }
+
+    COLLECTOR_STATUS
+    HandleHello (
+        IN Connection               *pConn,
+        IN const COLLECTOR_HELLO    *pHello
+    )
+    {
+        COLLECTOR_HELLO_ACK     ack = {};
+        COLLECTOR_FRAME_HEADER  header;
+        CHAR                    guestId[COLLECTOR_GUEST_ID_LEN];
+        struct stat             st;
+
+        memcpy(guestId, pHello->guestId, sizeof(guestId));
+        guestId[sizeof(guestId) - 1] = '\0';
+
+        if (pHello->version != COLLECTOR_VERSION)
+        {
+            return COLLECTOR_STATUS_BAD_FRAME;
+        }
+        if (!CollectorIsValidGuestId(guestId))
+        {
+            return COLLECTOR_STATUS_BAD_GUEST_ID;
+        }
+        if (m_guests.find(guestId) != m_guests.end())
+        {
+            return COLLECTOR_STATUS_GUEST_BUSY;
+        }
+
+        std::string dir = m_dir + "/" + guestId;
+        mkdir(dir.c_str(), 0755);
+
+        pConn->logFd = open((dir + "/VIFU_LOG.txt").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        pConn->journalFd = open((dir + "/fuzz_journal.bin").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (pConn->logFd < 0 || pConn->journalFd < 0 ||
+            !pConn->journal.Attach(pConn->journalFd, pHello->campaignId))
+        {
+            return COLLECTOR_STATUS_IO_ERROR;
+        }
+
+        pConn->hello = true;
+        pConn->guestId = guestId;
+        pConn->journalNext = pConn->journal.Count();
+        m_guests[pConn->guestId] = pConn;
+        m_activeGuests++;
+
+        ack.version = COLLECTOR_VERSION;
+        ack.campaignId = pConn->journal.CampaignId();
+        ack.journalCount = pConn->journal.Count();
+        ack.logBytes = fstat(pConn->logFd, &st) == 0 ? (UINT64)st.st_size : 0;
+        pConn->journal.FindResume(&ack.resume);
+        if (access((m_dir + "/autoStart.txt").c_str(), F_OK) == 0)
+        {
+            ack.flags |= COLLECTOR_HELLO_FLAG_AUTO_START;
+        }
+
+        CollectorInitFrame(&header, COLLECTOR_FRAME_HELLO_ACK, sizeof(ack));
+        Queue(pConn, &header, &ack, sizeof(ack));
+        Flush(pConn);
+        return COLLECTOR_STATUS_OK;
+    }
+
+    //
+    // Tell the guest why and drop it once that is sent (or can't be)
+    //
+    VOID
+    Reject (
+        IN Connection       *pConn,
+        IN COLLECTOR_STATUS status
+    )
+    {
+        COLLECTOR_FRAME_HEADER header;
+
+        CollectorInitFrame(&header, COLLECTOR_FRAME_ERROR, 0);
+        header.status = status;
+        Queue(pConn, &header, NULL, 0);
+        Flush(pConn);
+        pConn->closing = true;
+        m_rejected++;
+    }
+
+    VOID
+    Queue (
+        IN Connection                   *pConn,
+        IN const COLLECTOR_FRAME_HEADER *pHeader,
+        IN const VOID                   *pPayload,
+        IN UINT32                       len
+    )
+    {
+        const CHAR *pH = (const CHAR *)pHeader;
+        const CHAR *pP = (const CHAR *)pPayload;
+
+        pConn->out.insert(pConn->out.end(), pH, pH + sizeof(COLLECTOR_FRAME_HEADER));
+        if (len != 0)
+        {
+            pConn->out.insert(pConn->out.end(), pP, pP + len);
+        }
+    }
+
+    //
+    // Send what is queued, and the latest ACK once nothing else is pending
+    //
+    VOID
+    Flush (
+        IN Connection   *pConn
+    )
+    {
+        for (;;)
+        {
+            if (pConn->outSent == pConn->out.size())
+            {
+                pConn->out.clear();
+                pConn->outSent = 0;
+
+                if (pConn->closing || pConn->ackedSeq == pConn->durableSeq)
+                {
+                    break;
+                }
+
+                COLLECTOR_FRAME_HEADER header;
+
+                CollectorInitFrame(&header, COLLECTOR_FRAME_ACK, 0);
+                header.sequence = pConn->durableSeq;
+                Queue(pConn, &header, NULL, 0);
+                pConn->ackedSeq = pConn->durableSeq;
+                m_acks++;
+            }
+
+            ssize_t n = send(pConn->fd,
+                             pConn->out.data() + pConn->outSent,
+                             pConn->out.size() - pConn->outSent,
+                             MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                SetWantWrite(pConn, true);
+                return;
+            }
+            if (n <= 0)
+            {
+                pConn->closing = true;
+                return;
+            }
+            pConn->outSent += (SIZE_T)n;
+        }
+
+        SetWantWrite(pConn, false);
+    }
+
+    VOID
+    SetWantWrite (
+        IN Connection   *pConn,
+        IN bool         want
+    )
+    {
+        struct epoll_event ev = {};
+
+        if (pConn->wantWrite == want)
+        {
+            return;
+        }
+        ev.events = EPOLLIN | EPOLLRDHUP | (want ? (UINT32)EPOLLOUT : 0);
+        ev.data.fd = pConn->fd;
+        epoll_ctl(m_epoll, EPOLL_CTL_MOD, pConn->fd, &ev);
+        pConn->wantWrite = want;
+    }
+
+    //
+    // Group commit: one fdatasync per file written this iteration, then ACK
+    //
+    VOID
+    Commit ()
+    {
+        BOOL committed = FALSE;
+
+        for (auto &it : m_conns)
+        {
+            Connection *pConn = it.second.get();
+
+            if (pConn->durableSeq == pConn->recvSeq)
+            {
+                continue;
+            }
+
+            if (m_config.sync == COLLECTOR_SYNC_DATA)
+            {
+                if ((pConn->logDirty && fdatasync(pConn->logFd) != 0) ||
+                    (pConn->journalDirty && fdatasync(pConn->journalFd) != 0))
+                {
+                    Reject(pConn, COLLECTOR_STATUS_IO_ERROR);
+                    continue;
+                }
+                m_syncs += (pConn->logDirty ? 1 : 0) + (pConn->journalDirty ? 1 : 0);
+            }
+
+            pConn->logDirty = false;
+            pConn->journalDirty = false;
+            pConn->durableSeq = pConn->recvSeq;
+            committed = TRUE;
+
+            if (!pConn->closing)
+            {
+                Flush(pConn);
+            }
+        }
+
+        if (committed)
+        {
+            m_groupCommits++;
+        }
+    }
+
+    VOID
+    CloseConnection (
+        IN Connection   *pConn
+    )
+    {
+        if (pConn->hello)
+        {
+            m_guests.erase(pConn->guestId);
+            m_activeGuests--;
+        }
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, pConn->fd, NULL);
+        CloseFd(pConn->fd);
+        CloseFd(pConn->logFd);
+        CloseFd(pConn->journalFd);
+    }
+
+    VOID
+    Reap ()
+    {
+        for (auto it = m_conns.begin(); it != m_conns.end();)
+        {
+            if (it->second->closing)
+            {
+                CloseConnection(it->second.get());
+                it = m_conns.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    COLLECTOR_CONFIG                                m_config;
+    std::string                                     m_dir;
+    INT                                             m_epoll;
+    INT                                             m_listen;
+    INT                                             m_vsock;
+    INT                                             m_wake;
+    UINT16                                          m_port;
+    std::atomic<bool>                               m_stop;
+    std::map<INT, std::unique_ptr<Connection>>      m_conns;
+    std::map<std::string, Connection *>             m_guests;
+
+    std::atomic<UINT64>                             m_connections;
+    std::atomic<UINT64>                             m_activeGuests;
+    std::atomic<UINT64>                             m_frames;
+    std::atomic<UINT64>                             m_bytes;
+    std::atomic<UINT64>                             m_journalRecords;
+    std::atomic<UINT64>                             m_syncs;
+    std::atomic<UINT64>                             m_groupCommits;
+    std::atomic<UINT64>                             m_acks;
+    std::atomic<UINT64>                             m_rejected;
+};
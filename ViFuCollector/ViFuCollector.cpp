@@ -0,0 +1,134 @@
+/*++
+
+Module Name:
+
+    ViFuCollector.cpp
+
+Abstract:
+
+    Host log collector daemon. Guests' ViFuR3 stream VIFU_LOG.txt and
+    fuzz_journal.bin to it instead of writing them to an SMB share.
+
+    Usage: ViFuCollector [-d dir] [-b bind address] [-p port] [-v vsock port]
+                         [-s data|none]
+
+        -d  directory holding one subdirectory per guest, and autoStart.txt
+            (default .)
+        -b  IPv4 address to listen on (default 0.0.0.0)
+        -p  TCP port (default COLLECTOR_DEFAULT_PORT)
+        -v  also listen on this AF_VSOCK port
+        -s  data: ack after fdatasync (default), none: ack once written
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include "CollectorServer.h"
+
+static CollectorServer g_server;
+
+static VOID
+OnSignal (
+    IN int  sig
+)
+{
+    (VOID)sig;
+    g_server.Stop();
+}
+
+static VOID
+Usage (
+    IN const CHAR   *name
+)
+{
+    fprintf(stderr,
+            "Usage: %s [-d dir] [-b bind address] [-p port] [-v vsock port] [-s data|none]\n",
+            name);
+    exit(2);
+}
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    COLLECTOR_CONFIG    config = {};
+    COLLECTOR_STATS     stats = {};
+    INT                 opt = 0;
+
+    config.pDir = ".";
+    config.pBindAddr = "0.0.0.0";
+    config.port = COLLECTOR_DEFAULT_PORT;
+    config.sync = COLLECTOR_SYNC_DATA;
+
+    while ((opt = getopt(argc, argv, "d:b:p:v:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            config.pDir = optarg;
+            break;
+        case 'b':
+            config.pBindAddr = optarg;
+            break;
+        case 'p':
+            config.port = (UINT16)atoi(optarg);
+            break;
+        case 'v':
+            config.vsockPort = (UINT32)atoi(optarg);
+            break;
+        case 's':
+            if (strcmp(optarg, "data") == 0)
+            {
+                config.sync = COLLECTOR_SYNC_DATA;
+            }
+            else if (strcmp(optarg, "none") == 0)
+            {
+                config.sync = COLLECTOR_SYNC_NONE;
+            }
+            else
+            {
+                Usage(argv[0]);
+            }
+            break;
+        default:
+            Usage(argv[0]);
+        }
+    }
+
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!g_server.Start(config))
+    {
+        fprintf(stderr, "[-] ERR listening on %s:%u\n", config.pBindAddr, config.port);
+        return 1;
+    }
+
+    printf("[+] Collecting into %s on %s:%u%s\n",
+           config.pDir,
+           config.pBindAddr,
+           g_server.Port(),
+           config.vsockPort != 0 ? " and vsock" : "");
+    fflush(stdout);
+
+    g_server.Run();
+
+    g_server.GetStats(&stats);
+    printf("[+] %llu connections, %llu frames, %llu bytes, %llu journal records, %llu syncs in %llu group commits, %llu rejected\n",
+           (unsigned long long)stats.connections,
+           (unsigned long long)stats.frames,
+           (unsigned long long)stats.bytes,
+           (unsigned long long)stats.journalRecords,
+           (unsigned long long)stats.syncs,
+           (unsigned long long)stats.groupCommits,
+           (unsigned long long)stats.rejected);
+    return 0;
+}
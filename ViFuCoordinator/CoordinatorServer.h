@@ -0,0 +1,1168 @@
+/*++
+
+Module Name:
+
+    CoordinatorServer.h
+
+Abstract:
+
+    Campaign coordinator, see ViFuCore/CoordinatorProtocol.h. Splits one
+    campaign's case space between a fleet of guests by leasing them ranges
+    of it, and merges what they report.
+
+    One thread runs an epoll loop over every guest connection, the same
+    shape as CollectorServer. The loop also wakes every half heartbeat to
+    take back leases whose guest went quiet.
+
+    Ranges are handed out in order from the start of the space, ranges
+    given back come first. A lease taken back (timeout, disconnect or the
+    guest saying hello again) is split along the guest's last report:
+    [begin, low) is done, [low, high) was in flight when the guest died and
+    is recorded in <dir>/crash_windows.txt but never leased again, so a
+    crashing case can't take down the next guest too, and [high, end) is
+    given back. Ends are rounded out to combo boundaries.
+
+    The campaign's totals (HV status counts, merged novelty, per guest
+    counts) are kept as they arrive; Save() writes campaign.txt and
+    novelty.bin.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../ViFuCore/CoordinatorProtocol.h"
+#include "../ViFuCore/InputGenerator.h"
+
+typedef struct _COORD_CONFIG
+{
+    const CHAR  *pDir;                  // crash_windows.txt, campaign.txt, novelty.bin and autoStart.txt
+    const CHAR  *pBindAddr;             // IPv4 address to listen on
+    UINT16      port;                   // 0 picks a free port, see Port()
+    UINT64      campaignId;             // 0 for a fresh one
+    UINT32      leaseCombos;            // Combos (CaseSpace::CasesPerCombo cases) per lease
+    UINT32      heartbeatMs;
+    UINT32      leaseTimeoutMs;
+} COORD_CONFIG, *PCOORD_CONFIG;
+
+typedef struct _COORD_STATS
+{
+    UINT64  connections;
+    UINT64  activeGuests;
+    UINT64  frames;
+    UINT64  leases;             // Granted
+    UINT64  leasesDone;
+    UINT64  heartbeats;
+    UINT64  timeouts;           // Leases taken back for a missed heartbeat
+    UINT64  disconnects;        // ... because their guest disconnected
+    UINT64  restarts;           // ... because their guest said hello again
+    UINT64  crashWindows;
+    UINT64  rejected;           // Connections dropped with an ERROR frame
+} COORD_STATS, *PCOORD_STATS;
+
+typedef enum _COORD_TAKEBACK
+{
+    COORD_TAKEBACK_TIMEOUT = 0,
+    COORD_TAKEBACK_DISCONNECT,
+    COORD_TAKEBACK_RESTART
+} COORD_TAKEBACK;
+
+//
+// Cases in flight on a guest when its lease was taken back
+//
+typedef struct _COORD_CRASH_WINDOW
+{
+    std::string     guestId;
+    UINT64          leaseId;
+    UINT64          low;
+    UINT64          high;
+    COORD_TAKEBACK  reason;
+} COORD_CRASH_WINDOW;
+
+typedef struct _COORD_GUEST_STATS
+{
+    UINT64  cases;
+    UINT64  success;
+    UINT64  effective;
+    UINT64  errors;
+    UINT64  novel;              // Entries new to the campaign
+    UINT64  leases;
+    UINT64  crashWindows;
+} COORD_GUEST_STATS, *PCOORD_GUEST_STATS;
+
+#define COORD_READ_CHUNK            (64 * 1024)
+#define COORD_DEFAULT_LEASE_COMBOS  16
+#define COORD_DEFAULT_HEARTBEAT_MS  1000
+#define COORD_DEFAULT_TIMEOUT_MS    10000
+
+class CoordinatorServer
+{
+public:
+    CoordinatorServer ()
+        : m_epoll(-1),
+          m_listen(-1),
+          m_wake(-1),
+          m_port(0),
+          m_stop(false),
+          m_caseCount(0),
+          m_casesPerCombo(0),
+          m_next(0),
+          m_nextLeaseId(1),
+          m_windowsFile(NULL),
+          m_errors(0)
+    {
+        memset(&m_config, 0, sizeof(m_config));
+        memset(m_statusCounts, 0, sizeof(m_statusCounts));
+        ResetStats();
+    }
+
+    ~CoordinatorServer ()
+    {
+        for (auto &conn : m_conns)
+        {
+            CloseFd(conn.second->fd);
+        }
+        m_conns.clear();
+        CloseFd(m_listen);
+        CloseFd(m_wake);
+        CloseFd(m_epoll);
+        if (m_windowsFile != NULL)
+        {
+            fclose(m_windowsFile);
+        }
+    }
+
+    BOOL
+    Start (
+        IN const COORD_CONFIG   &config
+    )
+    {
+        struct sockaddr_in  addr = {};
+        socklen_t           addrLen = sizeof(addr);
+        INT                 one = 1;
+
+        m_config = config;
+        m_dir = config.pDir != NULL ? config.pDir : ".";
+        mkdir(m_dir.c_str(), 0755);
+
+        if (m_config.campaignId == 0)
+        {
+            m_config.campaignId = ((UINT64)time(NULL) << 32) ^ ((UINT64)getpid() << 12) ^ (UINT64)clock();
+        }
+        if (m_config.leaseCombos == 0)
+        {
+            m_config.leaseCombos = COORD_DEFAULT_LEASE_COMBOS;
+        }
+        if (m_config.heartbeatMs == 0)
+        {
+            m_config.heartbeatMs = COORD_DEFAULT_HEARTBEAT_MS;
+        }
+        if (m_config.leaseTimeoutMs == 0)
+        {
+            m_config.leaseTimeoutMs = COORD_DEFAULT_TIMEOUT_MS;
+        }
+
+        m_windowsFile = fopen((m_dir + "/crash_windows.txt").c_str(), "a");
+        m_epoll = epoll_create1(EPOLL_CLOEXEC);
+        m_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        m_listen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_windowsFile == NULL || m_epoll < 0 || m_wake < 0 || m_listen < 0)
+        {
+            return FALSE;
+        }
+
+        setsockopt(m_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(config.port);
+        if (inet_pton(AF_INET, config.pBindAddr != NULL ? config.pBindAddr : "0.0.0.0", &addr.sin_addr) != 1 ||
+            bind(m_listen, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(m_listen, 128) != 0 ||
+            getsockname(m_listen, (struct sockaddr *)&addr, &addrLen) != 0)
+        {
+            return FALSE;
+        }
+        m_port = ntohs(addr.sin_port);
+
+        return Watch(m_listen, EPOLLIN) && Watch(m_wake, EPOLLIN);
+    }
+
+    UINT16 Port () const { return m_port; }
+    UINT64 CampaignId () const { return m_config.campaignId; }
+
+    //
+    // Serve until Stop(). Safe to call Stop() from another thread or a
+    // signal handler
+    //
+    VOID
+    Run ()
+    {
+        struct epoll_event events[64];
+        INT timeoutMs = m_config.heartbeatMs / 2 != 0 ? (INT)(m_config.heartbeatMs / 2) : 1;
+
+        while (!m_stop)
+        {
+            INT n = epoll_wait(m_epoll, events, _ARRAYSIZE(events), timeoutMs);
+
+            if (n < 0 && errno != EINTR)
+            {
+                break;
+            }
+
+            for (INT e = 0; e < n; e++)
+            {
+                INT fd = events[e].data.fd;
+
+                if (fd == m_listen)
+                {
+                    Accept();
+                    continue;
+                }
+                if (fd == m_wake)
+                {
+                    continue;
+                }
+
+                auto it = m_conns.find(fd);
+                if (it == m_conns.end())
+                {
+                    continue;
+                }
+
+                Connection *pConn = it->second.get();
+
+                //
+                // Superseded by a hello earlier in this iteration
+                //
+                if (pConn->closing)
+                {
+                    continue;
+                }
+                if (events[e].events & EPOLLIN)
+                {
+                    Receive(pConn);
+                }
+                if (!pConn->closing && (events[e].events & EPOLLOUT))
+                {
+                    Flush(pConn);
+                }
+                if (!pConn->closing && (events[e].events & (EPOLLHUP | EPOLLERR)))
+                {
+                    pConn->closing = true;
+                }
+            }
+
+            Expire();
+            Reap();
+        }
+    }
+
+    VOID
+    Stop ()
+    {
+        UINT64 one = 1;
+
+        m_stop = true;
+        if (write(m_wake, &one, sizeof(one)) < 0)
+        {
+            // Already signalled
+        }
+    }
+
+    //
+    // TRUE once every case of the space is done or quarantined
+    //
+    BOOL
+    IsDone ()
+    {
+        std::lock_guard<std::mutex> lock(m_resultsLock);
+        return m_casesPerCombo != 0 && m_next == m_caseCount && m_free.empty() && m_leases.empty();
+    }
+
+    VOID
+    GetStats (
+        OUT PCOORD_STATS    pStats
+    ) const
+    {
+        pStats->connections = m_connections;
+        pStats->activeGuests = m_activeGuests;
+        pStats->frames = m_frames;
+        pStats->leases = m_leasesGranted;
+        pStats->leasesDone = m_leasesDone;
+        pStats->heartbeats = m_heartbeats;
+        pStats->timeouts = m_timeouts;
+        pStats->disconnects = m_disconnects;
+        pStats->restarts = m_restarts;
+        pStats->crashWindows = m_crashWindows;
+        pStats->rejected = m_rejected;
+    }
+
+    //
+    // Merged results. Safe to call while Run() is going
+    //
+    VOID
+    GetStatusCounts (
+        OUT UINT64  (&statusCounts)[COORD_STATUS_SLOTS],
+        OUT UINT64  *pErrors
+    )
+    {
+        std::lock_guard<std::mutex> lock(m_resultsLock);
+        memcpy(statusCounts, m_statusCounts, sizeof(m_statusCounts));
+        *pErrors = m_errors;
+    }
+
+    SIZE_T
+    NoveltyCount ()
+    {
+        std::lock_guard<std::mutex> lock(m_resultsLock);
+        return m_novelty.Count();
+    }
+
+    std::vector<COORD_CRASH_WINDOW>
+    CrashWindows ()
+    {
+        std::lock_guard<std::mutex> lock(m_resultsLock);
+        return m_windows;
+    }
+
+    BOOL
+    GetGuestStats (
+        IN  const CHAR          *guestId,
+        OUT PCOORD_GUEST_STATS  pStats
+    )
+    {
+        std::lock_guard<std::mutex> lock(m_resultsLock);
+        auto it = m_guestStats.find(guestId);
+
+        if (it == m_guestStats.end())
+        {
+            return FALSE;
+        }
+        *pStats = it->second;
+        return TRUE;
+    }
+
+    //
+    // Write <dir>/campaign.txt and <dir>/novelty.bin
+    //
+    BOOL
+    Save ()
+    {
+        std::lock_guard<std::mutex> lock(m_resultsLock);
+        FILE *pFile = fopen((m_dir + "/campaign.txt").c_str(), "w");
+        UINT64 cases = 0;
+
+        if (pFile == NULL)
+        {
+            return FALSE;
+        }
+
+        for (UINT64 count : m_statusCounts)
+        {
+            cases += count;
+        }
+
+        fprintf(pFile, "campaign %016llx\n", (unsigned long long)m_config.campaignId);
+        fprintf(pFile, "cases %llu of %llu, next %llu, %zu ranges free, %zu leased\n",
+                (unsigned long long)cases,
+                (unsigned long long)m_caseCount,
+                (unsigned long long)m_next,
+                m_free.size(),
+                m_leases.size());
+        fprintf(pFile, "errors %llu, novel %zu, crash windows %zu\n",
+                (unsigned long long)m_errors,
+                m_novelty.Count(),
+                m_windows.size());
+        for (UINT32 s = 0; s < COORD_STATUS_SLOTS; s++)
+        {
+            if (m_statusCounts[s] != 0)
+            {
+                fprintf(pFile, "status 0x%x%s %llu\n",
+                        s,
+                        s == COORD_STATUS_SLOTS - 1 ? "+" : "",
+                        (unsigned long long)m_statusCounts[s]);
+            }
+        }
+        for (const auto &guest : m_guestStats)
+        {
+            fprintf(pFile, "guest %s cases %llu success %llu effective %llu errors %llu novel %llu leases %llu windows %llu\n",
+                    guest.first.c_str(),
+                    (unsigned long long)guest.second.cases,
+                    (unsigned long long)guest.second.success,
+                    (unsigned long long)guest.second.effective,
+                    (unsigned long long)guest.second.errors,
+                    (unsigned long long)guest.second.novel,
+                    (unsigned long long)guest.second.leases,
+                    (unsigned long long)guest.second.crashWindows);
+        }
+
+        BOOL bOk = fclose(pFile) == 0;
+
+        return m_novelty.Save((m_dir + "/novelty.bin").c_str()) && bOk;
+    }
+
+private:
+    struct Lease
+    {
+        UINT64      id;
+        INT         fd;
+        std::string guestId;
+        UINT64      begin;
+        UINT64      end;
+        UINT64      low;
+        UINT64      high;
+        UINT64      deadline;       // NowMs() past which it is taken back
+    };
+
+    struct Connection
+    {
+        Connection ()
+            : fd(-1), inUsed(0), outSent(0), hello(false), closing(false),
+              leaseId(0), wantWrite(false)
+        {
+        }
+
+        INT                 fd;
+        std::vector<CHAR>   in;
+        SIZE_T              inUsed;
+        std::vector<CHAR>   out;
+        SIZE_T              outSent;
+        bool                hello;
+        bool                closing;
+        std::string         guestId;
+        UINT64              leaseId;        // 0 for none
+        bool                wantWrite;
+    };
+
+    static UINT64
+    NowMs ()
+    {
+        return (UINT64)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static VOID
+    CloseFd (
+        IN OUT INT  &fd
+    )
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    VOID
+    ResetStats ()
+    {
+        m_connections = 0;
+        m_activeGuests = 0;
+        m_frames = 0;
+        m_leasesGranted = 0;
+        m_leasesDone = 0;
+        m_heartbeats = 0;
+        m_timeouts = 0;
+        m_disconnects = 0;
+        m_restarts = 0;
+        m_crashWindows = 0;
+        m_rejected = 0;
+    }
+
+    BOOL
+    Watch (
+        IN INT      fd,
+        IN UINT32   events
+    )
+    {
+        struct epoll_event ev = {};
+
+        ev.events = events;
+        ev.data.fd = fd;
+        return epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+
+    VOID
+    Accept ()
+    {
+        for (;;)
+        {
+            INT fd = accept4(m_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            INT one = 1;
+
+            if (fd < 0)
+            {
+                return;
+            }
+
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (!Watch(fd, EPOLLIN | EPOLLRDHUP))
+            {
+                close(fd);
+                continue;
+            }
+
+            std::unique_ptr<Connection> pConn(new Connection());
+            pConn->fd = fd;
+            pConn->in.resize(sizeof(COORD_FRAME_HEADER) + COORD_READ_CHUNK);
+            m_conns[fd] = std::move(pConn);
+            m_connections++;
+        }
+    }
+
+    //
+    // Drain the socket into the connection's buffer and handle every whole
+    // frame in it
+    //
+    VOID
+    Receive (
+        IN Connection   *pConn
+    )
+    {
+        for (;;)
+        {
+            if (pConn->in.size() - pConn->inUsed < COORD_READ_CHUNK / 4)
+            {
+                pConn->in.resize(pConn->in.size() * 2);
+            }
+
+            ssize_t n = read(pConn->fd, pConn->in.data() + pConn->inUsed, pConn->in.size() - pConn->inUsed);
+
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            {
+                pConn->closing = true;
+                break;
+            }
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+
+            pConn->inUsed += (SIZE_T)n;
+            if (!ParseFrames(pConn))
+            {
+                break;
+            }
+        }
+    }
+
+    BOOL
+    ParseFrames (
+        IN Connection   *pConn
+    )
+    {
+        SIZE_T offset = 0;
+
+        while (pConn->inUsed - offset >= sizeof(COORD_FRAME_HEADER))
+        {
+            COORD_FRAME_HEADER header;
+
+            memcpy(&header, pConn->in.data() + offset, sizeof(header));
+            if (header.magic != COORD_FRAME_MAGIC || header.length > COORD_MAX_PAYLOAD)
+            {
+                Reject(pConn, COORD_STATUS_BAD_FRAME);
+                return FALSE;
+            }
+
+            if (pConn->inUsed - offset < sizeof(header) + header.length)
+            {
+                //
+                // Make room for the rest of a big frame
+                //
+                if (pConn->in.size() < sizeof(header) + header.length)
+                {
+                    pConn->in.resize(sizeof(header) + header.length + COORD_READ_CHUNK);
+                }
+                break;
+            }
+
+            COORD_STATUS status = HandleFrame(pConn, header, pConn->in.data() + offset + sizeof(header));
+            if (status != COORD_STATUS_OK)
+            {
+                Reject(pConn, status);
+                return FALSE;
+            }
+            offset += sizeof(header) + header.length;
+            m_frames++;
+        }
+
+        if (offset != 0)
+        {
+            memmove(pConn->in.data(), pConn->in.data() + offset, pConn->inUsed - offset);
+            pConn->inUsed -= offset;
+        }
+        return TRUE;
+    }
+
+    COORD_STATUS
+    HandleFrame (
+        IN Connection               *pConn,
+        IN const COORD_FRAME_HEADER &header,
+        IN const CHAR               *pPayload
+    )
+    {
+        if (!pConn->hello)
+        {
+            if (header.type != COORD_FRAME_HELLO || header.length != sizeof(COORD_HELLO))
+            {
+                return COORD_STATUS_BAD_FRAME;
+            }
+            return HandleHello(pConn, (const COORD_HELLO *)pPayload);
+        }
+
+        if (header.type != COORD_FRAME_LEASE_REQUEST && header.type != COORD_FRAME_HEARTBEAT)
+        {
+            return COORD_STATUS_BAD_FRAME;
+        }
+
+        COORD_REPORT report;
+
+        if (header.length < sizeof(report))
+        {
+            return COORD_STATUS_BAD_FRAME;
+        }
+        memcpy(&report, pPayload, sizeof(report));
+        if (header.length != sizeof(report) + (UINT64)report.novelCnt * sizeof(NOVELTY_ENTRY))
+        {
+            return COORD_STATUS_BAD_FRAME;
+        }
+
+        std::lock_guard<std::mutex> lock(m_resultsLock);
+
+        if (m_casesPerCombo == 0)
+        {
+            if (report.caseCount == 0 || report.casesPerCombo == 0 ||
+                report.caseCount % report.casesPerCombo != 0)
+            {
+                return COORD_STATUS_SPACE_MISMATCH;
+            }
+            m_caseCount = report.caseCount;
+            m_casesPerCombo = report.casesPerCombo;
+        }
+        else if (report.caseCount != m_caseCount || report.casesPerCombo != m_casesPerCombo)
+        {
+            return COORD_STATUS_SPACE_MISMATCH;
+        }
+
+        Merge(pConn, report, (const NOVELTY_ENTRY *)(pPayload + sizeof(report)));
+
+        return header.type == COORD_FRAME_LEASE_REQUEST ? HandleLeaseRequest(pConn, report)
+                                                        : HandleHeartbeat(pConn, report);
+    }
+
+    COORD_STATUS
+    HandleHello (
+        IN Connection           *pConn,
+        IN const COORD_HELLO    *pHello
+    )
+    {
+        COORD_HELLO_ACK     ack = {};
+        COORD_FRAME_HEADER  header;
+        CHAR                guestId[COORD_GUEST_ID_LEN];
+
+        memcpy(guestId, pHello->guestId, sizeof(guestId));
+        guestId[sizeof(guestId) - 1] = '\0';
+
+        if (pHello->version != COORD_VERSION)
+        {
+            return COORD_STATUS_BAD_FRAME;
+        }
+        if (!CollectorIsValidGuestId(guestId))
+        {
+            return COORD_STATUS_BAD_GUEST_ID;
+        }
+
+        //
+        // The guest rebooted (most likely bugchecked) and its old connection
+        // hasn't timed out yet
+        //
+        auto it = m_guests.find(guestId);
+        if (it != m_guests.end())
+        {
+            Connection *pOld = it->second;
+            std::lock_guard<std::mutex> lock(m_resultsLock);
+
+            TakeBack(pOld, COORD_TAKEBACK_RESTART);
+            pOld->closing = true;
+            pOld->hello = false;
+            m_guests.erase(it);
+            m_activeGuests--;
+        }
+
+        pConn->hello = true;
+        pConn->guestId = guestId;
+        m_guests[pConn->guestId] = pConn;
+        m_activeGuests++;
+
+        ack.version = COORD_VERSION;
+        ack.campaignId = m_config.campaignId;
+        ack.heartbeatMs = m_config.heartbeatMs;
+        ack.leaseTimeoutMs = m_config.leaseTimeoutMs;
+        if (access((m_dir + "/autoStart.txt").c_str(), F_OK) == 0)
+        {
+            ack.flags |= COORD_HELLO_FLAG_AUTO_START;
+        }
+
+        CoordInitFrame(&header, COORD_FRAME_HELLO_ACK, sizeof(ack));
+        Queue(pConn, &header, &ack, sizeof(ack));
+        Flush(pConn);
+        return COORD_STATUS_OK;
+    }
+
+    //
+    // Add a report's results to the campaign's and the guest's totals
+    //
+    VOID
+    Merge (
+        IN Connection           *pConn,
+        IN const COORD_REPORT   &report,
+        IN const NOVELTY_ENTRY  *pNovel
+    )
+    {
+        COORD_GUEST_STATS &guest = m_guestStats[pConn->guestId];
+
+        for (UINT32 s = 0; s < COORD_STATUS_SLOTS; s++)
+        {
+            UINT64 count = report.statusCounts[s];
+
+            if (count == 0)
+            {
+                continue;
+            }
+            m_statusCounts[s] += count;
+            guest.cases += count;
+            guest.success += s == HV_STATUS_SUCCESS ? count : 0;
+            guest.effective += InputGenIsEffectiveStatus((HV_STATUS)s) ? count : 0;
+        }
+        m_errors += report.errors;
+        guest.errors += report.errors;
+
+        for (UINT32 i = 0; i < report.novelCnt; i++)
+        {
+            NOVELTY_ENTRY entry;
+
+            memcpy(&entry, &pNovel[i], sizeof(entry));
+            if (m_novelty.Insert(entry))
+            {
+                guest.novel++;
+            }
+        }
+    }
+
+    COORD_STATUS
+    HandleLeaseRequest (
+        IN Connection           *pConn,
+        IN const COORD_REPORT   &report
+    )
+    {
+        COORD_LEASE         grant = {};
+        COORD_FRAME_HEADER  header;
+
+        //
+        // Finish the lease the guest had. One taken back in the meantime is
+        // already accounted for
+        //
+        auto it = m_leases.find(report.leaseId);
+        if (report.leaseId != 0 && it != m_leases.end() && it->second.fd == pConn->fd)
+        {
+            Lease &lease = it->second;
+
+            if (report.low < lease.end)
+            {
+                Release(RoundDown(report.low < lease.begin ? lease.begin : report.low), lease.end);
+            }
+            m_leases.erase(it);
+            m_leasesDone++;
+        }
+        pConn->leaseId = 0;
+
+        if (Grant(pConn, &grant))
+        {
+            m_guestStats[pConn->guestId].leases++;
+        }
+        else if (m_next == m_caseCount && m_free.empty() && m_leases.empty())
+        {
+            grant.flags |= COORD_LEASE_FLAG_DONE;
+        }
+
+        CoordInitFrame(&header, COORD_FRAME_LEASE, sizeof(grant));
+        Queue(pConn, &header, &grant, sizeof(grant));
+        Flush(pConn);
+        return COORD_STATUS_OK;
+    }
+
+    COORD_STATUS
+    HandleHeartbeat (
+        IN Connection           *pConn,
+        IN const COORD_REPORT   &report
+    )
+    {
+        COORD_FRAME_HEADER header;
+
+        CoordInitFrame(&header, COORD_FRAME_HEARTBEAT_ACK, 0);
+        m_heartbeats++;
+
+        auto it = m_leases.find(report.leaseId);
+        if (it == m_leases.end() || it->second.fd != pConn->fd)
+        {
+            header.status = COORD_STATUS_LEASE_LOST;
+            if (pConn->leaseId == report.leaseId)
+            {
+                pConn->leaseId = 0;
+            }
+        }
+        else
+        {
+            Lease &lease = it->second;
+
+            lease.low = Clamp(report.low, lease.begin, lease.end);
+            lease.high = Clamp(report.high, lease.low, lease.end);
+            lease.deadline = NowMs() + m_config.leaseTimeoutMs;
+        }
+
+        Queue(pConn, &header, NULL, 0);
+        Flush(pConn);
+        return COORD_STATUS_OK;
+    }
+
+    //
+    // Next range for the guest, given back ranges first. FALSE if there is
+    // none right now
+    //
+    BOOL
+    Grant (
+        IN  Connection      *pConn,
+        OUT PCOORD_LEASE    pGrant
+    )
+    {
+        UINT64 leaseCases = (UINT64)m_config.leaseCombos * m_casesPerCombo;
+        Lease lease;
+
+        if (!m_free.empty())
+        {
+            lease.begin = m_free.front().first;
+            lease.end = m_free.front().second;
+            if (lease.end - lease.begin > leaseCases)
+            {
+                lease.end = lease.begin + leaseCases;
+                m_free.front().first = lease.end;
+            }
+            else
+            {
+                m_free.pop_front();
+            }
+        }
+        else if (m_next < m_caseCount)
+        {
+            lease.begin = m_next;
+            lease.end = m_caseCount - m_next > leaseCases ? m_next + leaseCases : m_caseCount;
+            m_next = lease.end;
+        }
+        else
+        {
+            return FALSE;
+        }
+
+        lease.id = m_nextLeaseId++;
+        lease.fd = pConn->fd;
+        lease.guestId = pConn->guestId;
+        lease.low = lease.begin;
+        lease.high = lease.begin;
+        lease.deadline = NowMs() + m_config.leaseTimeoutMs;
+        m_leases[lease.id] = lease;
+        pConn->leaseId = lease.id;
+        m_leasesGranted++;
+
+        pGrant->leaseId = lease.id;
+        pGrant->begin = lease.begin;
+        pGrant->end = lease.end;
+        return TRUE;
+    }
+
+    //
+    // Take the connection's lease away: quarantine what was in flight and
+    // give back what hadn't started. Called with m_resultsLock held
+    //
+    VOID
+    TakeBack (
+        IN Connection       *pConn,
+        IN COORD_TAKEBACK   reason
+    )
+    {
+        static const CHAR *s_reasons[] = { "timeout", "disconnect", "restart" };
+
+        auto it = m_leases.find(pConn->leaseId);
+        pConn->leaseId = 0;
+        if (it == m_leases.end())
+        {
+            return;
+        }
+
+        Lease lease = it->second;
+        UINT64 low = RoundDown(lease.low);
+        UINT64 high = RoundUp(lease.high) < lease.end ? RoundUp(lease.high) : lease.end;
+
+        m_leases.erase(it);
+        switch (reason)
+        {
+        case COORD_TAKEBACK_TIMEOUT:
+            m_timeouts++;
+            break;
+        case COORD_TAKEBACK_DISCONNECT:
+            m_disconnects++;
+            break;
+        default:
+            m_restarts++;
+            break;
+        }
+
+        if (low < high)
+        {
+            COORD_CRASH_WINDOW window = { lease.guestId, lease.id, low, high, reason };
+
+            m_windows.push_back(window);
+            m_guestStats[lease.guestId].crashWindows++;
+            m_crashWindows++;
+            fprintf(m_windowsFile, "%s lease %llu cases [%llu, %llu) %s\n",
+                    lease.guestId.c_str(),
+                    (unsigned long long)lease.id,
+                    (unsigned long long)low,
+                    (unsigned long long)high,
+                    s_reasons[reason]);
+            fflush(m_windowsFile);
+        }
+        Release(high, lease.end);
+    }
+
+    //
+    // Take back every lease whose guest missed its heartbeats
+    //
+    VOID
+    Expire ()
+    {
+        UINT64 now = NowMs();
+        std::lock_guard<std::mutex> lock(m_resultsLock);
+
+        for (auto &it : m_conns)
+        {
+            Connection *pConn = it.second.get();
+            auto lease = m_leases.find(pConn->leaseId);
+
+            if (pConn->leaseId != 0 && lease != m_leases.end() && lease->second.deadline < now)
+            {
+                TakeBack(pConn, COORD_TAKEBACK_TIMEOUT);
+            }
+        }
+    }
+
+    VOID
+    Release (
+        IN UINT64   begin,
+        IN UINT64   end
+    )
+    {
+        if (begin < end)
+        {
+            m_free.push_back(std::make_pair(begin, end));
+        }
+    }
+
+    UINT64 RoundDown (IN UINT64 i) const { return i - i % m_casesPerCombo; }
+    UINT64 RoundUp (IN UINT64 i) const { return RoundDown(i + m_casesPerCombo - 1); }
+
+    static UINT64
+    Clamp (
+        IN UINT64   i,
+        IN UINT64   lo,
+        IN UINT64   hi
+    )
+    {
+        return i < lo ? lo : (i > hi ? hi : i);
+    }
+
+    //
+    // Tell the guest why and drop it once that is sent (or can't be)
+    //
+    VOID
+    Reject (
+        IN Connection   *pConn,
+        IN COORD_STATUS status
+    )
+    {
+        COORD_FRAME_HEADER header;
+
+        CoordInitFrame(&header, COORD_FRAME_ERROR, 0);
+        header.status = status;
+        Queue(pConn, &header, NULL, 0);
+        Flush(pConn);
+        pConn->closing = true;
+        m_rejected++;
+    }
+
+    VOID
+    Queue (
+        IN Connection               *pConn,
+        IN const COORD_FRAME_HEADER *pHeader,
+        IN const VOID               *pPayload,
+        IN UINT32                   len
+    )
+    {
+        const CHAR *pH = (const CHAR *)pHeader;
+        const CHAR *pP = (const CHAR *)pPayload;
+
+        pConn->out.insert(pConn->out.end(), pH, pH + sizeof(COORD_FRAME_HEADER));
+        if (len != 0)
+        {
+            pConn->out.insert(pConn->out.end(), pP, pP + len);
+        }
+    }
+
+    VOID
+    Flush (
+        IN Connection   *pConn
+    )
+    {
+        while (pConn->outSent != pConn->out.size())
+        {
+            ssize_t n = send(pConn->fd,
+                             pConn->out.data() + pConn->outSent,
+                             pConn->out.size() - pConn->outSent,
+                             MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                SetWantWrite(pConn, true);
+                return;
+            }
+            if (n <= 0)
+            {
+                pConn->closing = true;
+                return;
+            }
+            pConn->outSent += (SIZE_T)n;
+        }
+
+        pConn->out.clear();
+        pConn->outSent = 0;
+        SetWantWrite(pConn, false);
+    }
+
+    VOID
+    SetWantWrite (
+        IN Connection   *pConn,
+        IN bool         want
+    )
+    {
+        struct epoll_event ev = {};
+
+        if (pConn->wantWrite == want)
+        {
+            return;
+        }
+        ev.events = EPOLLIN | EPOLLRDHUP | (want ? (UINT32)EPOLLOUT : 0);
+        ev.data.fd = pConn->fd;
+        epoll_ctl(m_epoll, EPOLL_CTL_MOD, pConn->fd, &ev);
+        pConn->wantWrite = want;
+    }
+
+    VOID
+    CloseConnection (
+        IN Connection   *pConn
+    )
+    {
+        if (pConn->hello)
+        {
+            std::lock_guard<std::mutex> lock(m_resultsLock);
+
+            TakeBack(pConn, COORD_TAKEBACK_DISCONNECT);
+            m_guests.erase(pConn->guestId);
+            m_activeGuests--;
+        }
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, pConn->fd, NULL);
+        CloseFd(pConn->fd);
+    }
+
+    VOID
+    Reap ()
+    {
+        for (auto it = m_conns.begin(); it != m_conns.end();)
+        {
+            if (it->second->closing)
+            {
+                CloseConnection(it->second.get());
+                it = m_conns.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    COORD_CONFIG                                    m_config;
+    std::string                                     m_dir;
+    INT                                             m_epoll;
+    INT                                             m_listen;
+    INT                                             m_wake;
+    UINT16                                          m_port;
+    std::atomic<bool>                               m_stop;
+    std::map<INT, std::unique_ptr<Connection>>      m_conns;
+    std::map<std::string, Connection *>             m_guests;
+
+    //
+    // Lease bookkeeping and merged results, read by other threads under
+    // m_resultsLock
+    //
+    std::mutex                                      m_resultsLock;
+    UINT64                                          m_caseCount;
+    UINT32                                          m_casesPerCombo;
+    UINT64                                          m_next;
+    std::deque<std::pair<UINT64, UINT64>>           m_free;
+    std::map<UINT64, Lease>                         m_leases;
+    UINT64                                          m_nextLeaseId;
+    std::vector<COORD_CRASH_WINDOW>                 m_windows;
+    FILE                                            *m_windowsFile;
+    UINT64                                          m_statusCounts[COORD_STATUS_SLOTS];
+    UINT64                                          m_errors;
+    NoveltyTracker                                  m_novelty;
+    std::map<std::string, COORD_GUEST_STATS>        m_guestStats;
+
+    std::atomic<UINT64>                             m_connections;
+    std::atomic<UINT64>                             m_activeGuests;
+    std::atomic<UINT64>                             m_frames;
+    std::atomic<UINT64>                             m_leasesGranted;
+    std::atomic<UINT64>                             m_leasesDone;
+    std::atomic<UINT64>                             m_heartbeats;
+    std::atomic<UINT64>                             m_timeouts;
+    std::atomic<UINT64>                             m_disconnects;
+    std::atomic<UINT64>                             m_restarts;
+    std::atomic<UINT64>                             m_crashWindows;
+    std::atomic<UINT64>                             m_rejected;
+};
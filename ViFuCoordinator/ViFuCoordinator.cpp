@@ -0,0 +1,180 @@
+/*++
+
+Module Name:
+
+    ViFuCoordinator.cpp
+
+Abstract:
+
+    Campaign coordinator daemon. Leases ranges of one campaign's case space
+    to a fleet of guests' ViFuR3, takes back the leases of guests that stop
+    heartbeating (usually because they bugchecked) and records what they had
+    in flight, and merges their status counts and novelty.
+
+    Usage: ViFuCoordinator [-d dir] [-b bind address] [-p port] [-c campaign id]
+                           [-l lease combos] [-h heartbeat ms] [-t lease timeout ms]
+
+        -d  directory for crash_windows.txt, campaign.txt, novelty.bin, and
+            autoStart.txt (default .)
+        -b  IPv4 address to listen on (default 0.0.0.0)
+        -p  TCP port (default COORD_DEFAULT_PORT)
+        -c  campaign id in hex, seeds every guest's case space (default fresh)
+        -l  combos per lease (default COORD_DEFAULT_LEASE_COMBOS)
+        -h  guest heartbeat interval (default COORD_DEFAULT_HEARTBEAT_MS)
+        -t  take a lease back after this long without a heartbeat
+            (default COORD_DEFAULT_TIMEOUT_MS)
+
+    Exits once every case is done or quarantined and every guest has gone,
+    or on SIGINT/SIGTERM, writing campaign.txt and novelty.bin.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <thread>
+#include "CoordinatorServer.h"
+
+static CoordinatorServer g_server;
+
+static VOID
+OnSignal (
+    IN int  sig
+)
+{
+    (VOID)sig;
+    g_server.Stop();
+}
+
+static VOID
+Usage (
+    IN const CHAR   *name
+)
+{
+    fprintf(stderr,
+            "Usage: %s [-d dir] [-b bind address] [-p port] [-c campaign id] [-l lease combos] [-h heartbeat ms] [-t lease timeout ms]\n",
+            name);
+    exit(2);
+}
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    COORD_CONFIG    config = {};
+    COORD_STATS     stats = {};
+    UINT64          statusCounts[COORD_STATUS_SLOTS];
+    UINT64          errors = 0;
+    UINT64          cases = 0;
+    INT             opt = 0;
+
+    config.pDir = ".";
+    config.pBindAddr = "0.0.0.0";
+    config.port = COORD_DEFAULT_PORT;
+
+    while ((opt = getopt(argc, argv, "d:b:p:c:l:h:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            config.pDir = optarg;
+            break;
+        case 'b':
+            config.pBindAddr = optarg;
+            break;
+        case 'p':
+            config.port = (UINT16)atoi(optarg);
+            break;
+        case 'c':
+            config.campaignId = strtoull(optarg, NULL, 16);
+            break;
+        case 'l':
+            config.leaseCombos = (UINT32)atoi(optarg);
+            break;
+        case 'h':
+            config.heartbeatMs = (UINT32)atoi(optarg);
+            break;
+        case 't':
+            config.leaseTimeoutMs = (UINT32)atoi(optarg);
+            break;
+        default:
+            Usage(argv[0]);
+        }
+    }
+
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!g_server.Start(config))
+    {
+        fprintf(stderr, "[-] ERR listening on %s:%u\n", config.pBindAddr, config.port);
+        return 1;
+    }
+
+    printf("[+] Coordinating campaign %016llx from %s on %s:%u\n",
+           (unsigned long long)g_server.CampaignId(),
+           config.pDir,
+           config.pBindAddr,
+           g_server.Port());
+    fflush(stdout);
+
+    //
+    // Stop once the space is covered and the last guest, told DONE, has gone
+    //
+    std::atomic<bool> bRunning(true);
+    std::thread watcher([&]() {
+        COORD_STATS current = {};
+
+        while (bRunning)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            g_server.GetStats(&current);
+            if (current.activeGuests == 0 && g_server.IsDone())
+            {
+                g_server.Stop();
+                break;
+            }
+        }
+    });
+
+    g_server.Run();
+    bRunning = false;
+    watcher.join();
+
+    if (!g_server.Save())
+    {
+        fprintf(stderr, "[-] ERR writing campaign.txt or novelty.bin in %s\n", config.pDir);
+    }
+
+    g_server.GetStats(&stats);
+    g_server.GetStatusCounts(statusCounts, &errors);
+    for (UINT64 count : statusCounts)
+    {
+        cases += count;
+    }
+
+    printf("[+] %llu cases, %llu HV_STATUS_SUCCESS, %zu novel, %llu errors\n",
+           (unsigned long long)cases,
+           (unsigned long long)statusCounts[HV_STATUS_SUCCESS],
+           g_server.NoveltyCount(),
+           (unsigned long long)errors);
+    printf("[+] %llu connections, %llu leases (%llu done), %llu heartbeats, %llu taken back (%llu timeout, %llu disconnect, %llu restart), %llu crash windows, %llu rejected\n",
+           (unsigned long long)stats.connections,
+           (unsigned long long)stats.leases,
+           (unsigned long long)stats.leasesDone,
+           (unsigned long long)stats.heartbeats,
+           (unsigned long long)(stats.timeouts + stats.disconnects + stats.restarts),
+           (unsigned long long)stats.timeouts,
+           (unsigned long long)stats.disconnects,
+           (unsigned long long)stats.restarts,
+           (unsigned long long)stats.crashWindows,
+           (unsigned long long)stats.rejected);
+    return 0;
+}
@@ -0,0 +1,873 @@
+/*++
+
+Module Name:
+
+    AsyncLog.h
+
+Abstract:
+
+    Asynchronous group-commit logger.
+
+    Records are formatted straight into a per-thread staging buffer, no lock
+    is shared between producers. A background flusher thread takes staged
+    buffers and writes them to the sink as one coalesced write when
+        - a staging buffer fills up (size)
+        - flushIntervalMs passes (time)
+        - a producer calls Barrier(), e.g. right before a risky hypercall
+    so many records share one write instead of each paying a round trip to
+    the share.
+
+    What Barrier() waits for is set by the durability level:
+        ASYNC_LOG_DURABILITY_NONE       nothing, it only wakes the flusher
+        ASYNC_LOG_DURABILITY_WRITTEN    every record logged before it has been
+                                        written to the sink (a write-through
+                                        handle makes that the server)
+        ASYNC_LOG_DURABILITY_SYNCED     as WRITTEN, plus the sink is synced
+                                        (FlushFileBuffers/fsync)
+    Records not yet past a barrier are lost if the process or the guest dies.
+
+    Producers only block if every buffer is queued for writing (counted as a
+    stall). Enqueue latency, write latency, barrier waits and queue depth are
+    available through GetStats().
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include "ViFuPlatform.h"
+#include "LatencyHistogram.h"
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+//
+// Where flushed records go
+//
+class AsyncLogSink
+{
+public:
+    virtual ~AsyncLogSink () {}
+
+    virtual BOOL Write (IN const VOID *pData, IN SIZE_T len) = 0;
+    virtual BOOL Sync () = 0;
+};
+
+//
+// Appends to an already open file handle/descriptor, which stays owned by the
+// caller
+//
+class AsyncLogFileSink : public AsyncLogSink
+{
+public:
+#if defined(_WIN32)
+    explicit AsyncLogFileSink (
+        IN HANDLE   hFile
+    )
+        : m_hFile(hFile)
+    {
+    }
+
+    virtual BOOL
+    Write (
+        IN const VOID   *pData,
+        IN SIZE_T       len
+    )
+    {
+        const CHAR  *p = (const CHAR *)pData;
+        DWORD       written = 0;
+
+        while (len != 0)
+        {
+            DWORD chunk = len > 0x40000000 ? 0x40000000 : (DWORD)len;
+
+            if (!WriteFile(m_hFile, p, chunk, &written, NULL) || written == 0)
+            {
+                return FALSE;
+            }
+            p += written;
+            len -= written;
+        }
+        return TRUE;
+    }
+
+    virtual BOOL
+    Sync ()
+    {
+        return FlushFileBuffers(m_hFile);
+    }
+
+private:
+    HANDLE  m_hFile;
+#else
+    explicit AsyncLogFileSink (
+        IN INT  fd
+    )
+        : m_fd(fd)
+    {
+    }
+
+    virtual BOOL
+    Write (
+        IN const VOID   *pData,
+        IN SIZE_T       len
+    )
+    {
+        const CHAR *p = (const CHAR *)pData;
+
+        while (len != 0)
+        {
+            ssize_t written = write(m_fd, p, len);
+
+            if (written <= 0)
+            {
+                return FALSE;
+            }
+            p += written;
+            len -= (SIZE_T)written;
+        }
+        return TRUE;
+    }
+
+    virtual BOOL
+    Sync ()
+    {
+        return fsync(m_fd) == 0;
+    }
+
+private:
+    INT     m_fd;
+#endif
+};
+
+typedef enum _ASYNC_LOG_DURABILITY
+{
+    ASYNC_LOG_DURABILITY_NONE = 0,
+    ASYNC_LOG_DURABILITY_WRITTEN,
+    ASYNC_LOG_DURABILITY_SYNCED
+} ASYNC_LOG_DURABILITY;
+
+typedef struct _ASYNC_LOG_CONFIG
+{
+    UINT32                  bufferSize;         // Bytes per staging buffer, also the longest record
+    UINT32                  bufferCount;        // Buffers shared by all producers, at least 2 per thread
+    UINT32                  flushIntervalMs;    // Longest a record sits staged without a barrier
+    ASYNC_LOG_DURABILITY    durability;
+    BOOL                    trackLatency;       // Time every enqueue
+} ASYNC_LOG_CONFIG, *PASYNC_LOG_CONFIG;
+
+#define ASYNC_LOG_DEFAULT_CONFIG    { 64 * 1024, 16, 50, ASYNC_LOG_DURABILITY_WRITTEN, TRUE }
+
+//
+// Latencies in ns, depths in bytes
+//
+typedef struct _ASYNC_LOG_STATS
+{
+    UINT64  recordsEnqueued;
+    UINT64  bytesEnqueued;
+    UINT64  bytesWritten;
+    UINT64  writes;             // Sink writes, each one coalesced flush
+    UINT64  writeErrors;
+    UINT64  syncs;
+    UINT64  barriers;
+    UINT64  stalls;             // Producer waits for a free buffer
+    UINT64  queueDepth;         // Enqueued, not yet written
+    UINT64  maxQueueDepth;
+    UINT64  enqueueP50;
+    UINT64  enqueueP99;
+    UINT64  enqueueMax;
+    UINT64  writeP50;
+    UINT64  writeP99;
+    UINT64  writeMax;
+    UINT64  barrierP99;
+    UINT64  barrierMax;
+} ASYNC_LOG_STATS, *PASYNC_LOG_STATS;
+
+class AsyncLog
+{
+public:
+    AsyncLog ()
+        : m_pSink(NULL),
+          m_id(0),
+          m_stop(false),
+          m_submitSeq(0),
+          m_writtenSeq(0),
+          m_bytesEnqueued(0),
+          m_bytesWritten(0),
+          m_recordsEnqueued(0),
+          m_maxQueueDepth(0),
+          m_writes(0),
+          m_writeErrors(0),
+          m_syncs(0),
+          m_barriers(0),
+          m_stalls(0)
+    {
+        ASYNC_LOG_CONFIG config = ASYNC_LOG_DEFAULT_CONFIG;
+        m_config = config;
+    }
+
+    ~AsyncLog ()
+    {
+        Close();
+    }
+
+    //
+    // Start the flusher. The sink must outlive Close(), a closed logger can be
+    // opened again
+    //
+    BOOL
+    Open (
+        IN AsyncLogSink             *pSink,
+        IN const ASYNC_LOG_CONFIG   &config
+    )
+    {
+        if (m_pSink != NULL || pSink == NULL || config.bufferSize < 256 || config.bufferCount < 2)
+        {
+            return FALSE;
+        }
+
+        m_config = config;
+        m_pSink = pSink;
+        m_id = NextId();
+        m_stop = false;
+
+        for (UINT32 b = 0; b < m_config.bufferCount; b++)
+        {
+            m_buffers.emplace_back(new LogBuffer(m_config.bufferSize));
+            m_free.push_back(m_buffers.back().get());
+        }
+
+        m_flusher = std::thread(&AsyncLog::FlusherThread, this);
+        return TRUE;
+    }
+
+    //
+    // Write out everything staged and stop the flusher
+    //
+    VOID
+    Close ()
+    {
+        if (m_pSink == NULL)
+        {
+            return;
+        }
+
+        Flush();
+
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_stop = true;
+        }
+        m_workCv.notify_all();
+        m_flusher.join();
+
+        //
+        // Keep the closed stages' enqueue latencies for GetStats
+        //
+        {
+            std::lock_guard<std::mutex> lock(m_stagesLock);
+            for (auto &pStage : m_stages)
+            {
+                m_closedEnqueueHist.Merge(pStage->enqueueHist);
+            }
+            m_stages.clear();
+        }
+
+        m_pSink = NULL;
+        m_free.clear();
+        m_full.clear();
+        m_buffers.clear();
+    }
+
+    BOOL IsOpen () const { return m_pSink != NULL; }
+
+    VOID
+    VPrintf (
+        IN const CHAR   *fmt,
+        IN va_list      args
+    )
+    {
+        std::chrono::steady_clock::time_point start;
+        LogStage    *pStage = GetStage();
+        SIZE_T      len = 0;
+
+        if (pStage == NULL)
+        {
+            return;
+        }
+
+        if (m_config.trackLatency)
+        {
+            start = std::chrono::steady_clock::now();
+        }
+
+        std::unique_lock<std::mutex> stageLock(pStage->lock);
+
+        for (;;)
+        {
+            if (pStage->pBuf == NULL && !RefillStage(pStage, stageLock))
+            {
+                return;
+            }
+
+            LogBuffer   *pBuf = pStage->pBuf;
+            SIZE_T      room = pBuf->data.size() - pBuf->used;
+            va_list     argsCopy;
+
+            va_copy(argsCopy, args);
+            INT n = vsnprintf(&pBuf->data[pBuf->used], room, fmt, argsCopy);
+            va_end(argsCopy);
+
+            if (n < 0)
+            {
+                return;
+            }
+
+            if ((SIZE_T)n < room)
+            {
+                len = (SIZE_T)n;
+                pBuf->used += len;
+                break;
+            }
+
+            if (pBuf->used == 0)
+            {
+                //
+                // Longer than a whole buffer, keep what fit
+                //
+                len = room - 1;
+                pBuf->used += len;
+                break;
+            }
+
+            Submit(pBuf);
+            pStage->pBuf = NULL;
+        }
+
+        RecordEnqueue(pStage, len, start);
+    }
+
+    VOID
+    Printf (
+        IN const CHAR   *fmt,
+        IN ...
+    )
+    {
+        va_list args;
+
+        va_start(args, fmt);
+        VPrintf(fmt, args);
+        va_end(args);
+    }
+
+    //
+    // Raw bytes, must be no longer than bufferSize
+    //
+    VOID
+    Write (
+        IN const VOID   *pData,
+        IN SIZE_T       len
+    )
+    {
+        std::chrono::steady_clock::time_point start;
+        LogStage *pStage = GetStage();
+
+        if (pStage == NULL || len > m_config.bufferSize)
+        {
+            return;
+        }
+
+        if (m_config.trackLatency)
+        {
+            start = std::chrono::steady_clock::now();
+        }
+
+        std::unique_lock<std::mutex> stageLock(pStage->lock);
+
+        for (;;)
+        {
+            if (pStage->pBuf == NULL && !RefillStage(pStage, stageLock))
+            {
+                return;
+            }
+
+            LogBuffer *pBuf = pStage->pBuf;
+
+            if (pBuf->data.size() - pBuf->used >= len)
+            {
+                memcpy(&pBuf->data[pBuf->used], pData, len);
+                pBuf->used += len;
+                break;
+            }
+
+            Submit(pBuf);
+            pStage->pBuf = NULL;
+        }
+
+        RecordEnqueue(pStage, len, start);
+    }
+
+    //
+    // Group commit point, see the durability levels above
+    //
+    VOID
+    Barrier ()
+    {
+        m_barriers++;
+        if (m_config.durability == ASYNC_LOG_DURABILITY_NONE)
+        {
+            SubmitStages();
+            m_workCv.notify_one();
+            return;
+        }
+
+        WaitWritten(m_config.durability == ASYNC_LOG_DURABILITY_SYNCED);
+    }
+
+    //
+    // Wait until everything logged so far has been written, whatever the
+    // durability level
+    //
+    VOID
+    Flush ()
+    {
+        WaitWritten(m_config.durability == ASYNC_LOG_DURABILITY_SYNCED);
+    }
+
+    VOID
+    GetStats (
+        OUT PASYNC_LOG_STATS    pStats
+    )
+    {
+        LatencyHistogram enqueue;
+
+        memset(pStats, 0, sizeof(ASYNC_LOG_STATS));
+
+        {
+            std::lock_guard<std::mutex> lock(m_stagesLock);
+            enqueue.Merge(m_closedEnqueueHist);
+            for (auto &pStage : m_stages)
+            {
+                std::lock_guard<std::mutex> stageLock(pStage->lock);
+                enqueue.Merge(pStage->enqueueHist);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            pStats->writeP50 = m_writeHist.Percentile(50);
+            pStats->writeP99 = m_writeHist.Percentile(99);
+            pStats->writeMax = m_writeHist.Max();
+            pStats->barrierP99 = m_barrierHist.Percentile(99);
+            pStats->barrierMax = m_barrierHist.Max();
+        }
+
+        pStats->recordsEnqueued = m_recordsEnqueued;
+        pStats->bytesEnqueued = m_bytesEnqueued;
+        pStats->bytesWritten = m_bytesWritten;
+        pStats->writes = m_writes;
+        pStats->writeErrors = m_writeErrors;
+        pStats->syncs = m_syncs;
+        pStats->barriers = m_barriers;
+        pStats->stalls = m_stalls;
+        pStats->queueDepth = pStats->bytesEnqueued - pStats->bytesWritten;
+        pStats->maxQueueDepth = m_maxQueueDepth;
+        pStats->enqueueP50 = enqueue.Percentile(50);
+        pStats->enqueueP99 = enqueue.Percentile(99);
+        pStats->enqueueMax = enqueue.Max();
+    }
+
+private:
+    struct LogBuffer
+    {
+        explicit LogBuffer (SIZE_T size) : data(size), used(0) {}
+
+        std::vector<CHAR>   data;
+        SIZE_T              used;
+    };
+
+    struct LogStage
+    {
+        LogStage () : pBuf(NULL) {}
+
+        std::mutex          lock;
+        LogBuffer           *pBuf;
+        LatencyHistogram    enqueueHist;
+    };
+
+    //
+    // Per-thread lookup of this logger's stage, keyed by an id that is never
+    // reused so stages freed by Close() or a dead logger at the same address
+    // are never picked up again
+    //
+    struct StageCacheEntry
+    {
+        UINT64      id;
+        LogStage    *pStage;
+    };
+
+    static UINT64
+    NextId ()
+    {
+        static std::atomic<UINT64> s_nextId(1);
+        return s_nextId++;
+    }
+
+    LogStage *
+    GetStage ()
+    {
+        static thread_local StageCacheEntry s_cache[8] = {};
+        static thread_local UINT32          s_next = 0;
+
+        if (m_pSink == NULL)
+        {
+            return NULL;
+        }
+
+        for (UINT32 e = 0; e < _ARRAYSIZE(s_cache); e++)
+        {
+            if (s_cache[e].id == m_id)
+            {
+                return s_cache[e].pStage;
+            }
+        }
+
+        LogStage *pStage = new LogStage();
+        {
+            std::lock_guard<std::mutex> lock(m_stagesLock);
+            m_stages.emplace_back(pStage);
+        }
+
+        s_cache[s_next].id = m_id;
+        s_cache[s_next].pStage = pStage;
+        s_next = (s_next + 1) % _ARRAYSIZE(s_cache);
+        return pStage;
+    }
+
+    //
+    // Get a free buffer for the stage. The stage lock is dropped while waiting
+    // so the flusher can still collect it
+    //
+    BOOL
+    RefillStage (
+        IN LogStage                     *pStage,
+        IN std::unique_lock<std::mutex> &stageLock
+    )
+    {
+        LogBuffer *pBuf = NULL;
+
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+
+            if (m_free.empty())
+            {
+                m_stalls++;
+                stageLock.unlock();
+                m_workCv.notify_one();
+                m_freeCv.wait(lock, [this]() { return !m_free.empty() || m_stop; });
+                if (m_stop)
+                {
+                    lock.unlock();
+                    stageLock.lock();
+                    return FALSE;
+                }
+                pBuf = m_free.back();
+                m_free.pop_back();
+                lock.unlock();
+                stageLock.lock();
+
+                if (pStage->pBuf != NULL)
+                {
+                    std::lock_guard<std::mutex> relock(m_lock);
+                    m_free.push_back(pBuf);
+                    return TRUE;
+                }
+            }
+            else
+            {
+                pBuf = m_free.back();
+                m_free.pop_back();
+            }
+        }
+
+        pBuf->used = 0;
+        pStage->pBuf = pBuf;
+        return TRUE;
+    }
+
+    VOID
+    RecordEnqueue (
+        IN LogStage                                     *pStage,
+        IN SIZE_T                                       len,
+        IN const std::chrono::steady_clock::time_point  &start
+    )
+    {
+        UINT64 enqueued = (m_bytesEnqueued += len);
+        UINT64 depth = enqueued - m_bytesWritten.load(std::memory_order_relaxed);
+        UINT64 maxDepth = m_maxQueueDepth.load(std::memory_order_relaxed);
+
+        m_recordsEnqueued++;
+        while (depth > maxDepth && !m_maxQueueDepth.compare_exchange_weak(maxDepth, depth))
+        {
+        }
+
+        if (m_config.trackLatency)
+        {
+            pStage->enqueueHist.Record((UINT64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                            std::chrono::steady_clock::now() - start).count());
+        }
+    }
+
+    //
+    // Queue a filled buffer for the flusher, wakes it if it is idle
+    //
+    VOID
+    Submit (
+        IN LogBuffer    *pBuf
+    )
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_full.push_back(pBuf);
+            m_submitSeq++;
+        }
+        m_workCv.notify_one();
+    }
+
+    //
+    // Submit every non-empty staging buffer. Returns the sequence number the
+    // flusher has to reach for all of them to be written
+    //
+    UINT64
+    SubmitStages ()
+    {
+        std::vector<LogStage *> stages;
+
+        {
+            std::lock_guard<std::mutex> lock(m_stagesLock);
+            for (auto &pStage : m_stages)
+            {
+                stages.push_back(pStage.get());
+            }
+        }
+
+        for (auto pStage : stages)
+        {
+            std::lock_guard<std::mutex> stageLock(pStage->lock);
+
+            if (pStage->pBuf != NULL && pStage->pBuf->used != 0)
+            {
+                Submit(pStage->pBuf);
+                pStage->pBuf = NULL;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_lock);
+        return m_submitSeq;
+    }
+
+    VOID
+    WaitWritten (
+        IN BOOL     sync
+    )
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        UINT64 target = 0;
+
+        if (m_pSink == NULL)
+        {
+            return;
+        }
+
+        target = SubmitStages();
+
+        std::unique_lock<std::mutex> lock(m_lock);
+        if (sync)
+        {
+            m_syncTarget = m_syncTarget > target ? m_syncTarget : target;
+        }
+        m_workCv.notify_one();
+        m_writtenCv.wait(lock, [&]() {
+            return m_stop || (m_writtenSeq >= target && (!sync || m_syncedSeq >= target));
+        });
+
+        m_barrierHist.Record((UINT64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 std::chrono::steady_clock::now() - start).count());
+    }
+
+    VOID
+    FlusherThread ()
+    {
+        std::vector<LogBuffer *>    batch;
+        std::vector<CHAR>           coalesce;
+
+        for (;;)
+        {
+            BOOL    timedOut = FALSE;
+            BOOL    stop = FALSE;
+            UINT64  seq = 0;
+            UINT64  syncTarget = 0;
+
+            {
+                std::unique_lock<std::mutex> lock(m_lock);
+
+                timedOut = !m_workCv.wait_for(lock,
+                                              std::chrono::milliseconds(m_config.flushIntervalMs),
+                                              [this]() { return m_stop || !m_full.empty(); });
+                stop = m_stop;
+            }
+
+            if (timedOut || stop)
+            {
+                SubmitStages();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+
+                batch.assign(m_full.begin(), m_full.end());
+                m_full.clear();
+                seq = m_submitSeq;
+                syncTarget = m_syncTarget;
+            }
+
+            WriteBatch(batch, coalesce);
+
+            BOOL doSync = syncTarget > m_syncedSeq;
+            if (doSync)
+            {
+                m_syncs++;
+                m_pSink->Sync();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+
+                for (auto pBuf : batch)
+                {
+                    pBuf->used = 0;
+                    m_free.push_back(pBuf);
+                }
+                m_writtenSeq = seq;
+                if (doSync)
+                {
+                    m_syncedSeq = seq;
+                }
+                if (stop && m_full.empty())
+                {
+                    m_writtenCv.notify_all();
+                    m_freeCv.notify_all();
+                    return;
+                }
+            }
+
+            m_freeCv.notify_all();
+            m_writtenCv.notify_all();
+        }
+    }
+
+    //
+    // One sink write for the whole batch, buffers are copied together unless
+    // there is only one
+    //
+    VOID
+    WriteBatch (
+        IN const std::vector<LogBuffer *>   &batch,
+        IN OUT std::vector<CHAR>            &coalesce
+    )
+    {
+        const VOID  *pData = NULL;
+        SIZE_T      len = 0;
+
+        if (batch.empty())
+        {
+            return;
+        }
+
+        if (batch.size() == 1)
+        {
+            pData = batch[0]->data.data();
+            len = batch[0]->used;
+        }
+        else
+        {
+            coalesce.clear();
+            for (auto pBuf : batch)
+            {
+                coalesce.insert(coalesce.end(), pBuf->data.begin(), pBuf->data.begin() + pBuf->used);
+            }
+            pData = coalesce.data();
+            len = coalesce.size();
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (!m_pSink->Write(pData, len))
+        {
+            m_writeErrors++;
+        }
+        UINT64 ns = (UINT64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count();
+
+        m_writes++;
+        m_bytesWritten += len;
+
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_writeHist.Record(ns);
+    }
+
+    ASYNC_LOG_CONFIG                        m_config;
+    AsyncLogSink                            *m_pSink;
+    UINT64                                  m_id;
+
+    std::thread                             m_flusher;
+
+    //
+    // m_lock guards the buffer lists, sequence numbers and the write/barrier
+    // histograms. Lock order is stage lock, then m_lock
+    //
+    std::mutex                              m_lock;
+    std::condition_variable                 m_workCv;
+    std::condition_variable                 m_freeCv;
+    std::condition_variable                 m_writtenCv;
+    bool                                    m_stop;
+    std::vector<std::unique_ptr<LogBuffer>> m_buffers;
+    std::vector<LogBuffer *>                m_free;
+    std::deque<LogBuffer *>                 m_full;
+    UINT64                                  m_submitSeq;
+    UINT64                                  m_writtenSeq;
+    UINT64                                  m_syncedSeq = 0;
+    UINT64                                  m_syncTarget = 0;
+    LatencyHistogram                        m_writeHist;
+    LatencyHistogram                        m_barrierHist;
+
+    std::mutex                              m_stagesLock;
+    std::vector<std::unique_ptr<LogStage>>  m_stages;
+    LatencyHistogram                        m_closedEnqueueHist;
+
+    std::atomic<UINT64>                     m_bytesEnqueued;
+    std::atomic<UINT64>                     m_bytesWritten;
+    std::atomic<UINT64>                     m_recordsEnqueued;
+    std::atomic<UINT64>                     m_maxQueueDepth;
+    std::atomic<UINT64>                     m_writes;
+    std::atomic<UINT64>                     m_writeErrors;
+    std::atomic<UINT64>                     m_syncs;
+    std::atomic<UINT64>                     m_barriers;
+    std::atomic<UINT64>                     m_stalls;
+};
@@ -0,0 +1,414 @@
+/*++
+
+Module Name:
+
+    CasePruner.h
+
+Abstract:
+
+    Adaptive pruning of the case space per call code. Every call code
+    otherwise gets its full grid of rep/fast combos times the cases of every
+    generator, even when its first few results show that no input changes
+    what the hypervisor answers.
+
+    A run goes in two passes over the same range of the space
+
+        probe   - CASE_PRUNE_PROBES cases of every rep/fast combo, spread
+                  evenly over the generators (NextCase with probing on)
+        Decide  - each call code with a fully probed combo gets a verdict
+                  from the statuses its fully probed combos saw
+
+            CASE_PRUNE_UNIMPLEMENTED    every probe failed with
+                                        HV_STATUS_INVALID_HYPERCALL_CODE
+            CASE_PRUNE_PRIVILEGED       HV_STATUS_ACCESS_DENIED, and nothing
+                                        but control word, alignment and GPA
+                                        rejections besides: no probe got
+                                        past the privilege check
+            CASE_PRUNE_INVARIANT        every combo gave one outcome (status
+                                        and repComplete) on all its probes
+            CASE_PRUNE_SENSITIVE        some combo's outcomes vary
+
+        rest    - the combos of sensitive call codes whose outcomes vary,
+                  less the probes already run, and every case of the
+                  combos not fully probed. Unimplemented, privileged and
+                  invariant call codes, and the invariant combos of
+                  sensitive ones, are pruned
+
+    A status of 0x80 or above is never expected, so a combo that sees one
+    is kept. A combo is judged only once all its probes are back: one the
+    guest went down in, or a resumed probe pass started after, is unprobed
+    and kept, and so is a call code without a fully probed combo.
+
+    Every verdict is a CASE_PRUNE_DECISION, for the audit log
+    (CasePruneFormat).
+
+    Observe and Decide are not thread safe. NextCase and IsPruned are, once
+    Decide has returned.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <stdio.h>
+#include <vector>
+#include "CaseSpace.h"
+
+#define CASE_PRUNE_PROBES       8       // Per rep/fast combo
+#define CASE_PRUNE_STATUSES     0x80
+#define CASE_PRUNE_COMBOS       (CASE_SPACE_REP_CNTS * CASE_SPACE_FAST)
+
+typedef enum _CASE_PRUNE_VERDICT
+{
+    CASE_PRUNE_UNPROBED = 0,            // No probe result, kept
+    CASE_PRUNE_UNIMPLEMENTED,
+    CASE_PRUNE_PRIVILEGED,
+    CASE_PRUNE_INVARIANT,
+    CASE_PRUNE_SENSITIVE
+} CASE_PRUNE_VERDICT;
+
+typedef enum _CASE_PRUNE_MODE
+{
+    CASE_PRUNE_MODE_OFF = 0,            // NextCase runs everything
+    CASE_PRUNE_MODE_PROBE,              // NextCase runs the probes only
+    CASE_PRUNE_MODE_PRUNE               // NextCase runs what Decide kept
+} CASE_PRUNE_MODE;
+
+typedef struct _CASE_PRUNE_DECISION
+{
+    UINT16  callcode;
+    UINT16  verdict;                    // CASE_PRUNE_VERDICT
+    UINT16  probes;                     // Probe results of the fully probed combos
+    UINT8   combosKept;                 // Bit per combo, repCnt * 2 + fast
+    UINT8   combosProbed;               // Bit per fully probed combo
+    UINT64  statuses[CASE_PRUNE_STATUSES / 64];     // Bit per status seen
+    UINT64  casesPruned;
+} CASE_PRUNE_DECISION, *PCASE_PRUNE_DECISION;
+
+C_ASSERT(sizeof(CASE_PRUNE_DECISION) == 32);
+
+inline const CHAR *
+CasePruneVerdictName (
+    IN UINT32   verdict
+)
+{
+    static const CHAR *s_names[] = { "unprobed", "unimplemented", "privileged", "invariant", "sensitive" };
+
+    return verdict < _ARRAYSIZE(s_names) ? s_names[verdict] : "?";
+}
+
+//
+// One audit log line, without a newline:
+//
+//   0x0044 HvGetPartitionProperty privileged, 48 probes, statuses 0x3 0x6,
+//   combos probed 0x3f, kept 0x00, 1542 cases pruned
+//
+inline VOID
+CasePruneFormat (
+    IN  const CASE_PRUNE_DECISION   &decision,
+    OUT CHAR                        *pBuffer,
+    IN  SIZE_T                      size
+)
+{
+    SIZE_T  used = 0;
+    int     n = 0;
+
+    n = snprintf(pBuffer,
+                 size,
+                 "0x%04x %s %s, %u probes, statuses",
+                 decision.callcode,
+                 HcDescriptors[decision.callcode].name,
+                 CasePruneVerdictName(decision.verdict),
+                 decision.probes);
+    used = n > 0 ? (SIZE_T)n : 0;
+
+    for (UINT32 s = 0; s < CASE_PRUNE_STATUSES && used < size; s++)
+    {
+        if (decision.statuses[s / 64] & (1ULL << (s % 64)))
+        {
+            n = snprintf(pBuffer + used, size - used, " 0x%x", s);
+            used += n > 0 ? (SIZE_T)n : 0;
+        }
+    }
+
+    if (used < size)
+    {
+        snprintf(pBuffer + used,
+                 size - used,
+                 ", combos probed 0x%02x, kept 0x%02x, %llu cases pruned",
+                 decision.combosProbed,
+                 decision.combosKept,
+                 (unsigned long long)decision.casesPruned);
+    }
+}
+
+class CasePruner
+{
+public:
+    //
+    // The space is not copied
+    //
+    explicit CasePruner (
+        IN const CaseSpace  &space,
+        IN UINT32           probes = CASE_PRUNE_PROBES
+    )
+        : m_space(space),
+          m_mode(CASE_PRUNE_MODE_OFF),
+          m_casesPerCombo(space.CasesPerCombo()),
+          m_probes(0),
+          m_combos(space.CasesPerCombo() ? space.Count() / space.CasesPerCombo() : 0),
+          m_isProbe(space.CasesPerCombo(), 0)
+    {
+        if (probes > m_casesPerCombo)
+        {
+            probes = m_casesPerCombo;
+        }
+        for (UINT32 k = 0; k < probes; k++)
+        {
+            m_isProbe[(UINT64)k * m_casesPerCombo / probes] = 1;
+        }
+        for (UINT8 bProbe : m_isProbe)
+        {
+            m_probes += bProbe;
+        }
+        Reset();
+    }
+
+    //
+    // Forget every observation and decision, back to running everything
+    //
+    VOID
+    Reset ()
+    {
+        COMBO_STATE combo = {};
+
+        m_mode = CASE_PRUNE_MODE_OFF;
+        m_comboStates.assign((SIZE_T)m_combos, combo);
+        m_decisions.clear();
+    }
+
+    CASE_PRUNE_MODE Mode () const { return m_mode; }
+    UINT32 ProbesPerCombo () const { return m_probes; }
+    VOID StartProbing () { m_mode = CASE_PRUNE_MODE_PROBE; }
+
+    BOOL
+    IsProbe (
+        IN UINT64   index
+    ) const
+    {
+        return m_casesPerCombo != 0 && m_isProbe[(SIZE_T)(index % m_casesPerCombo)];
+    }
+
+    //
+    // Pruned: not run after Decide, either a probe of a fully probed combo
+    // or a case of a pruned combo
+    //
+    BOOL
+    IsPruned (
+        IN UINT64   index
+    ) const
+    {
+        const COMBO_STATE *pCombo = NULL;
+
+        if (m_mode != CASE_PRUNE_MODE_PRUNE)
+        {
+            return FALSE;
+        }
+        pCombo = &m_comboStates[(SIZE_T)(index / m_casesPerCombo)];
+        return pCombo->bPruned || (pCombo->bProbed && IsProbe(index));
+    }
+
+    //
+    // First case in [index, end) the current mode runs, end if none. Skips
+    // a pruned combo whole
+    //
+    UINT64
+    NextCase (
+        IN UINT64   index,
+        IN UINT64   end
+    ) const
+    {
+        if (m_mode == CASE_PRUNE_MODE_OFF)
+        {
+            return index;
+        }
+
+        while (index < end)
+        {
+            UINT64 combo = index / m_casesPerCombo;
+
+            if (m_mode == CASE_PRUNE_MODE_PROBE ? IsProbe(index) : !IsPruned(index))
+            {
+                return index;
+            }
+            if (m_mode == CASE_PRUNE_MODE_PRUNE && m_comboStates[(SIZE_T)combo].bPruned)
+            {
+                index = (combo + 1) * m_casesPerCombo;
+                continue;
+            }
+            index++;
+        }
+        return end;
+    }
+
+    //
+    // Count a probe's result
+    //
+    VOID
+    Observe (
+        IN UINT32                           callcode,
+        IN UINT32                           repCnt,
+        IN UINT32                           fast,
+        IN const HYPERCALL_BATCH_RESULT     &result
+    )
+    {
+        UINT64      index = 0;
+        UINT32      outcome = result.hvStatus | (UINT32)result.repComplete << 16;
+        COMBO_STATE *pCombo = NULL;
+
+        if (!m_space.IndexOf(callcode, repCnt, fast, 0, &index))
+        {
+            return;
+        }
+
+        pCombo = &m_comboStates[(SIZE_T)(index / m_casesPerCombo)];
+        if (pCombo->probes == 0)
+        {
+            pCombo->outcome = outcome;
+        }
+        pCombo->bVaries |= pCombo->outcome != outcome || result.hvStatus >= CASE_PRUNE_STATUSES;
+        if (result.hvStatus < CASE_PRUNE_STATUSES)
+        {
+            pCombo->statuses[result.hvStatus / 64] |= 1ULL << (result.hvStatus % 64);
+        }
+        pCombo->probes++;
+    }
+
+    //
+    // Give every probed call code its verdict and prune. Returns the number
+    // of cases pruned, probes not counted
+    //
+    UINT64
+    Decide ()
+    {
+        UINT64 pruned = 0;
+
+        m_decisions.clear();
+        for (UINT64 first = 0; first < m_combos; first += CASE_PRUNE_COMBOS)
+        {
+            CASE_PRUNE_DECISION decision;
+
+            if (DecideCallcode(first, &decision))
+            {
+                pruned += decision.casesPruned;
+                m_decisions.push_back(decision);
+            }
+        }
+        m_mode = CASE_PRUNE_MODE_PRUNE;
+        return pruned;
+    }
+
+    //
+    // Decisions of the last Decide, in call code order
+    //
+    SIZE_T DecisionCount () const { return m_decisions.size(); }
+    const CASE_PRUNE_DECISION &Decision (IN SIZE_T i) const { return m_decisions[i]; }
+
+private:
+    typedef struct _COMBO_STATE
+    {
+        UINT64  statuses[CASE_PRUNE_STATUSES / 64];
+        UINT32  outcome;                // Of the first probe
+        UINT16  probes;
+        UINT8   bVaries;
+        UINT8   bProbed;                // All its probes came back
+        UINT8   bPruned;
+    } COMBO_STATE;
+
+    //
+    // Verdict of the call code whose combos start at first, from its fully
+    // probed combos. FALSE if it has none
+    //
+    BOOL
+    DecideCallcode (
+        IN  UINT64                  first,
+        OUT PCASE_PRUNE_DECISION    pDecision
+    )
+    {
+        const UINT64    rejected = 1ULL << HV_STATUS_INVALID_HYPERCALL_INPUT |
+                                   1ULL << HV_STATUS_INVALID_ALIGNMENT |
+                                   1ULL << HV_STATUS_INVALID_PARAMETER;
+        BOOL            bVaries = FALSE;
+        FUZZ_CASE       fuzzCase;
+
+        memset(pDecision, 0, sizeof(CASE_PRUNE_DECISION));
+        for (UINT32 c = 0; c < CASE_PRUNE_COMBOS; c++)
+        {
+            COMBO_STATE &combo = m_comboStates[(SIZE_T)(first + c)];
+
+            combo.bProbed = m_probes != 0 && combo.probes >= m_probes;
+            combo.bPruned = FALSE;
+            if (!combo.bProbed)
+            {
+                continue;
+            }
+            pDecision->combosProbed |= 1 << c;
+            pDecision->statuses[0] |= combo.statuses[0];
+            pDecision->statuses[1] |= combo.statuses[1];
+            pDecision->probes = (UINT16)(pDecision->probes + combo.probes);
+            bVaries |= combo.bVaries;
+        }
+        if (pDecision->combosProbed == 0)
+        {
+            return FALSE;
+        }
+
+        m_space.Materialize(first * m_casesPerCombo, &fuzzCase);
+        pDecision->callcode = fuzzCase.callcode;
+
+        if (pDecision->statuses[1] == 0 &&
+            pDecision->statuses[0] == 1ULL << HV_STATUS_INVALID_HYPERCALL_CODE)
+        {
+            pDecision->verdict = CASE_PRUNE_UNIMPLEMENTED;
+        }
+        else if (pDecision->statuses[1] == 0 &&
+                 (pDecision->statuses[0] & 1ULL << HV_STATUS_ACCESS_DENIED) &&
+                 (pDecision->statuses[0] & ~(rejected | 1ULL << HV_STATUS_ACCESS_DENIED)) == 0)
+        {
+            pDecision->verdict = CASE_PRUNE_PRIVILEGED;
+        }
+        else
+        {
+            pDecision->verdict = bVaries ? CASE_PRUNE_SENSITIVE : CASE_PRUNE_INVARIANT;
+        }
+
+        for (UINT32 c = 0; c < CASE_PRUNE_COMBOS; c++)
+        {
+            COMBO_STATE &combo = m_comboStates[(SIZE_T)(first + c)];
+
+            combo.bPruned = combo.bProbed &&
+                            (pDecision->verdict != CASE_PRUNE_SENSITIVE || !combo.bVaries);
+            if (combo.bPruned)
+            {
+                pDecision->casesPruned += m_casesPerCombo - m_probes;
+            }
+            else
+            {
+                pDecision->combosKept |= 1 << c;
+            }
+        }
+        return TRUE;
+    }
+
+    const CaseSpace                     &m_space;
+    CASE_PRUNE_MODE                     m_mode;
+    UINT32                              m_casesPerCombo;
+    UINT32                              m_probes;       // Per combo
+    UINT64                              m_combos;
+    std::vector<UINT8>                  m_isProbe;      // Per caseIdx
+    std::vector<COMBO_STATE>            m_comboStates;
+    std::vector<CASE_PRUNE_DECISION>    m_decisions;
+};
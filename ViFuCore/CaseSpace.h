@@ -0,0 +1,672 @@
+/*++
+
+Module Name:
+
+    CaseSpace.h
+
+Abstract:
+
+    The fuzzer's cases as one flat, numbered space. A case is a call code
+    the filter allows, a rep count (0 - 2), the fast bit and a case number
+    within the registered generators, and its 64-bit index is
+
+        ((callcode slot * 3 + repCnt) * 2 + fast) * cases per combo + caseIdx
+
+    so any index turns into its case in O(1), without walking the ones
+    before it. That makes resume a lookup, and lets the space be cut into
+    disjoint shards (Shard) or visited in a random order that still hits
+    every case once (CaseCursor with a key, a Feistel permutation of the
+    shard).
+
+    Each strategy is a CASE_GENERATOR: a name, a number of cases and a
+    function setting the registers of case k. The default table reproduces
+    the old switch case for case, caseIdx 0 - 136 in its first
+    CASE_SPACE_BLIND_GENERATORS entries, then the structured
+    (InputGenerator.h) and havoc (HavocMutator.h) cases. s_repSweepGenerators
+    sweeps rep counts up to the 12-bit maximum instead, s_registerGenerators
+    makes extended fast calls that take all their input from registers.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <vector>
+#include "HypercallTable.h"
+#include "InputGenerator.h"
+#include "HavocMutator.h"
+
+#define CASE_SPACE_REP_CNTS     3
+#define CASE_SPACE_FAST         2
+#define CASE_SPACE_HAVOC_CASES  64
+#define CASE_SPACE_MAX_STACK    4
+
+//
+// What a generator knows about the case it is making
+//
+typedef struct _CASE_GEN_CONTEXT
+{
+    const HC_DESC   *pDesc;
+    UINT32          repCnt;
+    UINT32          isFast;
+    UINT32          count;          // Cases of this generator
+    UINT32          param;          // CASE_GENERATOR param
+    HavocMutator    *pHavoc;
+} CASE_GEN_CONTEXT;
+
+//
+// Sets the registers of case k (0 - count-1), RCX already holds the control
+// word. Returns the rngState to journal with it
+//
+typedef UINT64 (*CASE_GEN_FN)(
+    IN     const CASE_GEN_CONTEXT   *pContext,
+    IN     UINT32                   k,
+    IN OUT PCPU_REG_64              pRegs
+    );
+
+typedef struct _CASE_GENERATOR
+{
+    const CHAR  *name;
+    UINT32      count;
+    UINT32      param;
+    CASE_GEN_FN pfnGenerate;
+} CASE_GENERATOR;
+
+//
+// A concrete case
+//
+typedef struct _FUZZ_CASE
+{
+    UINT64      index;
+    UINT16      callcode;
+    UINT16      repCnt;
+    UINT16      fast;
+    UINT16      caseIdx;
+    UINT32      generator;      // Index into the generator table
+    UINT32      rsvd;
+    UINT64      rngState;
+    CPU_REG_64  regs;
+} FUZZ_CASE, *PFUZZ_CASE;
+
+//
+// USE_GPA_MEM_FILL in RDX, then R8, R9, R10 and R11 too
+//
+inline UINT64
+CaseGenGpaFill (
+    IN     const CASE_GEN_CONTEXT   *pContext,
+    IN     UINT32                   k,
+    IN OUT PCPU_REG_64              pRegs
+)
+{
+    (VOID)pContext;
+
+    switch (k)
+    {
+    case 4:
+        pRegs->r11 = USE_GPA_MEM_FILL;
+        // fall through
+    case 3:
+        pRegs->r10 = USE_GPA_MEM_FILL;
+        // fall through
+    case 2:
+        pRegs->r9 = USE_GPA_MEM_FILL;
+        // fall through
+    case 1:
+        pRegs->r8 = USE_GPA_MEM_FILL;
+        // fall through
+    default:
+        pRegs->rdx = USE_GPA_MEM_FILL;
+        break;
+    }
+    return 0;
+}
+
+//
+// No in/out args
+//
+inline UINT64
+CaseGenNone (
+    IN     const CASE_GEN_CONTEXT   *pContext,
+    IN     UINT32                   k,
+    IN OUT PCPU_REG_64              pRegs
+)
+{
+    (VOID)pContext;
+    (VOID)k;
+    (VOID)pRegs;
+    return 0;
+}
+
+//
+// Input page of 0's, then 1's
+//
+inline UINT64
+CaseGenNoFill (
+    IN     const CASE_GEN_CONTEXT   *pContext,
+    IN     UINT32                   k,
+    IN OUT PCPU_REG_64              pRegs
+)
+{
+    (VOID)pContext;
+
+    pRegs->rdx = k == 0 ? USE_GPA_MEM_NOFILL_0 : USE_GPA_MEM_NOFILL_1;
+    return 0;
+}
+
+//
+// Input page filled with bit (param + k) set, RAX carries it to the driver
+//
+inline UINT64
+CaseGenBitRangeIn (
+    IN     const CASE_GEN_CONTEXT   *pContext,
+    IN     UINT32                   k,
+    IN OUT PCPU_REG_64              pRegs
+)
+{
+    pRegs->rdx = USE_GPA_MEM_BIT_RANGE_LOOP;
+    pRegs->rax = 1ULL << ((pContext->param + k) & 63);
+    return 0;
+}
+
+//
+// Same for the input and output pages
+//
+inline UINT64
+CaseGenBitRangeInOut (
+    IN     const CASE_GEN_CONTEXT   *pContext,
+    IN     UINT32                   k,
+    IN OUT PCPU_REG_64              pRegs
+)
+{
+    pRegs->rdx = USE_GPA_MEM_BIT_RANGE_LOOP;
+    pRegs->r8 = USE_GPA_MEM_BIT_RANGE_LOOP;
+    pRegs->rax = 1ULL << ((pContext->param + k) & 63);
+    return 0;
+}
+
+//
+// XMM constants. Fast calls also get XMM0-2 all 0, then 1, 1, 0 and 1, 1, 1
+//
+inline UINT64
+CaseGenXmm (
+    IN     const CASE_GEN_CONTEXT   *pContext,
+    IN     UINT32                   k,
+    IN OUT PCPU_REG_64              pRegs
+)
+{
+    if (k == 0)
+    {
+        pRegs->xmm0.lower = 0x0DCDCDCDCDCDCDCD;
+        pRegs->xmm0.upper = 0x0FEFEFEFEFEFEFEF;
+    }
+    else if (pContext->isFast)
+    {
+        pRegs->xmm0.lower = k >= 2;
+        pRegs->xmm1.lower = k >= 2;
+        pRegs->xmm2.lower = k >= 3;
+    }
+    return 0;
+}
+
+inline UINT64
+CaseGenStructured (
+    IN     const CASE_GEN_CONTEXT   *pContext,
+    IN     UINT32                   k,
+    IN OUT PCPU_REG_64              pRegs
+)
+{
+    InputGenCase(*pContext->pDesc, k, pRegs);
+    return 0;
+}
+
+//
+// Havoc on structured case k. The iteration is derived from the call code
+// rather than its slot, so it stays the same whatever the filter allows
+//
+inline UINT64
+CaseGenHavoc (
+    IN     const CASE_GEN_CONTEXT   *pContext,
+    IN     UINT32                   k,
+    IN OUT PCPU_REG_64              pRegs
+)
+{
+    UINT64 iteration = ((pContext->pDesc->callcode * (UINT64)CASE_SPACE_REP_CNTS + pContext->repCnt) *
+                        CASE_SPACE_FAST + pContext->isFast) * pContext->count + k;
+
+    InputGenCase(*pContext->pDesc, k % INPUT_GEN_CASES, pRegs);
+    pContext->pHavoc->Seek(iteration);
+    pContext->pHavoc->Mutate(pRegs);
+    return iteration;
+}
+
+//
+// Rep count sweep (InputGenRepSweepCase). The combo's rep count 0 - 2 picks
+// the rep start index instead of the rep count
+//
+inline UINT64
+CaseGenRepSweep (
+    IN     const CASE_GEN_CONTEXT   *pContext,
+    IN     UINT32                   k,
+    IN OUT PCPU_REG_64              pRegs
+)
+{
+    InputGenRepSweepCase(*pContext->pDesc, k, pContext->repCnt, pRegs);
+    return 0;
+}
+
+//
+// Register only cases (InputGenRegisterCase), the combo's fast bit picks
+// whether the registers past the input are filled too
+//
+inline UINT64
+CaseGenRegister (
+    IN     const CASE_GEN_CONTEXT   *pContext,
+    IN     UINT32                   k,
+    IN OUT PCPU_REG_64              pRegs
+)
+{
+    InputGenRegisterCase(*pContext->pDesc, k, pContext->isFast, pRegs);
+    return 0;
+}
+
+//
+// Havoc on register only case k. The fast bit is set again afterwards, so
+// a mutated control word never turns the registers into GPAs
+//
+inline UINT64
+CaseGenRegisterHavoc (
+    IN     const CASE_GEN_CONTEXT   *pContext,
+    IN     UINT32                   k,
+    IN OUT PCPU_REG_64              pRegs
+)
+{
+    UINT64 iteration = ((pContext->pDesc->callcode * (UINT64)CASE_SPACE_REP_CNTS + pContext->repCnt) *
+                        CASE_SPACE_FAST + pContext->isFast) * pContext->count + k;
+
+    InputGenRegisterCase(*pContext->pDesc, k % INPUT_GEN_CASES, pContext->isFast, pRegs);
+    pContext->pHavoc->Seek(iteration);
+    pContext->pHavoc->Mutate(pRegs);
+    pRegs->rcx |= 1ULL << 16;
+    return iteration;
+}
+
+//
+// caseIdx 0 - 136 are the old switch, in its numbering
+//
+constexpr CASE_GENERATOR s_caseGenerators[] =
+{
+    { "gpa fill",           5,                      0,  CaseGenGpaFill },
+    { "no args",            1,                      0,  CaseGenNone },
+    { "nofill",             2,                      0,  CaseGenNoFill },
+    { "bit range in",       64,                     0,  CaseGenBitRangeIn },
+    { "bit range in/out",   48,                     0,  CaseGenBitRangeInOut },
+    { "xmm",                4,                      0,  CaseGenXmm },
+    { "bit range in/out",   12,                     52, CaseGenBitRangeInOut },
+    { "no args",            1,                      0,  CaseGenNone },
+    { "structured",         INPUT_GEN_CASES,        0,  CaseGenStructured },
+    { "havoc",              CASE_SPACE_HAVOC_CASES, 0,  CaseGenHavoc },
+};
+
+#define CASE_SPACE_BLIND_GENERATORS     8
+
+//
+// Rep calls only, for stressing their rep paths and continuations. A journal
+// of it has its own caseIdx numbering, replay it with this table
+//
+constexpr CASE_GENERATOR s_repSweepGenerators[] =
+{
+    { "rep sweep",          INPUT_GEN_REP_SWEEP_CASES,  0,  CaseGenRepSweep },
+};
+
+//
+// Extended fast calls only, nothing in guest memory: the batch can go with
+// HYPERCALL_BATCH_FLAG_REGISTER_ONLY. Havoc needs a space made with
+// MUTATOR_OP_MASK_REGISTER_ONLY
+//
+constexpr CASE_GENERATOR s_registerGenerators[] =
+{
+    { "register",           INPUT_GEN_CASES,            0,  CaseGenRegister },
+    { "register havoc",     CASE_SPACE_HAVOC_CASES,     0,  CaseGenRegisterHavoc },
+};
+
+constexpr UINT32
+CaseSpaceCases (
+    IN const CASE_GENERATOR *pGenerators,
+    IN UINT32               generatorCnt
+)
+{
+    UINT32 cases = 0;
+
+    for (UINT32 g = 0; g < generatorCnt; g++)
+    {
+        cases += pGenerators[g].count;
+    }
+    return cases;
+}
+
+//
+// Cases per call code, rep and fast of the default table
+//
+#define CASE_SPACE_CASES    CaseSpaceCases(s_caseGenerators, _ARRAYSIZE(s_caseGenerators))
+
+static_assert(CaseSpaceCases(s_caseGenerators, CASE_SPACE_BLIND_GENERATORS) == INPUT_GEN_FIRST_CASE,
+              "blind generators must keep the old switch numbering");
+static_assert(CASE_SPACE_CASES == INPUT_GEN_LAST_CASE + 1 + CASE_SPACE_HAVOC_CASES,
+              "journaled caseIdx must stay stable");
+
+class CaseSpace
+{
+public:
+    //
+    // Call codes below HC_DESC_COUNT the filter allows, with the generators
+    // given (the table is not copied). seed seeds the havoc cases, which
+    // use the havocOps operations
+    //
+    CaseSpace (
+        IN const HcFilter       &filter,
+        IN UINT64               seed,
+        IN const CASE_GENERATOR *pGenerators = s_caseGenerators,
+        IN UINT32               generatorCnt = _ARRAYSIZE(s_caseGenerators),
+        IN UINT32               havocOps = MUTATOR_OP_MASK_REGS
+    )
+        : m_pGenerators(pGenerators),
+          m_generatorCnt(generatorCnt),
+          m_havoc(seed, havocOps, CASE_SPACE_MAX_STACK)
+    {
+        UINT32 caseIdx = 0;
+
+        for (UINT32 callcode = 0; callcode < HC_DESC_COUNT; callcode++)
+        {
+            if (filter.IsAllowed(callcode))
+            {
+                m_callcodes.push_back((UINT16)callcode);
+            }
+        }
+
+        //
+        // caseIdx -> generator, so materializing needs no search
+        //
+        for (UINT32 g = 0; g < generatorCnt; g++)
+        {
+            m_firstCase.push_back(caseIdx);
+            for (UINT32 k = 0; k < pGenerators[g].count; k++, caseIdx++)
+            {
+                m_caseGenerator.push_back((UINT16)g);
+            }
+        }
+        m_casesPerCombo = caseIdx;
+        m_count = (UINT64)m_callcodes.size() * CASE_SPACE_REP_CNTS * CASE_SPACE_FAST * m_casesPerCombo;
+    }
+
+    UINT64 Count () const { return m_count; }
+    UINT32 CasesPerCombo () const { return m_casesPerCombo; }
+    UINT32 CallcodeCount () const { return (UINT32)m_callcodes.size(); }
+    const CASE_GENERATOR &Generator (IN UINT32 g) const { return m_pGenerators[g]; }
+    UINT32 GeneratorCount () const { return m_generatorCnt; }
+
+    //
+    // Index -> case. FALSE past the end. Workers can share one space, each
+    // call seeks its own copy of the mutator
+    //
+    BOOL
+    Materialize (
+        IN  UINT64      index,
+        OUT PFUZZ_CASE  pCase
+    ) const
+    {
+        HavocMutator        havoc(m_havoc);
+        CASE_GEN_CONTEXT    context;
+        UINT64              combo = 0;
+        UINT32              g = 0;
+
+        if (index >= m_count)
+        {
+            return FALSE;
+        }
+
+        combo = index / m_casesPerCombo;
+        pCase->index = index;
+        pCase->caseIdx = (UINT16)(index % m_casesPerCombo);
+        pCase->fast = (UINT16)(combo % CASE_SPACE_FAST);
+        pCase->repCnt = (UINT16)((combo / CASE_SPACE_FAST) % CASE_SPACE_REP_CNTS);
+        pCase->callcode = m_callcodes[(SIZE_T)(combo / (CASE_SPACE_FAST * CASE_SPACE_REP_CNTS))];
+        pCase->rsvd = 0;
+
+        g = m_caseGenerator[pCase->caseIdx];
+        pCase->generator = g;
+
+        context.pDesc = &HcDescriptors[pCase->callcode];
+        context.repCnt = pCase->repCnt;
+        context.isFast = pCase->fast;
+        context.count = m_pGenerators[g].count;
+        context.param = m_pGenerators[g].param;
+        context.pHavoc = &havoc;
+
+        memset(&pCase->regs, 0, sizeof(CPU_REG_64));
+        pCase->regs.rcx = pCase->callcode | ((UINT64)pCase->fast << 16) | ((UINT64)pCase->repCnt << 32);
+        pCase->rngState = m_pGenerators[g].pfnGenerate(&context,
+                                                       pCase->caseIdx - m_firstCase[g],
+                                                       &pCase->regs);
+        return TRUE;
+    }
+
+    //
+    // Index of a case, FALSE if its call code is not in the space
+    //
+    BOOL
+    IndexOf (
+        IN  UINT32  callcode,
+        IN  UINT32  repCnt,
+        IN  UINT32  fast,
+        IN  UINT32  caseIdx,
+        OUT PUINT64 pIndex
+    ) const
+    {
+        UINT32 slot = LowerBound(callcode);
+
+        if (slot == m_callcodes.size() || m_callcodes[slot] != callcode ||
+            repCnt >= CASE_SPACE_REP_CNTS || fast >= CASE_SPACE_FAST || caseIdx >= m_casesPerCombo)
+        {
+            return FALSE;
+        }
+
+        *pIndex = ((slot * (UINT64)CASE_SPACE_REP_CNTS + repCnt) * CASE_SPACE_FAST + fast) * m_casesPerCombo + caseIdx;
+        return TRUE;
+    }
+
+    //
+    // Where to continue after a case took the guest down: the first case of
+    // the next rep/fast combo, or of the next call code in the space if this
+    // one no longer is
+    //
+    UINT64
+    ResumeIndex (
+        IN UINT32   callcode,
+        IN UINT32   repCnt,
+        IN UINT32   fast
+    ) const
+    {
+        UINT32 slot = LowerBound(callcode);
+        UINT64 combo = (UINT64)slot * CASE_SPACE_REP_CNTS * CASE_SPACE_FAST;
+
+        if (slot < m_callcodes.size() && m_callcodes[slot] == callcode &&
+            repCnt < CASE_SPACE_REP_CNTS && fast < CASE_SPACE_FAST)
+        {
+            combo += repCnt * CASE_SPACE_FAST + fast + 1;
+        }
+        return combo * m_casesPerCombo;
+    }
+
+    //
+    // Range [*pBegin, *pEnd) of shard s of n. Shards are contiguous so each
+    // keeps whole call codes together where it can
+    //
+    VOID
+    Shard (
+        IN  UINT32  s,
+        IN  UINT32  n,
+        OUT PUINT64 pBegin,
+        OUT PUINT64 pEnd
+    ) const
+    {
+        *pBegin = ShardStart(s, n);
+        *pEnd = ShardStart(s + 1, n);
+    }
+
+private:
+    UINT32
+    LowerBound (
+        IN UINT32   callcode
+    ) const
+    {
+        UINT32 lo = 0;
+        UINT32 hi = (UINT32)m_callcodes.size();
+
+        while (lo < hi)
+        {
+            UINT32 mid = (lo + hi) / 2;
+
+            if (m_callcodes[mid] < callcode)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    //
+    // Split on combo boundaries, count * s / n without overflowing
+    //
+    UINT64
+    ShardStart (
+        IN UINT32   s,
+        IN UINT32   n
+    ) const
+    {
+        UINT64 combos = m_casesPerCombo ? m_count / m_casesPerCombo : 0;
+
+        if (n == 0 || s >= n)
+        {
+            return m_count;
+        }
+        return (combos / n * s + combos % n * s / n) * m_casesPerCombo;
+    }
+
+    const CASE_GENERATOR    *m_pGenerators;
+    UINT32                  m_generatorCnt;
+    UINT32                  m_casesPerCombo;
+    UINT64                  m_count;
+    std::vector<UINT16>     m_callcodes;
+    std::vector<UINT32>     m_firstCase;
+    std::vector<UINT16>     m_caseGenerator;
+    HavocMutator            m_havoc;
+};
+
+//
+// Visits [begin, end) once each, in order or, with a non-zero key, in a
+// pseudo-random order. Position() is how far it got, Seek() skips in O(1)
+//
+class CaseCursor
+{
+public:
+    CaseCursor (
+        IN UINT64   begin,
+        IN UINT64   end,
+        IN UINT64   key = 0
+    )
+        : m_begin(begin),
+          m_length(end > begin ? end - begin : 0),
+          m_position(0),
+          m_key(key),
+          m_halfBits(1)
+    {
+        while ((1ULL << (2 * m_halfBits)) < m_length)
+        {
+            m_halfBits++;
+        }
+    }
+
+    UINT64 Position () const { return m_position; }
+    UINT64 Length () const { return m_length; }
+    BOOL IsDone () const { return m_position >= m_length; }
+
+    VOID
+    Seek (
+        IN UINT64   position
+    )
+    {
+        m_position = position > m_length ? m_length : position;
+    }
+
+    //
+    // Case index at a position of the walk
+    //
+    UINT64
+    IndexAt (
+        IN UINT64   position
+    ) const
+    {
+        if (m_key == 0)
+        {
+            return m_begin + position;
+        }
+
+        //
+        // Cycle walk the permutation of the next power of 4 until it lands
+        // in range, at most 4 steps on average
+        //
+        UINT64 x = position;
+
+        do
+        {
+            x = Feistel(x);
+        } while (x >= m_length);
+        return m_begin + x;
+    }
+
+    BOOL
+    Next (
+        OUT PUINT64 pIndex
+    )
+    {
+        if (IsDone())
+        {
+            return FALSE;
+        }
+        *pIndex = IndexAt(m_position++);
+        return TRUE;
+    }
+
+private:
+    UINT64
+    Feistel (
+        IN UINT64   x
+    ) const
+    {
+        UINT64 mask = (1ULL << m_halfBits) - 1;
+        UINT64 left = x >> m_halfBits;
+        UINT64 right = x & mask;
+
+        for (UINT32 round = 0; round < 4; round++)
+        {
+            UINT64 next = left ^ (PageFillSplitMix(right ^ m_key ^ ((UINT64)round << 56)) & mask);
+
+            left = right;
+            right = next;
+        }
+        return (left << m_halfBits) | right;
+    }
+
+    UINT64  m_begin;
+    UINT64  m_length;
+    UINT64  m_position;
+    UINT64  m_key;
+    UINT32  m_halfBits;
+};
@@ -0,0 +1,443 @@
+/*++
+
+Module Name:
+
+    CollectorClient.h
+
+Abstract:
+
+    Guest side of the log collector protocol (CollectorProtocol.h).
+
+    CollectorClient holds the connection, numbers RECORDS frames and tracks
+    the collector's ACKs. CollectorSink puts it behind AsyncLog, so with
+    ASYNC_LOG_DURABILITY_SYNCED an AsyncLog::Barrier() returns once the
+    collector has the records on disk, the same guarantee the write-through
+    share files gave.
+
+    Send() may be called from several threads (one AsyncLog flusher per
+    stream), frames go out whole and in sequence order.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <stdio.h>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include "CollectorProtocol.h"
+#include "AsyncLog.h"
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "Ws2_32.lib")
+#endif
+typedef SOCKET  COLLECTOR_SOCKET;
+#define COLLECTOR_INVALID_SOCKET    INVALID_SOCKET
+#else
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+typedef INT     COLLECTOR_SOCKET;
+#define COLLECTOR_INVALID_SOCKET    (-1)
+#endif
+
+class CollectorClient
+{
+public:
+    CollectorClient ()
+        : m_socket(COLLECTOR_INVALID_SOCKET),
+          m_sent(0),
+          m_acked(0),
+          m_status(COLLECTOR_STATUS_OK)
+    {
+    }
+
+    ~CollectorClient ()
+    {
+        Close();
+    }
+
+    //
+    // Connect and say hello. pAck gets the collector's journal state, from
+    // which the guest resumes. Waits at most timeoutMs for any reply
+    //
+    BOOL
+    Connect (
+        IN  const CHAR              *host,
+        IN  UINT16                  port,
+        IN  const CHAR              *guestId,
+        IN  UINT64                  campaignId,
+        IN  UINT32                  timeoutMs,
+        OUT PCOLLECTOR_HELLO_ACK    pAck
+    )
+    {
+        struct addrinfo     hints = {};
+        struct addrinfo     *pAddrs = NULL;
+        CHAR                service[8];
+        COLLECTOR_HELLO     hello = {};
+
+        if (!StartSockets() || !CollectorIsValidGuestId(guestId))
+        {
+            return FALSE;
+        }
+        Close();
+
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(service, sizeof(service), "%u", port);
+        if (getaddrinfo(host, service, &hints, &pAddrs) != 0)
+        {
+            return FALSE;
+        }
+
+        for (struct addrinfo *pAddr = pAddrs; pAddr != NULL; pAddr = pAddr->ai_next)
+        {
+            m_socket = socket(pAddr->ai_family, pAddr->ai_socktype, pAddr->ai_protocol);
+            if (m_socket == COLLECTOR_INVALID_SOCKET)
+            {
+                continue;
+            }
+            if (connect(m_socket, pAddr->ai_addr, (INT)pAddr->ai_addrlen) == 0)
+            {
+                break;
+            }
+            CloseSocket(m_socket);
+            m_socket = COLLECTOR_INVALID_SOCKET;
+        }
+        freeaddrinfo(pAddrs);
+
+        if (m_socket == COLLECTOR_INVALID_SOCKET)
+        {
+            return FALSE;
+        }
+
+        SetOptions(timeoutMs);
+
+        m_sent = 0;
+        m_acked = 0;
+        m_status = COLLECTOR_STATUS_OK;
+
+        hello.version = COLLECTOR_VERSION;
+        hello.campaignId = campaignId;
+        strncpy(hello.guestId, guestId, sizeof(hello.guestId) - 1);
+
+        if (!SendFrame(COLLECTOR_FRAME_HELLO, 0, 0, &hello, sizeof(hello)) ||
+            !ReceiveHelloAck(pAck))
+        {
+            Close();
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    VOID
+    Close ()
+    {
+        if (m_socket != COLLECTOR_INVALID_SOCKET)
+        {
+            CloseSocket(m_socket);
+            m_socket = COLLECTOR_INVALID_SOCKET;
+        }
+    }
+
+    BOOL IsConnected () const { return m_socket != COLLECTOR_INVALID_SOCKET && m_status == COLLECTOR_STATUS_OK; }
+
+    UINT64 Sent () const { return m_sent; }
+    UINT64 Acked () const { return m_acked; }
+
+    //
+    // Why the collector dropped us, if it said
+    //
+    COLLECTOR_STATUS Status () const { return (COLLECTOR_STATUS)m_status.load(); }
+
+    //
+    // Send bytes for a stream, split into frames of at most
+    // COLLECTOR_MAX_PAYLOAD. Returns the sequence of the last frame, 0 on
+    // failure
+    //
+    UINT64
+    Send (
+        IN COLLECTOR_STREAM stream,
+        IN const VOID       *pData,
+        IN SIZE_T           len
+    )
+    {
+        std::lock_guard<std::mutex> lock(m_sendLock);
+        const CHAR *p = (const CHAR *)pData;
+        UINT64 seq = 0;
+
+        do
+        {
+            UINT32 chunk = len > COLLECTOR_MAX_PAYLOAD ? COLLECTOR_MAX_PAYLOAD : (UINT32)len;
+
+            seq = m_sent + 1;
+            if (!IsConnected() || !SendFrameLocked(COLLECTOR_FRAME_RECORDS, stream, seq, p, chunk))
+            {
+                return 0;
+            }
+            m_sent = seq;
+            p += chunk;
+            len -= chunk;
+        } while (len != 0);
+
+        return seq;
+    }
+
+    //
+    // Block until frame seq is acked, reading ACKs off the socket. FALSE if
+    // the connection fails or the collector rejects something first
+    //
+    BOOL
+    WaitAcked (
+        IN UINT64   seq
+    )
+    {
+        std::lock_guard<std::mutex> lock(m_recvLock);
+
+        while (m_acked < seq)
+        {
+            COLLECTOR_FRAME_HEADER header;
+
+            if (!IsConnected() || !ReceiveAll(&header, sizeof(header)) || header.magic != COLLECTOR_FRAME_MAGIC)
+            {
+                Fail(COLLECTOR_STATUS_IO_ERROR);
+                return FALSE;
+            }
+
+            if (header.type == COLLECTOR_FRAME_ERROR)
+            {
+                Fail(header.status != COLLECTOR_STATUS_OK ? (COLLECTOR_STATUS)header.status : COLLECTOR_STATUS_IO_ERROR);
+                return FALSE;
+            }
+
+            if (header.type != COLLECTOR_FRAME_ACK || header.length != 0 || header.sequence > m_sent)
+            {
+                Fail(COLLECTOR_STATUS_BAD_FRAME);
+                return FALSE;
+            }
+
+            if (header.sequence > m_acked)
+            {
+                m_acked = header.sequence;
+            }
+        }
+        return TRUE;
+    }
+
+private:
+    static BOOL
+    StartSockets ()
+    {
+#if defined(_WIN32)
+        static const BOOL s_started = []() {
+            WSADATA wsaData;
+            return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+        }();
+        return s_started;
+#else
+        return TRUE;
+#endif
+    }
+
+    static VOID
+    CloseSocket (
+        IN COLLECTOR_SOCKET s
+    )
+    {
+#if defined(_WIN32)
+        closesocket(s);
+#else
+        close(s);
+#endif
+    }
+
+    VOID
+    SetOptions (
+        IN UINT32   timeoutMs
+    )
+    {
+        INT noDelay = 1;
+
+        setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, (const CHAR *)&noDelay, sizeof(noDelay));
+
+#if defined(_WIN32)
+        DWORD timeout = timeoutMs;
+#else
+        struct timeval timeout;
+
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_usec = (timeoutMs % 1000) * 1000;
+#endif
+        setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, (const CHAR *)&timeout, sizeof(timeout));
+        setsockopt(m_socket, SOL_SOCKET, SO_SNDTIMEO, (const CHAR *)&timeout, sizeof(timeout));
+    }
+
+    VOID
+    Fail (
+        IN COLLECTOR_STATUS status
+    )
+    {
+        UINT32 ok = COLLECTOR_STATUS_OK;
+
+        m_status.compare_exchange_strong(ok, (UINT32)status);
+    }
+
+    BOOL
+    SendFrame (
+        IN COLLECTOR_FRAME_TYPE type,
+        IN UINT32               stream,
+        IN UINT64               seq,
+        IN const VOID           *pPayload,
+        IN UINT32               len
+    )
+    {
+        std::lock_guard<std::mutex> lock(m_sendLock);
+        return SendFrameLocked(type, stream, seq, pPayload, len);
+    }
+
+    //
+    // Header and payload in one send so a frame is never split by Nagle and
+    // delayed acks
+    //
+    BOOL
+    SendFrameLocked (
+        IN COLLECTOR_FRAME_TYPE type,
+        IN UINT32               stream,
+        IN UINT64               seq,
+        IN const VOID           *pPayload,
+        IN UINT32               len
+    )
+    {
+        COLLECTOR_FRAME_HEADER header;
+
+        CollectorInitFrame(&header, type, len);
+        header.stream = (UINT16)stream;
+        header.sequence = seq;
+
+        m_frame.resize(sizeof(header) + len);
+        memcpy(m_frame.data(), &header, sizeof(header));
+        if (len != 0)
+        {
+            memcpy(m_frame.data() + sizeof(header), pPayload, len);
+        }
+
+        const CHAR *p = m_frame.data();
+        SIZE_T left = m_frame.size();
+
+        while (left != 0)
+        {
+            INT n = send(m_socket, p, left > 0x40000000 ? 0x40000000 : (INT)left, 0);
+
+            if (n <= 0)
+            {
+                Fail(COLLECTOR_STATUS_IO_ERROR);
+                return FALSE;
+            }
+            p += n;
+            left -= (SIZE_T)n;
+        }
+        return TRUE;
+    }
+
+    BOOL
+    ReceiveAll (
+        OUT VOID    *pBuf,
+        IN  SIZE_T  len
+    )
+    {
+        CHAR *p = (CHAR *)pBuf;
+
+        while (len != 0)
+        {
+            INT n = recv(m_socket, p, len > 0x40000000 ? 0x40000000 : (INT)len, 0);
+
+            if (n <= 0)
+            {
+                return FALSE;
+            }
+            p += n;
+            len -= (SIZE_T)n;
+        }
+        return TRUE;
+    }
+
+    BOOL
+    ReceiveHelloAck (
+        OUT PCOLLECTOR_HELLO_ACK    pAck
+    )
+    {
+        COLLECTOR_FRAME_HEADER header;
+
+        if (!ReceiveAll(&header, sizeof(header)) || header.magic != COLLECTOR_FRAME_MAGIC)
+        {
+            return FALSE;
+        }
+
+        if (header.type == COLLECTOR_FRAME_ERROR)
+        {
+            Fail(header.status != COLLECTOR_STATUS_OK ? (COLLECTOR_STATUS)header.status : COLLECTOR_STATUS_IO_ERROR);
+            return FALSE;
+        }
+
+        return header.type == COLLECTOR_FRAME_HELLO_ACK &&
+               header.length == sizeof(COLLECTOR_HELLO_ACK) &&
+               ReceiveAll(pAck, sizeof(COLLECTOR_HELLO_ACK)) &&
+               pAck->version == COLLECTOR_VERSION;
+    }
+
+    COLLECTOR_SOCKET        m_socket;
+    std::mutex              m_sendLock;
+    std::mutex              m_recvLock;
+    std::vector<CHAR>       m_frame;
+    std::atomic<UINT64>     m_sent;
+    std::atomic<UINT64>     m_acked;
+    std::atomic<UINT32>     m_status;
+};
+
+//
+// One stream of a collector connection as an AsyncLog sink
+//
+class CollectorSink : public AsyncLogSink
+{
+public:
+    CollectorSink (
+        IN CollectorClient  *pClient,
+        IN COLLECTOR_STREAM stream
+    )
+        : m_pClient(pClient),
+          m_stream(stream)
+    {
+    }
+
+    virtual BOOL
+    Write (
+        IN const VOID   *pData,
+        IN SIZE_T       len
+    )
+    {
+        return m_pClient->Send(m_stream, pData, len) != 0;
+    }
+
+    //
+    // Everything sent so far on any stream is durable
+    //
+    virtual BOOL
+    Sync ()
+    {
+        return m_pClient->WaitAcked(m_pClient->Sent());
+    }
+
+private:
+    CollectorClient     *m_pClient;
+    COLLECTOR_STREAM    m_stream;
+};
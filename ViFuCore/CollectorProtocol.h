@@ -0,0 +1,143 @@
+/*++
+
+Module Name:
+
+    CollectorProtocol.h
+
+Abstract:
+
+    Wire format between a guest's ViFuR3 and the host log collector
+    (ViFuCollector), over TCP or a hypervisor socket.
+
+    Every message is a COLLECTOR_FRAME_HEADER followed by `length` payload
+    bytes, all little endian.
+
+        guest                               collector
+        HELLO (guest id, campaign id)   ->
+                                        <-  HELLO_ACK (journal state, where to
+                                                       resume)
+        RECORDS (stream, seq n, bytes)  ->
+        RECORDS (stream, seq n+1, ...)  ->
+                                        <-  ACK (seq n+1 is durable)
+                                        <-  ERROR (status), then disconnect
+
+    RECORDS sequence numbers start at 1 on every connection and go up by one
+    per frame across both streams. An ACK covers every frame up to and
+    including its sequence, and only goes out once the collector has the data
+    on disk as configured (written, or written and fdatasync'd). Journal
+    payloads are whole FUZZ_JOURNAL_RECORDs continuing the collector's copy of
+    the journal, the HELLO_ACK says where that copy ends.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include "FuzzJournal.h"
+
+#define COLLECTOR_FRAME_MAGIC       0x46434656      // 'VFCF'
+#define COLLECTOR_VERSION           3
+#define COLLECTOR_DEFAULT_PORT      7331
+#define COLLECTOR_MAX_PAYLOAD       (1 << 20)
+#define COLLECTOR_GUEST_ID_LEN      32
+
+typedef enum _COLLECTOR_FRAME_TYPE
+{
+    COLLECTOR_FRAME_HELLO = 1,
+    COLLECTOR_FRAME_HELLO_ACK,
+    COLLECTOR_FRAME_RECORDS,
+    COLLECTOR_FRAME_ACK,
+    COLLECTOR_FRAME_ERROR
+} COLLECTOR_FRAME_TYPE;
+
+typedef enum _COLLECTOR_STREAM
+{
+    COLLECTOR_STREAM_LOG = 0,           // VIFU_LOG.txt text
+    COLLECTOR_STREAM_JOURNAL,           // fuzz_journal.bin records
+    COLLECTOR_STREAM_MAX
+} COLLECTOR_STREAM;
+
+typedef enum _COLLECTOR_STATUS
+{
+    COLLECTOR_STATUS_OK = 0,
+    COLLECTOR_STATUS_BAD_FRAME,         // Bad magic, type, length or sequence
+    COLLECTOR_STATUS_BAD_GUEST_ID,
+    COLLECTOR_STATUS_GUEST_BUSY,        // Guest id already connected
+    COLLECTOR_STATUS_BAD_JOURNAL,       // Record out of sequence, wrong campaign or checksum
+    COLLECTOR_STATUS_IO_ERROR
+} COLLECTOR_STATUS;
+
+typedef struct _COLLECTOR_FRAME_HEADER
+{
+    UINT32  magic;
+    UINT16  type;                       // COLLECTOR_FRAME_TYPE
+    UINT16  stream;                     // COLLECTOR_STREAM, RECORDS only
+    UINT32  length;                     // Payload bytes after the header
+    UINT32  status;                     // COLLECTOR_STATUS, ERROR only
+    UINT64  sequence;                   // RECORDS: frame number, ACK: last durable frame
+} COLLECTOR_FRAME_HEADER, *PCOLLECTOR_FRAME_HEADER;
+
+//
+// guestId names the guest's directory on the collector, [A-Za-z0-9_.-] only.
+// campaignId is used only if the collector has no journal for the guest yet
+//
+typedef struct _COLLECTOR_HELLO
+{
+    UINT32  version;
+    UINT32  rsvd;
+    UINT64  campaignId;
+    CHAR    guestId[COLLECTOR_GUEST_ID_LEN];
+} COLLECTOR_HELLO, *PCOLLECTOR_HELLO;
+
+#define COLLECTOR_HELLO_FLAG_AUTO_START     0x01    // autoStart.txt is in the collector's directory
+
+typedef struct _COLLECTOR_HELLO_ACK
+{
+    UINT32              version;
+    UINT32              flags;
+    UINT64              campaignId;     // Of the collector's journal, continue with this one
+    UINT64              journalCount;   // Records in it, the next record's sequence
+    UINT64              logBytes;
+    FUZZ_JOURNAL_RESUME resume;         // FindResume of the journal, as far as it is durable
+} COLLECTOR_HELLO_ACK, *PCOLLECTOR_HELLO_ACK;
+
+C_ASSERT(sizeof(COLLECTOR_FRAME_HEADER) == 24);
+C_ASSERT(sizeof(COLLECTOR_HELLO) == 48);
+C_ASSERT(sizeof(COLLECTOR_HELLO_ACK) == 32 + sizeof(FUZZ_JOURNAL_RESUME));
+
+inline VOID
+CollectorInitFrame (
+    OUT PCOLLECTOR_FRAME_HEADER pHeader,
+    IN  COLLECTOR_FRAME_TYPE    type,
+    IN  UINT32                  length
+)
+{
+    memset(pHeader, 0, sizeof(COLLECTOR_FRAME_HEADER));
+    pHeader->magic = COLLECTOR_FRAME_MAGIC;
+    pHeader->type = (UINT16)type;
+    pHeader->length = length;
+}
+
+inline BOOL
+CollectorIsValidGuestId (
+    IN const CHAR   *pGuestId
+)
+{
+    SIZE_T len = 0;
+
+    for (; len < COLLECTOR_GUEST_ID_LEN && pGuestId[len] != '\0'; len++)
+    {
+        CHAR c = pGuestId[len];
+
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+              c == '_' || c == '-' || (c == '.' && len != 0)))
+        {
+            return FALSE;
+        }
+    }
+
+    return len != 0 && len < COLLECTOR_GUEST_ID_LEN;
+}
@@ -0,0 +1,606 @@
+/*++
+
+Module Name:
+
+    CoordinatorClient.h
+
+Abstract:
+
+    Guest side of the campaign coordinator protocol (CoordinatorProtocol.h).
+
+    CoordinatorClient holds the connection and the lease the guest is
+    working on, and gathers the results to go with the next report: Record()
+    per case status, RecordNovel() per new novelty entry. Requests are
+    synchronous, one frame out and its answer back, and may come from
+    several threads (fuzzing workers and a heartbeat thread).
+
+    CoordinatorRunLease() runs a lease on a WorkerPool. No chunk starts past
+    the high bound last promised to the coordinator: the worker about to
+    cross it first promises a new one, its chunk plus one more per worker,
+    so the window recorded if the guest dies stays a few chunks wide.
+    CoordinatorLeaseGate is that promise plus the heartbeat thread, for
+    workers that claim their own chunks (WorkerPool::RunWorkers).
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <thread>
+#include <condition_variable>
+#include "CoordinatorProtocol.h"
+#include "CollectorClient.h"
+#include "WorkerPool.h"
+
+class CoordinatorClient
+{
+public:
+    CoordinatorClient ()
+        : m_socket(COLLECTOR_INVALID_SOCKET),
+          m_status(COORD_STATUS_OK),
+          m_leaseId(0),
+          m_leaseEnd(0)
+    {
+        memset(&m_report, 0, sizeof(m_report));
+    }
+
+    ~CoordinatorClient ()
+    {
+        Close();
+    }
+
+    //
+    // Connect and say hello. pAck gets the campaign id to seed the case space
+    // with and how often to heartbeat
+    //
+    BOOL
+    Connect (
+        IN  const CHAR          *host,
+        IN  UINT16              port,
+        IN  const CHAR          *guestId,
+        IN  UINT32              workers,
+        IN  UINT32              timeoutMs,
+        OUT PCOORD_HELLO_ACK    pAck
+    )
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        struct addrinfo     hints = {};
+        struct addrinfo     *pAddrs = NULL;
+        CHAR                service[8];
+        COORD_HELLO         hello = {};
+        COORD_FRAME_HEADER  header;
+
+        if (!StartSockets() || !CollectorIsValidGuestId(guestId))
+        {
+            return FALSE;
+        }
+        CloseLocked();
+
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(service, sizeof(service), "%u", port);
+        if (getaddrinfo(host, service, &hints, &pAddrs) != 0)
+        {
+            return FALSE;
+        }
+
+        for (struct addrinfo *pAddr = pAddrs; pAddr != NULL; pAddr = pAddr->ai_next)
+        {
+            m_socket = socket(pAddr->ai_family, pAddr->ai_socktype, pAddr->ai_protocol);
+            if (m_socket == COLLECTOR_INVALID_SOCKET)
+            {
+                continue;
+            }
+            if (connect(m_socket, pAddr->ai_addr, (INT)pAddr->ai_addrlen) == 0)
+            {
+                break;
+            }
+            CloseSocket(m_socket);
+            m_socket = COLLECTOR_INVALID_SOCKET;
+        }
+        freeaddrinfo(pAddrs);
+
+        if (m_socket == COLLECTOR_INVALID_SOCKET)
+        {
+            return FALSE;
+        }
+
+        SetOptions(timeoutMs);
+        m_status = COORD_STATUS_OK;
+        m_leaseId = 0;
+
+        hello.version = COORD_VERSION;
+        hello.workers = workers;
+        strncpy(hello.guestId, guestId, sizeof(hello.guestId) - 1);
+
+        if (!Request(COORD_FRAME_HELLO, &hello, sizeof(hello), NULL, 0, &header) ||
+            header.type != COORD_FRAME_HELLO_ACK ||
+            header.length != sizeof(COORD_HELLO_ACK) ||
+            !ReceiveAll(pAck, sizeof(COORD_HELLO_ACK)) ||
+            pAck->version != COORD_VERSION)
+        {
+            CloseLocked();
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    VOID
+    Close ()
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        CloseLocked();
+    }
+
+    BOOL
+    IsConnected ()
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        return m_socket != COLLECTOR_INVALID_SOCKET;
+    }
+
+    //
+    // Why the last request failed
+    //
+    COORD_STATUS Status () const { return (COORD_STATUS)m_status.load(); }
+
+    //
+    // Shape of the guest's case space, checked by the coordinator on every
+    // lease request
+    //
+    VOID
+    SetSpace (
+        IN UINT64   caseCount,
+        IN UINT32   casesPerCombo
+    )
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_report.caseCount = caseCount;
+        m_report.casesPerCombo = casesPerCombo;
+    }
+
+    //
+    // A case's HV status, reported with the next request
+    //
+    VOID
+    Record (
+        IN UINT32   hvStatus,
+        IN UINT64   n = 1
+    )
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_report.statusCounts[CoordStatusSlot(hvStatus)] += n;
+    }
+
+    VOID
+    RecordError ()
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_report.errors++;
+    }
+
+    VOID
+    RecordNovel (
+        IN const NOVELTY_ENTRY  &entry
+    )
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_novel.push_back(entry);
+    }
+
+    //
+    // Report the held lease done and get the next. A lease with begin == end
+    // and no COORD_LEASE_FLAG_DONE means ask again later
+    //
+    BOOL
+    RequestLease (
+        OUT PCOORD_LEASE    pLease
+    )
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        COORD_FRAME_HEADER header;
+
+        m_report.leaseId = m_leaseId;
+        m_report.low = m_leaseEnd;
+        m_report.high = m_leaseEnd;
+        if (!SendReport(COORD_FRAME_LEASE_REQUEST, &header) ||
+            header.type != COORD_FRAME_LEASE ||
+            header.length != sizeof(COORD_LEASE) ||
+            !ReceiveAll(pLease, sizeof(COORD_LEASE)))
+        {
+            Fail(COORD_STATUS_IO_ERROR);
+            return FALSE;
+        }
+
+        m_leaseId = pLease->leaseId;
+        m_leaseEnd = pLease->end;
+        return TRUE;
+    }
+
+    //
+    // Tell the coordinator the guest is alive and what of the lease is in
+    // flight, see COORD_REPORT. COORD_STATUS_LEASE_LOST if the lease was
+    // taken back, the guest should drop it
+    //
+    COORD_STATUS
+    Heartbeat (
+        IN UINT64   low,
+        IN UINT64   high
+    )
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        COORD_FRAME_HEADER header;
+
+        if (m_leaseId == 0)
+        {
+            return COORD_STATUS_LEASE_LOST;
+        }
+
+        m_report.leaseId = m_leaseId;
+        m_report.low = low;
+        m_report.high = high;
+        if (!SendReport(COORD_FRAME_HEARTBEAT, &header) ||
+            header.type != COORD_FRAME_HEARTBEAT_ACK ||
+            header.length != 0)
+        {
+            Fail(COORD_STATUS_IO_ERROR);
+            return COORD_STATUS_IO_ERROR;
+        }
+
+        if (header.status == COORD_STATUS_LEASE_LOST)
+        {
+            m_leaseId = 0;
+            m_leaseEnd = 0;
+        }
+        return (COORD_STATUS)header.status;
+    }
+
+private:
+    static BOOL
+    StartSockets ()
+    {
+#if defined(_WIN32)
+        static const BOOL s_started = []() {
+            WSADATA wsaData;
+            return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+        }();
+        return s_started;
+#else
+        return TRUE;
+#endif
+    }
+
+    static VOID
+    CloseSocket (
+        IN COLLECTOR_SOCKET s
+    )
+    {
+#if defined(_WIN32)
+        closesocket(s);
+#else
+        close(s);
+#endif
+    }
+
+    VOID
+    CloseLocked ()
+    {
+        if (m_socket != COLLECTOR_INVALID_SOCKET)
+        {
+            CloseSocket(m_socket);
+            m_socket = COLLECTOR_INVALID_SOCKET;
+        }
+    }
+
+    VOID
+    SetOptions (
+        IN UINT32   timeoutMs
+    )
+    {
+        INT noDelay = 1;
+
+        setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, (const CHAR *)&noDelay, sizeof(noDelay));
+
+#if defined(_WIN32)
+        DWORD timeout = timeoutMs;
+#else
+        struct timeval timeout;
+
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_usec = (timeoutMs % 1000) * 1000;
+#endif
+        setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, (const CHAR *)&timeout, sizeof(timeout));
+        setsockopt(m_socket, SOL_SOCKET, SO_SNDTIMEO, (const CHAR *)&timeout, sizeof(timeout));
+    }
+
+    VOID
+    Fail (
+        IN COORD_STATUS status
+    )
+    {
+        if (m_status == COORD_STATUS_OK)
+        {
+            m_status = status;
+        }
+        CloseLocked();
+    }
+
+    //
+    // Send the pending report, novelty entries after it, and clear what went out
+    //
+    BOOL
+    SendReport (
+        IN  COORD_FRAME_TYPE    type,
+        OUT PCOORD_FRAME_HEADER pHeader
+    )
+    {
+        SIZE_T novelCnt = m_novel.size() < COORD_MAX_NOVEL ? m_novel.size() : COORD_MAX_NOVEL;
+
+        m_report.novelCnt = (UINT32)novelCnt;
+        if (!Request(type,
+                     &m_report,
+                     sizeof(m_report),
+                     novelCnt != 0 ? m_novel.data() : NULL,
+                     (UINT32)(novelCnt * sizeof(NOVELTY_ENTRY)),
+                     pHeader))
+        {
+            return FALSE;
+        }
+
+        m_novel.erase(m_novel.begin(), m_novel.begin() + novelCnt);
+        m_report.errors = 0;
+        memset(m_report.statusCounts, 0, sizeof(m_report.statusCounts));
+        return TRUE;
+    }
+
+    //
+    // One frame out, in one send, and the header of the answer back. An
+    // ERROR answer fails the request with its status
+    //
+    BOOL
+    Request (
+        IN  COORD_FRAME_TYPE    type,
+        IN  const VOID          *pPayload,
+        IN  UINT32              len,
+        IN  const VOID          *pExtra,
+        IN  UINT32              extraLen,
+        OUT PCOORD_FRAME_HEADER pHeader
+    )
+    {
+        COORD_FRAME_HEADER header;
+
+        if (m_socket == COLLECTOR_INVALID_SOCKET)
+        {
+            return FALSE;
+        }
+
+        CoordInitFrame(&header, type, len + extraLen);
+        m_frame.resize(sizeof(header) + len + extraLen);
+        memcpy(m_frame.data(), &header, sizeof(header));
+        memcpy(m_frame.data() + sizeof(header), pPayload, len);
+        if (extraLen != 0)
+        {
+            memcpy(m_frame.data() + sizeof(header) + len, pExtra, extraLen);
+        }
+
+        const CHAR *p = m_frame.data();
+        SIZE_T left = m_frame.size();
+
+        while (left != 0)
+        {
+            INT n = send(m_socket, p, left > 0x40000000 ? 0x40000000 : (INT)left, 0);
+
+            if (n <= 0)
+            {
+                Fail(COORD_STATUS_IO_ERROR);
+                return FALSE;
+            }
+            p += n;
+            left -= (SIZE_T)n;
+        }
+
+        if (!ReceiveAll(pHeader, sizeof(COORD_FRAME_HEADER)) || pHeader->magic != COORD_FRAME_MAGIC)
+        {
+            Fail(COORD_STATUS_IO_ERROR);
+            return FALSE;
+        }
+        if (pHeader->type == COORD_FRAME_ERROR)
+        {
+            Fail(pHeader->status != COORD_STATUS_OK ? (COORD_STATUS)pHeader->status : COORD_STATUS_IO_ERROR);
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    BOOL
+    ReceiveAll (
+        OUT VOID    *pBuf,
+        IN  SIZE_T  len
+    )
+    {
+        CHAR *p = (CHAR *)pBuf;
+
+        while (len != 0)
+        {
+            INT n = recv(m_socket, p, len > 0x40000000 ? 0x40000000 : (INT)len, 0);
+
+            if (n <= 0)
+            {
+                return FALSE;
+            }
+            p += n;
+            len -= (SIZE_T)n;
+        }
+        return TRUE;
+    }
+
+    COLLECTOR_SOCKET            m_socket;
+    std::mutex                  m_lock;
+    std::vector<CHAR>           m_frame;
+    std::atomic<UINT32>         m_status;
+    UINT64                      m_leaseId;
+    UINT64                      m_leaseEnd;
+    COORD_REPORT                m_report;
+    std::vector<NOVELTY_ENTRY>  m_novel;
+};
+
+//
+// Heartbeats a lease every heartbeatMs from its own thread while the pool
+// runs it. Admit() is asked before a chunk starts, Finish() once the pool is
+// done. On a heartbeat that fails the pool is stopped
+//
+class CoordinatorLeaseGate
+{
+public:
+    CoordinatorLeaseGate (
+        IN OUT CoordinatorClient    &client,
+        IN OUT WorkerPool           &pool,
+        IN     const COORD_LEASE    &lease,
+        IN     UINT64               chunk,
+        IN     UINT32               heartbeatMs
+    )
+        : m_client(client),
+          m_pool(pool),
+          m_end(lease.end),
+          m_chunk(chunk),
+          m_heartbeatMs(heartbeatMs),
+          m_promised(lease.begin),
+          m_status(COORD_STATUS_OK),
+          m_bDone(false)
+    {
+        m_heartbeat = std::thread([this]() { Heartbeat(); });
+    }
+
+    ~CoordinatorLeaseGate ()
+    {
+        Finish();
+    }
+
+    //
+    // May the chunk ending at end start? Promises a new high bound first if
+    // it crosses the last one. FALSE once the lease is abandoned
+    //
+    BOOL
+    Admit (
+        IN UINT64   end
+    )
+    {
+        std::lock_guard<std::mutex> lock(m_promiseLock);
+
+        if (m_status != COORD_STATUS_OK)
+        {
+            return FALSE;
+        }
+        if (end > m_promised)
+        {
+            UINT64 high = m_pool.HighWatermark() > end ? m_pool.HighWatermark() : end;
+            UINT64 next = high + m_pool.Workers() * m_chunk;
+            COORD_STATUS hbStatus;
+
+            next = next < m_end ? next : m_end;
+            hbStatus = m_client.Heartbeat(m_pool.LowWatermark(), next);
+            if (hbStatus != COORD_STATUS_OK)
+            {
+                Abandon(hbStatus);
+                return FALSE;
+            }
+            m_promised = next;
+        }
+        return TRUE;
+    }
+
+    //
+    // Stop heartbeating. COORD_STATUS_OK unless the lease was abandoned
+    //
+    COORD_STATUS
+    Finish ()
+    {
+        if (m_heartbeat.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_promiseLock);
+                m_bDone = true;
+            }
+            m_done.notify_all();
+            m_heartbeat.join();
+        }
+        return (COORD_STATUS)m_status.load();
+    }
+
+private:
+    CoordinatorLeaseGate (const CoordinatorLeaseGate &) = delete;
+    CoordinatorLeaseGate &operator= (const CoordinatorLeaseGate &) = delete;
+
+    VOID
+    Heartbeat ()
+    {
+        std::unique_lock<std::mutex> lock(m_promiseLock);
+
+        while (!m_done.wait_for(lock, std::chrono::milliseconds(m_heartbeatMs), [this]() { return m_bDone; }))
+        {
+            COORD_STATUS hbStatus = m_client.Heartbeat(m_pool.LowWatermark(), m_promised);
+
+            if (hbStatus != COORD_STATUS_OK)
+            {
+                Abandon(hbStatus);
+                break;
+            }
+        }
+    }
+
+    VOID
+    Abandon (
+        IN COORD_STATUS why
+    )
+    {
+        UINT32 ok = COORD_STATUS_OK;
+
+        m_status.compare_exchange_strong(ok, (UINT32)why);
+        m_pool.Stop();
+    }
+
+    CoordinatorClient           &m_client;
+    WorkerPool                  &m_pool;
+    UINT64                      m_end;
+    UINT64                      m_chunk;
+    UINT32                      m_heartbeatMs;
+    std::mutex                  m_promiseLock;
+    std::condition_variable     m_done;
+    std::thread                 m_heartbeat;
+    UINT64                      m_promised;
+    std::atomic<UINT32>         m_status;
+    bool                        m_bDone;
+};
+
+//
+// Run the lease's cases on the pool, fn(worker, begin, end, counters) per
+// chunk of chunk indices, heartbeating every heartbeatMs meanwhile. Returns
+// COORD_STATUS_OK once the lease is done, else why it was abandoned, with
+// the chunks already running finished
+//
+template <typename FN>
+inline COORD_STATUS
+CoordinatorRunLease (
+    IN OUT CoordinatorClient    &client,
+    IN OUT WorkerPool           &pool,
+    IN     const COORD_LEASE    &lease,
+    IN     UINT64               chunk,
+    IN     UINT32               heartbeatMs,
+    IN     FN                   fn
+)
+{
+    pool.Seed(lease.begin, lease.end, chunk);
+
+    CoordinatorLeaseGate gate(client, pool, lease, chunk, heartbeatMs);
+
+    pool.Run([&](UINT32 w, UINT64 begin, UINT64 end, WorkerCounters &counters) {
+        if (gate.Admit(end))
+        {
+            fn(w, begin, end, counters);
+        }
+    });
+    return gate.Finish();
+}
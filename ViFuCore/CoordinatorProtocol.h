@@ -0,0 +1,180 @@
+/*++
+
+Module Name:
+
+    CoordinatorProtocol.h
+
+Abstract:
+
+    Wire format between a guest's ViFuR3 and the campaign coordinator
+    (ViFuCoordinator), over TCP. The coordinator leases ranges of the case
+    space (CaseSpace.h) to guests so a fleet of child partitions splits one
+    campaign between them.
+
+    Every message is a COORD_FRAME_HEADER followed by `length` payload
+    bytes, all little endian. The guest always sends, the coordinator
+    answers each request with one frame.
+
+        guest                                   coordinator
+        HELLO (guest id, workers)           ->
+                                            <-  HELLO_ACK (campaign id, timing)
+        LEASE_REQUEST (report, space shape) ->
+                                            <-  LEASE (id, [begin, end))
+        HEARTBEAT (report)                  ->
+                                            <-  HEARTBEAT_ACK (status)
+        LEASE_REQUEST (report of the done lease, ...)
+                                            <-  ERROR (status), then disconnect
+
+    A guest heartbeats at least every heartbeatMs while it holds a lease. A
+    lease not heartbeated for leaseTimeoutMs, or whose guest disconnects or
+    says hello again, is taken back: its in-flight window [low, high) from
+    the last report is recorded as the likely crash and not leased again,
+    the rest of the lease goes to the next guest asking. Heartbeats for a
+    lease taken back get COORD_STATUS_LEASE_LOST.
+
+    Reports carry the guest's results since its last report: a count per HV
+    status and the novelty entries it found new (NoveltyTracker.h), which
+    the coordinator merges into campaign totals.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include "CollectorProtocol.h"
+#include "NoveltyTracker.h"
+
+#define COORD_FRAME_MAGIC           0x43434656      // 'VFCC'
+#define COORD_VERSION               1
+#define COORD_DEFAULT_PORT          7332
+#define COORD_MAX_PAYLOAD           (1 << 20)
+#define COORD_GUEST_ID_LEN          COLLECTOR_GUEST_ID_LEN
+
+//
+// HV status codes counted one by one, anything above in the last slot
+//
+#define COORD_STATUS_SLOTS          128
+
+//
+// Novelty entries per report, the rest go with the next one
+//
+#define COORD_MAX_NOVEL             ((COORD_MAX_PAYLOAD - sizeof(COORD_REPORT)) / sizeof(NOVELTY_ENTRY))
+
+typedef enum _COORD_FRAME_TYPE
+{
+    COORD_FRAME_HELLO = 1,
+    COORD_FRAME_HELLO_ACK,
+    COORD_FRAME_LEASE_REQUEST,
+    COORD_FRAME_LEASE,
+    COORD_FRAME_HEARTBEAT,
+    COORD_FRAME_HEARTBEAT_ACK,
+    COORD_FRAME_ERROR
+} COORD_FRAME_TYPE;
+
+typedef enum _COORD_STATUS
+{
+    COORD_STATUS_OK = 0,
+    COORD_STATUS_BAD_FRAME,             // Bad magic, type, length or version
+    COORD_STATUS_BAD_GUEST_ID,
+    COORD_STATUS_SPACE_MISMATCH,        // Guest's case space differs from the campaign's
+    COORD_STATUS_LEASE_LOST,            // Lease taken back, drop it and ask for another
+    COORD_STATUS_IO_ERROR
+} COORD_STATUS;
+
+typedef struct _COORD_FRAME_HEADER
+{
+    UINT32  magic;
+    UINT16  type;                       // COORD_FRAME_TYPE
+    UINT16  rsvd;
+    UINT32  length;                     // Payload bytes after the header
+    UINT32  status;                     // COORD_STATUS, HEARTBEAT_ACK and ERROR
+} COORD_FRAME_HEADER, *PCOORD_FRAME_HEADER;
+
+//
+// guestId as for the collector, a guest that says hello again (it rebooted)
+// replaces its old connection
+//
+typedef struct _COORD_HELLO
+{
+    UINT32  version;
+    UINT32  workers;                    // Fuzzing threads of the guest
+    CHAR    guestId[COORD_GUEST_ID_LEN];
+} COORD_HELLO, *PCOORD_HELLO;
+
+#define COORD_HELLO_FLAG_AUTO_START     0x01    // autoStart.txt is in the coordinator's directory
+
+//
+// Every guest of the campaign seeds its case space with campaignId, so an
+// index means the same case everywhere
+//
+typedef struct _COORD_HELLO_ACK
+{
+    UINT32  version;
+    UINT32  flags;
+    UINT64  campaignId;
+    UINT32  heartbeatMs;
+    UINT32  leaseTimeoutMs;
+} COORD_HELLO_ACK, *PCOORD_HELLO_ACK;
+
+//
+// Results since the last report, followed by novelCnt NOVELTY_ENTRY.
+// [low, high) is what is in flight: every case below low is done, none at
+// or past high has started. A LEASE_REQUEST reports leaseId done with
+// low == high == its end, leaseId 0 for none
+//
+typedef struct _COORD_REPORT
+{
+    UINT64  caseCount;                  // Guest's CaseSpace::Count()
+    UINT32  casesPerCombo;
+    UINT32  novelCnt;
+    UINT64  leaseId;
+    UINT64  low;
+    UINT64  high;
+    UINT64  errors;                     // Batches the backend failed
+    UINT64  statusCounts[COORD_STATUS_SLOTS];
+} COORD_REPORT, *PCOORD_REPORT;
+
+#define COORD_LEASE_FLAG_DONE   0x01    // Nothing left to lease, the campaign is over
+
+//
+// begin == end with COORD_LEASE_FLAG_DONE when there is nothing left. Leases
+// start and end on a combo boundary
+//
+typedef struct _COORD_LEASE
+{
+    UINT64  leaseId;
+    UINT64  begin;
+    UINT64  end;
+    UINT32  flags;
+    UINT32  rsvd;
+} COORD_LEASE, *PCOORD_LEASE;
+
+C_ASSERT(sizeof(COORD_FRAME_HEADER) == 16);
+C_ASSERT(sizeof(COORD_HELLO) == 40);
+C_ASSERT(sizeof(COORD_HELLO_ACK) == 24);
+C_ASSERT(sizeof(COORD_REPORT) == 48 + 8 * COORD_STATUS_SLOTS);
+C_ASSERT(sizeof(COORD_LEASE) == 32);
+
+inline VOID
+CoordInitFrame (
+    OUT PCOORD_FRAME_HEADER pHeader,
+    IN  COORD_FRAME_TYPE    type,
+    IN  UINT32              length
+)
+{
+    memset(pHeader, 0, sizeof(COORD_FRAME_HEADER));
+    pHeader->magic = COORD_FRAME_MAGIC;
+    pHeader->type = (UINT16)type;
+    pHeader->length = length;
+}
+
+inline UINT32
+CoordStatusSlot (
+    IN UINT32   hvStatus
+)
+{
+    return hvStatus < COORD_STATUS_SLOTS - 1 ? hvStatus : COORD_STATUS_SLOTS - 1;
+}
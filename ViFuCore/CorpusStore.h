@@ -0,0 +1,1071 @@
+/*++
+
+Module Name:
+
+    CorpusStore.h
+
+Abstract:
+
+    Content addressed, on-disk corpus of interesting cases: control word and
+    registers (CPU_REG_64) and, when the caller has it, the input page.
+
+    A case is stored once, under the SHA-256 of its bytes. Records are
+    appended to large segment files (segment.NNNNNN.vfc), so writes and a
+    full scan are sequential. Each record carries the case's hash, its tags
+    (HV status, novelty signature, discovered-at) and a CRC32C, so the
+    segments alone are the corpus.
+
+    The index (index.vfi) is an open addressing hash table of fixed size
+    slots in a memory mapped file: hash -> segment, offset and tags. A clean
+    open maps it and is done, whatever the size of the corpus. The index is
+    marked dirty while the store is open; one left dirty (the fuzzer died),
+    or not matching the segments, is rebuilt from the segments, cutting off
+    a torn record at the tail.
+
+    Insert hashes the case and builds its record outside any lock and finds
+    duplicates under the reader lock, so workers only serialise on the
+    append of a new case. Lookups share the reader lock with each other.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <shared_mutex>
+#include "FuzzJournal.h"
+
+#define CORPUS_SEGMENT_MAGIC        0x53434656      // 'VFCS'
+#define CORPUS_RECORD_MAGIC         0x52434656      // 'VFCR'
+#define CORPUS_INDEX_MAGIC          0x49434656      // 'VFCI'
+#define CORPUS_VERSION              1
+
+#define CORPUS_HASH_SIZE            32
+#define CORPUS_PAGE_SIZE            0x1000
+#define CORPUS_RECORD_ALIGN         64
+#define CORPUS_SEGMENT_HEADER_SIZE  64
+#define CORPUS_INDEX_HEADER_SIZE    64
+#define CORPUS_MIN_SLOTS            1024
+#define CORPUS_DEFAULT_SEGMENT_SIZE (1ULL << 30)
+
+#define CORPUS_INDEX_NAME           "index.vfi"
+#define CORPUS_SEGMENT_FORMAT       "segment.%06u.vfc"
+
+#define CORPUS_FLAG_USED            0x0001          // Index slot holds an entry
+#define CORPUS_FLAG_PAGE            0x0002          // Case has its input page
+
+#define CORPUS_INDEX_CLEAN          0x434C45414E    // 'CLEAN', written by Close
+#define CORPUS_INDEX_DIRTY          0
+
+typedef struct _CORPUS_HASH
+{
+    UINT8   bytes[CORPUS_HASH_SIZE];
+} CORPUS_HASH, *PCORPUS_HASH;
+
+//
+// What is known about a case besides its bytes
+//
+typedef struct _CORPUS_TAGS
+{
+    UINT64  novelty;                    // NoveltySignature of the result that made it interesting
+    UINT64  discoveredAt;               // Caller's clock, e.g. time()
+    UINT16  hvStatus;
+    UINT16  rsvd0;
+    UINT32  rsvd1;
+} CORPUS_TAGS, *PCORPUS_TAGS;
+
+//
+// A case, the page is part of it only when bPage is set
+//
+typedef struct _CORPUS_CASE
+{
+    CPU_REG_64  regs;
+    UINT32      bPage;
+    UINT32      rsvd;
+    UINT8       page[CORPUS_PAGE_SIZE];
+} CORPUS_CASE, *PCORPUS_CASE;
+
+//
+// Segment record header, followed by the registers and the page if any,
+// padded to CORPUS_RECORD_ALIGN
+//
+typedef struct _CORPUS_RECORD
+{
+    UINT32      magic;
+    UINT32      crc;                    // CRC32C of everything after this field, payload included
+    CORPUS_HASH hash;
+    UINT32      size;                   // Whole record, padding included
+    UINT16      flags;                  // CORPUS_FLAG_PAGE
+    UINT16      hvStatus;
+    UINT64      novelty;
+    UINT64      discoveredAt;
+} CORPUS_RECORD, *PCORPUS_RECORD;
+
+typedef struct _CORPUS_SEGMENT_HEADER
+{
+    UINT32  magic;
+    UINT16  version;
+    UINT16  rsvd0;
+    UINT32  segment;
+    UINT32  rsvd1;
+    UINT8   rsvd2[CORPUS_SEGMENT_HEADER_SIZE - 16];
+} CORPUS_SEGMENT_HEADER, *PCORPUS_SEGMENT_HEADER;
+
+typedef struct _CORPUS_SLOT
+{
+    CORPUS_HASH hash;
+    UINT64      novelty;
+    UINT64      discoveredAt;
+    UINT32      segment;
+    UINT32      offset;                 // Of the record in its segment
+    UINT32      size;
+    UINT16      flags;                  // CORPUS_FLAG_*
+    UINT16      hvStatus;
+} CORPUS_SLOT, *PCORPUS_SLOT;
+
+typedef struct _CORPUS_INDEX_HEADER
+{
+    UINT32  magic;
+    UINT16  version;
+    UINT16  rsvd0;
+    UINT64  state;                      // CORPUS_INDEX_CLEAN or _DIRTY
+    UINT64  slots;                      // Power of 2
+    UINT64  count;
+    UINT32  segments;
+    UINT32  rsvd1;
+    UINT64  tail;                       // Size of the last segment at Close
+    UINT8   rsvd2[CORPUS_INDEX_HEADER_SIZE - 48];
+} CORPUS_INDEX_HEADER, *PCORPUS_INDEX_HEADER;
+
+C_ASSERT(sizeof(CORPUS_TAGS) == 24);
+C_ASSERT(sizeof(CORPUS_RECORD) == CORPUS_RECORD_ALIGN);
+C_ASSERT(sizeof(CORPUS_SEGMENT_HEADER) == CORPUS_SEGMENT_HEADER_SIZE);
+C_ASSERT(sizeof(CORPUS_SLOT) == 64);
+C_ASSERT(sizeof(CORPUS_INDEX_HEADER) == CORPUS_INDEX_HEADER_SIZE);
+
+typedef enum _CORPUS_INSERT
+{
+    CORPUS_INSERT_NEW = 0,
+    CORPUS_INSERT_DUPLICATE,            // Already stored, tags left as they were
+    CORPUS_INSERT_ERROR
+} CORPUS_INSERT;
+
+typedef struct _CORPUS_CONFIG
+{
+    UINT64  segmentSize;                // Roll over to a new segment past this, 0 for the default
+    UINT64  expected;                   // Entries to size a new index for
+} CORPUS_CONFIG, *PCORPUS_CONFIG;
+
+typedef struct _CORPUS_STATS
+{
+    UINT64  inserted;
+    UINT64  duplicates;
+    UINT64  rebuilt;                    // Entries read back from the segments by Open
+    UINT64  tornBytes;                  // Cut off the last segment by Open
+    UINT64  grows;
+} CORPUS_STATS, *PCORPUS_STATS;
+
+//
+// SHA-256 (FIPS 180-4)
+//
+class CorpusSha256
+{
+public:
+    CorpusSha256 ()
+        : m_bytes(0),
+          m_used(0)
+    {
+        static const UINT32 s_init[8] =
+        {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+
+        memcpy(m_state, s_init, sizeof(m_state));
+    }
+
+    VOID
+    Update (
+        IN const VOID   *pData,
+        IN SIZE_T       len
+    )
+    {
+        const UINT8 *pBytes = (const UINT8 *)pData;
+
+        m_bytes += len;
+        if (m_used != 0)
+        {
+            SIZE_T take = len < 64 - m_used ? len : 64 - m_used;
+
+            memcpy(m_block + m_used, pBytes, take);
+            m_used += (UINT32)take;
+            pBytes += take;
+            len -= take;
+            if (m_used < 64)
+            {
+                return;
+            }
+            Compress(m_block);
+            m_used = 0;
+        }
+        for (; len >= 64; pBytes += 64, len -= 64)
+        {
+            Compress(pBytes);
+        }
+        memcpy(m_block, pBytes, len);
+        m_used = (UINT32)len;
+    }
+
+    VOID
+    Final (
+        OUT PCORPUS_HASH    pHash
+    )
+    {
+        UINT64 bits = m_bytes * 8;
+
+        m_block[m_used++] = 0x80;
+        if (m_used > 56)
+        {
+            memset(m_block + m_used, 0, 64 - m_used);
+            Compress(m_block);
+            m_used = 0;
+        }
+        memset(m_block + m_used, 0, 56 - m_used);
+        for (UINT32 b = 0; b < 8; b++)
+        {
+            m_block[63 - b] = (UINT8)(bits >> (b * 8));
+        }
+        Compress(m_block);
+
+        for (UINT32 w = 0; w < 8; w++)
+        {
+            for (UINT32 b = 0; b < 4; b++)
+            {
+                pHash->bytes[w * 4 + b] = (UINT8)(m_state[w] >> (24 - b * 8));
+            }
+        }
+    }
+
+private:
+    static UINT32 Rotr (IN UINT32 x, IN UINT32 n) { return (x >> n) | (x << (32 - n)); }
+
+    VOID
+    Compress (
+        IN const UINT8  *pBlock
+    )
+    {
+        static const UINT32 s_k[64] =
+        {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        UINT32 w[64];
+        UINT32 v[8];
+
+        for (UINT32 t = 0; t < 16; t++)
+        {
+            w[t] = (UINT32)pBlock[t * 4] << 24 | (UINT32)pBlock[t * 4 + 1] << 16 |
+                   (UINT32)pBlock[t * 4 + 2] << 8 | pBlock[t * 4 + 3];
+        }
+        for (UINT32 t = 16; t < 64; t++)
+        {
+            UINT32 s0 = Rotr(w[t - 15], 7) ^ Rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+            UINT32 s1 = Rotr(w[t - 2], 17) ^ Rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+
+        memcpy(v, m_state, sizeof(v));
+        for (UINT32 t = 0; t < 64; t++)
+        {
+            UINT32 t1 = v[7] + (Rotr(v[4], 6) ^ Rotr(v[4], 11) ^ Rotr(v[4], 25)) +
+                        ((v[4] & v[5]) ^ (~v[4] & v[6])) + s_k[t] + w[t];
+            UINT32 t2 = (Rotr(v[0], 2) ^ Rotr(v[0], 13) ^ Rotr(v[0], 22)) +
+                        ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+
+            v[7] = v[6];
+            v[6] = v[5];
+            v[5] = v[4];
+            v[4] = v[3] + t1;
+            v[3] = v[2];
+            v[2] = v[1];
+            v[1] = v[0];
+            v[0] = t1 + t2;
+        }
+        for (UINT32 i = 0; i < 8; i++)
+        {
+            m_state[i] += v[i];
+        }
+    }
+
+    UINT32  m_state[8];
+    UINT64  m_bytes;
+    UINT32  m_used;
+    UINT8   m_block[64];
+};
+
+//
+// The hash a case is stored under: its registers, then its page if it has one
+//
+inline VOID
+CorpusHashCase (
+    IN  const CORPUS_CASE   &corpusCase,
+    OUT PCORPUS_HASH        pHash
+)
+{
+    CorpusSha256 sha;
+
+    sha.Update(&corpusCase.regs, sizeof(CPU_REG_64));
+    if (corpusCase.bPage)
+    {
+        sha.Update(corpusCase.page, CORPUS_PAGE_SIZE);
+    }
+    sha.Final(pHash);
+}
+
+inline UINT32
+CorpusRecordSize (
+    IN BOOL bPage
+)
+{
+    UINT32 size = sizeof(CORPUS_RECORD) + sizeof(CPU_REG_64) + (bPage ? CORPUS_PAGE_SIZE : 0);
+
+    return (size + CORPUS_RECORD_ALIGN - 1) & ~(CORPUS_RECORD_ALIGN - 1);
+}
+
+inline UINT32
+CorpusRecordCrc (
+    IN const CORPUS_RECORD  *pRecord
+)
+{
+    return FuzzJournalCrc32c((const UINT8 *)pRecord + offsetof(CORPUS_RECORD, hash),
+                             pRecord->size - offsetof(CORPUS_RECORD, hash));
+}
+
+//
+// Files of the store, opened read/write and created if missing
+//
+inline FUZZ_JOURNAL_FD
+CorpusOpenFile (
+    IN const std::string    &path,
+    IN BOOL                 bCreate
+)
+{
+#if defined(_WIN32)
+    return CreateFileA(path.c_str(),
+                       GENERIC_READ | GENERIC_WRITE,
+                       FILE_SHARE_READ,
+                       NULL,
+                       bCreate ? OPEN_ALWAYS : OPEN_EXISTING,
+                       0,
+                       NULL);
+#else
+    return open(path.c_str(), O_RDWR | (bCreate ? O_CREAT : 0), 0644);
+#endif
+}
+
+inline VOID
+CorpusCloseFile (
+    IN FUZZ_JOURNAL_FD  fd
+)
+{
+#if defined(_WIN32)
+    CloseHandle(fd);
+#else
+    close(fd);
+#endif
+}
+
+inline VOID
+CorpusMakeDirectory (
+    IN const std::string    &path
+)
+{
+#if defined(_WIN32)
+    CreateDirectoryA(path.c_str(), NULL);
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+}
+
+class CorpusStore
+{
+public:
+    CorpusStore ()
+        : m_segmentSize(CORPUS_DEFAULT_SEGMENT_SIZE),
+          m_indexFd(FUZZ_JOURNAL_INVALID_FD),
+          m_pIndex(NULL),
+          m_mapSize(0),
+          m_tail(0)
+#if defined(_WIN32)
+          , m_hMapping(NULL)
+#endif
+    {
+        memset(&m_stats, 0, sizeof(m_stats));
+        m_duplicates = 0;
+    }
+
+    ~CorpusStore ()
+    {
+        Close();
+    }
+
+    //
+    // Open the store in directory dir, creating it if needed. The index is
+    // rebuilt from the segments unless it was closed cleanly
+    //
+    BOOL
+    Open (
+        IN const CHAR           *dir,
+        IN const CORPUS_CONFIG  *pConfig = NULL
+    )
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(m_lock);
+        UINT64 expected = pConfig != NULL && pConfig->expected != 0 ? pConfig->expected : CORPUS_MIN_SLOTS / 2;
+        UINT64 slots = CORPUS_MIN_SLOTS;
+
+        CloseLocked();
+        memset(&m_stats, 0, sizeof(m_stats));
+        m_duplicates = 0;
+        m_dir = dir;
+        m_segmentSize = pConfig != NULL && pConfig->segmentSize != 0 ? pConfig->segmentSize : CORPUS_DEFAULT_SEGMENT_SIZE;
+        if (m_segmentSize > 0xFFFFFFFF)
+        {
+            m_segmentSize = 0xFFFFFFFF;
+        }
+        CorpusMakeDirectory(m_dir);
+
+        if (!OpenSegments())
+        {
+            CloseLocked();
+            return FALSE;
+        }
+
+        m_indexFd = CorpusOpenFile(m_dir + "/" + CORPUS_INDEX_NAME, TRUE);
+        if (m_indexFd == FUZZ_JOURNAL_INVALID_FD)
+        {
+            CloseLocked();
+            return FALSE;
+        }
+
+        if (!MapExistingIndex())
+        {
+            while (slots < expected * 2)
+            {
+                slots *= 2;
+            }
+            if (!CreateIndex(slots) || !Rebuild())
+            {
+                CloseLocked();
+                return FALSE;
+            }
+        }
+
+        //
+        // Dirty until Close, so a crash means a rebuild
+        //
+        m_pIndex->state = CORPUS_INDEX_DIRTY;
+        return TRUE;
+    }
+
+    VOID
+    Close ()
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(m_lock);
+
+        CloseLocked();
+    }
+
+    BOOL IsOpen () const { return m_pIndex != NULL; }
+
+    UINT64 Count () const { return m_pIndex != NULL ? m_pIndex->count : 0; }
+    UINT32 Segments () const { return (UINT32)m_segments.size(); }
+
+    VOID
+    GetStats (
+        OUT PCORPUS_STATS   pStats
+    )
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_lock);
+
+        *pStats = m_stats;
+        pStats->duplicates = m_duplicates;
+    }
+
+    //
+    // Store a case unless its hash is already there. pHash gets the hash
+    //
+    CORPUS_INSERT
+    Insert (
+        IN  const CORPUS_CASE   &corpusCase,
+        IN  const CORPUS_TAGS   &tags,
+        OUT PCORPUS_HASH        pHash = NULL
+    )
+    {
+        CORPUS_HASH hash;
+
+        CorpusHashCase(corpusCase, &hash);
+        if (pHash != NULL)
+        {
+            *pHash = hash;
+        }
+        return Insert(hash, corpusCase, tags);
+    }
+
+    //
+    // The same, for a caller that already has the hash
+    //
+    CORPUS_INSERT
+    Insert (
+        IN const CORPUS_HASH    &hash,
+        IN const CORPUS_CASE    &corpusCase,
+        IN const CORPUS_TAGS    &tags
+    )
+    {
+        UINT8           buffer[CORPUS_RECORD_ALIGN * 4 + CORPUS_PAGE_SIZE];
+        PCORPUS_RECORD  pRecord = (PCORPUS_RECORD)buffer;
+        UINT32          size = CorpusRecordSize(corpusCase.bPage);
+        UINT64          slot = 0;
+
+        //
+        // Most of what a fuzzer offers is already stored, that only needs
+        // the reader lock
+        //
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(m_lock);
+
+            if (m_pIndex != NULL && Find(hash, &slot))
+            {
+                m_duplicates++;
+                return CORPUS_INSERT_DUPLICATE;
+            }
+        }
+
+        //
+        // Built before taking the writer lock
+        //
+        memset(buffer, 0, size);
+        pRecord->magic = CORPUS_RECORD_MAGIC;
+        pRecord->hash = hash;
+        pRecord->size = size;
+        pRecord->flags = corpusCase.bPage ? CORPUS_FLAG_PAGE : 0;
+        pRecord->hvStatus = tags.hvStatus;
+        pRecord->novelty = tags.novelty;
+        pRecord->discoveredAt = tags.discoveredAt;
+        memcpy(pRecord + 1, &corpusCase.regs, sizeof(CPU_REG_64));
+        if (corpusCase.bPage)
+        {
+            memcpy((PUINT8)(pRecord + 1) + sizeof(CPU_REG_64), corpusCase.page, CORPUS_PAGE_SIZE);
+        }
+        pRecord->crc = CorpusRecordCrc(pRecord);
+
+        std::unique_lock<std::shared_timed_mutex> lock(m_lock);
+
+        if (m_pIndex == NULL)
+        {
+            return CORPUS_INSERT_ERROR;
+        }
+        if (Find(hash, &slot))
+        {
+            m_duplicates++;
+            return CORPUS_INSERT_DUPLICATE;
+        }
+
+        if ((m_pIndex->count + 1) * 10 > m_pIndex->slots * 7)
+        {
+            if (!Grow())
+            {
+                return CORPUS_INSERT_ERROR;
+            }
+            Find(hash, &slot);
+        }
+
+        if (m_tail + size > m_segmentSize && !AddSegment())
+        {
+            return CORPUS_INSERT_ERROR;
+        }
+        if (!FuzzJournalFdWrite(m_segments.back(), m_tail, pRecord, size))
+        {
+            return CORPUS_INSERT_ERROR;
+        }
+
+        Fill(&Slots()[slot], *pRecord, (UINT32)m_segments.size() - 1, (UINT32)m_tail);
+        m_tail += size;
+        m_pIndex->count++;
+        m_stats.inserted++;
+        return CORPUS_INSERT_NEW;
+    }
+
+    //
+    // Tags and location of a stored case, FALSE if it is not in the corpus
+    //
+    BOOL
+    Lookup (
+        IN  const CORPUS_HASH   &hash,
+        OUT PCORPUS_SLOT        pSlot
+    )
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_lock);
+        UINT64 slot = 0;
+
+        if (m_pIndex == NULL || !Find(hash, &slot))
+        {
+            return FALSE;
+        }
+        *pSlot = Slots()[slot];
+        return TRUE;
+    }
+
+    BOOL
+    Contains (
+        IN const CORPUS_CASE    &corpusCase
+    )
+    {
+        CORPUS_HASH hash;
+        CORPUS_SLOT slot;
+
+        CorpusHashCase(corpusCase, &hash);
+        return Lookup(hash, &slot);
+    }
+
+    //
+    // Read a case back, checking its record
+    //
+    BOOL
+    Read (
+        IN  const CORPUS_SLOT   &slot,
+        OUT PCORPUS_CASE        pCase
+    )
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_lock);
+        UINT8           buffer[CORPUS_RECORD_ALIGN * 4 + CORPUS_PAGE_SIZE];
+        PCORPUS_RECORD  pRecord = (PCORPUS_RECORD)buffer;
+
+        if (slot.segment >= m_segments.size() ||
+            slot.size > sizeof(buffer) ||
+            slot.size != CorpusRecordSize(slot.flags & CORPUS_FLAG_PAGE) ||
+            !FuzzJournalFdRead(m_segments[slot.segment], slot.offset, buffer, slot.size) ||
+            !CheckRecord(pRecord, slot.size) ||
+            memcmp(&pRecord->hash, &slot.hash, sizeof(CORPUS_HASH)) != 0)
+        {
+            return FALSE;
+        }
+
+        memset(pCase, 0, offsetof(CORPUS_CASE, page));
+        memcpy(&pCase->regs, pRecord + 1, sizeof(CPU_REG_64));
+        pCase->bPage = (pRecord->flags & CORPUS_FLAG_PAGE) != 0;
+        if (pCase->bPage)
+        {
+            memcpy(pCase->page, (PUINT8)(pRecord + 1) + sizeof(CPU_REG_64), CORPUS_PAGE_SIZE);
+        }
+        return TRUE;
+    }
+
+    //
+    // fn(const CORPUS_SLOT &) for every entry, in index order
+    //
+    template <typename FN>
+    VOID
+    ForEach (
+        IN FN   fn
+    )
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_lock);
+
+        for (UINT64 s = 0; m_pIndex != NULL && s < m_pIndex->slots; s++)
+        {
+            if (Slots()[s].flags & CORPUS_FLAG_USED)
+            {
+                fn(Slots()[s]);
+            }
+        }
+    }
+
+private:
+    PCORPUS_SLOT Slots () const { return (PCORPUS_SLOT)(m_pIndex + 1); }
+
+    static UINT64
+    IndexSize (
+        IN UINT64   slots
+    )
+    {
+        return CORPUS_INDEX_HEADER_SIZE + slots * sizeof(CORPUS_SLOT);
+    }
+
+    std::string
+    SegmentPath (
+        IN UINT32   segment
+    ) const
+    {
+        CHAR name[32];
+
+        snprintf(name, sizeof(name), CORPUS_SEGMENT_FORMAT, segment);
+        return m_dir + "/" + name;
+    }
+
+    static BOOL
+    CheckRecord (
+        IN const CORPUS_RECORD  *pRecord,
+        IN UINT32               size
+    )
+    {
+        return pRecord->magic == CORPUS_RECORD_MAGIC &&
+               pRecord->size == size &&
+               pRecord->size == CorpusRecordSize(pRecord->flags & CORPUS_FLAG_PAGE) &&
+               pRecord->crc == CorpusRecordCrc(pRecord);
+    }
+
+    static VOID
+    Fill (
+        OUT PCORPUS_SLOT        pSlot,
+        IN  const CORPUS_RECORD &record,
+        IN  UINT32              segment,
+        IN  UINT32              offset
+    )
+    {
+        pSlot->hash = record.hash;
+        pSlot->novelty = record.novelty;
+        pSlot->discoveredAt = record.discoveredAt;
+        pSlot->segment = segment;
+        pSlot->offset = offset;
+        pSlot->size = record.size;
+        pSlot->hvStatus = record.hvStatus;
+        pSlot->flags = CORPUS_FLAG_USED | (record.flags & CORPUS_FLAG_PAGE);
+    }
+
+    //
+    // TRUE and its slot if the hash is in the index, else FALSE and the
+    // empty slot it would go in
+    //
+    BOOL
+    Find (
+        IN  const CORPUS_HASH   &hash,
+        OUT PUINT64             pSlot
+    ) const
+    {
+        UINT64 mask = m_pIndex->slots - 1;
+        UINT64 slot = 0;
+
+        memcpy(&slot, hash.bytes, sizeof(slot));
+        for (slot &= mask;; slot = (slot + 1) & mask)
+        {
+            const CORPUS_SLOT *pEntry = &Slots()[slot];
+
+            if (!(pEntry->flags & CORPUS_FLAG_USED))
+            {
+                *pSlot = slot;
+                return FALSE;
+            }
+            if (memcmp(&pEntry->hash, &hash, sizeof(CORPUS_HASH)) == 0)
+            {
+                *pSlot = slot;
+                return TRUE;
+            }
+        }
+    }
+
+    //
+    // Segment files 0, 1, ... until the first missing one. Appends go to
+    // the last
+    //
+    BOOL
+    OpenSegments ()
+    {
+        for (UINT32 segment = 0;; segment++)
+        {
+            FUZZ_JOURNAL_FD fd = CorpusOpenFile(SegmentPath(segment), FALSE);
+
+            if (fd == FUZZ_JOURNAL_INVALID_FD)
+            {
+                break;
+            }
+            m_segments.push_back(fd);
+        }
+
+        if (m_segments.empty())
+        {
+            return AddSegment();
+        }
+        return FuzzJournalFdSize(m_segments.back(), &m_tail);
+    }
+
+    BOOL
+    AddSegment ()
+    {
+        CORPUS_SEGMENT_HEADER   header;
+        UINT32                  segment = (UINT32)m_segments.size();
+        FUZZ_JOURNAL_FD         fd = CorpusOpenFile(SegmentPath(segment), TRUE);
+
+        if (fd == FUZZ_JOURNAL_INVALID_FD)
+        {
+            return FALSE;
+        }
+
+        memset(&header, 0, sizeof(header));
+        header.magic = CORPUS_SEGMENT_MAGIC;
+        header.version = CORPUS_VERSION;
+        header.segment = segment;
+        if (!FuzzJournalFdTruncate(fd, 0) ||
+            !FuzzJournalFdWrite(fd, 0, &header, sizeof(header)))
+        {
+            CorpusCloseFile(fd);
+            return FALSE;
+        }
+        m_segments.push_back(fd);
+        m_tail = CORPUS_SEGMENT_HEADER_SIZE;
+        if (m_pIndex != NULL)
+        {
+            m_pIndex->segments = (UINT32)m_segments.size();
+        }
+        return TRUE;
+    }
+
+    BOOL
+    Map (
+        IN UINT64   size
+    )
+    {
+        Unmap();
+
+#if defined(_WIN32)
+        m_hMapping = CreateFileMapping(m_indexFd, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+        m_pIndex = m_hMapping != NULL ? (PCORPUS_INDEX_HEADER)MapViewOfFile(m_hMapping, FILE_MAP_WRITE, 0, 0, 0) : NULL;
+#else
+        VOID *pView = NULL;
+
+        if (ftruncate(m_indexFd, (off_t)size) != 0)
+        {
+            return FALSE;
+        }
+        pView = mmap(NULL, (SIZE_T)size, PROT_READ | PROT_WRITE, MAP_SHARED, m_indexFd, 0);
+        m_pIndex = pView != MAP_FAILED ? (PCORPUS_INDEX_HEADER)pView : NULL;
+#endif
+        m_mapSize = m_pIndex != NULL ? size : 0;
+        return m_pIndex != NULL;
+    }
+
+    VOID
+    Unmap ()
+    {
+#if defined(_WIN32)
+        if (m_pIndex != NULL)
+        {
+            UnmapViewOfFile(m_pIndex);
+        }
+        if (m_hMapping != NULL)
+        {
+            CloseHandle(m_hMapping);
+        }
+        m_hMapping = NULL;
+#else
+        if (m_pIndex != NULL)
+        {
+            munmap(m_pIndex, (SIZE_T)m_mapSize);
+        }
+#endif
+        m_pIndex = NULL;
+        m_mapSize = 0;
+    }
+
+    //
+    // A clean index that matches the segments is used as it is
+    //
+    BOOL
+    MapExistingIndex ()
+    {
+        CORPUS_INDEX_HEADER header;
+        UINT64              size = 0;
+
+        if (!FuzzJournalFdSize(m_indexFd, &size) ||
+            size < CORPUS_INDEX_HEADER_SIZE ||
+            !FuzzJournalFdRead(m_indexFd, 0, &header, sizeof(header)))
+        {
+            return FALSE;
+        }
+        if (header.magic != CORPUS_INDEX_MAGIC ||
+            header.version != CORPUS_VERSION ||
+            header.state != CORPUS_INDEX_CLEAN ||
+            header.slots < CORPUS_MIN_SLOTS ||
+            (header.slots & (header.slots - 1)) != 0 ||
+            size != IndexSize(header.slots) ||
+            header.count >= header.slots ||
+            header.segments != m_segments.size() ||
+            header.tail != m_tail)
+        {
+            return FALSE;
+        }
+        return Map(size);
+    }
+
+    BOOL
+    CreateIndex (
+        IN UINT64   slots
+    )
+    {
+        Unmap();
+
+        //
+        // Cut to nothing first so every slot reads back zero
+        //
+        if (!FuzzJournalFdTruncate(m_indexFd, 0) || !Map(IndexSize(slots)))
+        {
+            return FALSE;
+        }
+        memset(m_pIndex, 0, CORPUS_INDEX_HEADER_SIZE);
+        m_pIndex->magic = CORPUS_INDEX_MAGIC;
+        m_pIndex->version = CORPUS_VERSION;
+        m_pIndex->slots = slots;
+        m_pIndex->segments = (UINT32)m_segments.size();
+        return TRUE;
+    }
+
+    //
+    // Index every good record of every segment. The first bad record of the
+    // last segment is a torn append, it and anything after it are cut off
+    //
+    BOOL
+    Rebuild ()
+    {
+        std::vector<UINT8> chunk(CORPUS_RECORD_ALIGN * 4 + CORPUS_PAGE_SIZE);
+
+        for (UINT32 segment = 0; segment < m_segments.size(); segment++)
+        {
+            FUZZ_JOURNAL_FD fd = m_segments[segment];
+            UINT64          size = 0;
+            UINT64          offset = CORPUS_SEGMENT_HEADER_SIZE;
+
+            if (!FuzzJournalFdSize(fd, &size))
+            {
+                return FALSE;
+            }
+
+            while (offset + sizeof(CORPUS_RECORD) <= size)
+            {
+                PCORPUS_RECORD  pRecord = (PCORPUS_RECORD)chunk.data();
+                UINT64          slot = 0;
+
+                if (!FuzzJournalFdRead(fd, offset, pRecord, sizeof(CORPUS_RECORD)) ||
+                    pRecord->magic != CORPUS_RECORD_MAGIC ||
+                    pRecord->size != CorpusRecordSize(pRecord->flags & CORPUS_FLAG_PAGE) ||
+                    offset + pRecord->size > size ||
+                    !FuzzJournalFdRead(fd, offset, pRecord, pRecord->size) ||
+                    !CheckRecord(pRecord, pRecord->size))
+                {
+                    break;
+                }
+
+                if ((m_pIndex->count + 1) * 10 > m_pIndex->slots * 7 && !Grow())
+                {
+                    return FALSE;
+                }
+                if (!Find(pRecord->hash, &slot))
+                {
+                    Fill(&Slots()[slot], *pRecord, segment, (UINT32)offset);
+                    m_pIndex->count++;
+                    m_stats.rebuilt++;
+                }
+                offset += pRecord->size;
+            }
+
+            if (offset < size && segment + 1 == m_segments.size())
+            {
+                m_stats.tornBytes += size - offset;
+                if (!FuzzJournalFdTruncate(fd, offset))
+                {
+                    return FALSE;
+                }
+                m_tail = offset;
+            }
+        }
+        return TRUE;
+    }
+
+    //
+    // Twice the slots. Entries are copied out and put back, the index is
+    // dirty meanwhile so a crash here means a rebuild
+    //
+    BOOL
+    Grow ()
+    {
+        std::vector<CORPUS_SLOT>    entries;
+        UINT64                      slots = m_pIndex->slots * 2;
+        UINT64                      count = m_pIndex->count;
+
+        entries.reserve((SIZE_T)count);
+        for (UINT64 s = 0; s < m_pIndex->slots; s++)
+        {
+            if (Slots()[s].flags & CORPUS_FLAG_USED)
+            {
+                entries.push_back(Slots()[s]);
+            }
+        }
+
+        if (!CreateIndex(slots))
+        {
+            return FALSE;
+        }
+        for (SIZE_T e = 0; e < entries.size(); e++)
+        {
+            UINT64 slot = 0;
+
+            Find(entries[e].hash, &slot);
+            Slots()[slot] = entries[e];
+        }
+        m_pIndex->count = count;
+        m_pIndex->state = CORPUS_INDEX_DIRTY;
+        m_stats.grows++;
+        return TRUE;
+    }
+
+    VOID
+    CloseLocked ()
+    {
+        if (m_pIndex != NULL)
+        {
+            m_pIndex->segments = (UINT32)m_segments.size();
+            m_pIndex->tail = m_tail;
+            m_pIndex->state = CORPUS_INDEX_CLEAN;
+#if !defined(_WIN32)
+            msync(m_pIndex, (SIZE_T)m_mapSize, MS_SYNC);
+#endif
+        }
+        Unmap();
+        if (m_indexFd != FUZZ_JOURNAL_INVALID_FD)
+        {
+            CorpusCloseFile(m_indexFd);
+            m_indexFd = FUZZ_JOURNAL_INVALID_FD;
+        }
+        for (SIZE_T s = 0; s < m_segments.size(); s++)
+        {
+            CorpusCloseFile(m_segments[s]);
+        }
+        m_segments.clear();
+        m_tail = 0;
+    }
+
+    std::shared_timed_mutex         m_lock;
+    std::string                     m_dir;
+    UINT64                          m_segmentSize;
+    std::vector<FUZZ_JOURNAL_FD>    m_segments;
+    FUZZ_JOURNAL_FD                 m_indexFd;
+    PCORPUS_INDEX_HEADER            m_pIndex;
+    UINT64                          m_mapSize;
+    UINT64                          m_tail;             // Next append offset in the last segment
+#if defined(_WIN32)
+    HANDLE                          m_hMapping;
+#endif
+    CORPUS_STATS                    m_stats;
+    std::atomic<UINT64>             m_duplicates;       // Counted under the reader lock too
+};
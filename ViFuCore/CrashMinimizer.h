@@ -0,0 +1,628 @@
+/*++
+
+Module Name:
+
+    CrashMinimizer.h
+
+Abstract:
+
+    Delta-debugging reducer for a case that took the guest down: its control
+    word and registers (CPU_REG_64) and, where the backend owns it, its input
+    page. It clears as much of the case as it can while it still crashes,
+    leaving the bits that matter.
+
+    The case is viewed as atoms that can be cleared, coarse to fine in three
+    phases: whole qwords (registers and page qwords), then bytes, then single
+    bits of what is left. The call code (RCX 15:0) is never touched. Each
+    phase is ddmin over its atoms in case order: split them into n chunks
+    and try clearing everything but one chunk, then each chunk alone. A
+    reduction that still crashes becomes the new case; when none does, n
+    doubles until the chunks are single atoms. Chunks are contiguous, so
+    they are register ranges, bit ranges and page regions.
+
+    Candidates go to a MinTarget in batches, run in order. Every crash or
+    hang costs the target a reboot, passing candidates cost nothing but
+    their run, so:
+        - the reductions clearing the most go first in a batch, so the first
+          crash found is the biggest step and there are fewer of them
+        - candidates seen not to reproduce are remembered by content and
+          never run again
+        - a target that cannot tell which case of a failed batch it was has
+          the suspects bisected, each half a batch of its own
+        - what the original case does decides what reproducing is: a case
+          that hangs the guest is minimized as a hang. A candidate that hangs
+          when looking for a crash is a reboot and a timeout wasted, so it is
+          remembered and the batch size halves (a failure in a smaller batch
+          is cheaper to pin down); clean batches grow it back
+
+    MinBackendTarget runs candidates through any HcBackend with an injected
+    predicate saying whether a case crashed, so the search runs on any
+    platform against the simulated hypervisor (HcSimBackend.h).
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+#include <unordered_set>
+#include "HcBackend.h"
+#include "PageFill.h"
+
+#define MIN_REG_QWORDS          (sizeof(CPU_REG_64) / sizeof(UINT64))
+#define MIN_PAGE_QWORDS         (0x1000 / sizeof(UINT64))
+#define MIN_QWORDS              (MIN_REG_QWORDS + MIN_PAGE_QWORDS)
+#define MIN_RCX_QWORD           (offsetof(CPU_REG_64, rcx) / sizeof(UINT64))
+#define MIN_CALLCODE_MASK       0xffffULL
+#define MIN_CULPRIT_UNKNOWN     0xFFFFFFFF
+
+#define MIN_DEFAULT_MAX_BATCH   16
+#define MIN_DEFAULT_MAX_REBOOTS 1000
+
+//
+// A case to minimize. The page is only part of it when bPage is set
+//
+typedef struct _MIN_CASE
+{
+    CPU_REG_64  regs;
+    UINT32      bPage;
+    UINT32      rsvd;
+    UINT64      page[MIN_PAGE_QWORDS];
+} MIN_CASE, *PMIN_CASE;
+
+C_ASSERT(offsetof(MIN_CASE, page) == sizeof(CPU_REG_64) + 8);
+
+typedef enum _MIN_OUTCOME
+{
+    MIN_OUTCOME_PASS = 0,               // Ran, the guest carried on
+    MIN_OUTCOME_CRASH,                  // Guest bugchecked
+    MIN_OUTCOME_HANG                    // Guest stopped answering, the target timed out
+} MIN_OUTCOME;
+
+typedef enum _MIN_PHASE
+{
+    MIN_PHASE_QWORDS = 0,
+    MIN_PHASE_BYTES,
+    MIN_PHASE_BITS,
+    MIN_PHASE_COUNT
+} MIN_PHASE;
+
+typedef enum _MIN_STATUS
+{
+    MIN_STATUS_MINIMIZED = 0,
+    MIN_STATUS_NOT_REPRODUCED,          // The original case passed
+    MIN_STATUS_BUDGET,                  // maxReboots reached, the smallest so far is returned
+    MIN_STATUS_TARGET_ERROR
+} MIN_STATUS;
+
+//
+// What a batch did. Cases [0, ran) passed. If outcome is not PASS, case
+// culprit crashed or hung (ran == culprit), or one of [ran, count) did when
+// culprit is MIN_CULPRIT_UNKNOWN
+//
+typedef struct _MIN_RESULT
+{
+    UINT32  outcome;                    // MIN_OUTCOME
+    UINT32  ran;
+    UINT32  culprit;
+    UINT32  rsvd;
+} MIN_RESULT, *PMIN_RESULT;
+
+typedef struct _MIN_CONFIG
+{
+    UINT32  maxBatch;                   // Candidates per batch, 0 for MIN_DEFAULT_MAX_BATCH
+    UINT32  maxReboots;                 // Crashes and hangs, 0 for MIN_DEFAULT_MAX_REBOOTS
+} MIN_CONFIG, *PMIN_CONFIG;
+
+typedef struct _MIN_STATS
+{
+    UINT64  batches;
+    UINT64  executed;                   // Candidates run, passing and failing
+    UINT64  reboots;                    // Batches that crashed or hung
+    UINT64  hangs;
+    UINT64  bisections;                 // Failed batches that had to be split
+    UINT64  known;                      // Candidates skipped, seen not to reproduce
+    UINT64  accepted[MIN_PHASE_COUNT];  // Reductions kept per phase
+    UINT32  bitsBefore;                 // Set bits that could be cleared
+    UINT32  bitsAfter;
+    UINT32  target;                     // MIN_OUTCOME being reproduced
+    UINT32  rsvd;
+} MIN_STATS, *PMIN_STATS;
+
+inline PUINT64
+MinQword (
+    IN PMIN_CASE    pCase,
+    IN UINT32       q
+)
+{
+    return q < MIN_REG_QWORDS ? &((PUINT64)&pCase->regs)[q] : &pCase->page[q - MIN_REG_QWORDS];
+}
+
+inline UINT64
+MinClearable (
+    IN UINT32   q
+)
+{
+    return q == MIN_RCX_QWORD ? ~MIN_CALLCODE_MASK : ~0ULL;
+}
+
+inline UINT32
+MinPopCount (
+    IN UINT64   v
+)
+{
+    UINT32 count = 0;
+
+    for (; v != 0; v &= v - 1)
+    {
+        count++;
+    }
+    return count;
+}
+
+//
+// Set bits of the case that could be cleared
+//
+inline UINT32
+MinClearableBits (
+    IN const MIN_CASE   &minCase
+)
+{
+    UINT32 qwords = minCase.bPage ? MIN_QWORDS : MIN_REG_QWORDS;
+    UINT32 bits = 0;
+
+    for (UINT32 q = 0; q < qwords; q++)
+    {
+        bits += MinPopCount(*MinQword((PMIN_CASE)&minCase, q) & MinClearable(q));
+    }
+    return bits;
+}
+
+inline UINT64
+MinCaseHash (
+    IN const MIN_CASE   &minCase
+)
+{
+    UINT32 qwords = minCase.bPage ? MIN_QWORDS : MIN_REG_QWORDS;
+    UINT64 h = minCase.bPage;
+
+    for (UINT32 q = 0; q < qwords; q++)
+    {
+        h = PageFillSplitMix(h ^ *MinQword((PMIN_CASE)&minCase, q));
+    }
+    return h;
+}
+
+//
+// Whatever runs candidates: the guest through something that can reboot
+// it, or a simulation. Run the cases in order, stopping at the first that
+// crashes or hangs. FALSE if the target could not run them at all
+//
+class MinTarget
+{
+public:
+    virtual ~MinTarget () {}
+
+    virtual BOOL
+    Run (
+        IN  const MIN_CASE  *pCases,
+        IN  UINT32          count,
+        OUT PMIN_RESULT     pResult
+    ) = 0;
+};
+
+//
+// Whether a case crashed, hung or passed, given what the backend said
+//
+typedef MIN_OUTCOME (*MIN_CRASH_PREDICATE)(
+    IN const MIN_CASE                   *pCase,
+    IN const HYPERCALL_BATCH_RESULT     *pResult,
+    IN VOID                             *pContext
+    );
+
+//
+// Runs a batch of candidates as one HcBackend batch, then asks the predicate
+// about each in order. bAttribute FALSE hides which case failed, as for a
+// guest that only journals whole batches
+//
+class MinBackendTarget : public MinTarget
+{
+public:
+    MinBackendTarget (
+        IN HcBackend            &backend,
+        IN MIN_CRASH_PREDICATE  pPredicate,
+        IN VOID                 *pContext = NULL,
+        IN BOOL                 bAttribute = TRUE
+    )
+        : m_backend(backend),
+          m_pPredicate(pPredicate),
+          m_pContext(pContext),
+          m_bAttribute(bAttribute),
+          m_batch(HYPERCALL_BATCH_MAX_CASES),
+          m_results(HYPERCALL_BATCH_MAX_CASES)
+    {
+    }
+
+    virtual BOOL
+    Run (
+        IN  const MIN_CASE  *pCases,
+        IN  UINT32          count,
+        OUT PMIN_RESULT     pResult
+    )
+    {
+        memset(pResult, 0, sizeof(MIN_RESULT));
+        pResult->culprit = MIN_CULPRIT_UNKNOWN;
+
+        m_batch.Reset();
+        for (UINT32 c = 0; c < count; c++)
+        {
+            if (!m_batch.Add(pCases[c].regs))
+            {
+                return FALSE;
+            }
+        }
+        if (m_backend.ExecBatch(m_batch, m_results) != 0 || m_results.Count() != count)
+        {
+            return FALSE;
+        }
+
+        for (UINT32 c = 0; c < count; c++)
+        {
+            MIN_OUTCOME outcome = m_pPredicate(&pCases[c], &m_results[c], m_pContext);
+
+            if (outcome != MIN_OUTCOME_PASS)
+            {
+                pResult->outcome = outcome;
+                pResult->ran = m_bAttribute ? c : 0;
+                pResult->culprit = m_bAttribute ? c : MIN_CULPRIT_UNKNOWN;
+                return TRUE;
+            }
+        }
+        pResult->ran = count;
+        return TRUE;
+    }
+
+private:
+    HcBackend           &m_backend;
+    MIN_CRASH_PREDICATE m_pPredicate;
+    VOID                *m_pContext;
+    BOOL                m_bAttribute;
+    HcBatchEncoder      m_batch;
+    HcBatchResults      m_results;
+};
+
+class CrashMinimizer
+{
+public:
+    explicit CrashMinimizer (
+        IN const MIN_CONFIG *pConfig = NULL
+    )
+    {
+        m_maxBatch = pConfig != NULL && pConfig->maxBatch != 0 ? pConfig->maxBatch : MIN_DEFAULT_MAX_BATCH;
+        m_maxReboots = pConfig != NULL && pConfig->maxReboots != 0 ? pConfig->maxReboots : MIN_DEFAULT_MAX_REBOOTS;
+        if (m_maxBatch > HYPERCALL_BATCH_MAX_CASES)
+        {
+            m_maxBatch = HYPERCALL_BATCH_MAX_CASES;
+        }
+        memset(&m_stats, 0, sizeof(m_stats));
+    }
+
+    //
+    // Minimize a case that crashes (or hangs) the target. pMinimal gets the
+    // smallest case found that still does, the original if nothing could
+    // be cleared or it did not reproduce
+    //
+    MIN_STATUS
+    Minimize (
+        IN OUT MinTarget        &target,
+        IN     const MIN_CASE   &crashing,
+        OUT    PMIN_CASE        pMinimal
+    )
+    {
+        MIN_RESULT  result;
+        MIN_STATUS  status = MIN_STATUS_MINIMIZED;
+
+        memset(&m_stats, 0, sizeof(m_stats));
+        m_known.clear();
+        m_best = crashing;
+        m_batch = m_maxBatch;
+        m_stats.bitsBefore = MinClearableBits(crashing);
+
+        //
+        // The original sets what reproducing means
+        //
+        if (!target.Run(&m_best, 1, &result))
+        {
+            status = MIN_STATUS_TARGET_ERROR;
+        }
+        else if (result.outcome == MIN_OUTCOME_PASS)
+        {
+            status = MIN_STATUS_NOT_REPRODUCED;
+        }
+        else
+        {
+            m_target = (MIN_OUTCOME)result.outcome;
+            m_stats.target = m_target;
+            m_stats.batches++;
+            m_stats.executed++;
+            m_stats.reboots++;
+            m_stats.hangs += m_target == MIN_OUTCOME_HANG;
+        }
+
+        for (UINT32 phase = 0; status == MIN_STATUS_MINIMIZED && phase < MIN_PHASE_COUNT; phase++)
+        {
+            m_phase = (MIN_PHASE)phase;
+            BuildAtoms();
+            m_n = 1;
+
+            while (!m_atoms.empty() && status == MIN_STATUS_MINIMIZED)
+            {
+                BOOL bReduced = FALSE;
+
+                status = RunRound(target, &bReduced);
+                if (bReduced)
+                {
+                    continue;
+                }
+                if (m_n >= m_atoms.size())
+                {
+                    break;
+                }
+                m_n = m_n * 2 < m_atoms.size() ? m_n * 2 : (UINT32)m_atoms.size();
+            }
+        }
+
+        m_stats.bitsAfter = MinClearableBits(m_best);
+        *pMinimal = m_best;
+        return status;
+    }
+
+    VOID
+    GetStats (
+        OUT PMIN_STATS  pStats
+    ) const
+    {
+        *pStats = m_stats;
+    }
+
+private:
+    typedef struct _MIN_ATOM
+    {
+        UINT32  qword;
+        UINT32  rsvd;
+        UINT64  mask;
+    } MIN_ATOM;
+
+    typedef enum _MIN_CANDIDATE_KIND
+    {
+        MIN_CANDIDATE_KEEP = 0,         // Clear every chunk but this one
+        MIN_CANDIDATE_CLEAR             // Clear this chunk
+    } MIN_CANDIDATE_KIND;
+
+    typedef struct _MIN_CANDIDATE
+    {
+        UINT32  kind;                   // MIN_CANDIDATE_KIND
+        UINT32  chunk;
+        UINT64  hash;
+    } MIN_CANDIDATE;
+
+    //
+    // Non-zero clearable parts of the case at the phase's granularity
+    //
+    VOID
+    BuildAtoms ()
+    {
+        static const UINT32 s_atomBits[MIN_PHASE_COUNT] = { 64, 8, 1 };
+        UINT32 qwords = m_best.bPage ? MIN_QWORDS : MIN_REG_QWORDS;
+        UINT32 bits = s_atomBits[m_phase];
+
+        m_atoms.clear();
+        for (UINT32 q = 0; q < qwords; q++)
+        {
+            UINT64 value = *MinQword(&m_best, q) & MinClearable(q);
+
+            for (UINT32 b = 0; value != 0 && b < 64; b += bits)
+            {
+                UINT64 mask = (bits == 64 ? ~0ULL : ((1ULL << bits) - 1) << b) & value;
+
+                if (mask != 0)
+                {
+                    MIN_ATOM atom = { q, 0, mask };
+
+                    m_atoms.push_back(atom);
+                }
+            }
+        }
+    }
+
+    SIZE_T ChunkBegin (IN UINT32 chunk) const { return m_atoms.size() * chunk / m_n; }
+
+    VOID
+    Materialize (
+        IN  const MIN_CANDIDATE &candidate,
+        OUT PMIN_CASE           pCase
+    ) const
+    {
+        SIZE_T begin = ChunkBegin(candidate.chunk);
+        SIZE_T end = ChunkBegin(candidate.chunk + 1);
+
+        *pCase = m_best;
+        for (SIZE_T a = 0; a < m_atoms.size(); a++)
+        {
+            BOOL bInChunk = a >= begin && a < end;
+
+            if (bInChunk == (candidate.kind == MIN_CANDIDATE_CLEAR))
+            {
+                *MinQword(pCase, m_atoms[a].qword) &= ~m_atoms[a].mask;
+            }
+        }
+    }
+
+    //
+    // The candidate reproduced: it is the case now, and its atoms the ones
+    // left to try
+    //
+    VOID
+    Accept (
+        IN const MIN_CANDIDATE  &candidate
+    )
+    {
+        SIZE_T begin = ChunkBegin(candidate.chunk);
+        SIZE_T end = ChunkBegin(candidate.chunk + 1);
+        MIN_CASE reduced;
+
+        Materialize(candidate, &reduced);
+        m_best = reduced;
+        if (candidate.kind == MIN_CANDIDATE_CLEAR)
+        {
+            m_atoms.erase(m_atoms.begin() + begin, m_atoms.begin() + end);
+            m_n = m_n > 2 ? m_n - 1 : 2;
+        }
+        else
+        {
+            m_atoms = std::vector<MIN_ATOM>(m_atoms.begin() + begin, m_atoms.begin() + end);
+            m_n = 2;
+        }
+        if (m_n > m_atoms.size())
+        {
+            m_n = m_atoms.empty() ? 1 : (UINT32)m_atoms.size();
+        }
+        m_stats.accepted[m_phase]++;
+    }
+
+    //
+    // Try the candidates of the current split until one reproduces (then
+    // *pbReduced) or none is left
+    //
+    MIN_STATUS
+    RunRound (
+        IN OUT MinTarget    &target,
+        OUT    BOOL         *pbReduced
+    )
+    {
+        std::vector<MIN_CANDIDATE>  pending;
+        std::vector<MIN_CASE>       cases;
+        SIZE_T                      pos = 0;
+        SIZE_T                      suspectEnd = 0;
+
+        *pbReduced = FALSE;
+
+        //
+        // Biggest reductions first. With two chunks keeping one is clearing
+        // the other
+        //
+        for (UINT32 kind = MIN_CANDIDATE_KEEP; kind <= MIN_CANDIDATE_CLEAR; kind++)
+        {
+            if (kind == MIN_CANDIDATE_KEEP && m_n <= 2)
+            {
+                continue;
+            }
+            for (UINT32 chunk = 0; chunk < m_n; chunk++)
+            {
+                MIN_CANDIDATE candidate = { kind, chunk, 0 };
+                MIN_CASE reduced;
+
+                Materialize(candidate, &reduced);
+                candidate.hash = MinCaseHash(reduced);
+                if (m_known.count(candidate.hash) != 0)
+                {
+                    m_stats.known++;
+                    continue;
+                }
+                pending.push_back(candidate);
+            }
+        }
+
+        while (pos < pending.size())
+        {
+            SIZE_T      count = pending.size() - pos < m_batch ? pending.size() - pos : m_batch;
+            MIN_RESULT  result;
+
+            if (suspectEnd > pos && suspectEnd - pos < count)
+            {
+                count = suspectEnd - pos;
+            }
+
+            cases.resize(count);
+            for (SIZE_T c = 0; c < count; c++)
+            {
+                Materialize(pending[pos + c], &cases[c]);
+            }
+            if (!target.Run(cases.data(), (UINT32)count, &result) || result.ran > count)
+            {
+                return MIN_STATUS_TARGET_ERROR;
+            }
+
+            m_stats.batches++;
+            m_stats.executed += result.ran;
+            for (SIZE_T c = 0; c < result.ran; c++)
+            {
+                m_known.insert(pending[pos + c].hash);
+            }
+
+            if (result.outcome == MIN_OUTCOME_PASS)
+            {
+                pos += count;
+                m_batch = m_batch * 2 < m_maxBatch ? m_batch * 2 : m_maxBatch;
+                continue;
+            }
+
+            m_stats.reboots++;
+            m_stats.hangs += result.outcome == MIN_OUTCOME_HANG;
+
+            if (result.culprit == MIN_CULPRIT_UNKNOWN && count - result.ran > 1)
+            {
+                //
+                // One of the rest did it, run the first half of them alone
+                //
+                m_stats.bisections++;
+                pos += result.ran;
+                suspectEnd = pos + (count - result.ran);
+                m_batch = (UINT32)((count - result.ran) / 2);
+            }
+            else
+            {
+                SIZE_T culprit = pos + (result.culprit == MIN_CULPRIT_UNKNOWN ? result.ran : result.culprit);
+
+                m_stats.executed++;
+                if (result.outcome == m_target)
+                {
+                    Accept(pending[culprit]);
+                    *pbReduced = TRUE;
+                    return m_stats.reboots >= m_maxReboots ? MIN_STATUS_BUDGET : MIN_STATUS_MINIMIZED;
+                }
+
+                //
+                // Failed some other way, a hang while looking for a crash
+                //
+                m_known.insert(pending[culprit].hash);
+                pos = culprit + 1;
+                if (result.outcome == MIN_OUTCOME_HANG)
+                {
+                    m_batch = m_batch / 2 != 0 ? m_batch / 2 : 1;
+                }
+            }
+
+            if (m_stats.reboots >= m_maxReboots)
+            {
+                return MIN_STATUS_BUDGET;
+            }
+        }
+        return MIN_STATUS_MINIMIZED;
+    }
+
+    UINT32                      m_maxBatch;
+    UINT32                      m_maxReboots;
+    UINT32                      m_batch;        // Candidates in the next batch
+    MIN_OUTCOME                 m_target;
+    MIN_PHASE                   m_phase;
+    UINT32                      m_n;            // Chunks the atoms are split into
+    MIN_CASE                    m_best;
+    std::vector<MIN_ATOM>       m_atoms;
+    std::unordered_set<UINT64>  m_known;        // Hashes of candidates that did not reproduce
+    MIN_STATS                   m_stats;
+};
@@ -0,0 +1,133 @@
+/*++
+
+Module Name:
+
+    FastCall.h
+
+Abstract:
+
+    Register layout of extended fast hypercalls. With the fast bit set the
+    input is taken from registers instead of an input GPA, in order
+
+        RDX, R8, XMM0, XMM1, XMM2, XMM3, XMM4, XMM5
+
+    8 bytes each from RDX and R8 and 16 from each XMM register, low qword
+    first, so up to FAST_CALL_MAX_INPUT bytes. Output comes back in the
+    same registers, starting at the first 16 byte register pair past the
+    input (RDX:R8 counting as one). CPU_REG_64 keeps the XMM registers as
+    lower/upper qwords in the same order, VIFU_Hypercall moves all 128 bits
+    of them both ways.
+
+    This is the reference the generators (InputGenRegisterCase) and the
+    simulated backend marshal with.
+
+    Plain C so it can be used by the driver.
+
+Environment:
+
+    Kernel mode, User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <stddef.h>
+#include "../ViridianFuzzer/ViridianFuzzerTypes.h"
+
+#define FAST_CALL_SLOTS         14      // Qwords: RDX, R8, XMM0 - XMM5 low and high
+#define FAST_CALL_MAX_INPUT     (FAST_CALL_SLOTS * 8)
+
+C_ASSERT(offsetof(CPU_REG_64, xmm5) + sizeof(VFUINT128) ==
+         offsetof(CPU_REG_64, xmm0) + (FAST_CALL_SLOTS - 2) * sizeof(UINT64));
+
+//
+// Register holding qword slot (0 - FAST_CALL_SLOTS-1) of the fast call
+// register block
+//
+static __inline PUINT64
+FastCallSlot (
+    IN PCPU_REG_64  pRegs,
+    IN UINT32       slot
+)
+{
+    if( slot == 0 )
+    {
+        return &pRegs->rdx;
+    }
+    if( slot == 1 )
+    {
+        return &pRegs->r8;
+    }
+    return &((PUINT64)&pRegs->xmm0)[slot - 2];
+}
+
+//
+// First slot of the output, for an input of inputBytes
+//
+static __inline UINT32
+FastCallOutputSlot (
+    IN UINT32   inputBytes
+)
+{
+    return ((inputBytes + 15) / 16) * 2;
+}
+
+//
+// Load bytes of input into the register block, the rest of it is zeroed.
+// FALSE if it doesn't fit
+//
+static __inline BOOL
+FastCallMarshalInput (
+    IN OUT PCPU_REG_64  pRegs,
+    IN     const VOID   *pInput,
+    IN     UINT32       bytes
+)
+{
+    const UINT8 *pBytes = (const UINT8 *)pInput;
+
+    if( bytes > FAST_CALL_MAX_INPUT )
+    {
+        return FALSE;
+    }
+
+    for( UINT32 slot = 0; slot < FAST_CALL_SLOTS; slot++ )
+    {
+        UINT64 value = 0;
+        UINT32 offset = slot * 8;
+
+        if( offset < bytes )
+        {
+            memcpy( &value, pBytes + offset, bytes - offset < 8 ? bytes - offset : 8 );
+        }
+        *FastCallSlot( pRegs, slot ) = value;
+    }
+    return TRUE;
+}
+
+//
+// Copy up to bytes of output out of the register block of a call that took
+// inputBytes of input. Returns the bytes copied, less than asked for if the
+// registers run out first
+//
+static __inline UINT32
+FastCallUnmarshalOutput (
+    IN  const CPU_REG_64    *pRegs,
+    IN  UINT32              inputBytes,
+    OUT VOID                *pOutput,
+    IN  UINT32              bytes
+)
+{
+    UINT8   *pBytes = (UINT8 *)pOutput;
+    UINT32  slot = FastCallOutputSlot( inputBytes );
+    UINT32  copied = 0;
+
+    for( ; slot < FAST_CALL_SLOTS && copied < bytes; slot++ )
+    {
+        UINT64 value = *FastCallSlot( (PCPU_REG_64)pRegs, slot );
+        UINT32 chunk = bytes - copied < 8 ? bytes - copied : 8;
+
+        memcpy( pBytes + copied, &value, chunk );
+        copied += chunk;
+    }
+    return copied;
+}
@@ -0,0 +1,941 @@
+/*++
+
+Module Name:
+
+    FuzzJournal.h
+
+Abstract:
+
+    Binary fuzz journal, the replacement for the fuzz_logger.txt text log.
+
+    The file is a FUZZ_JOURNAL_HEADER followed by fixed size
+    FUZZ_JOURNAL_RECORDs, append only. Record n sits at
+    FUZZ_JOURNAL_RECORD_OFFSET(n) and carries sequence n, the campaign id of
+    the header and a CRC32C of the rest of the record, so
+        - the last record is one seek from the end of the file
+        - a torn tail (partial record, or a group write cut short) fails the
+          checksum or sequence check and is walked back over
+        - any record can be read without scanning, from a handle or from a
+          memory mapped view (FuzzJournalReader)
+
+    Input registers are packed: a mask of the non-zero qwords of CPU_REG_64
+    plus up to FUZZ_JOURNAL_MAX_REGS of their values. A case with more
+    non-zero qwords is flagged FUZZ_JOURNAL_FLAG_REGS_TRUNCATED, it can still
+    be rebuilt from callcode/repCnt/fast/case index. Cases of a pruning probe
+    pass are flagged FUZZ_JOURNAL_FLAG_PROBE, a resume of the main pass looks
+    past them.
+
+    Workers finish cases out of order, so the last case says little about
+    what completed. Each pass also journals its low watermark whenever it
+    moves, and FindResume gives both passes' watermarks with the last case
+    of each: the cases to run again, and the combo likely to have taken the
+    guest down.
+
+    FuzzJournalFile attaches to an open handle/fd, recovers the tail and seals
+    records for appending. Appends themselves go through the handle, e.g. by
+    AsyncLog::Write so they are group committed with the other logs.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+#include "../ViridianFuzzer/ViridianFuzzerTypes.h"
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define FUZZ_JOURNAL_HEADER_MAGIC   0x484A4656      // 'VFJH'
+#define FUZZ_JOURNAL_RECORD_MAGIC   0x524A4656      // 'VFJR'
+#define FUZZ_JOURNAL_VERSION        1
+
+#define FUZZ_JOURNAL_RECORD_SIZE    128
+#define FUZZ_JOURNAL_HEADER_SIZE    FUZZ_JOURNAL_RECORD_SIZE
+#define FUZZ_JOURNAL_MAX_REGS       10
+
+#define FUZZ_JOURNAL_RECORD_OFFSET(seq) \
+    ((UINT64)FUZZ_JOURNAL_HEADER_SIZE + (UINT64)(seq) * FUZZ_JOURNAL_RECORD_SIZE)
+
+#define FUZZ_JOURNAL_REG_QWORDS     (sizeof(CPU_REG_64) / sizeof(UINT64))
+
+typedef enum _FUZZ_JOURNAL_KIND
+{
+    FUZZ_JOURNAL_KIND_CASE = 1,         // A case about to be executed
+    FUZZ_JOURNAL_KIND_SESSION = 2,      // Fuzzer (re)started, regs[0] is the time() it started
+    FUZZ_JOURNAL_KIND_WATERMARK = 3     // Every case index below regs[0] of the pass has completed
+} FUZZ_JOURNAL_KIND;
+
+#define FUZZ_JOURNAL_FLAG_REGS_TRUNCATED    0x01
+#define FUZZ_JOURNAL_FLAG_PROBE             0x02    // Case or watermark of a probe pass (CasePruner.h), not of the main pass
+
+typedef struct _FUZZ_JOURNAL_HEADER
+{
+    UINT32  magic;
+    UINT16  version;
+    UINT16  recordSize;
+    UINT32  crc;                        // CRC32C of the header with crc = 0
+    UINT32  rsvd0;
+    UINT64  campaignId;
+    UINT64  createdTime;                // time() the journal was created
+    UINT8   rsvd1[FUZZ_JOURNAL_HEADER_SIZE - 32];
+} FUZZ_JOURNAL_HEADER, *PFUZZ_JOURNAL_HEADER;
+
+typedef struct _FUZZ_JOURNAL_RECORD
+{
+    UINT32  magic;
+    UINT32  crc;                        // CRC32C of everything after this field
+    UINT64  sequence;
+    UINT64  campaignId;
+    UINT16  callcode;
+    UINT8   repCnt;
+    UINT8   fast;
+    UINT16  caseIdx;
+    UINT8   kind;
+    UINT8   flags;
+    UINT64  rngState;
+    UINT32  regMask;                    // Bit n set: qword n of CPU_REG_64 is non-zero
+    UINT32  rsvd;
+    UINT64  regs[FUZZ_JOURNAL_MAX_REGS];// Non-zero qwords, lowest first
+} FUZZ_JOURNAL_RECORD, *PFUZZ_JOURNAL_RECORD;
+
+C_ASSERT(sizeof(FUZZ_JOURNAL_HEADER) == FUZZ_JOURNAL_HEADER_SIZE);
+C_ASSERT(sizeof(FUZZ_JOURNAL_RECORD) == FUZZ_JOURNAL_RECORD_SIZE);
+C_ASSERT(FUZZ_JOURNAL_REG_QWORDS <= 32);
+
+//
+// CRC32C (Castagnoli), slicing by 8
+//
+inline const UINT32 *
+FuzzJournalCrcTable ()
+{
+    static UINT32 s_table[8][256];
+    static const BOOL s_init = [](UINT32 (*pTable)[256]) {
+        for (UINT32 b = 0; b < 256; b++)
+        {
+            UINT32 crc = b;
+
+            for (UINT32 k = 0; k < 8; k++)
+            {
+                crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+            }
+            pTable[0][b] = crc;
+        }
+        for (UINT32 b = 0; b < 256; b++)
+        {
+            for (UINT32 t = 1; t < 8; t++)
+            {
+                pTable[t][b] = (pTable[t - 1][b] >> 8) ^ pTable[0][pTable[t - 1][b] & 0xFF];
+            }
+        }
+        return TRUE;
+    }(s_table);
+
+    (VOID)s_init;
+    return &s_table[0][0];
+}
+
+inline UINT32
+FuzzJournalCrc32c (
+    IN const VOID   *pData,
+    IN SIZE_T       len,
+    IN UINT32       crc = 0
+)
+{
+    const UINT32    *pT = FuzzJournalCrcTable();
+    const UINT8     *p = (const UINT8 *)pData;
+
+    crc = ~crc;
+    while (len >= 8)
+    {
+        UINT32 lo = 0;
+        UINT32 hi = 0;
+
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = pT[7 * 256 + (lo & 0xFF)] ^ pT[6 * 256 + ((lo >> 8) & 0xFF)] ^
+              pT[5 * 256 + ((lo >> 16) & 0xFF)] ^ pT[4 * 256 + (lo >> 24)] ^
+              pT[3 * 256 + (hi & 0xFF)] ^ pT[2 * 256 + ((hi >> 8) & 0xFF)] ^
+              pT[1 * 256 + ((hi >> 16) & 0xFF)] ^ pT[0 * 256 + (hi >> 24)];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- != 0)
+    {
+        crc = (crc >> 8) ^ pT[(crc ^ *p++) & 0xFF];
+    }
+    return ~crc;
+}
+
+inline UINT32
+FuzzJournalRecordCrc (
+    IN const FUZZ_JOURNAL_RECORD    *pRecord
+)
+{
+    return FuzzJournalCrc32c(&pRecord->sequence,
+                             sizeof(FUZZ_JOURNAL_RECORD) - offsetof(FUZZ_JOURNAL_RECORD, sequence));
+}
+
+inline UINT32
+FuzzJournalHeaderCrc (
+    IN const FUZZ_JOURNAL_HEADER    *pHeader
+)
+{
+    FUZZ_JOURNAL_HEADER header = *pHeader;
+
+    header.crc = 0;
+    return FuzzJournalCrc32c(&header, sizeof(header));
+}
+
+inline VOID
+FuzzJournalInitHeader (
+    OUT PFUZZ_JOURNAL_HEADER    pHeader,
+    IN  UINT64                  campaignId
+)
+{
+    memset(pHeader, 0, sizeof(FUZZ_JOURNAL_HEADER));
+    pHeader->magic = FUZZ_JOURNAL_HEADER_MAGIC;
+    pHeader->version = FUZZ_JOURNAL_VERSION;
+    pHeader->recordSize = FUZZ_JOURNAL_RECORD_SIZE;
+    pHeader->campaignId = campaignId;
+    pHeader->createdTime = (UINT64)time(NULL);
+    pHeader->crc = FuzzJournalHeaderCrc(pHeader);
+}
+
+inline BOOL
+FuzzJournalCheckHeader (
+    IN const FUZZ_JOURNAL_HEADER    *pHeader
+)
+{
+    return pHeader->magic == FUZZ_JOURNAL_HEADER_MAGIC &&
+           pHeader->version == FUZZ_JOURNAL_VERSION &&
+           pHeader->recordSize == FUZZ_JOURNAL_RECORD_SIZE &&
+           pHeader->crc == FuzzJournalHeaderCrc(pHeader);
+}
+
+//
+// A record is valid only in its own slot of its own campaign
+//
+inline BOOL
+FuzzJournalCheckRecord (
+    IN const FUZZ_JOURNAL_RECORD    *pRecord,
+    IN UINT64                       sequence,
+    IN UINT64                       campaignId
+)
+{
+    return pRecord->magic == FUZZ_JOURNAL_RECORD_MAGIC &&
+           pRecord->sequence == sequence &&
+           pRecord->campaignId == campaignId &&
+           pRecord->crc == FuzzJournalRecordCrc(pRecord);
+}
+
+inline VOID
+FuzzJournalInitCase (
+    OUT PFUZZ_JOURNAL_RECORD    pRecord,
+    IN  USHORT                  callcode,
+    IN  USHORT                  repCnt,
+    IN  USHORT                  fast,
+    IN  USHORT                  caseIdx,
+    IN  UINT64                  rngState,
+    IN  const CPU_REG_64        *pRegs
+)
+{
+    const UINT64    *pQwords = (const UINT64 *)pRegs;
+    UINT32          packed = 0;
+
+    memset(pRecord, 0, sizeof(FUZZ_JOURNAL_RECORD));
+    pRecord->kind = FUZZ_JOURNAL_KIND_CASE;
+    pRecord->callcode = callcode;
+    pRecord->repCnt = (UINT8)repCnt;
+    pRecord->fast = (UINT8)fast;
+    pRecord->caseIdx = caseIdx;
+    pRecord->rngState = rngState;
+
+    for (UINT32 q = 0; q < FUZZ_JOURNAL_REG_QWORDS; q++)
+    {
+        if (pQwords[q] == 0)
+        {
+            continue;
+        }
+        if (packed == FUZZ_JOURNAL_MAX_REGS)
+        {
+            pRecord->flags |= FUZZ_JOURNAL_FLAG_REGS_TRUNCATED;
+            break;
+        }
+        pRecord->regMask |= 1u << q;
+        pRecord->regs[packed++] = pQwords[q];
+    }
+}
+
+inline VOID
+FuzzJournalInitSession (
+    OUT PFUZZ_JOURNAL_RECORD    pRecord,
+    IN  UINT64                  startTime
+)
+{
+    memset(pRecord, 0, sizeof(FUZZ_JOURNAL_RECORD));
+    pRecord->kind = FUZZ_JOURNAL_KIND_SESSION;
+    pRecord->regs[0] = startTime;
+}
+
+inline VOID
+FuzzJournalInitWatermark (
+    OUT PFUZZ_JOURNAL_RECORD    pRecord,
+    IN  UINT64                  low,
+    IN  UINT8                   flags
+)
+{
+    memset(pRecord, 0, sizeof(FUZZ_JOURNAL_RECORD));
+    pRecord->kind = FUZZ_JOURNAL_KIND_WATERMARK;
+    pRecord->flags = flags;
+    pRecord->regs[0] = low;
+}
+
+//
+// Where a resumed run picks up, from FuzzJournalFile::FindResume. The probe
+// pass's part is only set if the guest went down probing
+//
+#define FUZZ_JOURNAL_RESUME_HAS_CASE        0x01    // lastCase, of the main pass
+#define FUZZ_JOURNAL_RESUME_HAS_LOW         0x02    // low, of the main pass
+#define FUZZ_JOURNAL_RESUME_HAS_PROBE       0x04    // lastProbe
+#define FUZZ_JOURNAL_RESUME_HAS_PROBE_LOW   0x08    // probeLow
+
+typedef struct _FUZZ_JOURNAL_RESUME
+{
+    UINT32              flags;          // FUZZ_JOURNAL_RESUME_HAS_*
+    UINT32              rsvd;
+    UINT64              low;
+    UINT64              probeLow;
+    FUZZ_JOURNAL_RECORD lastCase;
+    FUZZ_JOURNAL_RECORD lastProbe;
+} FUZZ_JOURNAL_RESUME, *PFUZZ_JOURNAL_RESUME;
+
+C_ASSERT(sizeof(FUZZ_JOURNAL_RESUME) == 24 + 2 * FUZZ_JOURNAL_RECORD_SIZE);
+
+//
+// Registers as logged, qwords beyond FUZZ_JOURNAL_MAX_REGS of a truncated
+// record come back as 0
+//
+inline VOID
+FuzzJournalUnpackRegs (
+    IN  const FUZZ_JOURNAL_RECORD   *pRecord,
+    OUT PCPU_REG_64                 pRegs
+)
+{
+    PUINT64 pQwords = (PUINT64)pRegs;
+    UINT32  packed = 0;
+
+    memset(pRegs, 0, sizeof(CPU_REG_64));
+    for (UINT32 q = 0; q < FUZZ_JOURNAL_REG_QWORDS && packed < FUZZ_JOURNAL_MAX_REGS; q++)
+    {
+        if (pRecord->regMask & (1u << q))
+        {
+            pQwords[q] = pRecord->regs[packed++];
+        }
+    }
+}
+
+//
+// The fuzz_logger.txt line for a record, returns the length written
+//
+inline INT
+FuzzJournalFormatText (
+    IN  const FUZZ_JOURNAL_RECORD   *pRecord,
+    OUT CHAR                        *pBuf,
+    IN  SIZE_T                      bufLen
+)
+{
+    if (pRecord->kind == FUZZ_JOURNAL_KIND_WATERMARK)
+    {
+        //
+        // fuzz_logger.txt had no such line
+        //
+        if (bufLen != 0)
+        {
+            pBuf[0] = '\0';
+        }
+        return 0;
+    }
+
+    if (pRecord->kind == FUZZ_JOURNAL_KIND_SESSION)
+    {
+        time_t      t = (time_t)pRecord->regs[0];
+        struct tm   local = {};
+
+#if defined(_WIN32)
+        localtime_s(&local, &t);
+#else
+        localtime_r(&t, &local);
+#endif
+        return snprintf(pBuf, bufLen,
+                        "\r\n[ %02d/%02d/%04d %02d:%02d:%02d ]\r\n",
+                        local.tm_mday,
+                        local.tm_mon + 1,
+                        local.tm_year + 1900,
+                        local.tm_hour,
+                        local.tm_min,
+                        local.tm_sec);
+    }
+
+    return snprintf(pBuf, bufLen,
+                    "%x %x %x %x\r\n",
+                    pRecord->callcode,
+                    pRecord->repCnt,
+                    pRecord->fast,
+                    pRecord->caseIdx);
+}
+
+//
+// Thin file layer, the handle/fd is owned by the caller
+//
+#if defined(_WIN32)
+typedef HANDLE  FUZZ_JOURNAL_FD;
+#define FUZZ_JOURNAL_INVALID_FD     INVALID_HANDLE_VALUE
+#else
+typedef INT     FUZZ_JOURNAL_FD;
+#define FUZZ_JOURNAL_INVALID_FD     (-1)
+#endif
+
+inline BOOL
+FuzzJournalFdSize (
+    IN  FUZZ_JOURNAL_FD fd,
+    OUT PUINT64         pSize
+)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER size;
+
+    if (!GetFileSizeEx(fd, &size))
+    {
+        return FALSE;
+    }
+    *pSize = (UINT64)size.QuadPart;
+    return TRUE;
+#else
+    struct stat st;
+
+    if (fstat(fd, &st) != 0)
+    {
+        return FALSE;
+    }
+    *pSize = (UINT64)st.st_size;
+    return TRUE;
+#endif
+}
+
+inline BOOL
+FuzzJournalFdRead (
+    IN  FUZZ_JOURNAL_FD fd,
+    IN  UINT64          offset,
+    OUT VOID            *pBuf,
+    IN  UINT32          len
+)
+{
+#if defined(_WIN32)
+    OVERLAPPED  ov = {};
+    DWORD       bytesRead = 0;
+
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    return ReadFile(fd, pBuf, len, &bytesRead, &ov) && bytesRead == len;
+#else
+    return pread(fd, pBuf, len, (off_t)offset) == (ssize_t)len;
+#endif
+}
+
+inline BOOL
+FuzzJournalFdWrite (
+    IN FUZZ_JOURNAL_FD  fd,
+    IN UINT64           offset,
+    IN const VOID       *pBuf,
+    IN UINT32           len
+)
+{
+#if defined(_WIN32)
+    OVERLAPPED  ov = {};
+    DWORD       written = 0;
+
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    return WriteFile(fd, pBuf, len, &written, &ov) && written == len;
+#else
+    return pwrite(fd, pBuf, len, (off_t)offset) == (ssize_t)len;
+#endif
+}
+
+//
+// Move the file pointer, which sequential writers (AsyncLogFileSink) append at
+//
+inline BOOL
+FuzzJournalFdSeek (
+    IN FUZZ_JOURNAL_FD  fd,
+    IN UINT64           offset
+)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER pos;
+
+    pos.QuadPart = (LONGLONG)offset;
+    return SetFilePointerEx(fd, pos, NULL, FILE_BEGIN);
+#else
+    return lseek(fd, (off_t)offset, SEEK_SET) == (off_t)offset;
+#endif
+}
+
+//
+// Cut the file at size and leave the file pointer there for appends
+//
+inline BOOL
+FuzzJournalFdTruncate (
+    IN FUZZ_JOURNAL_FD  fd,
+    IN UINT64           size
+)
+{
+#if defined(_WIN32)
+    return FuzzJournalFdSeek(fd, size) && SetEndOfFile(fd);
+#else
+    return ftruncate(fd, (off_t)size) == 0 && FuzzJournalFdSeek(fd, size);
+#endif
+}
+
+//
+// Writer side. Attach() creates the header of an empty file or checks an
+// existing one, then cuts any torn tail so the next append lands in the right
+// slot. Not thread safe, one writer per journal
+//
+class FuzzJournalFile
+{
+public:
+    FuzzJournalFile ()
+        : m_fd(FUZZ_JOURNAL_INVALID_FD),
+          m_campaignId(0),
+          m_nextSeq(0),
+          m_tornRecords(0)
+    {
+    }
+
+    //
+    // campaignId is used only if the file is new. The handle/fd must be open
+    // for read and write and stays owned by the caller
+    //
+    BOOL
+    Attach (
+        IN FUZZ_JOURNAL_FD  fd,
+        IN UINT64           campaignId
+    )
+    {
+        FUZZ_JOURNAL_HEADER header;
+        UINT64              size = 0;
+        UINT64              slots = 0;
+
+        if (!FuzzJournalFdSize(fd, &size))
+        {
+            return FALSE;
+        }
+
+        if (size == 0)
+        {
+            FuzzJournalInitHeader(&header, campaignId);
+            if (!FuzzJournalFdWrite(fd, 0, &header, sizeof(header)) ||
+                !FuzzJournalFdTruncate(fd, FUZZ_JOURNAL_HEADER_SIZE))
+            {
+                return FALSE;
+            }
+            m_header = header;
+            m_fd = fd;
+            m_campaignId = campaignId;
+            m_nextSeq = 0;
+            m_tornRecords = 0;
+            return TRUE;
+        }
+
+        //
+        // Never touch a file that isn't a journal
+        //
+        if (size < FUZZ_JOURNAL_HEADER_SIZE ||
+            !FuzzJournalFdRead(fd, 0, &header, sizeof(header)) ||
+            !FuzzJournalCheckHeader(&header))
+        {
+            return FALSE;
+        }
+
+        m_header = header;
+        m_fd = fd;
+        m_campaignId = header.campaignId;
+
+        slots = (size - FUZZ_JOURNAL_HEADER_SIZE) / FUZZ_JOURNAL_RECORD_SIZE;
+        m_nextSeq = FindValidEnd(slots);
+        m_tornRecords = slots - m_nextSeq;
+
+        if (!FuzzJournalFdTruncate(fd, FUZZ_JOURNAL_RECORD_OFFSET(m_nextSeq)))
+        {
+            m_fd = FUZZ_JOURNAL_INVALID_FD;
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    //
+    // For a journal kept elsewhere (by the collector): Seal() carries on from
+    // count records of campaignId, there is nothing to Read() locally
+    //
+    VOID
+    Resume (
+        IN UINT64   campaignId,
+        IN UINT64   count
+    )
+    {
+        m_fd = FUZZ_JOURNAL_INVALID_FD;
+        m_campaignId = campaignId;
+        m_nextSeq = count;
+        m_tornRecords = 0;
+    }
+
+    BOOL IsAttached () const { return m_fd != FUZZ_JOURNAL_INVALID_FD; }
+
+    FUZZ_JOURNAL_FD Fd () const { return m_fd; }
+    UINT64 CampaignId () const { return m_campaignId; }
+    UINT64 Count () const { return m_nextSeq; }
+
+    //
+    // Whole records cut off by Attach(), a partial one at the end isn't counted
+    //
+    UINT64 TornRecords () const { return m_tornRecords; }
+
+    //
+    // Give the record the next slot and its checksum. Sealed records must be
+    // appended in the order they were sealed
+    //
+    VOID
+    Seal (
+        IN OUT PFUZZ_JOURNAL_RECORD pRecord
+    )
+    {
+        pRecord->magic = FUZZ_JOURNAL_RECORD_MAGIC;
+        pRecord->sequence = m_nextSeq++;
+        pRecord->campaignId = m_campaignId;
+        pRecord->crc = FuzzJournalRecordCrc(pRecord);
+    }
+
+    //
+    // Seal and write records straight to the file, for callers without an
+    // AsyncLog in front of it
+    //
+    BOOL
+    Append (
+        IN OUT PFUZZ_JOURNAL_RECORD pRecords,
+        IN UINT32                   count
+    )
+    {
+        UINT64 offset = FUZZ_JOURNAL_RECORD_OFFSET(m_nextSeq);
+
+        for (UINT32 r = 0; r < count; r++)
+        {
+            Seal(&pRecords[r]);
+        }
+        return FuzzJournalFdWrite(m_fd, offset, pRecords, count * FUZZ_JOURNAL_RECORD_SIZE) &&
+               FuzzJournalFdSeek(m_fd, FUZZ_JOURNAL_RECORD_OFFSET(m_nextSeq));
+    }
+
+    BOOL
+    Read (
+        IN  UINT64                  sequence,
+        OUT PFUZZ_JOURNAL_RECORD    pRecord
+    ) const
+    {
+        return sequence < m_nextSeq &&
+               IsAttached() &&
+               FuzzJournalFdRead(m_fd, FUZZ_JOURNAL_RECORD_OFFSET(sequence), pRecord, sizeof(FUZZ_JOURNAL_RECORD)) &&
+               FuzzJournalCheckRecord(pRecord, sequence, m_campaignId);
+    }
+
+    //
+    // Latest record of the given kind whose flags under flagMask are flags,
+    // walking back from the end
+    //
+    BOOL
+    FindLast (
+        IN  FUZZ_JOURNAL_KIND       kind,
+        OUT PFUZZ_JOURNAL_RECORD    pRecord,
+        IN  UINT8                   flagMask = 0,
+        IN  UINT8                   flags = 0
+    ) const
+    {
+        for (UINT64 seq = m_nextSeq; seq != 0; seq--)
+        {
+            if (!Read(seq - 1, pRecord))
+            {
+                return FALSE;
+            }
+            if (pRecord->kind == (UINT8)kind && (pRecord->flags & flagMask) == flags)
+            {
+                return TRUE;
+            }
+        }
+        return FALSE;
+    }
+
+    //
+    // Walk back from the end for the last case and watermark of the main
+    // pass and, if the newest case is a probe, the last probe and the probe
+    // watermark written after the main pass's last case. A journal without
+    // a main pass watermark (older ViFuR3, or probes only) is walked to its
+    // start, once
+    //
+    VOID
+    FindResume (
+        OUT PFUZZ_JOURNAL_RESUME    pResume
+    ) const
+    {
+        const UINT32        mainFound = FUZZ_JOURNAL_RESUME_HAS_CASE | FUZZ_JOURNAL_RESUME_HAS_LOW;
+        FUZZ_JOURNAL_RECORD record;
+        BOOL                bProbing = TRUE;    // No main pass case seen yet
+
+        memset(pResume, 0, sizeof(FUZZ_JOURNAL_RESUME));
+        for (UINT64 seq = m_nextSeq; seq != 0 && (pResume->flags & mainFound) != mainFound; seq--)
+        {
+            if (!Read(seq - 1, &record))
+            {
+                return;
+            }
+
+            BOOL bProbe = (record.flags & FUZZ_JOURNAL_FLAG_PROBE) != 0;
+
+            if (record.kind == FUZZ_JOURNAL_KIND_CASE && !bProbe)
+            {
+                if (!(pResume->flags & FUZZ_JOURNAL_RESUME_HAS_CASE))
+                {
+                    pResume->lastCase = record;
+                    pResume->flags |= FUZZ_JOURNAL_RESUME_HAS_CASE;
+                }
+                bProbing = FALSE;
+            }
+            else if (record.kind == FUZZ_JOURNAL_KIND_CASE && bProbing &&
+                     !(pResume->flags & FUZZ_JOURNAL_RESUME_HAS_PROBE))
+            {
+                pResume->lastProbe = record;
+                pResume->flags |= FUZZ_JOURNAL_RESUME_HAS_PROBE;
+            }
+            else if (record.kind == FUZZ_JOURNAL_KIND_WATERMARK && !bProbe &&
+                     !(pResume->flags & FUZZ_JOURNAL_RESUME_HAS_LOW))
+            {
+                pResume->low = record.regs[0];
+                pResume->flags |= FUZZ_JOURNAL_RESUME_HAS_LOW;
+            }
+            else if (record.kind == FUZZ_JOURNAL_KIND_WATERMARK && bProbe && bProbing &&
+                     !(pResume->flags & FUZZ_JOURNAL_RESUME_HAS_PROBE_LOW))
+            {
+                pResume->probeLow = record.regs[0];
+                pResume->flags |= FUZZ_JOURNAL_RESUME_HAS_PROBE_LOW;
+            }
+        }
+    }
+
+private:
+    //
+    // Number of records before the first bad one at the tail. Only the tail
+    // is looked at, so this is one read for a clean journal
+    //
+    UINT64
+    FindValidEnd (
+        IN UINT64   slots
+    ) const
+    {
+        FUZZ_JOURNAL_RECORD chunk[64];
+
+        while (slots != 0)
+        {
+            UINT64 first = slots > _ARRAYSIZE(chunk) ? slots - _ARRAYSIZE(chunk) : 0;
+            UINT32 cnt = (UINT32)(slots - first);
+
+            if (!FuzzJournalFdRead(m_fd, FUZZ_JOURNAL_RECORD_OFFSET(first), chunk, cnt * FUZZ_JOURNAL_RECORD_SIZE))
+            {
+                return 0;
+            }
+
+            for (UINT32 r = cnt; r != 0; r--)
+            {
+                if (FuzzJournalCheckRecord(&chunk[r - 1], first + r - 1, m_campaignId))
+                {
+                    return first + r;
+                }
+            }
+            slots = first;
+        }
+        return 0;
+    }
+
+    FUZZ_JOURNAL_FD     m_fd;
+    FUZZ_JOURNAL_HEADER m_header;
+    UINT64              m_campaignId;
+    UINT64              m_nextSeq;
+    UINT64              m_tornRecords;
+};
+
+//
+// Read only memory mapped view of a whole journal
+//
+class FuzzJournalReader
+{
+public:
+    FuzzJournalReader ()
+        : m_pView(NULL),
+          m_size(0),
+          m_count(0)
+#if defined(_WIN32)
+          , m_hFile(INVALID_HANDLE_VALUE),
+          m_hMapping(NULL)
+#endif
+    {
+    }
+
+    ~FuzzJournalReader ()
+    {
+        Close();
+    }
+
+    BOOL
+    Open (
+        IN const CHAR   *path
+    )
+    {
+        Close();
+
+#if defined(_WIN32)
+        LARGE_INTEGER size;
+
+        m_hFile = CreateFileA(path,
+                              GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE,
+                              NULL,
+                              OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN,
+                              NULL);
+        if (m_hFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_hFile, &size))
+        {
+            Close();
+            return FALSE;
+        }
+        m_size = (UINT64)size.QuadPart;
+        if (m_size >= FUZZ_JOURNAL_HEADER_SIZE)
+        {
+            m_hMapping = CreateFileMapping(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+            m_pView = m_hMapping != NULL ? (const UINT8 *)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        }
+#else
+        struct stat st;
+        INT         fd = open(path, O_RDONLY);
+
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return FALSE;
+        }
+        m_size = (UINT64)st.st_size;
+        if (m_size >= FUZZ_JOURNAL_HEADER_SIZE)
+        {
+            VOID *pView = mmap(NULL, (SIZE_T)m_size, PROT_READ, MAP_SHARED, fd, 0);
+
+            m_pView = pView != MAP_FAILED ? (const UINT8 *)pView : NULL;
+        }
+        close(fd);
+#endif
+
+        if (m_pView == NULL || !FuzzJournalCheckHeader(Header()))
+        {
+            Close();
+            return FALSE;
+        }
+
+        //
+        // Same tail rule as the writer
+        //
+        m_count = (m_size - FUZZ_JOURNAL_HEADER_SIZE) / FUZZ_JOURNAL_RECORD_SIZE;
+        while (m_count != 0 && !IsValid(m_count - 1))
+        {
+            m_count--;
+        }
+        return TRUE;
+    }
+
+    VOID
+    Close ()
+    {
+#if defined(_WIN32)
+        if (m_pView != NULL)
+        {
+            UnmapViewOfFile(m_pView);
+        }
+        if (m_hMapping != NULL)
+        {
+            CloseHandle(m_hMapping);
+        }
+        if (m_hFile != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_hFile);
+        }
+        m_hMapping = NULL;
+        m_hFile = INVALID_HANDLE_VALUE;
+#else
+        if (m_pView != NULL)
+        {
+            munmap((VOID *)m_pView, (SIZE_T)m_size);
+        }
+#endif
+        m_pView = NULL;
+        m_size = 0;
+        m_count = 0;
+    }
+
+    const FUZZ_JOURNAL_HEADER *
+    Header () const
+    {
+        return (const FUZZ_JOURNAL_HEADER *)m_pView;
+    }
+
+    //
+    // Records up to the last valid one, an invalid record before it means
+    // corruption in the middle of the journal, not a torn tail
+    //
+    UINT64 Count () const { return m_count; }
+
+    const FUZZ_JOURNAL_RECORD *
+    Record (
+        IN UINT64   sequence
+    ) const
+    {
+        return (const FUZZ_JOURNAL_RECORD *)(m_pView + FUZZ_JOURNAL_RECORD_OFFSET(sequence));
+    }
+
+    BOOL
+    IsValid (
+        IN UINT64   sequence
+    ) const
+    {
+        return FuzzJournalCheckRecord(Record(sequence), sequence, Header()->campaignId);
+    }
+
+private:
+    const UINT8 *m_pView;
+    UINT64      m_size;
+    UINT64      m_count;
+#if defined(_WIN32)
+    HANDLE      m_hFile;
+    HANDLE      m_hMapping;
+#endif
+};
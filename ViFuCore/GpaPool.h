@@ -0,0 +1,273 @@
+/*++
+
+Module Name:
+
+    GpaPool.h
+
+Abstract:
+
+    Preallocated per-processor pool of pinned pages handed to the hypervisor
+    as GPAs (USE_GPA_MEM_* substitutions).
+
+    Every page is allocated and translated once when the pool is created, so
+    running a case costs a slot lock, two stack pops and two pushes instead of
+    a pool allocation, a page clear and a PA lookup per register. Pages are not
+    cleared when recycled - a page is only exposed to the hypervisor once its
+    GPA is substituted into a register, and every substitution rewrites the
+    whole page first.
+
+    Each processor owns a slot holding a small free stack of pages. A caller
+    claims the slot of the processor it is running on; if the thread migrated
+    and that slot is taken, the next free slot is used instead, so a slot is
+    never shared and needs no locking beyond the claim.
+
+    Page allocation and translation go through GpaPoolPlatform.h, so the same
+    code runs on real pages in the driver and on heap pages with fake PAs in
+    ViFuBench.
+
+    Plain C so it can be used by the driver.
+
+Environment:
+
+    Kernel mode, User mode, Portable
+
+--*/
+
+#pragma once
+
+#include "GpaPoolPlatform.h"
+
+#define GPA_POOL_CACHE_LINE     64
+
+//
+// One input and one output page per processor
+//
+#define GPA_POOL_PAGES_PER_CPU  2
+
+typedef struct _GPA_PAGE
+{
+    PCHAR   pVa;
+    UINT64  pa;
+} GPA_PAGE, *PGPA_PAGE;
+
+//
+// Per-processor slot, one cache line so processors never share one
+//
+typedef struct _GPA_POOL_CPU
+{
+    volatile LONG   lock;
+    UINT32          freeCnt;
+    PGPA_PAGE       *ppFree;    // Free stack, pagesPerCpu entries
+    UINT8           rsvd[GPA_POOL_CACHE_LINE - 2 * sizeof(UINT32) - sizeof(PVOID)];
+} GPA_POOL_CPU, *PGPA_POOL_CPU;
+C_ASSERT(sizeof(GPA_POOL_CPU) == GPA_POOL_CACHE_LINE);
+
+typedef struct _GPA_POOL
+{
+    PGPA_POOL_CPU   pCpus;
+    PGPA_PAGE       pPages;     // cpuCnt * pagesPerCpu descriptors
+    PGPA_PAGE       *ppFree;    // Backing store for every slot's free stack
+    UINT32          cpuCnt;
+    UINT32          pagesPerCpu;
+} GPA_POOL, *PGPA_POOL;
+
+//
+// Input/output pages claimed for one or more cases
+//
+typedef struct _GPA_PAGE_PAIR
+{
+    PGPA_POOL_CPU   pCpu;
+    PGPA_PAGE       pIn;
+    PGPA_PAGE       pOut;
+} GPA_PAGE_PAIR, *PGPA_PAGE_PAIR;
+
+//
+// Free every page and the bookkeeping, safe on a partially created pool
+//
+GPA_PLATFORM_INLINE VOID
+GpaPoolDestroy (
+    IN OUT PGPA_POOL    pPool
+)
+{
+    if (pPool->pPages != NULL)
+    {
+        for (UINT32 p = 0; p < pPool->cpuCnt * pPool->pagesPerCpu; p++)
+        {
+            if (pPool->pPages[p].pVa != NULL)
+            {
+                GpaPlatformFree(pPool->pPages[p].pVa);
+            }
+        }
+        GpaPlatformFree(pPool->pPages);
+    }
+
+    if (pPool->ppFree != NULL)
+    {
+        GpaPlatformFree(pPool->ppFree);
+    }
+
+    if (pPool->pCpus != NULL)
+    {
+        GpaPlatformFree(pPool->pCpus);
+    }
+
+    memset(pPool, 0, sizeof(GPA_POOL));
+}
+
+//
+// Allocate pagesPerCpu pages for each of cpuCnt processors and cache their PAs
+//
+GPA_PLATFORM_INLINE BOOL
+GpaPoolInit (
+    OUT PGPA_POOL   pPool,
+    IN  UINT32      cpuCnt,
+    IN  UINT32      pagesPerCpu
+)
+{
+    SIZE_T pageCnt = (SIZE_T)cpuCnt * pagesPerCpu;
+
+    memset(pPool, 0, sizeof(GPA_POOL));
+
+    if (cpuCnt == 0 || pagesPerCpu == 0)
+    {
+        return FALSE;
+    }
+
+    pPool->cpuCnt = cpuCnt;
+    pPool->pagesPerCpu = pagesPerCpu;
+    pPool->pCpus = (PGPA_POOL_CPU)GpaPlatformAlloc(cpuCnt * sizeof(GPA_POOL_CPU));
+    pPool->pPages = (PGPA_PAGE)GpaPlatformAlloc(pageCnt * sizeof(GPA_PAGE));
+    pPool->ppFree = (PGPA_PAGE *)GpaPlatformAlloc(pageCnt * sizeof(PGPA_PAGE));
+    if (pPool->pCpus == NULL || pPool->pPages == NULL || pPool->ppFree == NULL)
+    {
+        GpaPoolDestroy(pPool);
+        return FALSE;
+    }
+
+    memset(pPool->pCpus, 0, cpuCnt * sizeof(GPA_POOL_CPU));
+    memset(pPool->pPages, 0, pageCnt * sizeof(GPA_PAGE));
+
+    for (UINT32 c = 0; c < cpuCnt; c++)
+    {
+        PGPA_POOL_CPU pCpu = &pPool->pCpus[c];
+
+        pCpu->ppFree = &pPool->ppFree[(SIZE_T)c * pagesPerCpu];
+
+        for (UINT32 p = 0; p < pagesPerCpu; p++)
+        {
+            PGPA_PAGE pPage = &pPool->pPages[(SIZE_T)c * pagesPerCpu + p];
+
+            pPage->pVa = (PCHAR)GpaPlatformAlloc(GPA_PAGE_SIZE);
+            if (pPage->pVa == NULL)
+            {
+                GpaPoolDestroy(pPool);
+                return FALSE;
+            }
+
+            memset(pPage->pVa, 0, GPA_PAGE_SIZE);
+            pPage->pa = GpaPlatformGetPhysical(pPage->pVa);
+            pCpu->ppFree[pCpu->freeCnt++] = pPage;
+        }
+    }
+
+    return TRUE;
+}
+
+//
+// Claim the slot of processor cpuIdx, or the next free one if it is taken.
+// Returns NULL only if every slot is in use
+//
+GPA_PLATFORM_INLINE PGPA_POOL_CPU
+GpaPoolAcquire (
+    IN PGPA_POOL    pPool,
+    IN UINT32       cpuIdx
+)
+{
+    UINT32 c = cpuIdx < pPool->cpuCnt ? cpuIdx : cpuIdx % pPool->cpuCnt;
+
+    for (UINT32 tries = 0; tries < pPool->cpuCnt; tries++)
+    {
+        if (GpaPlatformTryLock(&pPool->pCpus[c].lock))
+        {
+            return &pPool->pCpus[c];
+        }
+
+        if (++c == pPool->cpuCnt)
+        {
+            c = 0;
+        }
+    }
+
+    return NULL;
+}
+
+GPA_PLATFORM_INLINE VOID
+GpaPoolRelease (
+    IN OUT PGPA_POOL_CPU    pCpu
+)
+{
+    GpaPlatformUnlock(&pCpu->lock);
+}
+
+//
+// O(1) page hand out and recycle on a claimed slot
+//
+GPA_PLATFORM_INLINE PGPA_PAGE
+GpaPoolPop (
+    IN OUT PGPA_POOL_CPU    pCpu
+)
+{
+    return pCpu->freeCnt != 0 ? pCpu->ppFree[--pCpu->freeCnt] : NULL;
+}
+
+GPA_PLATFORM_INLINE VOID
+GpaPoolPush (
+    IN OUT PGPA_POOL_CPU    pCpu,
+    IN     PGPA_PAGE        pPage
+)
+{
+    pCpu->ppFree[pCpu->freeCnt++] = pPage;
+}
+
+//
+// Claim a slot and take an input and an output page from it
+//
+GPA_PLATFORM_INLINE BOOL
+GpaPoolAcquirePair (
+    IN  PGPA_POOL       pPool,
+    IN  UINT32          cpuIdx,
+    OUT PGPA_PAGE_PAIR  pPair
+)
+{
+    pPair->pCpu = GpaPoolAcquire(pPool, cpuIdx);
+    if (pPair->pCpu == NULL)
+    {
+        return FALSE;
+    }
+
+    pPair->pIn = GpaPoolPop(pPair->pCpu);
+    pPair->pOut = GpaPoolPop(pPair->pCpu);
+    if (pPair->pOut == NULL)
+    {
+        if (pPair->pIn != NULL)
+        {
+            GpaPoolPush(pPair->pCpu, pPair->pIn);
+        }
+        GpaPoolRelease(pPair->pCpu);
+        pPair->pCpu = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+GPA_PLATFORM_INLINE VOID
+GpaPoolReleasePair (
+    IN OUT PGPA_PAGE_PAIR   pPair
+)
+{
+    GpaPoolPush(pPair->pCpu, pPair->pOut);
+    GpaPoolPush(pPair->pCpu, pPair->pIn);
+    GpaPoolRelease(pPair->pCpu);
+    pPair->pCpu = NULL;
+}
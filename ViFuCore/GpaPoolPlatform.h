@@ -0,0 +1,151 @@
+/*++
+
+Module Name:
+
+    GpaPoolPlatform.h
+
+Abstract:
+
+    Platform shim for GpaPool.h - page allocation, VA to PA translation and
+    the per-processor slot lock.
+
+    Driver      NonPagedPool pages, PA from MmGetPhysicalAddress
+    User mode   page aligned heap pages, the VA stands in for the PA. It is
+                unique, page aligned and stable for the life of the page,
+                which is all the pool relies on
+
+Environment:
+
+    Kernel mode, User mode, Portable
+
+--*/
+
+#pragma once
+
+#include "ViFuPlatform.h"
+
+#define GPA_PAGE_SIZE   0x1000
+#define GPA_POOL_TAG    'VIFU'
+
+#if defined(_MSC_VER)
+#define GPA_PLATFORM_INLINE static __forceinline
+#else
+#define GPA_PLATFORM_INLINE static inline
+#endif
+
+#if defined(_NTDDK_) || defined(_WDMDDK_)
+
+GPA_PLATFORM_INLINE PVOID
+GpaPlatformAlloc (
+    IN SIZE_T   size
+)
+{
+    //
+    // Page sized (or larger) NonPagedPool allocations are page aligned
+    //
+    return ExAllocatePoolWithTag( NonPagedPool, size, GPA_POOL_TAG );
+}
+
+GPA_PLATFORM_INLINE VOID
+GpaPlatformFree (
+    IN PVOID    p
+)
+{
+    ExFreePoolWithTag( p, GPA_POOL_TAG );
+}
+
+GPA_PLATFORM_INLINE UINT64
+GpaPlatformGetPhysical (
+    IN PVOID    pPage
+)
+{
+    return (UINT64)MmGetPhysicalAddress( pPage ).QuadPart;
+}
+
+GPA_PLATFORM_INLINE BOOL
+GpaPlatformTryLock (
+    IN OUT volatile LONG    *pLock
+)
+{
+    return InterlockedCompareExchange( pLock, 1, 0 ) == 0;
+}
+
+GPA_PLATFORM_INLINE VOID
+GpaPlatformUnlock (
+    IN OUT volatile LONG    *pLock
+)
+{
+    InterlockedExchange( pLock, 0 );
+}
+
+#else
+
+#include <stdlib.h>
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+GPA_PLATFORM_INLINE PVOID
+GpaPlatformAlloc (
+    IN SIZE_T   size
+)
+{
+    PVOID p = NULL;
+
+#if defined(_WIN32)
+    p = _aligned_malloc(size, GPA_PAGE_SIZE);
+#else
+    if (posix_memalign(&p, GPA_PAGE_SIZE, size) != 0)
+    {
+        p = NULL;
+    }
+#endif
+    return p;
+}
+
+GPA_PLATFORM_INLINE VOID
+GpaPlatformFree (
+    IN PVOID    p
+)
+{
+#if defined(_WIN32)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+GPA_PLATFORM_INLINE UINT64
+GpaPlatformGetPhysical (
+    IN PVOID    pPage
+)
+{
+    return (UINT64)(SIZE_T)pPage;
+}
+
+GPA_PLATFORM_INLINE BOOL
+GpaPlatformTryLock (
+    IN OUT volatile LONG    *pLock
+)
+{
+#if defined(_WIN32)
+    return InterlockedCompareExchange(pLock, 1, 0) == 0;
+#else
+    LONG expected = 0;
+    return __atomic_compare_exchange_n(pLock, &expected, 1, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+#endif
+}
+
+GPA_PLATFORM_INLINE VOID
+GpaPlatformUnlock (
+    IN OUT volatile LONG    *pLock
+)
+{
+#if defined(_WIN32)
+    InterlockedExchange(pLock, 0);
+#else
+    __atomic_store_n(pLock, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+#endif
@@ -0,0 +1,476 @@
+/*++
+
+Module Name:
+
+    HavocMutator.h
+
+Abstract:
+
+    Havoc style mutation of a case's registers and, where the backend owns
+    it, the input page. Each mutation stacks 1 - maxStack operations
+
+        MUTATOR_OP_BIT_FLIP         - flip 1, 2 or 4 adjacent bits of a register
+        MUTATOR_OP_ARITH            - add or subtract 1 - 35 on an 8, 16, 32
+                                      or 64-bit lane of a register
+        MUTATOR_OP_INTERESTING      - replace a register with an interesting
+                                      value: boundaries, GPA markers and page
+                                      boundary GPAs (USE_GPA_MEM_OFFSET)
+        MUTATOR_OP_CONTROL          - change one field of the control word in
+                                      RCX: fast bit, variable header size, rep
+                                      count, rep start index or a reserved bit.
+                                      The call code is never changed, so the
+                                      call code filter still holds
+        MUTATOR_OP_PAGE_BIT_FLIP    - flip a bit of the input page
+        MUTATOR_OP_PAGE_ARITH       - add or subtract on a qword of the page
+        MUTATOR_OP_PAGE_INTERESTING - interesting value into a qword of the page
+        MUTATOR_OP_FAST_INPUT       - flip, arith or interesting value on a
+                                      qword of the extended fast call input
+                                      (FastCall.h), never leaving a GPA
+                                      marker in it. With CONTROL it is
+                                      MUTATOR_OP_MASK_REGISTER_ONLY, for cases
+                                      that must stay clear of GPA pages
+
+    The generator of iteration n is seeded from (seed, n) alone, so a case
+    can be regenerated from its base case, the seed and the iteration without
+    replaying the ones before it. MUTATOR_STATE is all there is to save.
+
+    Nothing is allocated after construction.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <stddef.h>
+#include "../ViridianFuzzer/ViridianFuzzerTypes.h"
+#include "PageFill.h"
+#include "FastCall.h"
+
+#define MUTATOR_STATE_MAGIC     0x4D484656      // 'VFHM'
+#define MUTATOR_MAX_STACK       16
+#define MUTATOR_PAGE_QWORDS     (0x1000 / sizeof(UINT64))
+
+typedef enum _MUTATOR_OP
+{
+    MUTATOR_OP_BIT_FLIP = 0,
+    MUTATOR_OP_ARITH,
+    MUTATOR_OP_INTERESTING,
+    MUTATOR_OP_CONTROL,
+    MUTATOR_OP_PAGE_BIT_FLIP,
+    MUTATOR_OP_PAGE_ARITH,
+    MUTATOR_OP_PAGE_INTERESTING,
+    MUTATOR_OP_FAST_INPUT,
+    MUTATOR_OP_COUNT
+} MUTATOR_OP;
+
+#define MUTATOR_OP_MASK_REGS    ((1u << MUTATOR_OP_BIT_FLIP) |      \
+                                 (1u << MUTATOR_OP_ARITH) |         \
+                                 (1u << MUTATOR_OP_INTERESTING) |   \
+                                 (1u << MUTATOR_OP_CONTROL))
+#define MUTATOR_OP_MASK_PAGE    ((1u << MUTATOR_OP_PAGE_BIT_FLIP) | \
+                                 (1u << MUTATOR_OP_PAGE_ARITH) |    \
+                                 (1u << MUTATOR_OP_PAGE_INTERESTING))
+#define MUTATOR_OP_MASK_REGISTER_ONLY   ((1u << MUTATOR_OP_FAST_INPUT) |    \
+                                         (1u << MUTATOR_OP_CONTROL))
+#define MUTATOR_OP_MASK_ALL     (MUTATOR_OP_MASK_REGS | MUTATOR_OP_MASK_PAGE | MUTATOR_OP_MASK_REGISTER_ONLY)
+
+//
+// Everything needed to carry on, or to regenerate any iteration
+//
+typedef struct _MUTATOR_STATE
+{
+    UINT32  magic;
+    UINT16  opMask;
+    UINT16  maxStack;
+    UINT64  seed;
+    UINT64  iteration;          // Next iteration Mutate() runs
+} MUTATOR_STATE, *PMUTATOR_STATE;
+
+C_ASSERT(sizeof(MUTATOR_STATE) == 24);
+
+//
+// What one operation did, for logs and crash reports
+//
+typedef struct _MUTATOR_STEP
+{
+    UINT8   op;                 // MUTATOR_OP
+    UINT8   rsvd;
+    UINT16  target;             // Qword of CPU_REG_64, or of the page
+    UINT32  rsvd2;
+    UINT64  value;              // New value of the target
+} MUTATOR_STEP;
+
+typedef struct _MUTATOR_LOG
+{
+    UINT64          iteration;
+    UINT32          count;
+    UINT32          rsvd;
+    MUTATOR_STEP    steps[MUTATOR_MAX_STACK];
+} MUTATOR_LOG, *PMUTATOR_LOG;
+
+//
+// Qwords of CPU_REG_64 the register operations pick from, RCX is left to
+// MUTATOR_OP_CONTROL
+//
+static const UINT8 s_mutatorRegTargets[] =
+{
+    offsetof(CPU_REG_64, rax) / 8,
+    offsetof(CPU_REG_64, rbx) / 8,
+    offsetof(CPU_REG_64, rdx) / 8,
+    offsetof(CPU_REG_64, rsi) / 8,
+    offsetof(CPU_REG_64, rdi) / 8,
+    offsetof(CPU_REG_64, r8) / 8,
+    offsetof(CPU_REG_64, r9) / 8,
+    offsetof(CPU_REG_64, r10) / 8,
+    offsetof(CPU_REG_64, r11) / 8,
+    offsetof(CPU_REG_64, xmm0) / 8,
+    offsetof(CPU_REG_64, xmm0) / 8 + 1,
+    offsetof(CPU_REG_64, xmm1) / 8,
+    offsetof(CPU_REG_64, xmm1) / 8 + 1,
+    offsetof(CPU_REG_64, xmm2) / 8,
+    offsetof(CPU_REG_64, xmm2) / 8 + 1,
+    offsetof(CPU_REG_64, xmm3) / 8,
+    offsetof(CPU_REG_64, xmm3) / 8 + 1,
+    offsetof(CPU_REG_64, xmm4) / 8,
+    offsetof(CPU_REG_64, xmm4) / 8 + 1,
+    offsetof(CPU_REG_64, xmm5) / 8,
+    offsetof(CPU_REG_64, xmm5) / 8 + 1,
+};
+
+static const UINT64 s_mutatorInteresting[] =
+{
+    0,
+    1,
+    0xFFFFFFFFFFFFFFFFULL,
+    0x7FFFFFFFFFFFFFFFULL,
+    0x8000000000000000ULL,
+    0xFFFFFFFFULL,
+    0x7FFFFFFFULL,
+    0x80000000ULL,
+    0x100000000ULL,
+    0xFFFF,
+    0x10000,
+    0x1000,
+    0xFFF,
+    0xFFFFFFFEULL,                          // HV_VP_INDEX_SELF
+    USE_GPA_MEM_NOFILL_0,
+    USE_GPA_MEM_NOFILL_1,
+    USE_GPA_MEM_FILL,
+    USE_GPA_MEM_OFFSET_GPA(0xFF8),          // Last qword of the page
+    USE_GPA_MEM_OFFSET_GPA(0xFFC),          // Crosses into the next page
+    USE_GPA_MEM_OFFSET_GPA(0xFF0),
+    USE_GPA_MEM_OFFSET_GPA(0x4),            // Misaligned
+};
+
+#define MUTATOR_INTERESTING_VALUES  14
+
+//
+// All the GPA markers share bits 63:24
+//
+#define MUTATOR_IS_GPA_MARKER(v)    (((v) >> 24) == (USE_GPA_MEM_NOFILL_0 >> 24))
+
+class HavocMutator
+{
+public:
+    explicit HavocMutator (
+        IN UINT64   seed,
+        IN UINT32   opMask = MUTATOR_OP_MASK_ALL,
+        IN UINT32   maxStack = 8
+    )
+    {
+        m_state.magic = MUTATOR_STATE_MAGIC;
+        m_state.opMask = (UINT16)(opMask & MUTATOR_OP_MASK_ALL);
+        m_state.maxStack = (UINT16)(maxStack == 0 ? 1 : (maxStack > MUTATOR_MAX_STACK ? MUTATOR_MAX_STACK : maxStack));
+        m_state.seed = seed;
+        m_state.iteration = 0;
+        m_rng = 1;
+        BuildOps();
+    }
+
+    const MUTATOR_STATE &State () const { return m_state; }
+    UINT64 Iteration () const { return m_state.iteration; }
+
+    VOID
+    Seek (
+        IN UINT64   iteration
+    )
+    {
+        m_state.iteration = iteration;
+    }
+
+    //
+    // Continue from a saved state, FALSE if it is not one
+    //
+    BOOL
+    Restore (
+        IN const MUTATOR_STATE  &state
+    )
+    {
+        if (state.magic != MUTATOR_STATE_MAGIC ||
+            (state.opMask & ~MUTATOR_OP_MASK_ALL) != 0 ||
+            state.maxStack == 0 ||
+            state.maxStack > MUTATOR_MAX_STACK)
+        {
+            return FALSE;
+        }
+
+        m_state = state;
+        BuildOps();
+        return TRUE;
+    }
+
+    //
+    // Mutate a case in place with the current iteration, then move to the
+    // next one. pPage (MUTATOR_PAGE_QWORDS) may be NULL, page operations are
+    // then skipped. Returns the number of operations applied
+    //
+    UINT32
+    Mutate (
+        IN OUT PCPU_REG_64  pRegs,
+        IN OUT PUINT64      pPage = NULL,
+        OUT    PMUTATOR_LOG pLog = NULL
+    )
+    {
+        const UINT8 *pOps = pPage != NULL ? m_ops : m_regOps;
+        UINT32 opCnt = pPage != NULL ? m_opCnt : m_regOpCnt;
+        UINT32 stack = 0;
+
+        m_rng = PageFillSplitMix(m_state.seed ^ PageFillSplitMix(m_state.iteration)) | 1;
+        if (pLog != NULL)
+        {
+            pLog->iteration = m_state.iteration;
+            pLog->count = 0;
+        }
+        m_state.iteration++;
+
+        if (opCnt == 0)
+        {
+            return 0;
+        }
+
+        stack = 1 + Below(m_state.maxStack);
+        for (UINT32 s = 0; s < stack; s++)
+        {
+            MUTATOR_STEP step = Apply(pOps[Below(opCnt)], pRegs, pPage);
+
+            if (pLog != NULL)
+            {
+                pLog->steps[pLog->count++] = step;
+            }
+        }
+        return stack;
+    }
+
+private:
+    VOID
+    BuildOps ()
+    {
+        m_opCnt = 0;
+        m_regOpCnt = 0;
+        for (UINT32 op = 0; op < MUTATOR_OP_COUNT; op++)
+        {
+            if (!(m_state.opMask & (1u << op)))
+            {
+                continue;
+            }
+            m_ops[m_opCnt++] = (UINT8)op;
+            if (!(MUTATOR_OP_MASK_PAGE & (1u << op)))
+            {
+                m_regOps[m_regOpCnt++] = (UINT8)op;
+            }
+        }
+    }
+
+    //
+    // xorshift64*
+    //
+    UINT64
+    Next ()
+    {
+        m_rng ^= m_rng >> 12;
+        m_rng ^= m_rng << 25;
+        m_rng ^= m_rng >> 27;
+        return m_rng * 0x2545F4914F6CDD1DULL;
+    }
+
+    UINT32
+    Below (
+        IN UINT32   bound
+    )
+    {
+        return (UINT32)(((Next() >> 32) * bound) >> 32);
+    }
+
+    UINT64
+    Flip (
+        IN UINT64   value
+    )
+    {
+        UINT32 width = 1u << Below(3);
+
+        return value ^ ((((UINT64)1 << width) - 1) << Below(65 - width));
+    }
+
+    UINT64
+    Arith (
+        IN UINT64   value
+    )
+    {
+        UINT32 lane = 8u << Below(4);
+        UINT32 shift = lane == 64 ? 0 : Below(64 / lane) * lane;
+        UINT64 mask = lane == 64 ? ~0ULL : (((UINT64)1 << lane) - 1) << shift;
+        UINT64 delta = (UINT64)(1 + Below(35)) << shift;
+        UINT64 sum = (Next() & 1) ? value + delta : value - delta;
+
+        return (value & ~mask) | (sum & mask);
+    }
+
+    UINT64
+    Interesting ()
+    {
+        return s_mutatorInteresting[Below(_ARRAYSIZE(s_mutatorInteresting))];
+    }
+
+    //
+    // Interesting values up to the GPA markers, which start at
+    // USE_GPA_MEM_NOFILL_0
+    //
+    UINT64
+    InterestingValue ()
+    {
+        return s_mutatorInteresting[Below(MUTATOR_INTERESTING_VALUES)];
+    }
+
+    //
+    // Fast bit, variable header size, rep count, rep start index or a
+    // reserved bit, bit positions as HV_X64_HYPERCALL_INPUT
+    //
+    UINT64
+    Control (
+        IN UINT64   rcx
+    )
+    {
+        static const UINT64 s_rsvdMask = 0xF000F000F8000000ULL;
+        UINT64 repCnt = (rcx >> 32) & 0xfff;
+        UINT64 value = 0;
+
+        switch (Below(5))
+        {
+        case 0:
+            return rcx ^ (1ULL << 16);
+        case 1:
+            value = Below(2) ? Below(0x200) : Below(4);
+            return (rcx & ~(0x1ffULL << 17)) | (value << 17);
+        case 2:
+        {
+            static const UINT64 s_repCnts[] = { 0, 1, 2, 0xfff, 0xffe, 0x100 };
+
+            value = Below(2) ? s_repCnts[Below(_ARRAYSIZE(s_repCnts))] : Below(0x1000);
+            return (rcx & ~(0xfffULL << 32)) | (value << 32);
+        }
+        case 3:
+        {
+            UINT64 starts[] = { 0, repCnt, (repCnt - 1) & 0xfff, (repCnt + 1) & 0xfff, 0xfff, Below(0x1000) };
+
+            value = starts[Below(_ARRAYSIZE(starts))];
+            return (rcx & ~(0xfffULL << 48)) | (value << 48);
+        }
+        default:
+        {
+            //
+            // One of the 13 reserved bits
+            //
+            UINT32 bit = Below(13);
+
+            bit = bit < 5 ? 27 + bit : (bit < 9 ? 44 + bit - 5 : 60 + bit - 9);
+            return rcx | (s_rsvdMask & (1ULL << bit));
+        }
+        }
+    }
+
+    MUTATOR_STEP
+    Apply (
+        IN     UINT32       op,
+        IN OUT PCPU_REG_64  pRegs,
+        IN OUT PUINT64      pPage
+    )
+    {
+        MUTATOR_STEP    step = {};
+        PUINT64         pQwords = (PUINT64)pRegs;
+        PUINT64         pTarget = NULL;
+
+        step.op = (UINT8)op;
+        if (op == MUTATOR_OP_CONTROL)
+        {
+            step.target = offsetof(CPU_REG_64, rcx) / 8;
+        }
+        else if (MUTATOR_OP_MASK_REGS & (1u << op))
+        {
+            step.target = s_mutatorRegTargets[Below(_ARRAYSIZE(s_mutatorRegTargets))];
+        }
+        else if (op == MUTATOR_OP_FAST_INPUT)
+        {
+            step.target = (UINT16)(FastCallSlot(pRegs, Below(FAST_CALL_SLOTS)) - pQwords);
+        }
+        else
+        {
+            step.target = (UINT16)Below(MUTATOR_PAGE_QWORDS);
+        }
+        pTarget = (MUTATOR_OP_MASK_PAGE & (1u << op)) ? &pPage[step.target] : &pQwords[step.target];
+
+        switch (op)
+        {
+        case MUTATOR_OP_BIT_FLIP:
+        case MUTATOR_OP_PAGE_BIT_FLIP:
+            *pTarget = Flip(*pTarget);
+            break;
+        case MUTATOR_OP_ARITH:
+        case MUTATOR_OP_PAGE_ARITH:
+            *pTarget = Arith(*pTarget);
+            break;
+        case MUTATOR_OP_INTERESTING:
+        case MUTATOR_OP_PAGE_INTERESTING:
+            *pTarget = Interesting();
+            break;
+        case MUTATOR_OP_CONTROL:
+            *pTarget = Control(*pTarget);
+            break;
+        case MUTATOR_OP_FAST_INPUT:
+            switch (Below(3))
+            {
+            case 0:
+                *pTarget = Flip(*pTarget);
+                break;
+            case 1:
+                *pTarget = Arith(*pTarget);
+                break;
+            default:
+                *pTarget = InterestingValue();
+                break;
+            }
+
+            //
+            // A flip or arith that lands on a marker would still be
+            // substituted where the batch flags don't reach, e.g. the ring
+            //
+            if (MUTATOR_IS_GPA_MARKER(*pTarget))
+            {
+                *pTarget = InterestingValue();
+            }
+            break;
+        }
+
+        step.value = *pTarget;
+        return step;
+    }
+
+    MUTATOR_STATE   m_state;
+    UINT64          m_rng;
+    UINT8           m_ops[MUTATOR_OP_COUNT];
+    UINT8           m_regOps[MUTATOR_OP_COUNT];
+    UINT32          m_opCnt;
+    UINT32          m_regOpCnt;
+};
@@ -0,0 +1,161 @@
+/*++
+
+Module Name:
+
+    HcBackend.h
+
+Abstract:
+
+    Execute interface between the fuzzer and whatever answers its hypercalls.
+    ViFuR3 talks to the driver through it, and the in-process backends let
+    the batching path be driven and measured on any platform.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <chrono>
+#include "HcBatch.h"
+#include "RepContinuation.h"
+
+//
+// A backend consumes an IOCTL_HYPERCALL_BATCH input buffer and fills in the
+// HYPERCALL_BATCH_RESULT records. Returns 0 on success or a VIFU_CREATE_ERR
+// code, the same as the driver
+//
+class HcBackend
+{
+public:
+    virtual ~HcBackend () {}
+
+    virtual UINT32
+    ExecBatch (
+        IN  const VOID  *pInBuf,
+        IN  UINT32      inBufLen,
+        OUT VOID        *pOutBuf,
+        IN  UINT32      outBufLen,
+        OUT PUINT32     pBytesRet
+    ) = 0;
+
+    UINT32
+    ExecBatch (
+        IN  const HcBatchEncoder    &batch,
+        OUT HcBatchResults          &results
+    )
+    {
+        UINT32 bytesRet = 0;
+        UINT32 status = ExecBatch(batch.Data(),
+                                  batch.Size(),
+                                  results.Data(),
+                                  results.Capacity(),
+                                  &bytesRet);
+
+        results.SetBytesReturned(status == 0 ? bytesRet : 0);
+        return status;
+    }
+};
+
+//
+// Per-case handler for the loopback backend. Returns the full RAX value the
+// hypercall would have (HV_STATUS in the low 16 bits, repComplete in 43:32)
+//
+typedef UINT64 (*HC_LOOPBACK_HANDLER)(
+    IN  const CPU_REG_64    *pInRegs,
+    OUT PCPU_REG_64         pOutRegs,
+    IN  VOID                *pContext
+    );
+
+//
+// Default loopback handler - echoes the input registers back with success
+//
+inline UINT64
+HcLoopbackEcho (
+    IN  const CPU_REG_64    *pInRegs,
+    OUT PCPU_REG_64         pOutRegs,
+    IN  VOID                *pContext
+)
+{
+    (VOID)pContext;
+    memcpy(pOutRegs, pInRegs, sizeof(CPU_REG_64));
+    return HV_STATUS_SUCCESS;
+}
+
+//
+// In-process backend that decodes the batch exactly as the driver does and
+// runs each case through a handler instead of a vmcall, continuing partially
+// complete rep calls the same way. There is no TSC to read portably, cycles
+// holds the steady clock nanoseconds instead
+//
+class HcLoopbackBackend : public HcBackend
+{
+public:
+    explicit HcLoopbackBackend (
+        IN HC_LOOPBACK_HANDLER  pHandler = HcLoopbackEcho,
+        IN VOID                 *pContext = NULL
+    )
+        : m_pHandler(pHandler),
+          m_pContext(pContext)
+    {
+    }
+
+    using HcBackend::ExecBatch;
+
+    virtual UINT32
+    ExecBatch (
+        IN  const VOID  *pInBuf,
+        IN  UINT32      inBufLen,
+        OUT VOID        *pOutBuf,
+        IN  UINT32      outBufLen,
+        OUT PUINT32     pBytesRet
+    )
+    {
+        HcBatchDecoder          decoder;
+        PHYPERCALL_BATCH_RESULT pResults = (PHYPERCALL_BATCH_RESULT)pOutBuf;
+
+        *pBytesRet = 0;
+
+        if (!decoder.Parse(pInBuf, inBufLen))
+        {
+            return VIFU_CREATE_ERR(VIFU_ERR_INVALID_BATCH, FACILITY_VIFU);
+        }
+
+        if (pOutBuf == NULL || outBufLen < HYPERCALL_BATCH_OUTPUT_SIZE(decoder.Count()))
+        {
+            return VIFU_CREATE_ERR(VIFU_ERR_BUFFER_TOO_SMALL, FACILITY_VIFU);
+        }
+
+        for (UINT32 c = 0; c < decoder.Count(); c++)
+        {
+            CPU_REG_64  regs = decoder.Case(c);
+            UINT64      rax = 0;
+            auto        start = std::chrono::steady_clock::now();
+
+            memset(&pResults[c], 0, sizeof(HYPERCALL_BATCH_RESULT));
+            rax = m_pHandler(&regs, &pResults[c].regsOut, m_pContext);
+
+            while (pResults[c].continuations < REP_CONTINUATION_MAX &&
+                   RepContinuationNext(&regs.rcx, rax))
+            {
+                rax = m_pHandler(&regs, &pResults[c].regsOut, m_pContext);
+                pResults[c].continuations++;
+            }
+            pResults[c].cycles = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now() - start).count();
+
+            pResults[c].regsOut.rax = rax;
+            pResults[c].hvStatus = HV_RESULT_STATUS(rax);
+            pResults[c].repComplete = HV_RESULT_REP_COMPLETE(rax);
+        }
+
+        *pBytesRet = (UINT32)HYPERCALL_BATCH_OUTPUT_SIZE(decoder.Count());
+        return 0;
+    }
+
+private:
+    HC_LOOPBACK_HANDLER m_pHandler;
+    VOID                *m_pContext;
+};
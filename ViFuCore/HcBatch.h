@@ -0,0 +1,191 @@
+/*++
+
+Module Name:
+
+    HcBatch.h
+
+Abstract:
+
+    Encoder/decoder for the IOCTL_HYPERCALL_BATCH wire format. The same code is
+    used by ViFuR3 to build batches for the driver and by the in-process
+    backends to consume them, so the format can be exercised without a
+    Hyper-V guest.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <vector>
+#include "../ViridianFuzzer/ViridianFuzzerTypes.h"
+
+//
+// Builds a batch of CPU_REG_64 cases in a contiguous buffer ready to be passed
+// as the IOCTL input. The buffer is sized once for maxCases and reused
+//
+class HcBatchEncoder
+{
+public:
+    explicit HcBatchEncoder (
+        IN UINT32   maxCases = HYPERCALL_BATCH_MAX_CASES
+    )
+        : m_maxCases(maxCases > HYPERCALL_BATCH_MAX_CASES ? HYPERCALL_BATCH_MAX_CASES : maxCases),
+          m_buf(HYPERCALL_BATCH_INPUT_SIZE(m_maxCases) / sizeof(UINT64))
+    {
+        Reset();
+    }
+
+    VOID
+    Reset ()
+    {
+        PHYPERCALL_BATCH_HEADER pHeader = Header();
+
+        pHeader->magic = HYPERCALL_BATCH_MAGIC;
+        pHeader->version = HYPERCALL_BATCH_VERSION;
+        pHeader->flags = 0;
+        pHeader->caseCnt = 0;
+        pHeader->rsvd = 0;
+    }
+
+    //
+    // Returns FALSE if the batch is already full
+    //
+    BOOL
+    Add (
+        IN const CPU_REG_64 &regs
+    )
+    {
+        PHYPERCALL_BATCH_HEADER pHeader = Header();
+
+        if (pHeader->caseCnt >= m_maxCases)
+        {
+            return FALSE;
+        }
+
+        memcpy(&Cases()[pHeader->caseCnt], &regs, sizeof(CPU_REG_64));
+        pHeader->caseCnt++;
+        return TRUE;
+    }
+
+    //
+    // Hands out the next slot for the caller to fill in place, avoiding the
+    // extra copy of Add(). Returns NULL if the batch is full
+    //
+    PCPU_REG_64
+    Next ()
+    {
+        PHYPERCALL_BATCH_HEADER pHeader = Header();
+
+        if (pHeader->caseCnt >= m_maxCases)
+        {
+            return NULL;
+        }
+
+        return &Cases()[pHeader->caseCnt++];
+    }
+
+    //
+    // HYPERCALL_BATCH_FLAG_*, cleared by Reset
+    //
+    VOID SetFlags (IN UINT16 flags) { Header()->flags = flags; }
+    UINT16 Flags () const { return Header()->flags; }
+
+    UINT32 Count () const { return Header()->caseCnt; }
+    UINT32 MaxCases () const { return m_maxCases; }
+    BOOL IsFull () const { return Count() >= m_maxCases; }
+    BOOL IsEmpty () const { return Count() == 0; }
+
+    const CPU_REG_64 &Case (IN UINT32 i) const { return Cases()[i]; }
+
+    const VOID *Data () const { return m_buf.data(); }
+    UINT32 Size () const { return (UINT32)HYPERCALL_BATCH_INPUT_SIZE(Count()); }
+    UINT32 ResultSize () const { return (UINT32)HYPERCALL_BATCH_OUTPUT_SIZE(Count()); }
+
+private:
+    PHYPERCALL_BATCH_HEADER Header () { return (PHYPERCALL_BATCH_HEADER)m_buf.data(); }
+    const HYPERCALL_BATCH_HEADER *Header () const { return (const HYPERCALL_BATCH_HEADER *)m_buf.data(); }
+    PCPU_REG_64 Cases () { return (PCPU_REG_64)(Header() + 1); }
+    const CPU_REG_64 *Cases () const { return (const CPU_REG_64 *)(Header() + 1); }
+
+    UINT32              m_maxCases;
+    std::vector<UINT64> m_buf;      // UINT64 to keep the records 8 byte aligned
+};
+
+//
+// Validates and gives indexed access to a batch received as IOCTL input.
+// Mirrors the checks ExecHypercallBatch makes in the driver
+//
+class HcBatchDecoder
+{
+public:
+    HcBatchDecoder ()
+        : m_pHeader(NULL)
+    {
+    }
+
+    BOOL
+    Parse (
+        IN const VOID   *pBuf,
+        IN SIZE_T       bufLen
+    )
+    {
+        const HYPERCALL_BATCH_HEADER *pHeader = (const HYPERCALL_BATCH_HEADER *)pBuf;
+
+        m_pHeader = NULL;
+
+        if (pBuf == NULL ||
+            bufLen < sizeof(HYPERCALL_BATCH_HEADER) ||
+            pHeader->magic != HYPERCALL_BATCH_MAGIC ||
+            pHeader->version != HYPERCALL_BATCH_VERSION ||
+            (pHeader->flags & ~HYPERCALL_BATCH_FLAGS_VALID) != 0 ||
+            pHeader->caseCnt > HYPERCALL_BATCH_MAX_CASES ||
+            bufLen < HYPERCALL_BATCH_INPUT_SIZE(pHeader->caseCnt))
+        {
+            return FALSE;
+        }
+
+        m_pHeader = pHeader;
+        return TRUE;
+    }
+
+    UINT32 Count () const { return m_pHeader ? m_pHeader->caseCnt : 0; }
+    UINT16 Flags () const { return m_pHeader ? m_pHeader->flags : 0; }
+    const CPU_REG_64 &Case (IN UINT32 i) const { return ((const CPU_REG_64 *)(m_pHeader + 1))[i]; }
+
+private:
+    const HYPERCALL_BATCH_HEADER *m_pHeader;
+};
+
+//
+// Output side of a batch - an array of HYPERCALL_BATCH_RESULT sized for the
+// encoder it is paired with
+//
+class HcBatchResults
+{
+public:
+    explicit HcBatchResults (
+        IN UINT32   maxCases = HYPERCALL_BATCH_MAX_CASES
+    )
+        : m_results(maxCases),
+          m_cnt(0)
+    {
+    }
+
+    PHYPERCALL_BATCH_RESULT Data () { return m_results.data(); }
+    UINT32 Capacity () const { return (UINT32)HYPERCALL_BATCH_OUTPUT_SIZE(m_results.size()); }
+
+    //
+    // Number of valid records is derived from the bytes returned by the IOCTL
+    //
+    VOID SetBytesReturned (IN UINT32 bytesRet) { m_cnt = bytesRet / sizeof(HYPERCALL_BATCH_RESULT); }
+
+    UINT32 Count () const { return m_cnt; }
+    const HYPERCALL_BATCH_RESULT &operator[] (IN UINT32 i) const { return m_results[i]; }
+
+private:
+    std::vector<HYPERCALL_BATCH_RESULT> m_results;
+    UINT32                              m_cnt;
+};
@@ -0,0 +1,369 @@
+/*++
+
+Module Name:
+
+    HcLatency.h
+
+Abstract:
+
+    Latency of hypercalls per call code and per HV_STATUS, in the TSC cycles
+    the driver times around each vmcall (HYPERCALL_BATCH_RESULT.cycles).
+
+    ConcurrentLatencyHistogram has LatencyHistogram's log-linear buckets
+    with atomic counters, so any number of triage threads record into the
+    same one without a lock. HcLatency keeps one per call code with every
+    status in it, and one per call code and status, allocated the first
+    time the pair is seen and never freed before the HcLatency is.
+
+    Record also says whether the case is an outlier: more than
+    HC_LATENCY_OUTLIER_ORDERS powers of 10 slower or faster than the
+    median of its call code. The median is taken once a call code has
+    HC_LATENCY_WARMUP cases and again every HC_LATENCY_WARMUP after, by
+    whichever thread records the case that crosses the mark, so judging a
+    case costs a load and a division or two. A call that takes a very
+    different path through the hypervisor than the rest of its call code is
+    where the fuzzer should look.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include "HypercallTable.h"
+#include "LatencyHistogram.h"
+
+//
+// HV_STATUS values below this get a histogram each, the rest share the last
+//
+#define HC_LATENCY_STATUSES         0x80
+#define HC_LATENCY_ANY_STATUS       0xffffffff
+
+#define HC_LATENCY_OUTLIER_ORDERS   3
+#define HC_LATENCY_WARMUP           1024
+
+typedef enum _HC_LATENCY_OUTLIER
+{
+    HC_LATENCY_NORMAL = 0,
+    HC_LATENCY_SLOW,
+    HC_LATENCY_FAST
+} HC_LATENCY_OUTLIER;
+
+typedef struct _HC_LATENCY_SUMMARY
+{
+    UINT32  callcode;
+    UINT32  rsvd;
+    UINT64  cases;
+    UINT64  p50;
+    UINT64  p99;
+    UINT64  max;
+    UINT64  slow;                   // Outlier cases each way
+    UINT64  fast;
+} HC_LATENCY_SUMMARY, *PHC_LATENCY_SUMMARY;
+
+class ConcurrentLatencyHistogram
+{
+public:
+    ConcurrentLatencyHistogram ()
+    {
+        for (UINT32 b = 0; b < LATENCY_HIST_BUCKETS; b++)
+        {
+            m_counts[b].store(0, std::memory_order_relaxed);
+        }
+        m_total.store(0, std::memory_order_relaxed);
+        m_sum.store(0, std::memory_order_relaxed);
+        m_max.store(0, std::memory_order_relaxed);
+    }
+
+    //
+    // Returns the samples recorded before this one
+    //
+    UINT64
+    Record (
+        IN UINT64   value
+    )
+    {
+        UINT64 max = m_max.load(std::memory_order_relaxed);
+
+        m_counts[LatencyHistogram::BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(value, std::memory_order_relaxed);
+        while (value > max &&
+               !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+        {
+        }
+        return m_total.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    //
+    // Counts as of now into pHist. Records racing with it may be seen in
+    // some of the counters and not others
+    //
+    VOID
+    Snapshot (
+        OUT LatencyHistogram    *pHist
+    ) const
+    {
+        UINT64 counts[LATENCY_HIST_BUCKETS];
+
+        for (UINT32 b = 0; b < LATENCY_HIST_BUCKETS; b++)
+        {
+            counts[b] = m_counts[b].load(std::memory_order_relaxed);
+        }
+        pHist->Load(counts, m_sum.load(std::memory_order_relaxed), m_max.load(std::memory_order_relaxed));
+    }
+
+    UINT64 Count () const { return m_total.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<UINT64> m_counts[LATENCY_HIST_BUCKETS];
+    std::atomic<UINT64> m_total;
+    std::atomic<UINT64> m_sum;
+    std::atomic<UINT64> m_max;
+};
+
+class HcLatency
+{
+public:
+    explicit HcLatency (
+        IN UINT32   outlierOrders = HC_LATENCY_OUTLIER_ORDERS,
+        IN UINT64   warmup = HC_LATENCY_WARMUP
+    )
+        : m_outlierFactor(1),
+          m_warmup(warmup != 0 ? warmup : 1),
+          m_slots(new HC_LATENCY_SLOT[HC_DESC_COUNT])
+    {
+        for (UINT32 o = 0; o < outlierOrders; o++)
+        {
+            m_outlierFactor *= 10;
+        }
+
+        for (UINT32 callcode = 0; callcode < HC_DESC_COUNT; callcode++)
+        {
+            HC_LATENCY_SLOT &slot = m_slots[callcode];
+
+            slot.median.store(0, std::memory_order_relaxed);
+            slot.slow.store(0, std::memory_order_relaxed);
+            slot.fast.store(0, std::memory_order_relaxed);
+            for (UINT32 s = 0; s < HC_LATENCY_STATUSES; s++)
+            {
+                slot.pStatus[s].store(NULL, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    ~HcLatency ()
+    {
+        for (UINT32 callcode = 0; callcode < HC_DESC_COUNT; callcode++)
+        {
+            for (UINT32 s = 0; s < HC_LATENCY_STATUSES; s++)
+            {
+                delete m_slots[callcode].pStatus[s].load(std::memory_order_relaxed);
+            }
+        }
+        delete[] m_slots;
+    }
+
+    HcLatency (const HcLatency &) = delete;
+    HcLatency &operator= (const HcLatency &) = delete;
+
+    //
+    // Count cycles of a case of callcode that returned status, and judge it
+    // against the call code's median. Call codes past the handler table are
+    // not counted
+    //
+    HC_LATENCY_OUTLIER
+    Record (
+        IN UINT32   callcode,
+        IN UINT16   status,
+        IN UINT64   cycles
+    )
+    {
+        HC_LATENCY_OUTLIER outlier = HC_LATENCY_NORMAL;
+        UINT64 median = 0;
+        UINT64 seen = 0;
+
+        if (callcode >= HC_DESC_COUNT)
+        {
+            return HC_LATENCY_NORMAL;
+        }
+
+        HC_LATENCY_SLOT &slot = m_slots[callcode];
+
+        median = slot.median.load(std::memory_order_relaxed);
+        if (median != 0)
+        {
+            if (cycles / m_outlierFactor > median)
+            {
+                outlier = HC_LATENCY_SLOW;
+                slot.slow.fetch_add(1, std::memory_order_relaxed);
+            }
+            else if (cycles < median && cycles * m_outlierFactor < median)
+            {
+                outlier = HC_LATENCY_FAST;
+                slot.fast.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        StatusHistogram(slot, status)->Record(cycles);
+        seen = slot.all.Record(cycles) + 1;
+
+        if (seen % m_warmup == 0)
+        {
+            LatencyHistogram hist;
+
+            slot.all.Snapshot(&hist);
+            median = hist.Percentile(50);
+            slot.median.store(median != 0 ? median : 1, std::memory_order_relaxed);
+        }
+        return outlier;
+    }
+
+    //
+    // Histogram of callcode for status, or every status with
+    // HC_LATENCY_ANY_STATUS. FALSE if it has no cases
+    //
+    BOOL
+    Get (
+        IN  UINT32              callcode,
+        IN  UINT32              status,
+        OUT LatencyHistogram    *pHist
+    ) const
+    {
+        const ConcurrentLatencyHistogram *pConcurrent = NULL;
+
+        pHist->Reset();
+        if (callcode >= HC_DESC_COUNT)
+        {
+            return FALSE;
+        }
+
+        if (status == HC_LATENCY_ANY_STATUS)
+        {
+            pConcurrent = &m_slots[callcode].all;
+        }
+        else
+        {
+            pConcurrent = m_slots[callcode].pStatus[StatusIndex(status)].load(std::memory_order_acquire);
+        }
+
+        if (pConcurrent == NULL)
+        {
+            return FALSE;
+        }
+        pConcurrent->Snapshot(pHist);
+        return pHist->Count() != 0;
+    }
+
+    //
+    // Median outliers of callcode are judged against, 0 before warmup
+    //
+    UINT64
+    Median (
+        IN UINT32   callcode
+    ) const
+    {
+        return callcode < HC_DESC_COUNT ? m_slots[callcode].median.load(std::memory_order_relaxed) : 0;
+    }
+
+    UINT64
+    Outliers (
+        IN UINT32               callcode,
+        IN HC_LATENCY_OUTLIER   outlier
+    ) const
+    {
+        if (callcode >= HC_DESC_COUNT || outlier == HC_LATENCY_NORMAL)
+        {
+            return 0;
+        }
+        return (outlier == HC_LATENCY_SLOW ? m_slots[callcode].slow : m_slots[callcode].fast).load(std::memory_order_relaxed);
+    }
+
+    //
+    // Call codes with at least one case, slowest 99th percentile first
+    //
+    std::vector<HC_LATENCY_SUMMARY>
+    Ranked () const
+    {
+        std::vector<HC_LATENCY_SUMMARY> ranked;
+
+        for (UINT32 callcode = 0; callcode < HC_DESC_COUNT; callcode++)
+        {
+            HC_LATENCY_SUMMARY summary = { 0 };
+            LatencyHistogram hist;
+
+            if (!Get(callcode, HC_LATENCY_ANY_STATUS, &hist))
+            {
+                continue;
+            }
+
+            summary.callcode = callcode;
+            summary.cases = hist.Count();
+            summary.p50 = hist.Percentile(50);
+            summary.p99 = hist.Percentile(99);
+            summary.max = hist.Max();
+            summary.slow = Outliers(callcode, HC_LATENCY_SLOW);
+            summary.fast = Outliers(callcode, HC_LATENCY_FAST);
+            ranked.push_back(summary);
+        }
+
+        std::sort(ranked.begin(), ranked.end(), [](const HC_LATENCY_SUMMARY &a, const HC_LATENCY_SUMMARY &b) {
+            return a.p99 > b.p99;
+        });
+        return ranked;
+    }
+
+private:
+    typedef struct _HC_LATENCY_SLOT
+    {
+        ConcurrentLatencyHistogram                  all;
+        std::atomic<UINT64>                         median;
+        std::atomic<UINT64>                         slow;
+        std::atomic<UINT64>                         fast;
+        std::atomic<ConcurrentLatencyHistogram *>   pStatus[HC_LATENCY_STATUSES];
+    } HC_LATENCY_SLOT;
+
+    static UINT32
+    StatusIndex (
+        IN UINT32   status
+    )
+    {
+        return status < HC_LATENCY_STATUSES ? status : HC_LATENCY_STATUSES - 1;
+    }
+
+    //
+    // First thread to see a status installs its histogram, one that loses
+    // the race frees its own and takes the winner's
+    //
+    static ConcurrentLatencyHistogram *
+    StatusHistogram (
+        IN HC_LATENCY_SLOT  &slot,
+        IN UINT16           status
+    )
+    {
+        std::atomic<ConcurrentLatencyHistogram *> &entry = slot.pStatus[StatusIndex(status)];
+        ConcurrentLatencyHistogram *pHist = entry.load(std::memory_order_acquire);
+        ConcurrentLatencyHistogram *pExpected = NULL;
+
+        if (pHist != NULL)
+        {
+            return pHist;
+        }
+
+        pHist = new ConcurrentLatencyHistogram();
+        if (!entry.compare_exchange_strong(pExpected, pHist, std::memory_order_acq_rel))
+        {
+            delete pHist;
+            pHist = pExpected;
+        }
+        return pHist;
+    }
+
+    UINT64          m_outlierFactor;
+    UINT64          m_warmup;
+    HC_LATENCY_SLOT *m_slots;
+};
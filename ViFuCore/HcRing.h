@@ -0,0 +1,366 @@
+/*++
+
+Module Name:
+
+    HcRing.h
+
+Abstract:
+
+    Single-producer/single-consumer lock-free ring used as the shared
+    submission/completion queue pair between ViFuR3 and the driver.
+
+    ViFuR3 allocates one region holding both rings and registers it with
+    IOCTL_HYPERCALL_RING_REGISTER, the driver maps it once. Cases are
+    written to the submission ring (SQ), IOCTL_HYPERCALL_RING_DOORBELL makes
+    the driver drain it and post results to the completion ring (CQ).
+
+    Head/tail are free running UINT32 indices, each owned by one side:
+        tail - written by the producer (release), read by the consumer (acquire)
+        head - written by the consumer (release), read by the producer (acquire)
+    Entry contents are published by the release store of tail and handed back
+    by the release store of head. Each side keeps a private copy of its own
+    index, a cached copy of the other side's, and its own copy of the ring
+    geometry, so nothing the other side writes to the shared header is trusted
+    beyond the head/tail values (which are range checked).
+
+    Plain C so it can be used by the driver.
+
+Environment:
+
+    Kernel mode, User mode, Portable
+
+--*/
+
+#pragma once
+
+#include "../ViridianFuzzer/ViridianFuzzerTypes.h"
+
+#if defined(_MSC_VER)
+#define HC_RING_INLINE  static __forceinline
+#else
+#define HC_RING_INLINE  static inline
+#endif
+
+#define HC_RING_CACHE_LINE  64
+
+//
+// Shared header, head and tail on their own cache lines to avoid false sharing
+//
+typedef struct _HC_RING_HEADER
+{
+    volatile UINT32 head;
+    UINT8           rsvd0[HC_RING_CACHE_LINE - sizeof(UINT32)];
+    volatile UINT32 tail;
+    UINT8           rsvd1[HC_RING_CACHE_LINE - sizeof(UINT32)];
+    UINT32          entryCnt;
+    UINT32          entrySize;
+    UINT8           rsvd2[HC_RING_CACHE_LINE - 2 * sizeof(UINT32)];
+} HC_RING_HEADER, *PHC_RING_HEADER;
+C_ASSERT(sizeof(HC_RING_HEADER) == 3 * HC_RING_CACHE_LINE);
+
+//
+// Private per-side view of a ring
+//
+typedef struct _HC_RING
+{
+    PHC_RING_HEADER pHeader;
+    PUINT8          pEntries;
+    UINT32          entryMask;
+    UINT32          entrySize;
+    UINT32          local;          // Own index (tail for producer, head for consumer)
+    UINT32          cachedOther;    // Last value read of the other side's index
+} HC_RING, *PHC_RING;
+
+//
+// SQ and CQ entries. userData is opaque to the driver and copied from the
+// submission to its completion
+//
+typedef struct _HC_SQ_ENTRY
+{
+    UINT64      userData;
+    CPU_REG_64  regs;
+} HC_SQ_ENTRY, *PHC_SQ_ENTRY;
+
+typedef struct _HC_CQ_ENTRY
+{
+    UINT64                  userData;
+    HYPERCALL_BATCH_RESULT  result;
+} HC_CQ_ENTRY, *PHC_CQ_ENTRY;
+
+//
+// Acquire/release accessors for the shared indices. On MSVC x86/x64 volatile
+// accesses already have acquire/release semantics (/volatile:ms), the compiler
+// barrier keeps the surrounding entry accesses on the right side of them
+//
+HC_RING_INLINE UINT32
+HcRingLoadAcquire (
+    IN const volatile UINT32    *p
+)
+{
+#if defined(_MSC_VER)
+    UINT32 v = *p;
+    _ReadWriteBarrier();
+    return v;
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+HC_RING_INLINE VOID
+HcRingStoreRelease (
+    OUT volatile UINT32 *p,
+    IN  UINT32          v
+)
+{
+#if defined(_MSC_VER)
+    _ReadWriteBarrier();
+    *p = v;
+#else
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+#endif
+}
+
+//
+// Bytes needed for a ring of entryCnt (power of 2) entries of entrySize
+//
+#define HC_RING_SIZE(entryCnt, entrySize)   \
+    (sizeof(HC_RING_HEADER) + (SIZE_T)(entryCnt) * (entrySize))
+
+#define HC_RING_IS_POW2(n)  ((n) != 0 && ((n) & ((n) - 1)) == 0)
+
+//
+// Initialise the shared header, done once by whoever owns the memory
+//
+HC_RING_INLINE VOID
+HcRingInitShared (
+    OUT PHC_RING_HEADER pHeader,
+    IN  UINT32          entryCnt,
+    IN  UINT32          entrySize
+)
+{
+    memset(pHeader, 0, sizeof(HC_RING_HEADER));
+    pHeader->entryCnt = entryCnt;
+    pHeader->entrySize = entrySize;
+}
+
+//
+// Attach a private view to a shared ring. The geometry is passed in rather than
+// read from the header so a consumer never trusts the other side with it
+//
+HC_RING_INLINE BOOL
+HcRingAttach (
+    OUT PHC_RING        pRing,
+    IN  PHC_RING_HEADER pHeader,
+    IN  UINT32          entryCnt,
+    IN  UINT32          entrySize,
+    IN  BOOL            isProducer
+)
+{
+    if (!HC_RING_IS_POW2(entryCnt) || entrySize == 0)
+    {
+        return FALSE;
+    }
+
+    pRing->pHeader = pHeader;
+    pRing->pEntries = (PUINT8)(pHeader + 1);
+    pRing->entryMask = entryCnt - 1;
+    pRing->entrySize = entrySize;
+
+    if (isProducer)
+    {
+        pRing->local = HcRingLoadAcquire(&pHeader->tail);
+        pRing->cachedOther = HcRingLoadAcquire(&pHeader->head);
+    }
+    else
+    {
+        pRing->local = HcRingLoadAcquire(&pHeader->head);
+        pRing->cachedOther = HcRingLoadAcquire(&pHeader->tail);
+    }
+
+    return TRUE;
+}
+
+HC_RING_INLINE PVOID
+HcRingSlot (
+    IN PHC_RING pRing,
+    IN UINT32   idx
+)
+{
+    return pRing->pEntries + (SIZE_T)(idx & pRing->entryMask) * pRing->entrySize;
+}
+
+//
+// Producer - returns the next free slot, or NULL if the ring is full. The slot
+// is not visible to the consumer until HcRingProducerAdvance + Publish
+//
+HC_RING_INLINE PVOID
+HcRingProducerNext (
+    IN OUT PHC_RING pRing
+)
+{
+    if (pRing->local - pRing->cachedOther > pRing->entryMask)
+    {
+        pRing->cachedOther = HcRingLoadAcquire(&pRing->pHeader->head);
+        if (pRing->local - pRing->cachedOther > pRing->entryMask)
+        {
+            return NULL;
+        }
+    }
+
+    return HcRingSlot(pRing, pRing->local);
+}
+
+HC_RING_INLINE VOID
+HcRingProducerAdvance (
+    IN OUT PHC_RING pRing
+)
+{
+    pRing->local++;
+}
+
+//
+// Make every advanced slot visible with one release store
+//
+HC_RING_INLINE VOID
+HcRingProducerPublish (
+    IN OUT PHC_RING pRing
+)
+{
+    HcRingStoreRelease(&pRing->pHeader->tail, pRing->local);
+}
+
+//
+// Consumer - returns the oldest published slot, or NULL if the ring is empty.
+// A tail further ahead than the ring size (a corrupt or hostile producer) is
+// treated as empty
+//
+HC_RING_INLINE PVOID
+HcRingConsumerNext (
+    IN OUT PHC_RING pRing
+)
+{
+    if (pRing->local == pRing->cachedOther)
+    {
+        UINT32 tail = HcRingLoadAcquire(&pRing->pHeader->tail);
+
+        if (tail == pRing->local || tail - pRing->local > pRing->entryMask + 1)
+        {
+            return NULL;
+        }
+        pRing->cachedOther = tail;
+    }
+
+    return HcRingSlot(pRing, pRing->local);
+}
+
+HC_RING_INLINE VOID
+HcRingConsumerAdvance (
+    IN OUT PHC_RING pRing
+)
+{
+    pRing->local++;
+}
+
+//
+// Hand every consumed slot back to the producer with one release store
+//
+HC_RING_INLINE VOID
+HcRingConsumerRelease (
+    IN OUT PHC_RING pRing
+)
+{
+    HcRingStoreRelease(&pRing->pHeader->head, pRing->local);
+}
+
+//
+// Layout of the registered region: SQ header + entries, then CQ header +
+// entries (CQ header kept cache line aligned)
+//
+#define HC_RING_ALIGN(n)            (((n) + HC_RING_CACHE_LINE - 1) & ~((SIZE_T)HC_RING_CACHE_LINE - 1))
+#define HC_RING_PAIR_CQ_OFFSET(sqCnt)   \
+    HC_RING_ALIGN(HC_RING_SIZE((sqCnt), sizeof(HC_SQ_ENTRY)))
+#define HC_RING_PAIR_SIZE(sqCnt, cqCnt) \
+    (HC_RING_PAIR_CQ_OFFSET(sqCnt) + HC_RING_SIZE((cqCnt), sizeof(HC_CQ_ENTRY)))
+
+#define HC_RING_MAX_ENTRIES         HYPERCALL_BATCH_MAX_CASES
+
+HC_RING_INLINE PHC_RING_HEADER
+HcRingPairSq (
+    IN PVOID    pBase
+)
+{
+    return (PHC_RING_HEADER)pBase;
+}
+
+HC_RING_INLINE PHC_RING_HEADER
+HcRingPairCq (
+    IN PVOID    pBase,
+    IN UINT32   sqCnt
+)
+{
+    return (PHC_RING_HEADER)((PUINT8)pBase + HC_RING_PAIR_CQ_OFFSET(sqCnt));
+}
+
+//
+// Executes one case for HcRingDrain, filling in the result record. That is
+// the CQ entry itself, which the other side can write to: write it, never
+// read back from it
+//
+typedef VOID (*HC_RING_EXEC_CASE)(
+    IN OUT PCPU_REG_64              pInRegs,
+    OUT    PHYPERCALL_BATCH_RESULT  pResult,
+    IN     PVOID                    pContext
+    );
+
+//
+// Consumer side of the pair - move up to maxCases from the SQ to the CQ, 
+// stopping early if either runs out. Each SQ entry is copied out before use as
+// the producer owns the memory. Indices are published every 64 cases so the
+// producer can refill/reap while this runs. Returns the number drained
+//
+HC_RING_INLINE UINT32
+HcRingDrain (
+    IN OUT PHC_RING             pSq,
+    IN OUT PHC_RING             pCq,
+    IN     UINT32               maxCases,
+    IN     HC_RING_EXEC_CASE    pfnExec,
+    IN     PVOID                pContext
+)
+{
+    PHC_SQ_ENTRY    pSqe = NULL;
+    PHC_CQ_ENTRY    pCqe = NULL;
+    CPU_REG_64      inRegs;
+    UINT64          userData = 0;
+    UINT32          drained = 0;
+
+    while (drained < maxCases &&
+           (pSqe = (PHC_SQ_ENTRY)HcRingConsumerNext(pSq)) != NULL)
+    {
+        pCqe = (PHC_CQ_ENTRY)HcRingProducerNext(pCq);
+        if (pCqe == NULL)
+        {
+            break;
+        }
+
+        userData = pSqe->userData;
+        memcpy(&inRegs, &pSqe->regs, sizeof(CPU_REG_64));
+        HcRingConsumerAdvance(pSq);
+
+        memset(pCqe, 0, sizeof(HC_CQ_ENTRY));
+        pfnExec(&inRegs, &pCqe->result, pContext);
+        pCqe->userData = userData;
+        HcRingProducerAdvance(pCq);
+
+        drained++;
+        if ((drained & 0x3F) == 0)
+        {
+            HcRingConsumerRelease(pSq);
+            HcRingProducerPublish(pCq);
+        }
+    }
+
+    HcRingConsumerRelease(pSq);
+    HcRingProducerPublish(pCq);
+
+    return drained;
+}
@@ -0,0 +1,200 @@
+/*++
+
+Module Name:
+
+    HcRingClient.h
+
+Abstract:
+
+    Producer side of the SQ/CQ ring pair as an HcBackend. Batches are copied
+    into the submission ring, the doorbell is rung and completions are reaped
+    back into HYPERCALL_BATCH_RESULT records, so ViFuR3 can switch between the
+    IOCTL batch path and the ring without touching the fuzzing loop.
+
+    How the region is allocated and how the consumer is woken is left to the
+    derived class (driver IOCTLs in ViFuR3, a polling thread in ViFuBench).
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include "HcBackend.h"
+#include "HcRing.h"
+
+class HcRingClient : public HcBackend
+{
+public:
+    //
+    // Consumer is "polled" if it drains on its own and the doorbell is only a
+    // hint, otherwise the doorbell is expected to drain synchronously
+    //
+    explicit HcRingClient (
+        IN BOOL     isPolled = FALSE
+    )
+        : m_pBase(NULL),
+          m_sqCnt(0),
+          m_cqCnt(0),
+          m_isPolled(isPolled)
+    {
+        memset(&m_sq, 0, sizeof(m_sq));
+        memset(&m_cq, 0, sizeof(m_cq));
+    }
+
+    virtual ~HcRingClient () {}
+
+    using HcBackend::ExecBatch;
+
+    virtual UINT32
+    ExecBatch (
+        IN  const VOID  *pInBuf,
+        IN  UINT32      inBufLen,
+        OUT VOID        *pOutBuf,
+        IN  UINT32      outBufLen,
+        OUT PUINT32     pBytesRet
+    )
+    {
+        HcBatchDecoder          decoder;
+        PHYPERCALL_BATCH_RESULT pResults = (PHYPERCALL_BATCH_RESULT)pOutBuf;
+        UINT32                  submitted = 0;
+        UINT32                  completed = 0;
+
+        *pBytesRet = 0;
+
+        if (m_pBase == NULL)
+        {
+            return VIFU_CREATE_ERR(VIFU_ERR_RING_NOT_REGISTERED, FACILITY_VIFU);
+        }
+
+        if (!decoder.Parse(pInBuf, inBufLen))
+        {
+            return VIFU_CREATE_ERR(VIFU_ERR_INVALID_BATCH, FACILITY_VIFU);
+        }
+
+        if (pOutBuf == NULL || outBufLen < HYPERCALL_BATCH_OUTPUT_SIZE(decoder.Count()))
+        {
+            return VIFU_CREATE_ERR(VIFU_ERR_BUFFER_TOO_SMALL, FACILITY_VIFU);
+        }
+
+        while (completed < decoder.Count())
+        {
+            UINT32 progress = 0;
+
+            while (submitted < decoder.Count())
+            {
+                PHC_SQ_ENTRY pSqe = (PHC_SQ_ENTRY)HcRingProducerNext(&m_sq);
+
+                if (pSqe == NULL)
+                {
+                    break;
+                }
+
+                pSqe->userData = submitted;
+                memcpy(&pSqe->regs, &decoder.Case(submitted), sizeof(CPU_REG_64));
+                HcRingProducerAdvance(&m_sq);
+                submitted++;
+            }
+            HcRingProducerPublish(&m_sq);
+
+            UINT32 status = Doorbell(decoder.Flags());
+            if (status != 0)
+            {
+                return status;
+            }
+
+            progress = Reap(pResults, decoder.Count());
+            completed += progress;
+
+            if (progress == 0 && !m_isPolled)
+            {
+                //
+                // Synchronous doorbell drained nothing, the consumer is stuck
+                //
+                return VIFU_CREATE_ERR(VIFU_ERR_RING_BUSY, FACILITY_VIFU);
+            }
+        }
+
+        *pBytesRet = (UINT32)HYPERCALL_BATCH_OUTPUT_SIZE(decoder.Count());
+        return 0;
+    }
+
+protected:
+    //
+    // Lay out and attach both rings in pBase, which must be at least
+    // HC_RING_PAIR_SIZE(sqCnt, cqCnt) bytes and cache line aligned
+    //
+    BOOL
+    InitRings (
+        IN PVOID    pBase,
+        IN UINT32   sqCnt,
+        IN UINT32   cqCnt
+    )
+    {
+        if (!HC_RING_IS_POW2(sqCnt) || !HC_RING_IS_POW2(cqCnt))
+        {
+            return FALSE;
+        }
+
+        HcRingInitShared(HcRingPairSq(pBase), sqCnt, sizeof(HC_SQ_ENTRY));
+        HcRingInitShared(HcRingPairCq(pBase, sqCnt), cqCnt, sizeof(HC_CQ_ENTRY));
+        HcRingAttach(&m_sq, HcRingPairSq(pBase), sqCnt, sizeof(HC_SQ_ENTRY), TRUE);
+        HcRingAttach(&m_cq, HcRingPairCq(pBase, sqCnt), cqCnt, sizeof(HC_CQ_ENTRY), FALSE);
+
+        m_pBase = pBase;
+        m_sqCnt = sqCnt;
+        m_cqCnt = cqCnt;
+        return TRUE;
+    }
+
+    VOID
+    ResetRings ()
+    {
+        m_pBase = NULL;
+    }
+
+    //
+    // Wake the consumer for cases with the given HYPERCALL_BATCH_FLAG_*, so a
+    // register only batch skips the GPA pages on the ring too. Returns 0 or a
+    // VIFU_CREATE_ERR/GLE code
+    //
+    virtual UINT32 Doorbell (IN UINT32 flags) = 0;
+
+    PVOID   m_pBase;
+    UINT32  m_sqCnt;
+    UINT32  m_cqCnt;
+
+private:
+    //
+    // Copy every available completion to its result slot (userData is the
+    // index in the batch). Returns the number reaped
+    //
+    UINT32
+    Reap (
+        OUT PHYPERCALL_BATCH_RESULT pResults,
+        IN  UINT32                  caseCnt
+    )
+    {
+        PHC_CQ_ENTRY    pCqe = NULL;
+        UINT32          reaped = 0;
+
+        while ((pCqe = (PHC_CQ_ENTRY)HcRingConsumerNext(&m_cq)) != NULL)
+        {
+            if (pCqe->userData < caseCnt)
+            {
+                memcpy(&pResults[pCqe->userData], &pCqe->result, sizeof(HYPERCALL_BATCH_RESULT));
+            }
+            HcRingConsumerAdvance(&m_cq);
+            reaped++;
+        }
+        HcRingConsumerRelease(&m_cq);
+
+        return reaped;
+    }
+
+    HC_RING m_sq;
+    HC_RING m_cq;
+    BOOL    m_isPolled;
+};
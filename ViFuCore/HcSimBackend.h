@@ -0,0 +1,1063 @@
+/*++
+
+Module Name:
+
+    HcSimBackend.h
+
+Abstract:
+
+    In-process stand-in for the hypervisor, for comparing case generators
+    without a guest. It substitutes GPA markers the way the driver does, on
+    two local pages with fixed fake GPAs, and answers each call with a
+    deterministic model of the hypervisor's input checks
+
+        HV_STATUS_INVALID_HYPERCALL_CODE    - no handler, or the stub handler
+        HV_STATUS_INVALID_HYPERCALL_INPUT   - reserved control bits set, rep
+                                              count on a simple call or none
+                                              on a rep call, rep start index
+                                              not below the rep count, fast
+                                              call with more input than
+                                              RDX, R8 and XMM0 - XMM5 hold,
+                                              input or output crossing its
+                                              page
+        HV_STATUS_INVALID_ALIGNMENT         - input or output GPA not 8-byte
+                                              aligned
+        HV_STATUS_INVALID_PARAMETER         - input or output GPA not a page
+                                              of the pool, or an input field
+                                              out of its range
+
+    Field ranges are made up, but fixed per (call code, field): either any
+    value, reserved (must be 0) or small (below 0x100, or the partition self
+    id for field 0). Anything passing gets HV_STATUS_SUCCESS with all reps
+    complete and outputSize bytes written at the output GPA, or for a fast
+    call in the registers past its input (FastCall.h). Reps run from
+    the rep start index, a bad rep element fails the call with repComplete
+    at it. With a rep slice (SetRepSlice) a call returns HV_STATUS_SUCCESS
+    after that many reps, partially complete, for the caller to continue.
+
+    Each call can be made to take a fixed time, plus a time per rep, spent
+    spinning the way a VP is held in the hypervisor during a vmcall
+    (SetLatency).
+
+    Off by default, so the model above stays what existing measurements
+    were taken against:
+
+        SetCaller   - the calling partition is a child or a parent, and
+                      call codes HypercallTable.h marks privileged fail
+                      with HV_STATUS_ACCESS_DENIED, after the control word
+                      and GPA checks
+        SetState    - partitions, ports and connections and VTLs are
+                      tracked, and the call codes that act on them check
+                      their input against that state instead of the made
+                      up field ranges: HV_STATUS_INVALID_PARTITION_ID,
+                      _PARTITION_STATE, _PORT_ID, _CONNECTION_ID,
+                      _VP_INDEX, _VP_STATE, HV_STATUS_OBJECT_IN_USE and,
+                      once HC_SIM_MAX_OBJECTS of a kind exist,
+                      HV_STATUS_INSUFFICIENT_MEMORY. Reset forgets it all
+        SetFault    - a call that reaches its handler (past the control
+                      word, GPA and privilege checks) of a call code, 1 in
+                      n at random and optionally on a predicate, crashes
+                      the hypervisor, stalls it or fails with a status.
+                      After a crash every call returns HC_SIM_CRASH_STATUS
+                      until Reset, the reboot
+
+    With none of the latency set the model runs without reading a clock,
+    a few million calls a second on one core (BenchSimBackend).
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <chrono>
+#include "HcBackend.h"
+#include "HypercallTable.h"
+#include "InputLayout.h"
+#include "PageFill.h"
+#include "FastCall.h"
+
+#define HC_SIM_INPUT_GPA    0x10000000ULL
+#define HC_SIM_OUTPUT_GPA   0x10001000ULL
+
+//
+// Control word bits the hypervisor requires to be 0
+//
+#define HC_SIM_CONTROL_RSVD_MASK    0xF000F000F8000000ULL
+
+typedef enum _HC_SIM_FIELD_KIND
+{
+    HC_SIM_FIELD_ANY = 0,
+    HC_SIM_FIELD_RESERVED,
+    HC_SIM_FIELD_SMALL
+} HC_SIM_FIELD_KIND;
+
+#define HV_VP_INDEX_SELF    0xFFFFFFFEULL
+
+//
+// The bugcheck, as a status the hypervisor never gives
+//
+#define HC_SIM_CRASH_STATUS 0xDEAD
+
+//
+// Partition id of the caller, what HV_PARTITION_ID_SELF resolves to, and
+// the first id CreatePartition hands out
+//
+#define HC_SIM_SELF_ID          1ULL
+#define HC_SIM_FIRST_CHILD_ID   0x100ULL
+
+#define HC_SIM_MAX_OBJECTS      64      // Partitions, ports or connections
+#define HC_SIM_VP_COUNT         4       // VPs of the calling partition
+#define HC_SIM_MAX_VTL          1
+
+//
+// Call codes the state model answers
+//
+#define HC_SIM_CALL_ENABLE_PARTITION_VTL    0x000d
+#define HC_SIM_CALL_DISABLE_PARTITION_VTL   0x000e
+#define HC_SIM_CALL_ENABLE_VP_VTL           0x000f
+#define HC_SIM_CALL_DISABLE_VP_VTL          0x0010
+#define HC_SIM_CALL_VTL_CALL                0x0011
+#define HC_SIM_CALL_VTL_RETURN              0x0012
+#define HC_SIM_CALL_CREATE_PARTITION        0x0040
+#define HC_SIM_CALL_INITIALIZE_PARTITION    0x0041
+#define HC_SIM_CALL_FINALIZE_PARTITION      0x0042
+#define HC_SIM_CALL_DELETE_PARTITION        0x0043
+#define HC_SIM_CALL_GET_PARTITION_PROPERTY  0x0044
+#define HC_SIM_CALL_SET_PARTITION_PROPERTY  0x0045
+#define HC_SIM_CALL_GET_PARTITION_ID        0x0046
+#define HC_SIM_CALL_CREATE_PORT             0x0057
+#define HC_SIM_CALL_DELETE_PORT             0x0058
+#define HC_SIM_CALL_CONNECT_PORT            0x0059
+#define HC_SIM_CALL_DISCONNECT_PORT         0x005b
+#define HC_SIM_CALL_POST_MESSAGE            0x005c
+#define HC_SIM_CALL_SIGNAL_EVENT            0x005d
+#define HC_SIM_CALL_CREATE_PORT_EX          0x0095
+#define HC_SIM_CALL_CONNECT_PORT_EX         0x0096
+
+//
+// State SetState tracks
+//
+#define HC_SIM_STATE_PARTITIONS 0x01
+#define HC_SIM_STATE_PORTS      0x02    // Ports and connections
+#define HC_SIM_STATE_VTLS       0x04
+#define HC_SIM_STATE_ALL        0x07
+
+typedef enum _HC_SIM_CALLER
+{
+    HC_SIM_CALLER_ROOT = 0,             // Passes every privilege check
+    HC_SIM_CALLER_PARENT,               // Passes HC_PRIV_PARENT and HC_PRIV_PARENT_ROOT
+    HC_SIM_CALLER_CHILD                 // Passes none
+} HC_SIM_CALLER;
+
+typedef enum _HC_SIM_FAULT_KIND
+{
+    HC_SIM_FAULT_NONE = 0,
+    HC_SIM_FAULT_CRASH,                 // Hypervisor goes down until Reset
+    HC_SIM_FAULT_STALL,                 // Call spins stallNs more
+    HC_SIM_FAULT_STATUS                 // Call fails with status
+} HC_SIM_FAULT_KIND;
+
+typedef enum _HC_SIM_PARTITION_STATE
+{
+    HC_SIM_PARTITION_CREATED = 0,
+    HC_SIM_PARTITION_INITIALIZED,
+    HC_SIM_PARTITION_FINALIZED
+} HC_SIM_PARTITION_STATE;
+
+typedef struct _HC_SIM_PARTITION
+{
+    UINT64  id;
+    UINT32  state;                      // HC_SIM_PARTITION_STATE
+    UINT32  rsvd;
+} HC_SIM_PARTITION;
+
+#define HC_SIM_FAULT_ANY_CALLCODE   0xFFFFFFFF
+
+//
+// Further condition on a fault, on the registers after GPA substitution
+//
+typedef BOOL (*HC_SIM_FAULT_PREDICATE)(
+    IN const CPU_REG_64     *pRegs,
+    IN VOID                 *pContext
+    );
+
+typedef struct _HC_SIM_FAULT
+{
+    UINT32                  kind;           // HC_SIM_FAULT_KIND
+    UINT32                  callcode;       // HC_SIM_FAULT_ANY_CALLCODE for all
+    UINT32                  oneIn;          // Fires on 1 in oneIn matching calls, 0 or 1 for all
+    HV_STATUS               status;         // HC_SIM_FAULT_STATUS
+    UINT16                  rsvd;
+    UINT64                  stallNs;        // HC_SIM_FAULT_STALL
+    UINT64                  seed;
+    HC_SIM_FAULT_PREDICATE  pPredicate;     // NULL for none
+    VOID                    *pContext;
+} HC_SIM_FAULT, *PHC_SIM_FAULT;
+
+class HcSimBackend : public HcLoopbackBackend
+{
+public:
+    HcSimBackend ()
+        : HcLoopbackBackend(Handler, this),
+          m_latencyNs(0),
+          m_repLatencyNs(0),
+          m_repSlice(0),
+          m_caller(HC_SIM_CALLER_ROOT),
+          m_state(0),
+          m_stallNs(0),
+          m_bDown(FALSE),
+          m_faults(0),
+          m_rng(0)
+    {
+        memset(&m_fault, 0, sizeof(m_fault));
+        memset(m_in, 0, sizeof(m_in));
+        memset(m_out, 0, sizeof(m_out));
+        Reset();
+    }
+
+    //
+    // Time every call spins for, and for every rep it completes, 0 for none
+    //
+    VOID
+    SetLatency (
+        IN UINT32   latencyNs,
+        IN UINT32   repLatencyNs = 0
+    )
+    {
+        m_latencyNs = latencyNs;
+        m_repLatencyNs = repLatencyNs;
+    }
+
+    //
+    // Reps a call completes before returning, 0 for all of them
+    //
+    VOID SetRepSlice (IN UINT32 reps) { m_repSlice = reps; }
+
+    VOID SetCaller (IN HC_SIM_CALLER caller) { m_caller = caller; }
+
+    //
+    // HC_SIM_STATE_* to track, 0 for none. Tracking starts from Reset
+    //
+    VOID
+    SetState (
+        IN UINT32   state
+    )
+    {
+        m_state = state;
+        Reset();
+    }
+
+    //
+    // Fault to inject, NULL for none. Restarts the count of fired faults
+    //
+    VOID
+    SetFault (
+        IN const HC_SIM_FAULT   *pFault
+    )
+    {
+        memset(&m_fault, 0, sizeof(m_fault));
+        if (pFault != NULL)
+        {
+            m_fault = *pFault;
+        }
+        m_rng = m_fault.seed | 1;
+        m_faults = 0;
+    }
+
+    //
+    // The reboot: back up, with no partitions, ports, connections or higher
+    // VTLs
+    //
+    VOID
+    Reset ()
+    {
+        m_bDown = FALSE;
+        m_nextChildId = HC_SIM_FIRST_CHILD_ID;
+        m_partitionCount = 0;
+        m_portCount = 0;
+        m_connectionCount = 0;
+        m_partitionVtls = 1;
+        m_vtl = 0;
+        for (UINT32 vp = 0; vp < HC_SIM_VP_COUNT; vp++)
+        {
+            m_vpVtls[vp] = 1;
+        }
+    }
+
+    //
+    // Pages behind HC_SIM_INPUT_GPA and HC_SIM_OUTPUT_GPA, for a caller that
+    // passes the GPAs themselves instead of markers
+    //
+    PUINT64 InputPage () { return m_in; }
+    PUINT64 OutputPage () { return m_out; }
+
+    BOOL IsDown () const { return m_bDown; }
+    UINT64 Faults () const { return m_faults; }
+    UINT32 Partitions () const { return m_partitionCount; }
+    UINT32 Ports () const { return m_portCount; }
+    UINT32 Connections () const { return m_connectionCount; }
+    UINT32 Vtl () const { return m_vtl; }
+
+    //
+    // Range of a header field, rep element fields share field index 0x100
+    //
+    static HC_SIM_FIELD_KIND
+    FieldKind (
+        IN UINT32   callcode,
+        IN UINT32   field
+    )
+    {
+        UINT64 h = ((UINT64)callcode << 16 | field) * 0x9E3779B97F4A7C15ULL;
+
+        switch ((h >> 60) & 3)
+        {
+        case 2:
+            return HC_SIM_FIELD_RESERVED;
+        case 3:
+            return HC_SIM_FIELD_SMALL;
+        default:
+            return HC_SIM_FIELD_ANY;
+        }
+    }
+
+    static BOOL
+    FieldIsValid (
+        IN UINT32   callcode,
+        IN UINT32   field,
+        IN UINT64   value
+    )
+    {
+        switch (FieldKind(callcode, field))
+        {
+        case HC_SIM_FIELD_RESERVED:
+            return value == 0;
+        case HC_SIM_FIELD_SMALL:
+            return value < 0x100 || (field == 0 && value == HV_PARTITION_ID_SELF);
+        default:
+            return TRUE;
+        }
+    }
+
+    //
+    // Status the model gives a case, output registers and page are written
+    // on success
+    //
+    HV_STATUS
+    Exec (
+        IN  const CPU_REG_64    *pInRegs,
+        OUT PCPU_REG_64         pOutRegs,
+        OUT PUINT16             pRepComplete
+    )
+    {
+        CPU_REG_64      regs = *pInRegs;
+        const HC_DESC   *pDesc = HcLookup((UINT32)(regs.rcx & 0xffff));
+        UINT32          repCnt = HV_CONTROL_REP_COUNT(regs.rcx);
+        UINT32          repStart = HV_CONTROL_REP_START(regs.rcx);
+        UINT32          repEnd = 0;
+        BOOL            isFast = (regs.rcx >> 16) & 1;
+        BOOL            isRep = FALSE;
+        UINT32          inputBytes = 0;
+        PUINT64         pInput = NULL;
+        UINT64          fastInput[FAST_CALL_SLOTS] = { 0 };
+        UINT64          output = 0;
+        BOOL            bModelled = FALSE;
+        HV_STATUS       status = HV_STATUS_SUCCESS;
+
+        *pRepComplete = 0;
+        m_stallNs = 0;
+        memcpy(pOutRegs, pInRegs, sizeof(CPU_REG_64));
+        if (m_bDown)
+        {
+            return HC_SIM_CRASH_STATUS;
+        }
+        Substitute(&regs);
+
+        if (pDesc == NULL || (pDesc->flags & HC_DESC_STUB))
+        {
+            return HV_STATUS_INVALID_HYPERCALL_CODE;
+        }
+
+        isRep = pDesc->isRep == 1 || pDesc->isRep == 3;
+        inputBytes = (UINT32)pDesc->inputSize + (isRep ? repCnt * 8 : 0);
+        if ((regs.rcx & HC_SIM_CONTROL_RSVD_MASK) != 0 ||
+            (isRep ? repCnt == 0 || repStart >= repCnt : repCnt != 0) ||
+            (isFast && inputBytes > FAST_CALL_MAX_INPUT))
+        {
+            return HV_STATUS_INVALID_HYPERCALL_INPUT;
+        }
+
+        if (isFast)
+        {
+            for (UINT32 slot = 0; slot < FAST_CALL_SLOTS; slot++)
+            {
+                fastInput[slot] = *FastCallSlot(&regs, slot);
+            }
+            pInput = fastInput;
+        }
+        else
+        {
+            if ((status = CheckGpa(regs.rdx, inputBytes, HC_SIM_INPUT_GPA)) != HV_STATUS_SUCCESS ||
+                (status = CheckGpa(regs.r8, pDesc->outputSize, HC_SIM_OUTPUT_GPA)) != HV_STATUS_SUCCESS)
+            {
+                return status;
+            }
+            pInput = inputBytes != 0 ? &m_in[(regs.rdx & 0xfff) / 8] : NULL;
+        }
+
+        if (!CallerMayCall(pDesc))
+        {
+            return HV_STATUS_ACCESS_DENIED;
+        }
+
+        if (m_fault.kind != HC_SIM_FAULT_NONE && FaultFires(&regs))
+        {
+            m_faults++;
+            switch (m_fault.kind)
+            {
+            case HC_SIM_FAULT_CRASH:
+                m_bDown = TRUE;
+                return HC_SIM_CRASH_STATUS;
+            case HC_SIM_FAULT_STATUS:
+                return m_fault.status;
+            default:
+                m_stallNs = m_fault.stallNs;
+                break;
+            }
+        }
+
+        bModelled = m_state != 0 && (m_state & StateOf(pDesc->callcode)) != 0;
+        for (UINT32 f = 0; !bModelled && f < pDesc->inputSize / 8; f++)
+        {
+            if (!FieldIsValid(pDesc->callcode, f, pInput[f]))
+            {
+                return HV_STATUS_INVALID_PARAMETER;
+            }
+        }
+
+        if (bModelled &&
+            (status = Model(pDesc->callcode, pInput, &output)) != HV_STATUS_SUCCESS)
+        {
+            return status;
+        }
+
+        repEnd = repCnt;
+        if (m_repSlice != 0 && repCnt - repStart > m_repSlice)
+        {
+            repEnd = repStart + m_repSlice;
+        }
+
+        for (UINT32 r = repStart; isRep && r < repEnd; r++)
+        {
+            if (!FieldIsValid(pDesc->callcode, 0x100, pInput[pDesc->inputSize / 8 + r]))
+            {
+                *pRepComplete = (UINT16)r;
+                return HV_STATUS_INVALID_PARAMETER;
+            }
+        }
+
+        if (!isFast && pDesc->outputSize != 0)
+        {
+            memset((PUINT8)m_out + (regs.r8 & 0xfff), 0xa5, pDesc->outputSize);
+        }
+        else if (isFast)
+        {
+            //
+            // As much of the output as the registers past the input hold
+            //
+            for (UINT32 slot = FastCallOutputSlot(inputBytes);
+                 slot < FAST_CALL_SLOTS && (slot - FastCallOutputSlot(inputBytes)) * 8 < pDesc->outputSize;
+                 slot++)
+            {
+                *FastCallSlot(pOutRegs, slot) = 0xa5a5a5a5a5a5a5a5ULL;
+            }
+        }
+
+        //
+        // A modelled output is a partition id, the first output qword
+        //
+        if (bModelled && pDesc->outputSize != 0)
+        {
+            if (!isFast)
+            {
+                m_out[(regs.r8 & 0xfff) / 8] = output;
+            }
+            else if (FastCallOutputSlot(inputBytes) < FAST_CALL_SLOTS)
+            {
+                *FastCallSlot(pOutRegs, FastCallOutputSlot(inputBytes)) = output;
+            }
+        }
+        *pRepComplete = (UINT16)repEnd;
+        return HV_STATUS_SUCCESS;
+    }
+
+private:
+    static UINT64
+    Handler (
+        IN  const CPU_REG_64    *pInRegs,
+        OUT PCPU_REG_64         pOutRegs,
+        IN  VOID                *pContext
+    )
+    {
+        HcSimBackend *pSim = (HcSimBackend *)pContext;
+        UINT16 repComplete = 0;
+        HV_STATUS status = pSim->Exec(pInRegs, pOutRegs, &repComplete);
+        UINT32 repStart = HV_CONTROL_REP_START(pInRegs->rcx);
+        UINT64 latencyNs = pSim->m_latencyNs + pSim->m_stallNs;
+
+        if (repComplete > repStart)
+        {
+            latencyNs += (UINT64)(repComplete - repStart) * pSim->m_repLatencyNs;
+        }
+
+        if (latencyNs != 0)
+        {
+            auto until = std::chrono::steady_clock::now() + std::chrono::nanoseconds(latencyNs);
+
+            while (std::chrono::steady_clock::now() < until)
+            {
+            }
+        }
+        return (UINT64)status | ((UINT64)repComplete << 32);
+    }
+
+    BOOL
+    CallerMayCall (
+        IN const HC_DESC    *pDesc
+    ) const
+    {
+        if (m_caller == HC_SIM_CALLER_ROOT || !(pDesc->flags & HC_DESC_PRIVILEGED))
+        {
+            return TRUE;
+        }
+        return m_caller == HC_SIM_CALLER_PARENT &&
+               (pDesc->privilege == HC_PRIV_PARENT || pDesc->privilege == HC_PRIV_PARENT_ROOT);
+    }
+
+    BOOL
+    FaultFires (
+        IN const CPU_REG_64     *pRegs
+    )
+    {
+        if (m_fault.callcode != HC_SIM_FAULT_ANY_CALLCODE &&
+            m_fault.callcode != (UINT32)(pRegs->rcx & 0xffff))
+        {
+            return FALSE;
+        }
+        if (m_fault.oneIn > 1)
+        {
+            //
+            // xorshift64
+            //
+            m_rng ^= m_rng << 13;
+            m_rng ^= m_rng >> 7;
+            m_rng ^= m_rng << 17;
+            if (m_rng % m_fault.oneIn != 0)
+            {
+                return FALSE;
+            }
+        }
+        return m_fault.pPredicate == NULL || m_fault.pPredicate(pRegs, m_fault.pContext);
+    }
+
+    //
+    // HC_SIM_STATE_* a call code acts on, 0 if the state model leaves it to
+    // the field ranges
+    //
+    static UINT32
+    StateOf (
+        IN UINT32   callcode
+    )
+    {
+        switch (callcode)
+        {
+        case HC_SIM_CALL_ENABLE_PARTITION_VTL:
+        case HC_SIM_CALL_DISABLE_PARTITION_VTL:
+        case HC_SIM_CALL_ENABLE_VP_VTL:
+        case HC_SIM_CALL_DISABLE_VP_VTL:
+        case HC_SIM_CALL_VTL_CALL:
+        case HC_SIM_CALL_VTL_RETURN:
+            return HC_SIM_STATE_VTLS;
+        case HC_SIM_CALL_CREATE_PARTITION:
+        case HC_SIM_CALL_INITIALIZE_PARTITION:
+        case HC_SIM_CALL_FINALIZE_PARTITION:
+        case HC_SIM_CALL_DELETE_PARTITION:
+        case HC_SIM_CALL_GET_PARTITION_PROPERTY:
+        case HC_SIM_CALL_SET_PARTITION_PROPERTY:
+        case HC_SIM_CALL_GET_PARTITION_ID:
+            return HC_SIM_STATE_PARTITIONS;
+        case HC_SIM_CALL_CREATE_PORT:
+        case HC_SIM_CALL_DELETE_PORT:
+        case HC_SIM_CALL_CONNECT_PORT:
+        case HC_SIM_CALL_DISCONNECT_PORT:
+        case HC_SIM_CALL_POST_MESSAGE:
+        case HC_SIM_CALL_SIGNAL_EVENT:
+        case HC_SIM_CALL_CREATE_PORT_EX:
+        case HC_SIM_CALL_CONNECT_PORT_EX:
+            return HC_SIM_STATE_PORTS;
+        default:
+            return 0;
+        }
+    }
+
+    //
+    // Index of a partition CreatePartition made, HC_SIM_MAX_OBJECTS if none.
+    // Without HC_SIM_STATE_PARTITIONS every partition id exists
+    //
+    UINT32
+    FindPartition (
+        IN UINT64   id
+    ) const
+    {
+        UINT32 p = 0;
+
+        while (p < m_partitionCount && m_partitions[p].id != id)
+        {
+            p++;
+        }
+        return p < m_partitionCount ? p : HC_SIM_MAX_OBJECTS;
+    }
+
+    BOOL
+    PartitionExists (
+        IN UINT64   id
+    ) const
+    {
+        return id == HV_PARTITION_ID_SELF || id == HC_SIM_SELF_ID ||
+               (m_state & HC_SIM_STATE_PARTITIONS) == 0 ||
+               FindPartition(id) != HC_SIM_MAX_OBJECTS;
+    }
+
+    static UINT32
+    Find (
+        IN const UINT32     *pIds,
+        IN UINT32           count,
+        IN UINT32           id
+    )
+    {
+        UINT32 i = 0;
+
+        while (i < count && pIds[i] != id)
+        {
+            i++;
+        }
+        return i < count ? i : HC_SIM_MAX_OBJECTS;
+    }
+
+    //
+    // Removes entry i of an unordered table, moving the last one into it
+    //
+    static VOID
+    Remove (
+        IN OUT UINT32   *pIds,
+        IN OUT UINT32   *pCount,
+        IN     UINT32   i
+    )
+    {
+        pIds[i] = pIds[--*pCount];
+    }
+
+    HV_STATUS
+    Model (
+        IN  UINT32          callcode,
+        IN  const UINT64    *pInput,
+        OUT PUINT64         pOutput
+    )
+    {
+        switch (StateOf(callcode))
+        {
+        case HC_SIM_STATE_VTLS:
+            return ModelVtl(callcode, pInput);
+        case HC_SIM_STATE_PARTITIONS:
+            return ModelPartition(callcode, pInput, pOutput);
+        default:
+            return ModelPort(callcode, pInput);
+        }
+    }
+
+    //
+    // VTLs of the calling partition, entered from VP 0. Input: partition id,
+    // then the target VTL (partition) or VP index and target VTL (VP)
+    //
+    HV_STATUS
+    ModelVtl (
+        IN UINT32           callcode,
+        IN const UINT64     *pInput
+    )
+    {
+        UINT32  vtl = 0;
+        UINT32  vp = 0;
+        UINT32  bit = 0;
+
+        if (callcode == HC_SIM_CALL_VTL_CALL)
+        {
+            if (m_vtl >= HC_SIM_MAX_VTL || !(m_vpVtls[0] & (1 << (m_vtl + 1))))
+            {
+                return HV_STATUS_INVALID_VP_STATE;
+            }
+            m_vtl++;
+            return HV_STATUS_SUCCESS;
+        }
+        if (callcode == HC_SIM_CALL_VTL_RETURN)
+        {
+            if (m_vtl == 0)
+            {
+                return HV_STATUS_INVALID_VP_STATE;
+            }
+            m_vtl--;
+            return HV_STATUS_SUCCESS;
+        }
+
+        if (pInput[0] != HV_PARTITION_ID_SELF && pInput[0] != HC_SIM_SELF_ID)
+        {
+            return HV_STATUS_INVALID_PARTITION_ID;
+        }
+
+        if (callcode == HC_SIM_CALL_ENABLE_PARTITION_VTL ||
+            callcode == HC_SIM_CALL_DISABLE_PARTITION_VTL)
+        {
+            vtl = (UINT32)(pInput[1] & 0xff);
+        }
+        else
+        {
+            vp = (UINT32)pInput[1];
+            vtl = (UINT32)(pInput[1] >> 32 & 0xff);
+            if (vp == HV_VP_INDEX_SELF)
+            {
+                vp = 0;
+            }
+            if (vp >= HC_SIM_VP_COUNT)
+            {
+                return HV_STATUS_INVALID_VP_INDEX;
+            }
+        }
+
+        if (vtl == 0 || vtl > HC_SIM_MAX_VTL)
+        {
+            return HV_STATUS_INVALID_PARAMETER;
+        }
+        bit = 1 << vtl;
+
+        switch (callcode)
+        {
+        case HC_SIM_CALL_ENABLE_PARTITION_VTL:
+            if (m_partitionVtls & bit)
+            {
+                return HV_STATUS_INVALID_PARTITION_STATE;
+            }
+            m_partitionVtls |= bit;
+            break;
+        case HC_SIM_CALL_DISABLE_PARTITION_VTL:
+            if (!(m_partitionVtls & bit))
+            {
+                return HV_STATUS_INVALID_PARTITION_STATE;
+            }
+            for (UINT32 v = 0; v < HC_SIM_VP_COUNT; v++)
+            {
+                if (m_vpVtls[v] & bit)
+                {
+                    return HV_STATUS_OBJECT_IN_USE;
+                }
+            }
+            m_partitionVtls &= ~bit;
+            break;
+        case HC_SIM_CALL_ENABLE_VP_VTL:
+            if (!(m_partitionVtls & bit))
+            {
+                return HV_STATUS_INVALID_PARTITION_STATE;
+            }
+            if (m_vpVtls[vp] & bit)
+            {
+                return HV_STATUS_INVALID_VP_STATE;
+            }
+            m_vpVtls[vp] |= bit;
+            break;
+        default:
+            if (!(m_vpVtls[vp] & bit) || (vp == 0 && m_vtl >= vtl))
+            {
+                return HV_STATUS_INVALID_VP_STATE;
+            }
+            m_vpVtls[vp] &= ~bit;
+            break;
+        }
+        return HV_STATUS_SUCCESS;
+    }
+
+    //
+    // Children the caller creates go created, initialized, finalized, and
+    // are deleted when not running. Input: partition id
+    //
+    HV_STATUS
+    ModelPartition (
+        IN  UINT32          callcode,
+        IN  const UINT64    *pInput,
+        OUT PUINT64         pOutput
+    )
+    {
+        UINT32 p = 0;
+
+        switch (callcode)
+        {
+        case HC_SIM_CALL_CREATE_PARTITION:
+            if (m_partitionCount == HC_SIM_MAX_OBJECTS)
+            {
+                return HV_STATUS_INSUFFICIENT_MEMORY;
+            }
+            m_partitions[m_partitionCount].id = m_nextChildId++;
+            m_partitions[m_partitionCount].state = HC_SIM_PARTITION_CREATED;
+            *pOutput = m_partitions[m_partitionCount++].id;
+            return HV_STATUS_SUCCESS;
+        case HC_SIM_CALL_GET_PARTITION_ID:
+            *pOutput = HC_SIM_SELF_ID;
+            return HV_STATUS_SUCCESS;
+        case HC_SIM_CALL_GET_PARTITION_PROPERTY:
+        case HC_SIM_CALL_SET_PARTITION_PROPERTY:
+            return PartitionExists(pInput[0]) ? HV_STATUS_SUCCESS : HV_STATUS_INVALID_PARTITION_ID;
+        }
+
+        if ((p = FindPartition(pInput[0])) == HC_SIM_MAX_OBJECTS)
+        {
+            return HV_STATUS_INVALID_PARTITION_ID;
+        }
+
+        switch (callcode)
+        {
+        case HC_SIM_CALL_INITIALIZE_PARTITION:
+            if (m_partitions[p].state != HC_SIM_PARTITION_CREATED)
+            {
+                return HV_STATUS_INVALID_PARTITION_STATE;
+            }
+            m_partitions[p].state = HC_SIM_PARTITION_INITIALIZED;
+            break;
+        case HC_SIM_CALL_FINALIZE_PARTITION:
+            if (m_partitions[p].state != HC_SIM_PARTITION_INITIALIZED)
+            {
+                return HV_STATUS_INVALID_PARTITION_STATE;
+            }
+            m_partitions[p].state = HC_SIM_PARTITION_FINALIZED;
+            break;
+        default:
+            if (m_partitions[p].state == HC_SIM_PARTITION_INITIALIZED)
+            {
+                return HV_STATUS_INVALID_PARTITION_STATE;
+            }
+            m_partitions[p] = m_partitions[--m_partitionCount];
+            break;
+        }
+        return HV_STATUS_SUCCESS;
+    }
+
+    //
+    // Port and connection ids are global. Input: port partition and port id
+    // (create, delete), connection partition and connection id then port
+    // partition and port id (connect), connection id (post, signal)
+    //
+    HV_STATUS
+    ModelPort (
+        IN UINT32           callcode,
+        IN const UINT64     *pInput
+    )
+    {
+        UINT32  id = (UINT32)pInput[callcode == HC_SIM_CALL_POST_MESSAGE ||
+                                    callcode == HC_SIM_CALL_SIGNAL_EVENT ? 0 : 1];
+        UINT32  i = 0;
+
+        switch (callcode)
+        {
+        case HC_SIM_CALL_POST_MESSAGE:
+        case HC_SIM_CALL_SIGNAL_EVENT:
+            return Find(m_connections, m_connectionCount, id) != HC_SIM_MAX_OBJECTS ?
+                   HV_STATUS_SUCCESS : HV_STATUS_INVALID_CONNECTION_ID;
+        }
+
+        if (!PartitionExists(pInput[0]))
+        {
+            return HV_STATUS_INVALID_PARTITION_ID;
+        }
+
+        switch (callcode)
+        {
+        case HC_SIM_CALL_CREATE_PORT:
+        case HC_SIM_CALL_CREATE_PORT_EX:
+            if (Find(m_ports, m_portCount, id) != HC_SIM_MAX_OBJECTS)
+            {
+                return HV_STATUS_INVALID_PORT_ID;
+            }
+            if (m_portCount == HC_SIM_MAX_OBJECTS)
+            {
+                return HV_STATUS_INSUFFICIENT_MEMORY;
+            }
+            m_ports[m_portCount++] = id;
+            break;
+        case HC_SIM_CALL_DELETE_PORT:
+            if ((i = Find(m_ports, m_portCount, id)) == HC_SIM_MAX_OBJECTS)
+            {
+                return HV_STATUS_INVALID_PORT_ID;
+            }
+            for (UINT32 c = 0; c < m_connectionCount; c++)
+            {
+                if (m_connectionPorts[c] == id)
+                {
+                    return HV_STATUS_OBJECT_IN_USE;
+                }
+            }
+            Remove(m_ports, &m_portCount, i);
+            break;
+        case HC_SIM_CALL_CONNECT_PORT:
+        case HC_SIM_CALL_CONNECT_PORT_EX:
+            if (!PartitionExists(pInput[2]))
+            {
+                return HV_STATUS_INVALID_PARTITION_ID;
+            }
+            if (Find(m_ports, m_portCount, (UINT32)pInput[3]) == HC_SIM_MAX_OBJECTS)
+            {
+                return HV_STATUS_INVALID_PORT_ID;
+            }
+            if (Find(m_connections, m_connectionCount, id) != HC_SIM_MAX_OBJECTS)
+            {
+                return HV_STATUS_INVALID_CONNECTION_ID;
+            }
+            if (m_connectionCount == HC_SIM_MAX_OBJECTS)
+            {
+                return HV_STATUS_INSUFFICIENT_MEMORY;
+            }
+            m_connectionPorts[m_connectionCount] = (UINT32)pInput[3];
+            m_connections[m_connectionCount++] = id;
+            break;
+        default:
+            if ((i = Find(m_connections, m_connectionCount, id)) == HC_SIM_MAX_OBJECTS)
+            {
+                return HV_STATUS_INVALID_CONNECTION_ID;
+            }
+            m_connectionPorts[i] = m_connectionPorts[m_connectionCount - 1];
+            Remove(m_connections, &m_connectionCount, i);
+            break;
+        }
+        return HV_STATUS_SUCCESS;
+    }
+
+    //
+    // GPA of bytes at a pool page: aligned, on the page and not crossing it
+    //
+    static HV_STATUS
+    CheckGpa (
+        IN UINT64   gpa,
+        IN UINT32   bytes,
+        IN UINT64   pageGpa
+    )
+    {
+        if (bytes == 0)
+        {
+            return HV_STATUS_SUCCESS;
+        }
+        if (gpa & 7)
+        {
+            return HV_STATUS_INVALID_ALIGNMENT;
+        }
+        if ((gpa & ~0xfffULL) != pageGpa)
+        {
+            return HV_STATUS_INVALID_PARAMETER;
+        }
+        if ((gpa & 0xfff) + bytes > 0x1000)
+        {
+            return HV_STATUS_INVALID_HYPERCALL_INPUT;
+        }
+        return HV_STATUS_SUCCESS;
+    }
+
+    VOID
+    Fill (
+        IN PUINT64  pPage,
+        IN UINT64   value
+    )
+    {
+        PAGE_FILL_PARAMS params;
+
+        PAGE_FILL_INIT(&params, PAGE_FILL_CONSTANT, value, 0);
+        PageFill(PAGE_FILL_ISA_SCALAR, pPage, &params);
+    }
+
+    //
+    // Same substitution as the driver's SubstituteGpaRegs
+    //
+    VOID
+    Substitute (
+        IN OUT PCPU_REG_64  pRegs
+    )
+    {
+        for (UINT32 r = 0; r < sizeof(CPU_REG_64) / sizeof(UINT64); r++)
+        {
+            PUINT64 pReg = &((PUINT64)pRegs)[r];
+            BOOL isOut = r == offsetof(CPU_REG_64, r8) / sizeof(UINT64);
+            PUINT64 pPage = isOut ? m_out : m_in;
+            UINT64 pa = isOut ? HC_SIM_OUTPUT_GPA : HC_SIM_INPUT_GPA;
+
+            switch (*pReg)
+            {
+            case USE_GPA_MEM_FILL:
+                Fill(pPage, pa);
+                break;
+            case USE_GPA_MEM_NOFILL_0:
+                Fill(pPage, 0);
+                break;
+            case USE_GPA_MEM_NOFILL_1:
+                Fill(pPage, 1);
+                break;
+            case USE_GPA_MEM_BIT_RANGE_LOOP:
+                Fill(pPage, pRegs->rax);
+                break;
+            case USE_GPA_MEM_LAYOUT:
+            {
+                INPUT_LAYOUT layout;
+
+                InputLayoutUnpack(pRegs->rbx, &layout);
+                Fill(pPage, 0);
+                if (isOut)
+                {
+                    pa += InputLayoutOutputOffset(&layout);
+                }
+                else
+                {
+                    InputLayoutBuild(pPage, &layout, (UINT32)((pRegs->rcx >> 32) & 0xfff), pRegs->rax);
+                }
+                break;
+            }
+            default:
+                if ((*pReg & ~(UINT64)USE_GPA_MEM_OFFSET_MASK) != USE_GPA_MEM_OFFSET)
+                {
+                    continue;
+                }
+                Fill(pPage, 0);
+                pa += *pReg & USE_GPA_MEM_OFFSET_MASK;
+                break;
+            }
+            *pReg = pa;
+        }
+    }
+
+    UINT32           m_latencyNs;
+    UINT32           m_repLatencyNs;
+    UINT32           m_repSlice;
+    HC_SIM_CALLER    m_caller;
+    UINT32           m_state;
+    UINT64           m_stallNs;         // Of the last call, from a stall fault
+    BOOL             m_bDown;
+    HC_SIM_FAULT     m_fault;
+    UINT64           m_faults;
+    UINT64           m_rng;
+    UINT64           m_nextChildId;
+    HC_SIM_PARTITION m_partitions[HC_SIM_MAX_OBJECTS];
+    UINT32           m_partitionCount;
+    UINT32           m_ports[HC_SIM_MAX_OBJECTS];
+    UINT32           m_portCount;
+    UINT32           m_connections[HC_SIM_MAX_OBJECTS];
+    UINT32           m_connectionPorts[HC_SIM_MAX_OBJECTS];  // Port id of each connection
+    UINT32           m_connectionCount;
+    UINT32           m_partitionVtls;   // Bit per enabled VTL
+    UINT32           m_vpVtls[HC_SIM_VP_COUNT];
+    UINT32           m_vtl;             // VTL VP 0 runs in
+    UINT64           m_in[0x1000 / sizeof(UINT64)];
+    UINT64           m_out[0x1000 / sizeof(UINT64)];
+};
@@ -0,0 +1,466 @@
+/*++
+
+Module Name:
+
+    HypercallTable.h
+
+Abstract:
+
+    Hypercall descriptors, indexed by the 16-bit call code, and the
+    allow/deny bitmaps the fuzzer filters call codes with.
+
+    Everything here is built at compile time from the handler table dump
+    (Hypercalls.h) and the TLFS listing (HypercallsFromPdf.h), and checked
+    against each other with static asserts. HcFilter starts from the compile
+    time bitmaps and can be overridden at startup from a config file:
+
+        # comment
+        deny  0x4c
+        allow 0x7f
+        deny  0x40-0x4f
+
+    Later lines win.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../ViridianFuzzer/ViridianFuzzerTypes.h"
+#include "../ViridianFuzzer/HypercallsFromPdf.h"
+
+#define HC_CALLCODE_SPACE   0x10000
+
+#define HC_DESC_DENY        0x01    // Skipped unless the config allows it
+#define HC_DESC_PRIVILEGED  0x02    // TLFS says only a parent or root partition may call it
+#define HC_DESC_STUB        0x04    // Handler table slot holds the invalid call code stub
+#define HC_DESC_IN_PDF      0x08    // Listed in HypercallsOnlyFromPdf.txt
+
+//
+// Call codes that bugcheck a child partition. If VIFU runs in the root,
+// 0x00, 0x04, 0x53, 0x6b, 0x76, 0x7a, 0x7b, 0x7c and 0x86 do as well
+//
+#define HC_DEFAULT_DENY_LIST(X) X(0x01) X(0x0a) X(0x11) X(0x12)
+
+typedef enum _HC_PRIVILEGE
+{
+    HC_PRIV_UNKNOWN = 0,
+    HC_PRIV_ANY,
+    HC_PRIV_PARENT,
+    HC_PRIV_ROOT,
+    HC_PRIV_PARENT_ROOT
+} HC_PRIVILEGE;
+
+typedef struct _HC_DESC
+{
+    const CHAR  *name;
+    UINT16      callcode;
+    UINT16      isRep;          // Handler table's isRep, 0 for a simple call
+    UINT16      inputSize;
+    UINT16      outputSize;
+    UINT16      privilege;      // HC_PRIVILEGE
+    UINT16      flags;          // HC_DESC_*
+} HC_DESC, *PHC_DESC;
+
+typedef struct _HC_PDF_ENTRY
+{
+    const CHAR  *name;
+    UINT16      callcode;
+    UINT16      privilege;
+} HC_PDF_ENTRY;
+
+constexpr HC_PDF_ENTRY HcPdfEntries[] =
+{
+#define HC_PDF_ENTRY_INIT(name, callcode, priv) { name, callcode, HC_PRIV_##priv },
+    HYPERCALL_PDF_LIST(HC_PDF_ENTRY_INIT)
+#undef HC_PDF_ENTRY_INIT
+};
+
+constexpr UINT16 HcDefaultDenyCallcodes[] =
+{
+#define HC_DENY_INIT(callcode) callcode,
+    HC_DEFAULT_DENY_LIST(HC_DENY_INIT)
+#undef HC_DENY_INIT
+};
+
+constexpr BOOL
+HcStrEqual (
+    IN const CHAR   *a,
+    IN const CHAR   *b
+)
+{
+    while (*a != '\0' && *a == *b)
+    {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+constexpr BOOL
+HcStrStartsWith (
+    IN const CHAR   *s,
+    IN const CHAR   *prefix
+)
+{
+    while (*prefix != '\0')
+    {
+        if (*s++ != *prefix++)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+constexpr const HC_PDF_ENTRY *
+HcPdfLookup (
+    IN UINT32   callcode
+)
+{
+    for (const HC_PDF_ENTRY &entry : HcPdfEntries)
+    {
+        if (entry.callcode == callcode)
+        {
+            return &entry;
+        }
+    }
+    return NULL;
+}
+
+constexpr UINT16
+HcMakeFlags (
+    IN const CHAR   *name,
+    IN UINT16       callcode
+)
+{
+    const HC_PDF_ENTRY *pPdf = HcPdfLookup(callcode);
+    UINT16 flags = 0;
+
+    //
+    // The dump names every unimplemented slot after the stub's symbol
+    //
+    if (HcStrEqual(name, "HvCallUnmapDevicePages") &&
+        (pPdf == NULL || !HcStrEqual(pPdf->name, "HvCallUnmapDevicePages")))
+    {
+        flags |= HC_DESC_STUB;
+    }
+
+    if (pPdf != NULL)
+    {
+        flags |= HC_DESC_IN_PDF;
+        if (pPdf->privilege != HC_PRIV_ANY && pPdf->privilege != HC_PRIV_UNKNOWN)
+        {
+            flags |= HC_DESC_PRIVILEGED;
+        }
+    }
+
+    //
+    // Reserved slots usually bugcheck
+    //
+    if (HcStrStartsWith(name, "Reserved"))
+    {
+        flags |= HC_DESC_DENY;
+    }
+    for (UINT16 deny : HcDefaultDenyCallcodes)
+    {
+        if (deny == callcode)
+        {
+            flags |= HC_DESC_DENY;
+        }
+    }
+    return flags;
+}
+
+constexpr HC_DESC
+HcMakeDesc (
+    IN const CHAR   *name,
+    IN UINT16       callcode,
+    IN UINT16       isRep,
+    IN UINT16       inputSize,
+    IN UINT16       outputSize
+)
+{
+    const HC_PDF_ENTRY *pPdf = HcPdfLookup(callcode);
+
+    return HC_DESC{ name,
+                    callcode,
+                    isRep,
+                    inputSize,
+                    outputSize,
+                    pPdf != NULL ? pPdf->privilege : (UINT16)HC_PRIV_UNKNOWN,
+                    HcMakeFlags(name, callcode) };
+}
+
+constexpr HC_DESC HcDescriptors[] =
+{
+#define HC_DESC_INIT(name, callcode, isRep, inputSize, outputSize) \
+    HcMakeDesc(name, callcode, isRep, inputSize, outputSize),
+    HYPERCALL_ENTRY_LIST(HC_DESC_INIT)
+#undef HC_DESC_INIT
+};
+
+#define HC_DESC_COUNT   ((UINT32)_ARRAYSIZE(HcDescriptors))
+
+//
+// NULL for call codes past the handler table
+//
+constexpr const HC_DESC *
+HcLookup (
+    IN UINT32   callcode
+)
+{
+    return callcode < HC_DESC_COUNT ? &HcDescriptors[callcode] : NULL;
+}
+
+//
+// One bit per call code
+//
+typedef struct _HC_CALLCODE_BITMAP
+{
+    UINT64  bits[HC_CALLCODE_SPACE / 64];
+
+    constexpr BOOL
+    Test (
+        IN UINT32   callcode
+    ) const
+    {
+        return callcode < HC_CALLCODE_SPACE && ((bits[callcode / 64] >> (callcode % 64)) & 1) != 0;
+    }
+
+    constexpr VOID
+    Set (
+        IN UINT32   callcode,
+        IN BOOL     value
+    )
+    {
+        if (value)
+        {
+            bits[callcode / 64] |= 1ULL << (callcode % 64);
+        }
+        else
+        {
+            bits[callcode / 64] &= ~(1ULL << (callcode % 64));
+        }
+    }
+} HC_CALLCODE_BITMAP, *PHC_CALLCODE_BITMAP;
+
+//
+// Call codes with all of `mask` set in their flags (or none of them, if
+// `want` is FALSE)
+//
+constexpr HC_CALLCODE_BITMAP
+HcBuildBitmap (
+    IN UINT16   mask,
+    IN BOOL     want
+)
+{
+    HC_CALLCODE_BITMAP bitmap = {};
+
+    for (const HC_DESC &desc : HcDescriptors)
+    {
+        if (((desc.flags & mask) == mask) == (want != FALSE))
+        {
+            bitmap.Set(desc.callcode, TRUE);
+        }
+    }
+    return bitmap;
+}
+
+constexpr HC_CALLCODE_BITMAP HcDefaultDenied = HcBuildBitmap(HC_DESC_DENY, TRUE);
+constexpr HC_CALLCODE_BITMAP HcDefaultAllowed = HcBuildBitmap(HC_DESC_DENY, FALSE);
+
+//
+// Checks of the table against itself and the TLFS listing
+//
+constexpr BOOL
+HcIsIndexedByCallcode ()
+{
+    for (UINT32 i = 0; i < HC_DESC_COUNT; i++)
+    {
+        if (HcDescriptors[i].callcode != i)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+constexpr BOOL
+HcAgreesWithPdf ()
+{
+    for (const HC_PDF_ENTRY &entry : HcPdfEntries)
+    {
+        const HC_DESC *pDesc = HcLookup(entry.callcode);
+
+        if (pDesc == NULL)
+        {
+            return FALSE;
+        }
+
+        //
+        // Deprecated and Reserved are placeholders in the TLFS, the dump may
+        // have the handler's symbol, or the stub's for calls it doesn't have
+        //
+        if (!HcStrEqual(entry.name, "Deprecated") &&
+            !HcStrEqual(entry.name, "Reserved") &&
+            !(pDesc->flags & HC_DESC_STUB) &&
+            !HcStrEqual(pDesc->name, entry.name))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static_assert(HC_DESC_COUNT <= HC_CALLCODE_SPACE, "Call codes are 16 bit");
+static_assert(HcIsIndexedByCallcode(), "Hypercalls.h must have one entry per call code, in order");
+static_assert(HcAgreesWithPdf(), "Hypercalls.h disagrees with HypercallsOnlyFromPdf.txt");
+static_assert(!HcDefaultAllowed.Test(0x01) && !HcDefaultAllowed.Test(0x7f), "Default denylist not applied");
+static_assert(HcDefaultAllowed.Test(0x02) && !HcDefaultAllowed.Test(HC_DESC_COUNT), "Default allowlist wrong");
+static_assert(HcLookup(0x46)->privilege == HC_PRIV_ANY && HcLookup(0x41)->privilege == HC_PRIV_PARENT,
+              "Privileges not taken from HypercallsOnlyFromPdf.txt");
+
+//
+// Run time view of the bitmaps, the compile time ones plus the config
+//
+class HcFilter
+{
+public:
+    HcFilter ()
+        : m_allowed(HcDefaultAllowed),
+          m_denied(HcDefaultDenied)
+    {
+    }
+
+    BOOL IsAllowed (IN UINT32 callcode) const { return m_allowed.Test(callcode); }
+    BOOL IsDenied (IN UINT32 callcode) const { return m_denied.Test(callcode); }
+
+    VOID
+    Allow (
+        IN UINT32   first,
+        IN UINT32   last,
+        IN BOOL     allow
+    )
+    {
+        for (UINT32 callcode = first; callcode <= last && callcode < HC_CALLCODE_SPACE; callcode++)
+        {
+            m_allowed.Set(callcode, allow);
+            m_denied.Set(callcode, !allow);
+        }
+    }
+
+    //
+    // Apply an allow/deny config. FALSE if it can't be opened, or at the
+    // first bad line (*pBadLine, lines before it are applied)
+    //
+    BOOL
+    LoadConfig (
+        IN  const CHAR  *pPath,
+        OUT PUINT32     pBadLine
+    )
+    {
+        FILE    *pFile = fopen(pPath, "r");
+        CHAR    line[256];
+        UINT32  lineNo = 0;
+
+        *pBadLine = 0;
+        if (pFile == NULL)
+        {
+            return FALSE;
+        }
+
+        while (fgets(line, sizeof(line), pFile) != NULL)
+        {
+            lineNo++;
+            if (!ApplyLine(line))
+            {
+                *pBadLine = lineNo;
+                fclose(pFile);
+                return FALSE;
+            }
+        }
+
+        fclose(pFile);
+        return TRUE;
+    }
+
+private:
+    static const CHAR *
+    SkipSpace (
+        IN const CHAR   *p
+    )
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        {
+            p++;
+        }
+        return p;
+    }
+
+    BOOL
+    ApplyLine (
+        IN const CHAR   *pLine
+    )
+    {
+        const CHAR  *p = SkipSpace(pLine);
+        CHAR        *pEnd = NULL;
+        BOOL        allow = FALSE;
+
+        if (*p == '\0' || *p == '#')
+        {
+            return TRUE;
+        }
+
+        if (strncmp(p, "allow", 5) == 0)
+        {
+            allow = TRUE;
+            p += 5;
+        }
+        else if (strncmp(p, "deny", 4) == 0)
+        {
+            p += 4;
+        }
+        else
+        {
+            return FALSE;
+        }
+
+        unsigned long first = strtoul(SkipSpace(p), &pEnd, 0);
+        unsigned long last = first;
+
+        if (pEnd == SkipSpace(p))
+        {
+            return FALSE;
+        }
+
+        p = pEnd;
+        if (*p == '-')
+        {
+            last = strtoul(p + 1, &pEnd, 0);
+            if (pEnd == p + 1)
+            {
+                return FALSE;
+            }
+            p = pEnd;
+        }
+
+        p = SkipSpace(p);
+        if ((*p != '\0' && *p != '#') || first > last || last >= HC_CALLCODE_SPACE)
+        {
+            return FALSE;
+        }
+
+        Allow((UINT32)first, (UINT32)last, allow);
+        return TRUE;
+    }
+
+    HC_CALLCODE_BITMAP  m_allowed;
+    HC_CALLCODE_BITMAP  m_denied;
+};
@@ -0,0 +1,300 @@
+/*++
+
+Module Name:
+
+    InputGenerator.h
+
+Abstract:
+
+    Structure-aware cases for the fuzzer loop. Where the blind cases fill
+    whole pages with one value, these lay out the call's own input header
+    (inputSize) and rep element array and change one 8-byte field at a time
+    through a set of boundary values, keeping everything else valid enough
+    to get past the hypervisor's basic input checks.
+
+    Slow calls use USE_GPA_MEM_LAYOUT (InputLayout.h) for the input and
+    output GPAs, fast calls take the fields in RDX and R8 directly.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include "HypercallTable.h"
+#include "InputLayout.h"
+#include "RepContinuation.h"
+#include "FastCall.h"
+
+//
+// Cases of the fuzzer loop after the blind ones (0 - 136)
+//
+#define INPUT_GEN_FIRST_CASE    (8+64+64+1)
+#define INPUT_GEN_CASES         64
+#define INPUT_GEN_LAST_CASE     (INPUT_GEN_FIRST_CASE + INPUT_GEN_CASES - 1)
+
+//
+// The handler table does not carry the rep element size, one qword is the
+// common case (GPA, GVA and register name lists)
+//
+#define INPUT_GEN_REP_ELEMENT_QWORDS    1
+
+//
+// Values each field goes through, the boundaries parsers tend to get wrong
+//
+static const UINT64 s_inputGenValues[] =
+{
+    0,
+    1,
+    0xFFFFFFFFFFFFFFFFULL,
+    0xFFFFFFFEULL,
+    0x7FFFFFFFULL,
+    0x80000000ULL,
+    0xFFFFFFFFULL,
+    0x100000000ULL,
+    0x8000000000000000ULL,
+    0x1000,
+    0xFFF,
+    0xFFFF,
+    2,
+    0x40,
+    0x7F,
+    0xFF,
+};
+
+//
+// isRep 1 and 3 in the handler table take rep elements, 2 is a variable
+// header only and 4 the VTL calls
+//
+inline BOOL
+InputGenIsRepCall (
+    IN const HC_DESC    &desc
+)
+{
+    return desc.isRep == 1 || desc.isRep == 3;
+}
+
+//
+// Whether a status says the call got past the basic checks of the control
+// word, GPAs and input layout, i.e. the call's own code looked at the input
+//
+inline BOOL
+InputGenIsEffectiveStatus (
+    IN HV_STATUS    status
+)
+{
+    return status != HV_STATUS_INVALID_HYPERCALL_CODE &&
+           status != HV_STATUS_INVALID_HYPERCALL_INPUT &&
+           status != HV_STATUS_INVALID_ALIGNMENT &&
+           status != HV_STATUS_INVALID_PARAMETER;
+}
+
+inline VOID
+InputGenLayout (
+    IN  const HC_DESC   &desc,
+    OUT PINPUT_LAYOUT   pLayout
+)
+{
+    pLayout->headerSize = desc.inputSize;
+    pLayout->outputSize = desc.outputSize;
+    pLayout->repElementQwords = InputGenIsRepCall(desc) ? INPUT_GEN_REP_ELEMENT_QWORDS : 0;
+    pLayout->flags = 0;
+    pLayout->field = INPUT_LAYOUT_NO_FIELD;
+}
+
+//
+// Number of 8-byte fields a case can change, at least one
+//
+inline UINT32
+InputGenFieldCount (
+    IN const HC_DESC    &desc,
+    IN UINT32           repCnt,
+    IN BOOL             isFast
+)
+{
+    INPUT_LAYOUT layout;
+    UINT32 fields = 0;
+
+    InputGenLayout(desc, &layout);
+    fields = InputLayoutInputBytes(&layout, repCnt) / 8;
+    if (isFast && fields > 2)
+    {
+        fields = 2;
+    }
+    return fields == 0 ? 1 : fields;
+}
+
+//
+// Set the registers of generated case k (0 - INPUT_GEN_CASES-1) for a call.
+// RCX must already hold the control word. Field k % fields gets value
+// k / fields, the second half of the cases start field 0 as the partition self
+//
+inline VOID
+InputGenCase (
+    IN     const HC_DESC    &desc,
+    IN     UINT32           k,
+    IN OUT PCPU_REG_64      pRegs
+)
+{
+    UINT32          repCnt = (UINT32)((pRegs->rcx >> 32) & 0xfff);
+    BOOL            isFast = (pRegs->rcx >> 16) & 1;
+    UINT32          fields = InputGenFieldCount(desc, repCnt, isFast);
+    UINT64          value = s_inputGenValues[(k / fields) % _ARRAYSIZE(s_inputGenValues)];
+    INPUT_LAYOUT    layout;
+
+    InputGenLayout(desc, &layout);
+    layout.field = (UINT16)(k % fields);
+    if (k >= INPUT_GEN_CASES / 2)
+    {
+        layout.flags |= INPUT_LAYOUT_FLAG_PARTITION_SELF;
+    }
+
+    if (isFast)
+    {
+        //
+        // Fast calls read the first two input qwords from RDX and R8
+        //
+        pRegs->rdx = (layout.flags & INPUT_LAYOUT_FLAG_PARTITION_SELF) ? HV_PARTITION_ID_SELF : 0;
+        pRegs->r8 = 0;
+        if (layout.field == 0)
+        {
+            pRegs->rdx = value;
+        }
+        else
+        {
+            pRegs->r8 = value;
+        }
+        return;
+    }
+
+    pRegs->rdx = USE_GPA_MEM_LAYOUT;
+    pRegs->r8 = desc.outputSize != 0 ? USE_GPA_MEM_LAYOUT : 0;
+    pRegs->rbx = INPUT_LAYOUT_PACK(&layout);
+    pRegs->rax = value;
+}
+
+//
+// Input qwords of a register only case, the call's header and rep elements
+// as far as the fast call registers hold them, at least one
+//
+inline UINT32
+InputGenRegisterFieldCount (
+    IN const HC_DESC    &desc,
+    IN UINT32           repCnt
+)
+{
+    INPUT_LAYOUT layout;
+    UINT32 fields = 0;
+
+    InputGenLayout(desc, &layout);
+    fields = InputLayoutInputBytes(&layout, repCnt) / 8;
+    if (fields > FAST_CALL_SLOTS)
+    {
+        fields = FAST_CALL_SLOTS;
+    }
+    return fields == 0 ? 1 : fields;
+}
+
+//
+// Set the registers of register only case k (0 - INPUT_GEN_CASES-1): the
+// fields InputGenCase would lay out in the input page marshalled into RDX,
+// R8 and XMM0 - XMM5 (FastCall.h) instead, as an extended fast call, with
+// field k % fields set to value k / fields. With bFillRest the registers
+// past the input get the value too, which the hypervisor must ignore
+//
+inline VOID
+InputGenRegisterCase (
+    IN     const HC_DESC    &desc,
+    IN     UINT32           k,
+    IN     BOOL             bFillRest,
+    IN OUT PCPU_REG_64      pRegs
+)
+{
+    UINT32  fields = InputGenRegisterFieldCount(desc, HV_CONTROL_REP_COUNT(pRegs->rcx));
+    UINT64  value = s_inputGenValues[(k / fields) % _ARRAYSIZE(s_inputGenValues)];
+    UINT64  input[FAST_CALL_SLOTS] = { 0 };
+
+    if (k >= INPUT_GEN_CASES / 2)
+    {
+        input[0] = HV_PARTITION_ID_SELF;
+    }
+    input[k % fields] = value;
+    for (UINT32 slot = fields; bFillRest && slot < FAST_CALL_SLOTS; slot++)
+    {
+        input[slot] = value;
+    }
+
+    pRegs->rcx |= 1ULL << 16;
+    FastCallMarshalInput(pRegs, input, sizeof(input));
+}
+
+//
+// Rep counts of the rep sweep: every power of 2 and the one below it up to
+// the 12-bit maximum. InputGenRepSweepCount adds the count that exactly
+// fills the input page and the one past it
+//
+static const UINT16 s_inputGenRepCounts[] =
+{
+    1, 2, 3, 4, 7, 8, 15, 16, 31, 32, 63, 64, 127, 128, 255, 256,
+    511, 512, 1023, 1024, 2047, 2048, 4095,
+};
+
+#define INPUT_GEN_REP_SWEEP_CASES   ((UINT32)_ARRAYSIZE(s_inputGenRepCounts) + 2)
+
+inline UINT32
+InputGenRepSweepCount (
+    IN const HC_DESC    &desc,
+    IN UINT32           k
+)
+{
+    UINT32 pageFill = (INPUT_LAYOUT_PAGE_SIZE - ((desc.inputSize + 7u) & ~7u)) / (INPUT_GEN_REP_ELEMENT_QWORDS * 8);
+
+    if (k < _ARRAYSIZE(s_inputGenRepCounts))
+    {
+        return s_inputGenRepCounts[k];
+    }
+    pageFill += k - (UINT32)_ARRAYSIZE(s_inputGenRepCounts);
+    return pageFill == 0 ? 1 : (pageFill > 0xfff ? 0xfff : pageFill);
+}
+
+//
+// Set the registers of rep sweep case k (0 - INPUT_GEN_REP_SWEEP_CASES-1):
+// rep count k of the sweep from startIdx 0, 1 or the last rep, and a rep
+// element array counting up from 0 that fills the input page as far as the
+// count goes. The rest of the layout is as InputGenCase's, field 0 the
+// partition self
+//
+inline VOID
+InputGenRepSweepCase (
+    IN     const HC_DESC    &desc,
+    IN     UINT32           k,
+    IN     UINT32           start,
+    IN OUT PCPU_REG_64      pRegs
+)
+{
+    UINT32          repCnt = InputGenRepSweepCount(desc, k);
+    UINT32          repStart = start == 0 ? 0 : (start == 1 ? 1 : repCnt - 1);
+    INPUT_LAYOUT    layout;
+
+    InputGenLayout(desc, &layout);
+    layout.repElementQwords = INPUT_GEN_REP_ELEMENT_QWORDS;
+    layout.flags = INPUT_LAYOUT_FLAG_PARTITION_SELF | INPUT_LAYOUT_FLAG_REP_SEQUENCE;
+
+    pRegs->rcx = (pRegs->rcx & ~(0xfffULL << HV_CONTROL_REP_COUNT_SHIFT | HV_CONTROL_REP_START_MASK)) |
+                 ((UINT64)repCnt << HV_CONTROL_REP_COUNT_SHIFT) |
+                 ((UINT64)repStart << HV_CONTROL_REP_START_SHIFT);
+
+    if ((pRegs->rcx >> 16) & 1)
+    {
+        pRegs->rdx = HV_PARTITION_ID_SELF;
+        pRegs->r8 = 0;
+        return;
+    }
+
+    pRegs->rdx = USE_GPA_MEM_LAYOUT;
+    pRegs->r8 = desc.outputSize != 0 ? USE_GPA_MEM_LAYOUT : 0;
+    pRegs->rbx = INPUT_LAYOUT_PACK(&layout);
+    pRegs->rax = 0;
+}
@@ -0,0 +1,148 @@
+/*++
+
+Module Name:
+
+    InputLayout.h
+
+Abstract:
+
+    Structured input/output pages for slow hypercalls (USE_GPA_MEM_LAYOUT).
+
+    Instead of filling the whole input page with one value, the input page
+    gets a header of the call's inputSize followed by the rep element array,
+    all zero except one 8-byte field which is set to the case's value. The
+    output GPA is placed so that exactly outputSize bytes fit before the end
+    of the output page, so a call that writes past its output size crosses
+    the page.
+
+    The layout travels in the case's RBX (INPUT_LAYOUT_PACK) and the field
+    value in RAX, neither of which a slow hypercall reads. The rep count is
+    the control word's (RCX).
+
+    Plain C so it can be used by the driver.
+
+Environment:
+
+    Kernel mode, User mode, Portable
+
+--*/
+
+#pragma once
+
+#include "../ViridianFuzzer/ViridianFuzzerTypes.h"
+
+#define INPUT_LAYOUT_PAGE_SIZE      0x1000
+#define INPUT_LAYOUT_NO_FIELD       0x3ff
+
+//
+// Field 0 starts as HV_PARTITION_ID_SELF instead of 0, most partition and
+// VP calls take the partition id first
+//
+#define INPUT_LAYOUT_FLAG_PARTITION_SELF    0x1
+
+//
+// Rep element r starts with value + r instead of 0 (lists of VP indexes, GPA
+// pages or register names), the field set on top of it
+//
+#define INPUT_LAYOUT_FLAG_REP_SEQUENCE      0x2
+
+#define HV_PARTITION_ID_SELF        0xFFFFFFFFFFFFFFFFULL
+
+//
+// RBX: 15:0 header bytes, 31:16 output bytes, 39:32 rep element qwords,
+//      49:40 field to set (qword index, INPUT_LAYOUT_NO_FIELD for none),
+//      63:60 INPUT_LAYOUT_FLAG_*
+//
+typedef struct _INPUT_LAYOUT
+{
+    UINT16  headerSize;
+    UINT16  outputSize;
+    UINT8   repElementQwords;
+    UINT8   flags;
+    UINT16  field;
+} INPUT_LAYOUT, *PINPUT_LAYOUT;
+
+#define INPUT_LAYOUT_PACK(pLayout)                              \
+    ((UINT64)(pLayout)->headerSize |                            \
+     ((UINT64)(pLayout)->outputSize << 16) |                    \
+     ((UINT64)(pLayout)->repElementQwords << 32) |              \
+     ((UINT64)((pLayout)->field & INPUT_LAYOUT_NO_FIELD) << 40) | \
+     ((UINT64)((pLayout)->flags & 0xf) << 60))
+
+static __inline VOID
+InputLayoutUnpack (
+    IN  UINT64          packed,
+    OUT PINPUT_LAYOUT   pLayout
+)
+{
+    pLayout->headerSize = (UINT16)(packed & 0xffff);
+    pLayout->outputSize = (UINT16)((packed >> 16) & 0xffff);
+    pLayout->repElementQwords = (UINT8)((packed >> 32) & 0xff);
+    pLayout->field = (UINT16)((packed >> 40) & INPUT_LAYOUT_NO_FIELD);
+    pLayout->flags = (UINT8)((packed >> 60) & 0xf);
+}
+
+//
+// Bytes of header and rep elements, at most a page
+//
+static __inline UINT32
+InputLayoutInputBytes (
+    IN const INPUT_LAYOUT   *pLayout,
+    IN UINT32               repCnt
+)
+{
+    UINT32 bytes = ((UINT32)pLayout->headerSize + 7) & ~7u;
+
+    bytes += repCnt * pLayout->repElementQwords * 8;
+    return bytes > INPUT_LAYOUT_PAGE_SIZE ? INPUT_LAYOUT_PAGE_SIZE : bytes;
+}
+
+//
+// Offset of the output GPA in its page, 8-byte aligned. No output or a page
+// or more of it starts at the page
+//
+static __inline UINT32
+InputLayoutOutputOffset (
+    IN const INPUT_LAYOUT   *pLayout
+)
+{
+    UINT32 bytes = ((UINT32)pLayout->outputSize + 7) & ~7u;
+
+    return (bytes == 0 || bytes >= INPUT_LAYOUT_PAGE_SIZE) ? 0 : INPUT_LAYOUT_PAGE_SIZE - bytes;
+}
+
+//
+// Write the header and rep elements at the start of a zeroed input page
+//
+static __inline VOID
+InputLayoutBuild (
+    OUT PUINT64             pPage,
+    IN  const INPUT_LAYOUT  *pLayout,
+    IN  UINT32              repCnt,
+    IN  UINT64              value
+)
+{
+    UINT32 qwords = InputLayoutInputBytes( pLayout, repCnt ) / 8;
+
+    if( (pLayout->flags & INPUT_LAYOUT_FLAG_PARTITION_SELF) && qwords != 0 )
+    {
+        pPage[0] = HV_PARTITION_ID_SELF;
+    }
+
+    if( (pLayout->flags & INPUT_LAYOUT_FLAG_REP_SEQUENCE) && pLayout->repElementQwords != 0 )
+    {
+        UINT64 element = value;
+
+        for( UINT32 q = (((UINT32)pLayout->headerSize + 7) & ~7u) / 8; 
+             q < qwords; 
+             q += pLayout->repElementQwords )
+        {
+            pPage[q] = element++;
+        }
+    }
+
+    if( pLayout->field < qwords )
+    {
+        pPage[pLayout->field] = value;
+    }
+}
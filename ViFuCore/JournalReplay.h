@@ -0,0 +1,518 @@
+/*++
+
+Module Name:
+
+    JournalReplay.h
+
+Abstract:
+
+    Replays the cases of a recorded fuzz journal (FuzzJournal.h) against a
+    target, as fast as the target takes batches, and finds how much of the
+    history before a crash it needs.
+
+    Cases stream straight out of the memory mapped journal: only the
+    sequence numbers of the case records are indexed, registers are
+    unpacked when a batch is filled. A record whose registers were
+    truncated is rebuilt from its callcode/repCnt/fast/case index through a
+    CaseSpace made with the campaign's filter and seed, the rngState it
+    gives must match the journaled one.
+
+    Replay(begin, end) runs cases [begin, end) from a fresh target in
+    batches of up to maxBatch and stops at the first crash, ReplayLast(k)
+    the last k cases of the journal ("the cases before the crash").
+
+    A case that only crashes the hypervisor after earlier calls left state
+    behind does not reproduce on its own. Bisect(crash) finds the latest
+    start s for which replaying [s, crash] still crashes at the same case,
+    i.e. the part of the sequence that is required:
+        - nothing before the session the crash is in can matter, the guest
+          was rebooted at the SESSION record, so s is searched from there
+        - replay cost grows with the window, so windows of 1, 2, 4 ...
+          cases back from the crash are tried first (galloping), then the
+          start is bisected between the last window that did not reproduce
+          and the first that did
+        - a probe that crashes on an earlier case never gets to the crash
+          and counts as not reproducing (diverged in the stats)
+    This assumes more history never stops the crash, the result is checked
+    either side: [s, crash] reproduces and [s + 1, crash] does not.
+
+    A ReplayTarget is reset (the guest rebooted) before every run.
+    ReplayBackendTarget runs through any HcBackend with an injected
+    predicate saying whether a case crashed and a reset hook, so the
+    bisection runs on any platform against a stateful simulation.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include "FuzzJournal.h"
+#include "HcBackend.h"
+#include "CaseSpace.h"
+
+#define REPLAY_NO_CRASH         0xFFFFFFFFFFFFFFFFULL
+
+typedef enum _REPLAY_OUTCOME
+{
+    REPLAY_OUTCOME_PASS = 0,            // Ran, the guest carried on
+    REPLAY_OUTCOME_CRASH                // Guest went down
+} REPLAY_OUTCOME;
+
+typedef enum _REPLAY_STATUS
+{
+    REPLAY_STATUS_OK = 0,
+    REPLAY_STATUS_NOT_REPRODUCED,       // Did not crash at the case, even with its whole session
+    REPLAY_STATUS_BAD_RANGE,
+    REPLAY_STATUS_BAD_RECORD,           // Truncated registers and no CaseSpace to rebuild them
+    REPLAY_STATUS_TARGET_ERROR
+} REPLAY_STATUS;
+
+//
+// What a target batch did. Cases [0, ran) passed, on a crash it was case ran
+//
+typedef struct _REPLAY_BATCH_RESULT
+{
+    UINT32  outcome;                    // REPLAY_OUTCOME
+    UINT32  ran;
+} REPLAY_BATCH_RESULT, *PREPLAY_BATCH_RESULT;
+
+//
+// A replay of cases [begin, end), positions are case records, not journal
+// sequence numbers
+//
+typedef struct _REPLAY_RUN
+{
+    UINT64  begin;
+    UINT64  end;
+    UINT64  ran;                        // Cases run, the crashing one included
+    UINT64  crash;                      // Position of the crashing case, REPLAY_NO_CRASH if none
+} REPLAY_RUN, *PREPLAY_RUN;
+
+typedef struct _REPLAY_BISECT
+{
+    UINT64  crash;                      // Position of the crashing case
+    UINT64  start;                      // First case it needs, crash if it reproduces alone
+    UINT64  required;                   // crash - start + 1
+    UINT64  crashSequence;              // Journal sequence numbers of the two
+    UINT64  startSequence;
+    UINT64  sessionStart;               // Earliest start searched
+    UINT64  probes;                     // Replays run
+    UINT64  cases;                      // Cases those ran
+} REPLAY_BISECT, *PREPLAY_BISECT;
+
+typedef struct _REPLAY_CONFIG
+{
+    UINT32  maxBatch;                   // Cases per target batch, 0 for HYPERCALL_BATCH_MAX_CASES
+    UINT32  rsvd;
+} REPLAY_CONFIG, *PREPLAY_CONFIG;
+
+typedef struct _REPLAY_STATS
+{
+    UINT64  runs;                       // Replays, each from a reset target
+    UINT64  batches;
+    UINT64  cases;
+    UINT64  crashes;
+    UINT64  diverged;                   // Probes crashing before the case being bisected
+    UINT64  rebuilt;                    // Truncated records rebuilt through the CaseSpace
+    UINT64  execNs;                     // Time spent in the target, resets included
+} REPLAY_STATS, *PREPLAY_STATS;
+
+//
+// Whatever runs the cases: the guest through something that can reboot it,
+// or a simulation. Reset gives a target with no state left from earlier
+// runs, Run runs the cases in order and stops at the first that crashes.
+// FALSE if the target could not do it at all
+//
+class ReplayTarget
+{
+public:
+    virtual ~ReplayTarget () {}
+
+    virtual BOOL Reset () = 0;
+
+    virtual BOOL
+    Run (
+        IN  const CPU_REG_64    *pCases,
+        IN  UINT32              count,
+        OUT PREPLAY_BATCH_RESULT pResult
+    ) = 0;
+};
+
+//
+// Whether a case crashed, given what the backend said
+//
+typedef REPLAY_OUTCOME (*REPLAY_CRASH_PREDICATE)(
+    IN const CPU_REG_64                 *pCase,
+    IN const HYPERCALL_BATCH_RESULT     *pResult,
+    IN VOID                             *pContext
+    );
+
+typedef BOOL (*REPLAY_RESET)(
+    IN VOID     *pContext
+    );
+
+//
+// Runs a batch of cases as one HcBackend batch, then asks the predicate
+// about each in order
+//
+class ReplayBackendTarget : public ReplayTarget
+{
+public:
+    ReplayBackendTarget (
+        IN HcBackend                &backend,
+        IN REPLAY_CRASH_PREDICATE   pPredicate,
+        IN REPLAY_RESET             pReset,
+        IN VOID                     *pContext = NULL
+    )
+        : m_backend(backend),
+          m_pPredicate(pPredicate),
+          m_pReset(pReset),
+          m_pContext(pContext),
+          m_batch(HYPERCALL_BATCH_MAX_CASES),
+          m_results(HYPERCALL_BATCH_MAX_CASES)
+    {
+    }
+
+    virtual BOOL
+    Reset ()
+    {
+        return m_pReset == NULL || m_pReset(m_pContext);
+    }
+
+    virtual BOOL
+    Run (
+        IN  const CPU_REG_64    *pCases,
+        IN  UINT32              count,
+        OUT PREPLAY_BATCH_RESULT pResult
+    )
+    {
+        pResult->outcome = REPLAY_OUTCOME_PASS;
+        pResult->ran = 0;
+
+        m_batch.Reset();
+        for (UINT32 c = 0; c < count; c++)
+        {
+            if (!m_batch.Add(pCases[c]))
+            {
+                return FALSE;
+            }
+        }
+        if (m_backend.ExecBatch(m_batch, m_results) != 0 || m_results.Count() != count)
+        {
+            return FALSE;
+        }
+
+        for (; pResult->ran < count; pResult->ran++)
+        {
+            if (m_pPredicate(&pCases[pResult->ran], &m_results[pResult->ran], m_pContext) != REPLAY_OUTCOME_PASS)
+            {
+                pResult->outcome = REPLAY_OUTCOME_CRASH;
+                break;
+            }
+        }
+        return TRUE;
+    }
+
+private:
+    HcBackend               &m_backend;
+    REPLAY_CRASH_PREDICATE  m_pPredicate;
+    REPLAY_RESET            m_pReset;
+    VOID                    *m_pContext;
+    HcBatchEncoder          m_batch;
+    HcBatchResults          m_results;
+};
+
+class JournalReplay
+{
+public:
+    //
+    // Indexes the case records of an open journal. pSpace rebuilds truncated
+    // records, it must be made with the campaign's filter and seed
+    //
+    explicit JournalReplay (
+        IN const FuzzJournalReader  &reader,
+        IN const CaseSpace          *pSpace = NULL,
+        IN const REPLAY_CONFIG      *pConfig = NULL
+    )
+        : m_reader(reader),
+          m_pSpace(pSpace)
+    {
+        m_maxBatch = pConfig != NULL && pConfig->maxBatch != 0 ? pConfig->maxBatch : HYPERCALL_BATCH_MAX_CASES;
+        if (m_maxBatch > HYPERCALL_BATCH_MAX_CASES)
+        {
+            m_maxBatch = HYPERCALL_BATCH_MAX_CASES;
+        }
+        m_cases.resize(m_maxBatch);
+        memset(&m_stats, 0, sizeof(m_stats));
+
+        //
+        // Sessions are kept as the position of the first case after them
+        //
+        for (UINT64 seq = 0; seq < reader.Count(); seq++)
+        {
+            UINT8 kind = reader.Record(seq)->kind;
+
+            if (kind == FUZZ_JOURNAL_KIND_CASE)
+            {
+                m_sequences.push_back(seq);
+            }
+            else if (kind == FUZZ_JOURNAL_KIND_SESSION)
+            {
+                m_sessions.push_back(m_sequences.size());
+            }
+        }
+    }
+
+    UINT64 Count () const { return m_sequences.size(); }
+    UINT64 Sequence (IN UINT64 position) const { return m_sequences[(SIZE_T)position]; }
+
+    VOID GetStats (OUT PREPLAY_STATS pStats) const { *pStats = m_stats; }
+    VOID ResetStats () { memset(&m_stats, 0, sizeof(m_stats)); }
+
+    //
+    // First case of the session a case is in, the guest had just booted there
+    //
+    UINT64
+    SessionStart (
+        IN UINT64   position
+    ) const
+    {
+        UINT64 start = 0;
+
+        for (SIZE_T s = 0; s < m_sessions.size() && m_sessions[s] <= position; s++)
+        {
+            start = m_sessions[s];
+        }
+        return start;
+    }
+
+    //
+    // Registers of a case as it was run
+    //
+    BOOL
+    Case (
+        IN  UINT64      position,
+        OUT PCPU_REG_64 pRegs
+    )
+    {
+        const FUZZ_JOURNAL_RECORD   *pRecord = m_reader.Record(m_sequences[(SIZE_T)position]);
+        FUZZ_CASE                   fuzzCase;
+        UINT64                      index = 0;
+
+        if (!(pRecord->flags & FUZZ_JOURNAL_FLAG_REGS_TRUNCATED))
+        {
+            FuzzJournalUnpackRegs(pRecord, pRegs);
+            return TRUE;
+        }
+
+        if (m_pSpace == NULL ||
+            !m_pSpace->IndexOf(pRecord->callcode, pRecord->repCnt, pRecord->fast, pRecord->caseIdx, &index) ||
+            !m_pSpace->Materialize(index, &fuzzCase) ||
+            fuzzCase.rngState != pRecord->rngState)
+        {
+            return FALSE;
+        }
+        *pRegs = fuzzCase.regs;
+        m_stats.rebuilt++;
+        return TRUE;
+    }
+
+    //
+    // Cases [begin, end) from a reset target, up to the first crash
+    //
+    REPLAY_STATUS
+    Replay (
+        IN OUT ReplayTarget &target,
+        IN     UINT64       begin,
+        IN     UINT64       end,
+        OUT    PREPLAY_RUN  pRun
+    )
+    {
+        auto            start = std::chrono::steady_clock::now();
+        REPLAY_STATUS   status = REPLAY_STATUS_OK;
+
+        pRun->begin = begin;
+        pRun->end = end;
+        pRun->ran = 0;
+        pRun->crash = REPLAY_NO_CRASH;
+
+        if (begin > end || end > Count())
+        {
+            return REPLAY_STATUS_BAD_RANGE;
+        }
+        if (!target.Reset())
+        {
+            return REPLAY_STATUS_TARGET_ERROR;
+        }
+        m_stats.runs++;
+
+        for (UINT64 next = begin; next < end && pRun->crash == REPLAY_NO_CRASH;)
+        {
+            REPLAY_BATCH_RESULT result;
+            UINT32              count = end - next < m_maxBatch ? (UINT32)(end - next) : m_maxBatch;
+
+            for (UINT32 c = 0; c < count; c++)
+            {
+                if (!Case(next + c, &m_cases[c]))
+                {
+                    status = REPLAY_STATUS_BAD_RECORD;
+                    break;
+                }
+            }
+            if (status != REPLAY_STATUS_OK)
+            {
+                break;
+            }
+            if (!target.Run(m_cases.data(), count, &result) || result.ran > count)
+            {
+                status = REPLAY_STATUS_TARGET_ERROR;
+                break;
+            }
+
+            m_stats.batches++;
+            if (result.outcome != REPLAY_OUTCOME_PASS)
+            {
+                pRun->crash = next + result.ran;
+                pRun->ran += result.ran + 1;
+                m_stats.crashes++;
+            }
+            else
+            {
+                pRun->ran += count;
+            }
+            next += count;
+        }
+
+        m_stats.cases += pRun->ran;
+        m_stats.execNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        return status;
+    }
+
+    //
+    // The last k cases of the journal, the last one is the case in flight
+    // when the guest went down
+    //
+    REPLAY_STATUS
+    ReplayLast (
+        IN OUT ReplayTarget &target,
+        IN     UINT64       k,
+        OUT    PREPLAY_RUN  pRun
+    )
+    {
+        return Replay(target, Count() > k ? Count() - k : 0, Count(), pRun);
+    }
+
+    //
+    // The history a crashing case needs, see the header
+    //
+    REPLAY_STATUS
+    Bisect (
+        IN OUT ReplayTarget     &target,
+        IN     UINT64           crash,
+        OUT    PREPLAY_BISECT   pBisect
+    )
+    {
+        REPLAY_STATUS   status = REPLAY_STATUS_OK;
+        UINT64          earliest = 0;
+        UINT64          good = REPLAY_NO_CRASH;
+        UINT64          bad = crash + 1;
+        UINT64          window = 1;
+        BOOL            bReproduced = FALSE;
+
+        memset(pBisect, 0, sizeof(REPLAY_BISECT));
+        if (crash >= Count())
+        {
+            return REPLAY_STATUS_BAD_RANGE;
+        }
+        earliest = SessionStart(crash);
+        pBisect->crash = crash;
+        pBisect->sessionStart = earliest;
+
+        //
+        // Gallop back from the crash: starts crash, crash - 1, crash - 3 ...
+        //
+        for (;;)
+        {
+            UINT64 start = crash + 1 - earliest > window ? crash + 1 - window : earliest;
+
+            if ((status = Probe(target, start, crash, pBisect, &bReproduced)) != REPLAY_STATUS_OK)
+            {
+                return status;
+            }
+            if (bReproduced)
+            {
+                good = start;
+                break;
+            }
+            bad = start;
+            if (start == earliest)
+            {
+                return REPLAY_STATUS_NOT_REPRODUCED;
+            }
+            window *= 2;
+        }
+
+        //
+        // [good, crash] reproduces, [bad, crash] does not
+        //
+        while (bad - good > 1)
+        {
+            UINT64 mid = good + (bad - good) / 2;
+
+            if ((status = Probe(target, mid, crash, pBisect, &bReproduced)) != REPLAY_STATUS_OK)
+            {
+                return status;
+            }
+            if (bReproduced)
+            {
+                good = mid;
+            }
+            else
+            {
+                bad = mid;
+            }
+        }
+
+        pBisect->start = good;
+        pBisect->required = crash - good + 1;
+        pBisect->crashSequence = Sequence(crash);
+        pBisect->startSequence = Sequence(good);
+        return REPLAY_STATUS_OK;
+    }
+
+private:
+    REPLAY_STATUS
+    Probe (
+        IN OUT ReplayTarget     &target,
+        IN     UINT64           start,
+        IN     UINT64           crash,
+        IN OUT PREPLAY_BISECT   pBisect,
+        OUT    BOOL             *pbReproduced
+    )
+    {
+        REPLAY_RUN      run;
+        REPLAY_STATUS   status = Replay(target, start, crash + 1, &run);
+
+        pBisect->probes++;
+        pBisect->cases += run.ran;
+        *pbReproduced = run.crash == crash;
+        if (run.crash != REPLAY_NO_CRASH && run.crash != crash)
+        {
+            m_stats.diverged++;
+        }
+        return status;
+    }
+
+    const FuzzJournalReader &m_reader;
+    const CaseSpace         *m_pSpace;
+    UINT32                  m_maxBatch;
+    std::vector<UINT64>     m_sequences;        // Journal sequence of each case record
+    std::vector<UINT64>     m_sessions;         // Position of the first case of each session
+    std::vector<CPU_REG_64> m_cases;
+    REPLAY_STATS            m_stats;
+};
@@ -0,0 +1,189 @@
+/*++
+
+Module Name:
+
+    LatencyHistogram.h
+
+Abstract:
+
+    Fixed size log-linear histogram of UINT64 samples (nanoseconds, cycles).
+    Each power of 2 is split into LATENCY_HIST_SUB_BUCKETS linear buckets, so
+    a percentile is reported to within 1/LATENCY_HIST_SUB_BUCKETS of the real
+    value. Recording is a couple of shifts and an increment, no allocation.
+
+    Not thread safe, keep one per thread and Merge() them, or record into a
+    ConcurrentLatencyHistogram (HcLatency.h) from any number of threads.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <string.h>
+#include "ViFuPlatform.h"
+
+#define LATENCY_HIST_SUB_BITS       3
+#define LATENCY_HIST_SUB_BUCKETS    (1 << LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_BUCKETS        ((64 - LATENCY_HIST_SUB_BITS + 1) * LATENCY_HIST_SUB_BUCKETS)
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram ()
+    {
+        Reset();
+    }
+
+    VOID
+    Reset ()
+    {
+        memset(m_counts, 0, sizeof(m_counts));
+        m_total = 0;
+        m_sum = 0;
+        m_max = 0;
+    }
+
+    VOID
+    Record (
+        IN UINT64   value
+    )
+    {
+        m_counts[BucketOf(value)]++;
+        m_total++;
+        m_sum += value;
+        if (value > m_max)
+        {
+            m_max = value;
+        }
+    }
+
+    VOID
+    Merge (
+        IN const LatencyHistogram   &other
+    )
+    {
+        for (UINT32 b = 0; b < LATENCY_HIST_BUCKETS; b++)
+        {
+            m_counts[b] += other.m_counts[b];
+        }
+        m_total += other.m_total;
+        m_sum += other.m_sum;
+        if (other.m_max > m_max)
+        {
+            m_max = other.m_max;
+        }
+    }
+
+    //
+    // Upper bound of the bucket holding the pct'th percentile (0 - 100),
+    // clamped to the largest sample seen
+    //
+    UINT64
+    Percentile (
+        IN double   pct
+    ) const
+    {
+        UINT64 rank = 0;
+        UINT64 seen = 0;
+
+        if (m_total == 0)
+        {
+            return 0;
+        }
+
+        rank = (UINT64)((pct / 100.0) * (double)m_total + 0.5);
+        if (rank == 0)
+        {
+            rank = 1;
+        }
+
+        for (UINT32 b = 0; b < LATENCY_HIST_BUCKETS; b++)
+        {
+            seen += m_counts[b];
+            if (seen >= rank)
+            {
+                UINT64 upper = BucketUpper(b);
+                return upper < m_max ? upper : m_max;
+            }
+        }
+
+        return m_max;
+    }
+
+    //
+    // Replace the contents with counts kept elsewhere in the same buckets,
+    // e.g. a snapshot of a ConcurrentLatencyHistogram (HcLatency.h)
+    //
+    VOID
+    Load (
+        IN const UINT64 *pCounts,
+        IN UINT64       sum,
+        IN UINT64       max
+    )
+    {
+        m_total = 0;
+        for (UINT32 b = 0; b < LATENCY_HIST_BUCKETS; b++)
+        {
+            m_counts[b] = pCounts[b];
+            m_total += pCounts[b];
+        }
+        m_sum = sum;
+        m_max = max;
+    }
+
+    UINT64 Count () const { return m_total; }
+    UINT64 Max () const { return m_max; }
+    double Mean () const { return m_total != 0 ? (double)m_sum / (double)m_total : 0.0; }
+
+    //
+    // Values below LATENCY_HIST_SUB_BUCKETS get a bucket each, above that the
+    // top LATENCY_HIST_SUB_BITS bits below the leading one pick the sub bucket
+    //
+    static UINT32
+    BucketOf (
+        IN UINT64   value
+    )
+    {
+        UINT32 msb = 0;
+
+        if (value < LATENCY_HIST_SUB_BUCKETS)
+        {
+            return (UINT32)value;
+        }
+
+        for (UINT64 v = value; v > 1; v >>= 1)
+        {
+            msb++;
+        }
+
+        return (msb - LATENCY_HIST_SUB_BITS + 1) * LATENCY_HIST_SUB_BUCKETS +
+               (UINT32)((value >> (msb - LATENCY_HIST_SUB_BITS)) & (LATENCY_HIST_SUB_BUCKETS - 1));
+    }
+
+    static UINT64
+    BucketUpper (
+        IN UINT32   bucket
+    )
+    {
+        UINT32 group = bucket / LATENCY_HIST_SUB_BUCKETS;
+        UINT32 sub = bucket % LATENCY_HIST_SUB_BUCKETS;
+        UINT32 shift = 0;
+
+        if (group == 0)
+        {
+            return sub;
+        }
+
+        shift = group - 1;
+        return ((UINT64)(LATENCY_HIST_SUB_BUCKETS + sub + 1) << shift) - 1;
+    }
+
+private:
+    UINT64  m_counts[LATENCY_HIST_BUCKETS];
+    UINT64  m_total;
+    UINT64  m_sum;
+    UINT64  m_max;
+};
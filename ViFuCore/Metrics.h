@@ -0,0 +1,923 @@
+/*++
+
+Module Name:
+
+    Metrics.h
+
+Abstract:
+
+    Live metrics of a fuzzing run, for a dashboard to scrape or a TUI to
+    poll while the workers go on.
+
+    The hot path only counts. Workers already count cases and results in
+    WorkerCounters (WorkerPool.h) and their pipeline's stage timings in
+    PIPELINE_STATS (Pipeline.h), each counter written by one thread and
+    readable from any. MetricsStatusCounters adds per-worker counts of each
+    HV_STATUS the same way. None of it is a locked operation.
+
+    MetricsPublisher runs one background thread that every periodMs has a
+    collect function merge those counters into a METRICS_SNAPSHOT, works
+    out the case and novelty rates and publishes the snapshot twice:
+
+        - in a memory-mapped stats file, a METRICS_FILE_HEADER and the
+          snapshot behind a sequence lock. The sequence is odd while the
+          snapshot is rewritten, so MetricsView reads it without a lock
+          and retries if it changed under it
+        - as Prometheus text (version 0.0.4) on GET /metrics of a small
+          HTTP endpoint served by the same thread, anything else is a 404
+
+    Snapshots are only as consistent as the counters: one worker's cases
+    may already include a batch its statuses do not yet.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <functional>
+#include "WorkerPool.h"
+#include "Pipeline.h"
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "Ws2_32.lib")
+#endif
+typedef SOCKET  METRICS_SOCKET;
+typedef HANDLE  METRICS_FD;
+#define METRICS_INVALID_SOCKET  INVALID_SOCKET
+#define METRICS_INVALID_FD      INVALID_HANDLE_VALUE
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+typedef INT     METRICS_SOCKET;
+typedef INT     METRICS_FD;
+#define METRICS_INVALID_SOCKET  (-1)
+#define METRICS_INVALID_FD      (-1)
+#endif
+
+#define METRICS_MAGIC           0x534d4656      // 'VFMS'
+#define METRICS_VERSION         1
+
+//
+// HV_STATUS values below this are counted each, the rest share the last
+//
+#define METRICS_STATUSES        0x80
+#define METRICS_MAX_WORKERS     WORKER_POOL_MAX_WORKERS
+
+#define METRICS_DEFAULT_PORT    7333
+#define METRICS_PERIOD_MS       1000
+#define METRICS_POLL_MS         100             // Longest Stop() waits for the thread
+#define METRICS_HTTP_TIMEOUT_MS 500             // For a scraper to send its request
+#define METRICS_REQUEST_MAX     2048
+#define METRICS_READ_RETRIES    64
+
+typedef struct _METRICS_WORKER
+{
+    UINT64  cases;
+    UINT64  effective;
+    UINT64  errors;
+    UINT64  executeBusyNs;          // Time the pinned thread spent in hypercalls
+} METRICS_WORKER, *PMETRICS_WORKER;
+
+//
+// What the stats file holds after its header. Counters are totals since
+// the start of the run, rates are over the last period
+//
+typedef struct _METRICS_SNAPSHOT
+{
+    UINT64          uptimeNs;
+    UINT64          published;                      // Snapshots before this one
+    UINT32          workers;
+    UINT32          rsvd;
+    UINT64          counters[WORKER_COUNTER_COUNT]; // Summed over the workers
+    UINT64          statuses[METRICS_STATUSES];
+    UINT64          novel;                          // Unique results
+    UINT64          observations;
+    UINT64          logBacklog;                     // Bytes enqueued, not yet written
+    UINT64          logStalls;
+    double          casesPerSec;
+    double          novelPerSec;
+    PIPELINE_STATS  pipeline;                       // Summed over the workers
+    METRICS_WORKER  perWorker[METRICS_MAX_WORKERS];
+} METRICS_SNAPSHOT, *PMETRICS_SNAPSHOT;
+
+typedef struct _METRICS_FILE_HEADER
+{
+    UINT32  magic;
+    UINT32  version;
+    UINT32  size;                   // Of header and snapshot
+    UINT32  rsvd;
+    UINT64  sequence;               // Odd while the snapshot is written
+} METRICS_FILE_HEADER, *PMETRICS_FILE_HEADER;
+
+#define METRICS_FILE_SIZE       (sizeof(METRICS_FILE_HEADER) + sizeof(METRICS_SNAPSHOT))
+
+C_ASSERT(sizeof(METRICS_FILE_HEADER) == 24);
+C_ASSERT(sizeof(METRICS_SNAPSHOT) % 8 == 0);
+C_ASSERT(sizeof(std::atomic<UINT64>) == sizeof(UINT64));
+
+typedef struct _METRICS_CONFIG
+{
+    const CHAR  *pFile;             // Stats file, NULL for none
+    const CHAR  *pBindAddr;         // IPv4 address to serve on, NULL for no endpoint
+    UINT16      port;               // 0 picks a free port, see Port()
+    UINT32      periodMs;
+} METRICS_CONFIG, *PMETRICS_CONFIG;
+
+//
+// Fills the counters of a snapshot, everything but uptime, published and
+// the rates
+//
+typedef std::function<VOID (PMETRICS_SNAPSHOT)> METRICS_COLLECT;
+
+//
+// Counts of each HV_STATUS seen by one worker. Added to by its triage
+// thread only, so an add is a plain load and store like WorkerCounters
+//
+class MetricsStatusCounters
+{
+public:
+    MetricsStatusCounters ()
+    {
+        for (UINT32 s = 0; s < METRICS_STATUSES; s++)
+        {
+            m_counts[s].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    VOID
+    Add (
+        IN UINT16   status
+    )
+    {
+        std::atomic<UINT64> &count = m_counts[status < METRICS_STATUSES ? status : METRICS_STATUSES - 1];
+
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    //
+    // Add this worker's counts to pCounts[METRICS_STATUSES]
+    //
+    VOID
+    Sum (
+        IN OUT UINT64   *pCounts
+    ) const
+    {
+        for (UINT32 s = 0; s < METRICS_STATUSES; s++)
+        {
+            pCounts[s] += m_counts[s].load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    UINT8               rsvd0[WORKER_POOL_CACHE_LINE];  // Apart from whatever is around it
+    std::atomic<UINT64> m_counts[METRICS_STATUSES];
+    UINT8               rsvd1[WORKER_POOL_CACHE_LINE];
+};
+
+inline const CHAR *
+MetricsCounterName (
+    IN WORKER_COUNTER   counter
+)
+{
+    static const CHAR *names[WORKER_COUNTER_COUNT] = {
+        "chunks", "steals", "steal_misses", "cases", "success", "effective", "batch_errors"
+    };
+
+    return counter < WORKER_COUNTER_COUNT ? names[counter] : "?";
+}
+
+inline VOID
+MetricsAppend (
+    IN OUT std::string  *pText,
+    IN     const CHAR   *format,
+    ...
+)
+{
+    CHAR    line[256];
+    va_list args;
+    INT     len = 0;
+
+    va_start(args, format);
+    len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len > 0)
+    {
+        pText->append(line, (SIZE_T)len < sizeof(line) ? (SIZE_T)len : sizeof(line) - 1);
+    }
+}
+
+//
+// The snapshot as Prometheus text exposition format
+//
+inline VOID
+MetricsFormatPrometheus (
+    IN  const METRICS_SNAPSHOT  &snapshot,
+    OUT std::string             *pText
+)
+{
+    pText->clear();
+
+    MetricsAppend(pText, "# HELP vifu_uptime_seconds Time since metrics started.\n# TYPE vifu_uptime_seconds gauge\n");
+    MetricsAppend(pText, "vifu_uptime_seconds %.3f\n", snapshot.uptimeNs / 1e9);
+    MetricsAppend(pText, "# HELP vifu_workers Fuzzing workers.\n# TYPE vifu_workers gauge\n");
+    MetricsAppend(pText, "vifu_workers %u\n", snapshot.workers);
+
+    for (UINT32 c = 0; c < WORKER_COUNTER_COUNT; c++)
+    {
+        const CHAR *name = MetricsCounterName((WORKER_COUNTER)c);
+
+        MetricsAppend(pText, "# TYPE vifu_%s_total counter\n", name);
+        MetricsAppend(pText, "vifu_%s_total %llu\n", name, (unsigned long long)snapshot.counters[c]);
+    }
+
+    MetricsAppend(pText, "# HELP vifu_hv_status_total Cases by HV_STATUS returned.\n# TYPE vifu_hv_status_total counter\n");
+    for (UINT32 s = 0; s < METRICS_STATUSES; s++)
+    {
+        if (snapshot.statuses[s] != 0)
+        {
+            MetricsAppend(pText, "vifu_hv_status_total{status=\"0x%04x\"} %llu\n", s, (unsigned long long)snapshot.statuses[s]);
+        }
+    }
+
+    MetricsAppend(pText, "# HELP vifu_novel_results_total Unique result signatures.\n# TYPE vifu_novel_results_total counter\n");
+    MetricsAppend(pText, "vifu_novel_results_total %llu\n", (unsigned long long)snapshot.novel);
+    MetricsAppend(pText, "# TYPE vifu_observations_total counter\n");
+    MetricsAppend(pText, "vifu_observations_total %llu\n", (unsigned long long)snapshot.observations);
+    MetricsAppend(pText, "# HELP vifu_cases_per_second Cases over the last period.\n# TYPE vifu_cases_per_second gauge\n");
+    MetricsAppend(pText, "vifu_cases_per_second %.1f\n", snapshot.casesPerSec);
+    MetricsAppend(pText, "# HELP vifu_novel_per_second Unique results over the last period.\n# TYPE vifu_novel_per_second gauge\n");
+    MetricsAppend(pText, "vifu_novel_per_second %.3f\n", snapshot.novelPerSec);
+    MetricsAppend(pText, "# HELP vifu_log_backlog_bytes Log bytes enqueued, not yet written.\n# TYPE vifu_log_backlog_bytes gauge\n");
+    MetricsAppend(pText, "vifu_log_backlog_bytes %llu\n", (unsigned long long)snapshot.logBacklog);
+    MetricsAppend(pText, "# TYPE vifu_log_stalls_total counter\n");
+    MetricsAppend(pText, "vifu_log_stalls_total %llu\n", (unsigned long long)snapshot.logStalls);
+
+    MetricsAppend(pText, "# TYPE vifu_pipeline_wall_seconds_total counter\n");
+    MetricsAppend(pText, "vifu_pipeline_wall_seconds_total %.6f\n", snapshot.pipeline.wallNs / 1e9);
+    MetricsAppend(pText, "# HELP vifu_stage_busy_seconds_total Time in each pipeline stage.\n# TYPE vifu_stage_busy_seconds_total counter\n");
+    for (UINT32 stage = 0; stage < PIPELINE_STAGE_COUNT; stage++)
+    {
+        MetricsAppend(pText, "vifu_stage_busy_seconds_total{stage=\"%s\"} %.6f\n",
+                      PipelineStageName((PIPELINE_STAGE)stage),
+                      snapshot.pipeline.stages[stage].busyNs / 1e9);
+    }
+    MetricsAppend(pText, "# HELP vifu_stage_wait_seconds_total Time each pipeline stage waited on a queue.\n# TYPE vifu_stage_wait_seconds_total counter\n");
+    for (UINT32 stage = 0; stage < PIPELINE_STAGE_COUNT; stage++)
+    {
+        MetricsAppend(pText, "vifu_stage_wait_seconds_total{stage=\"%s\"} %.6f\n",
+                      PipelineStageName((PIPELINE_STAGE)stage),
+                      snapshot.pipeline.stages[stage].waitNs / 1e9);
+    }
+    MetricsAppend(pText, "# TYPE vifu_stage_batches_total counter\n");
+    for (UINT32 stage = 0; stage < PIPELINE_STAGE_COUNT; stage++)
+    {
+        MetricsAppend(pText, "vifu_stage_batches_total{stage=\"%s\"} %llu\n",
+                      PipelineStageName((PIPELINE_STAGE)stage),
+                      (unsigned long long)snapshot.pipeline.stages[stage].items);
+    }
+    MetricsAppend(pText, "# TYPE vifu_queue_occupancy_average gauge\n");
+    for (UINT32 queue = 0; queue < PIPELINE_QUEUE_COUNT; queue++)
+    {
+        MetricsAppend(pText, "vifu_queue_occupancy_average{queue=\"%s\"} %.3f\n",
+                      PipelineQueueName((PIPELINE_QUEUE)queue),
+                      PipelineAverageOccupancy(snapshot.pipeline, (PIPELINE_QUEUE)queue));
+    }
+
+    MetricsAppend(pText, "# TYPE vifu_worker_cases_total counter\n");
+    for (UINT32 w = 0; w < snapshot.workers && w < METRICS_MAX_WORKERS; w++)
+    {
+        MetricsAppend(pText, "vifu_worker_cases_total{worker=\"%u\"} %llu\n", w, (unsigned long long)snapshot.perWorker[w].cases);
+    }
+    MetricsAppend(pText, "# TYPE vifu_worker_effective_total counter\n");
+    for (UINT32 w = 0; w < snapshot.workers && w < METRICS_MAX_WORKERS; w++)
+    {
+        MetricsAppend(pText, "vifu_worker_effective_total{worker=\"%u\"} %llu\n", w, (unsigned long long)snapshot.perWorker[w].effective);
+    }
+    MetricsAppend(pText, "# TYPE vifu_worker_batch_errors_total counter\n");
+    for (UINT32 w = 0; w < snapshot.workers && w < METRICS_MAX_WORKERS; w++)
+    {
+        MetricsAppend(pText, "vifu_worker_batch_errors_total{worker=\"%u\"} %llu\n", w, (unsigned long long)snapshot.perWorker[w].errors);
+    }
+    MetricsAppend(pText, "# TYPE vifu_worker_execute_busy_seconds_total counter\n");
+    for (UINT32 w = 0; w < snapshot.workers && w < METRICS_MAX_WORKERS; w++)
+    {
+        MetricsAppend(pText, "vifu_worker_execute_busy_seconds_total{worker=\"%u\"} %.6f\n", w, snapshot.perWorker[w].executeBusyNs / 1e9);
+    }
+}
+
+inline std::atomic<UINT64> &
+MetricsSequence (
+    IN PMETRICS_FILE_HEADER pHeader
+)
+{
+    return *reinterpret_cast<std::atomic<UINT64> *>(&pHeader->sequence);
+}
+
+class MetricsPublisher
+{
+public:
+    MetricsPublisher ()
+        : m_listen(METRICS_INVALID_SOCKET),
+          m_fd(METRICS_INVALID_FD),
+#if defined(_WIN32)
+          m_hMapping(NULL),
+#endif
+          m_pHeader(NULL),
+          m_port(0),
+          m_prevCases(0),
+          m_prevNovel(0),
+          m_stop(false),
+          m_published(0)
+    {
+        memset(&m_config, 0, sizeof(m_config));
+        memset(&m_snapshot, 0, sizeof(m_snapshot));
+    }
+
+    ~MetricsPublisher ()
+    {
+        Stop();
+    }
+
+    MetricsPublisher (const MetricsPublisher &) = delete;
+    MetricsPublisher &operator= (const MetricsPublisher &) = delete;
+
+    //
+    // Map the stats file and listen as configured, publish a first snapshot
+    // and start the thread. FALSE if either the file or the endpoint failed
+    //
+    BOOL
+    Start (
+        IN const METRICS_CONFIG &config,
+        IN METRICS_COLLECT      collect
+    )
+    {
+        Stop();
+
+        m_config = config;
+        if (m_config.periodMs == 0)
+        {
+            m_config.periodMs = METRICS_PERIOD_MS;
+        }
+        m_collect = collect;
+        m_start = std::chrono::steady_clock::now();
+        m_last = m_start;
+        m_prevCases = 0;
+        m_prevNovel = 0;
+        m_published = 0;
+        m_stop = false;
+
+        if ((config.pFile != NULL && !MapFile(config.pFile)) ||
+            (config.pBindAddr != NULL && !Listen(config.pBindAddr, config.port)))
+        {
+            Close();
+            return FALSE;
+        }
+
+        Publish();
+        m_thread = std::thread([this]() { Serve(); });
+        return TRUE;
+    }
+
+    //
+    // Publish a last snapshot, so the file ends with the final totals, and
+    // close everything
+    //
+    VOID
+    Stop ()
+    {
+        if (!m_thread.joinable())
+        {
+            return;
+        }
+        m_stop = true;
+        m_thread.join();
+        Publish();
+        Close();
+    }
+
+    UINT16 Port () const { return m_port; }
+    UINT64 Published () const { return m_published.load(std::memory_order_relaxed); }
+
+private:
+    VOID
+    Publish ()
+    {
+        auto now = std::chrono::steady_clock::now();
+        double secs = std::chrono::duration<double>(now - m_last).count();
+        UINT64 published = m_published.load(std::memory_order_relaxed);
+
+        memset(&m_snapshot, 0, sizeof(m_snapshot));
+        m_collect(&m_snapshot);
+        m_snapshot.uptimeNs = (UINT64)std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_start).count();
+        m_snapshot.published = published;
+        if (secs > 0)
+        {
+            m_snapshot.casesPerSec = (m_snapshot.counters[WORKER_COUNTER_CASES] - m_prevCases) / secs;
+            m_snapshot.novelPerSec = (m_snapshot.novel - m_prevNovel) / secs;
+        }
+        m_prevCases = m_snapshot.counters[WORKER_COUNTER_CASES];
+        m_prevNovel = m_snapshot.novel;
+        m_last = now;
+
+        if (m_pHeader != NULL)
+        {
+            std::atomic<UINT64> &sequence = MetricsSequence(m_pHeader);
+            UINT64 seq = sequence.load(std::memory_order_relaxed);
+
+            sequence.store(seq + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            memcpy(m_pHeader + 1, &m_snapshot, sizeof(m_snapshot));
+            sequence.store(seq + 2, std::memory_order_release);
+        }
+
+        if (m_listen != METRICS_INVALID_SOCKET)
+        {
+            MetricsFormatPrometheus(m_snapshot, &m_text);
+        }
+        m_published.store(published + 1, std::memory_order_relaxed);
+    }
+
+    //
+    // The background thread. Waits for a scraper at most until the next
+    // snapshot is due, and never more than METRICS_POLL_MS so Stop() is
+    // quick
+    //
+    VOID
+    Serve ()
+    {
+        auto next = m_last + std::chrono::milliseconds(m_config.periodMs);
+
+        while (!m_stop)
+        {
+            auto now = std::chrono::steady_clock::now();
+            INT64 waitMs = 0;
+
+            if (now >= next)
+            {
+                Publish();
+                next += std::chrono::milliseconds(m_config.periodMs);
+                if (next < now)
+                {
+                    next = now + std::chrono::milliseconds(m_config.periodMs);
+                }
+                continue;
+            }
+
+            waitMs = (INT64)std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count() + 1;
+            if (waitMs > METRICS_POLL_MS)
+            {
+                waitMs = METRICS_POLL_MS;
+            }
+
+            if (m_listen == METRICS_INVALID_SOCKET)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(waitMs));
+            }
+            else if (WaitReadable(m_listen, (UINT32)waitMs))
+            {
+                METRICS_SOCKET client = accept(m_listen, NULL, NULL);
+
+                if (client != METRICS_INVALID_SOCKET)
+                {
+                    Respond(client);
+                    CloseSocket(client);
+                }
+            }
+        }
+    }
+
+    //
+    // One request per connection, answered from the last snapshot
+    //
+    VOID
+    Respond (
+        IN METRICS_SOCKET   client
+    )
+    {
+        CHAR        request[METRICS_REQUEST_MAX];
+        SIZE_T      len = 0;
+        std::string response;
+        CHAR        header[160];
+        BOOL        bMetrics = FALSE;
+
+        SetTimeout(client, METRICS_HTTP_TIMEOUT_MS);
+        while (len < sizeof(request) - 1)
+        {
+            INT got = recv(client, request + len, (INT)(sizeof(request) - 1 - len), 0);
+
+            if (got <= 0)
+            {
+                break;
+            }
+            len += (SIZE_T)got;
+            request[len] = '\0';
+            if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+            {
+                break;
+            }
+        }
+        request[len] = '\0';
+
+        bMetrics = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0;
+        if (bMetrics)
+        {
+            snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+                     (UINT32)m_text.size());
+            response = header;
+            response += m_text;
+        }
+        else
+        {
+            response = "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nnot found\n";
+        }
+
+        for (SIZE_T sent = 0; sent < response.size();)
+        {
+            INT n = send(client, response.data() + sent, (INT)(response.size() - sent), 0);
+
+            if (n <= 0)
+            {
+                break;
+            }
+            sent += (SIZE_T)n;
+        }
+    }
+
+    BOOL
+    Listen (
+        IN const CHAR   *bindAddr,
+        IN UINT16       port
+    )
+    {
+        struct sockaddr_in  addr = {};
+        socklen_t           addrLen = sizeof(addr);
+        INT                 one = 1;
+
+        if (!StartSockets())
+        {
+            return FALSE;
+        }
+
+        m_listen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (m_listen == METRICS_INVALID_SOCKET)
+        {
+            return FALSE;
+        }
+
+        setsockopt(m_listen, SOL_SOCKET, SO_REUSEADDR, (const CHAR *)&one, sizeof(one));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, bindAddr, &addr.sin_addr) != 1 ||
+            bind(m_listen, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(m_listen, 16) != 0 ||
+            getsockname(m_listen, (struct sockaddr *)&addr, &addrLen) != 0)
+        {
+            return FALSE;
+        }
+        m_port = ntohs(addr.sin_port);
+        return TRUE;
+    }
+
+    //
+    // Create the stats file at its full size and map it. The header is
+    // written once, only the sequence and snapshot change after
+    //
+    BOOL
+    MapFile (
+        IN const CHAR   *path
+    )
+    {
+#if defined(_WIN32)
+        m_fd = CreateFileA(path,
+                           GENERIC_READ | GENERIC_WRITE,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE,
+                           NULL,
+                           CREATE_ALWAYS,
+                           0,
+                           NULL);
+        if (m_fd == METRICS_INVALID_FD)
+        {
+            return FALSE;
+        }
+        m_hMapping = CreateFileMapping(m_fd, NULL, PAGE_READWRITE, 0, (DWORD)METRICS_FILE_SIZE, NULL);
+        m_pHeader = m_hMapping != NULL ? (PMETRICS_FILE_HEADER)MapViewOfFile(m_hMapping, FILE_MAP_WRITE, 0, 0, 0) : NULL;
+#else
+        VOID *pView = NULL;
+
+        m_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (m_fd == METRICS_INVALID_FD || ftruncate(m_fd, (off_t)METRICS_FILE_SIZE) != 0)
+        {
+            return FALSE;
+        }
+        pView = mmap(NULL, METRICS_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        m_pHeader = pView != MAP_FAILED ? (PMETRICS_FILE_HEADER)pView : NULL;
+#endif
+        if (m_pHeader == NULL)
+        {
+            return FALSE;
+        }
+
+        memset(m_pHeader, 0, METRICS_FILE_SIZE);
+        m_pHeader->magic = METRICS_MAGIC;
+        m_pHeader->version = METRICS_VERSION;
+        m_pHeader->size = (UINT32)METRICS_FILE_SIZE;
+        return TRUE;
+    }
+
+    VOID
+    Close ()
+    {
+        if (m_listen != METRICS_INVALID_SOCKET)
+        {
+            CloseSocket(m_listen);
+            m_listen = METRICS_INVALID_SOCKET;
+        }
+
+#if defined(_WIN32)
+        if (m_pHeader != NULL)
+        {
+            UnmapViewOfFile(m_pHeader);
+        }
+        if (m_hMapping != NULL)
+        {
+            CloseHandle(m_hMapping);
+        }
+        if (m_fd != METRICS_INVALID_FD)
+        {
+            CloseHandle(m_fd);
+        }
+        m_hMapping = NULL;
+#else
+        if (m_pHeader != NULL)
+        {
+            munmap(m_pHeader, METRICS_FILE_SIZE);
+        }
+        if (m_fd != METRICS_INVALID_FD)
+        {
+            close(m_fd);
+        }
+#endif
+        m_pHeader = NULL;
+        m_fd = METRICS_INVALID_FD;
+    }
+
+    static BOOL
+    StartSockets ()
+    {
+#if defined(_WIN32)
+        static const BOOL s_started = []() {
+            WSADATA wsaData;
+            return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+        }();
+        return s_started;
+#else
+        return TRUE;
+#endif
+    }
+
+    static VOID
+    CloseSocket (
+        IN METRICS_SOCKET   s
+    )
+    {
+#if defined(_WIN32)
+        closesocket(s);
+#else
+        close(s);
+#endif
+    }
+
+    static BOOL
+    WaitReadable (
+        IN METRICS_SOCKET   s,
+        IN UINT32           timeoutMs
+    )
+    {
+        fd_set          readable;
+        struct timeval  timeout;
+
+        FD_ZERO(&readable);
+        FD_SET(s, &readable);
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_usec = (timeoutMs % 1000) * 1000;
+        return select((INT)s + 1, &readable, NULL, NULL, &timeout) > 0;
+    }
+
+    static VOID
+    SetTimeout (
+        IN METRICS_SOCKET   s,
+        IN UINT32           timeoutMs
+    )
+    {
+#if defined(_WIN32)
+        DWORD timeout = timeoutMs;
+#else
+        struct timeval timeout;
+
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_usec = (timeoutMs % 1000) * 1000;
+#endif
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const CHAR *)&timeout, sizeof(timeout));
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const CHAR *)&timeout, sizeof(timeout));
+    }
+
+    METRICS_CONFIG                          m_config;
+    METRICS_COLLECT                         m_collect;
+    METRICS_SOCKET                          m_listen;
+    METRICS_FD                              m_fd;
+#if defined(_WIN32)
+    HANDLE                                  m_hMapping;
+#endif
+    PMETRICS_FILE_HEADER                    m_pHeader;
+    UINT16                                  m_port;
+
+    //
+    // Only the thread touches these while it runs
+    //
+    METRICS_SNAPSHOT                        m_snapshot;
+    std::string                             m_text;
+    std::chrono::steady_clock::time_point   m_start;
+    std::chrono::steady_clock::time_point   m_last;
+    UINT64                                  m_prevCases;
+    UINT64                                  m_prevNovel;
+
+    std::atomic<bool>                       m_stop;
+    std::atomic<UINT64>                     m_published;
+    std::thread                             m_thread;
+};
+
+//
+// Read side of the stats file, for a TUI or anything else polling it. Maps
+// the file read-only and never writes to it, so any number of readers can
+// follow one publisher
+//
+class MetricsView
+{
+public:
+    MetricsView ()
+        : m_fd(METRICS_INVALID_FD),
+#if defined(_WIN32)
+          m_hMapping(NULL),
+#endif
+          m_pHeader(NULL)
+    {
+    }
+
+    ~MetricsView ()
+    {
+        Close();
+    }
+
+    MetricsView (const MetricsView &) = delete;
+    MetricsView &operator= (const MetricsView &) = delete;
+
+    BOOL
+    Open (
+        IN const CHAR   *path
+    )
+    {
+        Close();
+
+#if defined(_WIN32)
+        m_fd = CreateFileA(path,
+                           GENERIC_READ,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE,
+                           NULL,
+                           OPEN_EXISTING,
+                           0,
+                           NULL);
+        if (m_fd == METRICS_INVALID_FD)
+        {
+            return FALSE;
+        }
+        m_hMapping = CreateFileMapping(m_fd, NULL, PAGE_READONLY, 0, (DWORD)METRICS_FILE_SIZE, NULL);
+        m_pHeader = m_hMapping != NULL ? (PMETRICS_FILE_HEADER)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+        struct stat st;
+        VOID        *pView = NULL;
+
+        m_fd = open(path, O_RDONLY);
+        if (m_fd == METRICS_INVALID_FD ||
+            fstat(m_fd, &st) != 0 ||
+            (UINT64)st.st_size < METRICS_FILE_SIZE)
+        {
+            Close();
+            return FALSE;
+        }
+        pView = mmap(NULL, METRICS_FILE_SIZE, PROT_READ, MAP_SHARED, m_fd, 0);
+        m_pHeader = pView != MAP_FAILED ? (PMETRICS_FILE_HEADER)pView : NULL;
+#endif
+        if (m_pHeader == NULL ||
+            m_pHeader->magic != METRICS_MAGIC ||
+            m_pHeader->version != METRICS_VERSION ||
+            m_pHeader->size != METRICS_FILE_SIZE)
+        {
+            Close();
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    VOID
+    Close ()
+    {
+#if defined(_WIN32)
+        if (m_pHeader != NULL)
+        {
+            UnmapViewOfFile(m_pHeader);
+        }
+        if (m_hMapping != NULL)
+        {
+            CloseHandle(m_hMapping);
+        }
+        if (m_fd != METRICS_INVALID_FD)
+        {
+            CloseHandle(m_fd);
+        }
+        m_hMapping = NULL;
+#else
+        if (m_pHeader != NULL)
+        {
+            munmap(m_pHeader, METRICS_FILE_SIZE);
+        }
+        if (m_fd != METRICS_INVALID_FD)
+        {
+            close(m_fd);
+        }
+#endif
+        m_pHeader = NULL;
+        m_fd = METRICS_INVALID_FD;
+    }
+
+    //
+    // Copy the latest whole snapshot. FALSE if none has been published yet
+    // or the publisher kept rewriting it for METRICS_READ_RETRIES tries.
+    // pSequence, if given, changes whenever a new snapshot is published
+    //
+    BOOL
+    Read (
+        OUT PMETRICS_SNAPSHOT   pSnapshot,
+        OUT UINT64              *pSequence = NULL
+    ) const
+    {
+        if (m_pHeader == NULL)
+        {
+            return FALSE;
+        }
+
+        std::atomic<UINT64> &sequence = MetricsSequence(m_pHeader);
+
+        for (UINT32 retry = 0; retry < METRICS_READ_RETRIES; retry++)
+        {
+            UINT64 before = sequence.load(std::memory_order_acquire);
+
+            if (before == 0)
+            {
+                return FALSE;
+            }
+            if ((before & 1) == 0)
+            {
+                memcpy(pSnapshot, m_pHeader + 1, sizeof(*pSnapshot));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (sequence.load(std::memory_order_relaxed) == before)
+                {
+                    if (pSequence != NULL)
+                    {
+                        *pSequence = before;
+                    }
+                    return TRUE;
+                }
+            }
+            std::this_thread::yield();
+        }
+        return FALSE;
+    }
+
+private:
+    METRICS_FD              m_fd;
+#if defined(_WIN32)
+    HANDLE                  m_hMapping;
+#endif
+    PMETRICS_FILE_HEADER    m_pHeader;
+};
@@ -0,0 +1,502 @@
+/*++
+
+Module Name:
+
+    NoveltyTracker.h
+
+Abstract:
+
+    Set of hypercall result signatures seen during a campaign, the basis for
+    deciding which cases are worth keeping.
+
+    A signature hashes the parts of a case selected by a NOVELTY_KEY mask:
+    the input control word (rcx), the HV status, repComplete and a hash of
+    the output registers. Each distinct signature gets a NOVELTY_ENTRY with
+    the first case that produced it, when it was first seen and how many
+    times it has been seen since.
+
+    The set is open addressing over groups of 16 slots with a one byte tag
+    per slot (7 bits of the hash, 0x80 empty). A lookup compares the 16 tags
+    of a group at once with SSE2 and only touches the keys whose tag
+    matches. There are no deletions, so an empty slot in a group ends the
+    probe. Entries are kept in insertion order, which is also the snapshot
+    order.
+
+    Not thread safe.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "../ViridianFuzzer/ViridianFuzzerTypes.h"
+#include "FuzzJournal.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+#define NOVELTY_SSE2    1
+#include <emmintrin.h>
+#else
+#define NOVELTY_SSE2    0
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define NOVELTY_KEY_INPUT           0x01    // Input control word (rcx)
+#define NOVELTY_KEY_STATUS          0x02    // HV status
+#define NOVELTY_KEY_REP_COMPLETE    0x04
+#define NOVELTY_KEY_OUTPUT          0x08    // Hash of the output GPRs
+#define NOVELTY_KEY_ALL             0x0f
+
+#define NOVELTY_SNAPSHOT_MAGIC      0x544E4656      // 'VFNT'
+#define NOVELTY_SNAPSHOT_VERSION    1
+
+#define NOVELTY_GROUP_SLOTS         16
+#define NOVELTY_CTRL_EMPTY          0x80
+
+typedef struct _NOVELTY_ENTRY
+{
+    UINT64  signature;
+    UINT64  callcode;                   // Input control word of the first case
+    UINT16  hvStatus;
+    UINT16  repComplete;
+    UINT32  rsvd;
+    UINT64  firstSeen;                  // Caller's clock, e.g. time() or case number
+    UINT64  hits;
+} NOVELTY_ENTRY, *PNOVELTY_ENTRY;
+
+//
+// Snapshot file: header, then `count` NOVELTY_ENTRY in first seen order
+//
+typedef struct _NOVELTY_SNAPSHOT_HEADER
+{
+    UINT32  magic;
+    UINT16  version;
+    UINT16  keyMask;
+    UINT64  count;
+    UINT64  observations;
+    UINT32  entriesCrc;                 // CRC32C of the entries
+    UINT32  headerCrc;                  // CRC32C of the header up to here
+} NOVELTY_SNAPSHOT_HEADER, *PNOVELTY_SNAPSHOT_HEADER;
+
+C_ASSERT(sizeof(NOVELTY_ENTRY) == 40);
+C_ASSERT(sizeof(NOVELTY_SNAPSHOT_HEADER) == 32);
+
+inline UINT64
+NoveltyMix (
+    IN UINT64   h,
+    IN UINT64   v
+)
+{
+    h ^= v;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+}
+
+inline UINT64
+NoveltyOutputHash (
+    IN const CPU_REG_64 &regsOut
+)
+{
+    const UINT64 *pRegs = &regsOut.rax;
+    UINT64 h = 0;
+
+    for (UINT32 r = 0; r < 10; r++)
+    {
+        h = NoveltyMix(h, pRegs[r]);
+    }
+    return h;
+}
+
+//
+// Signature of a case's result. Never 0
+//
+inline UINT64
+NoveltySignature (
+    IN UINT32                           keyMask,
+    IN const CPU_REG_64                 &inRegs,
+    IN const HYPERCALL_BATCH_RESULT     &result
+)
+{
+    UINT64 h = keyMask;
+
+    if (keyMask & NOVELTY_KEY_INPUT)
+    {
+        h = NoveltyMix(h, inRegs.rcx);
+    }
+    if (keyMask & (NOVELTY_KEY_STATUS | NOVELTY_KEY_REP_COMPLETE))
+    {
+        h = NoveltyMix(h, ((keyMask & NOVELTY_KEY_STATUS) ? (UINT64)result.hvStatus : 0) |
+                          ((keyMask & NOVELTY_KEY_REP_COMPLETE) ? (UINT64)result.repComplete << 16 : 0));
+    }
+    if (keyMask & NOVELTY_KEY_OUTPUT)
+    {
+        h = NoveltyMix(h, NoveltyOutputHash(result.regsOut));
+    }
+
+    //
+    // Final avalanche so both the tag (low bits) and the group (high bits)
+    // depend on every field
+    //
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h != 0 ? h : 1;
+}
+
+//
+// Write a snapshot of entries, replacing pPath only once the new one is
+// complete
+//
+inline BOOL
+NoveltySaveSnapshot (
+    IN const CHAR                       *pPath,
+    IN UINT32                           keyMask,
+    IN UINT64                           observations,
+    IN const std::vector<NOVELTY_ENTRY> &entries
+)
+{
+    NOVELTY_SNAPSHOT_HEADER header;
+    std::string             tmpPath = std::string(pPath) + ".tmp";
+    FILE                    *pFile = fopen(tmpPath.c_str(), "wb");
+    BOOL                    bOk = FALSE;
+
+    if (pFile == NULL)
+    {
+        return FALSE;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = NOVELTY_SNAPSHOT_MAGIC;
+    header.version = NOVELTY_SNAPSHOT_VERSION;
+    header.keyMask = (UINT16)keyMask;
+    header.count = entries.size();
+    header.observations = observations;
+    header.entriesCrc = FuzzJournalCrc32c(entries.data(), entries.size() * sizeof(NOVELTY_ENTRY));
+    header.headerCrc = FuzzJournalCrc32c(&header, offsetof(NOVELTY_SNAPSHOT_HEADER, headerCrc));
+
+    bOk = fwrite(&header, sizeof(header), 1, pFile) == 1 &&
+          (entries.empty() ||
+           fwrite(entries.data(), sizeof(NOVELTY_ENTRY), entries.size(), pFile) == entries.size());
+    bOk = fclose(pFile) == 0 && bOk;
+
+#if defined(_WIN32)
+    bOk = bOk && MoveFileExA(tmpPath.c_str(), pPath, MOVEFILE_REPLACE_EXISTING);
+#else
+    bOk = bOk && rename(tmpPath.c_str(), pPath) == 0;
+#endif
+    if (!bOk)
+    {
+        remove(tmpPath.c_str());
+    }
+    return bOk;
+}
+
+class NoveltyTracker
+{
+public:
+    explicit NoveltyTracker (
+        IN UINT32   keyMask = NOVELTY_KEY_INPUT | NOVELTY_KEY_STATUS | NOVELTY_KEY_REP_COMPLETE
+    )
+        : m_keyMask(keyMask),
+          m_groupMask(0),
+          m_observations(0)
+    {
+        Reset(0);
+    }
+
+    //
+    // Forget everything, sized for about `expected` signatures
+    //
+    VOID
+    Reset (
+        IN SIZE_T   expected
+    )
+    {
+        SIZE_T groups = 1;
+
+        while (groups * NOVELTY_GROUP_SLOTS * 7 / 8 < expected)
+        {
+            groups <<= 1;
+        }
+
+        m_entries.clear();
+        m_entries.reserve(expected);
+        m_observations = 0;
+        Rehash(groups);
+    }
+
+    UINT32 KeyMask () const { return m_keyMask; }
+
+    //
+    // Distinct signatures, and cases observed in total
+    //
+    SIZE_T Count () const { return m_entries.size(); }
+    UINT64 Observations () const { return m_observations; }
+
+    const NOVELTY_ENTRY &Entry (IN SIZE_T i) const { return m_entries[i]; }
+
+    //
+    // Count a case's result. TRUE if its signature is new
+    //
+    BOOL
+    Observe (
+        IN const CPU_REG_64                 &inRegs,
+        IN const HYPERCALL_BATCH_RESULT     &result,
+        IN UINT64                           now
+    )
+    {
+        NOVELTY_ENTRY entry;
+
+        entry.signature = NoveltySignature(m_keyMask, inRegs, result);
+        entry.callcode = inRegs.rcx;
+        entry.hvStatus = result.hvStatus;
+        entry.repComplete = result.repComplete;
+        entry.rsvd = 0;
+        entry.firstSeen = now;
+        entry.hits = 1;
+        return Insert(entry);
+    }
+
+    //
+    // Add a signature, or count a hit on it. TRUE if it was new
+    //
+    BOOL
+    Insert (
+        IN const NOVELTY_ENTRY  &entry
+    )
+    {
+        SIZE_T slot = 0;
+
+        m_observations++;
+        if (Find(entry.signature, &slot))
+        {
+            m_entries[m_index[slot]].hits += entry.hits;
+            return FALSE;
+        }
+
+        if ((m_entries.size() + 1) * 8 > m_ctrl.size() * 7)
+        {
+            Rehash(((SIZE_T)m_groupMask + 1) * 2);
+            Find(entry.signature, &slot);
+        }
+
+        m_ctrl[slot] = Tag(entry.signature);
+        m_keys[slot] = entry.signature;
+        m_index[slot] = (UINT32)m_entries.size();
+        m_entries.push_back(entry);
+        return TRUE;
+    }
+
+    //
+    // NULL if the signature hasn't been seen
+    //
+    const NOVELTY_ENTRY *
+    Lookup (
+        IN UINT64   signature
+    ) const
+    {
+        SIZE_T slot = 0;
+
+        return Find(signature, &slot) ? &m_entries[m_index[slot]] : NULL;
+    }
+
+    //
+    // Write a snapshot, replacing pPath only once the new one is complete
+    //
+    BOOL
+    Save (
+        IN const CHAR   *pPath
+    ) const
+    {
+        return NoveltySaveSnapshot(pPath, m_keyMask, m_observations, m_entries);
+    }
+
+    //
+    // What Save writes, copied out so a caller can write it with
+    // NoveltySaveSnapshot without holding the lock around the set
+    //
+    VOID
+    CopySnapshot (
+        OUT std::vector<NOVELTY_ENTRY>  &entries,
+        OUT PUINT64                     pObservations
+    ) const
+    {
+        entries.assign(m_entries.begin(), m_entries.end());
+        *pObservations = m_observations;
+    }
+
+    //
+    // Replace the set with a snapshot. Fails, leaving the set untouched, if
+    // the snapshot is damaged or was keyed differently
+    //
+    BOOL
+    Load (
+        IN const CHAR   *pPath
+    )
+    {
+        NOVELTY_SNAPSHOT_HEADER     header;
+        std::vector<NOVELTY_ENTRY>  entries;
+        FILE                        *pFile = fopen(pPath, "rb");
+        BOOL                        bOk = FALSE;
+
+        if (pFile == NULL)
+        {
+            return FALSE;
+        }
+
+        if (fread(&header, sizeof(header), 1, pFile) == 1 &&
+            header.magic == NOVELTY_SNAPSHOT_MAGIC &&
+            header.version == NOVELTY_SNAPSHOT_VERSION &&
+            header.headerCrc == FuzzJournalCrc32c(&header, offsetof(NOVELTY_SNAPSHOT_HEADER, headerCrc)) &&
+            header.keyMask == m_keyMask &&
+            header.count < 0xffffffffULL)
+        {
+            entries.resize((SIZE_T)header.count);
+            bOk = (entries.empty() ||
+                   fread(entries.data(), sizeof(NOVELTY_ENTRY), entries.size(), pFile) == entries.size()) &&
+                  header.entriesCrc == FuzzJournalCrc32c(entries.data(), entries.size() * sizeof(NOVELTY_ENTRY));
+        }
+        fclose(pFile);
+
+        if (!bOk)
+        {
+            return FALSE;
+        }
+
+        Reset(entries.size());
+        for (const NOVELTY_ENTRY &entry : entries)
+        {
+            Insert(entry);
+        }
+        m_observations = header.observations;
+        return TRUE;
+    }
+
+private:
+    static UINT8 Tag (IN UINT64 signature) { return (UINT8)(signature & 0x7f); }
+
+    static UINT32
+    LowestBit (
+        IN UINT32   mask
+    )
+    {
+#if defined(_MSC_VER)
+        unsigned long bit;
+        _BitScanForward(&bit, mask);
+        return bit;
+#else
+        return (UINT32)__builtin_ctz(mask);
+#endif
+    }
+
+    //
+    // Tag matches and empty slots of one group, bit n for slot n
+    //
+    VOID
+    MatchGroup (
+        IN  SIZE_T  group,
+        IN  UINT8   tag,
+        OUT UINT32  *pMatch,
+        OUT UINT32  *pEmpty
+    ) const
+    {
+        const UINT8 *pCtrl = &m_ctrl[group * NOVELTY_GROUP_SLOTS];
+
+#if NOVELTY_SSE2
+        __m128i ctrl = _mm_loadu_si128((const __m128i *)pCtrl);
+
+        *pMatch = (UINT32)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((CHAR)tag)));
+        *pEmpty = (UINT32)_mm_movemask_epi8(ctrl);
+#else
+        *pMatch = 0;
+        *pEmpty = 0;
+        for (UINT32 i = 0; i < NOVELTY_GROUP_SLOTS; i++)
+        {
+            *pMatch |= (UINT32)(pCtrl[i] == tag) << i;
+            *pEmpty |= (UINT32)(pCtrl[i] == NOVELTY_CTRL_EMPTY) << i;
+        }
+#endif
+    }
+
+    //
+    // TRUE and its slot if the signature is in the set, else FALSE and the
+    // slot it would go in
+    //
+    BOOL
+    Find (
+        IN  UINT64  signature,
+        OUT SIZE_T  *pSlot
+    ) const
+    {
+        UINT8   tag = Tag(signature);
+        SIZE_T  group = (SIZE_T)(signature >> 7) & m_groupMask;
+
+        for (SIZE_T step = 1;; step++)
+        {
+            UINT32 match = 0;
+            UINT32 empty = 0;
+
+            MatchGroup(group, tag, &match, &empty);
+            while (match != 0)
+            {
+                SIZE_T slot = group * NOVELTY_GROUP_SLOTS + LowestBit(match);
+
+                if (m_keys[slot] == signature)
+                {
+                    *pSlot = slot;
+                    return TRUE;
+                }
+                match &= match - 1;
+            }
+
+            if (empty != 0)
+            {
+                *pSlot = group * NOVELTY_GROUP_SLOTS + LowestBit(empty);
+                return FALSE;
+            }
+
+            //
+            // Triangular steps visit every group of a power of 2 table
+            //
+            group = (group + step) & m_groupMask;
+        }
+    }
+
+    VOID
+    Rehash (
+        IN SIZE_T   groups
+    )
+    {
+        m_groupMask = groups - 1;
+        m_ctrl.assign(groups * NOVELTY_GROUP_SLOTS, NOVELTY_CTRL_EMPTY);
+        m_keys.assign(groups * NOVELTY_GROUP_SLOTS, 0);
+        m_index.assign(groups * NOVELTY_GROUP_SLOTS, 0);
+
+        for (SIZE_T i = 0; i < m_entries.size(); i++)
+        {
+            SIZE_T slot = 0;
+
+            Find(m_entries[i].signature, &slot);
+            m_ctrl[slot] = Tag(m_entries[i].signature);
+            m_keys[slot] = m_entries[i].signature;
+            m_index[slot] = (UINT32)i;
+        }
+    }
+
+    UINT32                      m_keyMask;
+    SIZE_T                      m_groupMask;
+    UINT64                      m_observations;
+    std::vector<UINT8>          m_ctrl;
+    std::vector<UINT64>         m_keys;
+    std::vector<UINT32>         m_index;
+    std::vector<NOVELTY_ENTRY>  m_entries;
+};
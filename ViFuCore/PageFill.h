@@ -0,0 +1,571 @@
+/*++
+
+Module Name:
+
+    PageFill.h
+
+Abstract:
+
+    GPA page pattern kernels with scalar, SSE2 and AVX2 implementations.
+
+    Patterns work on UINT64 slots over [offset, offset + length) of a page,
+    both in bytes and multiples of 8 (the low 3 bits are ignored). Slot i
+    below is relative to offset:
+
+    PAGE_FILL_CONSTANT      value
+    PAGE_FILL_SELF_PTR      value + offset + i * 8, value being the page's
+                            GPA - every slot holds its own GPA
+    PAGE_FILL_WALKING_BIT   1 << ((value + i * step) % 64)
+    PAGE_FILL_INCREMENT     value + i * step
+    PAGE_FILL_PRNG          4 interleaved xorshift64 streams seeded from value
+                            with splitmix64, slot i from stream i % 4
+
+    Every ISA writes exactly the same bytes for the same parameters, so a
+    case can be reproduced on any machine.
+
+    AVX2 is only used if the CPU and OS support it. In the driver YMM state
+    must be saved around it (KeSaveExtendedProcessorState), SSE2 needs no
+    saving on x64.
+
+    Plain C so it can be used by the driver.
+
+Environment:
+
+    Kernel mode, User mode, Portable
+
+--*/
+
+#pragma once
+
+#include "../ViridianFuzzer/ViridianFuzzerTypes.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PAGE_FILL_X86   1
+#include <immintrin.h>
+#else
+#define PAGE_FILL_X86   0
+#endif
+
+#if defined(_MSC_VER)
+#define PAGE_FILL_INLINE        static __forceinline
+#define PAGE_FILL_TARGET_AVX2   static
+#else
+#define PAGE_FILL_INLINE        static inline
+#define PAGE_FILL_TARGET_AVX2   static __attribute__((target("avx2")))
+#endif
+
+typedef enum _PAGE_FILL_PATTERN
+{
+    PAGE_FILL_CONSTANT = 0,
+    PAGE_FILL_SELF_PTR,
+    PAGE_FILL_WALKING_BIT,
+    PAGE_FILL_INCREMENT,
+    PAGE_FILL_PRNG,
+    PAGE_FILL_PATTERN_MAX
+} PAGE_FILL_PATTERN;
+
+typedef enum _PAGE_FILL_ISA
+{
+    PAGE_FILL_ISA_SCALAR = 0,
+    PAGE_FILL_ISA_SSE2,
+    PAGE_FILL_ISA_AVX2,
+    PAGE_FILL_ISA_MAX
+} PAGE_FILL_ISA;
+
+typedef struct _PAGE_FILL_PARAMS
+{
+    UINT32  pattern;    // PAGE_FILL_PATTERN
+    UINT32  offset;     // Bytes from the start of the page
+    UINT32  length;     // Bytes to fill
+    UINT32  rsvd;
+    UINT64  value;      // Constant, page GPA, start bit, start value or seed
+    UINT64  step;       // WALKING_BIT and INCREMENT only
+} PAGE_FILL_PARAMS, *PPAGE_FILL_PARAMS;
+
+#define PAGE_FILL_PAGE_SIZE     0x1000
+#define PAGE_FILL_PRNG_LANES    4
+
+//
+// Whole page helper
+//
+#define PAGE_FILL_INIT(pParams, pat, val, stp)  \
+    do                                          \
+    {                                           \
+        (pParams)->pattern = (pat);             \
+        (pParams)->offset = 0;                  \
+        (pParams)->length = PAGE_FILL_PAGE_SIZE;\
+        (pParams)->rsvd = 0;                    \
+        (pParams)->value = (val);               \
+        (pParams)->step = (stp);                \
+    } while (0)
+
+PAGE_FILL_INLINE UINT64
+PageFillSplitMix (
+    IN UINT64   z
+)
+{
+    z += 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+PAGE_FILL_INLINE UINT64
+PageFillXorshift (
+    IN UINT64   x
+)
+{
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+PAGE_FILL_INLINE VOID
+PageFillPrngSeed (
+    IN  UINT64  seed,
+    OUT UINT64  state[PAGE_FILL_PRNG_LANES]
+)
+{
+    for (UINT32 l = 0; l < PAGE_FILL_PRNG_LANES; l++)
+    {
+        //
+        // xorshift64 must never be seeded with 0
+        //
+        state[l] = PageFillSplitMix(seed + l) | 1;
+    }
+}
+
+//
+// Scalar tails, also the reference implementation. Slots are counted from
+// `first` so a vector kernel can hand over whatever is left
+//
+PAGE_FILL_INLINE VOID
+PageFillScalarRange (
+    OUT    PUINT64                  pSlots,
+    IN     SIZE_T                   first,
+    IN     SIZE_T                   slotCnt,
+    IN     const PAGE_FILL_PARAMS   *pParams,
+    IN OUT UINT64                   prng[PAGE_FILL_PRNG_LANES]
+)
+{
+    UINT64  v0 = pParams->value;
+    UINT64  step = pParams->step;
+    SIZE_T  i = first;
+
+    switch (pParams->pattern)
+    {
+        case PAGE_FILL_CONSTANT:
+            for (; i < slotCnt; i++)
+            {
+                pSlots[i] = v0;
+            }
+            break;
+
+        case PAGE_FILL_SELF_PTR:
+            v0 += pParams->offset & ~7U;
+            step = 8;
+            // fall through
+        case PAGE_FILL_INCREMENT:
+            for (; i < slotCnt; i++)
+            {
+                pSlots[i] = v0 + i * step;
+            }
+            break;
+
+        case PAGE_FILL_WALKING_BIT:
+            for (; i < slotCnt; i++)
+            {
+                pSlots[i] = 1ULL << ((v0 + i * step) & 63);
+            }
+            break;
+
+        case PAGE_FILL_PRNG:
+            for (; i < slotCnt; i++)
+            {
+                prng[i % PAGE_FILL_PRNG_LANES] = PageFillXorshift(prng[i % PAGE_FILL_PRNG_LANES]);
+                pSlots[i] = prng[i % PAGE_FILL_PRNG_LANES];
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+PAGE_FILL_INLINE VOID
+PageFillScalar (
+    IN OUT PVOID                    pPage,
+    IN     const PAGE_FILL_PARAMS   *pParams
+)
+{
+    UINT64 prng[PAGE_FILL_PRNG_LANES];
+
+    PageFillPrngSeed(pParams->value, prng);
+    PageFillScalarRange((PUINT64)((PUINT8)pPage + (pParams->offset & ~7U)),
+                        0,
+                        pParams->length / 8,
+                        pParams,
+                        prng);
+}
+
+#if PAGE_FILL_X86
+
+//
+// Rotate both lanes left by the same count, a count of 0 or 64 is a no-op
+// (SSE shifts of 64 or more give 0)
+//
+PAGE_FILL_INLINE __m128i
+PageFillRotl128 (
+    IN __m128i  v,
+    IN UINT32   r
+)
+{
+    return _mm_or_si128(_mm_sll_epi64(v, _mm_cvtsi32_si128(r)),
+                        _mm_srl_epi64(v, _mm_cvtsi32_si128(64 - r)));
+}
+
+PAGE_FILL_INLINE __m128i
+PageFillXorshift128 (
+    IN __m128i  x
+)
+{
+    x = _mm_xor_si128(x, _mm_slli_epi64(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi64(x, 7));
+    return _mm_xor_si128(x, _mm_slli_epi64(x, 17));
+}
+
+PAGE_FILL_INLINE __m128i
+PageFillSet128 (
+    IN UINT64   lo,
+    IN UINT64   hi
+)
+{
+    return _mm_set_epi32((INT)(hi >> 32), (INT)hi, (INT)(lo >> 32), (INT)lo);
+}
+
+//
+// 4 slots (2 XMM) per iteration
+//
+PAGE_FILL_INLINE VOID
+PageFillSse2 (
+    IN OUT PVOID                    pPage,
+    IN     const PAGE_FILL_PARAMS   *pParams
+)
+{
+    PUINT64 pSlots = (PUINT64)((PUINT8)pPage + (pParams->offset & ~7U));
+    SIZE_T  slotCnt = pParams->length / 8;
+    SIZE_T  vecCnt = slotCnt & ~(SIZE_T)3;
+    UINT64  prng[PAGE_FILL_PRNG_LANES];
+    UINT64  v0 = 0;
+    UINT64  step = 0;
+    __m128i lo;
+    __m128i hi;
+    __m128i inc;
+    SIZE_T  i = 0;
+
+    PageFillPrngSeed(pParams->value, prng);
+
+    switch (pParams->pattern)
+    {
+        case PAGE_FILL_CONSTANT:
+            lo = PageFillSet128(pParams->value, pParams->value);
+            for (i = 0; i < vecCnt; i += 4)
+            {
+                _mm_storeu_si128((__m128i *)&pSlots[i], lo);
+                _mm_storeu_si128((__m128i *)&pSlots[i + 2], lo);
+            }
+            break;
+
+        case PAGE_FILL_SELF_PTR:
+        case PAGE_FILL_INCREMENT:
+            if (pParams->pattern == PAGE_FILL_SELF_PTR)
+            {
+                v0 = pParams->value + (pParams->offset & ~7U);
+                step = 8;
+            }
+            else
+            {
+                v0 = pParams->value;
+                step = pParams->step;
+            }
+            lo = PageFillSet128(v0, v0 + step);
+            hi = PageFillSet128(v0 + 2 * step, v0 + 3 * step);
+            inc = PageFillSet128(4 * step, 4 * step);
+            for (i = 0; i < vecCnt; i += 4)
+            {
+                _mm_storeu_si128((__m128i *)&pSlots[i], lo);
+                _mm_storeu_si128((__m128i *)&pSlots[i + 2], hi);
+                lo = _mm_add_epi64(lo, inc);
+                hi = _mm_add_epi64(hi, inc);
+            }
+            break;
+
+        case PAGE_FILL_WALKING_BIT:
+        {
+            UINT32 r = (UINT32)((4 * pParams->step) & 63);
+
+            lo = PageFillSet128(1ULL << (pParams->value & 63),
+                                1ULL << ((pParams->value + pParams->step) & 63));
+            hi = PageFillSet128(1ULL << ((pParams->value + 2 * pParams->step) & 63),
+                                1ULL << ((pParams->value + 3 * pParams->step) & 63));
+            for (i = 0; i < vecCnt; i += 4)
+            {
+                _mm_storeu_si128((__m128i *)&pSlots[i], lo);
+                _mm_storeu_si128((__m128i *)&pSlots[i + 2], hi);
+                lo = PageFillRotl128(lo, r);
+                hi = PageFillRotl128(hi, r);
+            }
+            break;
+        }
+
+        case PAGE_FILL_PRNG:
+            lo = _mm_loadu_si128((const __m128i *)&prng[0]);
+            hi = _mm_loadu_si128((const __m128i *)&prng[2]);
+            for (i = 0; i < vecCnt; i += 4)
+            {
+                lo = PageFillXorshift128(lo);
+                hi = PageFillXorshift128(hi);
+                _mm_storeu_si128((__m128i *)&pSlots[i], lo);
+                _mm_storeu_si128((__m128i *)&pSlots[i + 2], hi);
+            }
+            _mm_storeu_si128((__m128i *)&prng[0], lo);
+            _mm_storeu_si128((__m128i *)&prng[2], hi);
+            break;
+
+        default:
+            return;
+    }
+
+    PageFillScalarRange(pSlots, vecCnt, slotCnt, pParams, prng);
+}
+
+//
+// Rotate each lane left by the same count, VPSRLQ by 64 gives 0 so a count of
+// 0 is a no-op
+//
+PAGE_FILL_TARGET_AVX2 __m256i
+PageFillRotl256 (
+    IN __m256i  v,
+    IN UINT32   r
+)
+{
+    return _mm256_or_si256(_mm256_sll_epi64(v, _mm_cvtsi32_si128(r)),
+                           _mm256_srl_epi64(v, _mm_cvtsi32_si128(64 - r)));
+}
+
+PAGE_FILL_TARGET_AVX2 __m256i
+PageFillXorshift256 (
+    IN __m256i  x
+)
+{
+    x = _mm256_xor_si256(x, _mm256_slli_epi64(x, 13));
+    x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 7));
+    return _mm256_xor_si256(x, _mm256_slli_epi64(x, 17));
+}
+
+//
+// 4 slots (1 YMM) per iteration, unrolled 2x
+//
+PAGE_FILL_TARGET_AVX2 VOID
+PageFillAvx2 (
+    IN OUT PVOID                    pPage,
+    IN     const PAGE_FILL_PARAMS   *pParams
+)
+{
+    PUINT64 pSlots = (PUINT64)((PUINT8)pPage + (pParams->offset & ~7U));
+    SIZE_T  slotCnt = pParams->length / 8;
+    SIZE_T  vecCnt = slotCnt & ~(SIZE_T)7;
+    UINT64  prng[PAGE_FILL_PRNG_LANES];
+    UINT64  v0 = 0;
+    UINT64  step = 0;
+    __m256i a;
+    __m256i b;
+    __m256i inc;
+    SIZE_T  i = 0;
+
+    PageFillPrngSeed(pParams->value, prng);
+
+    switch (pParams->pattern)
+    {
+        case PAGE_FILL_CONSTANT:
+            a = _mm256_set1_epi64x((INT64)pParams->value);
+            for (i = 0; i < vecCnt; i += 8)
+            {
+                _mm256_storeu_si256((__m256i *)&pSlots[i], a);
+                _mm256_storeu_si256((__m256i *)&pSlots[i + 4], a);
+            }
+            break;
+
+        case PAGE_FILL_SELF_PTR:
+        case PAGE_FILL_INCREMENT:
+            if (pParams->pattern == PAGE_FILL_SELF_PTR)
+            {
+                v0 = pParams->value + (pParams->offset & ~7U);
+                step = 8;
+            }
+            else
+            {
+                v0 = pParams->value;
+                step = pParams->step;
+            }
+            a = _mm256_set_epi64x((INT64)(v0 + 3 * step), (INT64)(v0 + 2 * step), (INT64)(v0 + step), (INT64)v0);
+            inc = _mm256_set1_epi64x((INT64)(4 * step));
+            b = _mm256_add_epi64(a, inc);
+            inc = _mm256_add_epi64(inc, inc);
+            for (i = 0; i < vecCnt; i += 8)
+            {
+                _mm256_storeu_si256((__m256i *)&pSlots[i], a);
+                _mm256_storeu_si256((__m256i *)&pSlots[i + 4], b);
+                a = _mm256_add_epi64(a, inc);
+                b = _mm256_add_epi64(b, inc);
+            }
+            break;
+
+        case PAGE_FILL_WALKING_BIT:
+        {
+            UINT32 r = (UINT32)((8 * pParams->step) & 63);
+
+            a = _mm256_sllv_epi64(_mm256_set1_epi64x(1),
+                                  _mm256_and_si256(_mm256_set_epi64x((INT64)(pParams->value + 3 * pParams->step),
+                                                                     (INT64)(pParams->value + 2 * pParams->step),
+                                                                     (INT64)(pParams->value + pParams->step),
+                                                                     (INT64)pParams->value),
+                                                   _mm256_set1_epi64x(63)));
+            b = PageFillRotl256(a, (UINT32)((4 * pParams->step) & 63));
+            for (i = 0; i < vecCnt; i += 8)
+            {
+                _mm256_storeu_si256((__m256i *)&pSlots[i], a);
+                _mm256_storeu_si256((__m256i *)&pSlots[i + 4], b);
+                a = PageFillRotl256(a, r);
+                b = PageFillRotl256(b, r);
+            }
+            break;
+        }
+
+        case PAGE_FILL_PRNG:
+            a = _mm256_loadu_si256((const __m256i *)prng);
+            for (i = 0; i < vecCnt; i += 8)
+            {
+                a = PageFillXorshift256(a);
+                _mm256_storeu_si256((__m256i *)&pSlots[i], a);
+                a = PageFillXorshift256(a);
+                _mm256_storeu_si256((__m256i *)&pSlots[i + 4], a);
+            }
+            _mm256_storeu_si256((__m256i *)prng, a);
+            break;
+
+        default:
+            return;
+    }
+
+    PageFillScalarRange(pSlots, vecCnt, slotCnt, pParams, prng);
+}
+
+//
+// CPUID without <cpuid.h>, whose __cpuid macro clashes with the MSVC intrinsic
+//
+PAGE_FILL_INLINE VOID
+PageFillCpuid (
+    IN  UINT32  leaf,
+    IN  UINT32  subLeaf,
+    OUT UINT32  regs[4]
+)
+{
+#if defined(_MSC_VER)
+    __cpuidex((INT *)regs, (INT)leaf, (INT)subLeaf);
+#else
+    __asm__ __volatile__("cpuid"
+                         : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+                         : "a"(leaf), "c"(subLeaf));
+#endif
+}
+
+//
+// CPU and OS (XCR0 YMM state) support for AVX2
+//
+PAGE_FILL_INLINE BOOL
+PageFillHasAvx2 (
+    VOID
+)
+{
+    UINT32 regs[4] = { 0 };
+    UINT64 xcr0 = 0;
+
+    PageFillCpuid(1, 0, regs);
+    //
+    // OSXSAVE (27) and AVX (28)
+    //
+    if ((regs[2] & (3U << 27)) != (3U << 27))
+    {
+        return FALSE;
+    }
+
+#if defined(_MSC_VER)
+    xcr0 = _xgetbv(0);
+#else
+    {
+        UINT32 eax = 0;
+        UINT32 edx = 0;
+        __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        xcr0 = ((UINT64)edx << 32) | eax;
+    }
+#endif
+    if ((xcr0 & 6) != 6)
+    {
+        return FALSE;
+    }
+
+    PageFillCpuid(7, 0, regs);
+    return (regs[1] & (1U << 5)) != 0;
+}
+
+#endif // PAGE_FILL_X86
+
+//
+// Best ISA this machine supports
+//
+PAGE_FILL_INLINE PAGE_FILL_ISA
+PageFillBestIsa (
+    VOID
+)
+{
+#if PAGE_FILL_X86
+    return PageFillHasAvx2() ? PAGE_FILL_ISA_AVX2 : PAGE_FILL_ISA_SSE2;
+#else
+    return PAGE_FILL_ISA_SCALAR;
+#endif
+}
+
+//
+// Fill with the given ISA, which must not be better than PageFillBestIsa()
+//
+PAGE_FILL_INLINE VOID
+PageFill (
+    IN     PAGE_FILL_ISA            isa,
+    IN OUT PVOID                    pPage,
+    IN     const PAGE_FILL_PARAMS   *pParams
+)
+{
+    if (pParams->pattern >= PAGE_FILL_PATTERN_MAX ||
+        pParams->offset >= PAGE_FILL_PAGE_SIZE ||
+        pParams->length > PAGE_FILL_PAGE_SIZE - (pParams->offset & ~7U))
+    {
+        return;
+    }
+
+    switch (isa)
+    {
+#if PAGE_FILL_X86
+        case PAGE_FILL_ISA_AVX2:
+            PageFillAvx2(pPage, pParams);
+            break;
+        case PAGE_FILL_ISA_SSE2:
+            PageFillSse2(pPage, pParams);
+            break;
+#endif
+        default:
+            PageFillScalar(pPage, pParams);
+            break;
+    }
+}
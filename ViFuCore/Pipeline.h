@@ -0,0 +1,574 @@
+/*++
+
+Module Name:
+
+    Pipeline.h
+
+Abstract:
+
+    Three-stage pipeline of a fuzzing worker, so the thread issuing the
+    hypercalls does nothing else:
+
+        GENERATE    claim cases, materialize inputs, journal them  (own thread)
+        EXECUTE     issue the calls                                (caller's thread)
+        TRIAGE      novelty, counters, logging, reports            (own thread)
+
+    A fixed number (depth) of items, e.g. batches, go round between the
+    stages through bounded lock-free single-producer single-consumer queues:
+
+        FREE -> GENERATE -> READY -> EXECUTE -> DONE -> TRIAGE -> FREE
+
+    so while one batch is being executed the next depth - 2 can be generated
+    and the previous ones triaged. Each stage sees the items in the order
+    they were generated. A stage with nothing to take, or nowhere to put what
+    it has, spins a little and then yields; a full or empty queue is what
+    bounds the stages running ahead of each other, no item is dropped.
+
+    Per stage the time spent in the stage function (busy) and waiting for a
+    queue is measured, and each queue's occupancy is sampled on every push,
+    so GetStats() shows which stage bounds the throughput: the busiest, with
+    the queue in front of it full and the one behind it empty. Each counter
+    is written by one stage only and read whole, so GetStats() can also be
+    called while the pipeline runs, e.g. by a metrics thread.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <utility>
+#include "ViFuPlatform.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define PIPELINE_CACHE_LINE     64
+#define PIPELINE_SPINS          256     // Before a waiting stage starts yielding
+
+typedef enum _PIPELINE_STAGE
+{
+    PIPELINE_STAGE_GENERATE = 0,
+    PIPELINE_STAGE_EXECUTE,
+    PIPELINE_STAGE_TRIAGE,
+    PIPELINE_STAGE_COUNT
+} PIPELINE_STAGE;
+
+typedef enum _PIPELINE_QUEUE
+{
+    PIPELINE_QUEUE_READY = 0,           // Generated, to execute
+    PIPELINE_QUEUE_DONE,                // Executed, to triage
+    PIPELINE_QUEUE_FREE,                // Triaged, to generate into again
+    PIPELINE_QUEUE_COUNT
+} PIPELINE_QUEUE;
+
+typedef struct _PIPELINE_STAGE_STATS
+{
+    UINT64  items;
+    UINT64  busyNs;                     // In the stage function
+    UINT64  waitNs;                     // Waiting for an item or for room
+} PIPELINE_STAGE_STATS, *PPIPELINE_STAGE_STATS;
+
+typedef struct _PIPELINE_QUEUE_STATS
+{
+    UINT64  occupancySum;               // Items queued right after each push
+    UINT64  samples;
+    UINT64  max;
+} PIPELINE_QUEUE_STATS, *PPIPELINE_QUEUE_STATS;
+
+typedef struct _PIPELINE_STATS
+{
+    UINT64                  wallNs;
+    UINT32                  depth;
+    UINT32                  rsvd;
+    PIPELINE_STAGE_STATS    stages[PIPELINE_STAGE_COUNT];
+    PIPELINE_QUEUE_STATS    queues[PIPELINE_QUEUE_COUNT];
+} PIPELINE_STATS, *PPIPELINE_STATS;
+
+#define PIPELINE_STATS_QWORDS   (sizeof(PIPELINE_STATS) / sizeof(UINT64))
+
+inline const CHAR *
+PipelineStageName (
+    IN PIPELINE_STAGE   stage
+)
+{
+    static const CHAR *names[PIPELINE_STAGE_COUNT] = { "generate", "execute", "triage" };
+
+    return stage < PIPELINE_STAGE_COUNT ? names[stage] : "?";
+}
+
+inline const CHAR *
+PipelineQueueName (
+    IN PIPELINE_QUEUE   queue
+)
+{
+    static const CHAR *names[PIPELINE_QUEUE_COUNT] = { "ready", "done", "free" };
+
+    return queue < PIPELINE_QUEUE_COUNT ? names[queue] : "?";
+}
+
+//
+// Percent of the wall time the stage was busy
+//
+inline double
+PipelineUtilisation (
+    IN const PIPELINE_STATS &stats,
+    IN PIPELINE_STAGE       stage
+)
+{
+    return stats.wallNs != 0 ? 100.0 * stats.stages[stage].busyNs / stats.wallNs : 0.0;
+}
+
+inline double
+PipelineAverageOccupancy (
+    IN const PIPELINE_STATS &stats,
+    IN PIPELINE_QUEUE       queue
+)
+{
+    const PIPELINE_QUEUE_STATS &q = stats.queues[queue];
+
+    return q.samples != 0 ? (double)q.occupancySum / q.samples : 0.0;
+}
+
+//
+// The busiest stage, the one the others wait for
+//
+inline PIPELINE_STAGE
+PipelineBottleneck (
+    IN const PIPELINE_STATS &stats
+)
+{
+    UINT32 busiest = 0;
+
+    for (UINT32 s = 1; s < PIPELINE_STAGE_COUNT; s++)
+    {
+        if (stats.stages[s].busyNs > stats.stages[busiest].busyNs)
+        {
+            busiest = s;
+        }
+    }
+    return (PIPELINE_STAGE)busiest;
+}
+
+//
+// Add the stats of one pipeline to pTotal, e.g. of every worker. Wall times
+// add up too, so utilisation stays the average over the pipelines
+//
+inline VOID
+PipelineStatsMerge (
+    IN OUT PPIPELINE_STATS      pTotal,
+    IN     const PIPELINE_STATS &stats
+)
+{
+    pTotal->wallNs += stats.wallNs;
+    pTotal->depth = stats.depth;
+    for (UINT32 s = 0; s < PIPELINE_STAGE_COUNT; s++)
+    {
+        pTotal->stages[s].items += stats.stages[s].items;
+        pTotal->stages[s].busyNs += stats.stages[s].busyNs;
+        pTotal->stages[s].waitNs += stats.stages[s].waitNs;
+    }
+    for (UINT32 q = 0; q < PIPELINE_QUEUE_COUNT; q++)
+    {
+        pTotal->queues[q].occupancySum += stats.queues[q].occupancySum;
+        pTotal->queues[q].samples += stats.queues[q].samples;
+        if (stats.queues[q].max > pTotal->queues[q].max)
+        {
+            pTotal->queues[q].max = stats.queues[q].max;
+        }
+    }
+}
+
+inline VOID
+PipelineRelax ()
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+//
+// Bounded single-producer single-consumer queue. Head and tail are free
+// running counters in their own cache lines; the producer only writes the
+// tail and the consumer only the head
+//
+template <typename T>
+class SpscQueue
+{
+public:
+    SpscQueue (
+        IN UINT32   capacity
+    )
+    {
+        m_capacity = 1;
+        while (m_capacity < capacity)
+        {
+            m_capacity <<= 1;
+        }
+        m_slots.resize(m_capacity);
+        m_head = 0;
+        m_tail = 0;
+    }
+
+    BOOL
+    TryPush (
+        IN T    value
+    )
+    {
+        UINT64 tail = m_tail.load(std::memory_order_relaxed);
+
+        if (tail - m_head.load(std::memory_order_acquire) == m_capacity)
+        {
+            return FALSE;
+        }
+        m_slots[(SIZE_T)(tail & (m_capacity - 1))] = std::move(value);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return TRUE;
+    }
+
+    BOOL
+    TryPop (
+        OUT T   *pValue
+    )
+    {
+        UINT64 head = m_head.load(std::memory_order_relaxed);
+
+        if (head == m_tail.load(std::memory_order_acquire))
+        {
+            return FALSE;
+        }
+        *pValue = std::move(m_slots[(SIZE_T)(head & (m_capacity - 1))]);
+        m_head.store(head + 1, std::memory_order_release);
+        return TRUE;
+    }
+
+    //
+    // A snapshot, the other side may be pushing or popping meanwhile
+    //
+    UINT32
+    Size () const
+    {
+        return (UINT32)(m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire));
+    }
+
+    UINT32
+    Capacity () const
+    {
+        return m_capacity;
+    }
+
+private:
+    UINT8               rsvd0[PIPELINE_CACHE_LINE];     // Apart from whatever is before it
+    std::atomic<UINT64> m_head;
+    UINT8               rsvd1[PIPELINE_CACHE_LINE - sizeof(UINT64)];
+    std::atomic<UINT64> m_tail;
+    UINT8               rsvd2[PIPELINE_CACHE_LINE - sizeof(UINT64)];
+    UINT32              m_capacity;
+    std::vector<T>      m_slots;
+};
+
+//
+// depth items of type ITEM going round generate -> execute -> triage. Not
+// reentrant, one Run() at a time
+//
+template <typename ITEM>
+class Pipeline
+{
+public:
+    //
+    // depth items, at least 2, each constructed from args
+    //
+    template <typename... ARGS>
+    Pipeline (
+        IN UINT32       depth,
+        IN ARGS&&...    args
+    )
+        : m_depth(depth < 2 ? 2 : depth),
+          m_ready(m_depth),
+          m_done(m_depth),
+          m_free(m_depth),
+          m_pParked(NULL),
+          m_runStartNs(0)
+    {
+        for (UINT32 q = 0; q < PIPELINE_STATS_QWORDS; q++)
+        {
+            m_stats[q].store(0, std::memory_order_relaxed);
+        }
+        for (UINT32 i = 0; i < m_depth; i++)
+        {
+            m_items.emplace_back(new ITEM(args...));
+            m_free.TryPush(m_items.back().get());
+        }
+    }
+
+    //
+    // Run until gen(item) returns FALSE: gen fills a free item and returns
+    // TRUE, exec(item) runs on the calling thread, triage(item) last. Returns
+    // once every generated item has been triaged
+    //
+    template <typename GEN, typename EXEC, typename TRIAGE>
+    VOID
+    Run (
+        IN GEN      gen,
+        IN EXEC     exec,
+        IN TRIAGE   triage
+    )
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        m_runStartNs.store(NowNs(), std::memory_order_relaxed);
+
+        //
+        // A null item ends the stream, passed on by execute
+        //
+        std::thread generate([&]() {
+            for (;;)
+            {
+                ITEM *pItem = Pop(m_free, PIPELINE_STAGE_GENERATE);
+                auto begin = std::chrono::steady_clock::now();
+                BOOL bMore = gen(*pItem);
+
+                if (!bMore)
+                {
+                    m_pParked = pItem;
+                    Push(m_ready, PIPELINE_QUEUE_READY, PIPELINE_STAGE_GENERATE, NULL);
+                    break;
+                }
+                Busy(PIPELINE_STAGE_GENERATE, begin);
+                Push(m_ready, PIPELINE_QUEUE_READY, PIPELINE_STAGE_GENERATE, pItem);
+            }
+        });
+
+        std::thread triageStage([&]() {
+            for (;;)
+            {
+                ITEM *pItem = Pop(m_done, PIPELINE_STAGE_TRIAGE);
+
+                if (pItem == NULL)
+                {
+                    break;
+                }
+
+                auto begin = std::chrono::steady_clock::now();
+                triage(*pItem);
+                Busy(PIPELINE_STAGE_TRIAGE, begin);
+                Push(m_free, PIPELINE_QUEUE_FREE, PIPELINE_STAGE_TRIAGE, pItem);
+            }
+        });
+
+        for (;;)
+        {
+            ITEM *pItem = Pop(m_ready, PIPELINE_STAGE_EXECUTE);
+
+            if (pItem == NULL)
+            {
+                Push(m_done, PIPELINE_QUEUE_DONE, PIPELINE_STAGE_EXECUTE, NULL);
+                break;
+            }
+
+            auto begin = std::chrono::steady_clock::now();
+            exec(*pItem);
+            Busy(PIPELINE_STAGE_EXECUTE, begin);
+            Push(m_done, PIPELINE_QUEUE_DONE, PIPELINE_STAGE_EXECUTE, pItem);
+        }
+
+        generate.join();
+        triageStage.join();
+
+        //
+        // Every stage has stopped, so the item gen turned down can go back
+        // without another producer on the free queue
+        //
+        m_free.TryPush(m_pParked);
+        m_pParked = NULL;
+        Add(offsetof(PIPELINE_STATS, wallNs), Elapsed(start));
+        m_runStartNs.store(0, std::memory_order_relaxed);
+    }
+
+    //
+    // Stats of every Run() so far, the one running included
+    //
+    VOID
+    GetStats (
+        OUT PPIPELINE_STATS pStats
+    ) const
+    {
+        UINT64 qwords[PIPELINE_STATS_QWORDS];
+        UINT64 runStartNs = m_runStartNs.load(std::memory_order_relaxed);
+
+        for (UINT32 q = 0; q < PIPELINE_STATS_QWORDS; q++)
+        {
+            qwords[q] = m_stats[q].load(std::memory_order_relaxed);
+        }
+        memcpy(pStats, qwords, sizeof(PIPELINE_STATS));
+        pStats->depth = m_depth;
+        if (runStartNs != 0)
+        {
+            pStats->wallNs += NowNs() - runStartNs;
+        }
+    }
+
+    UINT32
+    Depth () const
+    {
+        return m_depth;
+    }
+
+private:
+    Pipeline (const Pipeline &) = delete;
+    Pipeline &operator= (const Pipeline &) = delete;
+
+    static UINT64
+    NowNs ()
+    {
+        return (UINT64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static UINT64
+    Elapsed (
+        IN const std::chrono::steady_clock::time_point  &start
+    )
+    {
+        return (UINT64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start).count();
+    }
+
+    //
+    // Add to the stats qword at offset, only ever written by this thread
+    //
+    VOID
+    Add (
+        IN SIZE_T   offset,
+        IN UINT64   n
+    )
+    {
+        std::atomic<UINT64> &qword = m_stats[offset / sizeof(UINT64)];
+
+        qword.store(qword.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static SIZE_T
+    StageOffset (
+        IN PIPELINE_STAGE   stage,
+        IN SIZE_T           field
+    )
+    {
+        return offsetof(PIPELINE_STATS, stages) + stage * sizeof(PIPELINE_STAGE_STATS) + field;
+    }
+
+    static SIZE_T
+    QueueOffset (
+        IN PIPELINE_QUEUE   queue,
+        IN SIZE_T           field
+    )
+    {
+        return offsetof(PIPELINE_STATS, queues) + queue * sizeof(PIPELINE_QUEUE_STATS) + field;
+    }
+
+    VOID
+    Busy (
+        IN PIPELINE_STAGE                               stage,
+        IN const std::chrono::steady_clock::time_point  &start
+    )
+    {
+        Add(StageOffset(stage, offsetof(PIPELINE_STAGE_STATS, items)), 1);
+        Add(StageOffset(stage, offsetof(PIPELINE_STAGE_STATS, busyNs)), Elapsed(start));
+    }
+
+    static VOID
+    Wait (
+        IN OUT PUINT32  pSpins
+    )
+    {
+        if (++*pSpins < PIPELINE_SPINS)
+        {
+            PipelineRelax();
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    ITEM *
+    Pop (
+        IN OUT SpscQueue<ITEM *>    &queue,
+        IN     PIPELINE_STAGE       stage
+    )
+    {
+        ITEM    *pItem = NULL;
+        UINT32  spins = 0;
+
+        if (queue.TryPop(&pItem))
+        {
+            return pItem;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        while (!queue.TryPop(&pItem))
+        {
+            Wait(&spins);
+        }
+        Add(StageOffset(stage, offsetof(PIPELINE_STAGE_STATS, waitNs)), Elapsed(start));
+        return pItem;
+    }
+
+    VOID
+    Push (
+        IN OUT SpscQueue<ITEM *>    &queue,
+        IN     PIPELINE_QUEUE       which,
+        IN     PIPELINE_STAGE       stage,
+        IN     ITEM                 *pItem
+    )
+    {
+        std::atomic<UINT64>     &max = m_stats[QueueOffset(which, offsetof(PIPELINE_QUEUE_STATS, max)) / sizeof(UINT64)];
+        UINT32                  spins = 0;
+        UINT32                  size = 0;
+
+        if (!queue.TryPush(pItem))
+        {
+            auto start = std::chrono::steady_clock::now();
+
+            while (!queue.TryPush(pItem))
+            {
+                Wait(&spins);
+            }
+            Add(StageOffset(stage, offsetof(PIPELINE_STAGE_STATS, waitNs)), Elapsed(start));
+        }
+
+        size = queue.Size();
+        Add(QueueOffset(which, offsetof(PIPELINE_QUEUE_STATS, occupancySum)), size);
+        Add(QueueOffset(which, offsetof(PIPELINE_QUEUE_STATS, samples)), 1);
+        if (size > max.load(std::memory_order_relaxed))
+        {
+            max.store(size, std::memory_order_relaxed);
+        }
+    }
+
+    UINT32                              m_depth;
+    std::vector<std::unique_ptr<ITEM>>  m_items;
+    SpscQueue<ITEM *>                   m_ready;
+    SpscQueue<ITEM *>                   m_done;
+    SpscQueue<ITEM *>                   m_free;
+    ITEM                                *m_pParked;
+
+    //
+    // PIPELINE_STATS as qwords. Each stage writes only its own stage and
+    // output queue entries, Run() the wall time
+    //
+    std::atomic<UINT64>                 m_stats[PIPELINE_STATS_QWORDS];
+    std::atomic<UINT64>                 m_runStartNs;
+};
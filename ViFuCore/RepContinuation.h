@@ -0,0 +1,69 @@
+/*++
+
+Module Name:
+
+    RepContinuation.h
+
+Abstract:
+
+    Continuing rep hypercalls the hypervisor returned partially complete.
+
+    A rep call that runs past its time slice comes back with
+    HV_STATUS_SUCCESS and repComplete below the control word's rep count.
+    The TLFS leaves finishing it to the caller: issue it again with the rep
+    start index (RCX 59:48) set to repComplete, until every rep is done or
+    a rep fails. The driver does that itself, so a continued call costs no
+    round trip through user mode, and counts the re-issues in
+    HYPERCALL_BATCH_RESULT.continuations.
+
+    Plain C so it can be used by the driver.
+
+Environment:
+
+    Kernel mode, User mode, Portable
+
+--*/
+
+#pragma once
+
+#include "../ViridianFuzzer/ViridianFuzzerTypes.h"
+
+//
+// Re-issues of one case at most, a hypervisor that keeps reporting progress
+// can't hold the VP forever. Each one completes at least a rep, so a full
+// 12-bit rep count fits
+//
+#define REP_CONTINUATION_MAX        0xfff
+
+#define HV_CONTROL_REP_COUNT_SHIFT  32
+#define HV_CONTROL_REP_START_SHIFT  48
+#define HV_CONTROL_REP_START_MASK   (0xfffULL << HV_CONTROL_REP_START_SHIFT)
+
+#define HV_CONTROL_REP_COUNT(c)     ((UINT32)(((c) >> HV_CONTROL_REP_COUNT_SHIFT) & 0xfff))
+#define HV_CONTROL_REP_START(c)     ((UINT32)(((c) >> HV_CONTROL_REP_START_SHIFT) & 0xfff))
+
+//
+// Whether the result in rax leaves the rep call in *pControl to continue, if
+// so the control word's start index is moved to where it stopped. Errors,
+// complete calls and results that made no progress are final
+//
+static __inline BOOL
+RepContinuationNext (
+    IN OUT PUINT64  pControl,
+    IN     UINT64   rax
+)
+{
+    UINT32 repCnt = HV_CONTROL_REP_COUNT( *pControl );
+    UINT32 repComplete = HV_RESULT_REP_COMPLETE( rax );
+
+    if( HV_RESULT_STATUS( rax ) != HV_STATUS_SUCCESS ||
+        repComplete >= repCnt ||
+        repComplete <= HV_CONTROL_REP_START( *pControl ) )
+    {
+        return FALSE;
+    }
+
+    *pControl = (*pControl & ~HV_CONTROL_REP_START_MASK) |
+                ((UINT64)repComplete << HV_CONTROL_REP_START_SHIFT);
+    return TRUE;
+}
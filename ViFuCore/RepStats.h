@@ -0,0 +1,168 @@
+/*++
+
+Module Name:
+
+    RepStats.h
+
+Abstract:
+
+    Per call code cost of rep hypercalls: how many cases ran, how many of
+    them the hypervisor returned partially complete, the continuations the
+    driver issued for them (RepContinuation.h), the reps completed and the
+    cycles spent, all issues of a case included.
+
+    Ranked by cycles per case it points at the rep paths that are expensive
+    in the hypervisor, to aim the rep sweep (s_repSweepGenerators) at.
+
+    Counters are relaxed atomics, any number of triage threads can record
+    at once.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include "HypercallTable.h"
+#include "RepContinuation.h"
+
+typedef struct _REP_CALL_STATS
+{
+    UINT32  callcode;
+    UINT32  rsvd;
+    UINT64  cases;
+    UINT64  continued;              // Cases that needed at least one continuation
+    UINT64  continuations;
+    UINT64  reps;                   // repComplete summed
+    UINT64  cycles;
+    UINT64  maxCycles;
+} REP_CALL_STATS, *PREP_CALL_STATS;
+
+inline double
+RepStatsCyclesPerCase (
+    IN const REP_CALL_STATS &stats
+)
+{
+    return stats.cases != 0 ? (double)stats.cycles / stats.cases : 0;
+}
+
+class RepStats
+{
+public:
+    RepStats ()
+    {
+        for (UINT32 callcode = 0; callcode < HC_DESC_COUNT; callcode++)
+        {
+            REP_STATS_SLOT &slot = m_slots[callcode];
+
+            slot.cases.store(0, std::memory_order_relaxed);
+            slot.continued.store(0, std::memory_order_relaxed);
+            slot.continuations.store(0, std::memory_order_relaxed);
+            slot.reps.store(0, std::memory_order_relaxed);
+            slot.cycles.store(0, std::memory_order_relaxed);
+            slot.maxCycles.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    //
+    // Count an executed case. Calls without a rep count or outside the
+    // handler table are not counted
+    //
+    VOID
+    Record (
+        IN const CPU_REG_64             &inRegs,
+        IN const HYPERCALL_BATCH_RESULT &result
+    )
+    {
+        UINT32 callcode = (UINT32)(inRegs.rcx & 0xffff);
+        UINT64 maxCycles = 0;
+
+        if (callcode >= HC_DESC_COUNT || HV_CONTROL_REP_COUNT(inRegs.rcx) == 0)
+        {
+            return;
+        }
+
+        REP_STATS_SLOT &slot = m_slots[callcode];
+
+        slot.cases.fetch_add(1, std::memory_order_relaxed);
+        if (result.continuations != 0)
+        {
+            slot.continued.fetch_add(1, std::memory_order_relaxed);
+            slot.continuations.fetch_add(result.continuations, std::memory_order_relaxed);
+        }
+        slot.reps.fetch_add(result.repComplete, std::memory_order_relaxed);
+        slot.cycles.fetch_add(result.cycles, std::memory_order_relaxed);
+
+        maxCycles = slot.maxCycles.load(std::memory_order_relaxed);
+        while (result.cycles > maxCycles &&
+               !slot.maxCycles.compare_exchange_weak(maxCycles, result.cycles, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    VOID
+    Get (
+        IN  UINT32          callcode,
+        OUT PREP_CALL_STATS pStats
+    ) const
+    {
+        memset(pStats, 0, sizeof(REP_CALL_STATS));
+        pStats->callcode = callcode;
+        if (callcode >= HC_DESC_COUNT)
+        {
+            return;
+        }
+
+        const REP_STATS_SLOT &slot = m_slots[callcode];
+
+        pStats->cases = slot.cases.load(std::memory_order_relaxed);
+        pStats->continued = slot.continued.load(std::memory_order_relaxed);
+        pStats->continuations = slot.continuations.load(std::memory_order_relaxed);
+        pStats->reps = slot.reps.load(std::memory_order_relaxed);
+        pStats->cycles = slot.cycles.load(std::memory_order_relaxed);
+        pStats->maxCycles = slot.maxCycles.load(std::memory_order_relaxed);
+    }
+
+    //
+    // Call codes with at least one case, most cycles per case first
+    //
+    std::vector<REP_CALL_STATS>
+    Ranked () const
+    {
+        std::vector<REP_CALL_STATS> ranked;
+
+        for (UINT32 callcode = 0; callcode < HC_DESC_COUNT; callcode++)
+        {
+            REP_CALL_STATS stats;
+
+            Get(callcode, &stats);
+            if (stats.cases != 0)
+            {
+                ranked.push_back(stats);
+            }
+        }
+
+        std::sort(ranked.begin(), ranked.end(), [](const REP_CALL_STATS &a, const REP_CALL_STATS &b) {
+            return RepStatsCyclesPerCase(a) > RepStatsCyclesPerCase(b);
+        });
+        return ranked;
+    }
+
+private:
+    typedef struct _REP_STATS_SLOT
+    {
+        std::atomic<UINT64> cases;
+        std::atomic<UINT64> continued;
+        std::atomic<UINT64> continuations;
+        std::atomic<UINT64> reps;
+        std::atomic<UINT64> cycles;
+        std::atomic<UINT64> maxCycles;
+    } REP_STATS_SLOT;
+
+    REP_STATS_SLOT  m_slots[HC_DESC_COUNT];
+};
@@ -0,0 +1,87 @@
+/*++
+
+Module Name:
+
+    ViFuPlatform.h
+
+Abstract:
+
+    Minimal platform shim so the shared Viridian Fuzzer headers can be
+    compiled outside of the WDK/SDK. In the driver and in ViFuR3 the real
+    ntddk.h/Windows.h types are used; anywhere else the handful of types
+    and macros the shared headers rely on are defined here.
+
+Environment:
+
+    Kernel mode, User mode, Portable
+
+--*/
+
+#pragma once
+
+#if defined(_NTDDK_) || defined(_WDMDDK_)
+
+//
+// Driver build - ntddk.h already provides everything
+//
+
+#elif defined(_WIN32)
+
+#include <Windows.h>
+
+#else
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef int8_t          INT8, *PINT8;
+typedef int16_t         INT16, *PINT16;
+typedef int32_t         INT32, *PINT32;
+typedef int64_t         INT64, *PINT64;
+typedef uint8_t         UINT8, *PUINT8;
+typedef uint16_t        UINT16, *PUINT16;
+typedef uint32_t        UINT32, *PUINT32;
+typedef uint64_t        UINT64, *PUINT64;
+
+typedef int             INT, *PINT;
+typedef unsigned int    UINT;
+typedef int             BOOL;
+typedef char            CHAR, *PCHAR;
+typedef unsigned char   UCHAR, *PUCHAR;
+typedef uint16_t        USHORT, *PUSHORT;
+typedef uint16_t        WORD;
+typedef int32_t         LONG, *PLONG;
+typedef uint32_t        ULONG, *PULONG;
+typedef uint32_t        DWORD, *PDWORD;
+typedef uint64_t        ULONG64, *PULONG64;
+typedef size_t          SIZE_T;
+typedef void            VOID, *PVOID;
+
+#ifndef TRUE
+#define TRUE    1
+#endif
+#ifndef FALSE
+#define FALSE   0
+#endif
+
+#define IN
+#define OUT
+#define OPTIONAL
+#define CONST   const
+
+#define C_ASSERT(e)             typedef char __C_ASSERT__[(e) ? 1 : -1]
+#define _ARRAYSIZE(a)           (sizeof(a) / sizeof((a)[0]))
+
+#define STATUS_SEVERITY_ERROR   0x3
+
+#define METHOD_BUFFERED         0
+#define METHOD_IN_DIRECT        1
+#define METHOD_OUT_DIRECT       2
+#define METHOD_NEITHER          3
+#define FILE_READ_DATA          0x0001
+#define FILE_WRITE_DATA         0x0002
+#define CTL_CODE(DeviceType, Function, Method, Access)  \
+    (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+#endif
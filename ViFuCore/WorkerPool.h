@@ -0,0 +1,539 @@
+/*++
+
+Module Name:
+
+    WorkerPool.h
+
+Abstract:
+
+    Runs a range of case indices on a pool of worker threads, one per
+    logical processor and pinned to it, so every VP of the guest issues
+    hypercalls instead of one.
+
+    The range is cut into chunks (a rep/fast combo of the case space in
+    ViFuR3) that are dealt round robin to per-worker deques before the run,
+    so all workers move through the range together from its start. A worker
+    takes chunks from the front of its own deque. Once it is empty it steals
+    from the back of the others', starting at a random victim. Nothing is
+    pushed while running, so a worker is done when a pass over every deque
+    finds nothing.
+
+    A deque is its chunk list plus head/tail indices packed in one 64-bit
+    word. The owner and thieves both claim a chunk with a compare-exchange
+    of that word, the list itself is only written before the run.
+
+    Workers count what they do in their own cache lines (WorkerCounters),
+    each counter written by one thread and readable from any. Total() merges
+    them, while running or after.
+
+    While running, every index below LowWatermark() has completed and none
+    at or past HighWatermark() has started, so [low, high) holds everything
+    in flight, e.g. the cases one of which took the guest down.
+
+    Run() calls a function per chunk on the worker's thread. RunWorkers()
+    instead calls one per worker and leaves taking chunks (Claim) and saying
+    they are done (Complete) to it, so a worker can be split into stages on
+    several threads, e.g. a Pipeline (Pipeline.h).
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <memory>
+#include "ViFuPlatform.h"
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#define WORKER_POOL_CACHE_LINE  64
+#define WORKER_POOL_MAX_WORKERS 256
+
+typedef enum _WORKER_COUNTER
+{
+    WORKER_COUNTER_CHUNKS = 0,      // Chunks run, own and stolen
+    WORKER_COUNTER_STEALS,          // Chunks taken from another worker
+    WORKER_COUNTER_STEAL_MISSES,    // Victims found empty
+    WORKER_COUNTER_CASES,
+    WORKER_COUNTER_SUCCESS,
+    WORKER_COUNTER_EFFECTIVE,
+    WORKER_COUNTER_ERRORS,          // Batches the backend failed
+    WORKER_COUNTER_COUNT
+} WORKER_COUNTER;
+
+//
+// Number of logical processors, at least 1
+//
+inline UINT32
+WorkerPoolProcessorCount ()
+{
+    UINT32 count = (UINT32)std::thread::hardware_concurrency();
+
+    return count != 0 ? count : 1;
+}
+
+//
+// Pin the calling thread to a processor, wrapping past the processor count.
+// On Windows only the calling thread's processor group is used
+//
+inline BOOL
+WorkerPoolPin (
+    IN UINT32   processor
+)
+{
+    processor %= WorkerPoolProcessorCount();
+#if defined(_WIN32)
+    if (processor >= 8 * sizeof(DWORD_PTR))
+    {
+        return FALSE;
+    }
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << processor) != 0;
+#else
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(processor, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
+
+//
+// Counters of one worker. Each counter is added to by one thread only (the
+// worker, or the one stage of it that counts it), so an add is a plain load
+// and store rather than a locked read-modify-write
+//
+class WorkerCounters
+{
+public:
+    WorkerCounters ()
+    {
+        Reset();
+    }
+
+    VOID
+    Add (
+        IN WORKER_COUNTER   counter,
+        IN UINT64           n = 1
+    )
+    {
+        m_values[counter].store(m_values[counter].load(std::memory_order_relaxed) + n,
+                                std::memory_order_relaxed);
+    }
+
+    UINT64
+    Get (
+        IN WORKER_COUNTER   counter
+    ) const
+    {
+        return m_values[counter].load(std::memory_order_relaxed);
+    }
+
+    VOID
+    Reset ()
+    {
+        for (UINT32 c = 0; c < WORKER_COUNTER_COUNT; c++)
+        {
+            m_values[c].store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    std::atomic<UINT64> m_values[WORKER_COUNTER_COUNT];
+    UINT8               rsvd[WORKER_POOL_CACHE_LINE - WORKER_COUNTER_COUNT * sizeof(UINT64) % WORKER_POOL_CACHE_LINE];
+};
+
+//
+// Bounded deque of chunk numbers, filled before the run. The owner pops the
+// front, thieves steal the back
+//
+class WorkStealDeque
+{
+public:
+    WorkStealDeque ()
+        : m_range(0)
+    {
+    }
+
+    //
+    // Not safe while anyone pops or steals
+    //
+    VOID
+    Reset ()
+    {
+        m_items.clear();
+        m_range.store(0, std::memory_order_relaxed);
+    }
+
+    VOID
+    Push (
+        IN UINT64   item
+    )
+    {
+        m_items.push_back(item);
+        m_range.store((UINT64)m_items.size() << 32, std::memory_order_release);
+    }
+
+    BOOL
+    Pop (
+        OUT PUINT64 pItem
+    )
+    {
+        UINT64 range = m_range.load(std::memory_order_acquire);
+
+        while ((UINT32)range != (UINT32)(range >> 32))
+        {
+            if (m_range.compare_exchange_weak(range, range + 1, std::memory_order_acq_rel))
+            {
+                *pItem = m_items[(UINT32)range];
+                return TRUE;
+            }
+        }
+        return FALSE;
+    }
+
+    BOOL
+    Steal (
+        OUT PUINT64 pItem
+    )
+    {
+        UINT64 range = m_range.load(std::memory_order_acquire);
+
+        while ((UINT32)range != (UINT32)(range >> 32))
+        {
+            if (m_range.compare_exchange_weak(range, range - (1ULL << 32), std::memory_order_acq_rel))
+            {
+                *pItem = m_items[(UINT32)(range >> 32) - 1];
+                return TRUE;
+            }
+        }
+        return FALSE;
+    }
+
+    UINT32
+    Size () const
+    {
+        UINT64 range = m_range.load(std::memory_order_relaxed);
+
+        return (UINT32)(range >> 32) - (UINT32)range;
+    }
+
+private:
+    std::atomic<UINT64> m_range;    // Head in 31:0, tail in 63:32
+    UINT8               rsvd[WORKER_POOL_CACHE_LINE - sizeof(UINT64)];
+    std::vector<UINT64> m_items;
+};
+
+//
+// A chunk a worker claimed, its number and [begin, end)
+//
+typedef struct _WORKER_CHUNK
+{
+    UINT64  index;
+    UINT64  begin;
+    UINT64  end;
+} WORKER_CHUNK, *PWORKER_CHUNK;
+
+class WorkerPool
+{
+public:
+    //
+    // workers 0 is one per logical processor
+    //
+    explicit WorkerPool (
+        IN UINT32   workers = 0,
+        IN BOOL     bPin = TRUE
+    )
+        : m_workers(workers != 0 ? workers : WorkerPoolProcessorCount()),
+          m_bPin(bPin),
+          m_begin(0),
+          m_end(0),
+          m_chunk(1),
+          m_chunks(0),
+          m_pinned(0),
+          m_lowChunk(0),
+          m_highChunk(0),
+          m_stop(false)
+    {
+        if (m_workers > WORKER_POOL_MAX_WORKERS)
+        {
+            m_workers = WORKER_POOL_MAX_WORKERS;
+        }
+        for (UINT32 w = 0; w < m_workers; w++)
+        {
+            m_slots.emplace_back(new WORKER_SLOT);
+            m_slots.back()->rng = 0x9E3779B97F4A7C15ULL * (w + 1);
+        }
+    }
+
+    UINT32 Workers () const { return m_workers; }
+    UINT32 Pinned () const { return m_pinned.load(); }
+
+    //
+    // Deal [begin, end) to the workers in chunks of chunk indices (the last
+    // may be short), chunk k to worker k % Workers(). Counters keep counting
+    // across seeds
+    //
+    VOID
+    Seed (
+        IN UINT64   begin,
+        IN UINT64   end,
+        IN UINT64   chunk
+    )
+    {
+        m_begin = begin;
+        m_end = end > begin ? end : begin;
+        m_chunk = chunk != 0 ? chunk : 1;
+
+        for (auto &pSlot : m_slots)
+        {
+            pSlot->deque.Reset();
+        }
+
+        m_chunks = (m_end - m_begin + m_chunk - 1) / m_chunk;
+        m_done.reset(new std::atomic<UINT8>[(SIZE_T)m_chunks + 1]);
+        for (UINT64 k = 0; k <= m_chunks; k++)
+        {
+            m_done[(SIZE_T)k].store(0, std::memory_order_relaxed);
+        }
+        m_lowChunk = 0;
+        m_highChunk = 0;
+        m_stop = false;
+
+        for (UINT64 k = 0; k < m_chunks; k++)
+        {
+            m_slots[(SIZE_T)(k % m_workers)]->deque.Push(k);
+        }
+    }
+
+    //
+    // Have the workers stop taking chunks, Run returns once the ones running
+    // finish. Safe from any thread
+    //
+    VOID Stop () { m_stop = true; }
+
+    //
+    // Every index below it has completed
+    //
+    UINT64
+    LowWatermark ()
+    {
+        UINT64 low = m_lowChunk.load();
+
+        while (low < m_chunks && m_done[(SIZE_T)low].load(std::memory_order_acquire))
+        {
+            low++;
+        }
+        UINT64 seen = m_lowChunk.load();
+        while (seen < low && !m_lowChunk.compare_exchange_weak(seen, low))
+        {
+        }
+        return ChunkIndex(low);
+    }
+
+    //
+    // No index at or past it has started
+    //
+    UINT64 HighWatermark () const { return ChunkIndex(m_highChunk.load()); }
+
+    //
+    // Run the seeded range, fn(worker, begin, end, counters) once per chunk
+    // on the worker's thread. Returns when every chunk has run
+    //
+    template <typename FN>
+    VOID
+    Run (
+        IN FN   fn
+    )
+    {
+        RunWorkers([this, &fn](UINT32 w, WorkerCounters &counters) {
+            WORKER_CHUNK chunk;
+
+            while (Claim(w, counters, &chunk))
+            {
+                fn(w, chunk.begin, chunk.end, counters);
+                Complete(chunk);
+            }
+        });
+    }
+
+    //
+    // Call fn(worker, counters) once on each worker's thread, pinned. It
+    // runs the seeded range with Claim() and Complete(). Returns when every
+    // fn has
+    //
+    template <typename FN>
+    VOID
+    RunWorkers (
+        IN FN   fn
+    )
+    {
+        std::vector<std::thread> threads;
+
+        m_pinned = 0;
+        for (UINT32 w = 1; w < m_workers; w++)
+        {
+            threads.emplace_back([this, w, &fn]() { Worker(w, fn); });
+        }
+        Worker(0, fn);
+
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    //
+    // Take worker w's next chunk, its own or stolen. FALSE once there are
+    // none left or Stop() was called. Only one thread may claim for a worker,
+    // not necessarily the worker's own
+    //
+    BOOL
+    Claim (
+        IN  UINT32          w,
+        IN  WorkerCounters  &counters,
+        OUT PWORKER_CHUNK   pChunk
+    )
+    {
+        UINT64 k = 0;
+
+        if (m_stop || (!m_slots[w]->deque.Pop(&k) && !StealChunk(w, &counters, &k)))
+        {
+            return FALSE;
+        }
+
+        UINT64 high = m_highChunk.load();
+
+        //
+        // Raised before any case of the chunk runs
+        //
+        while (high < k + 1 && !m_highChunk.compare_exchange_weak(high, k + 1))
+        {
+        }
+
+        pChunk->index = k;
+        pChunk->begin = m_begin + k * m_chunk;
+        pChunk->end = m_end - pChunk->begin > m_chunk ? pChunk->begin + m_chunk : m_end;
+        counters.Add(WORKER_COUNTER_CHUNKS);
+        return TRUE;
+    }
+
+    //
+    // Every case of a claimed chunk has run. Safe from any thread
+    //
+    VOID
+    Complete (
+        IN const WORKER_CHUNK   &chunk
+    )
+    {
+        m_done[(SIZE_T)chunk.index].store(1, std::memory_order_release);
+    }
+
+    WorkerCounters &
+    Counters (
+        IN UINT32   worker
+    )
+    {
+        return m_slots[worker]->counters;
+    }
+
+    UINT64
+    Total (
+        IN WORKER_COUNTER   counter
+    ) const
+    {
+        UINT64 total = 0;
+
+        for (auto &pSlot : m_slots)
+        {
+            total += pSlot->counters.Get(counter);
+        }
+        return total;
+    }
+
+private:
+    typedef struct _WORKER_SLOT
+    {
+        UINT8           rsvd[WORKER_POOL_CACHE_LINE];   // Apart from whatever the heap puts before it
+        WorkStealDeque  deque;
+        WorkerCounters  counters;
+        UINT64          rng;                            // Victim picks, used by whoever claims
+    } WORKER_SLOT;
+
+    template <typename FN>
+    VOID
+    Worker (
+        IN UINT32   w,
+        IN FN       &fn
+    )
+    {
+        if (m_bPin && WorkerPoolPin(w))
+        {
+            m_pinned++;
+        }
+        fn(w, m_slots[w]->counters);
+    }
+
+    UINT64
+    ChunkIndex (
+        IN UINT64   k
+    ) const
+    {
+        return k >= m_chunks ? m_end : m_begin + k * m_chunk;
+    }
+
+    BOOL
+    StealChunk (
+        IN     UINT32           w,
+        IN     WorkerCounters   *pCounters,
+        OUT    PUINT64          pChunk
+    )
+    {
+        UINT64 &rng = m_slots[w]->rng;
+
+        rng ^= rng >> 12;
+        rng ^= rng << 25;
+        rng ^= rng >> 27;
+
+        UINT32 first = (UINT32)(rng % m_workers);
+
+        for (UINT32 v = 0; v < m_workers; v++)
+        {
+            UINT32 victim = (first + v) % m_workers;
+
+            if (victim == w)
+            {
+                continue;
+            }
+            if (m_slots[victim]->deque.Steal(pChunk))
+            {
+                pCounters->Add(WORKER_COUNTER_STEALS);
+                return TRUE;
+            }
+            pCounters->Add(WORKER_COUNTER_STEAL_MISSES);
+        }
+        return FALSE;
+    }
+
+    UINT32                                      m_workers;
+    BOOL                                        m_bPin;
+    UINT64                                      m_begin;
+    UINT64                                      m_end;
+    UINT64                                      m_chunk;
+    UINT64                                      m_chunks;
+    std::atomic<UINT32>                         m_pinned;
+    std::atomic<UINT64>                         m_lowChunk;
+    std::atomic<UINT64>                         m_highChunk;
+    std::atomic<bool>                           m_stop;
+    std::unique_ptr<std::atomic<UINT8>[]>       m_done;
+    std::vector<std::unique_ptr<WORKER_SLOT>>   m_slots;
+};
@@ -0,0 +1,187 @@
+/*++
+
+Module Name:
+
+    DeviceBackend.h
+
+Abstract:
+
+    HcBackend implementations that forward batches to the ViridianFuzzer
+    driver, either with IOCTL_HYPERCALL_BATCH or through the registered
+    SQ/CQ ring pair.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include <Windows.h>
+#include "../ViFuCore/HcBackend.h"
+#include "../ViFuCore/HcRingClient.h"
+
+class HcDeviceBackend : public HcBackend
+{
+public:
+    explicit HcDeviceBackend (
+        IN HANDLE   hDevice
+    )
+        : m_hDevice(hDevice)
+    {
+    }
+
+    using HcBackend::ExecBatch;
+
+    //
+    // On failure returns GLE, which holds the VIFU_CREATE_ERR code if the
+    // driver rejected the batch
+    //
+    virtual UINT32
+    ExecBatch (
+        IN  const VOID  *pInBuf,
+        IN  UINT32      inBufLen,
+        OUT VOID        *pOutBuf,
+        IN  UINT32      outBufLen,
+        OUT PUINT32     pBytesRet
+    )
+    {
+        DWORD bytesRet = 0;
+        BOOL  bStatus = DeviceIoControl(m_hDevice,
+                                        IOCTL_HYPERCALL_BATCH,
+                                        (LPVOID)pInBuf,
+                                        inBufLen,
+                                        pOutBuf,
+                                        outBufLen,
+                                        &bytesRet,
+                                        NULL);
+
+        *pBytesRet = bytesRet;
+        return bStatus ? 0 : GetLastError();
+    }
+
+private:
+    HANDLE  m_hDevice;
+};
+
+class HcDeviceRingBackend : public HcRingClient
+{
+public:
+    explicit HcDeviceRingBackend (
+        IN HANDLE   hDevice
+    )
+        : m_hDevice(hDevice),
+          m_pRegion(NULL),
+          m_regionSize(0)
+    {
+    }
+
+    virtual ~HcDeviceRingBackend ()
+    {
+        Unregister();
+    }
+
+    //
+    // Allocate the SQ/CQ region and have the driver lock it. Entry counts must
+    // be powers of 2, up to HC_RING_MAX_ENTRIES
+    //
+    BOOL
+    Register (
+        IN UINT32   sqCnt,
+        IN UINT32   cqCnt
+    )
+    {
+        HYPERCALL_RING_REGISTER reg = { 0 };
+        DWORD                   bytesRet = 0;
+
+        m_regionSize = HC_RING_PAIR_SIZE(sqCnt, cqCnt);
+        m_pRegion = VirtualAlloc(NULL, m_regionSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (m_pRegion == NULL || !InitRings(m_pRegion, sqCnt, cqCnt))
+        {
+            Unregister();
+            return FALSE;
+        }
+
+        reg.baseVa = (UINT64)m_pRegion;
+        reg.size = (UINT32)m_regionSize;
+        reg.sqEntryCnt = sqCnt;
+        reg.cqEntryCnt = cqCnt;
+
+        if (!DeviceIoControl(m_hDevice,
+                             IOCTL_HYPERCALL_RING_REGISTER,
+                             &reg,
+                             sizeof(reg),
+                             NULL,
+                             0,
+                             &bytesRet,
+                             NULL))
+        {
+            printf("[-] ERR DeviceIoControl IOCTL_HYPERCALL_RING_REGISTER 0x%x\r\n", GetLastError());
+            ResetRings();
+            VirtualFree(m_pRegion, 0, MEM_RELEASE);
+            m_pRegion = NULL;
+            return FALSE;
+        }
+
+        return TRUE;
+    }
+
+    VOID
+    Unregister ()
+    {
+        DWORD bytesRet = 0;
+
+        if (m_pRegion == NULL)
+        {
+            return;
+        }
+
+        if (m_pBase != NULL)
+        {
+            DeviceIoControl(m_hDevice,
+                            IOCTL_HYPERCALL_RING_UNREGISTER,
+                            NULL,
+                            0,
+                            NULL,
+                            0,
+                            &bytesRet,
+                            NULL);
+            ResetRings();
+        }
+
+        VirtualFree(m_pRegion, 0, MEM_RELEASE);
+        m_pRegion = NULL;
+    }
+
+protected:
+    virtual UINT32
+    Doorbell (
+        IN UINT32   flags
+    )
+    {
+        HYPERCALL_RING_DOORBELL doorbell = { 0 };
+        DWORD                   drained = 0;
+        DWORD                   bytesRet = 0;
+
+        doorbell.flags = flags;
+        if (!DeviceIoControl(m_hDevice,
+                             IOCTL_HYPERCALL_RING_DOORBELL,
+                             &doorbell,
+                             sizeof(doorbell),
+                             &drained,
+                             sizeof(drained),
+                             &bytesRet,
+                             NULL))
+        {
+            return GetLastError();
+        }
+
+        return 0;
+    }
+
+private:
+    HANDLE  m_hDevice;
+    PVOID   m_pRegion;
+    SIZE_T  m_regionSize;
+};
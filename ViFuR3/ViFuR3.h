@@ -1,20 +1,145 @@
 #pragma once
 
+#include <winsock2.h>
 #include <Windows.h>
 #include <time.h>  
 #include "../ViridianFuzzer/ViridianFuzzerTypes.h"
+#include "DeviceBackend.h"
+#include "../ViFuCore/AsyncLog.h"
+#include "../ViFuCore/FuzzJournal.h"
+#include "../ViFuCore/CollectorClient.h"
+#include "../ViFuCore/NoveltyTracker.h"
+#include "../ViFuCore/HypercallTable.h"
+#include "../ViFuCore/CaseSpace.h"
+#include "../ViFuCore/CasePruner.h"
+#include "../ViFuCore/WorkerPool.h"
+#include "../ViFuCore/CoordinatorClient.h"
+#include "../ViFuCore/Pipeline.h"
+#include "../ViFuCore/CorpusStore.h"
+#include "../ViFuCore/RepStats.h"
+#include "../ViFuCore/HcLatency.h"
+#include "../ViFuCore/Metrics.h"
 
 //
 // Config vars for share (in our case its parent)
 //
 #define UNC_LOG_PATH        L"\\\\DESKTOP-6IIUE90\\Violet_SHARE"
 #define UNC_LOG_FILEPATH    L"\\\\DESKTOP-6IIUE90\\Violet_SHARE\\VIFU_LOG.txt"
-#define UNC_LOG_FUZZCMD     L"\\\\DESKTOP-6IIUE90\\Violet_SHARE\\fuzz_logger.txt"
+#define UNC_LOG_FUZZJOURNAL L"\\\\DESKTOP-6IIUE90\\Violet_SHARE\\fuzz_journal.bin"
 #define AUTO_START_FILE     L"\\\\DESKTOP-6IIUE90\\Violet_SHARE\\autoStart.txt"
 //
 //
 //
 
+//
+// Host log collector (ViFuCollector), tried before the share. "" to use the share only
+//
+#define VIFU_COLLECTOR_HOST     "DESKTOP-6IIUE90"
+#define VIFU_COLLECTOR_PORT     COLLECTOR_DEFAULT_PORT
+#define VIFU_COLLECTOR_TIMEOUT  10000
+
+//
+// Optional allow/deny overrides of the call codes fuzzed (see HypercallTable.h)
+//
+#define VIFU_HYPERCALL_CONFIG   "hypercalls.cfg"
+
+//
+// What makes a case's result new (NOVELTY_KEY_*), and where the set of seen
+// results is kept between runs
+//
+#define VIFU_NOVELTY_KEY        (NOVELTY_KEY_INPUT | NOVELTY_KEY_STATUS | NOVELTY_KEY_REP_COMPLETE)
+#define VIFU_NOVELTY_SNAPSHOT   "novelty.bin"
+#define VIFU_NOVELTY_SAVE_MS    30000   // Snapshot at most this often while fuzzing, and at the end
+
+//
+// Directory of the corpus of cases that gave a new result (CorpusStore.h)
+//
+#define VIFU_CORPUS_DIR         "corpus"
+
+//
+// 1 to fuzz only rep calls with the rep count sweep (s_repSweepGenerators)
+// instead of the default cases. Rep call codes reported at the end, most
+// cycles per case first
+//
+#define VIFU_REP_SWEEP          0
+#define VIFU_REP_STATS_TOP      16
+
+//
+// 1 to fuzz with extended fast calls that take all their input from RDX, R8
+// and XMM0 - XMM5 (s_registerGenerators), so the driver prepares no GPA pages.
+// Compare the cases/s reported at the end with a GPA backed run
+//
+#define VIFU_REGISTER_ONLY      0
+
+#if VIFU_REP_SWEEP && VIFU_REGISTER_ONLY
+#error VIFU_REP_SWEEP and VIFU_REGISTER_ONLY pick different case tables
+#endif
+
+//
+// 1 to run CASE_PRUNE_PROBES cases of every rep/fast combo of the shard first
+// and then skip the call codes and combos whose probes show the input makes
+// no difference (CasePruner.h). Every decision goes to VIFU_PRUNE_LOG.
+// Coordinated campaigns run their leases whole
+//
+#define VIFU_PRUNE              1
+#define VIFU_PRUNE_LOG          "vifu_prune.txt"
+
+//
+// Cases more than this many powers of 10 slower or faster than the median
+// of their call code are logged as latency outliers (HcLatency.h). Call
+// codes with the slowest 99th percentile reported at the end
+//
+#define VIFU_LATENCY_OUTLIER_ORDERS HC_LATENCY_OUTLIER_ORDERS
+#define VIFU_LATENCY_TOP            16
+
+//
+// Live metrics (Metrics.h): Prometheus text on GET /metrics at
+// VIFU_METRICS_BIND:VIFU_METRICS_PORT and a stats file a TUI can map, both
+// refreshed every VIFU_METRICS_PERIOD_MS. NULL bind address for no endpoint
+//
+#define VIFU_METRICS_BIND           "0.0.0.0"
+#define VIFU_METRICS_PORT           METRICS_DEFAULT_PORT
+#define VIFU_METRICS_FILE           "vifu_metrics.bin"
+#define VIFU_METRICS_PERIOD_MS      METRICS_PERIOD_MS
+
+//
+// Campaign coordinator (ViFuCoordinator), leases this guest ranges of the case
+// space. "" or unreachable to run the shard below instead
+//
+#define VIFU_COORDINATOR_HOST       "DESKTOP-6IIUE90"
+#define VIFU_COORDINATOR_PORT       COORD_DEFAULT_PORT
+#define VIFU_COORDINATOR_TIMEOUT    10000
+
+//
+// Part of the case space this guest runs without a coordinator, shard
+// VIFU_SHARD_INDEX of VIFU_SHARD_COUNT. Give each guest of a campaign its own index
+//
+#define VIFU_SHARD_INDEX        0
+#define VIFU_SHARD_COUNT        1
+
+//
+// Fuzzing threads, each pinned to a logical processor with its own driver
+// handle. 0 for one per logical processor
+//
+#define VIFU_WORKERS            0
+
+//
+// Number of cases sent to the driver per IOCTL_HYPERCALL_BATCH (1 - HYPERCALL_BATCH_MAX_CASES)
+//
+#define VIFU_BATCH_SIZE     64
+
+//
+// Batches of a worker in flight between its generate, execute and triage
+// threads (at least 2). Up to VIFU_PIPELINE_DEPTH - 1 of them are journaled
+// ahead of the one executing
+//
+#define VIFU_PIPELINE_DEPTH 4
+
+//
+// SQ and CQ entries of the ring registered with the driver (power of 2)
+//
+#define VIFU_RING_ENTRIES   256
+
 #define STR_FMT_DATETIME    "\r\n[ %02d/%02d/%04d %02d:%02d:%02d ]\r\n"
 
 #define PRINT_CPU_REG(eax, ebx, ecx, edx)   \
@@ -27,6 +152,6 @@
     rdi, r8, r9, r10, r11);
 
 #define WRITE_REGS_TO_LOG_FILE(rax, rbx, rcx, rdx, rsi, rdi, r8, r9, r10, r11)                  \
-    WriteToLogFile(g_hLogfile, "    rax 0x%016llx rbx 0x%016llx rcx 0x%016llx rdx 0x%016llx rsi 0x%016llx\n"\
+    WriteToLogFile(g_logfile, "    rax 0x%016llx rbx 0x%016llx rcx 0x%016llx rdx 0x%016llx rsi 0x%016llx\n"\
     "    rdi 0x%016llx r8  0x%016llx r9  0x%016llx r10 0x%016llx r11 0x%016llx\n",              \
     rax, rbx, rcx, rdx, rsi, rdi, r8, r9, r10, r11);
@@ -0,0 +1,85 @@
+/*++
+
+Module Name:
+
+    JournalToText.cpp
+
+Abstract:
+
+    Converts a binary fuzz journal (fuzz_journal.bin) to the old
+    fuzz_logger.txt text format, a "callcode repCnt fast case" line per case
+    and a datetime line for every fuzzer start.
+
+    Usage: JournalToText <journal> [output, default stdout]
+
+    Exits non-zero if the journal can't be read or has a bad record before its
+    last valid one. A torn tail is only reported.
+
+Environment:
+
+    User mode, Portable
+
+--*/
+
+#include "../ViFuCore/FuzzJournal.h"
+
+int
+main (
+    int     argc,
+    char    **argv
+)
+{
+    FuzzJournalReader   reader;
+    FILE                *pOut = stdout;
+    CHAR                line[128];
+    UINT64              bad = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <journal> [output]\n", argv[0]);
+        return 2;
+    }
+
+    if (!reader.Open(argv[1]))
+    {
+        fprintf(stderr, "[-] %s is not a fuzz journal\n", argv[1]);
+        return 1;
+    }
+
+    if (argc > 2)
+    {
+        pOut = fopen(argv[2], "wb");
+        if (pOut == NULL)
+        {
+            fprintf(stderr, "[-] ERR opening %s\n", argv[2]);
+            return 1;
+        }
+    }
+
+    for (UINT64 seq = 0; seq < reader.Count(); seq++)
+    {
+        if (!reader.IsValid(seq))
+        {
+            if (bad++ < 8)
+            {
+                fprintf(stderr, "[-] Bad record %llu\n", (unsigned long long)seq);
+            }
+            continue;
+        }
+
+        INT len = FuzzJournalFormatText(reader.Record(seq), line, sizeof(line));
+        fwrite(line, 1, (SIZE_T)len, pOut);
+    }
+
+    if (pOut != stdout)
+    {
+        fclose(pOut);
+    }
+
+    fprintf(stderr,
+            "[+] Campaign 0x%016llx, %llu records, %llu bad\n",
+            (unsigned long long)reader.Header()->campaignId,
+            (unsigned long long)reader.Count(),
+            (unsigned long long)bad);
+    return bad != 0 ? 1 : 0;
+}
@@ -0,0 +1,112 @@
+//
+// Generated from HypercallsOnlyFromPdf.txt
+//
+// HYPERCALL_PDF_LIST(X) expands X(name, callcode, privilege) for every `#define`
+// line of it, privilege being the partition the TLFS says may make the call
+// (HC_PRIV_ suffix). Lines marked [MANUALLY_FIX] are left out as they are there
+//
+#define HYPERCALL_PDF_LIST(X) \
+X("HvSwitchVirtualAddressSpace"          , 0x01, ANY) \
+X("HvFlushVirtualAddressSpace"           , 0x02, ANY) \
+X("HvFlushVirtualAddressList"            , 0x03, ANY) \
+X("HvGetLogicalProcessorRunTime"         , 0x04, ANY) \
+X("HvNotifyLongSpinWait"                 , 0x08, ANY) \
+X("HvCallSendSyntheticClusterIpi"        , 0x0b, ANY) \
+X("HvCallModifyVtlProtectionMask"        , 0x0c, ANY) \
+X("HvCallEnablePartitionVtl"             , 0x0d, ANY) \
+X("HvCallDisablePartitionVtl"            , 0x0e, ANY) \
+X("HvCallEnableVpVtl"                    , 0x0f, ANY) \
+X("HvCallDisableVpVtl"                   , 0x10, ANY) \
+X("HvCallVtlCall"                        , 0x11, ANY) \
+X("HvCallVtlReturn"                      , 0x12, ANY) \
+X("HvCallFlushVirtualAddressSpaceEx"     , 0x13, ANY) \
+X("HvCallFlushVirtualAddressListEx"      , 0x14, ANY) \
+X("HvCallSendSyntheticClusterIpiEx"      , 0x15, ANY) \
+X("HvCreatePartition"                    , 0x40, ANY) \
+X("HvInitializePartition"                , 0x41, PARENT) \
+X("HvFinalizePartition"                  , 0x42, PARENT) \
+X("HvDeletePartition"                    , 0x43, PARENT) \
+X("HvGetPartitionProperty"               , 0x44, PARENT_ROOT) \
+X("HvSetPartitionProperty"               , 0x45, PARENT_ROOT) \
+X("HvGetPartitionId"                     , 0x46, ANY) \
+X("HvGetNextChildPartition"              , 0x47, PARENT) \
+X("HvDepositMemory"                      , 0x48, PARENT_ROOT) \
+X("HvWithdrawMemory"                     , 0x49, PARENT_ROOT) \
+X("HvGetMemoryBalance"                   , 0x4a, PARENT_ROOT) \
+X("HvMapGpaPages"                        , 0x4b, PARENT_ROOT) \
+X("HvUnmapGpaPages"                      , 0x4c, PARENT) \
+X("HvInstallIntercept"                   , 0x4d, PARENT) \
+X("HvCreateVp"                           , 0x4e, PARENT) \
+X("HvDeleteVp"                           , 0x4f, PARENT) \
+X("HvGetVpRegisters"                     , 0x50, ANY) \
+X("HvSetVpRegisters"                     , 0x51, ANY) \
+X("HvTranslateVirtualAddress"            , 0x52, ANY) \
+X("HvReadGpa"                            , 0x53, PARENT) \
+X("HvWriteGpa"                           , 0x54, PARENT) \
+X("Deprecated"                           , 0x55, PARENT) \
+X("HvClearVirtualInterrupt"              , 0x56, PARENT) \
+X("Deprecated"                           , 0x57, PARENT_ROOT) \
+X("HvDeletePort"                         , 0x58, PARENT_ROOT) \
+X("HvConnectPort"                        , 0x59, PARENT_ROOT) \
+X("HvGetPortProperty"                    , 0x5a, PARENT_ROOT) \
+X("HvDisconnectPort"                     , 0x5b, PARENT_ROOT) \
+X("HvPostMessage"                        , 0x5c, ANY) \
+X("HvSignalEvent"                        , 0x5d, ANY) \
+X("HvSavePartitionState"                 , 0x5e, PARENT) \
+X("HvRestorePartitionState"              , 0x5f, PARENT) \
+X("HvInitializeEventLogBufferGroup"      , 0x60, ROOT) \
+X("HvFinalizeEventLogBufferGroup"        , 0x61, ROOT) \
+X("HvCreateEventLogBuffer"               , 0x62, ROOT) \
+X("HvDeleteEventLogBuffer"               , 0x63, ROOT) \
+X("HvMapEventLogBuffer"                  , 0x64, ROOT) \
+X("HvUnmapEventLogBuffer"                , 0x65, ROOT) \
+X("HvSetEventLogGroupSources"            , 0x66, ROOT) \
+X("HvReleaseEventLogBuffer"              , 0x67, ROOT) \
+X("HvFlushEventLogBuffer"                , 0x68, ROOT) \
+X("HvPostDebugData"                      , 0x69, ANY) \
+X("HvRetrieveDebugData"                  , 0x6a, ANY) \
+X("HvResetDebugSession"                  , 0x6b, ANY) \
+X("HvMapStatsPage"                       , 0x6c, PARENT) \
+X("HvUnmapStatsPage"                     , 0x6d, UNKNOWN) \
+X("HvCallMapSparseGpaPages"              , 0x6e, PARENT_ROOT) \
+X("HvCallSetSystemProperty"              , 0x6f, ROOT) \
+X("HvCallSetPortProperty"                , 0x70, PARENT_ROOT) \
+X("HvCallAddLogicalProcessor"            , 0x76, ROOT) \
+X("HvCallRemoveLogicalProcessor"         , 0x77, ROOT) \
+X("HvCallQueryNumaDistance"              , 0x78, ROOT) \
+X("HvCallSetLogicalProcessorProperty"    , 0x79, ROOT) \
+X("HvCallGetLogicalProcessorProperty"    , 0x7a, ROOT) \
+X("HvCallGetSystemProperty"              , 0x7b, ANY) \
+X("HvCallMapDeviceInterrupt"             , 0x7c, ROOT) \
+X("HvCallUnmapDeviceInterrupt"           , 0x7d, ROOT) \
+X("HvCallRetargetDeviceInterrupt"        , 0x7e, ANY) \
+X("Reserved"                             , 0x7f, ROOT) \
+X("HvCallMapDevicePages"                 , 0x80, ROOT) \
+X("HvCallUnmapDevicePages"               , 0x81, ROOT) \
+X("HvCallAttachDevice"                   , 0x82, ROOT) \
+X("HvCallDetachDevice"                   , 0x83, ROOT) \
+X("HvCallNotifyStandbyTransition"        , 0x84, ROOT) \
+X("HvCallPrepareForSleep"                , 0x85, ROOT) \
+X("HvCallPrepareForHibernate"            , 0x86, ROOT) \
+X("HvCallNotifyPartitionEvent"           , 0x87, ROOT) \
+X("HvCallGetLogicalProcessorRegisters"   , 0x88, ROOT) \
+X("HvCallSetLogicalProcessorRegisters"   , 0x89, ROOT) \
+X("HvCallQueryAssociatedLpsforMca"       , 0x8a, ROOT) \
+X("HvCallNotifyRingEmpty"                , 0x8b, ROOT) \
+X("HvCallInjectSyntheticMachineCheck"    , 0x8c, ROOT) \
+X("HvCallScrubPartition"                 , 0x8d, ROOT) \
+X("HvCallCollectLivedump"                , 0x8e, ROOT) \
+X("HvCallDisableHypervisor"              , 0x8f, ROOT) \
+X("HvCallModifySparseGpaPages"           , 0x90, ROOT) \
+X("HvCallRegisterInterceptResult"        , 0x91, ROOT) \
+X("HvCallUnregisterInterceptResult"      , 0x92, ROOT) \
+X("HvCallAssertVirtualInterrupt"         , 0x94, ANY) \
+X("HvCallCreatePort"                     , 0x95, ROOT) \
+X("HvCallConnectPort"                    , 0x96, ROOT) \
+X("HvCallGetSpaPageList"                 , 0x97, ROOT) \
+X("Reserved"                             , 0x98, UNKNOWN) \
+X("HvCallStartVirtualProcessor"          , 0x99, ANY) \
+X("HvCallGetVpIndexFromApicId"           , 0x9a, ANY) \
+X("Reserved"                             , 0xae, UNKNOWN) \
+X("HvCallFlushGuestPhysicalAddressSpace" , 0xaf, ANY) \
+X("HvCallFlushGuestPhysicalAddressList"  , 0xb0, ANY)
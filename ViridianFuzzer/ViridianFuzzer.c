@@ -27,6 +27,38 @@ UNICODE_STRING  g_usDeviceName = { 0 };
 UNICODE_STRING  g_usDeviceLink = { 0 };
 PDEVICE_OBJECT  g_pDevObj = NULL;
 
+//
+// Per-processor GPA pages, allocated once in DriverEntry
+//
+GPA_POOL        g_gpaPool = { 0 };
+PAGE_FILL_ISA   g_pageFillIsa = PAGE_FILL_ISA_SCALAR;
+
+//
+// Pool pages claimed for one or more cases, with the fill ISA usable while
+// they are held
+//
+typedef struct _CASE_PAGES
+{
+    GPA_PAGE_PAIR   pair;
+    PAGE_FILL_ISA   fillIsa;
+    XSTATE_SAVE     xState;
+} CASE_PAGES, *PCASE_PAGES;
+
+//
+// Registered SQ/CQ ring pair, g_ringBusy serialises register/unregister/doorbell.
+// Only the file object that registered it may ring or unregister it
+//
+PMDL            g_pRingMdl = NULL;
+PFILE_OBJECT    g_pRingOwner = NULL;
+HC_RING         g_sqRing = { 0 };
+HC_RING         g_cqRing = { 0 };
+volatile LONG   g_ringBusy = 0;
+
+NTSTATUS
+RingUnregister (
+    IN PFILE_OBJECT pFileObject
+);
+
 //
 // VIFU unload routine
 //
@@ -37,8 +69,10 @@ DriverUnload (
 {
     UNREFERENCED_PARAMETER( pDriverObject );
     DbgPrint( "Driver unloading\n" );
+    RingUnregister( NULL );
     IoDeleteSymbolicLink( &g_usDeviceLink );
     IoDeleteDevice( g_pDevObj );
+    GpaPoolDestroy( &g_gpaPool );
 }
 
 //
@@ -60,20 +94,458 @@ DispatchNotImplemented (
 }
 
 //
-// Fill a VA with `content` 
+// Fill `length` bytes of a pool page with `content`, using the best pattern
+// kernel usable while the pages are claimed
 //
 VOID 
 FillPage (
-    IN OUT PCHAR    pInBuf,
-    IN INT          bSize,
+    IN PCASE_PAGES  pPages,
+    IN PGPA_PAGE    pPage,
+    IN UINT32       length,
     IN UINT64       content8B 
 )
 {
-    for( int i = 0; i < bSize / 8; i++ )
+    PAGE_FILL_PARAMS params = { 0 };
+
+    PAGE_FILL_INIT( &params, PAGE_FILL_CONSTANT, content8B, 0 );
+    params.length = length;
+    PageFill( pPages->fillIsa, pPage->pVa, &params );
+}
+
+//
+// Replace 0xIDENTIFIERs in each reg with the GPA of a pool page, filling the 
+// page as requested by the identifier. R8 (output parameter GPA) gets the 
+// output page, every other reg the input page
+//
+VOID
+SubstituteGpaRegs (
+    IN OUT PCPU_REG_64  pInReg,
+    IN     PCASE_PAGES  pPages
+)
+{
+    PGPA_PAGE pPage = NULL;
+
+    for( int r = 0; r < (sizeof( CPU_REG_64 ) / sizeof( UINT64 )); r++ )
+    {
+        pPage = (r == FIELD_OFFSET( CPU_REG_64, r8 ) / sizeof( UINT64 )) ? pPages->pair.pOut : pPages->pair.pIn;
+
+        if( ((PUINT64)pInReg)[r] == USE_GPA_MEM_FILL )
+        {
+            //
+            // Fill GPA with ptr to itself
+            //
+            FillPage( pPages, pPage, 0x1000, pPage->pa );
+            //
+            // Set reg to GPA
+            //
+            ((PUINT64)pInReg)[r] = pPage->pa;
+        }
+        else if( ((PUINT64)pInReg)[r] == USE_GPA_MEM_NOFILL_0 )
+        {
+            FillPage( pPages, pPage, 0x1000, 0x00 );
+            ((PUINT64)pInReg)[r] = pPage->pa;
+        }
+        else if( ((PUINT64)pInReg)[r] == USE_GPA_MEM_NOFILL_1 )
+        {
+            FillPage( pPages, pPage, 0x1000, 0x01 );
+            ((PUINT64)pInReg)[r] = pPage->pa;
+        }
+        else if( ((PUINT64)pInReg)[r] == USE_GPA_MEM_BIT_RANGE_LOOP )
+        {
+            //
+            // FIll in GPA with bits set e.g. 0y1 0y10 0y100 0y1000
+            //
+            FillPage( pPages, pPage, 0x1000, pInReg->rax );
+            ((PUINT64)pInReg)[r] = pPage->pa;
+        }
+        else if( ((PUINT64)pInReg)[r] == USE_GPA_MEM_LAYOUT )
+        {
+            INPUT_LAYOUT layout = { 0 };
+
+            //
+            // Input page starts with the header and rep elements, the output 
+            // GPA leaves exactly outputSize bytes before the end of its page
+            //
+            InputLayoutUnpack( pInReg->rbx, &layout );
+            FillPage( pPages, pPage, 0x1000, 0x00 );
+            if( pPage == pPages->pair.pOut )
+            {
+                ((PUINT64)pInReg)[r] = pPage->pa + InputLayoutOutputOffset( &layout );
+            }
+            else
+            {
+                InputLayoutBuild( (PUINT64)pPage->pVa, &layout, (UINT32)((pInReg->rcx >> 32) & 0xfff), pInReg->rax );
+                ((PUINT64)pInReg)[r] = pPage->pa;
+            }
+        }
+        else if( (((PUINT64)pInReg)[r] & ~(UINT64)USE_GPA_MEM_OFFSET_MASK) == USE_GPA_MEM_OFFSET )
+        {
+            FillPage( pPages, pPage, 0x1000, 0x00 );
+            ((PUINT64)pInReg)[r] = pPage->pa + (((PUINT64)pInReg)[r] & USE_GPA_MEM_OFFSET_MASK);
+        }
+    }
+}
+
+//
+// Claim this processor's input/output pages. Pages are recycled as is, 
+// SubstituteGpaRegs rewrites a page before exposing its GPA.
+// AVX2 fills need the YMM state saved, if that fails SSE2 is used instead
+//
+NTSTATUS
+AcquireGpaPages (
+    OUT PCASE_PAGES pPages
+)
+{
+    if( !GpaPoolAcquirePair( &g_gpaPool, KeGetCurrentProcessorNumberEx( NULL ), &pPages->pair ) )
+    {
+        return VIFU_CREATE_ERR( VIFU_ERR_NO_RESOURCES, FACILITY_VIFU );
+    }
+
+    pPages->fillIsa = g_pageFillIsa;
+    if( pPages->fillIsa == PAGE_FILL_ISA_AVX2 &&
+        !NT_SUCCESS( KeSaveExtendedProcessorState( XSTATE_MASK_AVX, &pPages->xState ) ) )
+    {
+        pPages->fillIsa = PAGE_FILL_ISA_SSE2;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+ReleaseGpaPages (
+    IN OUT PCASE_PAGES  pPages
+)
+{
+    if( pPages->fillIsa == PAGE_FILL_ISA_AVX2 )
+    {
+        KeRestoreExtendedProcessorState( &pPages->xState );
+    }
+
+    GpaPoolReleasePair( &pPages->pair );
+}
+
+//
+// Issue one case with its GPAs substituted. A rep call the hypervisor returns 
+// partially complete is issued again from where it stopped, here rather than 
+// in UM, until it completes or fails. The cycles are those inside the vmcall 
+// of every issue, as VIFU_Hypercall times it.
+//
+// pResult may be a CQ entry UM can write to at any time, so the loop runs on 
+// locals and pResult is only written, once at the end
+//
+VOID
+ExecCase (
+    IN OUT PCPU_REG_64              pInReg,
+    OUT    PHYPERCALL_BATCH_RESULT  pResult
+)
+{
+    HYPERCALL_RESULT_VALUE  hvResult = { 0 };
+    HYPERCALL_TSC           tsc = { 0 };
+    CPU_REG_64              regsOut = { 0 };
+    UINT64                  cycles = 0;
+    UINT16                  continuations = 0;
+
+    VIFU_Hypercall( pInReg, &regsOut, &tsc );
+    cycles = tsc.end - tsc.start;
+
+    while( continuations < REP_CONTINUATION_MAX &&
+           RepContinuationNext( &pInReg->rcx, regsOut.rax ) )
+    {
+        VIFU_Hypercall( pInReg, &regsOut, &tsc );
+        cycles += tsc.end - tsc.start;
+        continuations++;
+    }
+
+    //
+    // Full RAX has been stored in the output regs, VIFU_Hypercall's 
+    // return value only holds the status
+    //
+    hvResult.AsUINT64 = regsOut.rax;
+    RtlCopyMemory( &pResult->regsOut, &regsOut, sizeof( CPU_REG_64 ) );
+    pResult->cycles = cycles;
+    pResult->continuations = continuations;
+    pResult->hvStatus = hvResult.result;
+    pResult->repComplete = (UINT16)hvResult.repComplete;
+}
+
+//
+// Run every case of an IOCTL_HYPERCALL_BATCH back to back. The processor's 
+// pool pages are claimed once for the whole batch
+//
+NTSTATUS
+ExecHypercallBatch (
+    IN  PVOID       pInBuf,
+    IN  ULONG       inBufLen,
+    OUT PVOID       pOutBuf,
+    IN  ULONG       outBufLen,
+    OUT PULONG      pBytesRet
+)
+{
+    PHYPERCALL_BATCH_HEADER pHeader = (PHYPERCALL_BATCH_HEADER)pInBuf;
+    PCPU_REG_64             pCases = NULL;
+    PHYPERCALL_BATCH_RESULT pResults = (PHYPERCALL_BATCH_RESULT)pOutBuf;
+    CPU_REG_64              inReg = { 0 };
+    CASE_PAGES              pages = { 0 };
+    BOOLEAN                 bRegisterOnly = FALSE;
+
+    *pBytesRet = 0;
+
+    if( pInBuf == NULL ||
+        inBufLen < sizeof( HYPERCALL_BATCH_HEADER ) ||
+        pHeader->magic != HYPERCALL_BATCH_MAGIC ||
+        pHeader->version != HYPERCALL_BATCH_VERSION ||
+        (pHeader->flags & ~HYPERCALL_BATCH_FLAGS_VALID) != 0 ||
+        pHeader->caseCnt > HYPERCALL_BATCH_MAX_CASES ||
+        inBufLen < HYPERCALL_BATCH_INPUT_SIZE( pHeader->caseCnt ) )
+    {
+        return VIFU_CREATE_ERR( VIFU_ERR_INVALID_BATCH, FACILITY_VIFU );
+    }
+
+    if( pOutBuf == NULL || outBufLen < HYPERCALL_BATCH_OUTPUT_SIZE( pHeader->caseCnt ) )
+    {
+        return VIFU_CREATE_ERR( VIFU_ERR_BUFFER_TOO_SMALL, FACILITY_VIFU );
+    }
+
+    //
+    // Register only batches (extended fast calls) have nothing to substitute
+    //
+    bRegisterOnly = (pHeader->flags & HYPERCALL_BATCH_FLAG_REGISTER_ONLY) != 0;
+    if( !bRegisterOnly && !NT_SUCCESS( AcquireGpaPages( &pages ) ) )
     {
-        *((PUINT64)pInBuf + i) = content8B;
+        return VIFU_CREATE_ERR( VIFU_ERR_NO_RESOURCES, FACILITY_VIFU );
     }
-    
+
+    pCases = (PCPU_REG_64)(pHeader + 1);
+    for( UINT32 c = 0; c < pHeader->caseCnt; c++ )
+    {
+        RtlCopyMemory( &inReg, &pCases[c], sizeof( CPU_REG_64 ) );
+        if( !bRegisterOnly )
+        {
+            SubstituteGpaRegs( &inReg, &pages );
+        }
+
+        RtlZeroMemory( &pResults[c], sizeof( HYPERCALL_BATCH_RESULT ) );
+        ExecCase( &inReg, &pResults[c] );
+    }
+
+    if( !bRegisterOnly )
+    {
+        ReleaseGpaPages( &pages );
+    }
+
+    *pBytesRet = (ULONG)HYPERCALL_BATCH_OUTPUT_SIZE( pHeader->caseCnt );
+    return STATUS_SUCCESS;
+}
+
+//
+// Lock and map the UM SQ/CQ region once, so cases can be exchanged without 
+// any copy through SystemBuffer
+//
+NTSTATUS
+RingRegister (
+    IN PFILE_OBJECT             pFileObject,
+    IN PHYPERCALL_RING_REGISTER pReg
+)
+{
+    NTSTATUS    status = STATUS_SUCCESS;
+    PMDL        pMdl = NULL;
+    PVOID       pBase = NULL;
+
+    if( InterlockedCompareExchange( &g_ringBusy, 1, 0 ) != 0 )
+    {
+        return VIFU_CREATE_ERR( VIFU_ERR_RING_BUSY, FACILITY_VIFU );
+    }
+
+    if( g_pRingMdl != NULL )
+    {
+        status = VIFU_CREATE_ERR( VIFU_ERR_RING_REGISTERED, FACILITY_VIFU );
+        goto RING_REGISTER_END;
+    }
+
+    if( !HC_RING_IS_POW2( pReg->sqEntryCnt ) || pReg->sqEntryCnt > HC_RING_MAX_ENTRIES ||
+        !HC_RING_IS_POW2( pReg->cqEntryCnt ) || pReg->cqEntryCnt > HC_RING_MAX_ENTRIES ||
+        pReg->baseVa == 0 ||
+        pReg->size < HC_RING_PAIR_SIZE( pReg->sqEntryCnt, pReg->cqEntryCnt ) ||
+        pReg->size > HC_RING_PAIR_SIZE( HC_RING_MAX_ENTRIES, HC_RING_MAX_ENTRIES ) )
+    {
+        status = VIFU_CREATE_ERR( VIFU_ERR_INVALID_BATCH, FACILITY_VIFU );
+        goto RING_REGISTER_END;
+    }
+
+    pMdl = IoAllocateMdl( (PVOID)pReg->baseVa, pReg->size, FALSE, FALSE, NULL );
+    if( pMdl == NULL )
+    {
+        status = VIFU_CREATE_ERR( VIFU_ERR_NO_RESOURCES, FACILITY_VIFU );
+        goto RING_REGISTER_END;
+    }
+
+    __try
+    {
+        MmProbeAndLockPages( pMdl, UserMode, IoWriteAccess );
+    }
+    __except( EXCEPTION_EXECUTE_HANDLER )
+    {
+        IoFreeMdl( pMdl );
+        status = GetExceptionCode();
+        goto RING_REGISTER_END;
+    }
+
+    pBase = MmGetSystemAddressForMdlSafe( pMdl, NormalPagePriority | MdlMappingNoExecute );
+    if( pBase == NULL )
+    {
+        MmUnlockPages( pMdl );
+        IoFreeMdl( pMdl );
+        status = VIFU_CREATE_ERR( VIFU_ERR_NO_RESOURCES, FACILITY_VIFU );
+        goto RING_REGISTER_END;
+    }
+
+    //
+    // Driver consumes the SQ and produces the CQ. Geometry comes from the 
+    // register request, never from the shared headers UM can still write to
+    //
+    HcRingAttach( &g_sqRing, HcRingPairSq( pBase ), pReg->sqEntryCnt, sizeof( HC_SQ_ENTRY ), FALSE );
+    HcRingAttach( &g_cqRing, HcRingPairCq( pBase, pReg->sqEntryCnt ), pReg->cqEntryCnt, sizeof( HC_CQ_ENTRY ), TRUE );
+
+    g_pRingMdl = pMdl;
+    g_pRingOwner = pFileObject;
+
+RING_REGISTER_END:
+    InterlockedExchange( &g_ringBusy, 0 );
+    return status;
+}
+
+//
+// Unlock the UM region, waits for any doorbell in progress to finish. 
+// pFileObject must be the owner, NULL on unload
+//
+NTSTATUS
+RingUnregister (
+    IN PFILE_OBJECT pFileObject
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    while( InterlockedCompareExchange( &g_ringBusy, 1, 0 ) != 0 )
+    {
+        YieldProcessor();
+    }
+
+    if( pFileObject != NULL && g_pRingOwner != pFileObject )
+    {
+        status = VIFU_CREATE_ERR( VIFU_ERR_RING_NOT_OWNER, FACILITY_VIFU );
+    }
+    else if( g_pRingMdl != NULL )
+    {
+        MmUnlockPages( g_pRingMdl );
+        IoFreeMdl( g_pRingMdl );
+
+        g_pRingMdl = NULL;
+        g_pRingOwner = NULL;
+        RtlZeroMemory( &g_sqRing, sizeof( HC_RING ) );
+        RtlZeroMemory( &g_cqRing, sizeof( HC_RING ) );
+    }
+
+    InterlockedExchange( &g_ringBusy, 0 );
+    return status;
+}
+
+//
+// HC_RING_EXEC_CASE for the doorbell, same per case work as a batch. pContext
+// is the CASE_PAGES claimed by RingDoorbell, NULL for register only cases
+//
+VOID
+RingExecCase (
+    IN OUT PCPU_REG_64              pInReg,
+    OUT    PHYPERCALL_BATCH_RESULT  pResult,
+    IN     PVOID                    pContext
+)
+{
+    if( pContext != NULL )
+    {
+        SubstituteGpaRegs( pInReg, (PCASE_PAGES)pContext );
+    }
+    ExecCase( pInReg, pResult );
+}
+
+//
+// Drain the SQ into the CQ. Stops early if the CQ is full, UM reaps and rings 
+// again. flags are the HYPERCALL_BATCH_FLAG_* of the cases in the SQ, 
+// pFileObject must be the ring's owner
+//
+NTSTATUS
+RingDoorbell (
+    IN  PFILE_OBJECT    pFileObject,
+    IN  UINT32          flags,
+    OUT PULONG          pDrained
+)
+{
+    NTSTATUS        status = STATUS_SUCCESS;
+    CASE_PAGES      pages = { 0 };
+
+    *pDrained = 0;
+
+    if( (flags & ~HYPERCALL_BATCH_FLAGS_VALID) != 0 )
+    {
+        return VIFU_CREATE_ERR( VIFU_ERR_INVALID_BATCH, FACILITY_VIFU );
+    }
+
+    if( InterlockedCompareExchange( &g_ringBusy, 1, 0 ) != 0 )
+    {
+        return VIFU_CREATE_ERR( VIFU_ERR_RING_BUSY, FACILITY_VIFU );
+    }
+
+    if( g_pRingMdl == NULL )
+    {
+        status = VIFU_CREATE_ERR( VIFU_ERR_RING_NOT_REGISTERED, FACILITY_VIFU );
+    }
+    else if( g_pRingOwner != pFileObject )
+    {
+        status = VIFU_CREATE_ERR( VIFU_ERR_RING_NOT_OWNER, FACILITY_VIFU );
+    }
+    else if( flags & HYPERCALL_BATCH_FLAG_REGISTER_ONLY )
+    {
+        //
+        // Nothing to substitute, as for a register only batch
+        //
+        *pDrained = HcRingDrain( &g_sqRing, &g_cqRing, MAXULONG, RingExecCase, NULL );
+    }
+    else
+    {
+        status = AcquireGpaPages( &pages );
+        if( NT_SUCCESS( status ) )
+        {
+            *pDrained = HcRingDrain( &g_sqRing, &g_cqRing, MAXULONG, RingExecCase, &pages );
+            ReleaseGpaPages( &pages );
+        }
+    }
+
+    InterlockedExchange( &g_ringBusy, 0 );
+    return status;
+}
+
+//
+// IRP_MJ_CLEANUP - release the ring if the handle that registered it closes
+//
+NTSTATUS
+DispatchCleanup (
+    IN PDEVICE_OBJECT   DeviceObject,
+    IN PIRP             Irp
+)
+{
+    UNREFERENCED_PARAMETER( DeviceObject );
+
+    //
+    // Does nothing unless the handle closing registered the ring
+    //
+    if( g_pRingOwner != NULL )
+    {
+        RingUnregister( IoGetCurrentIrpStackLocation( Irp )->FileObject );
+    }
+
+    Irp->IoStatus.Information = 0;
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    IoCompleteRequest( Irp, IO_NO_INCREMENT );
+    return STATUS_SUCCESS;
 }
 
 //
@@ -226,60 +698,25 @@ DispatchIoctl (
             HYPERCALL_RESULT_VALUE hvResult = { 0 };
             CPU_REG_64 inReg = { 0 };
             CPU_REG_64 outReg = { 0 };
+            CASE_PAGES pages = { 0 };
+            HYPERCALL_TSC tsc = { 0 };
             RtlCopyMemory( &inReg, 
                            Irp->AssociatedIrp.SystemBuffer, 
                            sizeof( CPU_REG_64 ) );
 
-            //ULONG outBufLen = pIsl->Parameters.DeviceIoControl.OutputBufferLength;
-            //PCHAR pOutBuf = ExAllocatePoolWithTag(NonPagedPool, 0x1000, 'VIFU');
-
-            PCHAR pInBuf = ExAllocatePoolWithTag( NonPagedPool, 0x1000, 'VIFU' );
-            //memset( pInBuf, 0x00, 0x1000 );
-            RtlZeroMemory( pInBuf, 0x1000 );
-            volatile PHYSICAL_ADDRESS realAddr = MmGetPhysicalAddress( pInBuf );
+            status = AcquireGpaPages( &pages );
+            if( !NT_SUCCESS( status ) )
+            {
+                break;
+            }
 
             //
             // Replace 0xIDENTIFIERs in each regs with GPA if required
             //
-            for( int r = 0; r < (sizeof( CPU_REG_64 ) / sizeof( UINT64 )); r++ )
-            {
-                if( ((PUINT64)&inReg)[r] == USE_GPA_MEM_FILL )
-                {
-                    realAddr = MmGetPhysicalAddress( pInBuf );
-                    //
-                    // Fill GPA with ptr to itself
-                    //
-                    FillPage( pInBuf, 0x1000, realAddr.QuadPart );
-                    //
-                    // Set reg to GPA
-                    //
-                    ((PUINT64)&inReg)[r] = realAddr.QuadPart;
-                }
-                else if( ((PUINT64)&inReg)[r] == USE_GPA_MEM_NOFILL_0 )
-                {
-                    realAddr = MmGetPhysicalAddress( pInBuf );
-                    FillPage( pInBuf, 0x1000, 0x00 );
-                    ((PUINT64)&inReg)[r] = realAddr.QuadPart;
-                }
-                else if( ((PUINT64)&inReg)[r] == USE_GPA_MEM_NOFILL_1 )
-                {
-                    realAddr = MmGetPhysicalAddress( pInBuf );
-                    FillPage( pInBuf, 0x1000, 0x01 );
-                    ((PUINT64)&inReg)[r] = realAddr.QuadPart;
-                }
-                else if( ((PUINT64)&inReg)[r] == USE_GPA_MEM_BIT_RANGE_LOOP )
-                {
-                    //
-                    // FIll in GPA with bits set e.g. 0y1 0y10 0y100 0y1000
-                    //
-                    realAddr = MmGetPhysicalAddress( pInBuf );
-                    FillPage( pInBuf, 0x1000, inReg.rax );
-                    ((PUINT64)&inReg)[r] = realAddr.QuadPart;
-                }
-            }
+            SubstituteGpaRegs( &inReg, &pages );
 
             //DbgBreakPoint();
-            hvResult.result = VIFU_Hypercall( &inReg, &outReg );
+            hvResult.result = VIFU_Hypercall( &inReg, &outReg, &tsc );
 
             if( hvResult.result == HV_STATUS_SUCCESS )
             {
@@ -293,8 +730,60 @@ DispatchIoctl (
                 status = VIFU_CREATE_ERR( hvResult.result, FACILITY_HYPERV );
             }
 
-            ExFreePoolWithTag( pInBuf, 'VIFU' );
-            //ExFreePoolWithTag( pOutBuf, 'VIFU' );
+            ReleaseGpaPages( &pages );
+            break;
+        }
+        case IOCTL_HYPERCALL_BATCH:
+        {
+            PVOID pOutBuf = NULL;
+
+            if( Irp->MdlAddress != NULL )
+            {
+                pOutBuf = MmGetSystemAddressForMdlSafe( Irp->MdlAddress, NormalPagePriority );
+            }
+
+            status = ExecHypercallBatch( Irp->AssociatedIrp.SystemBuffer,
+                                         pIsl->Parameters.DeviceIoControl.InputBufferLength,
+                                         pOutBuf,
+                                         pIsl->Parameters.DeviceIoControl.OutputBufferLength,
+                                         &bytesRet );
+            break;
+        }
+
+        case IOCTL_HYPERCALL_RING_REGISTER:
+            if( pIsl->Parameters.DeviceIoControl.InputBufferLength < sizeof( HYPERCALL_RING_REGISTER ) )
+            {
+                status = VIFU_CREATE_ERR( VIFU_ERR_BUFFER_TOO_SMALL, FACILITY_VIFU );
+                break;
+            }
+            status = RingRegister( pIsl->FileObject, 
+                                   (PHYPERCALL_RING_REGISTER)Irp->AssociatedIrp.SystemBuffer );
+            break;
+
+        case IOCTL_HYPERCALL_RING_UNREGISTER:
+            status = RingUnregister( pIsl->FileObject );
+            break;
+
+        case IOCTL_HYPERCALL_RING_DOORBELL:
+        {
+            ULONG drained = 0;
+            UINT32 flags = 0;
+
+            //
+            // The input is optional, the output overwrites it in SystemBuffer
+            //
+            if( pIsl->Parameters.DeviceIoControl.InputBufferLength >= sizeof( HYPERCALL_RING_DOORBELL ) )
+            {
+                flags = ((PHYPERCALL_RING_DOORBELL)Irp->AssociatedIrp.SystemBuffer)->flags;
+            }
+
+            status = RingDoorbell( pIsl->FileObject, flags, &drained );
+            if( NT_SUCCESS( status ) && 
+                pIsl->Parameters.DeviceIoControl.OutputBufferLength >= sizeof( ULONG ) )
+            {
+                *(PULONG)(Irp->AssociatedIrp.SystemBuffer) = drained;
+                bytesRet = sizeof( ULONG );
+            }
             break;
         }
 
@@ -322,6 +811,13 @@ DriverEntry (
     UNREFERENCED_PARAMETER(RegistryPath);
 
     DbgPrint("ViFu entry called\n");
+
+    if (!GpaPoolInit(&g_gpaPool, KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS), GPA_POOL_PAGES_PER_CPU))
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    g_pageFillIsa = PageFillBestIsa();
+
     RtlInitUnicodeString(&g_usDeviceName, g_wzDeviceName);
 
     status = IoCreateDevice(DriverObject, 0, &g_usDeviceName, DEVICE_VIRIDIAN, 0, TRUE, &g_pDevObj);
@@ -335,8 +831,14 @@ DriverEntry (
             DriverObject->MajorFunction[i] = DispatchNotImplemented;
         }
         DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = DispatchIoctl;
+        DriverObject->MajorFunction[IRP_MJ_CLEANUP] = DispatchCleanup;
         DriverObject->DriverUnload = DriverUnload;
     }
 
+    if (!NT_SUCCESS(status))
+    {
+        GpaPoolDestroy(&g_gpaPool);
+    }
+
     return status;
 }
@@ -5,6 +5,11 @@
 // #include <wdm.h>
 #include <ntddk.h>
 #include "ViridianFuzzerTypes.h"
+#include "../ViFuCore/HcRing.h"
+#include "../ViFuCore/GpaPool.h"
+#include "../ViFuCore/PageFill.h"
+#include "../ViFuCore/InputLayout.h"
+#include "../ViFuCore/RepContinuation.h"
 
 //
 // X64 ASM proc because there is no intrinsics for VMCALL
@@ -17,7 +22,8 @@ HV_STATUS
 __fastcall
 VIFU_Hypercall
 (
-    IN  PCPU_REG_64 regsIn,
-    OUT PCPU_REG_64 regsOut
+    IN  PCPU_REG_64     regsIn,
+    OUT PCPU_REG_64     regsOut,
+    OUT PHYPERCALL_TSC  pTsc
 );
 #pragma optimize("", on)
@@ -1,6 +1,9 @@
 #pragma once
 
+#include "../ViFuCore/ViFuPlatform.h"
+#ifdef _MSC_VER
 #include <intrin.h>
+#endif
 #include <assert.h>
 #include "HvStatusCodes.h"
 #include "Msrs.h"
@@ -16,6 +19,20 @@
 #define IOCTL_MSR_READ              CTL_CODE(DEVICE_VIRIDIAN, 0x804, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
 #define IOCTL_HYPERCALL             CTL_CODE(DEVICE_VIRIDIAN, 0x805, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
 
+//
+// Output buffer is locked and mapped by the IO manager (METHOD_OUT_DIRECT), so 
+// result records are written straight into the UM buffer with no copy back
+//
+#define IOCTL_HYPERCALL_BATCH       CTL_CODE(DEVICE_VIRIDIAN, 0x807, METHOD_OUT_DIRECT, FILE_READ_DATA | FILE_WRITE_DATA)
+
+//
+// Shared SQ/CQ ring pair (see ViFuCore/HcRing.h). Register maps the UM region 
+// once, doorbell drains the SQ and returns the number of cases executed
+//
+#define IOCTL_HYPERCALL_RING_REGISTER   CTL_CODE(DEVICE_VIRIDIAN, 0x808, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+#define IOCTL_HYPERCALL_RING_UNREGISTER CTL_CODE(DEVICE_VIRIDIAN, 0x809, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+#define IOCTL_HYPERCALL_RING_DOORBELL   CTL_CODE(DEVICE_VIRIDIAN, 0x80A, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
 #define DRIVER_WIN_OBJ              L"\\\\.\\ViridianFuzzer"
 
 //
@@ -30,6 +47,21 @@
 #define USE_GPA_MEM_NOFILL_1        0x1100000001
 #define USE_GPA_MEM_BIT_RANGE_LOOP  0x1100000002
 
+//
+// Lay out the call's input header and rep elements with one field set, and
+// size the output page to the call (ViFuCore/InputLayout.h). Layout is in RBX,
+// the field value in RAX
+//
+#define USE_GPA_MEM_LAYOUT          0x1100000003
+
+//
+// Zero filled page, reg set to its GPA plus a byte offset (0 - 0xfff), for
+// misaligned GPAs and parameters that run off the end of the page
+//
+#define USE_GPA_MEM_OFFSET          0x1100100000
+#define USE_GPA_MEM_OFFSET_MASK     0xfff
+#define USE_GPA_MEM_OFFSET_GPA(off) (USE_GPA_MEM_OFFSET | ((off) & USE_GPA_MEM_OFFSET_MASK))
+
 typedef struct _CPU_REG_32
 {
     UINT32 eax;
@@ -70,8 +102,10 @@ typedef struct _CPU_REG_64
     VFUINT128 xmm5;
 } CPU_REG_64, *PCPU_REG_64;
 
+#ifdef _MSC_VER
 #pragma warning(disable:4214)
 #pragma warning(disable:4201)
+#endif
 #pragma pack(push)
 #pragma pack(push, 1)
 //
@@ -116,8 +150,18 @@ typedef volatile union
 C_ASSERT(sizeof(HYPERCALL_RESULT_VALUE) == 8);
 
 #pragma pack(pop)
+#ifdef _MSC_VER
 #pragma warning(default:4201) 
 #pragma warning(disable:4214)
+#endif
+
+//
+// Bitfield layout above is MSVC specific (other compilers pack the UINT16 
+// fields across storage units differently), so anything that has to agree 
+// on the raw value outside of MSVC uses these instead
+//
+#define HV_RESULT_STATUS(v)         ((UINT16)((v) & 0xFFFF))
+#define HV_RESULT_REP_COMPLETE(v)   ((UINT16)(((v) >> 32) & 0xFFF))
 
 //
 // Virdian Fuzzer errors (are just custom NTSTATUS errs)
@@ -144,6 +188,99 @@ C_ASSERT(sizeof(HYPERCALL_RESULT_VALUE) == 8);
 #define VIFU_ERR_FACILITY(err)  (err >> 16 & 0x1FFF)
 #define VIFU_ERR_CODE(err)      (err & 0xFFFF)
 
+//
+// FACILITY_VIFU error codes
+//
+#define VIFU_ERR_INVALID_BATCH          0x0001
+#define VIFU_ERR_BUFFER_TOO_SMALL       0x0002
+#define VIFU_ERR_NO_RESOURCES           0x0003
+#define VIFU_ERR_RING_REGISTERED        0x0004
+#define VIFU_ERR_RING_NOT_REGISTERED    0x0005
+#define VIFU_ERR_RING_BUSY              0x0006
+#define VIFU_ERR_RING_NOT_OWNER         0x0007
+
+//
+// Format for IOCTL_HYPERCALL_BATCH
+//
+// Input:  HYPERCALL_BATCH_HEADER followed by caseCnt CPU_REG_64 (GPA markers 
+//         such as USE_GPA_MEM_FILL are substituted per case, as IOCTL_HYPERCALL)
+// Output: caseCnt HYPERCALL_BATCH_RESULT, bytes returned covers the executed ones
+//
+#define HYPERCALL_BATCH_MAGIC       0x48435642  // "BVCH"
+#define HYPERCALL_BATCH_VERSION     2
+#define HYPERCALL_BATCH_MAX_CASES   4096
+
+//
+// HYPERCALL_BATCH_HEADER flags. REGISTER_ONLY: no case uses a GPA marker, 
+// the driver neither claims pool pages nor substitutes for the batch
+//
+#define HYPERCALL_BATCH_FLAG_REGISTER_ONLY  0x0001
+#define HYPERCALL_BATCH_FLAGS_VALID         HYPERCALL_BATCH_FLAG_REGISTER_ONLY
+
+typedef struct _HYPERCALL_BATCH_HEADER
+{
+    UINT32 magic;
+    UINT16 version;
+    UINT16 flags;
+    UINT32 caseCnt;
+    UINT32 rsvd;
+} HYPERCALL_BATCH_HEADER, *PHYPERCALL_BATCH_HEADER;
+C_ASSERT(sizeof(HYPERCALL_BATCH_HEADER) == 16);
+
+//
+// TSC just before and just after the vmcall of one hypercall issue. Both
+// reads are fenced, so no instruction around them is counted
+//
+typedef struct _HYPERCALL_TSC
+{
+    UINT64 start;
+    UINT64 end;
+} HYPERCALL_TSC, *PHYPERCALL_TSC;
+
+//
+// continuations counts the re-issues of a rep call the hypervisor returned
+// partially complete, cycles the TSC cycles inside the vmcall of every
+// issue of the case (HYPERCALL_TSC end - start, summed)
+//
+typedef struct _HYPERCALL_BATCH_RESULT
+{
+    UINT16      hvStatus;
+    UINT16      repComplete;
+    UINT16      continuations;
+    UINT16      rsvd;
+    UINT64      cycles;
+    CPU_REG_64  regsOut;
+} HYPERCALL_BATCH_RESULT, *PHYPERCALL_BATCH_RESULT;
+C_ASSERT(sizeof(HYPERCALL_BATCH_RESULT) == 16 + sizeof(CPU_REG_64));
+
+#define HYPERCALL_BATCH_INPUT_SIZE(cnt)     \
+    (sizeof(HYPERCALL_BATCH_HEADER) + (SIZE_T)(cnt) * sizeof(CPU_REG_64))
+#define HYPERCALL_BATCH_OUTPUT_SIZE(cnt)    \
+    ((SIZE_T)(cnt) * sizeof(HYPERCALL_BATCH_RESULT))
+
+//
+// Input for IOCTL_HYPERCALL_RING_REGISTER. The region at baseVa is laid out 
+// as HC_RING_PAIR_SIZE(sqEntryCnt, cqEntryCnt) describes
+//
+typedef struct _HYPERCALL_RING_REGISTER
+{
+    UINT64 baseVa;
+    UINT32 size;
+    UINT32 sqEntryCnt;
+    UINT32 cqEntryCnt;
+    UINT32 rsvd;
+} HYPERCALL_RING_REGISTER, *PHYPERCALL_RING_REGISTER;
+
+//
+// Input for IOCTL_HYPERCALL_RING_DOORBELL, optional. flags are the
+// HYPERCALL_BATCH_FLAG_* of the cases in the SQ, as for a batch
+//
+typedef struct _HYPERCALL_RING_DOORBELL
+{
+    UINT32 flags;
+    UINT32 rsvd;
+} HYPERCALL_RING_DOORBELL, *PHYPERCALL_RING_DOORBELL;
+
 //
 // Format for passing data into driver for Hypercall IOCTL
 //
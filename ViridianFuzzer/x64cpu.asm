@@ -2,78 +2,110 @@
 ; Description: ...
 ;
 
-.CODE 
+.CODE
 
 PUBLIC VIFU_Hypercall
 
-; 
+;
 ; Hypercall wrapper
 ;
 ; Inputs:
 ; RCX = Input PCPU_REG_64
 ; RDX = Output PCPU_REG_64
+; R8  = Output PHYPERCALL_TSC
 ;
 ; Outputs:
 ; RAX = HV_STATUS from vmcall
 ;
+; Fast calls (control word bit 16) take their input from RDX, R8 and all
+; 128 bits of XMM0-XMM5 and return output in them, so the XMM registers are
+; moved whole both ways. Slow calls leave the output XMM fields untouched
+;
+; The TSC is read right before the vmcall, once every input register is
+; loaded, and right after it, before any output is stored. lfence keeps
+; the rdtsc from running ahead of the loads and rdtscp waits for the vmcall
+; to retire, the lfence after it keeps the stores from starting early.
+; R12 - R15 hold the start TSC and the vmcall's RAX, RCX and RDX while the
+; end TSC is read
+;
 VIFU_Hypercall PROC
 
+    push rbx
     push rsi
     push rdi
+    push r12
+    push r13
+    push r14
+    push r15
+    push r8                                 ; Store output PHYPERCALL_TSC
     push rdx                                ; Store output PCPU_REG_64
+    push rcx                                ; Store input PCPU_REG_64
 
     mov rsi, rcx
 
     ;
-    ; Hypercall inputs
-    ; RCX = Hypercall input value
-    ; RDX = Input param GPA
-    ; R8  = Output param GPA 
+    ; Extended fast hypercall (set it regardless)
     ;
-    mov rcx, qword ptr [rsi+10h]
-    mov rdx, qword ptr [rsi+18h]
-    mov r8,  qword ptr [rsi+30h]
+    bt  qword ptr [rsi+10h], 16
+    jnc LOAD_GPRS
 
-    ;
-    ; Fastcall check
-    ;
-    mov     rax, rcx
-    and     ax,  1  
-    movzx   eax, ax  
-    cmp     eax, 1 
-    jz EXT_HYPERCALL_XMM_SETUP
+    movdqu xmm0, xmmword ptr [rsi+50h]
+    movdqu xmm1, xmmword ptr [rsi+60h]
+    movdqu xmm2, xmmword ptr [rsi+70h]
+    movdqu xmm3, xmmword ptr [rsi+80h]
+    movdqu xmm4, xmmword ptr [rsi+90h]
+    movdqu xmm5, xmmword ptr [rsi+0a0h]
 
-    mov rax, qword ptr [rsi+00h]
+    LOAD_GPRS:
     mov rbx, qword ptr [rsi+08h]
     mov rdi, qword ptr [rsi+28h]
+    mov r8,  qword ptr [rsi+30h]
     mov r9,  qword ptr [rsi+38h]
     mov r10, qword ptr [rsi+40h]
     mov r11, qword ptr [rsi+48h]
-    jmp MAKE_VMCALL
+
+    lfence
+    rdtsc
+    shl rdx, 32
+    or  rax, rdx
+    mov r12, rax                            ; R12 = start TSC
 
     ;
-    ; Extended fast hypercall (set it regardless)
+    ; Hypercall inputs
+    ; RCX = Hypercall input value
+    ; RDX = Input param GPA
+    ; R8  = Output param GPA
     ;
-    EXT_HYPERCALL_XMM_SETUP:
-    movq xmm0, qword ptr [rsi+50h]
-    movq xmm1, qword ptr [rsi+60h]
-    movq xmm2, qword ptr [rsi+70h]
-    movq xmm3, qword ptr [rsi+80h]
-    movq xmm4, qword ptr [rsi+90h]
-    movq xmm5, qword ptr [rsi+0a0h]
+    mov rax, qword ptr [rsi+00h]
+    mov rcx, qword ptr [rsi+10h]
+    mov rdx, qword ptr [rsi+18h]
+    lfence
 
     MAKE_VMCALL:
     ;int 3
     vmcall
 
+    mov r13, rax
+    mov r14, rcx
+    mov r15, rdx
+    rdtscp
+    lfence
+    shl rdx, 32
+    or  rax, rdx
+
+    mov rsi, qword ptr [rsp+10h]            ; RSI now contains output PHYPERCALL_TSC
+    mov qword ptr [rsi+00h], r12
+    mov qword ptr [rsi+08h], rax
+
     ;
     ; Move any output data to PCPU_REG_64
     ;
-    pop rsi                                 ; RSI now contains output PCPU_REG_64
+    mov rsi, qword ptr [rsp+08h]            ; RSI now contains output PCPU_REG_64
+    mov rax, r13
     mov qword ptr [rsi+00h], rax
     mov qword ptr [rsi+08h], rbx
-    mov qword ptr [rsi+10h], rcx
-    mov qword ptr [rsi+18h], rdx
+    mov qword ptr [rsi+10h], r14
+    mov qword ptr [rsi+18h], r15
     mov qword ptr [rsi+28h], rdi
     mov qword ptr [rsi+30h], r8
     mov qword ptr [rsi+38h], r9
@@ -81,8 +113,31 @@ VIFU_Hypercall PROC
     mov qword ptr [rsi+48h], r11
     ;mov qword ptr [rsi+20h], rsi
 
+    ;
+    ; Fast call output registers, checked on the input control word as the
+    ; hypervisor may have changed RCX
+    ;
+    pop rdx                                 ; RDX now contains input PCPU_REG_64
+    pop rcx
+    pop r8
+    bt  qword ptr [rdx+10h], 16
+    jnc HYPERCALL_DONE
+
+    movdqu xmmword ptr [rsi+50h], xmm0
+    movdqu xmmword ptr [rsi+60h], xmm1
+    movdqu xmmword ptr [rsi+70h], xmm2
+    movdqu xmmword ptr [rsi+80h], xmm3
+    movdqu xmmword ptr [rsi+90h], xmm4
+    movdqu xmmword ptr [rsi+0a0h], xmm5
+
+    HYPERCALL_DONE:
+    pop r15
+    pop r14
+    pop r13
+    pop r12
     pop rdi
     pop rsi
+    pop rbx
     ;
     ; RAX from vmcall is return code for our subroutine too
     ;